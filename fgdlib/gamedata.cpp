@@ -235,6 +235,9 @@ bool GDGetTokenDynamic(TokenReader &tr, char **ppszStore, trtoken_t ttexpecting,
 }
 
 
+int GameData::s_nGeneration = 0;
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Constructor.
 //-----------------------------------------------------------------------------
@@ -268,6 +271,9 @@ void GameData::ClearData(void)
 		delete pm;
 	}
 	m_Classes.RemoveAll();
+	m_ClassIndex.RemoveAll();
+
+	s_nGeneration++;
 }
 
 
@@ -366,12 +372,18 @@ BOOL GameData::Load(const char *pszFilename)
 				GDclass *pExistingClass = ClassForName(pNewClass->GetName(), &nExistingClassIndex);
 				if (NULL != pExistingClass)
 				{
-					m_Classes.InsertAfter(nExistingClassIndex, pNewClass);
-					m_Classes.Remove(nExistingClassIndex);
+					m_Classes.Element(nExistingClassIndex) = pNewClass;
+
+					// Re-key with the new class's copy of the name; classes that inherit from the
+					// old definition now resolve their variables through this one.
+					m_ClassIndex.Remove(pExistingClass->GetName());
+					m_ClassIndex.Insert(pNewClass->GetName(), nExistingClassIndex);
+					s_nGeneration++;
 				}
 				else
 				{
-					m_Classes.AddToTail(pNewClass);
+					int nIndex = m_Classes.AddToTail(pNewClass);
+					m_ClassIndex.Insert(pNewClass->GetName(), nIndex);
 				}
 			}
 		}
@@ -439,10 +451,39 @@ BOOL GameData::Load(const char *pszFilename)
 
 	tr.Close();
 
+	BuildVariableIndexes();
+
 	return TRUE;
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Builds every class's variable index up front, so that looking up
+//			variables after loading doesn't modify the classes.
+//-----------------------------------------------------------------------------
+void GameData::BuildVariableIndexes(void)
+{
+	int nCount = m_Classes.Count();
+	for (int i = 0; i < nCount; i++)
+	{
+		m_Classes.Element(i)->BuildVariableIndex();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the variable indexes that are out of date.
+//-----------------------------------------------------------------------------
+void GameData::PrepareVariableIndexes(void)
+{
+	int nCount = m_Classes.Count();
+	for (int i = 0; i < nCount; i++)
+	{
+		m_Classes.Element(i)->PrepareVariableIndex();
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Parses the "mapsize" specifier, which should be of the form:
 //
@@ -501,19 +542,16 @@ bool GameData::ParseMapSize(TokenReader &tr)
 //-----------------------------------------------------------------------------
 GDclass *GameData::ClassForName(const char *pszName, int *piIndex)
 {
-	int nCount = m_Classes.Count();
-	for (int i = 0; i < nCount; i++)
+	UtlHashHandle_t h = m_ClassIndex.Find(pszName);
+	if (h == m_ClassIndex.InvalidHandle())
 	{
-		GDclass *mp = m_Classes.Element(i);
-		if(!strcmp(mp->GetName(), pszName))
-		{
-			if(piIndex)
-				piIndex[0] = i;
-			return mp;
-		}
+		return NULL;
 	}
 
-	return NULL;
+	int i = m_ClassIndex.Element(h);
+	if(piIndex)
+		piIndex[0] = i;
+	return m_Classes.Element(i);
 }
 
 
@@ -40,6 +40,8 @@ GDclass::GDclass(void)
 
 	m_pszDescription = NULL;
 
+	m_nVariableIndexGeneration = -1;
+
 	for (int i = 0; i < 3; i++)
 	{
 		m_bmins[i] = -8;
@@ -225,6 +227,12 @@ BOOL GDclass::AddVariable(GDinputvariable *pVar, GDclass *pBase, int iBaseIndex,
 			bReturn = true;
 		}
 
+		//
+		// The index is keyed by the old variable's name, which may be about to be deleted.
+		//
+		m_VariableIndex.Remove(pThisVar->GetName());
+		m_VariableIndex.Insert(pAddVar->GetName(), iThisIndex);
+
 		if (m_VariableMap[iThisIndex][0] == -1)
 		{
 			//
@@ -291,6 +299,7 @@ BOOL GDclass::AddVariable(GDinputvariable *pVar, GDclass *pBase, int iBaseIndex,
 	//
 	m_VariableMap[m_nVariables][0] = iBaseIndex;
 	m_VariableMap[m_nVariables][1] = iVarIndex;
+	m_VariableIndex.Insert(pVar->GetName(), m_nVariables);
 	++m_nVariables;
 
 	//
@@ -1006,18 +1015,52 @@ GDinputvariable *GDclass::GetVariableAt(int iIndex)
 //-----------------------------------------------------------------------------
 GDinputvariable *GDclass::VarForName(const char *pszName, int *piIndex)
 {
-	for(int i = 0; i < GetVariableCount(); i++)
+	PrepareVariableIndex();
+
+	UtlHashHandle_t h = m_VariableIndex.Find(pszName);
+	if (h == m_VariableIndex.InvalidHandle())
+	{
+		return NULL;
+	}
+
+	int i = m_VariableIndex.Element(h);
+	if(piIndex)
+		piIndex[0] = i;
+	return GetVariableAt(i);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the variable name index from the variable map. The first
+//			variable with a given name wins, same as searching the map in order.
+//-----------------------------------------------------------------------------
+void GDclass::BuildVariableIndex(void)
+{
+	m_VariableIndex.RemoveAll();
+
+	for (int i = 0; i < m_nVariables; i++)
 	{
 		GDinputvariable *pVar = GetVariableAt(i);
-		if(!strcmpi(pVar->GetName(), pszName))
+		if (pVar != NULL)
 		{
-			if(piIndex)
-				piIndex[0] = i;
-			return pVar;
+			m_VariableIndex.Insert(pVar->GetName(), i);
 		}
 	}
 
-	return NULL;
+	m_nVariableIndexGeneration = GameData::GetGeneration();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the variable name index if classes have been deleted or
+//			overridden since it was built.
+//-----------------------------------------------------------------------------
+void GDclass::PrepareVariableIndex(void)
+{
+	if (m_nVariableIndexGeneration != GameData::GetGeneration())
+	{
+		BuildVariableIndex();
+	}
 }
 
 void GDclass::GetHelperForGDVar( GDinputvariable *pVar, CUtlVector<const char *> *pszHelperName )
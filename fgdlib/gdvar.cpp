@@ -594,11 +594,11 @@ void GDinputvariable::FromKeyValue(MDkeyvalue *pkv)
 
 	if (eStoreAs == STRING)
 	{
-		V_strcpy_safe(m_szValue, pkv->szValue);
+		V_strcpy_safe(m_szValue, pkv->Value());
 	}
 	else if (eStoreAs == INTEGER)
 	{
-		m_nValue = atoi(pkv->szValue);
+		m_nValue = atoi(pkv->Value());
 	}
 }
 
@@ -714,17 +714,19 @@ void GDinputvariable::ResetDefaults(void)
 //-----------------------------------------------------------------------------
 void GDinputvariable::ToKeyValue(MDkeyvalue *pkv)
 {
-	strcpy(pkv->szKey, m_szName);
+	pkv->SetKey(m_szName);
 
 	trtoken_t eStoreAs = GetStoreAsFromType(m_eType);
 
 	if (eStoreAs == STRING)
 	{
-		strcpy(pkv->szValue, m_szValue);
+		pkv->SetValue(m_szValue);
 	}
 	else if (eStoreAs == INTEGER)
 	{
-		itoa(m_nValue, pkv->szValue, 10);
+		char szValue[16];
+		itoa(m_nValue, szValue, 10);
+		pkv->SetValue(szValue);
 	}
 }
 
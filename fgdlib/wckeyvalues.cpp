@@ -5,16 +5,180 @@
 //=============================================================================
 
 #include "fgdlib/wckeyvalues.h"
+#include "tier0/threadtools.h"
+#include "tier1/generichash.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
 
 
+//
+// Interned key names. s_KeyNames hands out a symbol per spelling. Each name also
+// gets a lookup symbol per name ignoring case, in order of first use, which is
+// found through s_KeyLookupHash, an open addressed hash on the case-folded name.
+//
+// Interning takes s_KeyTableMutex, looking up doesn't. The tables only grow, and
+// names are published in their blocks before the hash slot or block pointer that
+// refers to them, so a reader sees either a complete entry or none at all.
+//
+#define KEY_NAME_BLOCK_SIZE		1024
+#define MAX_KEY_NAME_BLOCKS		( ( UTL_INVAL_SYMBOL + KEY_NAME_BLOCK_SIZE - 1 ) / KEY_NAME_BLOCK_SIZE )
+#define KEY_LOOKUP_HASH_SIZE	( 1 << 17 )		// More than twice the number of symbols there can be, so it never fills up.
+
+static CThreadFastMutex s_KeyTableMutex;
+static CUtlSymbolTable s_KeyNames( 0, 256, false );
+static const char ** volatile s_ppKeyNameBlocks[MAX_KEY_NAME_BLOCKS];		// Spelling of each key symbol.
+static const char ** volatile s_ppLookupNameBlocks[MAX_KEY_NAME_BLOCKS];	// First spelling seen of each lookup symbol.
+static volatile uint32 s_KeyLookupHash[KEY_LOOKUP_HASH_SIZE];				// Top 16 bits of the hash and lookup symbol + 1, 0 if empty.
+static int s_nLookupSymbols = 0;
+static int s_nKeyTableBytes = 0;
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Stores the name for a symbol in a block table that readers index
+//			without locking. Must be called with s_KeyTableMutex held.
+//-----------------------------------------------------------------------------
+static void PublishKeyName(const char ** volatile *ppBlocks, UtlSymId_t id, const char *pszName)
+{
+	const char **ppBlock = ppBlocks[id / KEY_NAME_BLOCK_SIZE];
+	if (!ppBlock)
+	{
+		ppBlock = new const char *[KEY_NAME_BLOCK_SIZE];
+		s_nKeyTableBytes += KEY_NAME_BLOCK_SIZE * sizeof(const char *);
+	}
+	ppBlock[id % KEY_NAME_BLOCK_SIZE] = pszName;
+
+	ThreadMemoryBarrier();
+	ppBlocks[id / KEY_NAME_BLOCK_SIZE] = ppBlock;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the lookup symbol for a key name without locking.
+// Input  : nHash - HashStringCaseless of the name.
+//			pnSlot - If not NULL and the name isn't found, receives the empty
+//				hash slot it would go in.
+//-----------------------------------------------------------------------------
+static CUtlSymbol FindLookupSymbol(const char *pszKey, unsigned int nHash, int *pnSlot)
+{
+	uint32 nTag = nHash & 0xFFFF0000;
+	int nSlot = nHash & ( KEY_LOOKUP_HASH_SIZE - 1 );
+
+	for (;;)
+	{
+		uint32 nEntry = s_KeyLookupHash[nSlot];
+		if (nEntry == 0)
+		{
+			if (pnSlot)
+			{
+				*pnSlot = nSlot;
+			}
+			return CUtlSymbol();
+		}
+
+		ThreadMemoryBarrier();
+
+		if ((nEntry & 0xFFFF0000) == nTag)
+		{
+			UtlSymId_t id = (UtlSymId_t)((nEntry & 0xFFFF) - 1);
+			if (!V_stricmp(s_ppLookupNameBlocks[id / KEY_NAME_BLOCK_SIZE][id % KEY_NAME_BLOCK_SIZE], pszKey))
+			{
+				return CUtlSymbol(id);
+			}
+		}
+
+		nSlot = (nSlot + 1) & (KEY_LOOKUP_HASH_SIZE - 1);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Interns a key name.
+// Input  : pszKey - Key name, already truncated to KEYVALUE_MAX_KEY_LENGTH.
+//			Key - Receives the symbol for this spelling of the key.
+//			LookupKey - Receives the symbol for the key ignoring case.
+//-----------------------------------------------------------------------------
+static void InternKeyName(const char *pszKey, CUtlSymbol &Key, CUtlSymbol &LookupKey)
+{
+	AUTO_LOCK( s_KeyTableMutex );
+
+	Key = s_KeyNames.Find(pszKey);
+	if (!Key.IsValid())
+	{
+		Key = s_KeyNames.AddString(pszKey);
+		s_nKeyTableBytes += V_strlen(pszKey) + 1;
+		PublishKeyName(s_ppKeyNameBlocks, Key, s_KeyNames.String(Key));
+	}
+
+	unsigned int nHash = HashStringCaseless(pszKey);
+	int nSlot;
+	LookupKey = FindLookupSymbol(pszKey, nHash, &nSlot);
+	if (!LookupKey.IsValid())
+	{
+		Assert(s_nLookupSymbols < UTL_INVAL_SYMBOL);
+		LookupKey = CUtlSymbol((UtlSymId_t)s_nLookupSymbols++);
+		PublishKeyName(s_ppLookupNameBlocks, LookupKey, s_KeyNames.String(Key));
+
+		ThreadMemoryBarrier();
+		s_KeyLookupHash[nSlot] = (nHash & 0xFFFF0000) | ((UtlSymId_t)LookupKey + 1);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the case-insensitive symbol for a key name without interning
+//			it, so looking up a key that nothing has doesn't grow the table.
+//			Doesn't lock, so any number of threads can look keys up at once.
+//-----------------------------------------------------------------------------
+CUtlSymbol KeyValue_FindKeySymbol(const char *pszKey)
+{
+	if (!pszKey)
+		return CUtlSymbol();
+
+	return FindLookupSymbol(pszKey, HashStringCaseless(pszKey), NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the number of bytes used by the interned key names.
+//-----------------------------------------------------------------------------
+int KeyValue_GetKeyTableSize(void)
+{
+	AUTO_LOCK( s_KeyTableMutex );
+	return s_nKeyTableBytes + sizeof(s_KeyLookupHash);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor with assignment.
+//-----------------------------------------------------------------------------
+MDkeyvalue::MDkeyvalue(const char *pszKey, const char *pszValue)
+{
+	m_szInlineValue[0] = '\0';
+	m_nValueAlloc = 0;
+
+	Set(pszKey, pszValue);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Copy constructor.
+//-----------------------------------------------------------------------------
+MDkeyvalue::MDkeyvalue(const MDkeyvalue &other)
+{
+	m_szInlineValue[0] = '\0';
+	m_nValueAlloc = 0;
+
+	*this = other;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Destructor.
 //-----------------------------------------------------------------------------
 MDkeyvalue::~MDkeyvalue(void)
 {
+	FreeValue();
 }
 
 
@@ -23,12 +187,106 @@ MDkeyvalue::~MDkeyvalue(void)
 //-----------------------------------------------------------------------------
 MDkeyvalue &MDkeyvalue::operator =(const MDkeyvalue &other)
 {
-	V_strcpy_safe(szKey, other.szKey);
-	V_strcpy_safe(szValue, other.szValue);
+	if (this != &other)
+	{
+		m_Key = other.m_Key;
+		m_LookupKey = other.m_LookupKey;
+		SetValue(other.Value());
+	}
 
 	return(*this);
 }
 
+
+//-----------------------------------------------------------------------------
+// Purpose: Assigns a key and value.
+//-----------------------------------------------------------------------------
+void MDkeyvalue::Set(const char *pszKey, const char *pszValue)
+{
+	SetKey(pszKey);
+	SetValue(pszValue);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets the key name, truncated to KEYVALUE_MAX_KEY_LENGTH.
+//-----------------------------------------------------------------------------
+void MDkeyvalue::SetKey(const char *pszKey)
+{
+	Assert(pszKey);
+
+	char szKey[KEYVALUE_MAX_KEY_LENGTH];
+	V_strncpy(szKey, pszKey, sizeof(szKey));
+
+	InternKeyName(szKey, m_Key, m_LookupKey);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets the value, truncated to KEYVALUE_MAX_VALUE_LENGTH. Short values
+//			are kept inline, longer ones get an allocation of their own.
+//-----------------------------------------------------------------------------
+void MDkeyvalue::SetValue(const char *pszValue)
+{
+	Assert(pszValue);
+
+	int nLen = MIN(V_strlen(pszValue), KEYVALUE_MAX_VALUE_LENGTH - 1);
+	if (nLen < INLINE_VALUE_LENGTH)
+	{
+		// Copy before freeing, pszValue may be our own value.
+		char szValue[INLINE_VALUE_LENGTH];
+		memcpy(szValue, pszValue, nLen);
+		FreeValue();
+		memcpy(m_szInlineValue, szValue, nLen);
+		m_szInlineValue[nLen] = '\0';
+		return;
+	}
+
+	if (nLen + 1 > m_nValueAlloc)
+	{
+		char *pszNew = new char[nLen + 1];
+		memcpy(pszNew, pszValue, nLen);
+		FreeValue();
+		m_pszValue = pszNew;
+		m_nValueAlloc = nLen + 1;
+	}
+	else
+	{
+		memmove(m_pszValue, pszValue, nLen);
+	}
+
+	m_pszValue[nLen] = '\0';
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the value's allocation, leaving an empty inline value.
+//-----------------------------------------------------------------------------
+void MDkeyvalue::FreeValue(void)
+{
+	if (m_nValueAlloc)
+	{
+		delete [] m_pszValue;
+		m_nValueAlloc = 0;
+	}
+
+	m_szInlineValue[0] = '\0';
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the string keyname.
+//-----------------------------------------------------------------------------
+const char *MDkeyvalue::Key(void) const
+{
+	if (!m_Key.IsValid())
+		return "";
+
+	UtlSymId_t id = m_Key;
+	return s_ppKeyNameBlocks[id / KEY_NAME_BLOCK_SIZE][id % KEY_NAME_BLOCK_SIZE];
+}
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 void WCKVBase_Vector::RemoveKeyAt(int nIndex)
@@ -68,17 +326,23 @@ void WCKVBase_Vector::AddKeyValue(const char *pszKey, const char *pszValue)
 	//
 	// Add the keyvalue to our list.
 	//
-	MDkeyvalue newkv;
-	V_strcpy_safe(newkv.szKey, szTmpKey);
-	V_strcpy_safe(newkv.szValue, szTmpValue);
-	m_KeyValues.AddToTail(newkv);
+	int i = m_KeyValues.AddToTail();
+	m_KeyValues[i].Set(szTmpKey, szTmpValue);
 }
 
 int WCKVBase_Vector::FindByKeyName( const char *pKeyName ) const
 {
+	return FindByKeySymbol( KeyValue_FindKeySymbol( pKeyName ) );
+}
+
+int WCKVBase_Vector::FindByKeySymbol( CUtlSymbol LookupKey ) const
+{
+	if ( !LookupKey.IsValid() )
+		return GetInvalidIndex();
+
 	for ( int i=0; i < m_KeyValues.Count(); i++ )
 	{
-		if ( V_stricmp( m_KeyValues[i].szKey, pKeyName ) == 0 )
+		if ( m_KeyValues[i].KeySymbol() == LookupKey )
 			return i;
 	}
 	return GetInvalidIndex();
@@ -89,23 +353,71 @@ void WCKVBase_Vector::InsertKeyValue( const MDkeyvalue &kv )
 	m_KeyValues.AddToTail( kv );
 }
 
+void WCKVBase_Vector::GetMemoryStats( KeyValueMemoryStats_t &stats ) const
+{
+	stats.m_nKeyValues += m_KeyValues.Count();
+	stats.m_nBytes += m_KeyValues.NumAllocated() * sizeof( MDkeyvalue );
+	stats.m_nFixedSizeBytes += m_KeyValues.Count() * ( KEYVALUE_MAX_KEY_LENGTH + KEYVALUE_MAX_VALUE_LENGTH );
+
+	for ( int i=0; i < m_KeyValues.Count(); i++ )
+	{
+		stats.m_nBytes += m_KeyValues[i].GetValueAllocSize();
+	}
+}
+
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 void WCKVBase_Dict::RemoveKeyAt(int nIndex)
 {
-	m_KeyValues.RemoveAt(nIndex);
+	m_KeyValues.Remove(nIndex);
 }
 
 
 int WCKVBase_Dict::FindByKeyName( const char *pKeyName ) const
 {
-	return m_KeyValues.Find( pKeyName );
+	return FindByKeySymbol( KeyValue_FindKeySymbol( pKeyName ) );
 }
 
+int WCKVBase_Dict::FindByKeySymbol( CUtlSymbol LookupKey ) const
+{
+	if ( !LookupKey.IsValid() )
+		return GetInvalidIndex();
+
+	for ( int i = m_KeyValues.Head(); i != m_KeyValues.InvalidIndex(); i = m_KeyValues.Next( i ) )
+	{
+		if ( m_KeyValues[i].KeySymbol() == LookupKey )
+			return i;
+	}
+	return GetInvalidIndex();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Inserts a keyvalue, keeping the list sorted by key name the same way
+//			the CUtlDict it replaced did.
+//-----------------------------------------------------------------------------
 void WCKVBase_Dict::InsertKeyValue( const MDkeyvalue &kv )
 {
-	m_KeyValues.Insert( kv.szKey, kv );
+	int i = m_KeyValues.Head();
+	while ( i != m_KeyValues.InvalidIndex() && V_stricmp( m_KeyValues[i].Key(), kv.Key() ) < 0 )
+	{
+		i = m_KeyValues.Next( i );
+	}
+
+	m_KeyValues.InsertBefore( i, kv );
+}
+
+void WCKVBase_Dict::GetMemoryStats( KeyValueMemoryStats_t &stats ) const
+{
+	stats.m_nBytes += m_KeyValues.NumAllocated() * sizeof( UtlLinkedListElem_t<MDkeyvalue, unsigned short> );
+
+	for ( int i = m_KeyValues.Head(); i != m_KeyValues.InvalidIndex(); i = m_KeyValues.Next( i ) )
+	{
+		// The dictionary also kept its own copy of the key name.
+		stats.m_nKeyValues++;
+		stats.m_nBytes += m_KeyValues[i].GetValueAllocSize();
+		stats.m_nFixedSizeBytes += KEYVALUE_MAX_KEY_LENGTH + KEYVALUE_MAX_VALUE_LENGTH + V_strlen( m_KeyValues[i].Key() ) + 1;
+	}
 }
 
 
@@ -149,7 +461,7 @@ const char *WCKeyValuesT<Base>::GetValue(const char *pszKey, int *piIndex) const
 		if(piIndex)
 			piIndex[0] = i;
 
-		return this->m_KeyValues[i].szValue;
+		return this->m_KeyValues[i].Value();
 	}
 }
 
@@ -241,9 +553,7 @@ void WCKeyValuesT<Base>::SetValue(const char *pszKey, const char *pszValue)
 			//
 			// Add the keyvalue to our list.
 			//
-			MDkeyvalue newkv;
-			Q_strncpy( newkv.szKey, szTmpKey, sizeof( newkv.szKey ) );
-			Q_strncpy( newkv.szValue, szTmpValue, sizeof( newkv.szValue ) );
+			MDkeyvalue newkv( szTmpKey, szTmpValue );
 			this->InsertKeyValue( newkv );
 		}
 	}
@@ -251,7 +561,7 @@ void WCKeyValuesT<Base>::SetValue(const char *pszKey, const char *pszValue)
 	{
 		if (pszValue != NULL)
 		{
-			V_strncpy(this->m_KeyValues[i].szValue, szTmpValue, sizeof(this->m_KeyValues[i].szValue));
+			this->m_KeyValues[i].SetValue(szTmpValue);
 		}
 		//
 		// If we are setting to a NULL value, delete the key.
@@ -13,6 +13,12 @@
 #include "hammer.h"
 #include "mapoverlay.h"
 #include "gameconfig.h"
+#include "filesystem.h"
+#include "mapdiff.h"
+#include "mapentity.h"
+#include "mapsolid.h"
+#include "tier1/fmtstr.h"
+#include "tier1/utlhashtable.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -96,51 +102,135 @@ void CMapDiffDlg::OnBnClickedOk()
 
 
 //-----------------------------------------------------------------------------
-// Purpose:
+// Purpose: Compares the current map with the chosen map file and puts what was
+//			added, modified or moved since into visgroups.
 //-----------------------------------------------------------------------------
 void CMapDiffDlg::OnOK()
 {
 	CString strFilename;
 	m_mapName.GetWindowText( strFilename );
-	CHammer *pApp = (CHammer*) AfxGetApp();
-	CMapDoc *pDoc = (CMapDoc*) pApp->pMapDocTemplate->OpenDocumentFile( strFilename );
-	CUtlVector <int> IDList;
+	if ( strFilename.IsEmpty() )
+	{
+		return;
+	}
+
+	//
+	// The comparison is between files, so that both maps are hashed the same
+	// way. Use the current map's file if it's saved, otherwise write it out.
+	//
+	char szCurrentFile[MAX_PATH];
+	bool bTempFile = false;
+	if ( !s_pCurrentMap->IsModified() && !s_pCurrentMap->GetPathName().IsEmpty() )
+	{
+		V_strncpy( szCurrentFile, s_pCurrentMap->GetPathName(), sizeof( szCurrentFile ) );
+	}
+	else
+	{
+		APP()->GetDirectory( DIR_AUTOSAVE, szCurrentFile );
+		V_strncat( szCurrentFile, "mapdiff_current.vmf", sizeof( szCurrentFile ) );
+		if ( !s_pCurrentMap->SaveVMF( szCurrentFile, SAVEFLAGS_NO_UI_UPDATE ) )
+		{
+			GetMainWnd()->MessageBox( "The current map couldn't be written out for comparison.", "Map Diff", MB_OK | MB_ICONEXCLAMATION );
+			return;
+		}
+		bTempFile = true;
+	}
+
+	CWaitCursor wait;
 
-	const CMapObjectList *pChildren = pDoc->GetMapWorld()->GetChildren();
+	double flStartTime = Plat_FloatTime();
+	CMapDiff Diff;
+	bool bOk = Diff.Run( strFilename, szCurrentFile );
+	double flElapsed = Plat_FloatTime() - flStartTime;
 
-	FOR_EACH_OBJ( *pChildren, pos )
+	if ( !bOk )
 	{
-		int nID = pChildren->Element(pos)->GetID();
-		IDList.AddToTail( nID );
+		GetMainWnd()->MessageBox( Diff.GetError(), "Map Diff", MB_OK | MB_ICONEXCLAMATION );
+		if ( bTempFile )
+		{
+			g_pFullFileSystem->RemoveFile( szCurrentFile );
+		}
+		return;
 	}
 
-	pDoc->OnCloseDocument();
+	//
+	// Find the objects of the current map by ID. The IDs in the file are the
+	// IDs the objects have now.
+	//
+	CUtlHashtable<uint32, CMapClass *> ObjectsByID;
+	CMapWorld *pWorld = s_pCurrentMap->GetMapWorld();
 
-	CVisGroup *resultsVisGroup = NULL;
-	pChildren = s_pCurrentMap->GetMapWorld()->GetChildren();
-	int nTotalSimilarities = 0;
-	if ( m_bCheckSimilar )
+	EnumChildrenPos_t pos;
+	CMapClass *pChild = pWorld->GetFirstDescendent( pos );
+	while ( pChild != NULL )
 	{
-		FOR_EACH_OBJ( *pChildren, pos )
+		if ( dynamic_cast<CMapEntity *>( pChild ) != NULL )
+		{
+			ObjectsByID.Insert( ( (uint32)pChild->GetID() << 1 ) | MapDiffObject_Entity, pChild );
+		}
+		else if ( ( dynamic_cast<CMapSolid *>( pChild ) != NULL ) && ( dynamic_cast<CMapEntity *>( pChild->GetParent() ) == NULL ) )
 		{
-			CMapClass *pChild = pChildren->Element(pos)	;
-			int ID = pChild->GetID();
-			if ( IDList.Find( ID ) != -1 )
+			ObjectsByID.Insert( ( (uint32)pChild->GetID() << 1 ) | MapDiffObject_Solid, pChild );
+		}
+
+		pChild = pWorld->GetNextDescendent( pos );
+	}
+
+	CMapObjectList Results[MapDiff_ResultCount];
+	const MapDiffFile_t &NewFile = Diff.GetNewFile();
+	for ( int i = 0; i < NewFile.m_Objects.Count(); i++ )
+	{
+		const MapDiffObject_t &Object = NewFile.m_Objects[i];
+		UtlHashHandle_t h = ObjectsByID.Find( ( (uint32)Object.m_nID << 1 ) | Object.m_eType );
+		if ( h != ObjectsByID.InvalidHandle() )
+		{
+			Results[Object.m_eResult].AddToTail( ObjectsByID[h] );
+		}
+	}
+
+	static const char *s_pszVisGroupNames[MapDiff_ResultCount] =
+	{
+		"Similar",				// MapDiff_Unchanged
+		"Diff: added",			// MapDiff_Added
+		NULL,					// MapDiff_Removed, not in the current map.
+		"Diff: modified",		// MapDiff_Modified
+		"Diff: moved",			// MapDiff_Moved
+	};
+
+	for ( int i = 0; i < MapDiff_ResultCount; i++ )
+	{
+		if ( !s_pszVisGroupNames[i] || !Results[i].Count() || ( ( i == MapDiff_Unchanged ) && !m_bCheckSimilar ) )
+		{
+			continue;
+		}
+
+		s_pCurrentMap->VisGroups_CreateNamedVisGroup( Results[i], s_pszVisGroupNames[i], false, false );
+	}
+	s_pCurrentMap->VisGroups_UpdateAll();
+
+	CFmtStr strSummary( "Compared in %.2f seconds.\n\n"
+		"Added: %d\nRemoved: %d\nModified: %d\nMoved: %d\nUnchanged: %d\n\n"
+		"Changed objects were placed into the \"Diff\" visgroups. Export the changes as a patch?",
+		flElapsed, Diff.GetResultCount( MapDiff_Added ), Diff.GetResultCount( MapDiff_Removed ),
+		Diff.GetResultCount( MapDiff_Modified ), Diff.GetResultCount( MapDiff_Moved ), Diff.GetResultCount( MapDiff_Unchanged ) );
+
+	if ( GetMainWnd()->MessageBox( strSummary, "Map Diff", MB_YESNO | MB_ICONINFORMATION ) == IDYES )
+	{
+		CFileDialog dlg( FALSE, "vmfpatch", NULL, OFN_LONGNAMES | OFN_HIDEREADONLY | OFN_NOCHANGEDIR | OFN_OVERWRITEPROMPT, "Map Patch Files (*.vmfpatch)|*.vmfpatch||" );
+		if ( dlg.DoModal() == IDOK )
+		{
+			if ( !Diff.ExportPatch( dlg.GetPathName() ) )
 			{
-				if ( resultsVisGroup == NULL )
-				{
-					resultsVisGroup = s_pCurrentMap->VisGroups_AddGroup( "Similar" );
-					nTotalSimilarities++;
-				}
-				pChild->AddVisGroup( resultsVisGroup );
+				GetMainWnd()->MessageBox( "The patch couldn't be written.", "Map Diff", MB_OK | MB_ICONEXCLAMATION );
 			}
 		}
 	}
-	if ( nTotalSimilarities > 0 )
+
+	if ( bTempFile )
 	{
-		GetMainWnd()->MessageBox( "Similarities were found and placed into the \"Similar\" visgroup.", "Map Similarities Found", MB_OK | MB_ICONEXCLAMATION);
+		g_pFullFileSystem->RemoveFile( szCurrentFile );
 	}
-	s_pCurrentMap->VisGroups_UpdateAll();
+
 	DestroyWindow();
 }
 
@@ -65,8 +65,8 @@ static CMapObjectList FoundEntities;
 //-----------------------------------------------------------------------------
 static BOOL FindKeyValue(CMapEntity *pEntity, MDkeyvalue *pKV)
 {
-	LPCTSTR pszValue = pEntity->GetKeyValue(pKV->szKey);
-	if (!pszValue || strcmpi(pszValue, pKV->szValue))
+	LPCTSTR pszValue = pEntity->GetKeyValue(pKV->Key());
+	if (!pszValue || strcmpi(pszValue, pKV->Value()))
 	{
 		return TRUE;
 	}
@@ -275,7 +275,7 @@ void CMapEntity::AddChild(CMapClass *pChild)
 		for ( int i=GetFirstKeyValue(); i != GetInvalidKeyValue(); i=GetNextKeyValue( i ) )
 		{
 			MDkeyvalue KeyValue = m_KeyValues.GetKeyValue(i);
-			pChild->OnParentKeyChanged( KeyValue.szKey, KeyValue.szValue );
+			pChild->OnParentKeyChanged( KeyValue.Key(), KeyValue.Value() );
 		}
 	}
 }
@@ -550,6 +550,17 @@ CMapClass *CMapEntity::CopyFrom(CMapClass *pobj, bool bUpdateDependencies)
 			UpdateAllDependencies(this);
 		}
 	}
+
+	//
+	// Undo copies keys back without updating dependencies, so make sure the
+	// world's entity index sees any change of name or class.
+	//
+	CMapWorld *pWorld = GetWorldObject(this);
+	if (pWorld != NULL)
+	{
+		pWorld->EntityList_Reindex(this);
+	}
+
 	CalculateTypeFlags();
 	SignalChanged();
 	return(this);
@@ -882,10 +893,10 @@ void CMapEntity::ReplaceTargetname(const char *szOldName, const char *szNewName)
 	for ( int i=GetFirstKeyValue(); i != GetInvalidKeyValue(); i=GetNextKeyValue( i ) )
 	{
 		MDkeyvalue KeyValue = m_KeyValues.GetKeyValue(i);
-		if (!CompareEntityNames(KeyValue.szValue, szOldName))
+		if (!CompareEntityNames(KeyValue.Value(), szOldName))
 		{
-			BuildNewTargetName( KeyValue.szValue, szNewName, szTempName );
-			SetKeyValue( KeyValue.szKey, szTempName );
+			BuildNewTargetName( KeyValue.Value(), szNewName, szTempName );
+			SetKeyValue( KeyValue.Key(), szTempName );
 		}
 	}
 
@@ -942,6 +953,13 @@ void CMapEntity::SetClass(LPCTSTR pszClass, bool bLoading)
 	CEditGameClass::SetClass(pszClass, bLoading);
 	UpdateObjectColor();
 
+	// Move to the right class bucket in the world's entity index.
+	CMapWorld *pWorld = GetWorldObject(this);
+	if (pWorld != NULL)
+	{
+		pWorld->EntityList_Reindex(this);
+	}
+
 	//
 	// If our new class is defined in the FGD, set our color and our default keys
 	// from the class.
@@ -1097,7 +1115,7 @@ void CMapEntity::PostloadWorld(CMapWorld *pWorld)
 	if (pszValue != NULL)
 	{
 		Vector Origin;
-		sscanf(pszValue, "%f %f %f", &Origin[0], &Origin[1], &Origin[2]);
+		CChunkFile::ScanValue(pszValue, "%f %f %f", &Origin[0], &Origin[1], &Origin[2]);
 		SetOrigin(Origin);
 	}
 
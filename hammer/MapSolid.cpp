@@ -8,6 +8,7 @@
 #include "box3d.h"
 #include "brushops.h"
 #include "globalfunctions.h"
+#include "hammer.h"
 #include "mapdefs.h"		// dvs: For COORD_NOTINIT
 #include "mapview2d.h" // dvs FIXME: For HitTest2D implementation
 #include "mapworld.h"
@@ -21,6 +22,7 @@
 #include "camera.h"
 #include "ssolid.h"
 #include "texturesystem.h"
+#include "vstdlib/jobthread.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -35,6 +37,15 @@ IMPLEMENT_MAPCLASS(CMapSolid)
 int CMapSolid::g_nBadSolidCount = 0;
 
 
+//
+// Solids loaded between BeginDeferredBuild and EndDeferredBuild. Their geometry
+// is built in one batch by EndDeferredBuild. Solids deleted before then are
+// set to NULL here by their destructor, which finds them by m_nDeferredIndex.
+//
+static int s_nDeferredBuildDepth = 0;
+static CUtlVector<CMapSolid *> s_DeferredSolids;
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Constructor. Sets this solid's color to a random blue-green color.
 // Input  : Parent0 - The parent of this solid. Typically this is the world.
@@ -44,6 +55,7 @@ CMapSolid::CMapSolid(CMapClass *Parent0)
 {
 	m_pParent = Parent0;
 	m_bIsCordonBrush = false;
+	m_nDeferredIndex = -1;
 
 	PickRandomColor();
 }
@@ -54,6 +66,12 @@ CMapSolid::CMapSolid(CMapClass *Parent0)
 //-----------------------------------------------------------------------------
 CMapSolid::~CMapSolid(void)
 {
+	if (m_nDeferredIndex != -1)
+	{
+		Assert(s_DeferredSolids[m_nDeferredIndex] == this);
+		s_DeferredSolids[m_nDeferredIndex] = NULL;
+	}
+
 	Faces.SetCount(0);
 }
 
@@ -589,6 +607,28 @@ CMapClass *CMapSolid::CopyFrom(CMapClass *pobj, bool bUpdateDependencies)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns a copy of this solid that has everything but the faces.
+//			Used by the undo history, which keeps the faces in CKeptFaces.
+//-----------------------------------------------------------------------------
+CMapSolid *CMapSolid::CopyWithoutFaces(void)
+{
+	CMapSolid *pNew = new CMapSolid;
+	pNew->CopyFromWithoutFaces(this, false);
+	return pNew;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Copies everything but the faces from the given solid.
+//-----------------------------------------------------------------------------
+void CMapSolid::CopyFromWithoutFaces(CMapSolid *pFrom, bool bUpdateDependencies)
+{
+	CMapClass::CopyFrom(pFrom, bUpdateDependencies);
+	m_bIsCordonBrush = pFrom->m_bIsCordonBrush;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Walks the faces of a solid for debugging.
 //-----------------------------------------------------------------------------
@@ -889,10 +929,16 @@ int CMapSolid::CreateFromPlanes( DWORD dwFlags )
 
 			//
 			// Create a huge winding from this face's plane, then clip it by all other
-			// face planes.
+			// face planes. The points ping-pong between two buffers on the stack so
+			// that no memory is allocated per clip; this can run on a worker thread
+			// while a map is loading.
 			//
-			winding_t *w = CreateWindingFromPlane(&pFace->plane);
-			for (j = 0; j < nFaces && w; j++)
+			Vector Points[2][MAX_POINTS_ON_WINDING];
+			int nCur = 0;
+			int nPoints = 4;
+			CreateWindingPointsFromPlane(&pFace->plane, Points[nCur]);
+
+			for (j = 0; j < nFaces && nPoints > 0; j++)
 			{
 				CMapFace *pFaceClip = GetFace(j);
 
@@ -906,7 +952,8 @@ int CMapSolid::CreateFromPlanes( DWORD dwFlags )
 					VectorSubtract(vec3_origin, pFaceClip->plane.normal, plane.normal);
 					plane.dist = -pFaceClip->plane.dist;
 
-					w = ClipWinding(w, &plane);
+					nPoints = ClipWindingPoints(Points[nCur], nPoints, &plane, Points[nCur ^ 1]);
+					nCur ^= 1;
 				}
 			}
 
@@ -914,21 +961,25 @@ int CMapSolid::CreateFromPlanes( DWORD dwFlags )
 			// If we still have a winding after all that clipping, build a face from
 			// the winding.
 			//
-			if (w != NULL)
+			if (nPoints > 0)
 			{
+				winding_t w;
+				w.numpoints = nPoints;
+				w.p = Points[nCur];
+
 				//
 				// Round all points in the winding that are within ROUND_VERTEX_EPSILON of
 				// integer values.
 				//
-				for (j = 0; j < w->numpoints; j++)
+				for (j = 0; j < w.numpoints; j++)
 				{
 					for (k = 0; k < 3; k++)
 					{
-						float v = w->p[j][k];
+						float v = w.p[j][k];
 						float v1 = rint(v);
 						if ((v != v1) && (fabs(v - v1) < ROUND_VERTEX_EPSILON))
 						{
-							w->p[j][k] = v1;
+							w.p[j][k] = v1;
 						}
 					}
 				}
@@ -936,7 +987,7 @@ int CMapSolid::CreateFromPlanes( DWORD dwFlags )
 				//
 				// The above rounding process may have created duplicate points. Eliminate them.
 				//
-				RemoveDuplicateWindingPoints(w, MIN_EDGE_LENGTH_EPSILON);
+				RemoveDuplicateWindingPoints(&w, MIN_EDGE_LENGTH_EPSILON);
 
 				bGotFaces = TRUE;
 
@@ -946,17 +997,12 @@ int CMapSolid::CreateFromPlanes( DWORD dwFlags )
 				//
 				if (dwFlags & CREATE_FROM_PLANES_CLIPPING)
 				{
-					pFace->CreateFace( w, CREATE_FACE_PRESERVE_PLANE | CREATE_FACE_CLIPPING );
+					pFace->CreateFace( &w, CREATE_FACE_PRESERVE_PLANE | CREATE_FACE_CLIPPING );
 				}
 				else
 				{
-					pFace->CreateFace(w, CREATE_FACE_PRESERVE_PLANE);
+					pFace->CreateFace(&w, CREATE_FACE_PRESERVE_PLANE);
 				}
-
-				//
-				// Done with the winding, we can free it now.
-				//
-				FreeWinding(w);
 			}
 		}
 	}
@@ -1105,7 +1151,16 @@ ChunkFileResult_t CMapSolid::LoadVMF(CChunkFile *pFile, bool &bValid)
 
 	bValid = false;
 
-	if (eResult == ChunkFile_Ok)
+	if ((eResult == ChunkFile_Ok) && (s_nDeferredBuildDepth > 0))
+	{
+		//
+		// The geometry is built later by EndDeferredBuild. If the solid turns out
+		// to be invalid it is removed from its parent and deleted then.
+		//
+		m_nDeferredIndex = s_DeferredSolids.AddToTail(this);
+		bValid = true;
+	}
+	else if (eResult == ChunkFile_Ok)
 	{
 		//
 		// Create the solid using the planes that were read from the MAP file.
@@ -1148,6 +1203,215 @@ ChunkFileResult_t CMapSolid::LoadVMF(CChunkFile *pFile, bool &bValid)
 }
 
 
+struct DeferredSolid_t
+{
+	CMapSolid *m_pSolid;
+	DWORD m_dwCreateFlags;
+	bool m_bHasDisp;
+	bool m_bPlanesDone;
+	bool m_bValid;
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the geometry of one solid loaded while building was deferred.
+//			Runs on the worker threads, so this must only touch the solid, its
+//			faces and their displacements.
+//-----------------------------------------------------------------------------
+static void BuildDeferredSolid(DeferredSolid_t &Solid)
+{
+	CMapSolid *pSolid = Solid.m_pSolid;
+
+	if (!Solid.m_bPlanesDone)
+	{
+		Solid.m_bValid = (pSolid->CreateFromPlanes(Solid.m_dwCreateFlags) != FALSE);
+	}
+
+	if (!Solid.m_bValid)
+	{
+		return;
+	}
+
+	if (Solid.m_bHasDisp)
+	{
+		int nFaces = pSolid->GetFaceCount();
+		for (int i = 0; i < nFaces; i++)
+		{
+			CMapFace *pFace = pSolid->GetFace(i);
+			if (!pFace->HasDisp())
+				continue;
+
+			CMapDisp *pMapDisp = EditDispMgr()->GetDisp(pFace->GetDisp());
+			pMapDisp->InitDispSurfaceData(pFace, false);
+			pMapDisp->CreateSurface();
+			pMapDisp->PostLoad();
+		}
+	}
+
+	pSolid->CalcBounds();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Starts deferring the geometry build of solids as they are loaded,
+//			so that EndDeferredBuild can build them all on worker threads.
+//			Calls may nest.
+// Output : Returns the value to pass to the matching EndDeferredBuild.
+//-----------------------------------------------------------------------------
+int CMapSolid::BeginDeferredBuild(void)
+{
+	s_nDeferredBuildDepth++;
+	return s_DeferredSolids.Count();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the geometry of the solids loaded since the matching call to
+//			BeginDeferredBuild. Solids are clipped from their planes and their
+//			displacements are tessellated on a thread pool, then the work that
+//			touches other objects is done here in load order: invalid solids are
+//			removed and deleted, and displacements are hooked up to their
+//			neighbors.
+//
+//			Parent bounds are not updated; PostloadWorld recalculates them.
+// Input  : nFirstSolid - Value returned by BeginDeferredBuild.
+//-----------------------------------------------------------------------------
+void CMapSolid::EndDeferredBuild(int nFirstSolid)
+{
+	Assert(s_nDeferredBuildDepth > 0);
+	s_nDeferredBuildDepth--;
+
+	CUtlVector<DeferredSolid_t> Solids;
+	Solids.EnsureCapacity(s_DeferredSolids.Count() - nFirstSolid);
+
+	for (int i = nFirstSolid; i < s_DeferredSolids.Count(); i++)
+	{
+		// Solids deleted since they were loaded have been nulled out.
+		CMapSolid *pSolid = s_DeferredSolids[i];
+		if (pSolid == NULL)
+			continue;
+
+		pSolid->m_nDeferredIndex = -1;
+
+		DeferredSolid_t &Solid = Solids[Solids.AddToTail()];
+		Solid.m_pSolid = pSolid;
+		Solid.m_dwCreateFlags = pSolid->m_bFacesHavePoints ? CREATE_ALREADY_HAS_POINTS : 0;
+		Solid.m_bHasDisp = false;
+		Solid.m_bPlanesDone = false;
+		Solid.m_bValid = false;
+
+		int nFaces = pSolid->GetFaceCount();
+		for (int j = 0; j < nFaces; j++)
+		{
+			if (pSolid->GetFace(j)->HasDisp())
+			{
+				Solid.m_bHasDisp = true;
+				break;
+			}
+		}
+	}
+
+	s_DeferredSolids.RemoveMultipleFromTail(s_DeferredSolids.Count() - nFirstSolid);
+
+	//
+	// Clipping a solid can remove faces, which adds and removes displacements
+	// when the faces have them. The displacement manager isn't thread safe, so
+	// solids with displacements are clipped here. Their surfaces are built
+	// with the rest on the worker threads.
+	//
+	CMapDisp::SetDeferCreate(true);
+
+	for (int i = 0; i < Solids.Count(); i++)
+	{
+		DeferredSolid_t &Solid = Solids[i];
+		if (Solid.m_bHasDisp)
+		{
+			Solid.m_bValid = (Solid.m_pSolid->CreateFromPlanes(Solid.m_dwCreateFlags) != FALSE);
+			Solid.m_bPlanesDone = true;
+		}
+	}
+
+	CMapDisp::SetDeferCreate(false);
+
+	//
+	// Building faces signals EVTYPE_FACE_CHANGED, which isn't thread safe. The
+	// signal is held back until all the solids are built and sent once here.
+	//
+	SuppressUpdateSignals(true);
+
+	//
+	// Small loads, such as prefabs, aren't worth starting threads for.
+	//
+	const int nMinSolidsForThreads = 256;
+	if (Solids.Count() >= nMinSolidsForThreads)
+	{
+		IThreadPool *pThreadPool = CreateThreadPool();
+
+		const CPUInformation *pCPUInfo = GetCPUInformation();
+		ThreadPoolStartParams_t startParams;
+		startParams.nThreads = Clamp(pCPUInfo->m_nLogicalProcessors - 1, 1, TP_MAX_POOL_THREADS);
+		startParams.nStackSize = 4 * 1024 * 1024;
+		pThreadPool->Start(startParams, "hammer_loadsolids");
+
+		ParallelProcess("BuildDeferredSolid", pThreadPool, Solids.Base(), Solids.Count(), BuildDeferredSolid);
+
+		pThreadPool->Stop();
+		DestroyThreadPool(pThreadPool);
+	}
+	else
+	{
+		for (int i = 0; i < Solids.Count(); i++)
+		{
+			BuildDeferredSolid(Solids[i]);
+		}
+	}
+
+	SuppressUpdateSignals(false);
+	if (Solids.Count() > 0)
+	{
+		SignalUpdate(EVTYPE_FACE_CHANGED);
+	}
+
+	for (int i = 0; i < Solids.Count(); i++)
+	{
+		CMapSolid *pSolid = Solids[i].m_pSolid;
+
+		if (!Solids[i].m_bValid)
+		{
+			g_nBadSolidCount++;
+
+			CMapClass *pParent = pSolid->GetParent();
+			if (pParent != NULL)
+			{
+				pParent->RemoveChild(pSolid, false);
+			}
+
+			delete pSolid;
+			continue;
+		}
+
+		if (Solids[i].m_bHasDisp)
+		{
+			int nFaces = pSolid->GetFaceCount();
+			for (int j = 0; j < nFaces; j++)
+			{
+				CMapFace *pFace = pSolid->GetFace(j);
+				if (pFace->HasDisp())
+				{
+					EditDispMgr()->GetDisp(pFace->GetDisp())->PostCreate();
+				}
+			}
+		}
+
+		// There once was a bug that caused black solids. Fix it here.
+		if ((pSolid->r == 0) && (pSolid->g == 0) && (pSolid->b == 0))
+		{
+			pSolid->PickRandomColor();
+		}
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Picks a random shade of blue/green for this solid.
 //-----------------------------------------------------------------------------
@@ -17,6 +17,7 @@
 #include "globalfunctions.h"
 #include "gotobrushdlg.h"
 #include "history.h"
+#include "historyblocks.h"
 #include "mainfrm.h"
 #include "mapanimator.h"
 #include "mapcheckdlg.h"
@@ -1424,7 +1425,7 @@ void CMapDoc::Initialize(void)
 	Assert(!m_pWorld);
 
 	m_pWorld = new CMapWorld( this );
-	m_pWorld->CullTree_Build();
+	m_pWorld->ObjectBVH_Build();
 	m_openTime = time( nullptr );
 }
 
@@ -1611,6 +1612,7 @@ bool CMapDoc::LoadVMF( const char *pszFileName, int LoadFlags )
 		//
 
 		pProgDlg->SetWindowText( "Reading Chunks..." );
+		int nFirstSolid = CMapSolid::BeginDeferredBuild();
 		while (eResult == ChunkFile_Ok)
 		{
 			eResult = File.ReadChunk();
@@ -1618,6 +1620,13 @@ bool CMapDoc::LoadVMF( const char *pszFileName, int LoadFlags )
 		pProgDlg->SetStep(5000);
 		pProgDlg->StepIt();
 
+		//
+		// Solid geometry isn't built as the solids are read. Build it all at once
+		// now, on worker threads.
+		//
+		pProgDlg->SetWindowText( "Building Solids..." );
+		CMapSolid::EndDeferredBuild( nFirstSolid );
+
 		if (eResult == ChunkFile_EOF)
 		{
 			eResult = ChunkFile_Ok;
@@ -1664,6 +1673,140 @@ bool CMapDoc::LoadVMF( const char *pszFileName, int LoadFlags )
 }
 
 
+struct VMFBenchmark_t
+{
+	int m_nKeys;
+	CUtlVector<CUtlString> m_Planes;
+};
+
+
+static ChunkFileResult_t BenchmarkVMFKeyCallback( const char *szKey, const char *szValue, VMFBenchmark_t *pBenchmark )
+{
+	pBenchmark->m_nKeys++;
+	if ( !stricmp( szKey, "plane" ) )
+	{
+		pBenchmark->m_Planes.AddToTail( szValue );
+	}
+
+	return ChunkFile_Ok;
+}
+
+
+static ChunkFileResult_t BenchmarkVMFChunkCallback( CChunkFile *pFile, VMFBenchmark_t *pBenchmark, const char *pszChunkName )
+{
+	return pFile->ReadChunk( BenchmarkVMFKeyCallback, pBenchmark );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Times parsing a VMF without building any map objects. The file is
+//			tokenized with TokenReader, which CChunkFile used to read through,
+//			and then parsed with CChunkFile. The face planes found are then
+//			converted with sscanf and with CChunkFile::ScanValue.
+// Input  : pszFileName - Full path of file to parse.
+// Output : Returns true if the file was parsed without errors.
+//-----------------------------------------------------------------------------
+bool CMapDoc::BenchmarkVMFParse( const char *pszFileName )
+{
+	TokenReader Tokens;
+	if ( !Tokens.Open( pszFileName ) )
+	{
+		Warning( "VMF parse benchmark: couldn't open %s\n", pszFileName );
+		return false;
+	}
+
+	double flStartTime = Plat_FloatTime();
+
+	int nTokens = 0;
+	char szToken[MAX_KEYVALUE_LEN];
+	trtoken_t eToken;
+	while ( ( eToken = Tokens.NextToken( szToken, sizeof( szToken ) ) ) != TOKENEOF )
+	{
+		if ( eToken == TOKENERROR || eToken == TOKENSTRINGTOOLONG )
+			break;
+		nTokens++;
+	}
+	Tokens.Close();
+
+	double flTokenReaderTime = Plat_FloatTime() - flStartTime;
+
+	VMFBenchmark_t Benchmark;
+	Benchmark.m_nKeys = 0;
+
+	flStartTime = Plat_FloatTime();
+
+	CChunkFile File;
+	ChunkFileResult_t eResult = File.Open( pszFileName, ChunkFile_Read );
+	if ( eResult == ChunkFile_Ok )
+	{
+		File.SetDefaultChunkHandler( BenchmarkVMFChunkCallback, &Benchmark );
+		while ( ( eResult = File.ReadChunk( BenchmarkVMFKeyCallback, &Benchmark ) ) == ChunkFile_Ok )
+		{
+		}
+	}
+
+	double flChunkFileTime = Plat_FloatTime() - flStartTime;
+
+	if ( eResult != ChunkFile_EOF )
+	{
+		Warning( "VMF parse benchmark: %s\n", File.GetErrorText( eResult ) );
+		return false;
+	}
+
+	Vector vecPoints[3];
+	int nPlanes = Benchmark.m_Planes.Count();
+
+	flStartTime = Plat_FloatTime();
+	for ( int i = 0; i < nPlanes; i++ )
+	{
+		sscanf( Benchmark.m_Planes[i].Get(), "(%f %f %f) (%f %f %f) (%f %f %f)",
+				&vecPoints[0].x, &vecPoints[0].y, &vecPoints[0].z, &vecPoints[1].x, &vecPoints[1].y, &vecPoints[1].z,
+				&vecPoints[2].x, &vecPoints[2].y, &vecPoints[2].z );
+	}
+	double flScanfTime = Plat_FloatTime() - flStartTime;
+
+	int nMismatches = 0;
+	flStartTime = Plat_FloatTime();
+	for ( int i = 0; i < nPlanes; i++ )
+	{
+		CChunkFile::ScanValue( Benchmark.m_Planes[i].Get(), "(%f %f %f) (%f %f %f) (%f %f %f)",
+							   &vecPoints[0].x, &vecPoints[0].y, &vecPoints[0].z, &vecPoints[1].x, &vecPoints[1].y, &vecPoints[1].z,
+							   &vecPoints[2].x, &vecPoints[2].y, &vecPoints[2].z );
+	}
+	double flScanValueTime = Plat_FloatTime() - flStartTime;
+
+	// check the conversions agree, outside of the timed loops
+	for ( int i = 0; i < nPlanes; i++ )
+	{
+		Vector vecScanned[3];
+		CChunkFile::ScanValue( Benchmark.m_Planes[i].Get(), "(%f %f %f) (%f %f %f) (%f %f %f)",
+							   &vecScanned[0].x, &vecScanned[0].y, &vecScanned[0].z, &vecScanned[1].x, &vecScanned[1].y, &vecScanned[1].z,
+							   &vecScanned[2].x, &vecScanned[2].y, &vecScanned[2].z );
+		sscanf( Benchmark.m_Planes[i].Get(), "(%f %f %f) (%f %f %f) (%f %f %f)",
+				&vecPoints[0].x, &vecPoints[0].y, &vecPoints[0].z, &vecPoints[1].x, &vecPoints[1].y, &vecPoints[1].z,
+				&vecPoints[2].x, &vecPoints[2].y, &vecPoints[2].z );
+		if ( V_memcmp( vecScanned, vecPoints, sizeof( vecPoints ) ) )
+			nMismatches++;
+	}
+
+	CFmtStr results( "VMF parse benchmark: %s, %d tokens, %d keys. TokenReader %.1f ms, CChunkFile %.1f ms (%.1fx). "
+					 "%d planes: sscanf %.1f ms, ScanValue %.1f ms (%.1fx), %d mismatches\n",
+					 pszFileName, nTokens, Benchmark.m_nKeys,
+					 flTokenReaderTime * 1000.0, flChunkFileTime * 1000.0, ( flChunkFileTime > 0.0 ) ? flTokenReaderTime / flChunkFileTime : 0.0,
+					 nPlanes, flScanfTime * 1000.0, flScanValueTime * 1000.0, ( flScanValueTime > 0.0 ) ? flScanfTime / flScanValueTime : 0.0,
+					 nMismatches );
+	Msg( "%s", results.Access() );
+	FileHandle_t hFile = g_pFullFileSystem->Open( CFmtStr( "%s_benchmark.txt", pszFileName ), "at" );
+	if ( hFile )
+	{
+		g_pFullFileSystem->Write( results.Access(), V_strlen( results.Access() ), hFile );
+		g_pFullFileSystem->Close( hFile );
+	}
+
+	return nMismatches == 0;
+}
+
+
 void CMapDoc::BuildAllDetailObjects()
 {
 	EnumChildrenPos_t pos;
@@ -2210,7 +2353,7 @@ void CMapDoc::PostloadDocument(const char *pszFileName)
 		pProgDlg->StepIt();
 		pProgDlg->SetWindowText( "Building Cull Tree..." );
 	}
-	m_pWorld->CullTree_Build();
+	m_pWorld->ObjectBVH_Build();
 	if ( pProgDlg )
 	{
 		pProgDlg->StepIt();
@@ -3326,6 +3469,7 @@ BOOL CMapDoc::OnOpenDocument(LPCTSTR lpszPathName)
 	//
 	PreloadDocument();
 
+	double flStartTime = Plat_FloatTime();
 
 	if (!LoadVMF(lpszPathName))
 	{
@@ -3333,7 +3477,7 @@ BOOL CMapDoc::OnOpenDocument(LPCTSTR lpszPathName)
 	}
 
 	SetModifiedFlag(FALSE);
-	Msg(mwStatus, "Opened %s", lpszPathName);
+	Msg(mwStatus, "Opened %s (%d entities, %.2f seconds)", lpszPathName, m_pWorld->EntityList_GetCount(), Plat_FloatTime() - flStartTime);
 	SetActiveMapDoc(this);
 
 	//
@@ -5305,7 +5449,9 @@ void CMapDoc::OnEditPaste(void)
 	//
 	// Paste the objects into the active world.
 	//
+	double flStartTime = Plat_FloatTime();
 	Paste(GetHammerClipboard(), GetActiveWorld(), vecPasteOffset, QAngle(0, 0, 0), NULL, false, NULL);
+	Msg(mwStatus, "Pasted %d objects in %.2f seconds", m_pSelection->GetCount(), Plat_FloatTime() - flStartTime);
 
 	m_pToolManager->SetTool(TOOL_POINTER);
 
@@ -6966,15 +7112,13 @@ BOOL CMapDoc::OnUndoRedo(UINT nID)
 
 	// Do the undo/redo.
 
+	CHistory *pHistory = (nID == ID_EDIT_UNDO) ? m_pUndo : m_pRedo;
+	CFmtStr strAction("%s %s", (nID == ID_EDIT_UNDO) ? "Undo" : "Redo", pHistory->GetCurTrackName());
+	size_t nStepSize = pHistory->GetCurTrackSize();
+	double flStartTime = Plat_FloatTime();
+
 	CMapObjectList NewSelection;
-	if (nID == ID_EDIT_UNDO)
-	{
-		m_pUndo->Undo(&NewSelection);
-	}
-	else
-	{
-		m_pRedo->Undo(&NewSelection);
-	}
+	pHistory->Undo(&NewSelection);
 
 	// Change the selection to the objects that the undo system says
 	// should be selected now. Don't save changes and create new undo entrys
@@ -6983,6 +7127,17 @@ BOOL CMapDoc::OnUndoRedo(UINT nID)
 	m_pSelection->RemoveDead();
 	CMapClass::UpdateAllDependencies(NULL);
 
+	double flElapsed = Plat_FloatTime() - flStartTime;
+
+	//
+	// Report how long it took and how much memory the undo step and the whole
+	// history use, to keep an eye on the cost of the undo system.
+	//
+	SetStatusText(SBI_PROMPT, CFmtStr("%s: %.1f ms, step %s, history %s (%s in %d face blocks)",
+		strAction.Access(), flElapsed * 1000.0, V_pretifymem((float)nStepSize, 1, true),
+		V_pretifymem((float)(m_pUndo->GetDataSize() + m_pRedo->GetDataSize()), 1, true),
+		V_pretifymem((float)HistoryBlockStore()->GetMemoryUsed(), 1, true), HistoryBlockStore()->GetBlockCount()));
+
 	UpdateAllViews( MAPVIEW_UPDATE_OBJECTS );
 
 	return(TRUE);
@@ -10789,6 +10944,11 @@ BOOL CMapDoc::UpdateVisibilityCallback(CMapClass *pObject, UpdateVisibilityData_
 	Assert(!pObject->IsTemporary());
 
 	bool bVisible = pData->pDoc->ShouldObjectBeVisible(pObject, pData);
+	if (bVisible != pObject->IsVisible())
+	{
+		// Hidden objects don't cast shadows in the lighting preview.
+		pData->pDoc->m_pWorld->ShadowList_MarkDirty(pObject);
+	}
 	pObject->SetVisible(bVisible);
 	if (bVisible)
 	{
@@ -613,7 +613,7 @@ void COP_Entity::GetKeyState( const char *pShortName, EKeyState *pState, bool *p
 	varCopy.ResetDefaults();
 	varCopy.ToKeyValue( &tmpkv );
 
-	if ( Q_stricmp( pszCurValue, tmpkv.szValue ) == 0 )
+	if ( Q_stricmp( pszCurValue, tmpkv.Value() ) == 0 )
 		*pState = k_EKeyState_DefaultFGDValue;
 	else
 		*pState = k_EKeyState_Modified;
@@ -1129,17 +1129,20 @@ bool COP_Entity::SaveData( SaveData_Reason_t reason )
 			for (int i = m_kv.GetFirst(); i != m_kv.GetInvalidIndex(); i=m_kv.GetNext( i ) )
 			{
 				MDkeyvalue &kvCur = m_kv.GetKeyValue(i);
-				const char *pszAddedKeyValue = m_kvAdded.GetValue(kvCur.szKey);
+				const char *pszAddedKeyValue = m_kvAdded.GetValue(kvCur.Key());
 				if (pszAddedKeyValue != NULL)
 				{
-					Q_FixSlashes( kvCur.szValue, '/' );
+					char szValue[KEYVALUE_MAX_VALUE_LENGTH];
+					V_strcpy_safe( szValue, kvCur.Value() );
+					Q_FixSlashes( szValue, '/' );
+					kvCur.SetValue( szValue );
 					//
 					// Don't store keys with multiple/undefined values.
 					//
-					if (strcmp(kvCur.szValue, VALUE_DIFFERENT_STRING))
+					if (strcmp(kvCur.Value(), VALUE_DIFFERENT_STRING))
 					{
-						//DBG("    apply key %s\n", kvCur.szKey);
-						ApplyKeyValueToObject(pEdit, kvCur.szKey, kvCur.szValue);
+						//DBG("    apply key %s\n", kvCur.Key());
+						ApplyKeyValueToObject(pEdit, kvCur.Key(), kvCur.Value());
 					}
 				}
 			}
@@ -1419,8 +1422,8 @@ void COP_Entity::PresentProperties()
 		{
 			MDkeyvalue &KeyValue = m_kv.GetKeyValue(i);
 
-			int iItem = m_VarList.InsertItem( i, KeyValue.szKey );
-			m_VarList.SetItemData( iItem, (DWORD)KeyValue.szKey );
+			int iItem = m_VarList.InsertItem( i, KeyValue.Key() );
+			m_VarList.SetItemData( iItem, (DWORD)KeyValue.Key() );
 		}
 
 		m_Angle.Enable( m_bCanEdit );
@@ -1527,10 +1530,10 @@ void COP_Entity::PresentProperties()
 		{
 			MDkeyvalue &KeyValue = m_kv.GetKeyValue(i);
 
-			if ( !m_pDisplayClass->VarForName( KeyValue.szKey ) && m_InstanceParmData.Find( KeyValue.szKey ) == m_InstanceParmData.InvalidIndex() )
+			if ( !m_pDisplayClass->VarForName( KeyValue.Key() ) && m_InstanceParmData.Find( KeyValue.Key() ) == m_InstanceParmData.InvalidIndex() )
 			{
-				int iItem = m_VarList.InsertItem( i, KeyValue.szKey );
-				m_VarList.SetItemData( iItem, (DWORD)KeyValue.szKey );
+				int iItem = m_VarList.InsertItem( i, KeyValue.Key() );
+				m_VarList.SetItemData( iItem, (DWORD)KeyValue.Key() );
 			}
 		}
 
@@ -1579,7 +1582,7 @@ void COP_Entity::RemoveBlankKeys(void)
 		iNext = m_kv.GetNext( i );
 
 		MDkeyvalue &KeyValue = m_kv.GetKeyValue(i);
-		if (KeyValue.szValue[0] == '\0')
+		if (KeyValue.Value()[0] == '\0')
 		{
 			bool bRemove = true;
 
@@ -1589,7 +1592,7 @@ void COP_Entity::RemoveBlankKeys(void)
 			//
 			// dvs: disabled for now because deleting the value text is the currently
 			//      accepted way of reverting a key to its default value.
-			GDinputvariable *pVar = m_pDisplayClass->VarForName( KeyValue.szKey );
+			GDinputvariable *pVar = m_pDisplayClass->VarForName( KeyValue.Key() );
 			if ( pVar )
 			{
 				char szDefault[MAX_KEYVALUE_LEN];
@@ -3028,10 +3031,10 @@ void COP_Entity::AssignClassDefaults(GDclass *pClass, GDclass *pOldClass)
 			MDkeyvalue newkv;
 			pVar->ResetDefaults();
 			pVar->ToKeyValue(&newkv);
-			m_kv.SetValue(newkv.szKey, newkv.szValue);
+			m_kv.SetValue(newkv.Key(), newkv.Value());
 
 			// Remember that we added this key.
-			m_kvAdded.SetValue(newkv.szKey, "1");
+			m_kvAdded.SetValue(newkv.Key(), "1");
 		}
 	}
 }
@@ -3064,9 +3067,9 @@ void COP_Entity::UpdateEditClass(const char *pszClass, bool bForce)
 			iNext = m_kv.GetNext( i );
 
 			MDkeyvalue &KeyValue = m_kv.GetKeyValue(i);
-			if (m_pEditClass->VarForName(KeyValue.szKey) == NULL)
+			if (m_pEditClass->VarForName(KeyValue.Key()) == NULL)
 			{
-				m_kv.RemoveKey(KeyValue.szKey);
+				m_kv.RemoveKey(KeyValue.Key());
 			}
 		}
 	}
@@ -5069,7 +5072,7 @@ void COP_Entity::OnCameraDistance(void)
 			// First set VALUE_DIFFERENT_STRING in our smart control and in m_kv.
 			m_pSmartControl->SetWindowText( VALUE_DIFFERENT_STRING );
 			MDkeyvalue &kvCur = m_kv.GetKeyValue( index );
-			V_strncpy( kvCur.szValue, VALUE_DIFFERENT_STRING, sizeof( kvCur.szValue ) );
+			kvCur.SetValue( VALUE_DIFFERENT_STRING );
 
 			// Get the list of objects we'll apply this to.
 			CMapObjectList objectList;
@@ -8,7 +8,6 @@
 #include "stdafx.h"
 #include <math.h>
 #include "camera.h"
-#include "culltreenode.h"
 #include "mapdoc.h"
 #include "mapentity.h"
 #include "mapworld.h"
@@ -34,6 +33,19 @@
 #include "manifest.h"
 #include "materialsystem/imaterialvar.h"
 #include "MapInstance.h"
+#include "mapsolid.h"
+#include "mapface.h"
+#include "mapalignedbox.h"
+#include "mapsprite.h"
+#include "mapworldtext.h"
+#include "mapplayerhullhandle.h"
+#include "mapline.h"
+#include "mapcylinder.h"
+#include "ToolSelection.h"
+#include "globalfunctions.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlhashtable.h"
+#include "collisionutils.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -56,6 +68,7 @@
 static bool g_bDrawWireFrameSelection = true;
 static bool g_bShowStatistics = false;
 static bool g_bUseCullTree = true;
+static bool g_bCPUPicking = true;
 static bool g_bRenderCullBoxes = false;
 
 float frameTime = 0.f;
@@ -175,6 +188,7 @@ CRender3D::CRender3D(void) :
 	m_LastLPreviewCameraPos = Vector(1.0e22,1.0e22,1.0e22);
 	m_nLastLPreviewWidth = -1;
 	m_nLastLPreviewHeight = -1;
+	m_bRecordLPreviewGBuffers = false;
 
 	memset(&m_Pick, 0, sizeof(m_Pick));
 	m_Pick.bPicking = false;
@@ -589,48 +603,993 @@ bool CRender3D::IsPicking(void)
 //			by 'pObjects'.
 //-----------------------------------------------------------------------------
 int CRender3D::ObjectsAt( float x, float y, float fWidth, float fHeight, HitInfo_t *pObjects, int nMaxObjects, unsigned int nFlags )
+{
+	//
+	// Try the world's BVH first. It gives up on anything it can't answer
+	// exactly the way the renderer would, in which case we render for selection.
+	//
+	if (g_bCPUPicking)
+	{
+		int nHits = ObjectsAtBVH( x, y, fWidth, fHeight, pObjects, nMaxObjects, nFlags );
+		if (nHits >= 0)
+		{
+			return(nHits);
+		}
+	}
+
+	return(ObjectsAtRender( x, y, fWidth, fHeight, pObjects, nMaxObjects, nFlags ));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks objects by rendering the scene in selection mode. Parameters
+//			and return value are as for ObjectsAt.
+//-----------------------------------------------------------------------------
+int CRender3D::ObjectsAtRender( float x, float y, float fWidth, float fHeight, HitInfo_t *pObjects, int nMaxObjects, unsigned int nFlags )
 {
 	int width, height;
 
-	GetCamera()->GetViewPort(width,height);
+	GetCamera()->GetViewPort(width,height);
+
+	m_Pick.fX = x;
+	m_Pick.fY = height - (y + 1);
+	m_Pick.fWidth = fWidth;
+	m_Pick.fHeight = fHeight;
+	m_Pick.pHitsDest = pObjects;
+	m_Pick.nMaxHits = min(nMaxObjects, MAX_PICK_HITS);
+	m_Pick.nNumHits = 0;
+
+	if (!m_RenderState.bReverseSelection)
+	{
+		m_Pick.uLastZ = 0xFFFFFFFF;
+	}
+	else
+	{
+		m_Pick.uLastZ = 0;
+	}
+
+	m_Pick.m_nFlags = nFlags;
+	m_Pick.bPicking = true;
+
+	EditorRenderMode_t eOldMode = GetDefaultRenderMode();
+	SetDefaultRenderMode( RENDER_MODE_TEXTURED );
+
+	bool bOldLightPreview = IsInLightingPreview();
+	SetInLightingPreview( false );
+
+	Render();
+
+	SetDefaultRenderMode( eOldMode );
+	SetInLightingPreview( bOldLightPreview );
+
+	m_Pick.bPicking = false;
+
+	CMatRenderContextPtr pRenderContext( MaterialSystemInterface() );
+	pRenderContext->SelectionMode(false);
+
+	return(m_Pick.nNumHits);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sorts the hits gathered in m_Pick by depth and copies the nearest
+//			ones into the caller's buffer.
+//-----------------------------------------------------------------------------
+void CRender3D::SortPickHits(void)
+{
+	//
+	// Some OpenGL drivers, such as the ATI Rage Fury Max, return selection buffer Z values
+	// in reverse order. For these cards, we must reverse the selection order.
+	//
+	if (m_Pick.nNumHits > 1)
+	{
+		if (!m_RenderState.bReverseSelection)
+		{
+			qsort(m_Pick.Hits, m_Pick.nNumHits, sizeof(m_Pick.Hits[0]), _CompareHits);
+		}
+		else
+		{
+			qsort(m_Pick.Hits, m_Pick.nNumHits, sizeof(m_Pick.Hits[0]), _CompareHitsReverse);
+		}
+	}
+
+	//
+	// Copy the requested number of nearest hits into the destination buffer.
+	//
+	int nHitsToCopy = min(m_Pick.nNumHits, m_Pick.nMaxHits);
+	if (nHitsToCopy != 0)
+	{
+		memcpy(m_Pick.pHitsDest, m_Pick.Hits, sizeof(m_Pick.Hits[0]) * nHitsToCopy);
+	}
+}
+
+
+//
+// State shared by the BVH picking functions below.
+//
+struct BVHPick_t
+{
+	Vector vecEye;					// Camera position.
+	Vector vecForward;				// Camera forward vector.
+	float flNear;					// Near and far clip distances along vecForward.
+	float flFar;
+
+	Vector vecDir;					// Unit direction of the pick ray (ray picks only).
+	Vector vecEnd;					// Where the pick ray crosses the far plane.
+	Vector vecInvDelta;				// Reciprocal of vecEnd - vecEye on each axis.
+	float flMaxDist;				// Length of the pick ray.
+	float flNearestDist;			// Distance along the ray to the nearest hit so far.
+
+	Vector4D Planes[6];				// Pick frustum planes (marquee picks only), CCamera convention.
+
+	unsigned int nFlags;			// FLAG_OBJECTS_AT_xxx
+	bool bMaskDispSolids;			// Whether only the displaced faces of displacement solids are drawn.
+	bool bReverseDepth;				// Whether to store depths reversed, see RenderStateInfo_t.
+	bool bNeedsRender;				// Set when we reach something only the renderer can pick.
+
+	PickInfo_t *pPickInfo;			// Where to put the hits.
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Converts a distance along the camera's forward vector to the value
+//			the selection buffer would hold for it.
+//-----------------------------------------------------------------------------
+static unsigned int ViewDepthToPickDepth( const BVHPick_t &Pick, float flViewDepth )
+{
+	flViewDepth = clamp( flViewDepth, Pick.flNear, Pick.flFar );
+
+	double flDepth = ( Pick.flFar / ( Pick.flFar - Pick.flNear ) ) * ( 1.0 - Pick.flNear / flViewDepth );
+	flDepth = clamp( flDepth, 0.0, 1.0 );
+
+	unsigned int nDepth = (unsigned int)( flDepth * 4294967295.0 );
+	return( Pick.bReverseDepth ? 0xFFFFFFFF - nDepth : nDepth );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Records a pick hit.
+//-----------------------------------------------------------------------------
+static void AddBVHPickHit( BVHPick_t &Pick, CMapClass *pObject, unsigned int uData, float flViewDepth )
+{
+	PickInfo_t *pPickInfo = Pick.pPickInfo;
+	if (pPickInfo->nNumHits < MAX_PICK_HITS)
+	{
+		HitInfo_t &Hit = pPickInfo->Hits[pPickInfo->nNumHits];
+		Hit.pObject = pObject;
+		Hit.uData = uData;
+		Hit.nDepth = ViewDepthToPickDepth( Pick, flViewDepth );
+		Hit.m_LocalMatrix.Identity();
+		pPickInfo->nNumHits++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the renderer would emit a hit target for this
+//			helper over (roughly) its render box.
+//-----------------------------------------------------------------------------
+static bool IsBoxPickableHelper( CMapClass *pObject )
+{
+	if (pObject->IsMapClass(MAPCLASS_TYPE(CMapAlignedBox)))
+	{
+		return(((CMapAlignedBox *)pObject)->IsVisualElement());
+	}
+
+	return(pObject->IsMapClass(MAPCLASS_TYPE(CMapStudioModel)) ||
+		   pObject->IsMapClass(MAPCLASS_TYPE(CMapSprite)) ||
+		   pObject->IsMapClass(MAPCLASS_TYPE(CWorldTextHelper)) ||
+		   pObject->IsMapClass(MAPCLASS_TYPE(CMapPlayerHullHandle)));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the renderer emits a hit target for this helper
+//			that its box doesn't describe, such as the wireframe of a line.
+//			Picks that reach one of these have to be rendered.
+//-----------------------------------------------------------------------------
+static bool IsRenderPickableHelper( CMapClass *pObject )
+{
+	return(pObject->IsMapClass(MAPCLASS_TYPE(CMapLine)) ||
+		   pObject->IsMapClass(MAPCLASS_TYPE(CMapCylinder)));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether a studio model is drawn as a mesh, which makes the
+//			mesh its hit target rather than its render box.
+//-----------------------------------------------------------------------------
+static bool IsMeshPickableModel( CMapClass *pObject, const BVHPick_t &Pick )
+{
+	return(pObject->IsMapClass(MAPCLASS_TYPE(CMapStudioModel)) && !((CMapStudioModel *)pObject)->IsRenderedAsBox(Pick.vecEye));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Gets the triangles of a studio model's mesh for picking. The render
+//			box has already been hit, so it only has to be rendered when the
+//			model can't give its triangles or draws itself as a wireframe.
+//-----------------------------------------------------------------------------
+static bool GetModelPickTriangles( CMapStudioModel *pModel, BVHPick_t &Pick, CUtlVector<Vector> &Triangles )
+{
+	if ((pModel->GetSelectionState() == SELECT_MODIFY) || !pModel->GetPickTriangles(Triangles))
+	{
+		Pick.bNeedsRender = true;
+		return(false);
+	}
+
+	return(true);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Traces the pick ray against the mesh of a studio model.
+//-----------------------------------------------------------------------------
+static void PickRayStudioModel( CMapStudioModel *pModel, BVHPick_t &Pick )
+{
+	CUtlVector<Vector> Triangles;
+	if (!GetModelPickTriangles(pModel, Pick, Triangles))
+	{
+		return;
+	}
+
+	Ray_t Ray;
+	Ray.Init(Pick.vecEye, Pick.vecEnd);
+
+	float flNearDist = Pick.flNear / DotProduct(Pick.vecDir, Pick.vecForward);
+	float flBestDist = FLT_MAX;
+
+	for (int i = 0; i + 2 < Triangles.Count(); i += 3)
+	{
+		float t = IntersectRayWithTriangle(Ray, Triangles[i], Triangles[i + 1], Triangles[i + 2], false);
+		if (t >= 0)
+		{
+			float flDist = t * Pick.flMaxDist;
+			if ((flDist >= flNearDist) && (flDist < flBestDist))
+			{
+				flBestDist = flDist;
+			}
+		}
+	}
+
+	if (flBestDist != FLT_MAX)
+	{
+		AddBVHPickHit(Pick, pModel, 0, flBestDist * DotProduct(Pick.vecDir, Pick.vecForward));
+		Pick.flNearestDist = min(Pick.flNearestDist, flBestDist);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Traces the pick ray against a solid. The ray is clipped against the
+//			solid's face planes to find the face it enters through, and traced
+//			against the displacement surfaces of any displaced faces.
+//-----------------------------------------------------------------------------
+static void PickRaySolid( CMapSolid *pSolid, BVHPick_t &Pick )
+{
+	bool bMaskFaces = Pick.bMaskDispSolids && pSolid->HasDisp();
+	float flNearDist = Pick.flNear / DotProduct( Pick.vecDir, Pick.vecForward );
+
+	int nBestFace = -1;
+	float flBestDist = Pick.flMaxDist;
+
+	int nFaces = pSolid->GetFaceCount();
+
+	if (!bMaskFaces)
+	{
+		Vector vecMins, vecMaxs;
+		pSolid->GetCullBox(vecMins, vecMaxs);
+		Vector vecCenter = (vecMins + vecMaxs) * 0.5f;
+
+		float flEnter = 0;
+		float flExit = Pick.flMaxDist;
+		int nEnterFace = -1;
+
+		int nFace;
+		for (nFace = 0; nFace < nFaces; nFace++)
+		{
+			CMapFace *pFace = pSolid->GetFace(nFace);
+
+			//
+			// Orient the plane to face out of the solid.
+			//
+			Vector vecNormal = pFace->plane.normal;
+			float flDist = pFace->plane.dist;
+			if (DotProduct(vecNormal, vecCenter) > flDist)
+			{
+				vecNormal = -vecNormal;
+				flDist = -flDist;
+			}
+
+			float flDenom = DotProduct(vecNormal, Pick.vecDir);
+			float flEyeDist = DotProduct(vecNormal, Pick.vecEye) - flDist;
+
+			if (flDenom == 0)
+			{
+				if (flEyeDist > 0)
+				{
+					break;
+				}
+				continue;
+			}
+
+			float t = -flEyeDist / flDenom;
+			if (flDenom < 0)
+			{
+				if (t > flEnter)
+				{
+					flEnter = t;
+					nEnterFace = nFace;
+				}
+			}
+			else if (t < flExit)
+			{
+				flExit = t;
+			}
+
+			if (flEnter > flExit)
+			{
+				break;
+			}
+		}
+
+		//
+		// Faces are single sided, so there is nothing to hit from inside the
+		// solid. Displaced faces draw their displacement instead of the face.
+		//
+		if ((nFace == nFaces) && (nEnterFace != -1) && (flEnter >= flNearDist) && !pSolid->GetFace(nEnterFace)->HasDisp())
+		{
+			nBestFace = nEnterFace;
+			flBestDist = flEnter;
+		}
+	}
+
+	if (pSolid->HasDisp())
+	{
+		for (int nFace = 0; nFace < nFaces; nFace++)
+		{
+			CMapFace *pFace = pSolid->GetFace(nFace);
+			if (!pFace->HasDisp())
+			{
+				continue;
+			}
+
+			Vector vecHitPos, vecHitNormal;
+			if (pFace->TraceLine(vecHitPos, vecHitNormal, Pick.vecEye, Pick.vecEnd))
+			{
+				float flHitDist = DotProduct(vecHitPos - Pick.vecEye, Pick.vecDir);
+				if ((flHitDist >= flNearDist) && (flHitDist < flBestDist))
+				{
+					nBestFace = nFace;
+					flBestDist = flHitDist;
+				}
+			}
+		}
+	}
+
+	if (nBestFace != -1)
+	{
+		AddBVHPickHit(Pick, pSolid, nBestFace, flBestDist * DotProduct(Pick.vecDir, Pick.vecForward));
+		Pick.flNearestDist = min(Pick.flNearestDist, flBestDist);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks an object and its children along the pick ray, applying the
+//			same visibility rules as RenderMapClass.
+//-----------------------------------------------------------------------------
+static void PickRay_r( CMapClass *pObject, BVHPick_t &Pick )
+{
+	if (!pObject->IsVisible())
+	{
+		return;
+	}
+
+	if (pObject->IsMapClass(MAPCLASS_TYPE(CMapInstance)))
+	{
+		Pick.bNeedsRender = true;
+		return;
+	}
+
+	if (((Pick.nFlags & FLAG_OBJECTS_AT_ONLY_SOLIDS) == 0) && IsRenderPickableHelper(pObject))
+	{
+		Pick.bNeedsRender = true;
+		return;
+	}
+
+	if (pObject->IsMapClass(MAPCLASS_TYPE(CMapSolid)))
+	{
+		PickRaySolid((CMapSolid *)pObject, Pick);
+	}
+	else if (((Pick.nFlags & FLAG_OBJECTS_AT_ONLY_SOLIDS) == 0) && IsBoxPickableHelper(pObject))
+	{
+		Vector vecMins, vecMaxs;
+		pObject->GetRender2DBox(vecMins, vecMaxs);
+
+		//
+		// The render box of a model drawn as a mesh is only a broad phase for
+		// the mesh itself.
+		//
+		float flEnter;
+		if (IsMeshPickableModel(pObject, Pick))
+		{
+			if (ClipSegmentToBox(Pick.vecEye, Pick.vecInvDelta, vecMins, vecMaxs, flEnter))
+			{
+				PickRayStudioModel((CMapStudioModel *)pObject, Pick);
+			}
+		}
+		else if (ClipSegmentToBox(Pick.vecEye, Pick.vecInvDelta, vecMins, vecMaxs, flEnter) && (flEnter > 0))
+		{
+			float flDist = flEnter * Pick.flMaxDist;
+			float flViewDepth = flDist * DotProduct(Pick.vecDir, Pick.vecForward);
+			if (flViewDepth >= Pick.flNear)
+			{
+				AddBVHPickHit(Pick, pObject, 0, flViewDepth);
+				Pick.flNearestDist = min(Pick.flNearestDist, flDist);
+			}
+		}
+	}
+
+	const CMapObjectList *pChildren = pObject->GetChildren();
+	FOR_EACH_OBJ( *pChildren, pos )
+	{
+		CMapClass *pChild = pChildren->Element(pos);
+
+		Vector vecMins, vecMaxs;
+		pChild->GetCullBox(vecMins, vecMaxs);
+
+		float flEnter;
+		if (ClipSegmentToBox(Pick.vecEye, Pick.vecInvDelta, vecMins, vecMaxs, flEnter))
+		{
+			PickRay_r(pChild, Pick);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether a polygon lies entirely outside one of the pick
+//			frustum planes.
+//-----------------------------------------------------------------------------
+static bool PolygonOutsidePlanes( const BVHPick_t &Pick, const Vector *pPoints, int nPoints )
+{
+	for (int nPlane = 0; nPlane < 6; nPlane++)
+	{
+		const Vector4D &Plane = Pick.Planes[nPlane];
+
+		int nPoint;
+		for (nPoint = 0; nPoint < nPoints; nPoint++)
+		{
+			if (DotProduct(Plane.AsVector3D(), pPoints[nPoint]) < Plane.w)
+			{
+				break;
+			}
+		}
+
+		if (nPoint == nPoints)
+		{
+			return(true);
+		}
+	}
+
+	return(false);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks the mesh of a studio model inside the pick frustum. The model
+//			is hit by the nearest triangle that reaches into the frustum.
+//-----------------------------------------------------------------------------
+static void PickFrustumStudioModel( CMapStudioModel *pModel, BVHPick_t &Pick )
+{
+	CUtlVector<Vector> Triangles;
+	if (!GetModelPickTriangles(pModel, Pick, Triangles))
+	{
+		return;
+	}
+
+	float flBestDepth = FLT_MAX;
+
+	for (int i = 0; i + 2 < Triangles.Count(); i += 3)
+	{
+		if (PolygonOutsidePlanes(Pick, &Triangles[i], 3))
+		{
+			continue;
+		}
+
+		for (int nPoint = 0; nPoint < 3; nPoint++)
+		{
+			float flDepth = DotProduct(Triangles[i + nPoint] - Pick.vecEye, Pick.vecForward);
+			flBestDepth = min(flBestDepth, flDepth);
+		}
+	}
+
+	if (flBestDepth != FLT_MAX)
+	{
+		AddBVHPickHit(Pick, pModel, 0, flBestDepth);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks an object and its children inside the pick frustum. Each
+//			solid reports its nearest face that reaches into the frustum.
+//-----------------------------------------------------------------------------
+static void PickFrustum_r( CMapClass *pObject, BVHPick_t &Pick )
+{
+	if (!pObject->IsVisible())
+	{
+		return;
+	}
+
+	if (pObject->IsMapClass(MAPCLASS_TYPE(CMapInstance)))
+	{
+		Pick.bNeedsRender = true;
+		return;
+	}
+
+	if (((Pick.nFlags & FLAG_OBJECTS_AT_ONLY_SOLIDS) == 0) && IsRenderPickableHelper(pObject))
+	{
+		Pick.bNeedsRender = true;
+		return;
+	}
+
+	if (pObject->IsMapClass(MAPCLASS_TYPE(CMapSolid)))
+	{
+		CMapSolid *pSolid = (CMapSolid *)pObject;
+		bool bMaskFaces = Pick.bMaskDispSolids && pSolid->HasDisp();
+
+		int nBestFace = -1;
+		float flBestDepth = FLT_MAX;
+
+		int nFaces = pSolid->GetFaceCount();
+		for (int nFace = 0; nFace < nFaces; nFace++)
+		{
+			CMapFace *pFace = pSolid->GetFace(nFace);
+			if (bMaskFaces && !pFace->HasDisp())
+			{
+				continue;
+			}
+
+			if (PolygonOutsidePlanes(Pick, pFace->Points, pFace->nPoints))
+			{
+				continue;
+			}
+
+			for (int nPoint = 0; nPoint < pFace->nPoints; nPoint++)
+			{
+				float flDepth = DotProduct(pFace->Points[nPoint] - Pick.vecEye, Pick.vecForward);
+				if (flDepth < flBestDepth)
+				{
+					nBestFace = nFace;
+					flBestDepth = flDepth;
+				}
+			}
+		}
+
+		if (nBestFace != -1)
+		{
+			AddBVHPickHit(Pick, pSolid, nBestFace, flBestDepth);
+		}
+	}
+	else if (((Pick.nFlags & FLAG_OBJECTS_AT_ONLY_SOLIDS) == 0) && IsBoxPickableHelper(pObject))
+	{
+		Vector vecMins, vecMaxs;
+		pObject->GetRender2DBox(vecMins, vecMaxs);
+
+		if (BoxOutsidePlanes(Pick.Planes, 6, vecMins, vecMaxs))
+		{
+			// Nothing to pick.
+		}
+		else if (IsMeshPickableModel(pObject, Pick))
+		{
+			PickFrustumStudioModel((CMapStudioModel *)pObject, Pick);
+		}
+		else
+		{
+			Vector vecNear;
+			vecNear.x = (Pick.vecForward.x > 0) ? vecMins.x : vecMaxs.x;
+			vecNear.y = (Pick.vecForward.y > 0) ? vecMins.y : vecMaxs.y;
+			vecNear.z = (Pick.vecForward.z > 0) ? vecMins.z : vecMaxs.z;
+
+			AddBVHPickHit(Pick, pObject, 0, DotProduct(vecNear - Pick.vecEye, Pick.vecForward));
+		}
+	}
+
+	const CMapObjectList *pChildren = pObject->GetChildren();
+	FOR_EACH_OBJ( *pChildren, pos )
+	{
+		CMapClass *pChild = pChildren->Element(pos);
+
+		Vector vecMins, vecMaxs;
+		pChild->GetCullBox(vecMins, vecMaxs);
+
+		if (!BoxOutsidePlanes(Pick.Planes, 6, vecMins, vecMaxs))
+		{
+			PickFrustum_r(pChild, Pick);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Callback comparison function for sorting BVH ray candidates front
+//			to back.
+//-----------------------------------------------------------------------------
+static int _CompareRayHits(const void *pHit1, const void *pHit2)
+{
+	float flEnter1 = ((MapObjectRayHit_t *)pHit1)->m_flEnterFraction;
+	float flEnter2 = ((MapObjectRayHit_t *)pHit2)->m_flEnterFraction;
+
+	if (flEnter1 < flEnter2)
+	{
+		return(-1);
+	}
+
+	if (flEnter1 > flEnter2)
+	{
+		return(1);
+	}
+
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks objects on the CPU using the world's object BVH. Solids are
+//			picked exactly, face by face, and studio models drawn as meshes
+//			triangle by triangle; other helpers are picked by their render
+//			boxes. Parameters are as for ObjectsAt.
+// Output : Returns the number of hits, as ObjectsAt does, or -1 if the pick
+//			needs to be done by rendering (tools that draw pick targets of
+//			their own, instances, wireframe helpers, animated models,
+//			manifests, orthographic cameras).
+//-----------------------------------------------------------------------------
+int CRender3D::ObjectsAtBVH( float x, float y, float fWidth, float fHeight, HitInfo_t *pObjects, int nMaxObjects, unsigned int nFlags )
+{
+	CMapDoc *pDoc = m_pView->GetMapDoc();
+	if ((pDoc == NULL) || (pDoc->GetManifest() != NULL))
+	{
+		return(-1);
+	}
+
+	CMapWorld *pWorld = pDoc->GetMapWorld();
+	CCamera *pCamera = GetCamera();
+	if ((pWorld == NULL) || (pCamera == NULL) || pCamera->IsOrthographic())
+	{
+		return(-1);
+	}
+
+	//
+	// The overlay tool draws handles on the selected overlays, and the selection
+	// tool sometimes draws itself as a solid box to occlude what is behind it.
+	//
+	CBaseTool *pTool = pDoc->GetTools()->GetActiveTool();
+	if (pTool != NULL)
+	{
+		ToolID_t eToolID = pTool->GetToolID();
+		if (eToolID == TOOL_OVERLAY)
+		{
+			return(-1);
+		}
+
+		if ((eToolID == TOOL_POINTER) && ((Selection3D *)pTool)->IsDrawingAsSolidBox())
+		{
+			return(-1);
+		}
+	}
+
+	BVHPick_t Pick;
+	pCamera->GetViewPoint(Pick.vecEye);
+	pCamera->GetViewForward(Pick.vecForward);
+	Pick.flNear = pCamera->GetNearClip();
+	Pick.flFar = pCamera->GetFarClip();
+	Pick.flNearestDist = FLT_MAX;
+	Pick.nFlags = nFlags;
+	Pick.bMaskDispSolids = pDoc->IsDispSolidDrawMask();
+	Pick.bReverseDepth = m_RenderState.bReverseSelection;
+	Pick.bNeedsRender = false;
+	Pick.pPickInfo = &m_Pick;
+
+	m_Pick.pHitsDest = pObjects;
+	m_Pick.nMaxHits = min(nMaxObjects, MAX_PICK_HITS);
+	m_Pick.nNumHits = 0;
+	m_Pick.m_nFlags = nFlags;
+
+	const CMapObjectBVH *pBVH = pWorld->ObjectBVH_Get();
+
+	if ((fWidth <= 1) && (fHeight <= 1))
+	{
+		//
+		// Cast a ray through the pixel out to the far plane.
+		//
+		Vector vecStart, vecEnd;
+		pCamera->BuildRay(Vector2D(x, y), vecStart, vecEnd);
+		Pick.vecDir = vecEnd - vecStart;
+		VectorNormalize(Pick.vecDir);
+
+		float flCos = DotProduct(Pick.vecDir, Pick.vecForward);
+		if (flCos <= 0)
+		{
+			return(0);
+		}
+
+		Pick.flMaxDist = Pick.flFar / flCos;
+		Pick.vecEnd = Pick.vecEye + Pick.vecDir * Pick.flMaxDist;
+
+		Vector vecDelta = Pick.vecEnd - Pick.vecEye;
+		for (int nAxis = 0; nAxis < 3; nAxis++)
+		{
+			Pick.vecInvDelta[nAxis] = (vecDelta[nAxis] != 0.0f) ? 1.0f / vecDelta[nAxis] : FLT_MAX;
+		}
+
+		CUtlVector<MapObjectRayHit_t> Candidates;
+		pBVH->EnumerateRay(Pick.vecEye, Pick.vecEnd, Candidates);
+		if (Candidates.Count() > 1)
+		{
+			qsort(Candidates.Base(), Candidates.Count(), sizeof(Candidates[0]), _CompareRayHits);
+		}
+
+		for (int i = 0; i < Candidates.Count(); i++)
+		{
+			//
+			// When only the nearest hit is wanted, nothing beyond it can matter.
+			//
+			if ((m_Pick.nMaxHits == 1) && (Candidates[i].m_flEnterFraction * Pick.flMaxDist > Pick.flNearestDist))
+			{
+				break;
+			}
+
+			PickRay_r(Candidates[i].m_pObject, Pick);
+			if (Pick.bNeedsRender)
+			{
+				return(-1);
+			}
+		}
+	}
+	else
+	{
+		//
+		// Build a frustum through the rectangle, centered on (x, y) as the
+		// pick matrix is, bounded by the near and far planes.
+		//
+		float fHalfWidth = fWidth * 0.5f;
+		float fHalfHeight = fHeight * 0.5f;
+
+		Vector2D vecCorners[4] =
+		{
+			Vector2D(x - fHalfWidth, y - fHalfHeight),
+			Vector2D(x + fHalfWidth, y - fHalfHeight),
+			Vector2D(x + fHalfWidth, y + fHalfHeight),
+			Vector2D(x - fHalfWidth, y + fHalfHeight),
+		};
 
-	m_Pick.fX = x;
-	m_Pick.fY = height - (y + 1);
-	m_Pick.fWidth = fWidth;
-	m_Pick.fHeight = fHeight;
-	m_Pick.pHitsDest = pObjects;
-	m_Pick.nMaxHits = min(nMaxObjects, MAX_PICK_HITS);
-	m_Pick.nNumHits = 0;
+		Vector vecStart, vecEnd;
+		Vector vecDirs[4];
+		for (int i = 0; i < 4; i++)
+		{
+			pCamera->BuildRay(vecCorners[i], vecStart, vecEnd);
+			vecDirs[i] = vecEnd - vecStart;
+		}
 
-	if (!m_RenderState.bReverseSelection)
+		pCamera->BuildRay(Vector2D(x, y), vecStart, vecEnd);
+		Vector vecCenterDir = vecEnd - vecStart;
+
+		for (int i = 0; i < 4; i++)
+		{
+			Vector vecNormal = CrossProduct(vecDirs[i], vecDirs[(i + 1) % 4]);
+			VectorNormalize(vecNormal);
+			if (DotProduct(vecNormal, vecCenterDir) > 0)
+			{
+				vecNormal = -vecNormal;
+			}
+
+			Pick.Planes[i].Init(vecNormal.x, vecNormal.y, vecNormal.z, DotProduct(vecNormal, Pick.vecEye));
+		}
+
+		float flEyeDepth = DotProduct(Pick.vecForward, Pick.vecEye);
+		Pick.Planes[4].Init(-Pick.vecForward.x, -Pick.vecForward.y, -Pick.vecForward.z, -(flEyeDepth + Pick.flNear));
+		Pick.Planes[5].Init(Pick.vecForward.x, Pick.vecForward.y, Pick.vecForward.z, flEyeDepth + Pick.flFar);
+
+		CUtlVector<CMapClass *> Candidates;
+		pBVH->EnumerateFrustum(Pick.Planes, 6, Candidates);
+
+		for (int i = 0; i < Candidates.Count(); i++)
+		{
+			PickFrustum_r(Candidates[i], Pick);
+			if (Pick.bNeedsRender)
+			{
+				return(-1);
+			}
+		}
+	}
+
+	SortPickHits();
+
+	return(m_Pick.nNumHits);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Times single pixel picks over a grid of points in the view with both
+//			the render-based and the BVH picking paths and reports how they
+//			compare to the console. Run by the -pickbenchmark command line option.
+// Input  : nPicksPerAxis - Number of grid points along each side of the view.
+//-----------------------------------------------------------------------------
+void CRender3D::BenchmarkPicking( int nPicksPerAxis )
+{
+	int nWidth, nHeight;
+	GetCamera()->GetViewPort(nWidth, nHeight);
+
+	int nPicks = 0;
+	int nAgree = 0;
+	int nFallbacks = 0;
+	double flRenderTime = 0;
+	double flBVHTime = 0;
+
+	for (int nY = 0; nY < nPicksPerAxis; nY++)
 	{
-		m_Pick.uLastZ = 0xFFFFFFFF;
+		for (int nX = 0; nX < nPicksPerAxis; nX++)
+		{
+			float x = (nX + 0.5f) * nWidth / nPicksPerAxis;
+			float y = (nY + 0.5f) * nHeight / nPicksPerAxis;
+
+			HitInfo_t RenderHit;
+			HitInfo_t BVHHit;
+			V_memset(&RenderHit, 0, sizeof(RenderHit));
+			V_memset(&BVHHit, 0, sizeof(BVHHit));
+
+			double flStart = Plat_FloatTime();
+			int nRenderHits = ObjectsAtRender(x, y, 1, 1, &RenderHit, 1, 0);
+			double flMiddle = Plat_FloatTime();
+			int nBVHHits = ObjectsAtBVH(x, y, 1, 1, &BVHHit, 1, 0);
+			double flEnd = Plat_FloatTime();
+
+			if (nBVHHits < 0)
+			{
+				nFallbacks++;
+				continue;
+			}
+
+			nPicks++;
+			flRenderTime += flMiddle - flStart;
+			flBVHTime += flEnd - flMiddle;
+
+			if ((nRenderHits == 0) && (nBVHHits == 0))
+			{
+				nAgree++;
+			}
+			else if ((nRenderHits != 0) && (nBVHHits != 0) && (RenderHit.pObject == BVHHit.pObject) && (RenderHit.uData == BVHHit.uData))
+			{
+				nAgree++;
+			}
+		}
 	}
-	else
+
+	if (nPicks == 0)
 	{
-		m_Pick.uLastZ = 0;
+		Msg("Pick benchmark: the BVH can't pick in this view (%d picks fell back to rendering).\n", nFallbacks);
+		return;
 	}
 
-	m_Pick.m_nFlags = nFlags;
-	m_Pick.bPicking = true;
+	double flRenderMS = flRenderTime * 1000.0 / nPicks;
+	double flBVHMS = flBVHTime * 1000.0 / nPicks;
 
-	EditorRenderMode_t eOldMode = GetDefaultRenderMode();
-	SetDefaultRenderMode( RENDER_MODE_TEXTURED );
+	Msg("Pick benchmark: %d picks, render %.3f ms/pick, BVH %.3f ms/pick (%.1fx), %d agree, %d fell back to rendering.\n",
+		nPicks, flRenderMS, flBVHMS, (flBVHMS > 0) ? flRenderMS / flBVHMS : 0.0, nAgree, nFallbacks);
+}
 
-	bool bOldLightPreview = IsInLightingPreview();
-	SetInLightingPreview( false );
+//-----------------------------------------------------------------------------
+// Purpose: Times frustum culling the world's root level objects one by one and
+//			through the world's BVH, and times building and updating a copy of
+//			the BVH. Results go to the console. Run by the -cullbenchmark command
+//			line option.
+// Input  : nIterations - Number of times to repeat each measurement.
+//-----------------------------------------------------------------------------
+void CRender3D::BenchmarkCulling( int nIterations )
+{
+	CMapDoc *pDoc = m_pView->GetMapDoc();
+	CMapWorld *pWorld = pDoc->GetMapWorld();
+	if (pDoc->GetManifest() != NULL)
+	{
+		pWorld = pDoc->GetManifest()->GetManifestWorld();
+	}
 
-	Render();
+	if (pWorld == NULL)
+	{
+		return;
+	}
 
-	SetDefaultRenderMode( eOldMode );
-	SetInLightingPreview( bOldLightPreview );
+	CUtlVector<CMapClass *> Objects;
+	const CMapObjectList *pChildren = pWorld->GetChildren();
+	FOR_EACH_OBJ( *pChildren, pos )
+	{
+		Objects.AddToTail(pChildren->Element(pos));
+	}
 
-	m_Pick.bPicking = false;
+	if (Objects.Count() == 0)
+	{
+		Msg("Cull benchmark: the map is empty.\n");
+		return;
+	}
 
-	CMatRenderContextPtr pRenderContext( MaterialSystemInterface() );
-	pRenderContext->SelectionMode(false);
+	//
+	// Test every object against the frustum.
+	//
+	int nVisible = 0;
+	double flStart = Plat_FloatTime();
+	for (int nIteration = 0; nIteration < nIterations; nIteration++)
+	{
+		nVisible = 0;
+		for (int i = 0; i < Objects.Count(); i++)
+		{
+			Vector vecMins;
+			Vector vecMaxs;
+			Objects[i]->GetCullBox(vecMins, vecMaxs);
+			if (IsBoxVisible(vecMins, vecMaxs) != VIS_NONE)
+			{
+				nVisible++;
+			}
+		}
+	}
+	double flObjectTime = Plat_FloatTime() - flStart;
 
-	return(m_Pick.nNumHits);
+	//
+	// Walk the BVH the way RenderTree does.
+	//
+	CUtlVector<CMapClass *> Visible;
+	flStart = Plat_FloatTime();
+	for (int nIteration = 0; nIteration < nIterations; nIteration++)
+	{
+		Visible.RemoveAll();
+		pWorld->ObjectBVH_Get()->EnumerateFrustum(m_FrustumPlanes, 6, Visible);
+	}
+	double flBVHTime = Plat_FloatTime() - flStart;
+
+	//
+	// Build and update a copy so that the world's tree is left alone.
+	//
+	CMapObjectBVH BVH;
+	flStart = Plat_FloatTime();
+	BVH.Build(Objects.Base(), Objects.Count());
+	double flBuildTime = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for (int i = 0; i < Objects.Count(); i++)
+	{
+		BVH.RemoveObject(Objects[i]);
+		BVH.AddObject(Objects[i]);
+	}
+	double flReinsertTime = Plat_FloatTime() - flStart;
+
+	double flObjectMS = flObjectTime * 1000.0 / nIterations;
+	double flBVHMS = flBVHTime * 1000.0 / nIterations;
+
+	Msg("Cull benchmark: %d objects, %d visible (BVH %d). Per object %.3f ms, BVH %.3f ms (%.1fx).\n",
+		Objects.Count(), nVisible, Visible.Count(), flObjectMS, flBVHMS, (flBVHMS > 0) ? flObjectMS / flBVHMS : 0.0);
+	Msg("Cull benchmark: BVH build %.2f ms, remove and reinsert %.2f us/object.\n",
+		flBuildTime * 1000.0, flReinsertTime * 1000000.0 / Objects.Count());
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes out the next g-buffers sent to the lighting preview, so that
+//			they can be fed to the -lpreviewbenchmark command line option. Run
+//			by the -lpreviewrecord command line option.
+//-----------------------------------------------------------------------------
+void CRender3D::RecordLightingPreviewGBuffers(void)
+{
+	if (m_eCurrentRenderMode != RENDER_MODE_LIGHT_PREVIEW_RAYTRACED)
+	{
+		Msg(mwStatus, "Switch the view to the ray traced lighting preview to record its g-buffers.");
+		return;
+	}
+
+	// force the g-buffers to be sent again even though the view hasn't moved
+	m_bRecordLPreviewGBuffers = true;
+	m_nLastLPreviewWidth = -1;
+	m_pView->UpdateView(MAPVIEW_UPDATE_OBJECTS);
+	Msg(mwStatus, "Recording the lighting preview g-buffers and shadow geometry as lpreview_gbuffer_*.");
 }
 
 static ITexture *SetRenderTargetNamed(int nWhichTarget, char const *pRtName)
@@ -970,40 +1929,173 @@ bool CompareLightPreview_Lights(CLightPreview_Light const &a, CLightPreview_Ligh
 	return (a.m_flDistanceToEye > b.m_flDistanceToEye);
 }
 
+// crc of the triangles of each object the lighting preview thread currently has, by object id
+static CUtlHashtable<int, CRC32_t> s_ShadowChunkCRCs;
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds the triangles of a visible object to the chunk for its id.
+//			Objects sharing an id end up in the same chunk.
+//-----------------------------------------------------------------------------
+static void AddShadowChunk( CMapClass *pObject, CUtlVector<LightingPreviewGeomChunk_t> &Chunks, CUtlHashtable<int, int> &ChunkForID )
+{
+	int nChunk;
+	UtlHashHandle_t h = ChunkForID.Find( pObject->GetID() );
+	if ( h == ChunkForID.InvalidHandle() )
+	{
+		nChunk = Chunks.AddToTail();
+		Chunks[nChunk].m_nObjectID = pObject->GetID();
+		ChunkForID.Insert( pObject->GetID(), nChunk );
+	}
+	else
+		nChunk = ChunkForID.Element( h );
+
+	if ( pObject->IsVisible() )
+		pObject->AddShadowingTriangles( Chunks[nChunk].m_Triangles );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sends the lighting preview the triangles of the objects which were
+//			added, changed or removed since the last call. Only a reset (first
+//			send or a different world) or an undo regenerates the whole world.
+//-----------------------------------------------------------------------------
 void CRender3D::SendShadowTriangles( void )
 {
-	static int LastSendTimeStamp=-1;
-	if ( GetUpdateCounter( EVTYPE_FACE_CHANGED ) != LastSendTimeStamp )
+	static CMapWorld *s_pLastWorld = NULL;
+
+	CMapDoc *pDoc = m_pView->GetMapDoc();
+	CMapWorld *pWorld = pDoc->GetMapWorld();
+
+	if ( !pWorld )
+		return;
+
+	bool bReset = ( pWorld != s_pLastWorld );
+	if ( bReset )
 	{
-		LastSendTimeStamp = GetUpdateCounter( EVTYPE_FACE_CHANGED );
-		CUtlVector<Vector> *tri_list=new CUtlVector<Vector>;
-		CMapDoc *pDoc = m_pView->GetMapDoc();
-		CMapWorld *pWorld = pDoc->GetMapWorld();
+		s_pLastWorld = pWorld;
+		pWorld->ShadowList_MarkAllDirty();
+	}
 
-		if ( !pWorld )
-			return;
+	CMapObjectList Dirty;
+	CUtlVector<int> RemovedIDs;
+	bool bAllDirty = pWorld->ShadowList_GetChanges( Dirty, RemovedIDs );
+	if ( !bAllDirty && !Dirty.Count() && !RemovedIDs.Count() )
+		return;
 
-		if (g_pLPreviewOutputBitmap)
-			delete g_pLPreviewOutputBitmap;
-		g_pLPreviewOutputBitmap = NULL;
-		EnumChildrenPos_t pos;
+	if (g_pLPreviewOutputBitmap)
+		delete g_pLPreviewOutputBitmap;
+	g_pLPreviewOutputBitmap = NULL;
+
+	CUtlVector<LightingPreviewGeomChunk_t> *pChunks = new CUtlVector<LightingPreviewGeomChunk_t>;
+	CUtlHashtable<int, int> ChunkForID;
+	EnumChildrenPos_t pos;
+	if ( bAllDirty )
+	{
 		CMapClass *pChild = pWorld->GetFirstDescendent( pos );
 		while ( pChild )
 		{
-			if (pChild->IsVisible())
-				pChild->AddShadowingTriangles( *tri_list );
+			AddShadowChunk( pChild, *pChunks, ChunkForID );
 			pChild = pWorld->GetNextDescendent( pos );
 		}
-		if ( tri_list->Count() )
+
+		// everything the preview has which isn't in the world anymore goes away
+		FOR_EACH_HASHTABLE( s_ShadowChunkCRCs, it )
+		{
+			RemovedIDs.AddToTail( s_ShadowChunkCRCs.Key( it ) );
+		}
+	}
+	else
+	{
+		CUtlHashtable<CMapClass *, empty_t, PointerHashFunctor> DirtySet;
+		FOR_EACH_OBJ( Dirty, i )
+		{
+			DirtySet.Insert( Dirty.Element( i ) );
+		}
+
+		FOR_EACH_OBJ( Dirty, i )
+		{
+			// skip objects which have left the world, and objects whose parent is
+			// regenerated anyway so their triangles aren't added twice
+			CMapClass *pObject = Dirty.Element( i );
+			bool bInWorld = false;
+			bool bParentDirty = false;
+			for ( CMapClass *pParent = pObject; pParent; pParent = pParent->GetParent() )
+			{
+				if ( pParent == pWorld )
+				{
+					bInWorld = true;
+					break;
+				}
+				if ( ( pParent != pObject ) && ( DirtySet.Find( pParent ) != DirtySet.InvalidHandle() ) )
+					bParentDirty = true;
+			}
+			if ( !bInWorld || bParentDirty )
+				continue;
+
+			if ( pObject != pWorld )
+				AddShadowChunk( pObject, *pChunks, ChunkForID );
+			CMapClass *pChild = pObject->GetFirstDescendent( pos );
+			while ( pChild )
+			{
+				AddShadowChunk( pChild, *pChunks, ChunkForID );
+				pChild = pObject->GetNextDescendent( pos );
+			}
+		}
+
+		// objects which were regenerated but don't cast shadows anymore
+		for ( int i = 0; i < pChunks->Count(); i++ )
+		{
+			if ( pChunks->Element( i ).m_Triangles.IsEmpty() )
+				RemovedIDs.AddToTail( pChunks->Element( i ).m_nObjectID );
+		}
+	}
+
+	// objects the preview has which are gone or don't cast shadows anymore. An id
+	// which is still in the world with triangles was only moved or regenerated.
+	CUtlVector<int> DroppedIDs;
+	for ( int i = 0; i < RemovedIDs.Count(); i++ )
+	{
+		UtlHashHandle_t h = ChunkForID.Find( RemovedIDs[i] );
+		if ( ( h == ChunkForID.InvalidHandle() ) || pChunks->Element( ChunkForID.Element( h ) ).m_Triangles.IsEmpty() )
+			DroppedIDs.AddToTail( RemovedIDs[i] );
+	}
+
+	if ( bReset )
+		s_ShadowChunkCRCs.RemoveAll();
+
+	// keep only the chunks which are new or have changed
+	for ( int i = pChunks->Count() - 1; i >= 0; i-- )
+	{
+		CUtlVector<Vector> &tris = pChunks->Element( i ).m_Triangles;
+		if ( tris.IsEmpty() )
 		{
-			MessageToLPreview msg( LPREVIEW_MSG_GEOM_DATA );
-			msg.m_pShadowTriangleList = tri_list;
-			g_HammerToLPreviewMsgQueue.QueueMessage( msg );
+			pChunks->FastRemove( i );
+			continue;
 		}
+		CRC32_t crc = CRC32_ProcessSingleBuffer( tris.Base(), tris.Count() * sizeof( Vector ) );
+		UtlHashHandle_t h = s_ShadowChunkCRCs.Find( pChunks->Element( i ).m_nObjectID );
+		if ( h == s_ShadowChunkCRCs.InvalidHandle() )
+			s_ShadowChunkCRCs.Insert( pChunks->Element( i ).m_nObjectID, crc );
+		else if ( s_ShadowChunkCRCs.Element( h ) != crc )
+			s_ShadowChunkCRCs.Element( h ) = crc;
 		else
-			delete tri_list;
+			pChunks->FastRemove( i );
+	}
+
+	for ( int i = 0; i < DroppedIDs.Count(); i++ )
+	{
+		if ( s_ShadowChunkCRCs.Remove( DroppedIDs[i] ) )
+			pChunks->Element( pChunks->AddToTail() ).m_nObjectID = DroppedIDs[i];
 	}
 
+	if ( pChunks->Count() || bReset )
+	{
+		MessageToLPreview msg( LPREVIEW_MSG_GEOM_DATA );
+		msg.m_pShadowChunks = pChunks;
+		msg.m_bResetGeometry = bReset;
+		g_HammerToLPreviewMsgQueue.QueueMessage( msg );
+	}
+	else
+		delete pChunks;
 }
 
 
@@ -1420,6 +2512,26 @@ void CRender3D::SendGBuffersToLightingThread( int nTargetWidth, int nTargetHeigh
 	delete[] pTmpData;
 	n_gbufs_queued++;
 	GetCamera()->GetViewPoint( Msg.m_EyePosition );
+	if ( m_bRecordLPreviewGBuffers )
+	{
+		m_bRecordLPreviewGBuffers = false;
+
+		// record the whole world's shadow geometry too, so the benchmark traces the same occluders
+		CUtlVector<LightingPreviewGeomChunk_t> ShadowChunks;
+		CMapWorld *pWorld = m_pView->GetMapDoc()->GetMapWorld();
+		if ( pWorld )
+		{
+			CUtlHashtable<int, int> ChunkForID;
+			EnumChildrenPos_t pos;
+			CMapClass *pChild = pWorld->GetFirstDescendent( pos );
+			while ( pChild )
+			{
+				AddShadowChunk( pChild, ShadowChunks, ChunkForID );
+				pChild = pWorld->GetNextDescendent( pos );
+			}
+		}
+		::RecordLightingPreviewGBuffers( "lpreview_gbuffer", Msg.m_pDefferedRenderingBMs, Msg.m_EyePosition, ShadowChunks );
+	}
 	Msg.m_nBitmapGenerationCounter = g_nBitmapGenerationCounter;
 	g_HammerToLPreviewMsgQueue.QueueMessage( Msg );
 }
@@ -1436,30 +2548,7 @@ void CRender3D::EndRenderFrame(void)
 	{
 		pRenderContext->Flush();
 
-		//
-		// Some OpenGL drivers, such as the ATI Rage Fury Max, return selection buffer Z values
-		// in reverse order. For these cards, we must reverse the selection order.
-		//
-		if (m_Pick.nNumHits > 1)
-		{
-			if (!m_RenderState.bReverseSelection)
-			{
-				qsort(m_Pick.Hits, m_Pick.nNumHits, sizeof(m_Pick.Hits[0]), _CompareHits);
-			}
-			else
-			{
-				qsort(m_Pick.Hits, m_Pick.nNumHits, sizeof(m_Pick.Hits[0]), _CompareHitsReverse);
-			}
-		}
-
-		//
-		// Copy the requested number of nearest hits into the destination buffer.
-		//
-		int nHitsToCopy = min(m_Pick.nNumHits, m_Pick.nMaxHits);
-		if (nHitsToCopy != 0)
-		{
-			memcpy(m_Pick.pHitsDest, m_Pick.Hits, sizeof(m_Pick.Hits[0]) * nHitsToCopy);
-		}
+		SortPickHits();
 	}
 
 	//
@@ -1843,7 +2932,7 @@ void CRender3D::Render(void)
 	m_TranslucentSortRendering = true;
 
 	//
-	// Render the world using octree culling.
+	// Render the world using BVH culling.
 	//
 
 	PrepareInstanceStencil();
@@ -1858,7 +2947,7 @@ void CRender3D::Render(void)
 		RenderTree( pMapWorld );
 	}
 	//
-	// Render the world without octree culling.
+	// Render the world without culling.
 	//
 	else
 	{
@@ -2733,80 +3822,6 @@ void CRender3D::Preload(CMapClass *pParent)
 }
 
 
-//-----------------------------------------------------------------------------
-// Purpose: Renders all objects in this node if this node is visible.
-// Input  : pNode - The node to render.
-//			bForce - If true, don't check for visibility, just render the node
-//				and all of its children.
-//-----------------------------------------------------------------------------
-void CRender3D::RenderNode(CCullTreeNode *pNode, bool bForce )
-{
-	//
-	// Render all child nodes first.
-	//
-	CCullTreeNode *pChild;
-	int nChildren = pNode->GetChildCount();
-	if (nChildren != 0)
-	{
-		for (int nChild = 0; nChild < nChildren; nChild++)
-		{
-			pChild = pNode->GetCullTreeChild(nChild);
-			Assert(pChild != NULL);
-
-			if (pChild != NULL)
-			{
-				//
-				// Only bother checking nodes with children or objects.
-				//
-				if ((pChild->GetChildCount() != 0) || (pChild->GetObjectCount() != 0))
-				{
-					bool bForceThisChild = bForce;
-					Visibility_t eVis = VIS_NONE;
-
-					if (!bForceThisChild)
-					{
-						Vector vecMins;
-						Vector vecMaxs;
-						pChild->GetBounds(vecMins, vecMaxs);
-						eVis = IsBoxVisible(vecMins, vecMaxs);
-						if (eVis == VIS_TOTAL)
-						{
-							bForceThisChild = true;
-						}
-					}
-
-					if ((bForceThisChild) || (eVis != VIS_NONE))
-					{
-						RenderNode(pChild, bForceThisChild);
-					}
-				}
-			}
-		}
-	}
-	else
-	{
-		//
-		// Now render the contents of this node.
-		//
-		CMapClass *pObject;
-		int nObjects = pNode->GetObjectCount();
-		for (int nObject = 0; nObject < nObjects; nObject++)
-		{
-			pObject = pNode->GetCullTreeObject(nObject);
-			Assert(pObject != NULL);
-
-			Vector vecMins;
-			Vector vecMaxs;
-			pObject->GetCullBox(vecMins, vecMaxs);
-			if (IsBoxVisible(vecMins, vecMaxs) != VIS_NONE)
-			{
-				RenderMapClass(pObject);
-			}
-		}
-	}
-}
-
-
 void CRender3D::RenderCrossHair()
 {
 	if ( m_eCurrentRenderMode == RENDER_MODE_LIGHT_PREVIEW_RAYTRACED )
@@ -2891,20 +3906,15 @@ void CRender3D::RenderTree( CMapWorld *pWorld )
 	}
 
 	//
-	// Recursively traverse the culling tree, rendering visible nodes.
+	// Find the root level objects in the view frustum with the world's BVH
+	// and render them.
 	//
-	CCullTreeNode *pTree = pWorld->CullTree_GetCullTree();
-	if (pTree != NULL)
-	{
-		Vector vecMins;
-		Vector vecMaxs;
-		pTree->GetBounds(vecMins, vecMaxs);
-		Visibility_t eVis = IsBoxVisible(vecMins, vecMaxs);
+	CUtlVector<CMapClass *> Objects;
+	pWorld->ObjectBVH_Get()->EnumerateFrustum(m_FrustumPlanes, 6, Objects);
 
-		if (eVis != VIS_NONE)
-		{
-			RenderNode(pTree, eVis == VIS_TOTAL);
-		}
+	for (int i = 0; i < Objects.Count(); i++)
+	{
+		RenderMapClass(Objects[i]);
 	}
 }
 
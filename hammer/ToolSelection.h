@@ -37,6 +37,7 @@ public:
 
 	inline bool IsBoxSelecting();
 	inline bool IsLogicalBoxSelecting();
+	inline bool IsDrawingAsSolidBox();
 	void EndBoxSelection();
 
 	// Start, end logical selection
@@ -158,5 +159,10 @@ inline bool Selection3D::IsLogicalBoxSelecting()
 	return m_bInLogicalBoxSelection;
 }
 
+inline bool Selection3D::IsDrawingAsSolidBox()
+{
+	return m_bDrawAsSolidBox;
+}
+
 
 #endif // SELECTION3D_H
\ No newline at end of file
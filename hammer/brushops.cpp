@@ -33,8 +33,6 @@
 
 float		lightaxis[3] = {1, 0.6f, 0.75f};
 
-const int MAX_POINTS_ON_WINDING	= 128;
-
 
 void Error(char* fmt, ...)
 {
@@ -188,7 +186,7 @@ winding_t *ClipWinding (winding_t *in, PLANE *split)
 
 	if (!counts[0])
 	{
-		free (in);
+		FreeWinding (in);
 		return NULL;
 	}
 	if (!counts[1])
@@ -248,17 +246,112 @@ winding_t *ClipWinding (winding_t *in, PLANE *split)
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Creates a huge quadrilateral winding given a plane.
-// Input  : pPlane - Plane normal and distance to use when creating the winding.
-// Output : Returns a winding with 4 points.
+// Purpose: Clips a set of points to a plane, keeping the points on the positive
+//			side. Works like ClipWinding but writes the result to a buffer
+//			supplied by the caller instead of allocating a new winding.
+// Input  : pIn - Points to clip.
+//			nInPoints - Number of points to clip.
+//			split - Plane to clip against.
+//			pOut - Receives the clipped points. Must not overlap pIn.
+// Output : Returns the number of points written to pOut, zero if the points
+//			were clipped away entirely.
+//-----------------------------------------------------------------------------
+int ClipWindingPoints(const Vector *pIn, int nInPoints, const PLANE *split, Vector *pOut)
+{
+	float	dists[MAX_POINTS_ON_WINDING + 1];
+	int		sides[MAX_POINTS_ON_WINDING + 1];
+	int		counts[3];
+	float	dot;
+	int		i, j;
+	int		nOutPoints;
+
+	Assert(nInPoints <= MAX_POINTS_ON_WINDING);
+	counts[0] = counts[1] = counts[2] = 0;
+
+	// determine sides for each point
+	for (i=0 ; i<nInPoints ; i++)
+	{
+		dot = DotProduct (pIn[i], split->normal);
+		dot -= split->dist;
+		dists[i] = dot;
+		if (dot > SPLIT_EPSILON)
+			sides[i] = SIDE_FRONT;
+		else if (dot < -SPLIT_EPSILON)
+			sides[i] = SIDE_BACK;
+		else
+		{
+			sides[i] = SIDE_ON;
+		}
+		counts[sides[i]]++;
+	}
+	sides[i] = sides[0];
+	dists[i] = dists[0];
+
+	if (!counts[0])
+	{
+		if (!counts[1])
+		{
+			memcpy(pOut, pIn, nInPoints * sizeof(Vector));
+			return nInPoints;
+		}
+
+		return 0;
+	}
+
+	if (!counts[1])
+	{
+		memcpy(pOut, pIn, nInPoints * sizeof(Vector));
+		return nInPoints;
+	}
+
+	nOutPoints = 0;
+	for (i=0 ; i<nInPoints ; i++)
+	{
+		const Vector *p1 = &pIn[i];
+
+		// Not Error, this may be running on a worker thread.
+		if (nOutPoints + 2 > MAX_POINTS_ON_WINDING)
+		{
+			AssertMsg(false, "ClipWindingPoints: too many points");
+			break;
+		}
+
+		if (sides[i] == SIDE_FRONT || sides[i] == SIDE_ON)
+		{
+			pOut[nOutPoints++] = *p1;
+			if (sides[i] == SIDE_ON)
+				continue;
+		}
+
+		if (sides[i+1] == SIDE_ON || sides[i+1] == sides[i])
+			continue;
+
+	// generate a split point
+		const Vector *p2 = (i == nInPoints - 1) ? &pIn[0] : p1 + 1;
+		Vector &mid = pOut[nOutPoints++];
+
+		dot = dists[i] / (dists[i]-dists[i+1]);
+		for (j=0 ; j<3 ; j++)
+		{
+			mid[j] = (*p1)[j] + dot*((*p2)[j]-(*p1)[j]);
+		}
+	}
+
+	return nOutPoints;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Creates a huge quadrilateral given a plane.
+// Input  : pPlane - Plane normal and distance to use when creating the points.
+//			pPoints - Receives the 4 points.
 //-----------------------------------------------------------------------------
 // dvs: read through this and clean it up
-winding_t *CreateWindingFromPlane(PLANE *pPlane)
+void CreateWindingPointsFromPlane(const PLANE *pPlane, Vector *pPoints)
 {
 	int		i, x;
 	float	max, v;
 	Vector	org, vright, vup;
-	winding_t	*w;
 
 	// find the major axis
 	max = -BOGUS_RANGE;
@@ -299,20 +392,29 @@ winding_t *CreateWindingFromPlane(PLANE *pPlane)
 	vright = vright * MAX_TRACE_LENGTH;
 
 	// project a really big	axis aligned box onto the plane
-	w = NewWinding (4);
-	w->numpoints = 4;
+	VectorSubtract (org, vright, pPoints[0]);
+	VectorAdd (pPoints[0], vup, pPoints[0]);
 
-	VectorSubtract (org, vright, w->p[0]);
-	VectorAdd (w->p[0], vup, w->p[0]);
+	VectorAdd (org, vright, pPoints[1]);
+	VectorAdd (pPoints[1], vup, pPoints[1]);
 
-	VectorAdd (org, vright, w->p[1]);
-	VectorAdd (w->p[1], vup, w->p[1]);
+	VectorAdd (org, vright, pPoints[2]);
+	VectorSubtract (pPoints[2], vup, pPoints[2]);
 
-	VectorAdd (org, vright, w->p[2]);
-	VectorSubtract (w->p[2], vup, w->p[2]);
+	VectorSubtract (org, vright, pPoints[3]);
+	VectorSubtract (pPoints[3], vup, pPoints[3]);
+}
 
-	VectorSubtract (org, vright, w->p[3]);
-	VectorSubtract (w->p[3], vup, w->p[3]);
 
+//-----------------------------------------------------------------------------
+// Purpose: Creates a huge quadrilateral winding given a plane.
+// Input  : pPlane - Plane normal and distance to use when creating the winding.
+// Output : Returns a winding with 4 points.
+//-----------------------------------------------------------------------------
+winding_t *CreateWindingFromPlane(PLANE *pPlane)
+{
+	winding_t *w = NewWinding (4);
+	w->numpoints = 4;
+	CreateWindingPointsFromPlane(pPlane, w->p);
 	return w;
 }
\ No newline at end of file
@@ -17,12 +17,21 @@
 #define	MIN_EDGE_LENGTH_EPSILON		0.1f		// Edges shorter than this are considered degenerate.
 #define	ROUND_VERTEX_EPSILON		0.01f		// Vertices within this many units of an integer value will be rounded to an integer value.
 
+const int MAX_POINTS_ON_WINDING = 128;
+
 winding_t *ClipWinding(winding_t *in, PLANE *split);
 winding_t *CopyWinding(winding_t *w);
 winding_t *NewWinding(int points);
 void FreeWinding (winding_t *w);
 winding_t *CreateWindingFromPlane(PLANE *pPlane);
 size_t WindingSize(int points);
+
+//
+// Allocation free versions for callers that keep their points in their own buffers.
+// Output buffers must hold MAX_POINTS_ON_WINDING points.
+//
+void CreateWindingPointsFromPlane(const PLANE *pPlane, Vector *pPoints);
+int ClipWindingPoints(const Vector *pIn, int nInPoints, const PLANE *split, Vector *pOut);
 void RemoveDuplicateWindingPoints(winding_t *pWinding, float fMinDist = 0);
 
 #endif // BRUSHOPS_H
\ No newline at end of file
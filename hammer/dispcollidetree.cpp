@@ -0,0 +1,545 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Quadtree over the triangles of one displacement. The tree's shape
+//			depends only on the displacement's power, so it is built once and
+//			then just refit as the vertices move while sculpting.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "stdafx.h"
+#include "dispcollidetree.h"
+#include "builddisp.h"
+#include "collisionutils.h"
+#include "mapobjectbvh.h"
+#include "mathlib/ssemath.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+
+//
+// The same tolerances IntersectRayWithTriangle uses for rays.
+//
+static const fltx4 Four_MinDeterminant = ReplicateX4( 1.0e-6f );
+static const fltx4 Four_MinFraction = ReplicateX4( -1.0e-3f );
+static const fltx4 Four_MaxFraction = ReplicateX4( 1.0f + 1.0e-3f );
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Intersects one ray with four triangles, the same way as
+//			IntersectRayWithTriangle.
+// Output : Returns a mask of the triangles hit, with the hit fractions in t.
+//-----------------------------------------------------------------------------
+static FORCEINLINE fltx4 RayTriGroupMask( const FourVectors &vecStart, const FourVectors &vecDelta, const float flStart[3][4],
+	const float flEdge1[3][4], const float flEdge2[3][4], const float flNormal[3][4], bool bOneSided, fltx4 &t )
+{
+	FourVectors vecEdge1, vecEdge2;
+	vecEdge1.x = LoadUnalignedSIMD( flEdge1[0] );
+	vecEdge1.y = LoadUnalignedSIMD( flEdge1[1] );
+	vecEdge1.z = LoadUnalignedSIMD( flEdge1[2] );
+	vecEdge2.x = LoadUnalignedSIMD( flEdge2[0] );
+	vecEdge2.y = LoadUnalignedSIMD( flEdge2[1] );
+	vecEdge2.z = LoadUnalignedSIMD( flEdge2[2] );
+
+	fltx4 mask = LoadAlignedSIMD( g_SIMD_AllOnesMask );
+	if ( bOneSided )
+	{
+		FourVectors vecNormal;
+		vecNormal.x = LoadUnalignedSIMD( flNormal[0] );
+		vecNormal.y = LoadUnalignedSIMD( flNormal[1] );
+		vecNormal.z = LoadUnalignedSIMD( flNormal[2] );
+		mask = CmpLtSIMD( vecNormal * vecDelta, Four_Zeros );
+	}
+
+	// Delta cross Edge2.
+	FourVectors vecP;
+	vecP.x = SubSIMD( MulSIMD( vecDelta.y, vecEdge2.z ), MulSIMD( vecDelta.z, vecEdge2.y ) );
+	vecP.y = SubSIMD( MulSIMD( vecDelta.z, vecEdge2.x ), MulSIMD( vecDelta.x, vecEdge2.z ) );
+	vecP.z = SubSIMD( MulSIMD( vecDelta.x, vecEdge2.y ), MulSIMD( vecDelta.y, vecEdge2.x ) );
+
+	fltx4 det = vecP * vecEdge1;
+	mask = AndSIMD( mask, CmpGeSIMD( fabs( det ), Four_MinDeterminant ) );
+	if ( IsAllZeros( mask ) )
+		return mask;
+
+	fltx4 invDet = DivSIMD( Four_Ones, det );
+
+	FourVectors vecOrg = vecStart;
+	vecOrg.x = SubSIMD( vecOrg.x, LoadUnalignedSIMD( flStart[0] ) );
+	vecOrg.y = SubSIMD( vecOrg.y, LoadUnalignedSIMD( flStart[1] ) );
+	vecOrg.z = SubSIMD( vecOrg.z, LoadUnalignedSIMD( flStart[2] ) );
+
+	fltx4 u = MulSIMD( vecP * vecOrg, invDet );
+	mask = AndSIMD( mask, AndSIMD( CmpGeSIMD( u, Four_Zeros ), CmpLeSIMD( u, Four_Ones ) ) );
+
+	// Org cross Edge1.
+	FourVectors vecQ;
+	vecQ.x = SubSIMD( MulSIMD( vecOrg.y, vecEdge1.z ), MulSIMD( vecOrg.z, vecEdge1.y ) );
+	vecQ.y = SubSIMD( MulSIMD( vecOrg.z, vecEdge1.x ), MulSIMD( vecOrg.x, vecEdge1.z ) );
+	vecQ.z = SubSIMD( MulSIMD( vecOrg.x, vecEdge1.y ), MulSIMD( vecOrg.y, vecEdge1.x ) );
+
+	fltx4 v = MulSIMD( vecQ * vecDelta, invDet );
+	mask = AndSIMD( mask, AndSIMD( CmpGeSIMD( v, Four_Zeros ), CmpLeSIMD( AddSIMD( u, v ), Four_Ones ) ) );
+
+	t = MulSIMD( vecQ * vecEdge2, invDet );
+	mask = AndSIMD( mask, AndSIMD( CmpGeSIMD( t, Four_MinFraction ), CmpLeSIMD( t, Four_MaxFraction ) ) );
+	t = MinSIMD( MaxSIMD( t, Four_Zeros ), Four_Ones );
+
+	return mask;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor.
+//-----------------------------------------------------------------------------
+CDispCollideTree::CDispCollideTree(void)
+{
+	m_nWidth = 0;
+	m_nTriCount = 0;
+	m_nLeafCells = 0;
+	m_nLevels = 0;
+	m_bRebuild = true;
+	m_bRefit = true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds or refits the tree if the displacement changed since the
+//			last call.
+//-----------------------------------------------------------------------------
+void CDispCollideTree::Update(CCoreDispInfo *pDispInfo)
+{
+	if (m_bRebuild || (pDispInfo->GetWidth() != m_nWidth) || (pDispInfo->GetTriCount() != m_nTriCount))
+	{
+		Rebuild(pDispInfo);
+	}
+
+	if (m_bRefit)
+	{
+		Refit(pDispInfo);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sorts the triangles and vertices into leaves. Each leaf covers a
+//			square of grid cells, and each triangle goes into the leaf of the
+//			cell it is in. Vertices go into the leaf of the cell they are the
+//			lowest corner of, or the nearest leaf along the far edges.
+//-----------------------------------------------------------------------------
+void CDispCollideTree::Rebuild(CCoreDispInfo *pDispInfo)
+{
+	m_nWidth = pDispInfo->GetWidth();
+	m_nTriCount = pDispInfo->GetTriCount();
+
+	m_Nodes.RemoveAll();
+	m_Leaves.RemoveAll();
+	m_TriGroups.RemoveAll();
+	m_VertGroups.RemoveAll();
+	m_nLevels = 0;
+
+	m_bRebuild = false;
+	m_bRefit = true;
+
+	if ((m_nWidth < 2) || (m_nTriCount == 0))
+	{
+		return;
+	}
+
+	int nCells = m_nWidth - 1;
+	m_nLeafCells = min( (int)LEAF_CELLS, nCells );
+	int nLeafSide = nCells / m_nLeafCells;
+
+	int nNodes = 0;
+	for (int nSide = 1; nSide <= nLeafSide; nSide <<= 1)
+	{
+		Assert(m_nLevels < MAX_LEVELS);
+		m_nLevelStart[m_nLevels++] = nNodes;
+		nNodes += nSide * nSide;
+	}
+
+	m_Nodes.SetCount(nNodes);
+	m_Leaves.SetCount(nLeafSide * nLeafSide);
+
+	//
+	// Find the leaf of each triangle and vertex, and how many go in each leaf.
+	//
+	CUtlVector<int> TriLeaves;
+	CUtlVector<int> VertLeaves;
+	CUtlVector<int> TriCounts;
+	CUtlVector<int> VertCounts;
+	TriLeaves.SetCount(m_nTriCount);
+	VertLeaves.SetCount(m_nWidth * m_nWidth);
+	TriCounts.SetCount(m_Leaves.Count());
+	VertCounts.SetCount(m_Leaves.Count());
+	memset(TriCounts.Base(), 0, TriCounts.Count() * sizeof(int));
+	memset(VertCounts.Base(), 0, VertCounts.Count() * sizeof(int));
+
+	for (int iTri = 0; iTri < m_nTriCount; iTri++)
+	{
+		unsigned short nIndices[3];
+		pDispInfo->GetTriIndices(iTri, nIndices[0], nIndices[1], nIndices[2]);
+
+		int x = m_nWidth;
+		int y = m_nWidth;
+		for (int i = 0; i < 3; i++)
+		{
+			x = min(x, nIndices[i] % m_nWidth);
+			y = min(y, nIndices[i] / m_nWidth);
+		}
+
+		int nLeaf = min(y / m_nLeafCells, nLeafSide - 1) * nLeafSide + min(x / m_nLeafCells, nLeafSide - 1);
+		TriLeaves[iTri] = nLeaf;
+		TriCounts[nLeaf]++;
+	}
+
+	for (int iVert = 0; iVert < VertLeaves.Count(); iVert++)
+	{
+		int x = iVert % m_nWidth;
+		int y = iVert / m_nWidth;
+
+		int nLeaf = min(y / m_nLeafCells, nLeafSide - 1) * nLeafSide + min(x / m_nLeafCells, nLeafSide - 1);
+		VertLeaves[iVert] = nLeaf;
+		VertCounts[nLeaf]++;
+	}
+
+	//
+	// Give each leaf its groups, then fill them.
+	//
+	int nTriGroups = 0;
+	int nVertGroups = 0;
+	for (int nLeaf = 0; nLeaf < m_Leaves.Count(); nLeaf++)
+	{
+		Leaf_t &Leaf = m_Leaves[nLeaf];
+		Leaf.m_nFirstTriGroup = nTriGroups;
+		Leaf.m_nTriGroupCount = (TriCounts[nLeaf] + 3) / 4;
+		Leaf.m_nFirstVertGroup = nVertGroups;
+		Leaf.m_nVertGroupCount = (VertCounts[nLeaf] + 3) / 4;
+
+		nTriGroups += Leaf.m_nTriGroupCount;
+		nVertGroups += Leaf.m_nVertGroupCount;
+
+		// Count them again as they are filled in.
+		TriCounts[nLeaf] = 0;
+		VertCounts[nLeaf] = 0;
+	}
+
+	m_TriGroups.SetCount(nTriGroups);
+	memset(m_TriGroups.Base(), 0, nTriGroups * sizeof(TriGroup_t));
+	for (int i = 0; i < nTriGroups; i++)
+	{
+		for (int nSlot = 0; nSlot < 4; nSlot++)
+		{
+			m_TriGroups[i].m_nTri[nSlot] = -1;
+		}
+	}
+
+	m_VertGroups.SetCount(nVertGroups);
+	for (int i = 0; i < nVertGroups; i++)
+	{
+		for (int nSlot = 0; nSlot < 4; nSlot++)
+		{
+			m_VertGroups[i].m_flPos[0][nSlot] = m_VertGroups[i].m_flPos[1][nSlot] = m_VertGroups[i].m_flPos[2][nSlot] = FLT_MAX;
+			m_VertGroups[i].m_nVert[nSlot] = -1;
+		}
+	}
+
+	for (int iTri = 0; iTri < m_nTriCount; iTri++)
+	{
+		int nLeaf = TriLeaves[iTri];
+		int nSlot = TriCounts[nLeaf]++;
+		m_TriGroups[m_Leaves[nLeaf].m_nFirstTriGroup + nSlot / 4].m_nTri[nSlot % 4] = iTri;
+	}
+
+	for (int iVert = 0; iVert < VertLeaves.Count(); iVert++)
+	{
+		int nLeaf = VertLeaves[iVert];
+		int nSlot = VertCounts[nLeaf]++;
+		m_VertGroups[m_Leaves[nLeaf].m_nFirstVertGroup + nSlot / 4].m_nVert[nSlot % 4] = iVert;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Copies the current vertex positions into the groups and recomputes
+//			the boxes from the leaves up.
+//-----------------------------------------------------------------------------
+void CDispCollideTree::Refit(CCoreDispInfo *pDispInfo)
+{
+	m_bRefit = false;
+	if (m_nLevels == 0)
+	{
+		return;
+	}
+
+	int nLeafLevel = m_nLevels - 1;
+	int nLeafSide = 1 << nLeafLevel;
+
+	for (int nLeaf = 0; nLeaf < m_Leaves.Count(); nLeaf++)
+	{
+		const Leaf_t &Leaf = m_Leaves[nLeaf];
+		Node_t &Node = m_Nodes[GetNodeIndex(nLeafLevel, nLeaf % nLeafSide, nLeaf / nLeafSide)];
+		ClearBounds(Node.m_vecMins, Node.m_vecMaxs);
+
+		for (int i = 0; i < Leaf.m_nTriGroupCount; i++)
+		{
+			TriGroup_t &Group = m_TriGroups[Leaf.m_nFirstTriGroup + i];
+			for (int nSlot = 0; nSlot < 4; nSlot++)
+			{
+				if (Group.m_nTri[nSlot] == -1)
+				{
+					continue;
+				}
+
+				unsigned short nIndices[3];
+				pDispInfo->GetTriIndices(Group.m_nTri[nSlot], nIndices[0], nIndices[1], nIndices[2]);
+
+				Vector vecVerts[3];
+				for (int j = 0; j < 3; j++)
+				{
+					pDispInfo->GetVert(nIndices[j], vecVerts[j]);
+					AddPointToBounds(vecVerts[j], Node.m_vecMins, Node.m_vecMaxs);
+				}
+
+				Vector vecEdge1 = vecVerts[1] - vecVerts[0];
+				Vector vecEdge2 = vecVerts[2] - vecVerts[0];
+				Vector vecNormal = CrossProduct(vecEdge1, vecEdge2);
+
+				for (int nAxis = 0; nAxis < 3; nAxis++)
+				{
+					Group.m_flStart[nAxis][nSlot] = vecVerts[0][nAxis];
+					Group.m_flEdge1[nAxis][nSlot] = vecEdge1[nAxis];
+					Group.m_flEdge2[nAxis][nSlot] = vecEdge2[nAxis];
+					Group.m_flNormal[nAxis][nSlot] = vecNormal[nAxis];
+				}
+			}
+		}
+
+		for (int i = 0; i < Leaf.m_nVertGroupCount; i++)
+		{
+			VertGroup_t &Group = m_VertGroups[Leaf.m_nFirstVertGroup + i];
+			for (int nSlot = 0; nSlot < 4; nSlot++)
+			{
+				if (Group.m_nVert[nSlot] == -1)
+				{
+					continue;
+				}
+
+				Vector vecPos;
+				pDispInfo->GetVert(Group.m_nVert[nSlot], vecPos);
+				AddPointToBounds(vecPos, Node.m_vecMins, Node.m_vecMaxs);
+
+				for (int nAxis = 0; nAxis < 3; nAxis++)
+				{
+					Group.m_flPos[nAxis][nSlot] = vecPos[nAxis];
+				}
+			}
+		}
+	}
+
+	for (int nLevel = nLeafLevel - 1; nLevel >= 0; nLevel--)
+	{
+		int nSide = 1 << nLevel;
+		for (int y = 0; y < nSide; y++)
+		{
+			for (int x = 0; x < nSide; x++)
+			{
+				Node_t &Node = m_Nodes[GetNodeIndex(nLevel, x, y)];
+				ClearBounds(Node.m_vecMins, Node.m_vecMaxs);
+
+				for (int nChild = 0; nChild < 4; nChild++)
+				{
+					const Node_t &Child = m_Nodes[GetNodeIndex(nLevel + 1, (x << 1) + (nChild & 1), (y << 1) + (nChild >> 1))];
+					VectorMin(Node.m_vecMins, Child.m_vecMins, Node.m_vecMins);
+					VectorMax(Node.m_vecMaxs, Child.m_vecMaxs, Node.m_vecMaxs);
+				}
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the first triangle along a line segment.
+// Input  : bOneSided - Whether to ignore triangles facing away from the ray.
+// Output : Returns the index of the triangle hit, -1 if none, with the fraction
+//			along the segment in flFraction. Ties go to the lowest index, as
+//			they would testing the triangles in order.
+//-----------------------------------------------------------------------------
+int CDispCollideTree::TraceRay(const Vector &vecStart, const Vector &vecEnd, bool bOneSided, float &flFraction) const
+{
+	flFraction = 1.0f;
+	int iBestTri = -1;
+
+	if (m_Nodes.Count() == 0)
+	{
+		return(-1);
+	}
+
+	Vector vecDelta = vecEnd - vecStart;
+	Vector vecInvDelta;
+	for (int nAxis = 0; nAxis < 3; nAxis++)
+	{
+		vecInvDelta[nAxis] = (vecDelta[nAxis] != 0.0f) ? 1.0f / vecDelta[nAxis] : FLT_MAX;
+	}
+
+	FourVectors vecStart4, vecDelta4;
+	vecStart4.DuplicateVector(vecStart);
+	vecDelta4.DuplicateVector(vecDelta);
+
+	struct StackEntry_t
+	{
+		int m_nLevel;
+		int x;
+		int y;
+		float m_flEnter;
+	};
+
+	float flEnter;
+	if (!ClipSegmentToBox(vecStart, vecInvDelta, m_Nodes[0].m_vecMins, m_Nodes[0].m_vecMaxs, flEnter))
+	{
+		return(-1);
+	}
+
+	StackEntry_t Stack[MAX_LEVELS * 3 + 1];
+	int nStack = 0;
+	StackEntry_t Root = { 0, 0, 0, flEnter };
+	Stack[nStack++] = Root;
+
+	int nLeafLevel = m_nLevels - 1;
+	while (nStack != 0)
+	{
+		StackEntry_t Entry = Stack[--nStack];
+		if (Entry.m_flEnter > flFraction)
+		{
+			continue;
+		}
+
+		if (Entry.m_nLevel < nLeafLevel)
+		{
+			//
+			// Push the children that the segment crosses, farthest first, so the
+			// nearest are looked at first and cut short the rest.
+			//
+			StackEntry_t Children[4];
+			int nChildren = 0;
+			for (int nChild = 0; nChild < 4; nChild++)
+			{
+				StackEntry_t Child = { Entry.m_nLevel + 1, (Entry.x << 1) + (nChild & 1), (Entry.y << 1) + (nChild >> 1), 0 };
+				const Node_t &Node = m_Nodes[GetNodeIndex(Child.m_nLevel, Child.x, Child.y)];
+				if (ClipSegmentToBox(vecStart, vecInvDelta, Node.m_vecMins, Node.m_vecMaxs, Child.m_flEnter) && (Child.m_flEnter <= flFraction))
+				{
+					int i = nChildren++;
+					while ((i > 0) && (Children[i - 1].m_flEnter < Child.m_flEnter))
+					{
+						Children[i] = Children[i - 1];
+						i--;
+					}
+					Children[i] = Child;
+				}
+			}
+
+			for (int i = 0; i < nChildren; i++)
+			{
+				Stack[nStack++] = Children[i];
+			}
+			continue;
+		}
+
+		const Leaf_t &Leaf = m_Leaves[(Entry.y << nLeafLevel) + Entry.x];
+		for (int i = 0; i < Leaf.m_nTriGroupCount; i++)
+		{
+			const TriGroup_t &Group = m_TriGroups[Leaf.m_nFirstTriGroup + i];
+
+			fltx4 t;
+			fltx4 mask = RayTriGroupMask(vecStart4, vecDelta4, Group.m_flStart, Group.m_flEdge1, Group.m_flEdge2, Group.m_flNormal, bOneSided, t);
+
+			int nHits = TestSignSIMD(mask);
+			for (int nSlot = 0; nHits != 0; nSlot++, nHits >>= 1)
+			{
+				if (!(nHits & 1))
+				{
+					continue;
+				}
+
+				float flHit = SubFloat(t, nSlot);
+				int iTri = Group.m_nTri[nSlot];
+				if ((flHit < flFraction) || ((iBestTri != -1) && (flHit == flFraction) && (iTri < iBestTri)))
+				{
+					flFraction = flHit;
+					iBestTri = iTri;
+				}
+			}
+		}
+	}
+
+	return(iBestTri);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the vertices strictly inside a sphere.
+// Input  : Verts - Vertex indices are added to this list.
+//-----------------------------------------------------------------------------
+void CDispCollideTree::EnumerateVertsInSphere(const Vector &vecCenter, float flRadius, CUtlVector<int> &Verts) const
+{
+	if (m_Nodes.Count() == 0)
+	{
+		return;
+	}
+
+	FourVectors vecCenter4;
+	vecCenter4.DuplicateVector(vecCenter);
+	fltx4 flRadius2 = ReplicateX4(flRadius * flRadius);
+
+	int nLeafLevel = m_nLevels - 1;
+
+	int Stack[MAX_LEVELS * 3 + 1];
+	int nStack = 0;
+	Stack[nStack++] = 0;
+
+	while (nStack != 0)
+	{
+		// Entries are packed as level, y, x, each in a byte.
+		int nEntry = Stack[--nStack];
+		int nLevel = nEntry >> 16;
+		int x = nEntry & 0xff;
+		int y = (nEntry >> 8) & 0xff;
+
+		const Node_t &Node = m_Nodes[GetNodeIndex(nLevel, x, y)];
+		if (!IsBoxIntersectingSphere(Node.m_vecMins, Node.m_vecMaxs, vecCenter, flRadius))
+		{
+			continue;
+		}
+
+		if (nLevel < nLeafLevel)
+		{
+			for (int nChild = 3; nChild >= 0; nChild--)
+			{
+				Stack[nStack++] = ((nLevel + 1) << 16) | (((y << 1) + (nChild >> 1)) << 8) | ((x << 1) + (nChild & 1));
+			}
+			continue;
+		}
+
+		const Leaf_t &Leaf = m_Leaves[(y << nLeafLevel) + x];
+		for (int i = 0; i < Leaf.m_nVertGroupCount; i++)
+		{
+			const VertGroup_t &Group = m_VertGroups[Leaf.m_nFirstVertGroup + i];
+
+			FourVectors vecOffset;
+			vecOffset.x = SubSIMD(LoadUnalignedSIMD(Group.m_flPos[0]), vecCenter4.x);
+			vecOffset.y = SubSIMD(LoadUnalignedSIMD(Group.m_flPos[1]), vecCenter4.y);
+			vecOffset.z = SubSIMD(LoadUnalignedSIMD(Group.m_flPos[2]), vecCenter4.z);
+
+			int nInside = TestSignSIMD(CmpLtSIMD(vecOffset * vecOffset, flRadius2));
+			for (int nSlot = 0; nInside != 0; nSlot++, nInside >>= 1)
+			{
+				if (nInside & 1)
+				{
+					Verts.AddToTail(Group.m_nVert[nSlot]);
+				}
+			}
+		}
+	}
+}
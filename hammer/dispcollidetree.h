@@ -0,0 +1,103 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Quadtree over the triangles of one displacement, following the
+//			displacement's grid, for ray and sphere queries. Triangles and
+//			vertices are kept four to a group so they can be tested with SIMD.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef DISPCOLLIDETREE_H
+#define DISPCOLLIDETREE_H
+#pragma once
+
+#include "mathlib/vector.h"
+#include "utlvector.h"
+
+class CCoreDispInfo;
+
+
+class CDispCollideTree
+{
+	public:
+
+		CDispCollideTree(void);
+
+		//
+		// The tree is brought up to date by Update, on the next query. Vertex
+		// moves only need the boxes refit, changes to the triangles or the power
+		// need the tree rebuilt.
+		//
+		inline void MarkMoved(void) { m_bRefit = true; }
+		inline void Invalidate(void) { m_bRebuild = true; }
+		void Update(CCoreDispInfo *pDispInfo);
+
+		//
+		// Queries. These give the same results as testing every triangle or vertex.
+		//
+		int TraceRay(const Vector &vecStart, const Vector &vecEnd, bool bOneSided, float &flFraction) const;
+		void EnumerateVertsInSphere(const Vector &vecCenter, float flRadius, CUtlVector<int> &Verts) const;
+
+	protected:
+
+		enum { MAX_LEVELS = 8 };
+		enum { LEAF_CELLS = 2 };			// Grid cells along each side of a leaf.
+
+		struct Node_t
+		{
+			Vector m_vecMins;
+			Vector m_vecMaxs;
+		};
+
+		struct Leaf_t
+		{
+			int m_nFirstTriGroup;
+			int m_nTriGroupCount;
+			int m_nFirstVertGroup;
+			int m_nVertGroupCount;
+		};
+
+		//
+		// Four triangles, each component stored across the four of them. Unused
+		// slots have a zero area, which the ray test rejects.
+		//
+		struct TriGroup_t
+		{
+			float m_flStart[3][4];			// First vertex.
+			float m_flEdge1[3][4];			// Second vertex minus the first.
+			float m_flEdge2[3][4];			// Third vertex minus the first.
+			float m_flNormal[3][4];			// Edge1 cross Edge2, for one sided tests.
+			int m_nTri[4];					// -1 for unused slots.
+		};
+
+		//
+		// Four vertices. Unused slots are at FLT_MAX, which no sphere contains.
+		//
+		struct VertGroup_t
+		{
+			float m_flPos[3][4];
+			int m_nVert[4];					// -1 for unused slots.
+		};
+
+		void Rebuild(CCoreDispInfo *pDispInfo);
+		void Refit(CCoreDispInfo *pDispInfo);
+
+		inline int GetNodeIndex(int nLevel, int x, int y) const { return(m_nLevelStart[nLevel] + (y << nLevel) + x); }
+
+		int m_nWidth;						// Vertices along each side.
+		int m_nTriCount;
+		int m_nLeafCells;					// Grid cells along each side of a leaf.
+		int m_nLevels;						// The last level is the leaves.
+		int m_nLevelStart[MAX_LEVELS];
+
+		CUtlVector<Node_t> m_Nodes;
+		CUtlVector<Leaf_t> m_Leaves;		// In the same order as the last level of nodes.
+		CUtlVector<TriGroup_t> m_TriGroups;
+		CUtlVector<VertGroup_t> m_VertGroups;
+
+		bool m_bRebuild;
+		bool m_bRefit;
+};
+
+
+#endif // DISPCOLLIDETREE_H
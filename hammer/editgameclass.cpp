@@ -40,6 +40,8 @@ CEditGameClass::CEditGameClass(void)
 	m_pClass = NULL;
 	m_szClass[0] = '\0';
 	m_pszComments = NULL;
+	m_pKeyVariablesClass = NULL;
+	m_nKeyVariablesGeneration = -1;
 }
 
 
@@ -227,6 +229,44 @@ void CEditGameClass::SetClass(LPCTSTR pszClass, bool bLoading)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns the game class variable for the given key, remembering the
+//			answer by key symbol until the class or the game data changes.
+// Input  : nIndex - Index of the keyvalue.
+//-----------------------------------------------------------------------------
+GDinputvariable *CEditGameClass::GetKeyVariable(int nIndex)
+{
+	if (m_pClass == NULL)
+	{
+		return(NULL);
+	}
+
+	if ((m_pKeyVariablesClass != m_pClass) || (m_nKeyVariablesGeneration != GameData::GetGeneration()))
+	{
+		m_KeyVariables.RemoveAll();
+		m_pKeyVariablesClass = m_pClass;
+		m_nKeyVariablesGeneration = GameData::GetGeneration();
+	}
+
+	const MDkeyvalue &kv = m_KeyValues.GetKeyValue(nIndex);
+	CUtlSymbol Key = kv.KeySymbol();
+
+	int nCount = m_KeyVariables.Count();
+	for (int i = 0; i < nCount; i++)
+	{
+		if (m_KeyVariables[i].m_Key == Key)
+		{
+			return(m_KeyVariables[i].m_pVar);
+		}
+	}
+
+	KeyVariable_t &entry = m_KeyVariables[m_KeyVariables.AddToTail()];
+	entry.m_Key = Key;
+	entry.m_pVar = m_pClass->VarForName(kv.Key());
+	return(entry.m_pVar);
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Copies the data from a given CEditGameClass object into this one.
 // Input  : pFrom - Object to copy.
@@ -301,9 +341,9 @@ void CEditGameClass::GetDefaultKeys( void )
 					//
 					// Only set the key value if it is non-zero.
 					//
-					if ((tmpkv.szKey[0] != 0) && (tmpkv.szValue[0] != 0) && (stricmp(tmpkv.szValue, "0")))
+					if ((tmpkv.Key()[0] != 0) && (tmpkv.Value()[0] != 0) && (stricmp(tmpkv.Value(), "0")))
 					{
-						SetKeyValue(tmpkv.szKey, tmpkv.szValue);
+						SetKeyValue(tmpkv.Key(), tmpkv.Value());
 					}
 				}
 			}
@@ -405,7 +445,7 @@ ChunkFileResult_t CEditGameClass::SaveVMF(CChunkFile *pFile, CSaveInfo *pSaveInf
 		// Don't write keys that were already written above.
 		//
 		bool bAlreadyWritten = false;
-		if (!stricmp(KeyValue.szKey, "classname"))
+		if (!stricmp(KeyValue.Key(), "classname"))
 		{
 			bAlreadyWritten = true;
 		}
@@ -418,7 +458,7 @@ ChunkFileResult_t CEditGameClass::SaveVMF(CChunkFile *pFile, CSaveInfo *pSaveInf
 			//
 			// Write it to the MAP file.
 			//
-			eResult = pFile->WriteKeyValue(KeyValue.szKey, KeyValue.szValue);
+			eResult = pFile->WriteKeyValue(KeyValue.Key(), KeyValue.Value());
 			if (eResult != ChunkFile_Ok)
 			{
 				return(eResult);
@@ -458,9 +498,9 @@ ChunkFileResult_t CEditGameClass::SaveVMF(CChunkFile *pFile, CSaveInfo *pSaveInf
 					//
 					// Only write the key value if it is non-zero.
 					//
-					if ((TempKey.szKey[0] != 0) && (TempKey.szValue[0] != 0) && (stricmp(TempKey.szValue, "0")))
+					if ((TempKey.Key()[0] != 0) && (TempKey.Value()[0] != 0) && (stricmp(TempKey.Value(), "0")))
 					{
-						eResult = pFile->WriteKeyValue(TempKey.szKey, TempKey.szValue);
+						eResult = pFile->WriteKeyValue(TempKey.Key(), TempKey.Value());
 						if (eResult != ChunkFile_Ok)
 						{
 							return(eResult);
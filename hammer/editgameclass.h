@@ -65,8 +65,15 @@ class CEditGameClass
 		// Iterate the list of keyvalues.
 		inline int GetFirstKeyValue() const			{ return m_KeyValues.GetFirst(); }
 		inline int GetNextKeyValue( int i ) const	{ return m_KeyValues.GetNext( i ); }
+		inline void GetKeyValueMemoryStats( KeyValueMemoryStats_t &stats ) const { m_KeyValues.GetMemoryStats( stats ); }
 		static inline int GetInvalidKeyValue()		{ return WCKeyValues::GetInvalidIndex(); }
 
+		// Returns the game class variable for the key at nIndex, or NULL if the class
+		// doesn't have one. Remembered per key, so asking again is just a compare.
+		// Only for loops over an entity's own keys; lookups by name, or against a
+		// class other than the entity's, go straight to GDclass::VarForName.
+		GDinputvariable *GetKeyVariable(int nIndex);
+
 		//
 		// Interface to flags.
 		//
@@ -136,6 +143,16 @@ class CEditGameClass
 
 		static const char *g_pszEmpty;
 
+		struct KeyVariable_t
+		{
+			CUtlSymbol m_Key;			// MDkeyvalue::KeySymbol of the key.
+			GDinputvariable *m_pVar;	// NULL if the class has no variable by that name.
+		};
+
+		CUtlVector<KeyVariable_t> m_KeyVariables;
+		GDclass *m_pKeyVariablesClass;		// m_pClass when m_KeyVariables was filled in.
+		int m_nKeyVariablesGeneration;		// GameData generation when m_KeyVariables was filled in.
+
 		CEntityConnectionList m_Connections;
 		CEntityConnectionList m_Upstream;
 };
@@ -432,7 +432,7 @@ BOOL AddEntityToList(CMapEntity *pEntity, CEntityReportDlg *pDlg)
 		GDclass *pClass = pEntity->GetClass();
 		if (pClass != NULL)
 		{
-			GDinputvariable *pVar = pClass->VarForName(pEntity->GetKey(i));
+			GDinputvariable *pVar = pEntity->GetKeyVariable(i);
 			if (!pVar || !pVar->IsReportable())
 			{
 				continue;
@@ -14,9 +14,14 @@
 
 static int g_EventTimeCounters[100];
 static float g_EventTimes[100];
+static int g_nSuppressSignals;
 
 void SignalUpdate(int ev)
 {
+	// the counters aren't thread safe. whoever suppressed signals signals
+	// once from the main thread when the workers are done.
+	if ( g_nSuppressSignals )
+		return;
 	g_EventTimes[ev]=Plat_FloatTime();
 	g_EventTimeCounters[ev]++;
 }
@@ -31,6 +36,17 @@ float GetUpdateTime(int ev)
 	return g_EventTimes[ev];
 }
 
+void SuppressUpdateSignals(bool bSuppress)
+{
+	if ( bSuppress )
+		g_nSuppressSignals++;
+	else
+	{
+		Assert( g_nSuppressSignals > 0 );
+		g_nSuppressSignals--;
+	}
+}
+
 void SignalGlobalUpdate(void)
 {
 	float stamp=Plat_FloatTime();
@@ -16,9 +16,12 @@
 #include "mainfrm.h"
 #include "messagewnd.h"
 #include "childfrm.h"
+#include "mapchecker.h"
+#include "sculptkernel.h"
 #include "mapdoc.h"
 #include "manifest.h"
 #include "mapview3d.h"
+#include "render3dms.h"
 #include "mapview2d.h"
 #include "prefabs.h"
 #include "globalfunctions.h"
@@ -104,6 +107,12 @@ ThreadHandle_t g_LPreviewThread;
 
 bool	CHammer::m_bIsNewDocumentVisible = true;
 
+// Benchmarks asked for on the command line that need a 3D view, run by RunViewBenchmarks.
+static bool s_bPickBenchmark = false;
+static bool s_bCullBenchmark = false;
+static bool s_bLPreviewRecord = false;
+static bool s_bLPreviewRecording = false;
+
 //-----------------------------------------------------------------------------
 // Expose singleton
 //-----------------------------------------------------------------------------
@@ -1222,6 +1231,52 @@ InitReturnVal_t CHammer::HammerInternalInit()
 
 	CSplashWnd::HideSplashScreen();
 
+	// -lpreviewbenchmark <basename> times the lighting preview against recorded g-buffers and quits
+	const char *pszLPreviewBenchmark = CommandLine()->ParmValue( "-lpreviewbenchmark" );
+	if ( pszLPreviewBenchmark )
+	{
+		BenchmarkLightingPreview( pszLPreviewBenchmark );
+		PostQuitMessage( 0 );
+		return INIT_OK;
+	}
+
+	// -vmfbenchmark <filename> times parsing a map file and quits
+	const char *pszVMFBenchmark = CommandLine()->ParmValue( "-vmfbenchmark" );
+	if ( pszVMFBenchmark )
+	{
+		CMapDoc::BenchmarkVMFParse( pszVMFBenchmark );
+		PostQuitMessage( 0 );
+		return INIT_OK;
+	}
+
+	// -mapcheck <filename> writes the problems in a map to <filename>_mapcheck.txt and quits
+	const char *pszMapCheck = CommandLine()->ParmValue( "-mapcheck" );
+	if ( pszMapCheck )
+	{
+		int nErrors = CMapChecker::CheckMapFile( pszMapCheck );
+		PostQuitMessage( ( nErrors == 0 ) ? 0 : 1 );
+		return INIT_OK;
+	}
+
+	// -sculptbenchmark <filename> replays a sculpt stroke across a map's displacements, reports the time per dab and quits
+	const char *pszSculptBenchmark = CommandLine()->ParmValue( "-sculptbenchmark" );
+	if ( pszSculptBenchmark )
+	{
+		CSculptKernel::BenchmarkStroke( pszSculptBenchmark );
+		PostQuitMessage( 0 );
+		return INIT_OK;
+	}
+
+	// -pickbenchmark times picking in the 3D view of the map given on the command line once it has been drawn, and quits
+	s_bPickBenchmark = ( CommandLine()->FindParm( "-pickbenchmark" ) != 0 );
+
+	// -cullbenchmark times culling in the 3D view of the map given on the command line once it has been drawn, and quits
+	s_bCullBenchmark = ( CommandLine()->FindParm( "-cullbenchmark" ) != 0 );
+
+	// -lpreviewrecord switches the 3D view of the map given on the command line to the ray traced lighting
+	// preview, writes the g-buffers it sends as lpreview_gbuffer_* for -lpreviewbenchmark, and quits
+	s_bLPreviewRecord = ( CommandLine()->FindParm( "-lpreviewrecord" ) != 0 );
+
 	// create the lighting preview thread
 	g_LPreviewThread = CreateSimpleThread( LightingPreviewThreadFN, 0 );
 
@@ -1954,6 +2009,59 @@ BOOL CHammer::OnIdle(LONG lCount)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Runs the benchmarks asked for on the command line against the first
+//			3D view of a document, once that view has been drawn.
+//-----------------------------------------------------------------------------
+static void RunViewBenchmarks(CMapDoc *pDoc)
+{
+	CMapView3D *pView = pDoc->GetFirst3DView();
+	if ((pView == NULL) || (pView->GetRender() == NULL))
+	{
+		return;
+	}
+
+	if (s_bPickBenchmark || s_bCullBenchmark)
+	{
+		if (s_bPickBenchmark)
+		{
+			pView->GetRender()->BenchmarkPicking();
+		}
+
+		if (s_bCullBenchmark)
+		{
+			pView->GetRender()->BenchmarkCulling();
+		}
+
+		s_bPickBenchmark = false;
+		s_bCullBenchmark = false;
+		PostQuitMessage(0);
+	}
+
+	//
+	// The g-buffers are written when the view next sends them to the lighting
+	// preview, which takes a frame in the ray traced mode to start.
+	//
+	if (s_bLPreviewRecord)
+	{
+		if (pView->GetDrawType() != VIEW3D_LIGHTING_PREVIEW_RAYTRACED)
+		{
+			pView->SetDrawType(VIEW3D_LIGHTING_PREVIEW_RAYTRACED);
+		}
+		else if (!s_bLPreviewRecording)
+		{
+			pView->GetRender()->RecordLightingPreviewGBuffers();
+			s_bLPreviewRecording = true;
+		}
+		else if (!pView->GetRender()->IsRecordingLightingPreviewGBuffers())
+		{
+			s_bLPreviewRecord = false;
+			PostQuitMessage(0);
+		}
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Renders the realtime views.
 //-----------------------------------------------------------------------------
@@ -1994,6 +2102,11 @@ void CHammer::RunFrame(void)
 
 		// redraw the 3d views
 		CMapDoc::GetActiveMapDoc()->RenderAllViews();
+
+		if (s_bPickBenchmark || s_bCullBenchmark || s_bLPreviewRecord)
+		{
+			RunViewBenchmarks(CMapDoc::GetActiveMapDoc());
+		}
 	}
 
 	// No matter what, we want to keep caching in materials...
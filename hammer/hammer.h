@@ -222,6 +222,7 @@ void SignalUpdate(int ev);									// EVTYPE_xx
 int GetUpdateCounter(int ev);									// return timestamp
 float GetUpdateTime(int ev);									// return floating point time event was signalled
 void SignalGlobalUpdate(void);								// flag ALL events, such as on map load
+void SuppressUpdateSignals(bool bSuppress);					// ignore signals while worker threads run code that signals
 
 #define EVTYPE_FACE_CHANGED 0
 #define EVTYPE_LIGHTING_CHANGED 1
@@ -7,11 +7,13 @@
 
 #include "stdafx.h"
 #include "history.h"
+#include "historyblocks.h"
 #include "hammer.h"
 #include "options.h"
 #include "mainfrm.h"
 #include "mapdoc.h"
 #include "globalfunctions.h"
+#include "mapsolid.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -437,8 +439,24 @@ CTrackEntry::CTrackEntry(TrackType_t eType, ...)
 		case ttCopy:
 		{
 			m_Copy.pCurrent = va_arg(vl, CMapClass *);
-			m_Copy.pKeptObject = m_Copy.pCurrent->Copy(false);
-			m_nDataSize = sizeof(*this) + m_Copy.pKeptObject->GetSize();
+
+			//
+			// Solids keep their faces in the shared block store, so faces that didn't
+			// change between undo steps (most of them, usually) are only stored once.
+			//
+			if (m_Copy.pCurrent->IsMapClass(MAPCLASS_TYPE(CMapSolid)))
+			{
+				CMapSolid *pSolid = (CMapSolid *)m_Copy.pCurrent;
+				m_Copy.pKeptObject = pSolid->CopyWithoutFaces();
+				m_Copy.pKeptFaces = new CKeptFaces(pSolid);
+				m_nDataSize = sizeof(*this) + m_Copy.pKeptObject->GetSize() + m_Copy.pKeptFaces->GetSize();
+			}
+			else
+			{
+				m_Copy.pKeptObject = m_Copy.pCurrent->Copy(false);
+				m_Copy.pKeptFaces = NULL;
+				m_nDataSize = sizeof(*this) + m_Copy.pKeptObject->GetSize();
+			}
 			break;
 		}
 
@@ -511,6 +529,7 @@ CTrackEntry::~CTrackEntry()
 			if (!m_bUndone)
 			{
 				delete m_Copy.pKeptObject;
+				delete m_Copy.pKeptFaces;
 			}
 
 			break;
@@ -594,7 +613,19 @@ void CTrackEntry::Undo(CHistory *Opposite)
 			//
 			// Copying back into the world, so update object dependencies.
 			//
-			m_Copy.pCurrent->CopyFrom(m_Copy.pKeptObject, true);
+			if (m_Copy.pKeptFaces != NULL)
+			{
+				CMapSolid *pSolid = (CMapSolid *)m_Copy.pCurrent;
+				pSolid->CopyFromWithoutFaces((CMapSolid *)m_Copy.pKeptObject, true);
+				m_Copy.pKeptFaces->Restore(pSolid, true);
+
+				delete m_Copy.pKeptFaces;
+				m_Copy.pKeptFaces = NULL;
+			}
+			else
+			{
+				m_Copy.pCurrent->CopyFrom(m_Copy.pKeptObject, true);
+			}
 
 			//
 			// Delete the copy of the kept object.
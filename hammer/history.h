@@ -15,6 +15,7 @@
 class CMapClass;
 class CMapDoc;
 class CHistory;
+class CKeptFaces;
 
 //
 // Holds undo information for a single object, due to a single operation. Held by a CHistoryTrack.
@@ -65,6 +66,7 @@ class CTrackEntry
 			{
 				CMapClass *pCurrent;		// Pointer to the object as it currently exists in the world.
 				CMapClass *pKeptObject;		// Pointer to a copy of the object at the time it was kept.
+				CKeptFaces *pKeptFaces;		// For solids, the kept faces. pKeptObject then has no faces.
 			} m_Copy;
 
 			struct
@@ -172,6 +174,10 @@ public:
 	// returns current name
 	LPCTSTR GetCurTrackName() { return CurTrack ? CurTrack->szName : ""; }
 
+	// approximate memory used by the current track and by the whole history:
+	size_t GetCurTrackSize() { return CurTrack ? CurTrack->uDataSize : 0; }
+	size_t GetDataSize() { return uDataSize; }
+
 	// total override:
 	void SetActive(BOOL bActive);
 	BOOL IsActive() { return m_bActive; }
@@ -0,0 +1,321 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed, shared storage for the undo history. Blocks are found
+//			by a hash of their uncompressed bytes and reference counted, so the
+//			same data kept by many undo steps is only stored once.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "stdafx.h"
+#include "historyblocks.h"
+#include "mapsolid.h"
+#include "mapface.h"
+#include "tier1/generichash.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/snappy.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+
+struct HistoryBlock_t
+{
+	uint32 m_nHash;						// Hash of the uncompressed data.
+	int m_nSize;						// Size of the uncompressed data.
+	int m_nCompressedSize;
+	int m_nRefCount;
+	char *m_pCompressed;
+	HistoryBlock_t *m_pNextSameHash;	// Next block whose data has the same hash.
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the block store shared by all undo histories.
+//-----------------------------------------------------------------------------
+CHistoryBlockStore *HistoryBlockStore(void)
+{
+	static CHistoryBlockStore s_HistoryBlockStore;
+	return(&s_HistoryBlockStore);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor.
+//-----------------------------------------------------------------------------
+CHistoryBlockStore::CHistoryBlockStore(void)
+{
+	m_nMemoryUsed = 0;
+	m_nBlockCount = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Destructor. Frees any blocks that are still referenced.
+//-----------------------------------------------------------------------------
+CHistoryBlockStore::~CHistoryBlockStore(void)
+{
+	FOR_EACH_HASHTABLE(m_Blocks, i)
+	{
+		HistoryBlock_t *pBlock = m_Blocks[i];
+		while (pBlock != NULL)
+		{
+			HistoryBlock_t *pNext = pBlock->m_pNextSameHash;
+			delete [] pBlock->m_pCompressed;
+			delete pBlock;
+			pBlock = pNext;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the given block holds exactly the given bytes.
+//-----------------------------------------------------------------------------
+bool CHistoryBlockStore::DataMatches(HistoryBlock_t *pBlock, const void *pData, int nSize)
+{
+	if (pBlock->m_nSize != nSize)
+	{
+		return(false);
+	}
+
+	m_Scratch.EnsureCapacity(nSize);
+	if (!snappy::RawUncompress(pBlock->m_pCompressed, pBlock->m_nCompressedSize, m_Scratch.Base()))
+	{
+		return(false);
+	}
+
+	return(memcmp(m_Scratch.Base(), pData, nSize) == 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds a reference to the block holding the given bytes.
+// Input  : pData - Uncompressed data.
+//			nSize - Size of the data.
+//			bCreated - Set to true if a new block was created for the data, false
+//				if an existing block already held it.
+// Output : Returns the block. Release it with ReleaseBlock.
+//-----------------------------------------------------------------------------
+HistoryBlockHandle_t CHistoryBlockStore::AddBlock(const void *pData, int nSize, bool &bCreated)
+{
+	uint32 nHash = MurmurHash2(pData, nSize, 0);
+
+	HistoryBlock_t *pFirst = NULL;
+	UtlHashHandle_t hHash = m_Blocks.Find(nHash);
+	if (hHash != m_Blocks.InvalidHandle())
+	{
+		pFirst = m_Blocks[hHash];
+		for (HistoryBlock_t *pBlock = pFirst; pBlock != NULL; pBlock = pBlock->m_pNextSameHash)
+		{
+			if (DataMatches(pBlock, pData, nSize))
+			{
+				pBlock->m_nRefCount++;
+				bCreated = false;
+				return(pBlock);
+			}
+		}
+	}
+
+	//
+	// Compress into scratch memory first, then copy just what was used.
+	//
+	size_t nCompressedSize = snappy::MaxCompressedLength(nSize);
+	m_Scratch.EnsureCapacity((int)nCompressedSize);
+	snappy::RawCompress((const char *)pData, nSize, m_Scratch.Base(), &nCompressedSize);
+
+	HistoryBlock_t *pBlock = new HistoryBlock_t;
+	pBlock->m_nHash = nHash;
+	pBlock->m_nSize = nSize;
+	pBlock->m_nCompressedSize = (int)nCompressedSize;
+	pBlock->m_nRefCount = 1;
+	pBlock->m_pCompressed = new char[nCompressedSize];
+	memcpy(pBlock->m_pCompressed, m_Scratch.Base(), nCompressedSize);
+	pBlock->m_pNextSameHash = pFirst;
+
+	if (hHash != m_Blocks.InvalidHandle())
+	{
+		m_Blocks[hHash] = pBlock;
+	}
+	else
+	{
+		m_Blocks.Insert(nHash, pBlock);
+	}
+
+	m_nMemoryUsed += sizeof(HistoryBlock_t) + nCompressedSize;
+	m_nBlockCount++;
+
+	bCreated = true;
+	return(pBlock);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Removes a reference to a block, freeing it if it was the last one.
+//-----------------------------------------------------------------------------
+void CHistoryBlockStore::ReleaseBlock(HistoryBlockHandle_t hBlock)
+{
+	Assert(hBlock->m_nRefCount > 0);
+	if (--hBlock->m_nRefCount > 0)
+	{
+		return;
+	}
+
+	//
+	// Unlink the block from the blocks with the same hash.
+	//
+	UtlHashHandle_t hHash = m_Blocks.Find(hBlock->m_nHash);
+	Assert(hHash != m_Blocks.InvalidHandle());
+
+	HistoryBlock_t **ppLink = &m_Blocks[hHash];
+	while (*ppLink != hBlock)
+	{
+		ppLink = &(*ppLink)->m_pNextSameHash;
+	}
+
+	*ppLink = hBlock->m_pNextSameHash;
+	if (m_Blocks[hHash] == NULL)
+	{
+		m_Blocks.Remove(hBlock->m_nHash);
+	}
+
+	m_nMemoryUsed -= sizeof(HistoryBlock_t) + hBlock->m_nCompressedSize;
+	m_nBlockCount--;
+
+	delete [] hBlock->m_pCompressed;
+	delete hBlock;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Uncompresses a block.
+// Input  : hBlock - Block to uncompress.
+//			buf - Receives the uncompressed data, ready to be read.
+// Output : Returns false if the block could not be uncompressed.
+//-----------------------------------------------------------------------------
+bool CHistoryBlockStore::GetBlockData(HistoryBlockHandle_t hBlock, CUtlBuffer &buf)
+{
+	buf.Clear();
+	buf.EnsureCapacity(hBlock->m_nSize);
+
+	if (!snappy::RawUncompress(hBlock->m_pCompressed, hBlock->m_nCompressedSize, (char *)buf.Base()))
+	{
+		return(false);
+	}
+
+	buf.SeekPut(CUtlBuffer::SEEK_HEAD, hBlock->m_nSize);
+	return(true);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the given block holds exactly the given bytes.
+//-----------------------------------------------------------------------------
+bool CHistoryBlockStore::BlockMatches(HistoryBlockHandle_t hBlock, const void *pData, int nSize)
+{
+	if ((hBlock->m_nSize != nSize) || (hBlock->m_nHash != MurmurHash2(pData, nSize, 0)))
+	{
+		return(false);
+	}
+
+	return(DataMatches(hBlock, pData, nSize));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the number of bytes a block takes up in memory.
+//-----------------------------------------------------------------------------
+int CHistoryBlockStore::GetCompressedSize(HistoryBlockHandle_t hBlock) const
+{
+	return(sizeof(HistoryBlock_t) + hBlock->m_nCompressedSize);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Keeps the faces of a solid.
+// Input  : pSolid - Solid whose faces to keep.
+//-----------------------------------------------------------------------------
+CKeptFaces::CKeptFaces(CMapSolid *pSolid)
+{
+	CHistoryBlockStore *pStore = HistoryBlockStore();
+	CUtlBuffer buf;
+
+	int nFaces = pSolid->GetFaceCount();
+	m_Faces.EnsureCount(nFaces);
+	m_SelectionStates.EnsureCount(nFaces);
+	m_nDataSize = sizeof(*this) + nFaces * (sizeof(HistoryBlockHandle_t) + sizeof(SelectionState_t));
+
+	for (int i = 0; i < nFaces; i++)
+	{
+		CMapFace *pFace = pSolid->GetFace(i);
+
+		buf.Clear();
+		pFace->SaveUndoState(buf);
+
+		bool bCreated;
+		m_Faces[i] = pStore->AddBlock(buf.Base(), buf.TellPut(), bCreated);
+		m_SelectionStates[i] = pFace->GetSelectionState();
+
+		if (bCreated)
+		{
+			m_nDataSize += pStore->GetCompressedSize(m_Faces[i]);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Destructor. Releases the kept face blocks.
+//-----------------------------------------------------------------------------
+CKeptFaces::~CKeptFaces(void)
+{
+	CHistoryBlockStore *pStore = HistoryBlockStore();
+	for (int i = 0; i < m_Faces.Count(); i++)
+	{
+		pStore->ReleaseBlock(m_Faces[i]);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Puts the kept faces back into the solid. Faces that are already the
+//			same as the kept ones are left alone, so undoing a change to a few
+//			faces of a solid doesn't rebuild the rest, such as displacements
+//			that weren't touched.
+// Input  : pSolid - Solid to restore, the one the faces were kept from.
+//			bUpdateDependencies - Passed on to the faces, as with CopyFrom.
+//-----------------------------------------------------------------------------
+void CKeptFaces::Restore(CMapSolid *pSolid, bool bUpdateDependencies)
+{
+	CHistoryBlockStore *pStore = HistoryBlockStore();
+	CUtlBuffer buf;
+
+	int nFaces = m_Faces.Count();
+	bool bSameFaceCount = (pSolid->GetFaceCount() == nFaces);
+	pSolid->SetFaceCount(nFaces);
+
+	for (int i = nFaces - 1; i >= 0; i--)
+	{
+		CMapFace *pFace = pSolid->GetFace(i);
+		pFace->SetParent(pSolid);
+
+		if (bSameFaceCount)
+		{
+			buf.Clear();
+			pFace->SaveUndoState(buf);
+			if (pStore->BlockMatches(m_Faces[i], buf.Base(), buf.TellPut()))
+			{
+				pFace->SetSelectionState(m_SelectionStates[i]);
+				continue;
+			}
+		}
+
+		if (pStore->GetBlockData(m_Faces[i], buf))
+		{
+			pFace->LoadUndoState(buf, bUpdateDependencies);
+			Assert(!buf.IsValid() || (buf.TellGet() == buf.TellPut()));
+		}
+
+		pFace->SetSelectionState(m_SelectionStates[i]);
+	}
+}
@@ -0,0 +1,86 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed, shared storage for the undo history. Kept object state
+//			is serialized into blocks which are compressed with snappy and
+//			stored once no matter how many undo steps refer to them.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef HISTORYBLOCKS_H
+#define HISTORYBLOCKS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier1/utlvector.h"
+#include "tier1/utlhashtable.h"
+#include "mapatom.h"	// For SelectionState_t
+
+class CUtlBuffer;
+class CMapSolid;
+
+struct HistoryBlock_t;
+typedef HistoryBlock_t *HistoryBlockHandle_t;
+
+
+class CHistoryBlockStore
+{
+	public:
+
+		CHistoryBlockStore(void);
+		~CHistoryBlockStore(void);
+
+		//
+		// Adds a reference to the block holding the given bytes, creating the
+		// block if no block holds them yet. bCreated is set if it was created.
+		//
+		HistoryBlockHandle_t AddBlock(const void *pData, int nSize, bool &bCreated);
+		void ReleaseBlock(HistoryBlockHandle_t hBlock);
+
+		bool GetBlockData(HistoryBlockHandle_t hBlock, CUtlBuffer &buf);
+		bool BlockMatches(HistoryBlockHandle_t hBlock, const void *pData, int nSize);
+		int GetCompressedSize(HistoryBlockHandle_t hBlock) const;
+
+		inline size_t GetMemoryUsed(void) const { return(m_nMemoryUsed); }
+		inline int GetBlockCount(void) const { return(m_nBlockCount); }
+
+	protected:
+
+		bool DataMatches(HistoryBlock_t *pBlock, const void *pData, int nSize);
+
+		CUtlHashtable<uint32, HistoryBlock_t *> m_Blocks;	// Data hash -> first block with that hash.
+		CUtlMemory<char> m_Scratch;
+		size_t m_nMemoryUsed;
+		int m_nBlockCount;
+};
+
+CHistoryBlockStore *HistoryBlockStore(void);
+
+
+//
+// The faces of a solid, as kept by the undo history. Each face is kept in its
+// own block, so faces that are the same in several undo steps are stored once,
+// and restoring the solid only touches the faces that differ.
+//
+class CKeptFaces
+{
+	public:
+
+		CKeptFaces(CMapSolid *pSolid);
+		~CKeptFaces(void);
+
+		void Restore(CMapSolid *pSolid, bool bUpdateDependencies);
+
+		// Bytes this added to the history, not counting blocks that were already kept.
+		inline size_t GetSize(void) const { return(m_nDataSize); }
+
+	protected:
+
+		CUtlVector<HistoryBlockHandle_t> m_Faces;
+		CUtlVector<SelectionState_t> m_SelectionStates;
+		size_t m_nDataSize;
+};
+
+
+#endif // HISTORYBLOCKS_H
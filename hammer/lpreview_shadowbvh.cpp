@@ -0,0 +1,503 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: two level acceleration structure for the lighting preview's shadow rays. The
+//			bottom level is a bvh per map object, built once when the object's triangles
+//			arrive. The top level is a bvh over the objects' bounds, refit when objects
+//			change shape and rebuilt when objects come and go. Dragging a brush around
+//			therefore costs a rebuild of that brush's few triangles plus a refit.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "stdafx.h"
+#include "lpreview_shadowbvh.h"
+#include "lpreview_thread.h"
+#include "raytrace.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+constexpr int SHADOWBVH_MAX_TRIANGLES_PER_LEAF = 4;
+constexpr int SHADOWBVH_MAX_OBJECTS_PER_LEAF = 2;
+
+// triangles with a determinant smaller than this are considered parallel to the ray
+static const fltx4 Four_DeterminantEpsilon = ReplicateX4( 1.0e-8f );
+
+
+// returns a mask of the rays which enter the box before TMax
+static FORCEINLINE fltx4 RayBoxMask( const FourRays& rays, const FourVectors& invDir, const Vector& vecMins, const Vector& vecMaxs, fltx4 TMax )
+{
+	fltx4 t1 = MulSIMD( SubSIMD( ReplicateX4( vecMins.x ), rays.origin.x ), invDir.x );
+	fltx4 t2 = MulSIMD( SubSIMD( ReplicateX4( vecMaxs.x ), rays.origin.x ), invDir.x );
+	fltx4 tNear = MinSIMD( t1, t2 );
+	fltx4 tFar = MaxSIMD( t1, t2 );
+
+	t1 = MulSIMD( SubSIMD( ReplicateX4( vecMins.y ), rays.origin.y ), invDir.y );
+	t2 = MulSIMD( SubSIMD( ReplicateX4( vecMaxs.y ), rays.origin.y ), invDir.y );
+	tNear = MaxSIMD( tNear, MinSIMD( t1, t2 ) );
+	tFar = MinSIMD( tFar, MaxSIMD( t1, t2 ) );
+
+	t1 = MulSIMD( SubSIMD( ReplicateX4( vecMins.z ), rays.origin.z ), invDir.z );
+	t2 = MulSIMD( SubSIMD( ReplicateX4( vecMaxs.z ), rays.origin.z ), invDir.z );
+	tNear = MaxSIMD( tNear, MinSIMD( t1, t2 ) );
+	tFar = MinSIMD( tFar, MaxSIMD( t1, t2 ) );
+
+	tNear = MaxSIMD( tNear, Four_Zeros );
+	tFar = MinSIMD( tFar, TMax );
+	return CmpLeSIMD( tNear, tFar );
+}
+
+
+// moller-trumbore test of 4 rays against one triangle. returns a mask of the rays which hit
+// it between 0 and TMax, with the distances in t.
+static FORCEINLINE fltx4 RayTriangleMask( const FourRays& rays, const Vector& v0, const Vector& vecEdge1, const Vector& vecEdge2, fltx4 TMax, fltx4& t )
+{
+	fltx4 e1x = ReplicateX4( vecEdge1.x ), e1y = ReplicateX4( vecEdge1.y ), e1z = ReplicateX4( vecEdge1.z );
+	fltx4 e2x = ReplicateX4( vecEdge2.x ), e2y = ReplicateX4( vecEdge2.y ), e2z = ReplicateX4( vecEdge2.z );
+
+	// p = dir x e2
+	fltx4 px = SubSIMD( MulSIMD( rays.direction.y, e2z ), MulSIMD( rays.direction.z, e2y ) );
+	fltx4 py = SubSIMD( MulSIMD( rays.direction.z, e2x ), MulSIMD( rays.direction.x, e2z ) );
+	fltx4 pz = SubSIMD( MulSIMD( rays.direction.x, e2y ), MulSIMD( rays.direction.y, e2x ) );
+	fltx4 det = AddSIMD( MulSIMD( e1x, px ), AddSIMD( MulSIMD( e1y, py ), MulSIMD( e1z, pz ) ) );
+	fltx4 mask = OrSIMD( CmpGtSIMD( det, Four_DeterminantEpsilon ), CmpLtSIMD( det, NegSIMD( Four_DeterminantEpsilon ) ) );
+	if ( IsAllZeros( mask ) )
+		return mask;
+	fltx4 invDet = ReciprocalSaturateSIMD( det );
+
+	fltx4 tx = SubSIMD( rays.origin.x, ReplicateX4( v0.x ) );
+	fltx4 ty = SubSIMD( rays.origin.y, ReplicateX4( v0.y ) );
+	fltx4 tz = SubSIMD( rays.origin.z, ReplicateX4( v0.z ) );
+	fltx4 u = MulSIMD( AddSIMD( MulSIMD( tx, px ), AddSIMD( MulSIMD( ty, py ), MulSIMD( tz, pz ) ) ), invDet );
+	mask = AndSIMD( mask, AndSIMD( CmpGeSIMD( u, Four_Zeros ), CmpLeSIMD( u, Four_Ones ) ) );
+	if ( IsAllZeros( mask ) )
+		return mask;
+
+	// q = (origin - v0) x e1
+	fltx4 qx = SubSIMD( MulSIMD( ty, e1z ), MulSIMD( tz, e1y ) );
+	fltx4 qy = SubSIMD( MulSIMD( tz, e1x ), MulSIMD( tx, e1z ) );
+	fltx4 qz = SubSIMD( MulSIMD( tx, e1y ), MulSIMD( ty, e1x ) );
+	fltx4 v = MulSIMD( AddSIMD( MulSIMD( rays.direction.x, qx ), AddSIMD( MulSIMD( rays.direction.y, qy ), MulSIMD( rays.direction.z, qz ) ) ), invDet );
+	mask = AndSIMD( mask, AndSIMD( CmpGeSIMD( v, Four_Zeros ), CmpLeSIMD( AddSIMD( u, v ), Four_Ones ) ) );
+	if ( IsAllZeros( mask ) )
+		return mask;
+
+	t = MulSIMD( AddSIMD( MulSIMD( e2x, qx ), AddSIMD( MulSIMD( e2y, qy ), MulSIMD( e2z, qz ) ) ), invDet );
+	return AndSIMD( mask, AndSIMD( CmpGtSIMD( t, Four_Zeros ), CmpLtSIMD( t, TMax ) ) );
+}
+
+
+// reciprocal of the ray directions, with zero components replaced by a large value so the
+// slab tests don't produce nans
+static FORCEINLINE FourVectors InverseDirections( const FourRays& rays )
+{
+	FourVectors invDir;
+	invDir.x = ReciprocalSaturateSIMD( rays.direction.x );
+	invDir.y = ReciprocalSaturateSIMD( rays.direction.y );
+	invDir.z = ReciprocalSaturateSIMD( rays.direction.z );
+	return invDir;
+}
+
+
+CLightingPreviewShadowBVH::CLightingPreviewShadowBVH( void )
+{
+	m_bTopLevelStale = false;
+	m_bTopLevelNeedsRefit = false;
+}
+
+
+CLightingPreviewShadowBVH::~CLightingPreviewShadowBVH( void )
+{
+	m_Objects.PurgeAndDeleteElements();
+}
+
+
+void CLightingPreviewShadowBVH::ApplyChunks( CUtlVector<LightingPreviewGeomChunk_t>& chunks, bool bReset )
+{
+	if ( bReset )
+	{
+		m_Objects.PurgeAndDeleteElements();
+		m_ObjectIndex.RemoveAll();
+		m_bTopLevelStale = true;
+	}
+
+	for ( int i = 0; i < chunks.Count(); i++ )
+	{
+		LightingPreviewGeomChunk_t& chunk = chunks[i];
+		UtlHashHandle_t h = m_ObjectIndex.Find( chunk.m_nObjectID );
+		if ( chunk.m_Triangles.Count() < 3 )
+		{
+			// the object is gone
+			if ( h != m_ObjectIndex.InvalidHandle() )
+			{
+				int nIndex = m_ObjectIndex.Element( h );
+				m_ObjectIndex.Remove( chunk.m_nObjectID );
+				delete m_Objects[nIndex];
+				m_Objects.FastRemove( nIndex );
+				if ( nIndex < m_Objects.Count() )
+					m_ObjectIndex.Element( m_ObjectIndex.Find( m_Objects[nIndex]->m_nObjectID ) ) = nIndex;
+				m_bTopLevelStale = true;
+			}
+			continue;
+		}
+
+		Object_t* pObject;
+		if ( h == m_ObjectIndex.InvalidHandle() )
+		{
+			pObject = new Object_t;
+			pObject->m_nObjectID = chunk.m_nObjectID;
+			m_ObjectIndex.Insert( chunk.m_nObjectID, m_Objects.AddToTail( pObject ) );
+			m_bTopLevelStale = true;
+		}
+		else
+			pObject = m_Objects[m_ObjectIndex.Element( h )];
+
+		pObject->m_Vertices.Swap( chunk.m_Triangles );
+		pObject->m_bDirty = true;
+	}
+}
+
+
+void CLightingPreviewShadowBVH::Update( void )
+{
+	for ( int i = 0; i < m_Objects.Count(); i++ )
+	{
+		if ( m_Objects[i]->m_bDirty )
+		{
+			// objects without triangles are left out of the top level, so one that gains or
+			// loses all of its triangles needs the top level rebuilt rather than refit
+			bool bHadNodes = !m_Objects[i]->m_Nodes.IsEmpty();
+			BuildObject( m_Objects[i] );
+			if ( bHadNodes != !m_Objects[i]->m_Nodes.IsEmpty() )
+				m_bTopLevelStale = true;
+			m_bTopLevelNeedsRefit = true;
+		}
+	}
+
+	if ( m_bTopLevelStale )
+		BuildTopLevel();
+	else if ( m_bTopLevelNeedsRefit )
+		RefitTopLevel();
+
+	m_bTopLevelStale = false;
+	m_bTopLevelNeedsRefit = false;
+}
+
+
+// build a bvh over the given items by splitting them at the midpoint of their centers along
+// the longest axis. pItems is reordered so that each leaf's items are contiguous.
+void CLightingPreviewShadowBVH::BuildTree( CUtlVector<Node_t>& nodes, int* pItems, int nItems,
+										   const Vector* pMins, const Vector* pMaxs, int nMaxLeafItems )
+{
+	nodes.RemoveAll();
+	if ( nItems )
+	{
+		nodes.EnsureCapacity( 2 * ( nItems / nMaxLeafItems ) + 1 );
+		BuildTreeRecurse( nodes, pItems, 0, nItems, pMins, pMaxs, nMaxLeafItems );
+	}
+}
+
+
+int CLightingPreviewShadowBVH::BuildTreeRecurse( CUtlVector<Node_t>& nodes, int* pItems, int nFirst, int nItems,
+												 const Vector* pMins, const Vector* pMaxs, int nMaxLeafItems )
+{
+	int nNode = nodes.AddToTail();
+
+	Vector vecMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	Vector vecCenterMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecCenterMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = nFirst; i < nFirst + nItems; i++ )
+	{
+		int nItem = pItems[i];
+		vecMins = vecMins.Min( pMins[nItem] );
+		vecMaxs = vecMaxs.Max( pMaxs[nItem] );
+		Vector vecCenter = pMins[nItem] + pMaxs[nItem];	// doubled
+		vecCenterMins = vecCenterMins.Min( vecCenter );
+		vecCenterMaxs = vecCenterMaxs.Max( vecCenter );
+	}
+	nodes[nNode].m_vecMins = vecMins;
+	nodes[nNode].m_vecMaxs = vecMaxs;
+
+	if ( nItems <= nMaxLeafItems )
+	{
+		nodes[nNode].m_nIndex = nFirst;
+		nodes[nNode].m_nCount = nItems;
+		return nNode;
+	}
+
+	Vector vecExtent = vecCenterMaxs - vecCenterMins;
+	int nAxis = 0;
+	if ( vecExtent.y > vecExtent[nAxis] )
+		nAxis = 1;
+	if ( vecExtent.z > vecExtent[nAxis] )
+		nAxis = 2;
+
+	float flSplit = 0.5f * ( vecCenterMins[nAxis] + vecCenterMaxs[nAxis] );
+	int nLeft = nFirst;
+	int nRight = nFirst + nItems - 1;
+	while ( nLeft <= nRight )
+	{
+		int nItem = pItems[nLeft];
+		if ( pMins[nItem][nAxis] + pMaxs[nItem][nAxis] < flSplit )
+			nLeft++;
+		else
+		{
+			pItems[nLeft] = pItems[nRight];
+			pItems[nRight] = nItem;
+			nRight--;
+		}
+	}
+	int nLeftCount = nLeft - nFirst;
+
+	// all the centers coincide - split the list in half instead
+	if ( nLeftCount == 0 || nLeftCount == nItems )
+		nLeftCount = nItems / 2;
+
+	BuildTreeRecurse( nodes, pItems, nFirst, nLeftCount, pMins, pMaxs, nMaxLeafItems );
+	int nSecondChild = BuildTreeRecurse( nodes, pItems, nFirst + nLeftCount, nItems - nLeftCount, pMins, pMaxs, nMaxLeafItems );
+	nodes[nNode].m_nIndex = nSecondChild;
+	nodes[nNode].m_nCount = 0;
+	return nNode;
+}
+
+
+void CLightingPreviewShadowBVH::BuildObject( Object_t* pObject )
+{
+	CUtlVector<Vector>& verts = pObject->m_Vertices;
+
+	// drop degenerate triangles, they can't block anything and have no normal
+	CUtlVector<Triangle_t> tris;
+	tris.EnsureCapacity( verts.Count() / 3 );
+	for ( int i = 0; i + 2 < verts.Count(); i += 3 )
+	{
+		Triangle_t tri;
+		tri.m_v0 = verts[i];
+		tri.m_vecEdge1 = verts[i + 1] - verts[i];
+		tri.m_vecEdge2 = verts[i + 2] - verts[i];
+		tri.m_vecNormal = CrossProduct( tri.m_vecEdge1, tri.m_vecEdge2 );
+		if ( VectorNormalize( tri.m_vecNormal ) > 1.0e-6f )
+			tris.AddToTail( tri );
+	}
+	verts.Purge();
+
+	CUtlVector<Vector> mins, maxs;
+	CUtlVector<int> items;
+	mins.SetCount( tris.Count() );
+	maxs.SetCount( tris.Count() );
+	items.SetCount( tris.Count() );
+	for ( int i = 0; i < tris.Count(); i++ )
+	{
+		const Triangle_t& tri = tris[i];
+		Vector v1 = tri.m_v0 + tri.m_vecEdge1;
+		Vector v2 = tri.m_v0 + tri.m_vecEdge2;
+		mins[i] = tri.m_v0.Min( v1 ).Min( v2 );
+		maxs[i] = tri.m_v0.Max( v1 ).Max( v2 );
+		items[i] = i;
+	}
+	BuildTree( pObject->m_Nodes, items.Base(), items.Count(), mins.Base(), maxs.Base(), SHADOWBVH_MAX_TRIANGLES_PER_LEAF );
+
+	// store the triangles in leaf order
+	pObject->m_Triangles.SetCount( tris.Count() );
+	for ( int i = 0; i < items.Count(); i++ )
+		pObject->m_Triangles[i] = tris[items[i]];
+
+	if ( pObject->m_Nodes.Count() )
+	{
+		pObject->m_vecMins = pObject->m_Nodes[0].m_vecMins;
+		pObject->m_vecMaxs = pObject->m_Nodes[0].m_vecMaxs;
+	}
+	else
+	{
+		pObject->m_vecMins.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+		pObject->m_vecMaxs.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	}
+	pObject->m_bDirty = false;
+}
+
+
+void CLightingPreviewShadowBVH::BuildTopLevel( void )
+{
+	CUtlVector<Vector> mins, maxs;
+	mins.SetCount( m_Objects.Count() );
+	maxs.SetCount( m_Objects.Count() );
+	m_TopObjects.RemoveAll();
+	for ( int i = 0; i < m_Objects.Count(); i++ )
+	{
+		mins[i] = m_Objects[i]->m_vecMins;
+		maxs[i] = m_Objects[i]->m_vecMaxs;
+		if ( m_Objects[i]->m_Nodes.Count() )
+			m_TopObjects.AddToTail( i );
+	}
+	BuildTree( m_TopNodes, m_TopObjects.Base(), m_TopObjects.Count(), mins.Base(), maxs.Base(), SHADOWBVH_MAX_OBJECTS_PER_LEAF );
+}
+
+
+void CLightingPreviewShadowBVH::RefitTopLevel( void )
+{
+	// children always come after their parents, so walking backwards visits them first
+	for ( int i = m_TopNodes.Count() - 1; i >= 0; i-- )
+	{
+		Node_t& node = m_TopNodes[i];
+		if ( node.IsLeaf() )
+		{
+			node.m_vecMins.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+			node.m_vecMaxs.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+			for ( int j = node.m_nIndex; j < node.m_nIndex + node.m_nCount; j++ )
+			{
+				const Object_t* pObject = m_Objects[m_TopObjects[j]];
+				node.m_vecMins = node.m_vecMins.Min( pObject->m_vecMins );
+				node.m_vecMaxs = node.m_vecMaxs.Max( pObject->m_vecMaxs );
+			}
+		}
+		else
+		{
+			const Node_t& child0 = m_TopNodes[i + 1];
+			const Node_t& child1 = m_TopNodes[node.m_nIndex];
+			node.m_vecMins = child0.m_vecMins.Min( child1.m_vecMins );
+			node.m_vecMaxs = child0.m_vecMaxs.Max( child1.m_vecMaxs );
+		}
+	}
+}
+
+
+void CLightingPreviewShadowBVH::TraceObject( const Object_t* pObject, const FourRays& rays, const FourVectors& invDir,
+											 fltx4& TMax, RayTracingResult* pResult ) const
+{
+	if ( pObject->m_Nodes.IsEmpty() )
+		return;
+
+	CUtlVectorFixedGrowable<int, 64> stack;
+	stack.AddToTail( 0 );
+	while ( stack.Count() )
+	{
+		int nNode = stack.Tail();
+		stack.RemoveMultipleFromTail( 1 );
+		const Node_t& node = pObject->m_Nodes[nNode];
+		if ( IsAllZeros( RayBoxMask( rays, invDir, node.m_vecMins, node.m_vecMaxs, TMax ) ) )
+			continue;
+		if ( !node.IsLeaf() )
+		{
+			stack.AddToTail( node.m_nIndex );
+			stack.AddToTail( nNode + 1 );
+			continue;
+		}
+		for ( int i = node.m_nIndex; i < node.m_nIndex + node.m_nCount; i++ )
+		{
+			const Triangle_t& tri = pObject->m_Triangles[i];
+			fltx4 t;
+			fltx4 hit = RayTriangleMask( rays, tri.m_v0, tri.m_vecEdge1, tri.m_vecEdge2, TMax, t );
+			if ( IsAllZeros( hit ) )
+				continue;
+			TMax = MaskedAssign( hit, t, TMax );
+			pResult->HitDistance = MaskedAssign( hit, t, pResult->HitDistance );
+			StoreAlignedSIMD( ( float* ) pResult->HitIds, MaskedAssign( hit, ReplicateIX4( i ), LoadAlignedSIMD( ( float* ) pResult->HitIds ) ) );
+			pResult->surface_normal.x = MaskedAssign( hit, ReplicateX4( tri.m_vecNormal.x ), pResult->surface_normal.x );
+			pResult->surface_normal.y = MaskedAssign( hit, ReplicateX4( tri.m_vecNormal.y ), pResult->surface_normal.y );
+			pResult->surface_normal.z = MaskedAssign( hit, ReplicateX4( tri.m_vecNormal.z ), pResult->surface_normal.z );
+		}
+	}
+}
+
+
+fltx4 CLightingPreviewShadowBVH::OccludeObject( const Object_t* pObject, const FourRays& rays, const FourVectors& invDir,
+												fltx4 TMax, fltx4 blocked ) const
+{
+	if ( pObject->m_Nodes.IsEmpty() )
+		return blocked;
+
+	CUtlVectorFixedGrowable<int, 64> stack;
+	stack.AddToTail( 0 );
+	while ( stack.Count() )
+	{
+		int nNode = stack.Tail();
+		stack.RemoveMultipleFromTail( 1 );
+		const Node_t& node = pObject->m_Nodes[nNode];
+		if ( IsAllZeros( AndNotSIMD( blocked, RayBoxMask( rays, invDir, node.m_vecMins, node.m_vecMaxs, TMax ) ) ) )
+			continue;
+		if ( !node.IsLeaf() )
+		{
+			stack.AddToTail( node.m_nIndex );
+			stack.AddToTail( nNode + 1 );
+			continue;
+		}
+		for ( int i = node.m_nIndex; i < node.m_nIndex + node.m_nCount; i++ )
+		{
+			const Triangle_t& tri = pObject->m_Triangles[i];
+			fltx4 t;
+			blocked = OrSIMD( blocked, RayTriangleMask( rays, tri.m_v0, tri.m_vecEdge1, tri.m_vecEdge2, TMax, t ) );
+			if ( TestSignSIMD( blocked ) == 0xf )
+				return blocked;
+		}
+	}
+	return blocked;
+}
+
+
+void CLightingPreviewShadowBVH::Trace4Rays( const FourRays& rays, fltx4 TMax, RayTracingResult* pResult ) const
+{
+	StoreAlignedSIMD( ( float* ) pResult->HitIds, ReplicateIX4( -1 ) );
+	pResult->HitDistance = TMax;
+	pResult->surface_normal.DuplicateVector( vec3_origin );
+	if ( m_TopNodes.IsEmpty() )
+		return;
+
+	FourVectors invDir = InverseDirections( rays );
+	CUtlVectorFixedGrowable<int, 64> stack;
+	stack.AddToTail( 0 );
+	while ( stack.Count() )
+	{
+		int nNode = stack.Tail();
+		stack.RemoveMultipleFromTail( 1 );
+		const Node_t& node = m_TopNodes[nNode];
+		if ( IsAllZeros( RayBoxMask( rays, invDir, node.m_vecMins, node.m_vecMaxs, TMax ) ) )
+			continue;
+		if ( !node.IsLeaf() )
+		{
+			stack.AddToTail( node.m_nIndex );
+			stack.AddToTail( nNode + 1 );
+			continue;
+		}
+		for ( int i = node.m_nIndex; i < node.m_nIndex + node.m_nCount; i++ )
+		{
+			const Object_t* pObject = m_Objects[m_TopObjects[i]];
+			if ( node.m_nCount > 1 && IsAllZeros( RayBoxMask( rays, invDir, pObject->m_vecMins, pObject->m_vecMaxs, TMax ) ) )
+				continue;
+			TraceObject( pObject, rays, invDir, TMax, pResult );
+		}
+	}
+}
+
+
+fltx4 CLightingPreviewShadowBVH::Occluded4Rays( const FourRays& rays, fltx4 TMax ) const
+{
+	fltx4 blocked = Four_Zeros;
+	if ( m_TopNodes.IsEmpty() )
+		return blocked;
+
+	FourVectors invDir = InverseDirections( rays );
+	CUtlVectorFixedGrowable<int, 64> stack;
+	stack.AddToTail( 0 );
+	while ( stack.Count() )
+	{
+		int nNode = stack.Tail();
+		stack.RemoveMultipleFromTail( 1 );
+		const Node_t& node = m_TopNodes[nNode];
+		if ( IsAllZeros( AndNotSIMD( blocked, RayBoxMask( rays, invDir, node.m_vecMins, node.m_vecMaxs, TMax ) ) ) )
+			continue;
+		if ( !node.IsLeaf() )
+		{
+			stack.AddToTail( node.m_nIndex );
+			stack.AddToTail( nNode + 1 );
+			continue;
+		}
+		for ( int i = node.m_nIndex; i < node.m_nIndex + node.m_nCount; i++ )
+		{
+			blocked = OccludeObject( m_Objects[m_TopObjects[i]], rays, invDir, TMax, blocked );
+			if ( TestSignSIMD( blocked ) == 0xf )
+				return blocked;
+		}
+	}
+	return blocked;
+}
@@ -0,0 +1,107 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: two level acceleration structure for the lighting preview's shadow rays. Each
+//			map object gets a bvh over its own triangles, and a top level bvh is kept over
+//			the objects, so that editing an object only rebuilds that object's tree.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef LPREVIEW_SHADOWBVH_H
+#define LPREVIEW_SHADOWBVH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+#include "mathlib/ssemath.h"
+#include "tier1/utlvector.h"
+#include "tier1/utlhashtable.h"
+
+struct LightingPreviewGeomChunk_t;
+struct RayTracingResult;
+class FourRays;
+
+class CLightingPreviewShadowBVH
+{
+public:
+	CLightingPreviewShadowBVH( void );
+	~CLightingPreviewShadowBVH( void );
+
+	// take the triangles of added, changed and removed objects. Trees are not rebuilt until
+	// the next call to Update(). if bReset is set, objects not in the list are thrown away.
+	void ApplyChunks( CUtlVector<LightingPreviewGeomChunk_t>& chunks, bool bReset );
+
+	// rebuild the trees of objects which have changed, and rebuild or refit the top level
+	void Update( void );
+
+	bool IsEmpty( void ) const { return m_Objects.IsEmpty(); }
+
+	// find the closest intersection for each of 4 rays, with the same results as
+	// RayTracingEnvironment::Trace4Rays. HitIds are triangle indices within the object hit.
+	void Trace4Rays( const FourRays& rays, fltx4 TMax, RayTracingResult* pResult ) const;
+
+	// returns a mask of the rays which hit anything closer than TMax. Stops looking as soon as
+	// all 4 rays are blocked, so this is cheaper than Trace4Rays for shadow rays.
+	fltx4 Occluded4Rays( const FourRays& rays, fltx4 TMax ) const;
+
+private:
+	// nodes are stored depth-first. for interior nodes, the first child follows the node and
+	// m_nIndex is the second child. for leaves, m_nIndex is the first of m_nCount items.
+	struct Node_t
+	{
+		Vector m_vecMins;
+		int m_nIndex;
+		Vector m_vecMaxs;
+		int m_nCount;										// 0 for interior nodes
+
+		bool IsLeaf( void ) const { return m_nCount != 0; }
+	};
+
+	struct Triangle_t
+	{
+		Vector m_v0;
+		Vector m_vecEdge1;
+		Vector m_vecEdge2;
+		Vector m_vecNormal;
+	};
+
+	struct Object_t
+	{
+		int m_nObjectID;
+		Vector m_vecMins;
+		Vector m_vecMaxs;
+		bool m_bDirty;										// needs its tree rebuilt
+		CUtlVector<Vector> m_Vertices;						// as received, until the tree is built
+		CUtlVector<Triangle_t> m_Triangles;					// in tree order
+		CUtlVector<Node_t> m_Nodes;
+	};
+
+	static void BuildTree( CUtlVector<Node_t>& nodes, int* pItems, int nItems,
+						   const Vector* pMins, const Vector* pMaxs, int nMaxLeafItems );
+	static int BuildTreeRecurse( CUtlVector<Node_t>& nodes, int* pItems, int nFirst, int nItems,
+								 const Vector* pMins, const Vector* pMaxs, int nMaxLeafItems );
+
+	void BuildObject( Object_t* pObject );
+	void BuildTopLevel( void );
+	void RefitTopLevel( void );
+
+	// trace against one object's triangles, updating the closest hits in pResult and TMax
+	void TraceObject( const Object_t* pObject, const FourRays& rays, const FourVectors& invDir,
+					  fltx4& TMax, RayTracingResult* pResult ) const;
+
+	// same, for any hit. returns the rays blocked so far
+	fltx4 OccludeObject( const Object_t* pObject, const FourRays& rays, const FourVectors& invDir,
+						 fltx4 TMax, fltx4 blocked ) const;
+
+	CUtlVector<Object_t*> m_Objects;
+	CUtlHashtable<int, int> m_ObjectIndex;					// object id -> index in m_Objects
+
+	CUtlVector<Node_t> m_TopNodes;
+	CUtlVector<int> m_TopObjects;							// objects referenced by top level leaves
+
+	bool m_bTopLevelStale;									// objects were added or removed
+	bool m_bTopLevelNeedsRefit;								// object bounds changed
+};
+
+#endif // LPREVIEW_SHADOWBVH_H
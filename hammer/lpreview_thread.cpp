@@ -10,6 +10,7 @@
 
 //#define HAMMER_RAYTRACE
 #include "raytrace.h"
+#include "lpreview_shadowbvh.h"
 #include "hammer.h"
 #include "mainfrm.h"
 #include "mapdoc.h"
@@ -18,6 +19,10 @@
 #include "vstdlib/jobthread.h"
 #include "mathlib/halton.h"
 #include "tier1/fmtstr.h"
+#include "tier1/utlpriorityqueue.h"
+#include "tier1/utlbuffer.h"
+#include "filesystem.h"
+#include "collisionutils.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -30,8 +35,15 @@ CInterlockedInt n_gbufs_queued;
 
 #define NUMBER_OF_LINES_TO_CALCULATE_PER_STEP 8
 
+// lights are binned by their influence bounds into a grid of cells this size, so that only the
+// lights near the view have to be looked at when it changes
+constexpr float LIGHT_GRID_CELL_SIZE = 1024.0f;
+// lights covering more cells than this are kept in a list which is always checked
+constexpr int LIGHT_GRID_MAX_CELLS_PER_LIGHT = 64;
+
 // the current lighting preview output, if we have one
 Bitmap_t * g_pLPreviewOutputBitmap;
+LightingPreviewStats_t g_LPreviewStats;
 IThreadPool *s_pThreadPool;
 static int s_nNumThreads;
 
@@ -58,6 +70,40 @@ constexpr int GBUFFER_ATTR_POSITION = 0;
 constexpr int GBUFFER_ATTR_ALBEDO = 1;
 constexpr int GBUFFER_ATTR_NORMAL = 2;
 
+// the g-buffers are divided into tiles this many quads wide and rows high. the bounds of the
+// positions in each tile are kept, so that lights can skip the tiles they can't reach.
+constexpr int LPREVIEW_TILE_QUADS = 16;
+constexpr int LPREVIEW_TILE_ROWS = 8;
+
+// cleared by the benchmark to time the shading without tile culling
+static bool s_bLightingPreviewTileCulling = true;
+
+struct GBufferTile_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+};
+
+class CGBufferTiles
+{
+public:
+	CUtlVector<GBufferTile_t> m_Tiles;
+	int m_nTilesPerRow;
+
+	CGBufferTiles()
+	{
+		m_nTilesPerRow = 0;
+	}
+
+	// find the bounds of the positions in each tile of a g-buffer
+	void Build( const CSOAContainer& gbuffer );
+
+	const GBufferTile_t& Tile( int nQuad, int y ) const
+	{
+		return m_Tiles[( y / LPREVIEW_TILE_ROWS ) * m_nTilesPerRow + nQuad / LPREVIEW_TILE_QUADS];
+	}
+};
+
 class CIncrementalLightInfo
 {
 public:
@@ -79,7 +125,13 @@ public:
 	int m_nFirstCalculatedLine;
 	bool m_bCreatedIndirectLights;
 
-	bool m_bDisabled;
+	// bounds of the region the light can brighten noticeably. lights without any are always in view
+	bool m_bUnbounded;
+	Vector m_vecInfluenceMins;
+	Vector m_vecInfluenceMaxs;
+	float m_flInfluenceRadius;
+
+	int m_nViewStamp;										// matches the thread's when the light can affect the view
 
 	CIncrementalLightInfo()
 	{
@@ -97,7 +149,11 @@ public:
 		m_nMaxCalculatedLine = -1;
 		m_nFirstCalculatedLine = INT_MAX;
 		m_bCreatedIndirectLights = false;
-		m_bDisabled = false;
+		m_bUnbounded = true;
+		m_vecInfluenceMins.Init();
+		m_vecInfluenceMaxs.Init();
+		m_flInfluenceRadius = 0.f;
+		m_nViewStamp = 0;
 	}
 
 	float PredictedContribution() const;
@@ -119,7 +175,6 @@ public:
 
 	void DiscardResults()
 	{
-		m_bDisabled = false;
 		m_CalculatedContribution.Purge();
 		memset( m_nCalculationLevel, 0, sizeof( m_nCalculationLevel ) );
 		m_nMaxCalculatedLine = -1;
@@ -138,16 +193,66 @@ public:
 
 	bool HasWorkToDo() const
 	{
-		if ( m_bDisabled )
-			return false;
 		return m_eIncrState != INCR_STATE_HAVE_FULL_RESULTS;
 	}
 
-	bool IsLowerPriorityThan( CLightingPreviewThread* pLPV, CIncrementalLightInfo const& other ) const;
+	void CalculateInfluenceBounds()
+	{
+		m_bUnbounded = ( m_pLight->m_Type == MATERIAL_LIGHT_DIRECTIONAL );
+		if ( !m_bUnbounded )
+		{
+			m_flInfluenceRadius = m_pLight->DistanceAtWhichBrightnessIsLessThan( 1.0f / 500.0f );
+			m_vecInfluenceMins = m_pLight->m_Position - ReplicateToVector( m_flInfluenceRadius );
+			m_vecInfluenceMaxs = m_pLight->m_Position + ReplicateToVector( m_flInfluenceRadius );
+		}
+	}
+
+	// where this light goes in the work queue. lights are run in order of tier, then key.
+	void CalculateSchedulePriority( CLightingPreviewThread* pLPV, int* pTier, float* pKey ) const;
 
 	bool IsHighPriority( CLightingPreviewThread* pLPV ) const;
 };
 
+// an entry in the thread's queue of lights with work to do. the priority is worked out when the
+// light is queued, and doesn't change until the light is run or the queue is rebuilt.
+struct LightQueueEntry_t
+{
+	CIncrementalLightInfo* m_pInfo;
+	int m_nTier;
+	float m_flKey;
+};
+
+static bool LightQueueLessFunc( LightQueueEntry_t const& a, LightQueueEntry_t const& b )
+{
+	if ( a.m_nTier != b.m_nTier )
+		return a.m_nTier < b.m_nTier;
+	return a.m_flKey < b.m_flKey;
+}
+
+struct LightGridEntry_t
+{
+	uint64 m_nCell;
+	CIncrementalLightInfo* m_pInfo;
+};
+
+static int __cdecl LightGridEntryCompare( const LightGridEntry_t* a, const LightGridEntry_t* b )
+{
+	if ( a->m_nCell != b->m_nCell )
+		return ( a->m_nCell < b->m_nCell ) ? -1 : 1;
+	return 0;
+}
+
+static inline int LightGridCoord( float flCoord )
+{
+	return (int)floorf( flCoord * ( 1.0f / LIGHT_GRID_CELL_SIZE ) );
+}
+
+static inline uint64 LightGridCell( int x, int y, int z )
+{
+	// 21 bits per axis is 2 billion units in each direction, far more than any map
+	return ( (uint64)( x & 0x1fffff ) << 42 ) | ( (uint64)( y & 0x1fffff ) << 21 ) | (uint64)( z & 0x1fffff );
+}
+
 class CLightingPreviewThread
 {
 public:
@@ -155,11 +260,12 @@ public:
 
 	CSOAContainer m_GBuffer;
 	CSOAContainer m_GBufferLowRes;
+	CGBufferTiles m_GBufferTiles;
+	CGBufferTiles m_GBufferLowResTiles;
 
-	RayTracingEnvironment* m_pRtEnv;
+	CLightingPreviewShadowBVH m_ShadowBVH;
 	CIncrementalLightInfo* m_pIncrementalLightInfoList;
 
-	bool m_bAccStructureBuilt;
 	Vector m_LastEyePosition;
 
 	bool m_bResultChangedSinceLastSend;
@@ -175,18 +281,34 @@ public:
 	// sets that we are doing the first update since a discard and should do more lights per pass
 	bool m_bFirstWork;
 
+	// lights with work to do which can affect the view, highest priority first
+	CUtlPriorityQueue<LightQueueEntry_t> m_LightQueue;
+	bool m_bLightQueueStale;								// rebuild before the next step
+
+	// lights binned by influence bounds, sorted by cell
+	CUtlVector<LightGridEntry_t> m_LightGrid;
+	CUtlVector<CIncrementalLightInfo*> m_UnboundedLights;
+	bool m_bLightGridStale;
+	int m_nViewStamp;
+
+	LightingPreviewStats_t m_Stats;
+
 	CLightingPreviewThread()
 	{
-		m_pRtEnv = NULL;
 		m_pIncrementalLightInfoList = NULL;
-		m_bAccStructureBuilt = false;
 		m_LastEyePosition.Init();
 		m_bResultChangedSinceLastSend = false;
 		m_fLastSendTime = - 1.0e6;
 		m_nBitmapGenerationCounter = -1;
 		m_nContributionCounter = 1000000;
 		m_MinViewCoords.Init();
+		m_MaxViewCoords.Init();
 		m_bFirstWork = true;
+		m_LightQueue.SetLessFunc( LightQueueLessFunc );
+		m_bLightQueueStale = true;
+		m_bLightGridStale = true;
+		m_nViewStamp = 0;
+		memset( &m_Stats, 0, sizeof( m_Stats ) );
 	}
 
 
@@ -213,11 +335,14 @@ public:
 	// handle new g-buffers from master
 	void HandleGBuffersMessage( MessageToLPreview& msg_in );
 
-	// accept triangle list from master
+	// take a new light list from master
+	void HandleLightDataMessage( MessageToLPreview& msg_in );
+
+	// accept changed triangle chunks from master
 	void HandleGeomMessage( MessageToLPreview& msg_in );
 
 	// send one of our output images back
-	void SendResultRendering( CSOAContainer& rsltBuffer );
+	void SendResultRendering( Bitmap_t* pBitmap );
 
 	// calculate m_MinViewCoords, m_MaxViewCoords - the bounding box of the rendered pixels+the eye
 	void CalculateSceneBounds();
@@ -230,8 +355,19 @@ public:
 	// send our current output back
 	void SendResult();
 
+	// combine the results of all the lights into a new output image
+	Bitmap_t* ResolveResult();
+
 	void UpdateIncrementalForNewLightList();
 
+	// bin all the lights by their influence bounds
+	void RebuildLightGrid();
+	void AddLightToGrid( CIncrementalLightInfo* pInfo );
+
+	// find the lights which can affect the view, and queue the ones with work left
+	void RebuildLightQueue();
+	void QueueLight( CIncrementalLightInfo* pInfo );
+
 	void DiscardResults()
 	{
 //		Warning(" invalidate\n" );
@@ -255,6 +391,8 @@ public:
 		m_bResultChangedSinceLastSend = true;
 		m_fLastSendTime = Plat_FloatTime() - 12;				// force send
 		m_bFirstWork = true;
+		m_bLightQueueStale = true;
+		m_Stats.m_nLinesCalculated = 0;
 	}
 
 	// handle a message. returns true if the thread shuold exit
@@ -288,7 +426,11 @@ public:
 	}
 	void AccumulateOuput( int nLineMask, CSOAContainer* pResult, CSOAContainer* pLowresResule ) const;
 
-	void AddLowresResultToHires( CSOAContainer& lowres, CSOAContainer& hires );
+	// upsample the low res result, multiply by albedo and write the output image, for the rows
+	// in nLineMask. pLowresResult is NULL if there are no low res lights.
+	void ResolveOutput( int nLineMask, CSOAContainer* pResult, CSOAContainer* pLowresResult, Bitmap_t* pBitmap ) const;
+
+	void AddLowresResultToHiresRow( const CSOAContainer& lowres, CSOAContainer& hires, int y ) const;
 };
 
 
@@ -302,118 +444,43 @@ bool CIncrementalLightInfo::IsHighPriority( CLightingPreviewThread* pLPV ) const
 
 }
 
-bool CIncrementalLightInfo::IsLowerPriorityThan( CLightingPreviewThread* pLPV, CIncrementalLightInfo const& other ) const
+void CIncrementalLightInfo::CalculateSchedulePriority( CLightingPreviewThread* pLPV, int* pTier, float* pKey ) const
 {
-	// a NEW light within the view volume is highest priority
-	bool highpriority = IsHighPriority( pLPV );
-	bool other_highpriority = other.IsHighPriority( pLPV );
-
-	if ( highpriority && !other_highpriority )
-		return false;
-	if ( other_highpriority && !highpriority )
-		return true;
-
-	int state_combo = m_eIncrState + 16 * other.m_eIncrState;
-	switch ( state_combo )
+	switch ( m_eIncrState )
 	{
-		case INCR_STATE_NEW + 16 * INCR_STATE_NEW:
-		{
-			// if both are new, closest to eye is best
-			return m_fDistanceToEye > other.m_fDistanceToEye;
-		}
-
-		case INCR_STATE_NEW + 16 * INCR_STATE_NO_RESULTS:
-		{
-			// new loses to something we know is probably going to contribute light
-			return other.m_fTotalContribution > 0;
-		}
-
-		case INCR_STATE_NEW + 16 * INCR_STATE_PARTIAL_RESULTS:
-		{
-			return false;
-		}
-
-		case INCR_STATE_PARTIAL_RESULTS + 16 * INCR_STATE_NEW:
+		case INCR_STATE_NEW:
 		{
-			return true;
+			// a NEW light within the view volume is highest priority. otherwise, closest to eye is best
+			*pTier = IsHighPriority( pLPV ) ? 4 : 2;
+			*pKey = -m_fDistanceToEye;
+			break;
 		}
 
-		case INCR_STATE_NO_RESULTS + 16 * INCR_STATE_NEW:
+		case INCR_STATE_NO_RESULTS:
 		{
-			// partial or discarded with no brightness loses to new
-			return m_fTotalContribution == 0;
+			// discarded lights we know are going to contribute light beat new ones
+			*pTier = ( m_fTotalContribution > 0 ) ? 3 : 0;
+			*pKey = ( m_fTotalContribution > 0 ) ? m_fTotalContribution : m_nMostRecentNonZeroContributionTimeStamp;
+			break;
 		}
 
-
-		case INCR_STATE_PARTIAL_RESULTS + 16 * INCR_STATE_PARTIAL_RESULTS:
-		{
-			// if incrmental vs incremental, and no light from either, do most recently lit one
-			if ( m_fTotalContribution == 0.0f && other.m_fTotalContribution == 0.0f &&
-				other.m_nMostRecentNonZeroContributionTimeStamp > m_nMostRecentNonZeroContributionTimeStamp )
-				return true;
-
-			int nMaxLines = max( m_nNumLinesCalculated, other.m_nNumLinesCalculated );
-			int nMinLines = min( m_nNumLinesCalculated, other.m_nNumLinesCalculated );
-
-			// if other is black, and ratios aren't extremely far off, keep this one
-			if ( nMaxLines <= 16 * nMinLines )
-			{
-				if ( other.m_fTotalContribution == 0.0f && m_fTotalContribution > 0 )
-					return false;
-				if ( m_fTotalContribution == 0.0f && other.m_fTotalContribution > 0 )
-					return true;
-			}
-
-			// if incremental states are close, do brightest
-			if ( nMaxLines <= 2 * nMinLines )
-				return PredictedContribution() < other.PredictedContribution();
-
-			// else do least refined
-			return ( m_nNumLinesCalculated > other.m_nNumLinesCalculated );
-		}
-		case INCR_STATE_PARTIAL_RESULTS + 16 * INCR_STATE_NO_RESULTS:
-		{
-			if ( other.m_fTotalContribution )
-				return true;
-			if ( m_fTotalContribution == 0.0f && other.m_fTotalContribution == 0.0f )
-				return other.m_nMostRecentNonZeroContributionTimeStamp > m_nMostRecentNonZeroContributionTimeStamp;
-			return PredictedContribution() < other.PredictedContribution();
-		}
-		case INCR_STATE_NO_RESULTS + 16 * INCR_STATE_PARTIAL_RESULTS:
-		{
-			if ( m_fTotalContribution )
-				return false;
-			if ( m_fTotalContribution == 0.0f && other.m_fTotalContribution == 0.0f )
-				return other.m_nMostRecentNonZeroContributionTimeStamp > m_nMostRecentNonZeroContributionTimeStamp;
-			return PredictedContribution() < other.PredictedContribution();
-		}
-		case INCR_STATE_NO_RESULTS * 16 + INCR_STATE_NO_RESULTS:
+		default:
 		{
-			// if incrmental vs discarded, brightest or most recently bright wins
-			if ( m_fTotalContribution == 0.0f && other.m_fTotalContribution == 0.0f )
-				return other.m_nMostRecentNonZeroContributionTimeStamp > m_nMostRecentNonZeroContributionTimeStamp;
-			return PredictedContribution() < other.PredictedContribution();
+			// partial results - brightest predicted contribution first, then the most recently lit of the
+			// black ones. PredictedContribution already scales what the lines done so far gave up to the
+			// whole view, so lights with only a few lines done aren't penalized for it.
+			*pTier = ( m_fTotalContribution > 0 ) ? 1 : 0;
+			*pKey = ( m_fTotalContribution > 0 ) ? PredictedContribution() : m_nMostRecentNonZeroContributionTimeStamp;
+			break;
 		}
 	}
-	return false;
 }
 
 void CLightingPreviewThread::HandleGeomMessage( MessageToLPreview& msg_in )
 {
-	if ( m_pRtEnv )
-	{
-		delete m_pRtEnv;
-		m_pRtEnv = NULL;
-	}
-	CUtlVector<Vector>& tris = *msg_in.m_pShadowTriangleList;
-	if ( !tris.IsEmpty() )
-	{
-		m_pRtEnv = new RayTracingEnvironment;
-		for ( int i = 0; i < tris.Count(); i += 3 )
-			m_pRtEnv->AddTriangle( i, tris[i], tris[1 + i], tris[2 + i], vec3_origin, RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS | RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS, 0 );
-	}
-	delete msg_in.m_pShadowTriangleList;
-	m_bAccStructureBuilt = false;
+	// only the objects in the message get their trees rebuilt, when DoWork next runs
+	m_ShadowBVH.ApplyChunks( *msg_in.m_pShadowChunks, msg_in.m_bResetGeometry );
+	delete msg_in.m_pShadowChunks;
 }
 
 
@@ -484,6 +551,127 @@ void CLightingPreviewThread::UpdateIncrementalForNewLightList()
 }
 
 
+void CLightingPreviewThread::AddLightToGrid( CIncrementalLightInfo* pInfo )
+{
+	pInfo->CalculateInfluenceBounds();
+	if ( !pInfo->m_bUnbounded )
+	{
+		int nMins[3], nMaxs[3];
+		for ( int i = 0; i < 3; i++ )
+		{
+			nMins[i] = LightGridCoord( pInfo->m_vecInfluenceMins[i] );
+			nMaxs[i] = LightGridCoord( pInfo->m_vecInfluenceMaxs[i] );
+		}
+		int64 nCells = (int64)( nMaxs[0] - nMins[0] + 1 ) * ( nMaxs[1] - nMins[1] + 1 ) * ( nMaxs[2] - nMins[2] + 1 );
+		if ( nCells <= LIGHT_GRID_MAX_CELLS_PER_LIGHT )
+		{
+			for ( int x = nMins[0]; x <= nMaxs[0]; x++ )
+				for ( int y = nMins[1]; y <= nMaxs[1]; y++ )
+					for ( int z = nMins[2]; z <= nMaxs[2]; z++ )
+					{
+						LightGridEntry_t entry;
+						entry.m_nCell = LightGridCell( x, y, z );
+						entry.m_pInfo = pInfo;
+						m_LightGrid.AddToTail( entry );
+					}
+			return;
+		}
+	}
+	m_UnboundedLights.AddToTail( pInfo );
+}
+
+
+void CLightingPreviewThread::RebuildLightGrid()
+{
+	m_LightGrid.RemoveAll();
+	m_UnboundedLights.RemoveAll();
+	m_Stats.m_nLightsTotal = 0;
+	for ( CLightingPreviewLightDescription* l = m_LightList.Head(); l; l = l->m_pNext )
+	{
+		AddLightToGrid( l->m_pIncrementalInfo );
+		m_Stats.m_nLightsTotal++;
+	}
+	m_LightGrid.Sort( LightGridEntryCompare );
+	m_bLightGridStale = false;
+}
+
+
+void CLightingPreviewThread::QueueLight( CIncrementalLightInfo* pInfo )
+{
+	LightQueueEntry_t entry;
+	entry.m_pInfo = pInfo;
+	pInfo->CalculateSchedulePriority( this, &entry.m_nTier, &entry.m_flKey );
+	m_LightQueue.Insert( entry );
+}
+
+
+void CLightingPreviewThread::RebuildLightQueue()
+{
+	if ( m_bLightGridStale )
+		RebuildLightGrid();
+
+	m_LightQueue.RemoveAll();
+	m_bLightQueueStale = false;
+	m_Stats.m_nLightsActive = 0;
+	if ( !m_GBuffer.NumRows() )
+		return;
+
+	// a new stamp marks all lights as out of view, without having to touch them
+	m_nViewStamp++;
+	CUtlVector<CIncrementalLightInfo*> candidates;
+	candidates.AddVectorToTail( m_UnboundedLights );
+
+	int nMins[3], nMaxs[3];
+	int64 nViewCells = 1;
+	for ( int i = 0; i < 3; i++ )
+	{
+		nMins[i] = LightGridCoord( m_MinViewCoords[i] );
+		nMaxs[i] = LightGridCoord( m_MaxViewCoords[i] );
+		nViewCells *= nMaxs[i] - nMins[i] + 1;
+	}
+	if ( nViewCells > m_LightGrid.Count() )
+	{
+		// the view covers more cells than there are entries, so just look at all of them
+		for ( int i = 0; i < m_LightGrid.Count(); i++ )
+			candidates.AddToTail( m_LightGrid[i].m_pInfo );
+	}
+	else
+	{
+		for ( int x = nMins[0]; x <= nMaxs[0]; x++ )
+			for ( int y = nMins[1]; y <= nMaxs[1]; y++ )
+				for ( int z = nMins[2]; z <= nMaxs[2]; z++ )
+				{
+					// binary search for the first entry in the cell
+					uint64 nCell = LightGridCell( x, y, z );
+					int nLow = 0, nHigh = m_LightGrid.Count();
+					while ( nLow < nHigh )
+					{
+						int nMid = ( nLow + nHigh ) / 2;
+						if ( m_LightGrid[nMid].m_nCell < nCell )
+							nLow = nMid + 1;
+						else
+							nHigh = nMid;
+					}
+					for ( ; nLow < m_LightGrid.Count() && m_LightGrid[nLow].m_nCell == nCell; nLow++ )
+						candidates.AddToTail( m_LightGrid[nLow].m_pInfo );
+				}
+	}
+
+	for ( int i = 0; i < candidates.Count(); i++ )
+	{
+		CIncrementalLightInfo* pInfo = candidates[i];
+		if ( pInfo->m_nViewStamp == m_nViewStamp )
+			continue;									// already seen in another cell
+		if ( !pInfo->m_bUnbounded && !IsBoxIntersectingBox( pInfo->m_vecInfluenceMins, pInfo->m_vecInfluenceMaxs, m_MinViewCoords, m_MaxViewCoords ) )
+			continue;
+		pInfo->m_nViewStamp = m_nViewStamp;
+		m_Stats.m_nLightsActive++;
+		if ( pInfo->HasWorkToDo() )
+			QueueLight( pInfo );
+	}
+}
+
+
 void CLightingPreviewThread::Run()
 {
 	bool should_quit = false;
@@ -513,14 +701,8 @@ bool CLightingPreviewThread::HandleAMessage()
 			return true;									// return from thread
 
 		case LPREVIEW_MSG_LIGHT_DATA:
-		{
-			m_LightList.Purge();
-			m_LightList = msg_in.m_LightList;
-			m_LastEyePosition = msg_in.m_EyePosition;
-			UpdateIncrementalForNewLightList();
-			DiscardResults();
-		}
-		break;
+			HandleLightDataMessage( msg_in );
+			break;
 
 		case LPREVIEW_MSG_GEOM_DATA:
 			HandleGeomMessage( msg_in );
@@ -535,27 +717,30 @@ bool CLightingPreviewThread::HandleAMessage()
 	return false;
 }
 
+void CLightingPreviewThread::HandleLightDataMessage( MessageToLPreview& msg_in )
+{
+	m_LightList.Purge();
+	m_LightList = msg_in.m_LightList;
+	m_LastEyePosition = msg_in.m_EyePosition;
+	UpdateIncrementalForNewLightList();
+	m_bLightGridStale = true;
+	DiscardResults();
+}
+
 bool CLightingPreviewThread::AnyUsefulWorkToDo()
 {
-	if ( m_GBuffer.NumRows() )
-	{
-		for ( CLightingPreviewLightDescription* l = m_LightList.Head(); l; l = l->m_pNext )
-		{
-			CIncrementalLightInfo* l_info = l->m_pIncrementalInfo;
-			if ( l_info->HasWorkToDo() )
-				return true;
-		}
-	}
-	return false;
+	if ( m_bLightQueueStale )
+		RebuildLightQueue();
+	return m_LightQueue.Count() != 0;
 }
 
 void CLightingPreviewThread::DoWork()
 {
-	if ( m_pRtEnv && !m_bAccStructureBuilt )
-	{
-		m_bAccStructureBuilt = true;
-		m_pRtEnv->SetupAccelerationStructure();
-	}
+	float flStartTime = Plat_FloatTime();
+	m_ShadowBVH.Update();
+	if ( m_bLightQueueStale )
+		RebuildLightQueue();
+
 	CLightingPreviewLightDescription* pLightsToRun[64];
 	int nNumLightJobs = 0;
 	int nJobsToDo = s_nNumThreads + 1;
@@ -568,42 +753,19 @@ void CLightingPreviewThread::DoWork()
 	nJobsToDo = 1;
 #endif
 
+	// take the highest priority lights. each light is queued at most once, so these are distinct
 	nJobsToDo = Min( nJobsToDo, 64 );
-	for ( int i = 0; i < nJobsToDo; i++ )
+	while ( nNumLightJobs < nJobsToDo && m_LightQueue.Count() )
 	{
-		CLightingPreviewLightDescription* best_l = NULL;
-		for ( CLightingPreviewLightDescription* l = m_LightList.Head(); l; l = l->m_pNext )
-		{
-			CIncrementalLightInfo* l_info = l->m_pIncrementalInfo;
-			// check if light could influence scene
-			if ( l_info->m_bDisabled )
-				continue;								// this light can't effect the visible scene
-			if ( l->m_Type != MATERIAL_LIGHT_DIRECTIONAL )
-			{
-				float lrad = l->DistanceAtWhichBrightnessIsLessThan( 1.0f / 500.0f );
-				if ( !l->m_Position.WithinAABox( m_MinViewCoords - ReplicateToVector( lrad ), m_MaxViewCoords + ReplicateToVector( lrad ) ) )
-					l_info->m_bDisabled = true;
-			}
-			if ( l_info->m_bDisabled )
-				continue;								// this light can't effect the visible scene
-
-			// check that we don't have it
-			bool bHaveit = false;
-			for ( int j = 0; j < nNumLightJobs; j++ )
-				if ( pLightsToRun[j] == l )
-					bHaveit = true;
-			if ( !bHaveit && l_info->HasWorkToDo() )
-			{
-				if ( !best_l || best_l->m_pIncrementalInfo->IsLowerPriorityThan( this, *l_info ) )
-					best_l = l;
-			}
-		}
-		if ( best_l )
-			pLightsToRun[nNumLightJobs++] = best_l;
+		pLightsToRun[nNumLightJobs++] = m_LightQueue.ElementAtHead().m_pInfo->m_pLight;
+		m_LightQueue.RemoveAtHead();
 	}
 	// now, process in parallel
 	if ( nNumLightJobs )
 	{
+		int nLinesBefore = 0;
+		for ( int i = 0; i < nNumLightJobs; i++ )
+			nLinesBefore += pLightsToRun[i]->m_pIncrementalInfo->m_nNumLinesCalculated;
 #if LPREVIEW_MULTITHREAD == 1
 		{
 			CJobSetN<64> jobs;
@@ -621,10 +783,15 @@ void CLightingPreviewThread::DoWork()
 #endif
 		// now, some lights may have created lights for indirect light. We must move these to the global list.
 		// we could not do this while creating them, because of thread-safety.
+		bool bAddedLights = false;
 		for ( int i = 0; i < nNumLightJobs; i++ )
 		{
-			if ( pLightsToRun[i]->m_pIncrementalInfo->m_flLastContribution )
+			CIncrementalLightInfo* l_info = pLightsToRun[i]->m_pIncrementalInfo;
+			m_Stats.m_nLinesCalculated += l_info->m_nNumLinesCalculated;
+			if ( l_info->m_flLastContribution )
 				m_bResultChangedSinceLastSend = true;
+			if ( l_info->HasWorkToDo() )
+				QueueLight( l_info );
 			for ( int j = 0; j < pLightsToRun[i]->m_TempChildren.Count(); j++ )
 			{
 				CLightingPreviewLightDescription* pNew = pLightsToRun[i]->m_TempChildren[j];
@@ -634,11 +801,26 @@ void CLightingPreviewThread::DoWork()
 				pNew->m_pIncrementalInfo->m_pNext = m_pIncrementalLightInfoList;
 				m_pIncrementalLightInfoList = pNew->m_pIncrementalInfo;
 				m_LightList.AddToTail( pNew );
+
+				CIncrementalLightInfo* pNewInfo = pNew->m_pIncrementalInfo;
+				AddLightToGrid( pNewInfo );
+				m_Stats.m_nLightsTotal++;
+				bAddedLights = true;
+				if ( pNewInfo->m_bUnbounded || IsBoxIntersectingBox( pNewInfo->m_vecInfluenceMins, pNewInfo->m_vecInfluenceMaxs, m_MinViewCoords, m_MaxViewCoords ) )
+				{
+					pNewInfo->m_nViewStamp = m_nViewStamp;
+					m_Stats.m_nLightsActive++;
+					QueueLight( pNewInfo );
+				}
 			}
 			pLightsToRun[i]->m_TempChildren.Purge();
 			pLightsToRun[i]->m_bDidIndirect = true;
 		}
+		if ( bAddedLights )
+			m_LightGrid.Sort( LightGridEntryCompare );
+		m_Stats.m_nLinesCalculated -= nLinesBefore;
 	}
+	m_Stats.m_flStepTime = Plat_FloatTime() - flStartTime;
 }
 
 
@@ -708,6 +890,8 @@ void CLightingPreviewThread::HandleGBuffersMessage( MessageToLPreview& msg_in )
 	m_GBufferLowRes.ResampleAttribute( m_GBuffer, GBUFFER_ATTR_ALBEDO );
 	m_GBufferLowRes.ResampleAttribute( m_GBuffer, GBUFFER_ATTR_NORMAL );
 
+	m_GBufferTiles.Build( m_GBuffer );
+	m_GBufferLowResTiles.Build( m_GBufferLowRes );
 
 	m_LastEyePosition = msg_in.m_EyePosition;
 	for ( uint i = 0;i < ARRAYSIZE( msg_in.m_pDefferedRenderingBMs ); i++ )
@@ -717,6 +901,56 @@ void CLightingPreviewThread::HandleGBuffersMessage( MessageToLPreview& msg_in )
 	CalculateSceneBounds();
 }
 
+void CGBufferTiles::Build( const CSOAContainer& gbuffer )
+{
+	int nQuads = gbuffer.NumQuadsPerRow();
+	int nRows = gbuffer.NumRows();
+	m_nTilesPerRow = ( nQuads + LPREVIEW_TILE_QUADS - 1 ) / LPREVIEW_TILE_QUADS;
+	int nTileRows = ( nRows + LPREVIEW_TILE_ROWS - 1 ) / LPREVIEW_TILE_ROWS;
+	m_Tiles.SetCount( m_nTilesPerRow * nTileRows );
+
+	// the last quad of a row can run past the edge of the image. its unused pixels are replaced
+	// by the first one, so that whatever they hold can't widen the bounds.
+	fltx4 fl4LastQuadMask = LoadAlignedSIMD( g_SIMD_SkipTailMask[gbuffer.NumCols() & 3] );
+	for ( int nTileY = 0; nTileY < nTileRows; nTileY++ )
+	{
+		int nY0 = nTileY * LPREVIEW_TILE_ROWS;
+		int nY1 = Min( nY0 + LPREVIEW_TILE_ROWS, nRows );
+		for ( int nTileX = 0; nTileX < m_nTilesPerRow; nTileX++ )
+		{
+			int nX0 = nTileX * LPREVIEW_TILE_QUADS;
+			int nX1 = Min( nX0 + LPREVIEW_TILE_QUADS, nQuads );
+			FourVectors mins, maxs;
+			mins.DuplicateVector( Vector( FLT_MAX, FLT_MAX, FLT_MAX ) );
+			maxs.DuplicateVector( Vector( -FLT_MAX, -FLT_MAX, -FLT_MAX ) );
+			for ( int y = nY0; y < nY1; y++ )
+			{
+				FourVectors const* pPos = gbuffer.RowPtr<FourVectors>( GBUFFER_ATTR_POSITION, y ) + nX0;
+				for ( int x = nX0; x < nX1; x++ )
+				{
+					FourVectors pos = *pPos++;
+					if ( x == nQuads - 1 )
+					{
+						pos.x = MaskedAssign( fl4LastQuadMask, pos.x, SplatXSIMD( pos.x ) );
+						pos.y = MaskedAssign( fl4LastQuadMask, pos.y, SplatXSIMD( pos.y ) );
+						pos.z = MaskedAssign( fl4LastQuadMask, pos.z, SplatXSIMD( pos.z ) );
+					}
+					mins = minimum( mins, pos );
+					maxs = maximum( maxs, pos );
+				}
+			}
+			GBufferTile_t& tile = m_Tiles[nTileY * m_nTilesPerRow + nTileX];
+			tile.m_vecMins = mins.Vec( 0 );
+			tile.m_vecMaxs = maxs.Vec( 0 );
+			for ( int i = 1; i < 4; i++ )
+			{
+				VectorMin( tile.m_vecMins, mins.Vec( i ), tile.m_vecMins );
+				VectorMax( tile.m_vecMaxs, maxs.Vec( i ), tile.m_vecMaxs );
+			}
+		}
+	}
+}
+
 #ifdef _DEBUG
 static FORCEINLINE bool isnan( fltx4 n )
 {
@@ -724,12 +958,6 @@ static FORCEINLINE bool isnan( fltx4 n )
 }
 #endif
 
-#ifdef __clang__
-__attribute__((optnone))
-#else
-#pragma optimize( "", off )
-#endif
-
 void CLightingPreviewThread::AccumulateOuput( int nLineMask, CSOAContainer* rslt, CSOAContainer* rslt1 ) const
 {
 	//FPExceptionEnabler e;
@@ -880,7 +1108,7 @@ FORCEINLINE void RotateLeftDoubleSIMD( fltx4& a, fltx4& b )
 		RotateLeftDoubleSIMD( base##ShiftRegister1.y, base##ShiftRegister1a.y );	\
 		RotateLeftDoubleSIMD( base##ShiftRegister1.z, base##ShiftRegister1a.z )
 
-void CLightingPreviewThread::AddLowresResultToHires( CSOAContainer& lores, CSOAContainer& hires )
+void CLightingPreviewThread::AddLowresResultToHiresRow( const CSOAContainer& lores, CSOAContainer& hires, int y ) const
 {
 	// we will bilaterally upsample lowres and add it to hires. This is coded for the specific case of a 4x4 downsamping
 	fltx4 fl4NormalFactorScale = ReplicateX4( 4.0f );
@@ -888,151 +1116,188 @@ void CLightingPreviewThread::AddLowresResultToHires( CSOAContainer& lores, CSOAC
 	fltx4 fl4DistanceScale = ReplicateX4( 1.0f / 36.0f );
 	Assert( lores.NumRows() == m_GBufferLowRes.NumRows() );
 	Assert( lores.NumCols() == m_GBufferLowRes.NumCols() );
-	for ( int y = 0; y < hires.NumRows(); y++ )
+	int ysrc0 = min( ( y >> 2 ), lores.NumRows() -1 );
+	int ysrc1 = min( ysrc0 + 1, lores.NumRows() - 1 );
+	int nIterations = hires.NumQuadsPerRow();
+	int numFetches = lores.NumQuadsPerRow();
+
+	FourVectors* pSrc0 = lores.RowPtr<FourVectors>( RSLT_BUFFER_RSLT_RGB, ysrc0 );
+	FourVectors* pSrc1 = lores.RowPtr<FourVectors>( RSLT_BUFFER_RSLT_RGB, ysrc1 );
+	FourVectors rsltShiftRegister0 = *pSrc0++;
+	FourVectors rsltShiftRegister0a;
+	FourVectors rsltShiftRegister1 = *pSrc1++;
+	FourVectors rsltShiftRegister1a;
+
+	FourVectors* pSrcNormal0 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_NORMAL, ysrc0 );
+	FourVectors* pSrcNormal1 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_NORMAL, ysrc1 );
+	FourVectors normShiftRegister0 = *pSrcNormal0++;
+	FourVectors normShiftRegister0a;
+	FourVectors normShiftRegister1 = *pSrcNormal1++;
+	FourVectors normShiftRegister1a;
+
+	FourVectors* pSrcPos0 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_POSITION, ysrc0 );
+	FourVectors* pSrcPos1 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_POSITION, ysrc1 );
+	FourVectors posShiftRegister0 = *pSrcPos0++;
+	FourVectors posShiftRegister0a;
+	FourVectors posShiftRegister1 = *pSrcPos1++;
+	FourVectors posShiftRegister1a;
+
+	FourVectors* pDest = hires.RowPtr<FourVectors>( RSLT_BUFFER_RSLT_RGB, y );
+	FourVectors* pDestNormal = m_GBuffer.RowPtr<FourVectors>( GBUFFER_ATTR_NORMAL, y );
+	FourVectors* pDestPos = m_GBuffer.RowPtr<FourVectors>( GBUFFER_ATTR_POSITION, y );
+
+	numFetches--;
+
+	for ( int x = 0; x < nIterations; x++ )
 	{
-		int ysrc0 = min( ( y >> 2 ), lores.NumRows() -1 );
-		int ysrc1 = min( ysrc0 + 1, lores.NumRows() - 1 );
-		int nIterations = hires.NumQuadsPerRow();
-		int numFetches = lores.NumQuadsPerRow();
-
-		FourVectors* pSrc0 = lores.RowPtr<FourVectors>( RSLT_BUFFER_RSLT_RGB, ysrc0 );
-		FourVectors* pSrc1 = lores.RowPtr<FourVectors>( RSLT_BUFFER_RSLT_RGB, ysrc1 );
-		FourVectors rsltShiftRegister0 = *pSrc0++;
-		FourVectors rsltShiftRegister0a;
-		FourVectors rsltShiftRegister1 = *pSrc1++;
-		FourVectors rsltShiftRegister1a;
-
-		FourVectors* pSrcNormal0 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_NORMAL, ysrc0 );
-		FourVectors* pSrcNormal1 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_NORMAL, ysrc1 );
-		FourVectors normShiftRegister0 = *pSrcNormal0++;
-		FourVectors normShiftRegister0a;
-		FourVectors normShiftRegister1 = *pSrcNormal1++;
-		FourVectors normShiftRegister1a;
-
-		FourVectors* pSrcPos0 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_POSITION, ysrc0 );
-		FourVectors* pSrcPos1 = m_GBufferLowRes.RowPtr<FourVectors>( GBUFFER_ATTR_POSITION, ysrc1 );
-		FourVectors posShiftRegister0 = *pSrcPos0++;
-		FourVectors posShiftRegister0a;
-		FourVectors posShiftRegister1 = *pSrcPos1++;
-		FourVectors posShiftRegister1a;
-
-		FourVectors* pDest = hires.RowPtr<FourVectors>( RSLT_BUFFER_RSLT_RGB, y );
-		FourVectors* pDestNormal = m_GBuffer.RowPtr<FourVectors>( GBUFFER_ATTR_NORMAL, y );
-		FourVectors* pDestPos = m_GBuffer.RowPtr<FourVectors>( GBUFFER_ATTR_POSITION, y );
-
-		numFetches--;
-
-		for ( int x = 0; x < nIterations; x++ )
+		if ( ( x & 3 ) == 0 && numFetches )		  // need to fetch new data every 4 outputs
 		{
-			if ( ( x & 3 ) == 0 && numFetches )		  // need to fetch new data every 4 outputs
-			{
-				numFetches--;
-				rsltShiftRegister0a = *( pSrc0++ );
-				rsltShiftRegister1a = *( pSrc1++ );
+			numFetches--;
+			rsltShiftRegister0a = *( pSrc0++ );
+			rsltShiftRegister1a = *( pSrc1++ );
 
-				normShiftRegister0a = *( pSrcNormal0++ );
-				normShiftRegister1a = *( pSrcNormal1++ );
+			normShiftRegister0a = *( pSrcNormal0++ );
+			normShiftRegister1a = *( pSrcNormal1++ );
 
-				posShiftRegister0a = *( pSrcPos0++ );
-				posShiftRegister1a = *( pSrcPos1++ );
-			}
+			posShiftRegister0a = *( pSrcPos0++ );
+			posShiftRegister1a = *( pSrcPos1++ );
+		}
 
-			FourVectors rsltAAAA, rsltBBBB, rsltEEEE, rsltFFFF;
-			GRAB4PIXELS( rslt );
+		FourVectors rsltAAAA, rsltBBBB, rsltEEEE, rsltFFFF;
+		GRAB4PIXELS( rslt );
 
-			FourVectors normAAAA, normBBBB, normEEEE, normFFFF;
-			GRAB4PIXELS( norm );
+		FourVectors normAAAA, normBBBB, normEEEE, normFFFF;
+		GRAB4PIXELS( norm );
 
-			FourVectors posAAAA, posBBBB, posEEEE, posFFFF;
-			GRAB4PIXELS( pos );
+		FourVectors posAAAA, posBBBB, posEEEE, posFFFF;
+		GRAB4PIXELS( pos );
 
-			// we should now be ready to filter. We will take the 4 pixels we have, and produce 4 output pixels
-			const FourVectors& dNorm = *pDestNormal++;
-			fltx4 fl4ADot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normAAAA ) ) );
-			fltx4 fl4BDot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normBBBB ) ) );
-			fltx4 fl4EDot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normEEEE ) ) );
-			fltx4 fl4FDot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normFFFF ) ) );
+		// we should now be ready to filter. We will take the 4 pixels we have, and produce 4 output pixels
+		const FourVectors& dNorm = *pDestNormal++;
+		fltx4 fl4ADot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normAAAA ) ) );
+		fltx4 fl4BDot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normBBBB ) ) );
+		fltx4 fl4EDot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normEEEE ) ) );
+		fltx4 fl4FDot = MaxSIMD( Four_Epsilons, MulSIMD( fl4NormalFactorScale, AddSIMD( fl4NormalBias, dNorm * normFFFF ) ) );
 
-			const FourVectors& fl4Pos = *pDestPos++;
-			FourVectors v4Delta = posAAAA;
-			v4Delta -= fl4Pos;
-			fltx4 fl4WA = MulSIMD( fl4ADot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
+		const FourVectors& fl4Pos = *pDestPos++;
+		FourVectors v4Delta = posAAAA;
+		v4Delta -= fl4Pos;
+		fltx4 fl4WA = MulSIMD( fl4ADot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
 
-			v4Delta = posBBBB;
-			v4Delta -= fl4Pos;
-			fltx4 fl4WB = MulSIMD( fl4BDot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
+		v4Delta = posBBBB;
+		v4Delta -= fl4Pos;
+		fltx4 fl4WB = MulSIMD( fl4BDot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
 
-			v4Delta = posEEEE;
-			v4Delta -= fl4Pos;
-			fltx4 fl4WE = MulSIMD( fl4EDot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
+		v4Delta = posEEEE;
+		v4Delta -= fl4Pos;
+		fltx4 fl4WE = MulSIMD( fl4EDot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
 
-			v4Delta = posFFFF;
-			v4Delta -= fl4Pos;
-			fltx4 fl4WF = MulSIMD( fl4FDot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
+		v4Delta = posFFFF;
+		v4Delta -= fl4Pos;
+		fltx4 fl4WF = MulSIMD( fl4FDot, ReciprocalSIMD( AddSIMD( Four_Ones, MulSIMD( v4Delta.length(), fl4DistanceScale ) ) ) );
 
-			fltx4 fl4OOSumWeights = ReciprocalSIMD( AddSIMD( AddSIMD( fl4WA, fl4WB ), AddSIMD( fl4WE, fl4WF ) ) );
+		fltx4 fl4OOSumWeights = ReciprocalSIMD( AddSIMD( AddSIMD( fl4WA, fl4WB ), AddSIMD( fl4WE, fl4WF ) ) );
 
-			// now, calculate the output color
-			FourVectors out = rsltAAAA;
-			out *= fl4WA;
+		// now, calculate the output color
+		FourVectors out = rsltAAAA;
+		out *= fl4WA;
 
-			FourVectors out1 = rsltBBBB;
-			out1 *= fl4WB;
-			out += out1;
+		FourVectors out1 = rsltBBBB;
+		out1 *= fl4WB;
+		out += out1;
 
-			out1 = rsltEEEE;
-			out1 *= fl4WE;
-			out += out1;
+		out1 = rsltEEEE;
+		out1 *= fl4WE;
+		out += out1;
 
-			out1 = rsltFFFF;
-			out1 *= fl4WF;
-			out += out1;
+		out1 = rsltFFFF;
+		out1 *= fl4WF;
+		out += out1;
 
-			out *= fl4OOSumWeights;
+		out *= fl4OOSumWeights;
 
-			*pDest++ += out;
-		}
+		*pDest++ += out;
 	}
 }
 
-void CLightingPreviewThread::SendResult()
+void CLightingPreviewThread::ResolveOutput( int nLineMask, CSOAContainer* pResult, CSOAContainer* pLowresResult, Bitmap_t* pBitmap ) const
 {
-	if ( m_GBuffer.NumRows() && m_GBuffer.NumCols() )
+	// each row is finished in one pass while it is in cache, rather than making separate passes
+	// over the whole image for the upsample, the albedo and the conversion
+	for ( int y = 0; y < pResult->NumRows(); y++ )
 	{
-		//FPExceptionEnabler e;
-		//		Warning("send\n");
-		CSOAContainer rsltBuffer;
-		rsltBuffer.SetAttributeType( RSLT_BUFFER_RSLT_RGB, ATTRDATATYPE_4V );
-		rsltBuffer.AllocateData( m_GBuffer.NumCols(), m_GBuffer.NumRows() );
-		rsltBuffer.FillAttr( RSLT_BUFFER_RSLT_RGB, EstimatedUnshotAmbient() );
-
-		bool bDidLoRes = false;
-		for ( CLightingPreviewLightDescription* l = m_LightList.Head(); l; l = l->m_pNext )
-			if ( l->m_bLowRes )
-				bDidLoRes = true;
-
-		CSOAContainer rsltBuffer1;
-		if ( bDidLoRes )
+		if ( !( nLineMask & ( 1 << ( y & 31 ) ) ) )
+			continue;
+		if ( pLowresResult )
+			AddLowresResultToHiresRow( *pLowresResult, *pResult, y );
+
+		FourVectors const* pRGB = pResult->RowPtr<FourVectors>( RSLT_BUFFER_RSLT_RGB, y );
+		FourVectors const* pAlbedo = m_GBuffer.RowPtr<FourVectors>( GBUFFER_ATTR_ALBEDO, y );
+		unsigned char* pPixel = pBitmap->GetPixel( 0, y );
+		int nWidth = pBitmap->Width();
+		for ( int x = 0; x < nWidth; x += 4 )
 		{
-			rsltBuffer1.SetAttributeType( RSLT_BUFFER_RSLT_RGB, ATTRDATATYPE_4V );
-			rsltBuffer1.AllocateData( m_GBufferLowRes.NumCols(), m_GBufferLowRes.NumRows() );
-			rsltBuffer1.FillAttr( RSLT_BUFFER_RSLT_RGB, vec3_origin );
+			FourVectors color = *pRGB++;
+			color *= *pAlbedo++;
+			int nPixels = Min( 4, nWidth - x );
+			for ( int i = 0; i < nPixels; i++ )
+			{
+				pPixel[0] = (uint8)min( 255.f, 255.0f * pow( SubFloat( color.z, i ), 1 / 2.2f ) );
+				pPixel[1] = (uint8)min( 255.f, 255.0f * pow( SubFloat( color.y, i ), 1 / 2.2f ) );
+				pPixel[2] = (uint8)min( 255.f, 255.0f * pow( SubFloat( color.x, i ), 1 / 2.2f ) );
+				pPixel[3] = 0;
+				pPixel += 4;
+			}
 		}
+	}
+}
 
-		{
-			CJobSetN<32> jobs;
-			for ( int i = 0; i < 32; i++ )
-				jobs += s_pThreadPool->QueueCall( this, &CLightingPreviewThread::AccumulateOuput, 1 << i, &rsltBuffer, &rsltBuffer1 );
-			jobs.WaitForFinish( s_pThreadPool );
-		}
+Bitmap_t* CLightingPreviewThread::ResolveResult()
+{
+	//FPExceptionEnabler e;
+	CSOAContainer rsltBuffer;
+	rsltBuffer.SetAttributeType( RSLT_BUFFER_RSLT_RGB, ATTRDATATYPE_4V );
+	rsltBuffer.AllocateData( m_GBuffer.NumCols(), m_GBuffer.NumRows() );
+	rsltBuffer.FillAttr( RSLT_BUFFER_RSLT_RGB, EstimatedUnshotAmbient() );
 
-		if ( bDidLoRes )
-			AddLowresResultToHires( rsltBuffer1, rsltBuffer );
+	bool bDidLoRes = false;
+	for ( CLightingPreviewLightDescription* l = m_LightList.Head(); l; l = l->m_pNext )
+		if ( l->m_bLowRes )
+			bDidLoRes = true;
+
+	CSOAContainer rsltBuffer1;
+	if ( bDidLoRes )
+	{
+		rsltBuffer1.SetAttributeType( RSLT_BUFFER_RSLT_RGB, ATTRDATATYPE_4V );
+		rsltBuffer1.AllocateData( m_GBufferLowRes.NumCols(), m_GBufferLowRes.NumRows() );
+		rsltBuffer1.FillAttr( RSLT_BUFFER_RSLT_RGB, vec3_origin );
+	}
 
-		// now, multiply by albedo
-		rsltBuffer.MulAttr( m_GBuffer, GBUFFER_ATTR_ALBEDO, RSLT_BUFFER_RSLT_RGB );
+	{
+		CJobSetN<32> jobs;
+		for ( int i = 0; i < 32; i++ )
+			jobs += s_pThreadPool->QueueCall( this, &CLightingPreviewThread::AccumulateOuput, 1 << i, &rsltBuffer, &rsltBuffer1 );
+		jobs.WaitForFinish( s_pThreadPool );
+	}
 
-		SendResultRendering( rsltBuffer );
+	// every low res row has to be accumulated before any high res row can be upsampled from it
+	Bitmap_t* pBitmap = new Bitmap_t;
+	pBitmap->Init( rsltBuffer.NumCols(), rsltBuffer.NumRows(), IMAGE_FORMAT_RGBA8888 );
+	{
+		CJobSetN<32> jobs;
+		for ( int i = 0; i < 32; i++ )
+			jobs += s_pThreadPool->QueueCall( this, &CLightingPreviewThread::ResolveOutput, 1 << i, &rsltBuffer, bDidLoRes ? &rsltBuffer1 : (CSOAContainer*)NULL, pBitmap );
+		jobs.WaitForFinish( s_pThreadPool );
+	}
+	return pBitmap;
+}
+
+void CLightingPreviewThread::SendResult()
+{
+	if ( m_GBuffer.NumRows() && m_GBuffer.NumCols() )
+	{
+		//		Warning("send\n");
+		SendResultRendering( ResolveResult() );
 		m_fLastSendTime = Plat_FloatTime();
 		m_bResultChangedSinceLastSend = false;
 	}
@@ -1077,6 +1342,13 @@ void CLightingPreviewThread::CalculateForLightTask( int nLineStart, int nLineEnd
 	int nCtx = GetSIMDRandContext();
 	CSOAContainer* pGB = l->m_bLowRes ? &m_GBufferLowRes : &m_GBuffer;
 
+	// tiles further than this from the light are left dark. jittering moves the light by up to
+	// the jitter amount on each axis.
+	const CGBufferTiles& tiles = l->m_bLowRes ? m_GBufferLowResTiles : m_GBufferTiles;
+	bool bCullTiles = s_bLightingPreviewTileCulling && !pLInfo->m_bUnbounded;
+	float flCullRadius = pLInfo->m_flInfluenceRadius + l->m_flJitterAmount * 1.7320508f;
+	float flCullRadiusSqr = flCullRadius * flCullRadius;
+
 	for ( int idx = nLineStart; idx <= nLineEnd; idx++ )
 	{
 		int y = InsideOut( rslt.NumRows(), idx );
@@ -1087,6 +1359,24 @@ void CLightingPreviewThread::CalculateForLightTask( int nLineStart, int nLineEnd
 		FourVectors* pNormal = pGB->RowPtr<FourVectors>( GBUFFER_ATTR_NORMAL, y );
 		for ( int x = 0; x < rslt.NumQuadsPerRow(); x++ )
 		{
+			if ( bCullTiles && ( x % LPREVIEW_TILE_QUADS ) == 0 )
+			{
+				const GBufferTile_t& tile = tiles.Tile( x, y );
+				if ( CalcSqrDistanceToAABB( tile.m_vecMins, tile.m_vecMaxs, l->m_Position ) > flCullRadiusSqr )
+				{
+					// out of reach - skip the rest of the tile's quads on this line
+					int nSkip = Min( LPREVIEW_TILE_QUADS, rslt.NumQuadsPerRow() - x );
+					for ( int i = 0; i < nSkip; i++ )
+						pDataOut[i] = zero_vector;
+					pDataOut += nSkip;
+					pAlbedo += nSkip;
+					pPos += nSkip;
+					pNormal += nSkip;
+					x += nSkip - 1;
+					continue;
+				}
+			}
+
 			// shadow check
 			FourVectors pos = *pPos++;
 			FourVectors normal = *pNormal++;
@@ -1135,12 +1425,7 @@ void CLightingPreviewThread::CalculateForLightTask( int nLineStart, int nLineEnd
 				Assert( !isnan( myray.origin.y ) );
 				Assert( !isnan( myray.origin.z ) );
 
-				RayTracingResult r_rslt;
-				m_pRtEnv->Trace4Rays( myray, Four_Zeros, ReplicateX4( 1.0e9f ), &r_rslt, -1, nullptr );
-
-				fltx4 mask = _mm_castsi128_ps( _mm_andnot_si128(
-					_mm_cmplt_epi32( _mm_load_si128( reinterpret_cast<__m128i*>( r_rslt.HitIds ) ), _mm_setzero_si128() ),
-					_mm_castps_si128( _mm_cmplt_ps( r_rslt.HitDistance, len ) ) ) );
+				fltx4 mask = m_ShadowBVH.Occluded4Rays( myray, len );
 				l_add.x = AndNotSIMD( mask, l_add.x );
 				l_add.y = AndNotSIMD( mask, l_add.y );
 				l_add.z = AndNotSIMD( mask, l_add.z );
@@ -1202,14 +1487,26 @@ void CLightingPreviewThread::CalculateForLight( CLightingPreviewLightDescription
 		RayTracingSingleResult rslts[N_FAKE_LIGHTS_FOR_INDIRECT];
 		Vector rayDirs[N_FAKE_LIGHTS_FOR_INDIRECT];
 		DirectionalSampler_t sampler;
-		RayStream myStream;
 		Vector rayStart = l->m_Position;
 		for ( int i = 0; i < N_FAKE_LIGHTS_FOR_INDIRECT; i++ )
-		{
 			rayDirs[i] = sampler.NextValue();
-			m_pRtEnv->AddToRayStream( myStream, rayStart, rayStart + lrad * rayDirs[i], rslts + i );
+		for ( int i = 0; i < N_FAKE_LIGHTS_FOR_INDIRECT; i += 4 )
+		{
+			// trace 4 at a time, padding the last group with copies of the last ray
+			FourRays myrays;
+			myrays.origin.DuplicateVector( rayStart );
+			myrays.direction.LoadAndSwizzle( rayDirs[i], rayDirs[Min( i + 1, N_FAKE_LIGHTS_FOR_INDIRECT - 1 )],
+											 rayDirs[Min( i + 2, N_FAKE_LIGHTS_FOR_INDIRECT - 1 )], rayDirs[Min( i + 3, N_FAKE_LIGHTS_FOR_INDIRECT - 1 )] );
+			RayTracingResult r_rslt;
+			m_ShadowBVH.Trace4Rays( myrays, ReplicateX4( lrad ), &r_rslt );
+			for ( int j = 0; j < 4 && i + j < N_FAKE_LIGHTS_FOR_INDIRECT; j++ )
+			{
+				rslts[i + j].HitID = r_rslt.HitIds[j];
+				rslts[i + j].HitDistance = SubFloat( r_rslt.HitDistance, j );
+				rslts[i + j].surface_normal = r_rslt.surface_normal.Vec( j );
+				rslts[i + j].ray_length = lrad;
+			}
 		}
-		m_pRtEnv->FinishRayStream( myStream );
 		// now, we have a bunch of raytracing results
 		for ( int i = 0; i < N_FAKE_LIGHTS_FOR_INDIRECT; i++ )
 		{
@@ -1279,37 +1576,12 @@ void CLightingPreviewThread::CalculateForLight( CLightingPreviewLightDescription
 		l_info->m_eIncrState = INCR_STATE_PARTIAL_RESULTS;
 }
 
-#ifndef __clang__
-#pragma optimize( "", on )
-#endif
-
-void CLightingPreviewThread::SendResultRendering( CSOAContainer& rsltBuffer )
+void CLightingPreviewThread::SendResultRendering( Bitmap_t* pBitmap )
 {
-	Bitmap_t* ret_bm = new Bitmap_t;
-	ret_bm->Init( rsltBuffer.NumCols(), rsltBuffer.NumRows(), IMAGE_FORMAT_RGBA8888 );
-	// lets copy into the output bitmap
-	for ( int y = 0; y < ret_bm->Height(); y++ )
-	{
-		float const* pRGBData = rsltBuffer.RowPtr<float>( RSLT_BUFFER_RSLT_RGB, y );
-#ifdef _DEBUG
-		OutputDebugStringA( CFmtStr( "%g %g %g\n", pRGBData[0], pRGBData[4], pRGBData[8] ) );
-#endif
-		for ( int x = 0; x < ret_bm->Width(); x++ )
-		{
-			Vector color( pRGBData[0], pRGBData[4], pRGBData[8] );
-			unsigned char* pPixel = ret_bm->GetPixel( x, y );
-			pPixel[0] = (uint8)min( 255.f, 255.0f * pow( color.z, 1 / 2.2f ) );
-			pPixel[1] = (uint8)min( 255.f, 255.0f * pow( color.y, 1 / 2.2f ) );
-			pPixel[2] = (uint8)min( 255.f, 255.0f * pow( color.x, 1 / 2.2f ) );
-			pPixel[3] = 0;
-			pRGBData++;
-			if ( ( x & 3 ) == 3 )
-				pRGBData += 8;
-		}
-	}
 	MessageFromLPreview ret_msg( LPREVIEW_MSG_DISPLAY_RESULT );
-	ret_msg.m_pBitmapToDisplay = ret_bm;
+	ret_msg.m_pBitmapToDisplay = pBitmap;
 	ret_msg.m_nBitmapGenerationCounter = m_nBitmapGenerationCounter;
+	ret_msg.m_Stats = m_Stats;
 	g_LPreviewToHammerMsgQueue.QueueMessage( ret_msg );
 }
 
@@ -1317,10 +1589,8 @@ void CLightingPreviewThread::SendResultRendering( CSOAContainer& rsltBuffer )
 
 // master side of lighting preview
 
-unsigned LightingPreviewThreadFN( void* )
+static void StartLightingPreviewThreadPool()
 {
-	CLightingPreviewThread LPreviewObject;
-	ThreadSetPriority( -2 );								// low
 	s_pThreadPool = CreateThreadPool();
 
 	const CPUInformation* pCPUInfo = GetCPUInformation();
@@ -1334,15 +1604,245 @@ unsigned LightingPreviewThreadFN( void* )
 		startParams.iAffinityTable[i] = 1 << ( i + 1 );
 	s_pThreadPool->Start( startParams, "hammer_lighting" );
 	CSOAContainer::SetThreadPool( s_pThreadPool );
+}
 
-	LPreviewObject.Run();
-
+static void StopLightingPreviewThreadPool()
+{
 	CSOAContainer::SetThreadPool( nullptr );
 	s_pThreadPool->Stop();
 	DestroyThreadPool( s_pThreadPool );
+	s_pThreadPool = NULL;
+}
+
+unsigned LightingPreviewThreadFN( void* )
+{
+	CLightingPreviewThread LPreviewObject;
+	ThreadSetPriority( -2 );								// low
+	StartLightingPreviewThreadPool();
+
+	LPreviewObject.Run();
+
+	StopLightingPreviewThreadPool();
 	return 0;
 }
 
+static const char* s_pszGBufferFileNames[] = { "albedo", "normal", "position" };
+
+void RecordLightingPreviewGBuffers( const char* pszBaseName, FloatBitMap2_t** ppGBuffers, const Vector& vecEyePosition,
+									const CUtlVector<LightingPreviewGeomChunk_t>& ShadowChunks )
+{
+	// the pfm reader and writer only handle images up to 2048 pixels across
+	if ( ppGBuffers[0]->NumCols() > 2048 )
+	{
+		Warning( "Can't record lighting preview g-buffers wider than 2048 pixels\n" );
+		return;
+	}
+
+	for ( uint i = 0; i < ARRAYSIZE( s_pszGBufferFileNames ); i++ )
+		ppGBuffers[i]->WritePFM( CFmtStr( "%s_%s.pfm", pszBaseName, s_pszGBufferFileNames[i] ) );
+
+	FileHandle_t hFile = g_pFullFileSystem->Open( CFmtStr( "%s_eye.txt", pszBaseName ), "wt" );
+	if ( hFile )
+	{
+		g_pFullFileSystem->FPrintf( hFile, "%f %f %f\n", vecEyePosition.x, vecEyePosition.y, vecEyePosition.z );
+		g_pFullFileSystem->Close( hFile );
+	}
+
+	// chunk count, then each non-empty chunk as its object id, vertex count and vertices
+	int nChunks = 0;
+	for ( int i = 0; i < ShadowChunks.Count(); i++ )
+	{
+		if ( ShadowChunks[i].m_Triangles.Count() )
+			nChunks++;
+	}
+	CUtlBuffer buf;
+	buf.PutInt( nChunks );
+	for ( int i = 0; i < ShadowChunks.Count(); i++ )
+	{
+		const CUtlVector<Vector>& Triangles = ShadowChunks[i].m_Triangles;
+		if ( !Triangles.Count() )
+			continue;
+		buf.PutInt( ShadowChunks[i].m_nObjectID );
+		buf.PutInt( Triangles.Count() );
+		buf.Put( Triangles.Base(), Triangles.Count() * sizeof( Vector ) );
+	}
+	if ( !g_pFullFileSystem->WriteFile( CFmtStr( "%s_shadows.bin", pszBaseName ), NULL, buf ) )
+		Warning( "Couldn't write the lighting preview shadow geometry to %s_shadows.bin\n", pszBaseName );
+}
+
+// load recorded shadow triangles into a geometry message replacing all the preview's geometry.
+// returns the number of triangles loaded, or -1 if there is no valid recording
+static int LoadRecordedShadowChunks( const char* pszBaseName, MessageToLPreview& msg )
+{
+	msg.m_pShadowChunks = new CUtlVector<LightingPreviewGeomChunk_t>;
+	msg.m_bResetGeometry = true;
+
+	CUtlBuffer buf;
+	if ( !g_pFullFileSystem->ReadFile( CFmtStr( "%s_shadows.bin", pszBaseName ), NULL, buf ) )
+		return -1;
+
+	int nTriangles = 0;
+	int nChunks = buf.GetInt();
+	for ( int i = 0; i < nChunks && buf.IsValid(); i++ )
+	{
+		int nObjectID = buf.GetInt();
+		int nVerts = buf.GetInt();
+		if ( !buf.IsValid() || nVerts <= 0 || ( nVerts % 3 ) != 0 ||
+			 nVerts > buf.GetBytesRemaining() / (int)sizeof( Vector ) )
+			break;
+
+		LightingPreviewGeomChunk_t& chunk = msg.m_pShadowChunks->Element( msg.m_pShadowChunks->AddToTail() );
+		chunk.m_nObjectID = nObjectID;
+		chunk.m_Triangles.SetCount( nVerts );
+		buf.Get( chunk.m_Triangles.Base(), nVerts * sizeof( Vector ) );
+		nTriangles += nVerts / 3;
+	}
+
+	if ( !buf.IsValid() || msg.m_pShadowChunks->Count() != nChunks )
+	{
+		msg.m_pShadowChunks->Purge();
+		return -1;
+	}
+	return nTriangles;
+}
+
+// load recorded g-buffers into a g-buffer message. returns false if any are missing
+static bool LoadRecordedGBuffers( const char* pszBaseName, MessageToLPreview& msg )
+{
+	bool bLoaded = true;
+	for ( uint i = 0; i < ARRAYSIZE( s_pszGBufferFileNames ); i++ )
+	{
+		msg.m_pDefferedRenderingBMs[i] = new FloatBitMap_t;
+		if ( !msg.m_pDefferedRenderingBMs[i]->LoadFromPFM( CFmtStr( "%s_%s.pfm", pszBaseName, s_pszGBufferFileNames[i] ) ) )
+			bLoaded = false;
+	}
+	if ( bLoaded && ( msg.m_pDefferedRenderingBMs[1]->NumCols() != msg.m_pDefferedRenderingBMs[0]->NumCols() ||
+					  msg.m_pDefferedRenderingBMs[1]->NumRows() != msg.m_pDefferedRenderingBMs[0]->NumRows() ||
+					  msg.m_pDefferedRenderingBMs[2]->NumCols() != msg.m_pDefferedRenderingBMs[0]->NumCols() ||
+					  msg.m_pDefferedRenderingBMs[2]->NumRows() != msg.m_pDefferedRenderingBMs[0]->NumRows() ) )
+		bLoaded = false;
+	if ( !bLoaded )
+	{
+		for ( uint i = 0; i < ARRAYSIZE( s_pszGBufferFileNames ); i++ )
+			delete msg.m_pDefferedRenderingBMs[i];
+		return false;
+	}
+
+	msg.m_EyePosition.Init();
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( g_pFullFileSystem->ReadFile( CFmtStr( "%s_eye.txt", pszBaseName ), NULL, buf ) )
+		buf.Scanf( "%f %f %f", &msg.m_EyePosition.x, &msg.m_EyePosition.y, &msg.m_EyePosition.z );
+	msg.m_nBitmapGenerationCounter = 0;
+	return true;
+}
+
+// make point lights a little way out from evenly spaced points of the recorded scene
+static void CreateBenchmarkLights( FloatBitMap2_t** ppGBuffers, int nLights, CUtlIntrusiveList<CLightingPreviewLightDescription>& lightList )
+{
+	const FloatBitMap_t* pNormals = ppGBuffers[1];
+	const FloatBitMap_t* pPositions = ppGBuffers[2];
+	int nPixels = pPositions->NumCols() * pPositions->NumRows();
+	for ( int i = 0; i < nLights; i++ )
+	{
+		int nPixel = (int)( ( (int64)nPixels * ( 2 * i + 1 ) ) / ( 2 * nLights ) );
+		int x = nPixel % pPositions->NumCols();
+		int y = nPixel / pPositions->NumCols();
+		Vector vecPos( pPositions->Pixel( x, y, 0, 0 ), pPositions->Pixel( x, y, 0, 1 ), pPositions->Pixel( x, y, 0, 2 ) );
+		Vector vecNormal( pNormals->Pixel( x, y, 0, 0 ), pNormals->Pixel( x, y, 0, 1 ), pNormals->Pixel( x, y, 0, 2 ) );
+
+		CLightingPreviewLightDescription* pLight = new CLightingPreviewLightDescription;
+		pLight->Init( i + 1 );
+		pLight->InitPoint( vecPos + vecNormal * 32.0f, Vector( 100.0f, 100.0f, 100.0f ) );
+		pLight->m_Attenuation0 = 0;
+		pLight->m_Attenuation1 = 0;
+		pLight->m_Attenuation2 = 1;
+		pLight->RecalculateDerivedValues();
+		lightList.AddToTail( pLight );
+	}
+}
+
+// light a recorded g-buffer from start to finish, returning the seconds spent shading and resolving.
+// *pShadowTriangles is -1 if there was no shadow geometry recorded, in which case nothing is occluded
+static bool TimeLightingPreview( const char* pszBaseName, int nLights, float* pShadeTime, float* pResolveTime, int* pWidth, int* pHeight,
+								 int* pShadowTriangles )
+{
+	CLightingPreviewThread* pLPV = new CLightingPreviewThread;
+
+	MessageToLPreview gbufMsg( LPREVIEW_MSG_G_BUFFERS );
+	if ( !LoadRecordedGBuffers( pszBaseName, gbufMsg ) )
+	{
+		delete pLPV;
+		return false;
+	}
+	*pWidth = gbufMsg.m_pDefferedRenderingBMs[0]->NumCols();
+	*pHeight = gbufMsg.m_pDefferedRenderingBMs[0]->NumRows();
+
+	MessageToLPreview lightMsg( LPREVIEW_MSG_LIGHT_DATA );
+	lightMsg.m_EyePosition = gbufMsg.m_EyePosition;
+	CreateBenchmarkLights( gbufMsg.m_pDefferedRenderingBMs, nLights, lightMsg.m_LightList );
+
+	MessageToLPreview geomMsg( LPREVIEW_MSG_GEOM_DATA );
+	*pShadowTriangles = LoadRecordedShadowChunks( pszBaseName, geomMsg );
+	pLPV->HandleGeomMessage( geomMsg );
+
+	n_gbufs_queued++;
+	pLPV->HandleGBuffersMessage( gbufMsg );
+	pLPV->HandleLightDataMessage( lightMsg );
+
+	// build the shadow trees up front so only the shading is timed
+	pLPV->m_ShadowBVH.Update();
+
+	float flStartTime = Plat_FloatTime();
+	while ( pLPV->AnyUsefulWorkToDo() )
+		pLPV->DoWork();
+	float flShadedTime = Plat_FloatTime();
+	Bitmap_t* pBitmap = pLPV->ResolveResult();
+	*pShadeTime = flShadedTime - flStartTime;
+	*pResolveTime = Plat_FloatTime() - flShadedTime;
+
+	delete pBitmap;
+	delete pLPV;
+	return true;
+}
+
+bool BenchmarkLightingPreview( const char* pszBaseName, int nLights )
+{
+	StartLightingPreviewThreadPool();
+
+	float flShadeTime = 0.f, flResolveTime = 0.f, flUnculledShadeTime = 0.f, flUnculledResolveTime = 0.f;
+	int nWidth = 0, nHeight = 0, nShadowTriangles = -1;
+	s_bLightingPreviewTileCulling = false;
+	bool bLoaded = TimeLightingPreview( pszBaseName, nLights, &flUnculledShadeTime, &flUnculledResolveTime, &nWidth, &nHeight, &nShadowTriangles );
+	s_bLightingPreviewTileCulling = true;
+	if ( bLoaded )
+		TimeLightingPreview( pszBaseName, nLights, &flShadeTime, &flResolveTime, &nWidth, &nHeight, &nShadowTriangles );
+
+	StopLightingPreviewThreadPool();
+
+	if ( !bLoaded )
+	{
+		Warning( "Lighting preview benchmark: couldn't load the g-buffers recorded as %s\n", pszBaseName );
+		return false;
+	}
+	if ( nShadowTriangles < 0 )
+	{
+		Warning( "Lighting preview benchmark: no shadow geometry recorded as %s_shadows.bin, so nothing is occluded\n", pszBaseName );
+		nShadowTriangles = 0;
+	}
+
+	CFmtStr results( "Lighting preview benchmark: %dx%d, %d lights, %d shadow triangles, shading %.1f ms (%.1f ms without tile culling, %.1fx), resolve %.1f ms\n",
+					 nWidth, nHeight, nLights, nShadowTriangles, flShadeTime * 1000.0f, flUnculledShadeTime * 1000.0f,
+					 ( flShadeTime > 0.f ) ? flUnculledShadeTime / flShadeTime : 0.f, flResolveTime * 1000.0f );
+	Msg( "%s", results.Access() );
+	FileHandle_t hFile = g_pFullFileSystem->Open( CFmtStr( "%s_benchmark.txt", pszBaseName ), "at" );
+	if ( hFile )
+	{
+		g_pFullFileSystem->Write( results.Access(), V_strlen( results.Access() ), hFile );
+		g_pFullFileSystem->Close( hFile );
+	}
+	return true;
+}
+
 
 void HandleLightingPreview()
 {
@@ -1369,6 +1869,7 @@ void HandleLightingPreview()
 				if ( msg.m_nBitmapGenerationCounter == g_nBitmapGenerationCounter )
 				{
 					g_pLPreviewOutputBitmap = msg.m_pBitmapToDisplay;
+					g_LPreviewStats = msg.m_Stats;
 					if ( g_pLPreviewOutputBitmap && g_pLPreviewOutputBitmap->Width() > 10 )
 					{
 						SignalUpdate( EVTYPE_BITMAP_RECEIVED_FROM_LPREVIEW );
@@ -55,7 +55,7 @@ enum HammerToLightingPreviewMessageType
 	// messages from hammer to preview task
 	LPREVIEW_MSG_STOP,									// no lighting previews open - stop working
 	LPREVIEW_MSG_EXIT,										// we're exiting program - shut down
-	LPREVIEW_MSG_GEOM_DATA,									  // we have new shadow geometry data
+	LPREVIEW_MSG_GEOM_DATA,									  // we have changed shadow geometry chunks
 	LPREVIEW_MSG_G_BUFFERS,							 // we have new g buffer data from the renderer
 	LPREVIEW_MSG_LIGHT_DATA,								// new light data in m_pLightList
 };
@@ -67,6 +67,15 @@ enum LightingPreviewToHammerMessageType
 };
 
 
+// the shadowing triangles of one map object. The geometry message carries only the chunks of
+// objects which were added, changed or removed since the last one sent. An empty triangle
+// list means that the object no longer casts shadows.
+struct LightingPreviewGeomChunk_t
+{
+	int m_nObjectID;
+	CUtlVector<Vector> m_Triangles;							// 3 vertices per triangle
+};
+
 struct MessageToLPreview
 {
 	HammerToLightingPreviewMessageType m_MsgType;
@@ -82,15 +91,26 @@ struct MessageToLPreview
 	FloatBitMap2_t*									m_pDefferedRenderingBMs[3];	// if LPREVIEW_MSG_G_BUFFERS
 	CUtlIntrusiveList<CLightingPreviewLightDescription> m_LightList;			// if LPREVIEW_MSG_LIGHT_DATA
 	Vector											m_EyePosition;				// for LPREVIEW_MSG_LIGHT_DATA & G_BUFFERS
-	CUtlVector<Vector>*								m_pShadowTriangleList;		// for LPREVIEW_MSG_GEOM_DATA
+	CUtlVector<LightingPreviewGeomChunk_t>*			m_pShadowChunks;			// for LPREVIEW_MSG_GEOM_DATA
+	bool											m_bResetGeometry;			// for LPREVIEW_MSG_GEOM_DATA - throw away chunks not in m_pShadowChunks
 	int												m_nBitmapGenerationCounter;	// for LPREVIEW_MSG_G_BUFFERS
 };
 
+// how the preview is getting on, shown over the result
+struct LightingPreviewStats_t
+{
+	int m_nLightsTotal;										// including pseudo lights for indirect light
+	int m_nLightsActive;									// lights which can affect the view
+	int m_nLinesCalculated;									// since the results were last thrown away
+	float m_flStepTime;										// seconds taken by the last step
+};
+
 struct MessageFromLPreview
 {
 	LightingPreviewToHammerMessageType	m_MsgType;
 	Bitmap_t*							m_pBitmapToDisplay;			// for LPREVIEW_MSG_DISPLAY_RESULT
 	int									m_nBitmapGenerationCounter;	// for LPREVIEW_MSG_DISPLAY_RESULT
+	LightingPreviewStats_t				m_Stats;					// for LPREVIEW_MSG_DISPLAY_RESULT
 	MessageFromLPreview() = default;
 	MessageFromLPreview( LightingPreviewToHammerMessageType msgtype )
 	{
@@ -105,6 +125,7 @@ extern ThreadHandle_t g_LPreviewThread;
 extern CInterlockedInt n_gbufs_queued;
 
 extern Bitmap_t *g_pLPreviewOutputBitmap;
+extern LightingPreviewStats_t g_LPreviewStats;
 
 // the lighting preview thread entry point
 
@@ -113,4 +134,13 @@ unsigned LightingPreviewThreadFN( void* );
 // the lighting preview handler. call often
 void HandleLightingPreview();
 
+// write g-buffers as they are sent to the preview to <basename>_albedo.pfm, _normal.pfm and
+// _position.pfm, the eye position to <basename>_eye.txt and the shadow triangles to <basename>_shadows.bin
+void RecordLightingPreviewGBuffers( const char *pszBaseName, FloatBitMap2_t **ppGBuffers, const Vector &vecEyePosition,
+									const CUtlVector<LightingPreviewGeomChunk_t> &ShadowChunks );
+
+// time the preview lighting g-buffers recorded by RecordLightingPreviewGBuffers, without needing
+// a map or a view. results are appended to <basename>_benchmark.txt
+bool BenchmarkLightingPreview( const char *pszBaseName, int nLights = 64 );
+
 #endif
\ No newline at end of file
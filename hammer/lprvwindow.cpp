@@ -16,11 +16,14 @@
 #include "tier0/memdbgon.h"
 
 
+static bool g_bShowLPreviewStats = false;
+
 
 BEGIN_MESSAGE_MAP( CLightingPreviewResultsWindow, CWnd )
 	//{{AFX_MSG_MAP(CTextureWindow)
 	ON_WM_PAINT()
 	ON_WM_CLOSE()
+	ON_WM_LBUTTONDBLCLK()
 	//}}AFX_MSG_MAP
 END_MESSAGE_MAP()
 
@@ -68,6 +71,15 @@ void CLightingPreviewResultsWindow::OnClose()
 	CWnd::OnClose();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Toggles the statistics overlay.
+//-----------------------------------------------------------------------------
+void CLightingPreviewResultsWindow::OnLButtonDblClk( UINT nFlags, CPoint point )
+{
+	g_bShowLPreviewStats = !g_bShowLPreviewStats;
+	Invalidate( false );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
@@ -95,5 +107,15 @@ void CLightingPreviewResultsWindow::OnPaint()
 			dc.GetSafeHdc(), clientrect.left, clientrect.top, 1 + ( clientrect.right - clientrect.left ),
 			1 + ( clientrect.bottom - clientrect.top ), 0, 0, g_pLPreviewOutputBitmap->Width(), g_pLPreviewOutputBitmap->Height(),
 			g_pLPreviewOutputBitmap->GetBits(), &bmi, DIB_RGB_COLORS, SRCCOPY );
+
+		if ( g_bShowLPreviewStats )
+		{
+			CString str;
+			str.Format( "lights: %d/%d  lines: %d  step: %.1f ms", g_LPreviewStats.m_nLightsActive, g_LPreviewStats.m_nLightsTotal,
+						g_LPreviewStats.m_nLinesCalculated, g_LPreviewStats.m_flStepTime * 1000.0f );
+			dc.SetBkMode( TRANSPARENT );
+			dc.SetTextColor( RGB( 255, 255, 0 ) );
+			dc.TextOut( clientrect.left + 4, clientrect.top + 4, str );
+		}
 	}
 }
\ No newline at end of file
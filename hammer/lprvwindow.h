@@ -27,11 +27,11 @@ protected:
 	//{{AFX_MSG(CLightingPreviewResultsWindow)
  	afx_msg void OnPaint();
 	afx_msg void OnClose(); 
+	afx_msg void OnLButtonDblClk(UINT nFlags, CPoint point);
 // 	afx_msg void OnSize(UINT nType, int cx, int cy);
 // 	afx_msg void OnHScroll(UINT nSBCode, UINT nPos, CScrollBar* pScrollBar);
 // 	afx_msg void OnVScroll(UINT nSBCode, UINT nPos, CScrollBar* pScrollBar);
 // 	afx_msg void OnLButtonDown(UINT nFlags, CPoint point);
-// 	afx_msg void OnLButtonDblClk(UINT nFlags, CPoint point);
 // 	afx_msg void OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags);
 // 	afx_msg void OnChar(UINT nChar, UINT nRepCnt, UINT nFlags);
 // 	afx_msg BOOL OnMouseWheel(UINT nFlags, short zDelta, CPoint point);
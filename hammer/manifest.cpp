@@ -803,7 +803,7 @@ void CManifest::Initialize( void )
 	__super::Initialize();
 
 	m_ManifestWorld = new CMapWorld( this );
-	m_ManifestWorld->CullTree_Build();
+	m_ManifestWorld->ObjectBVH_Build();
 }
 
 
@@ -1208,7 +1208,7 @@ bool CManifest::AddExistingMap( const char *pszFileName, bool bFromInstance )
 		return false;
 	}
 
-	pManifestMap->m_Map->GetMapWorld()->CullTree_Build();
+	pManifestMap->m_Map->GetMapWorld()->ObjectBVH_Build();
 	pManifestMap->m_Entity->PostUpdate( Notify_Changed );
 	if ( m_Maps.Count() == 1 )
 	{
@@ -9,6 +9,7 @@
 #include "globalfunctions.h"
 #include "history.h"
 #include "mainfrm.h"
+#include "mapchecker.h"
 #include "mapcheckdlg.h"
 #include "mapdoc.h"
 #include "mapentity.h"
@@ -25,69 +26,6 @@
 #include <tier0/memdbgon.h>
 
 
-// ********
-// NOTE: Make sure the order matches g_MapErrorStringIDs below!
-// ********
-enum MapErrorType
-{
-	ErrorNoPlayerStart,
-	ErrorMixedFace,
-	ErrorDuplicatePlanes,
-	ErrorMissingTarget,
-	ErrorInvalidTexture,
-	ErrorSolidStructure,
-	ErrorUnusedKeyvalues,
-	ErrorEmptyEntity,
-	ErrorDuplicateKeys,
-	ErrorInvalidTextureAxes,
-	ErrorDuplicateFaceIDs,
-	ErrorDuplicateNodeIDs,
-	ErrorBadConnections,
-	ErrorHiddenGroupHiddenChildren,
-	ErrorHiddenGroupVisibleChildren,
-	ErrorHiddenGroupMixedChildren,
-	ErrorHiddenObjectNoVisGroup,
-	ErrorHiddenChildOfEntity,
-	ErrorIllegallyHiddenObject,
-	ErrorKillInputRaceCondition,
-	ErrorOverlayFaceList,
-};
-
-// ********
-// NOTE: Make sure the order matches MapErrorType above!
-// ********
-constexpr struct
-{
-	int	m_StrResourceID;
-	int m_DescriptionResourceID;
-} g_MapErrorStrings[] =
-{
-	{IDS_NOPLAYERSTART,					IDS_NOPLAYERSTART_DESC},
-	{IDS_MIXEDFACES,					IDS_MIXEDFACES_DESC},
-	{IDS_DUPLICATEPLANES,				IDS_DUPLICATEPLANES_DESC},
-	{IDS_UNMATCHEDTARGET,				IDS_UNMATCHEDTARGET_DESC},
-	{IDS_INVALIDTEXTURE,				IDS_INVALIDTEXTURE_DESC},
-	{IDS_SOLIDSTRUCTURE,				IDS_SOLIDSTRUCTURE_DESC},
-	{IDS_UNUSEDKEYVALUES,				IDS_UNUSEDKEYVALUES_DESC},
-	{IDS_EMPTYENTITY,					IDS_EMPTYENTITY_DESC},
-	{IDS_DUPLICATEKEYS,					IDS_DUPLICATEKEYS_DESC},
-	{IDS_SOLIDCONTENT,					IDS_SOLIDCONTENT_DESC},
-	{IDS_INVALIDTEXTUREAXES,			IDS_INVALIDTEXTUREAXES_DESC},
-	{IDS_DUPLICATEFACEID,				IDS_DUPLICATEFACEID_DESC},
-	{IDS_DUPLICATE_NODE_ID,				IDS_DUPLICATE_NODE_ID_DESC},
-	{IDS_BAD_CONNECTIONS,				IDS_BAD_CONNECTIONS_DESC},
-	{IDS_HIDDEN_GROUP_HIDDEN_CHILDREN,	IDS_HIDDEN_GROUP_HIDDEN_CHILDREN_DESC},
-	{IDS_HIDDEN_GROUP_VISIBLE_CHILDREN, IDS_HIDDEN_GROUP_VISIBLE_CHILDREN_DESC},
-	{IDS_HIDDEN_GROUP_MIXED_CHILDREN,	IDS_HIDDEN_GROUP_MIXED_CHILDREN_DESC},
-	{IDS_HIDDEN_NO_VISGROUP,			IDS_HIDDEN_NO_VISGROUP_DESC},
-	{IDS_HIDDEN_CHILD_OF_ENTITY,		IDS_HIDDEN_CHILD_OF_ENTITY_DESC},
-	{IDS_HIDDEN_ILLEGALLY,				IDS_HIDDEN_ILLEGALLY_DESC},
-	{IDS_KILL_INPUT_RACE_CONDITION,		IDS_KILL_INPUT_RACE_CONDITION_DESC},
-	{IDS_BAD_OVERLAY,					IDS_DAB_OVERLAY_DESC}
-};
-
-
-
 enum FIXCODE
 {
 	CantFix,
@@ -141,15 +79,6 @@ BEGIN_MESSAGE_MAP(CMapCheckDlg, CDialog)
 END_MESSAGE_MAP()
 
 
-//-----------------------------------------------------------------------------
-// Visibility check
-//-----------------------------------------------------------------------------
-inline bool IsCheckVisible( CMapClass *pClass )
-{
-	return (Options.general.bCheckVisibleMapErrors == FALSE) || pClass->IsVisible();
-}
-
-
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
@@ -341,7 +270,7 @@ void CMapCheckDlg::Fix(MapError *pError, UpdateBox &ub)
 		}
 		case ErrorDuplicateFaceIDs:
 		{
-			FixDuplicatePlanes(pError);
+			FixDuplicateFaceIDs(pError);
 			break;
 		}
 		case ErrorDuplicateNodeIDs:
@@ -497,12 +426,7 @@ void CMapCheckDlg::OnSelchangeErrors()
 	MapError *pError;
 	pError = (MapError*) m_Errors.GetItemDataPtr(iSel);
 
-	// Figure out which error string we're using.
-	int iErrorStr = (int)pError->Type;
-	iErrorStr = clamp( iErrorStr, 0, ARRAYSIZE( g_MapErrorStrings ) - 1 );
-	Assert( iErrorStr == (int)pError->Type );
-
-	str.LoadString(g_MapErrorStrings[iErrorStr].m_DescriptionResourceID);
+	str.LoadString(CMapChecker::GetErrorDescriptionID(pError->Type));
 	m_Description.SetWindowText(str);
 
 	m_Go.EnableWindow(pError->pObjects[0] != NULL);
@@ -579,30 +503,13 @@ void CMapCheckDlg::KillErrorList()
 //-----------------------------------------------------------------------------
 static void AddErrorToListBox(CListBox *pList, MapError *pError)
 {
-	CString str;
-
-	// Figure out which error string we're using.
-	int iErrorStr = (int)pError->Type;
-	iErrorStr = clamp( iErrorStr, 0, ARRAYSIZE( g_MapErrorStrings ) - 1 );
-	Assert( iErrorStr == (int)pError->Type );
-
-	str.LoadString(g_MapErrorStrings[iErrorStr].m_StrResourceID);
+	MapCheckError_t Error;
+	Error.m_eType = pError->Type;
+	Error.m_pObject = pError->pObjects[0];
+	Error.m_dwExtra = pError->dwExtra;
 
-	if (str.Find('%') != -1)
-	{
-		if (pError->Type == ErrorUnusedKeyvalues)
-		{
-			// dwExtra has the name of the string in it
-			CString str2 = str;
-			CMapEntity *pEntity = (CMapEntity *)pError->pObjects[0];
-			str.Format(str2, pEntity->GetClassName(), pError->dwExtra);
-		}
-		else
-		{
-			CString str2 = str;
-			str.Format(str2, pError->dwExtra);
-		}
-	}
+	CString str;
+	CMapChecker::GetErrorText(Error, str);
 
 	int iIndex = pList->AddString(str);
 	pList->SetItemDataPtr(iIndex, (PVOID)pError);
@@ -610,71 +517,24 @@ static void AddErrorToListBox(CListBox *pList, MapError *pError)
 
 
 //-----------------------------------------------------------------------------
-// Purpose:
+// Purpose: Adds an error found by the map checker to the list.
 // Input  : pList -
-//			Type -
-//			dwExtra -
-//			... -
+//			Error -
 //-----------------------------------------------------------------------------
-static void AddError(CListBox *pList, MapErrorType Type, DWORD dwExtra, ...)
+static void AddError(CListBox *pList, const MapCheckError_t &Error)
 {
 	MapError *pError = new MapError;
 	memset(pError, 0, sizeof(MapError));
 
-	pError->Type = Type;
-	pError->dwExtra = dwExtra;
+	pError->Type = Error.m_eType;
+	pError->pObjects[0] = Error.m_pObject;
+	pError->dwExtra = Error.m_dwExtra;
 	pError->Fix = CantFix;
 
-	va_list vl;
-	va_start(vl, dwExtra);
-
-	//
-	// Get the object pointer from the variable argument list.
-	//
-	switch (Type)
-	{
-		case ErrorNoPlayerStart:
-		{
-			// no objects.
-			break;
-		}
-
-		case ErrorMixedFace:
-		case ErrorMissingTarget:
-		case ErrorDuplicatePlanes:
-		case ErrorDuplicateFaceIDs:
-		case ErrorDuplicateNodeIDs:
-		case ErrorSolidStructure:
-		case ErrorInvalidTexture:
-		case ErrorUnusedKeyvalues:
-		case ErrorBadConnections:
-		case ErrorEmptyEntity:
-		case ErrorDuplicateKeys:
-		case ErrorInvalidTextureAxes:
-		case ErrorHiddenGroupHiddenChildren:
-		case ErrorHiddenGroupVisibleChildren:
-		case ErrorHiddenGroupMixedChildren:
-		case ErrorHiddenObjectNoVisGroup:
-		case ErrorHiddenChildOfEntity:
-		case ErrorIllegallyHiddenObject:
-		case ErrorOverlayFaceList:
-		{
-			pError->pObjects[0] = va_arg(vl, CMapClass *);
-			break;
-		}
-
-		case ErrorKillInputRaceCondition:
-		{
-			pError->pObjects[0] = va_arg(vl, CMapClass *);
-			pError->dwExtra = (DWORD)va_arg(vl, CEntityConnection *);
-			break;
-		}
-	}
-
 	//
 	// Set the can fix flag.
 	//
-	switch (Type)
+	switch (Error.m_eType)
 	{
 		case ErrorDuplicatePlanes:
 		case ErrorDuplicateFaceIDs:
@@ -701,146 +561,10 @@ static void AddError(CListBox *pList, MapErrorType Type, DWORD dwExtra, ...)
 		}
 	}
 
-	va_end(vl);
-
 	AddErrorToListBox(pList, pError);
 }
 
 
-//-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pObject -
-//			DWORD -
-// Output :
-//-----------------------------------------------------------------------------
-static BOOL FindPlayer(CMapEntity *pObject, DWORD*)
-{
-	if ( !IsCheckVisible( pObject ) )
-		return TRUE;
-
-	if ( pObject->IsPlaceholder() && V_strnicmp( pObject->GetClassName(), "info_player_", 12 ) == 0 )
-	{
-		return(FALSE);
-	}
-	return(TRUE);
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pList -
-//			pWorld -
-//-----------------------------------------------------------------------------
-static void CheckRequirements(CListBox *pList, CMapWorld *pWorld)
-{
-	// ensure there's a player start ..
-	if (pWorld->EnumChildren(FindPlayer, nullptr, MAPCLASS_TYPE(CMapEntity)))
-	{
-		// if rvl is !0, it was not stopped prematurely.. which means there is
-		// NO player start.
-		AddError(pList, ErrorNoPlayerStart, 0);
-	}
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pSolid -
-//			pList -
-// Output :
-//-----------------------------------------------------------------------------
-static BOOL _CheckMixedFaces(CMapSolid *pSolid, CListBox *pList)
-{
-	if ( !IsCheckVisible( pSolid ) )
-		return TRUE;
-
-	// run thru faces..
-	int iFaces = pSolid->GetFaceCount();
-	int iSolid = 2;	// start off ambivalent
-	int i;
-	for(i = 0; i < iFaces; i++)
-	{
-		CMapFace *pFace = pSolid->GetFace(i);
-
-		char ch = pFace->texture.texture[0];
-		if((ch == '*' && iSolid == 1) || (ch != '*' && iSolid == 0))
-		{
-			break;
-		}
-		else iSolid = (ch == '*') ? 0 : 1;
-	}
-
-	if(i == iFaces)	// all ok
-		return TRUE;
-
-	// NOT ok
-	AddError(pList, ErrorMixedFace, 0, pSolid);
-
-	return TRUE;
-}
-
-
-static void CheckMixedFaces(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckMixedFaces, pList, MAPCLASS_TYPE(CMapSolid));
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Returns true if there is another node entity in the world with the
-//			same node ID as the given entity.
-// Input  : pNode -
-//			pWorld -
-//-----------------------------------------------------------------------------
-bool FindDuplicateNodeID(CMapEntity *pNode, CMapWorld *pWorld)
-{
-	if ( !IsCheckVisible( pNode ) )
-		return false;
-
-	EnumChildrenPos_t pos;
-	CMapClass *pChild = pWorld->GetFirstDescendent(pos);
-	while (pChild != NULL)
-	{
-		CMapEntity *pEntity = dynamic_cast<CMapEntity *>(pChild);
-		if (pEntity && IsCheckVisible( pEntity ) && (pEntity != pNode) && pEntity->IsNodeClass())
-		{
-			int nNodeID1 = pNode->GetNodeID();
-			int nNodeID2 = pEntity->GetNodeID();
-			if ((nNodeID1 != 0) && (nNodeID2 != 0) && (nNodeID1 == nNodeID2))
-			{
-				return true;
-			}
-		}
-
-		pChild = pWorld->GetNextDescendent(pos);
-	}
-
-	return false;
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Checks for node entities with the same node ID.
-//-----------------------------------------------------------------------------
-static void CheckDuplicateNodeIDs(CListBox *pList, CMapWorld *pWorld)
-{
-	EnumChildrenPos_t pos;
-	CMapClass *pChild = pWorld->GetFirstDescendent(pos);
-	while (pChild != NULL)
-	{
-		CMapEntity *pEntity = dynamic_cast<CMapEntity *>(pChild);
-		if (pEntity && pEntity->IsNodeClass())
-		{
-			if (FindDuplicateNodeID(pEntity, pWorld))
-			{
-				AddError(pList, ErrorDuplicateNodeIDs, (DWORD)pWorld, pEntity);
-			}
-		}
-
-		pChild = pWorld->GetNextDescendent(pos);
-	}
-}
-
 
 //-----------------------------------------------------------------------------
 // Purpose: Checks for faces with identical face normals in this solid object.
@@ -878,476 +602,6 @@ BOOL DoesContainDuplicates(CMapSolid *pSolid)
 }
 
 
-//-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pSolid -
-//			pList -
-// Output :
-//-----------------------------------------------------------------------------
-static BOOL _CheckDuplicatePlanes(CMapSolid *pSolid, CListBox *pList)
-{
-	if ( !IsCheckVisible( pSolid ) )
-		return TRUE;
-
-	if (DoesContainDuplicates(pSolid))
-	{
-		AddError(pList, ErrorDuplicatePlanes, 0, pSolid);
-	}
-
-	return(TRUE);
-}
-
-
-static void CheckDuplicatePlanes(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckDuplicatePlanes, pList, MAPCLASS_TYPE(CMapSolid));
-}
-
-
-struct FindDuplicateFaceIDs_t
-{
-	CMapFaceList All;					// Collects all the face IDs in this map.
-	CMapFaceList Duplicates;			// Collects the duplicate face IDs in this map.
-};
-
-
-//-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pSolid -
-//			pData -
-// Output : Returns TRUE to continue enumerating.
-//-----------------------------------------------------------------------------
-static BOOL _CheckDuplicateFaceIDs(CMapSolid *pSolid, FindDuplicateFaceIDs_t *pData)
-{
-	if ( !IsCheckVisible( pSolid ) )
-		return TRUE;
-
-	int nFaceCount = pSolid->GetFaceCount();
-	for (int i = 0; i < nFaceCount; i++)
-	{
-		CMapFace *pFace = pSolid->GetFace(i);
-		if (pData->All.FindFaceID(pFace->GetFaceID()) != -1)
-		{
-			if (pData->Duplicates.FindFaceID(pFace->GetFaceID()) != -1)
-			{
-				pData->Duplicates.AddToTail(pFace);
-			}
-		}
-		else
-		{
-			pData->All.AddToTail(pFace);
-		}
-	}
-
-	return(TRUE);
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Reports errors for all faces with duplicate face IDs.
-// Input  : pList -
-//			pWorld -
-//-----------------------------------------------------------------------------
-static void CheckDuplicateFaceIDs(CListBox *pList, CMapWorld *pWorld)
-{
-	FindDuplicateFaceIDs_t Lists;
-	Lists.All.SetGrowSize(128);
-	Lists.Duplicates.SetGrowSize(128);
-
-	pWorld->EnumChildren(_CheckDuplicateFaceIDs, &Lists, MAPCLASS_TYPE(CMapSolid));
-
-	for (int i = 0; i < Lists.Duplicates.Count(); i++)
-	{
-		CMapFace *pFace = Lists.Duplicates.Element(i);
-		AddError(pList, ErrorDuplicateFaceIDs, (DWORD)pFace, (CMapSolid *)pFace->GetParent());
-	}
-}
-
-
-//-----------------------------------------------------------------------------
-// Checks if a particular target is valid.
-//-----------------------------------------------------------------------------
-static void CheckValidTarget(CMapEntity *pEntity, const char *pFieldName, const char *pTargetName, CListBox *pList, bool bCheckClassNames)
-{
-	if (!pTargetName)
-		return;
-
-	// These procedural names are always assumed to exist.
-	if (!stricmp(pTargetName, "!activator") || !stricmp(pTargetName, "!caller") || !stricmp(pTargetName, "!player") || !stricmp(pTargetName, "!self"))
-		return;
-
-	CMapDoc *pDoc = CMapDoc::GetActiveMapDoc();
-
-	// Search by name first.
-	CMapEntityList Found;
-	bool bFound = pDoc->FindEntitiesByName(Found, pTargetName, (Options.general.bCheckVisibleMapErrors == TRUE));
-	if (!bFound && bCheckClassNames)
-	{
-		// Not found, search by classname.
-		bFound = pDoc->FindEntitiesByClassName(Found, pTargetName, (Options.general.bCheckVisibleMapErrors == TRUE));
-	}
-
-	if (!bFound)
-	{
-		// No dice, flag it as an error.
-		AddError(pList, ErrorMissingTarget, (DWORD)pFieldName, pEntity);
-	}
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Checks the given entity for references by name to nonexistent entities.
-// Input  : pEntity -
-//			pList -
-// Output : Returns TRUE to keep enumerating.
-//-----------------------------------------------------------------------------
-static BOOL _CheckMissingTargets(CMapEntity *pEntity, CListBox *pList)
-{
-	if ( !IsCheckVisible( pEntity ) )
-		return TRUE;
-
-	GDclass *pClass = pEntity->GetClass();
-	if (!pClass)
-	{
-		// Unknown class -- just check for target references.
-		constexpr const char *pszTarget = "target";
-		const char *pszValue = pEntity->GetKeyValue(pszTarget);
-		CheckValidTarget(pEntity, pszTarget, pszValue, pList, false);
-	}
-	else
-	{
-		// Known class -- check all target_destination and target_name_or_class keyvalues.
-		for (int i = 0; i < pClass->GetVariableCount(); i++)
-		{
-			GDinputvariable *pVar = pClass->GetVariableAt(i);
-			if ((pVar->GetType() != ivTargetDest) && (pVar->GetType() != ivTargetNameOrClass))
-				continue;
-
-			const char *pszValue = pEntity->GetKeyValue(pVar->GetName());
-			CheckValidTarget(pEntity, pVar->GetName(), pszValue, pList, (pVar->GetType() == ivTargetNameOrClass));
-		}
-	}
-
-	return TRUE;
-}
-
-
-static void CheckMissingTargets(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckMissingTargets, pList, MAPCLASS_TYPE(CMapEntity));
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Determines whether a solid is good or bad.
-// Input  : pSolid - Solid to check.
-//			pList - List box into which to place errors.
-// Output : Always returns TRUE to continue enumerating.
-//-----------------------------------------------------------------------------
-static BOOL _CheckSolidIntegrity(CMapSolid *pSolid, CListBox *pList)
-{
-	if ( !IsCheckVisible( pSolid ) )
-		return TRUE;
-
-	CCheckFaceInfo cfi;
-	int nFaces = pSolid->GetFaceCount();
-	for (int i = 0; i < nFaces; i++)
-	{
-		CMapFace *pFace = pSolid->GetFace(i);
-
-		//
-		// Reset the iPoint member so results from previous faces don't carry over.
-		//
-		cfi.iPoint = -1;
-
-		//
-		// Check the face.
-		//
-		if (!pFace->CheckFace(&cfi))
-		{
-			AddError(pList, ErrorSolidStructure, 0, pSolid);
-			break;
-		}
-	}
-
-	return(TRUE);
-}
-
-
-static void CheckSolidIntegrity(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckSolidIntegrity, pList, MAPCLASS_TYPE(CMapSolid));
-}
-
-//-----------------------------------------------------------------------------
-// Purpose: Determines if there are any invalid textures or texture axes on any
-//			face of this solid. Adds an error message to the list box for each
-//			error found.
-// Input  : pSolid - Solid to check.
-//			pList - Pointer to the error list box.
-// Output : Returns TRUE.
-//-----------------------------------------------------------------------------
-static BOOL _CheckInvalidTextures(CMapSolid *pSolid, CListBox *pList)
-{
-	if ( !IsCheckVisible( pSolid ) )
-		return TRUE;
-
-	int nFaces = pSolid->GetFaceCount();
-	for(int i = 0; i < nFaces; i++)
-	{
-		const CMapFace *pFace = pSolid->GetFace(i);
-
-		IEditorTexture *pTex = pFace->GetTexture();
-		if (pTex->IsDummy())
-		{
-			AddError(pList, ErrorInvalidTexture, (DWORD)pFace->texture.texture, pSolid);
-			return TRUE;
-		}
-
-		if (!pFace->IsTextureAxisValid())
-		{
-			AddError(pList, ErrorInvalidTextureAxes, i, pSolid);
-			return(TRUE);
-		}
-	}
-
-	return(TRUE);
-}
-
-
-static void CheckInvalidTextures(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckInvalidTextures, pList, MAPCLASS_TYPE(CMapSolid));
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pEntity -
-//			pList -
-// Output :
-//-----------------------------------------------------------------------------
-static BOOL _CheckUnusedKeyvalues(CMapEntity *pEntity, CListBox *pList)
-{
-	if ( !IsCheckVisible( pEntity ) )
-		return TRUE;
-
-	if (!pEntity->IsClass() || pEntity->IsClass("multi_manager"))
-	{
-		return(TRUE);	// can't check if no class associated
-	}
-
-	GDclass *pClass = pEntity->GetClass();
-
-	for (int i = pEntity->GetFirstKeyValue(); i != pEntity->GetInvalidKeyValue(); i=pEntity->GetNextKeyValue( i ) )
-	{
-		if (pClass->VarForName(pEntity->GetKey(i)) == NULL)
-		{
-			AddError(pList, ErrorUnusedKeyvalues, (DWORD)pEntity->GetKey(i), pEntity);
-			return(TRUE);
-		}
-	}
-
-	return(TRUE);
-}
-
-
-static void CheckUnusedKeyvalues(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckUnusedKeyvalues, pList, MAPCLASS_TYPE(CMapEntity));
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pEntity -
-//			pList -
-// Output :
-//-----------------------------------------------------------------------------
-static BOOL _CheckEmptyEntities(CMapEntity *pEntity, CListBox *pList)
-{
-	if ( !IsCheckVisible( pEntity ) )
-		return TRUE;
-
-	if(!pEntity->IsPlaceholder() && !pEntity->GetChildCount())
-	{
-		AddError(pList, ErrorEmptyEntity, (DWORD)pEntity->GetClassName(), pEntity);
-	}
-
-	return(TRUE);
-}
-
-
-static void CheckEmptyEntities(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckEmptyEntities, pList, MAPCLASS_TYPE(CMapEntity));
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Checks the entity for bad I/O connections.
-// Input  : pEntity - the entity to check
-//			pList - list box that tracks the errors
-// Output : Returns TRUE to keep enumerating.
-//-----------------------------------------------------------------------------
-static BOOL _CheckBadConnections(CMapEntity *pEntity, CListBox *pList)
-{
-	if ( !IsCheckVisible( pEntity ) )
-		return TRUE;
-
-	if (CEntityConnection::ValidateOutputConnections(pEntity, (Options.general.bCheckVisibleMapErrors == TRUE)) == CONNECTION_BAD)
-	{
-		AddError(pList, ErrorBadConnections, (DWORD)pEntity->GetClassName(), pEntity);
-	}
-
-	// TODO: Check for a "Kill" input with the same output, target, and delay as another input. This
-	//		 creates a race condition in the game where the order of arrival is not guaranteed
-	//int nConnCount = pEntity->Connections_GetCount();
-	//for (int i = 0; i < nConnCount; i++)
-	//{
-	//	CEntityConnection *pConn = pEntity->Connections_Get(i);
-	//	if (!stricmp(pConn->GetInputName(), "kill"))
-	//	{
-	//	}
-	//}
-
-	return TRUE;
-}
-
-
-static void CheckBadConnections(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildren(_CheckBadConnections, pList, MAPCLASS_TYPE(CMapEntity));
-}
-
-
-static bool HasVisGroupHiddenChildren(CMapClass *pObject)
-{
-	const CMapObjectList *pChildren = pObject->GetChildren();
-
-	FOR_EACH_OBJ( *pChildren, pos )
-	{
-		if (!pChildren->Element(pos)->IsVisGroupShown())
-			return true;
-	}
-
-	return false;
-}
-
-
-static bool HasVisGroupShownChildren(CMapClass *pObject)
-{
-	const CMapObjectList *pChildren = pObject->GetChildren();
-	FOR_EACH_OBJ( *pChildren, pos )
-	{
-		if (pChildren->Element(pos)->IsVisGroupShown())
-			return true;
-	}
-
-	return false;
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: Makes sure that the visgroup assignments are valid.
-//-----------------------------------------------------------------------------
-static BOOL _CheckVisGroups(CMapClass *pObject, CListBox *pList)
-{
-	CMapDoc *pDoc = CMapDoc::GetActiveMapDoc();
-
-	// dvs: FIXME: not working yet, revisit
-	// Entities cannot have hidden children.
-	//CMapEntity *pEntity = dynamic_cast<CMapEntity *>(pObject);
-	//if (pEntity && HasVisGroupHiddenChildren(pEntity))
-	//{
-	//	AddError(pList, ErrorHiddenChildOfEntity, 0, pEntity);
-	//	return TRUE;
-	//}
-
-	// Check the validity of any object that claims to be hidden by visgroups.
-	if (!pObject->IsVisGroupShown())
-	{
-		// Groups cannot be hidden by visgroups.
-		if (pObject->IsGroup())
-		{
-			bool bHidden = HasVisGroupHiddenChildren(pObject);
-			bool bVisible = HasVisGroupShownChildren(pObject);
-
-			if (bHidden && !bVisible)
-			{
-				AddError(pList, ErrorHiddenGroupHiddenChildren, 0, pObject);
-			}
-			else if (!bHidden && bVisible)
-			{
-				AddError(pList, ErrorHiddenGroupVisibleChildren, 0, pObject);
-			}
-			else
-			{
-				AddError(pList, ErrorHiddenGroupMixedChildren, 0, pObject);
-			}
-
-			return TRUE;
-		}
-
-		// Check for unanticipated objects that are hidden but forbidden from visgroup membership.
-		if (!pDoc->VisGroups_ObjectCanBelongToVisGroup(pObject))
-		{
-			AddError(pList, ErrorIllegallyHiddenObject, 0, pObject);
-			return TRUE;
-		}
-
-		// Hidden objects must belong to at least one visgroup.
-		if (pObject->GetVisGroupCount() == 0)
-		{
-			AddError(pList, ErrorHiddenObjectNoVisGroup, 0, pObject);
-			return TRUE;
-		}
-	}
-
-	return TRUE;
-}
-
-
-static void CheckVisGroups(CListBox *pList, CMapWorld *pWorld)
-{
-	pWorld->EnumChildrenRecurseGroupsOnly(_CheckVisGroups, pList);
-}
-
-//-----------------------------------------------------------------------------
-// Purpose:
-//-----------------------------------------------------------------------------
-static BOOL _CheckOverlayFaceList( CMapEntity *pEntity, CListBox *pList )
-{
-	if ( !IsCheckVisible( pEntity ) )
-		return TRUE;
-
-	const CMapObjectList *pChildren = pEntity->GetChildren();
-
-	FOR_EACH_OBJ( *pChildren, pos )
-	{
-		CMapOverlay *pOverlay = dynamic_cast<CMapOverlay*>( pChildren->Element(pos) );
-		if ( pOverlay )
-		{
-			// Check to see if the overlay has assigned faces.
-			if ( pOverlay->GetFaceCount() <= 0 )
-			{
-				AddError( pList, ErrorOverlayFaceList, 0, pEntity );
-				return TRUE;
-			}
-		}
-	}
-
-	return TRUE;
-}
-
-//-----------------------------------------------------------------------------
-// Purpose:
-//-----------------------------------------------------------------------------
-static void CheckOverlayFaceList( CListBox *pList, CMapWorld *pWorld )
-{
-	pWorld->EnumChildren( _CheckOverlayFaceList, pList, MAPCLASS_TYPE( CMapEntity ));
-}
-
 //
 // ** FIX FUNCTIONS
 //
@@ -1469,11 +723,11 @@ static void FixInvalidTextureAxes(MapError *pError)
 //-----------------------------------------------------------------------------
 // Purpose: Fixes duplicate face IDs by assigning the face a unique ID within
 //			the world.
-// Input  : pError - Holds the world and the face that is in error.
+// Input  : pError - Holds the solid and the face that is in error.
 //-----------------------------------------------------------------------------
 static void FixDuplicateFaceIDs(MapError *pError)
 {
-	CMapWorld *pWorld = (CMapWorld *)pError->pObjects[0];
+	CMapWorld *pWorld = GetActiveWorld();
 	CMapFace *pFace = (CMapFace *)pError->dwExtra;
 
 	pFace->SetFaceID(pWorld->FaceID_GetNext());
@@ -1497,7 +751,7 @@ static void FixUnusedKeyvalues(MapError *pError)
 	for ( int i=pEntity->GetFirstKeyValue(); i != pEntity->GetInvalidKeyValue(); i = iNext )
 	{
 		iNext = pEntity->GetNextKeyValue( i );
-		if (pClass->VarForName(pEntity->GetKey(i)) == NULL)
+		if (pEntity->GetKeyVariable(i) == NULL)
 		{
 			pEntity->DeleteKeyValue(pEntity->GetKey(i));
 		}
@@ -1644,31 +898,17 @@ void FixHiddenObject(MapError *pError)
 //-----------------------------------------------------------------------------
 bool CMapCheckDlg::DoCheck(void)
 {
-	CMapWorld *pWorld = GetActiveWorld();
-
 	// Clear error list
 	KillErrorList();
 
-	// Map validation
-	CheckRequirements(&m_Errors, pWorld);
-
-	// Solid validation
-	CheckMixedFaces(&m_Errors, pWorld);
-	//CheckDuplicatePlanes(&m_Errors, pWorld);
-	CheckDuplicateFaceIDs(&m_Errors, pWorld);
-	CheckDuplicateNodeIDs(&m_Errors, pWorld);
-	CheckSolidIntegrity(&m_Errors, pWorld);
-	CheckInvalidTextures(&m_Errors, pWorld);
-
-	// Entity validation
-	CheckUnusedKeyvalues(&m_Errors, pWorld);
-	CheckEmptyEntities(&m_Errors, pWorld);
-	CheckMissingTargets(&m_Errors, pWorld);
-	CheckBadConnections(&m_Errors, pWorld);
-
-	CheckVisGroups(&m_Errors, pWorld);
-
-	CheckOverlayFaceList(&m_Errors, pWorld);
+	// The checker is kept across checks so objects that haven't changed since
+	// the last check aren't checked again.
+	static CMapChecker s_MapChecker;
+	int nErrors = s_MapChecker.Run(CMapDoc::GetActiveMapDoc(), (Options.general.bCheckVisibleMapErrors == TRUE));
+	for (int i = 0; i < nErrors; i++)
+	{
+		AddError(&m_Errors, s_MapChecker.GetError(i));
+	}
 
 	if (!m_Errors.GetCount())
 	{
@@ -0,0 +1,989 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Finds problems in a map for Check for Problems and for the
+//			-mapcheck command line switch.
+//
+//			Everything that depends on more than one object (node IDs, face
+//			IDs, targets and connections) is looked up in indices built once
+//			per run. The checks of each object are then independent of one
+//			another and are run on a thread pool.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "stdafx.h"
+#include "mapchecker.h"
+#include "entityconnection.h"
+#include "gameconfig.h"
+#include "hammer.h"
+#include "mapdoc.h"
+#include "mapentity.h"
+#include "mapoverlay.h"
+#include "mapsolid.h"
+#include "mapworld.h"
+#include "visgroup.h"
+#include "fgdlib/gamedata.h"
+#include "filesystem.h"
+#include "tier1/fmtstr.h"
+#include "tier1/generichash.h"
+#include "vstdlib/jobthread.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+
+// ********
+// NOTE: Make sure the order matches MapErrorType in mapchecker.h!
+// ********
+constexpr struct
+{
+	int	m_StrResourceID;
+	int m_DescriptionResourceID;
+} g_MapErrorStrings[] =
+{
+	{IDS_NOPLAYERSTART,					IDS_NOPLAYERSTART_DESC},
+	{IDS_MIXEDFACES,					IDS_MIXEDFACES_DESC},
+	{IDS_DUPLICATEPLANES,				IDS_DUPLICATEPLANES_DESC},
+	{IDS_UNMATCHEDTARGET,				IDS_UNMATCHEDTARGET_DESC},
+	{IDS_INVALIDTEXTURE,				IDS_INVALIDTEXTURE_DESC},
+	{IDS_SOLIDSTRUCTURE,				IDS_SOLIDSTRUCTURE_DESC},
+	{IDS_UNUSEDKEYVALUES,				IDS_UNUSEDKEYVALUES_DESC},
+	{IDS_EMPTYENTITY,					IDS_EMPTYENTITY_DESC},
+	{IDS_DUPLICATEKEYS,					IDS_DUPLICATEKEYS_DESC},
+	{IDS_SOLIDCONTENT,					IDS_SOLIDCONTENT_DESC},
+	{IDS_INVALIDTEXTUREAXES,			IDS_INVALIDTEXTUREAXES_DESC},
+	{IDS_DUPLICATEFACEID,				IDS_DUPLICATEFACEID_DESC},
+	{IDS_DUPLICATE_NODE_ID,				IDS_DUPLICATE_NODE_ID_DESC},
+	{IDS_BAD_CONNECTIONS,				IDS_BAD_CONNECTIONS_DESC},
+	{IDS_HIDDEN_GROUP_HIDDEN_CHILDREN,	IDS_HIDDEN_GROUP_HIDDEN_CHILDREN_DESC},
+	{IDS_HIDDEN_GROUP_VISIBLE_CHILDREN, IDS_HIDDEN_GROUP_VISIBLE_CHILDREN_DESC},
+	{IDS_HIDDEN_GROUP_MIXED_CHILDREN,	IDS_HIDDEN_GROUP_MIXED_CHILDREN_DESC},
+	{IDS_HIDDEN_NO_VISGROUP,			IDS_HIDDEN_NO_VISGROUP_DESC},
+	{IDS_HIDDEN_CHILD_OF_ENTITY,		IDS_HIDDEN_CHILD_OF_ENTITY_DESC},
+	{IDS_HIDDEN_ILLEGALLY,				IDS_HIDDEN_ILLEGALLY_DESC},
+	{IDS_KILL_INPUT_RACE_CONDITION,		IDS_KILL_INPUT_RACE_CONDITION_DESC},
+	{IDS_BAD_OVERLAY,					IDS_DAB_OVERLAY_DESC}
+};
+
+
+//
+// The errors found by looking at a single object, which are kept from one run
+// to the next, in the order they are reported.
+//
+static const MapErrorType g_ObjectErrors[] =
+{
+	ErrorMixedFace,
+	ErrorSolidStructure,
+	ErrorInvalidTexture,
+	ErrorInvalidTextureAxes,
+	ErrorUnusedKeyvalues,
+	ErrorEmptyEntity,
+	ErrorOverlayFaceList,
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the name is one of the procedural names that are
+//			always assumed to exist.
+//-----------------------------------------------------------------------------
+static bool IsProceduralTargetName(const char *pszName)
+{
+	return (!stricmp(pszName, "!activator") || !stricmp(pszName, "!caller") || !stricmp(pszName, "!player") || !stricmp(pszName, "!self"));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor.
+//-----------------------------------------------------------------------------
+CMapChecker::CMapChecker(void)
+{
+	m_pDoc = NULL;
+	m_pWorld = NULL;
+	m_bVisibleOnly = false;
+	m_bCacheVisibleOnly = false;
+	m_nCheckedObjects = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Destructor.
+//-----------------------------------------------------------------------------
+CMapChecker::~CMapChecker(void)
+{
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Forgets the results kept from the last run, so that the next run
+//			checks every object.
+//-----------------------------------------------------------------------------
+void CMapChecker::FlushCache(void)
+{
+	m_Cache.RemoveAll();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Visibility check, as set up for this run.
+//-----------------------------------------------------------------------------
+inline bool CMapChecker::IsCheckVisible(CMapClass *pObject)
+{
+	return !m_bVisibleOnly || pObject->IsVisible();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks the document's world for problems.
+// Input  : pDoc - Document to check.
+//			bVisibleOnly - Whether to skip objects that are hidden.
+// Output : Returns the number of errors found.
+//-----------------------------------------------------------------------------
+int CMapChecker::Run(CMapDoc *pDoc, bool bVisibleOnly)
+{
+	m_pDoc = pDoc;
+	m_pWorld = pDoc->GetMapWorld();
+	m_bVisibleOnly = bVisibleOnly;
+	m_Errors.RemoveAll();
+
+	if (m_bCacheVisibleOnly != bVisibleOnly)
+	{
+		FlushCache();
+		m_bCacheVisibleOnly = bVisibleOnly;
+	}
+
+	GatherObjects(m_pWorld);
+	BuildConnectionIndex();
+
+	// The workers look up names through the world's indices and keys through the
+	// classes' variable indexes, neither of which may be rebuilt under them.
+	m_pWorld->EntityIndex_Prepare();
+	if (pGD != NULL)
+	{
+		pGD->PrepareVariableIndexes();
+	}
+
+	//
+	// Small maps aren't worth starting threads for.
+	//
+	const int nMinItemsForThreads = 512;
+	if (m_Items.Count() >= nMinItemsForThreads)
+	{
+		IThreadPool *pThreadPool = CreateThreadPool();
+
+		const CPUInformation *pCPUInfo = GetCPUInformation();
+		ThreadPoolStartParams_t startParams;
+		startParams.nThreads = Clamp(pCPUInfo->m_nLogicalProcessors - 1, 1, TP_MAX_POOL_THREADS);
+		pThreadPool->Start(startParams, "hammer_mapcheck");
+
+		ParallelProcess("CheckItem", pThreadPool, m_Items.Base(), m_Items.Count(), this, &CMapChecker::CheckItem);
+		ParallelProcess("CheckConnectionTarget", pThreadPool, m_ConnectionTargets.Base(), m_ConnectionTargets.Count(), this, &CMapChecker::CheckConnectionTarget);
+
+		pThreadPool->Stop();
+		DestroyThreadPool(pThreadPool);
+	}
+	else
+	{
+		for (int i = 0; i < m_Items.Count(); i++)
+		{
+			CheckItem(m_Items[i]);
+		}
+
+		for (int i = 0; i < m_ConnectionTargets.Count(); i++)
+		{
+			CheckConnectionTarget(m_ConnectionTargets[i]);
+		}
+	}
+
+	//
+	// An entity has bad connections if any of them goes to a target that
+	// doesn't exist or doesn't have the input.
+	//
+	for (int i = 0; i < m_Connections.Count(); i++)
+	{
+		if (!m_ConnectionTargets[m_ConnectionTargetIndex[i]].m_bValid)
+		{
+			m_Items[m_Connections[i].m_nItem].m_bBadConnection = true;
+		}
+	}
+
+	//
+	// Keep this run's results for the next one. Objects that were deleted or
+	// hidden since drop out.
+	//
+	m_Cache.RemoveAll();
+	m_nCheckedObjects = 0;
+	for (int i = 0; i < m_Items.Count(); i++)
+	{
+		m_Cache.Insert(m_Items[i].m_pObject, m_Items[i].m_Result);
+		if (!m_Items[i].m_bCached)
+		{
+			m_nCheckedObjects++;
+		}
+	}
+
+	AddErrors();
+	CheckVisGroups(pDoc, m_pWorld);
+
+	// Don't hold on to pointers into the map between runs.
+	m_Items.RemoveAll();
+	m_Connections.RemoveAll();
+	m_ConnectionTargets.RemoveAll();
+	m_ConnectionTargetIndex.RemoveAll();
+
+	return m_Errors.Count();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Collects the solids and entities to check in a single walk of the
+//			world, and picks up what the last run found for each of them.
+//-----------------------------------------------------------------------------
+void CMapChecker::GatherObjects(CMapWorld *pWorld)
+{
+	m_Items.RemoveAll();
+
+	EnumChildrenPos_t pos;
+	CMapClass *pChild = pWorld->GetFirstDescendent(pos);
+	while (pChild != NULL)
+	{
+		bool bSolid = pChild->IsMapClass(MAPCLASS_TYPE(CMapSolid));
+		bool bEntity = !bSolid && pChild->IsMapClass(MAPCLASS_TYPE(CMapEntity));
+
+		if ((bSolid || bEntity) && IsCheckVisible(pChild))
+		{
+			CheckItem_t &Item = m_Items[m_Items.AddToTail()];
+			Item.m_pObject = pChild;
+			Item.m_pSolid = bSolid ? (CMapSolid *)pChild : NULL;
+			Item.m_pEntity = bEntity ? (CMapEntity *)pChild : NULL;
+			Item.m_bBadConnection = false;
+
+			UtlHashHandle_t h = m_Cache.Find(pChild);
+			Item.m_bCached = (h != m_Cache.InvalidHandle());
+			if (Item.m_bCached)
+			{
+				Item.m_Result = m_Cache[h];
+			}
+		}
+
+		pChild = pWorld->GetNextDescendent(pos);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Compares connections by target name, then input name.
+//-----------------------------------------------------------------------------
+int __cdecl CMapChecker::CompareConnectionTargets(const ConnectionRef_t *pRef1, const ConnectionRef_t *pRef2)
+{
+	int nCompare = stricmp(pRef1->m_pConnection->GetTargetName(), pRef2->m_pConnection->GetTargetName());
+	if (nCompare == 0)
+	{
+		nCompare = stricmp(pRef1->m_pConnection->GetInputName(), pRef2->m_pConnection->GetInputName());
+	}
+	return nCompare;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Groups the connections of all the entities being checked by target
+//			and input, so that each is only looked up once however many
+//			connections use it.
+//-----------------------------------------------------------------------------
+void CMapChecker::BuildConnectionIndex(void)
+{
+	m_Connections.RemoveAll();
+	m_ConnectionTargets.RemoveAll();
+	m_ConnectionTargetIndex.RemoveAll();
+
+	for (int i = 0; i < m_Items.Count(); i++)
+	{
+		CMapEntity *pEntity = m_Items[i].m_pEntity;
+		if (pEntity == NULL)
+		{
+			continue;
+		}
+
+		int nConnCount = pEntity->Connections_GetCount();
+		for (int j = 0; j < nConnCount; j++)
+		{
+			CEntityConnection *pConnection = pEntity->Connections_Get(j);
+			if (pConnection != NULL)
+			{
+				ConnectionRef_t &Ref = m_Connections[m_Connections.AddToTail()];
+				Ref.m_pConnection = pConnection;
+				Ref.m_nItem = i;
+			}
+		}
+	}
+
+	m_Connections.Sort(CompareConnectionTargets);
+
+	m_ConnectionTargetIndex.SetCount(m_Connections.Count());
+	for (int i = 0; i < m_Connections.Count(); i++)
+	{
+		if ((i == 0) || (CompareConnectionTargets(&m_Connections[i - 1], &m_Connections[i]) != 0))
+		{
+			ConnectionTarget_t &Target = m_ConnectionTargets[m_ConnectionTargets.AddToTail()];
+			Target.m_pszTarget = m_Connections[i].m_pConnection->GetTargetName();
+			Target.m_pszInput = m_Connections[i].m_pConnection->GetInputName();
+			Target.m_bValid = false;
+		}
+
+		m_ConnectionTargetIndex[i] = m_ConnectionTargets.Count() - 1;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs the checks of a single object. Called on the worker threads,
+//			so it must only read from the map.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckItem(CheckItem_t &Item)
+{
+	uint32 nSignature = Item.m_pSolid ? GetSolidSignature(Item.m_pSolid) : GetEntitySignature(Item.m_pEntity);
+
+	if (!Item.m_bCached || (Item.m_Result.m_nSignature != nSignature))
+	{
+		Item.m_bCached = false;
+		Item.m_Result.m_nSignature = nSignature;
+		Item.m_Result.m_nErrorFlags = 0;
+		Item.m_Result.m_nErrorIndex = -1;
+
+		if (Item.m_pSolid)
+		{
+			CheckSolid(Item.m_pSolid, Item.m_Result);
+		}
+		else
+		{
+			CheckEntity(Item.m_pEntity, Item.m_Result);
+		}
+	}
+
+	//
+	// Targets and connections depend on other entities, so they are checked
+	// every time.
+	//
+	if (Item.m_pEntity)
+	{
+		CheckEntityTargets(Item);
+
+		int nConnCount = Item.m_pEntity->Connections_GetCount();
+		for (int i = 0; i < nConnCount; i++)
+		{
+			CEntityConnection *pConnection = Item.m_pEntity->Connections_Get(i);
+			if ((pConnection != NULL) && !CEntityConnection::ValidateOutput(Item.m_pEntity, pConnection->GetOutputName()))
+			{
+				Item.m_bBadConnection = true;
+				break;
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns a hash of everything CheckSolid looks at.
+//-----------------------------------------------------------------------------
+uint32 CMapChecker::GetSolidSignature(CMapSolid *pSolid)
+{
+	int nFaces = pSolid->GetFaceCount();
+	uint32 nHash = MurmurHash2(&nFaces, sizeof(nFaces), 0);
+
+	for (int i = 0; i < nFaces; i++)
+	{
+		CMapFace *pFace = pSolid->GetFace(i);
+
+		bool bDummy = pFace->GetTexture()->IsDummy();
+		nHash = MurmurHash2(&bDummy, sizeof(bDummy), nHash);
+		nHash = MurmurHash2(pFace->texture.texture, V_strlen(pFace->texture.texture), nHash);
+		nHash = MurmurHash2(&pFace->texture.UAxis, sizeof(pFace->texture.UAxis), nHash);
+		nHash = MurmurHash2(&pFace->texture.VAxis, sizeof(pFace->texture.VAxis), nHash);
+		nHash = MurmurHash2(&pFace->plane, sizeof(pFace->plane), nHash);
+
+		int nPoints = pFace->GetPointCount();
+		nHash = MurmurHash2(&nPoints, sizeof(nPoints), nHash);
+		if (nPoints != 0)
+		{
+			nHash = MurmurHash2(pFace->Points, nPoints * sizeof(Vector), nHash);
+		}
+	}
+
+	return nHash;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns a hash of everything CheckEntity looks at.
+//-----------------------------------------------------------------------------
+uint32 CMapChecker::GetEntitySignature(CMapEntity *pEntity)
+{
+	GDclass *pClass = pEntity->GetClass();
+	int nGeneration = GameData::GetGeneration();
+	uint32 nHash = MurmurHash2(&pClass, sizeof(pClass), 0);
+	nHash = MurmurHash2(&nGeneration, sizeof(nGeneration), nHash);
+	nHash = MurmurHash2(pEntity->GetClassName(), V_strlen(pEntity->GetClassName()), nHash);
+
+	for (int i = pEntity->GetFirstKeyValue(); i != pEntity->GetInvalidKeyValue(); i = pEntity->GetNextKeyValue(i))
+	{
+		const char *pszKey = pEntity->GetKey(i);
+		nHash = MurmurHash2(&i, sizeof(i), nHash);
+		nHash = MurmurHash2(pszKey, V_strlen(pszKey), nHash);
+	}
+
+	const CMapObjectList *pChildren = pEntity->GetChildren();
+	int nChildren = pChildren->Count();
+	nHash = MurmurHash2(&nChildren, sizeof(nChildren), nHash);
+
+	FOR_EACH_OBJ(*pChildren, pos)
+	{
+		CMapOverlay *pOverlay = dynamic_cast<CMapOverlay *>(pChildren->Element(pos));
+		if (pOverlay)
+		{
+			int nFaces = pOverlay->GetFaceCount();
+			nHash = MurmurHash2(&nFaces, sizeof(nFaces), nHash);
+		}
+	}
+
+	return nHash;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks a solid for mixed faces, bad structure and invalid textures.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckSolid(CMapSolid *pSolid, ObjectResult_t &Result)
+{
+	int nFaces = pSolid->GetFaceCount();
+
+	//
+	// Faces must either all be liquid or all be solid.
+	//
+	int iSolid = 2;	// start off ambivalent
+	for (int i = 0; i < nFaces; i++)
+	{
+		char ch = pSolid->GetFace(i)->texture.texture[0];
+		if ((ch == '*' && iSolid == 1) || (ch != '*' && iSolid == 0))
+		{
+			Result.m_nErrorFlags |= (1 << ErrorMixedFace);
+			break;
+		}
+
+		iSolid = (ch == '*') ? 0 : 1;
+	}
+
+	CCheckFaceInfo cfi;
+	for (int i = 0; i < nFaces; i++)
+	{
+		//
+		// Reset the iPoint member so results from previous faces don't carry over.
+		//
+		cfi.iPoint = -1;
+
+		if (!pSolid->GetFace(i)->CheckFace(&cfi))
+		{
+			Result.m_nErrorFlags |= (1 << ErrorSolidStructure);
+			break;
+		}
+	}
+
+	for (int i = 0; i < nFaces; i++)
+	{
+		const CMapFace *pFace = pSolid->GetFace(i);
+
+		if (pFace->GetTexture()->IsDummy())
+		{
+			Result.m_nErrorFlags |= (1 << ErrorInvalidTexture);
+			Result.m_nErrorIndex = i;
+			break;
+		}
+
+		if (!pFace->IsTextureAxisValid())
+		{
+			Result.m_nErrorFlags |= (1 << ErrorInvalidTextureAxes);
+			Result.m_nErrorIndex = i;
+			break;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks an entity for unused keyvalues, emptiness and overlays that
+//			aren't on any faces.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckEntity(CMapEntity *pEntity, ObjectResult_t &Result)
+{
+	// can't check for unused keys if no class associated
+	if (pEntity->IsClass() && !pEntity->IsClass("multi_manager"))
+	{
+		for (int i = pEntity->GetFirstKeyValue(); i != pEntity->GetInvalidKeyValue(); i = pEntity->GetNextKeyValue(i))
+		{
+			if (pEntity->GetKeyVariable(i) == NULL)
+			{
+				Result.m_nErrorFlags |= (1 << ErrorUnusedKeyvalues);
+				Result.m_nErrorIndex = i;
+				break;
+			}
+		}
+	}
+
+	if (!pEntity->IsPlaceholder() && !pEntity->GetChildCount())
+	{
+		Result.m_nErrorFlags |= (1 << ErrorEmptyEntity);
+	}
+
+	const CMapObjectList *pChildren = pEntity->GetChildren();
+	FOR_EACH_OBJ(*pChildren, pos)
+	{
+		CMapOverlay *pOverlay = dynamic_cast<CMapOverlay *>(pChildren->Element(pos));
+		if (pOverlay && (pOverlay->GetFaceCount() <= 0))
+		{
+			Result.m_nErrorFlags |= (1 << ErrorOverlayFaceList);
+			break;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether an entity has the given name, or class name if
+//			bCheckClassNames is set.
+//-----------------------------------------------------------------------------
+bool CMapChecker::TargetExists(const char *pszTarget, bool bCheckClassNames)
+{
+	if (IsProceduralTargetName(pszTarget))
+	{
+		return true;
+	}
+
+	CUtlVector<CMapEntity *> Found;
+	if (m_pWorld->EnumEntitiesByName(Found, pszTarget, m_bVisibleOnly, false) != 0)
+	{
+		return true;
+	}
+
+	return bCheckClassNames && (m_pWorld->EnumEntitiesByClassName(Found, pszTarget, m_bVisibleOnly) != 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the target keyvalues of an entity that refer to entities
+//			that don't exist.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckEntityTargets(CheckItem_t &Item)
+{
+	Item.m_MissingTargets.RemoveAll();
+
+	CMapEntity *pEntity = Item.m_pEntity;
+	GDclass *pClass = pEntity->GetClass();
+	if (!pClass)
+	{
+		// Unknown class -- just check for target references.
+		static const char *pszTarget = "target";
+		const char *pszValue = pEntity->GetKeyValue(pszTarget);
+		if (pszValue && !TargetExists(pszValue, false))
+		{
+			Item.m_MissingTargets.AddToTail(pszTarget);
+		}
+		return;
+	}
+
+	// Known class -- check all target_destination and target_name_or_class keyvalues.
+	for (int i = 0; i < pClass->GetVariableCount(); i++)
+	{
+		GDinputvariable *pVar = pClass->GetVariableAt(i);
+		if ((pVar->GetType() != ivTargetDest) && (pVar->GetType() != ivTargetNameOrClass))
+			continue;
+
+		const char *pszValue = pEntity->GetKeyValue(pVar->GetName());
+		if (pszValue && !TargetExists(pszValue, (pVar->GetType() == ivTargetNameOrClass)))
+		{
+			Item.m_MissingTargets.AddToTail(pVar->GetName());
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks that a connection target exists and that the entities with
+//			that name have the input, as CEntityConnection::FindBadConnections
+//			does. Called on the worker threads.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckConnectionTarget(ConnectionTarget_t &Target)
+{
+	if (IsProceduralTargetName(Target.m_pszTarget))
+	{
+		Target.m_bValid = true;
+		return;
+	}
+
+	CUtlVector<CMapEntity *> Found;
+	if (m_pWorld->EnumEntitiesByName(Found, Target.m_pszTarget, m_bVisibleOnly, true) == 0)
+	{
+		Target.m_bValid = false;
+		return;
+	}
+
+	// The input is only looked for on visible entities, whatever the visibility setting.
+	Found.RemoveAll();
+	if (m_pWorld->EnumEntitiesByName(Found, Target.m_pszTarget, true, false) == 0)
+	{
+		Target.m_bValid = false;
+		return;
+	}
+
+	Target.m_bValid = true;
+	for (int i = 0; i < Found.Count(); i++)
+	{
+		GDclass *pClass = Found[i]->GetClass();
+		if ((pClass != NULL) && (pClass->FindInput(Target.m_pszInput) == NULL))
+		{
+			Target.m_bValid = false;
+			break;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds an error to the list.
+//-----------------------------------------------------------------------------
+void CMapChecker::AddError(MapErrorType eType, CMapClass *pObject, DWORD dwExtra)
+{
+	MapCheckError_t &Error = m_Errors[m_Errors.AddToTail()];
+	Error.m_eType = eType;
+	Error.m_pObject = pObject;
+	Error.m_dwExtra = dwExtra;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Makes sure there's a player start.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckPlayerStart(void)
+{
+	for (int i = 0; i < m_Items.Count(); i++)
+	{
+		CMapEntity *pEntity = m_Items[i].m_pEntity;
+		if (pEntity && pEntity->IsPlaceholder() && (V_strnicmp(pEntity->GetClassName(), "info_player_", 12) == 0))
+		{
+			return;
+		}
+	}
+
+	AddError(ErrorNoPlayerStart, NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reports every face that reuses the face ID of a face found before it.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckDuplicateFaceIDs(void)
+{
+	CUtlHashtable<int> FaceIDs;
+
+	for (int i = 0; i < m_Items.Count(); i++)
+	{
+		CMapSolid *pSolid = m_Items[i].m_pSolid;
+		if (pSolid == NULL)
+		{
+			continue;
+		}
+
+		int nFaceCount = pSolid->GetFaceCount();
+		for (int j = 0; j < nFaceCount; j++)
+		{
+			CMapFace *pFace = pSolid->GetFace(j);
+			if (FaceIDs.Find(pFace->GetFaceID()) != FaceIDs.InvalidHandle())
+			{
+				AddError(ErrorDuplicateFaceIDs, pSolid, (DWORD)pFace);
+			}
+			else
+			{
+				FaceIDs.Insert(pFace->GetFaceID());
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reports node entities that share their node ID with another node.
+//-----------------------------------------------------------------------------
+void CMapChecker::CheckDuplicateNodeIDs(void)
+{
+	CUtlHashtable<int, int> NodeCounts;
+
+	for (int i = 0; i < m_Items.Count(); i++)
+	{
+		CMapEntity *pEntity = m_Items[i].m_pEntity;
+		if (pEntity && pEntity->IsNodeClass())
+		{
+			int nNodeID = pEntity->GetNodeID();
+			if (nNodeID != 0)
+			{
+				UtlHashHandle_t h = NodeCounts.Find(nNodeID);
+				if (h != NodeCounts.InvalidHandle())
+				{
+					NodeCounts[h]++;
+				}
+				else
+				{
+					NodeCounts.Insert(nNodeID, 1);
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < m_Items.Count(); i++)
+	{
+		CMapEntity *pEntity = m_Items[i].m_pEntity;
+		if (pEntity && pEntity->IsNodeClass())
+		{
+			int nNodeID = pEntity->GetNodeID();
+			if ((nNodeID != 0) && (NodeCounts[NodeCounts.Find(nNodeID)] > 1))
+			{
+				AddError(ErrorDuplicateNodeIDs, pEntity, (DWORD)m_pWorld);
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Makes sure that the visgroup assignments are valid.
+//-----------------------------------------------------------------------------
+BOOL CMapChecker::CheckVisGroupsCallback(CMapClass *pObject, CMapChecker *pChecker)
+{
+	// Check the validity of any object that claims to be hidden by visgroups.
+	if (pObject->IsVisGroupShown())
+	{
+		return TRUE;
+	}
+
+	// Groups cannot be hidden by visgroups.
+	if (pObject->IsGroup())
+	{
+		bool bHidden = false;
+		bool bVisible = false;
+
+		const CMapObjectList *pChildren = pObject->GetChildren();
+		FOR_EACH_OBJ(*pChildren, pos)
+		{
+			if (pChildren->Element(pos)->IsVisGroupShown())
+			{
+				bVisible = true;
+			}
+			else
+			{
+				bHidden = true;
+			}
+		}
+
+		if (bHidden && !bVisible)
+		{
+			pChecker->AddError(ErrorHiddenGroupHiddenChildren, pObject);
+		}
+		else if (!bHidden && bVisible)
+		{
+			pChecker->AddError(ErrorHiddenGroupVisibleChildren, pObject);
+		}
+		else
+		{
+			pChecker->AddError(ErrorHiddenGroupMixedChildren, pObject);
+		}
+
+		return TRUE;
+	}
+
+	// Check for unanticipated objects that are hidden but forbidden from visgroup membership.
+	if (!pChecker->m_pDoc->VisGroups_ObjectCanBelongToVisGroup(pObject))
+	{
+		pChecker->AddError(ErrorIllegallyHiddenObject, pObject);
+		return TRUE;
+	}
+
+	// Hidden objects must belong to at least one visgroup.
+	if (pObject->GetVisGroupCount() == 0)
+	{
+		pChecker->AddError(ErrorHiddenObjectNoVisGroup, pObject);
+	}
+
+	return TRUE;
+}
+
+
+void CMapChecker::CheckVisGroups(CMapDoc *pDoc, CMapWorld *pWorld)
+{
+	pWorld->EnumChildrenRecurseGroupsOnly(CheckVisGroupsCallback, this);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Turns the results of the object checks and the map-wide checks into
+//			the error list, in the order Check for Problems has always used.
+//-----------------------------------------------------------------------------
+void CMapChecker::AddErrors(void)
+{
+	CheckPlayerStart();
+
+	for (int nError = 0; nError < ARRAYSIZE(g_ObjectErrors); nError++)
+	{
+		MapErrorType eType = g_ObjectErrors[nError];
+
+		if (eType == ErrorSolidStructure)
+		{
+			// Reported between mixed faces and invalid textures, as before.
+			CheckDuplicateFaceIDs();
+			CheckDuplicateNodeIDs();
+		}
+
+		for (int i = 0; i < m_Items.Count(); i++)
+		{
+			const CheckItem_t &Item = m_Items[i];
+			if (!(Item.m_Result.m_nErrorFlags & (1 << eType)))
+			{
+				continue;
+			}
+
+			DWORD dwExtra = 0;
+			switch (eType)
+			{
+				case ErrorInvalidTexture:
+				{
+					dwExtra = (DWORD)Item.m_pSolid->GetFace(Item.m_Result.m_nErrorIndex)->texture.texture;
+					break;
+				}
+
+				case ErrorInvalidTextureAxes:
+				{
+					dwExtra = Item.m_Result.m_nErrorIndex;
+					break;
+				}
+
+				case ErrorUnusedKeyvalues:
+				{
+					dwExtra = (DWORD)Item.m_pEntity->GetKey(Item.m_Result.m_nErrorIndex);
+					break;
+				}
+
+				case ErrorEmptyEntity:
+				{
+					dwExtra = (DWORD)Item.m_pEntity->GetClassName();
+					break;
+				}
+			}
+
+			AddError(eType, Item.m_pObject, dwExtra);
+		}
+
+		if (eType == ErrorEmptyEntity)
+		{
+			for (int i = 0; i < m_Items.Count(); i++)
+			{
+				const CheckItem_t &Item = m_Items[i];
+				for (int j = 0; j < Item.m_MissingTargets.Count(); j++)
+				{
+					AddError(ErrorMissingTarget, Item.m_pObject, (DWORD)Item.m_MissingTargets[j]);
+				}
+			}
+
+			for (int i = 0; i < m_Items.Count(); i++)
+			{
+				const CheckItem_t &Item = m_Items[i];
+				if (Item.m_bBadConnection)
+				{
+					AddError(ErrorBadConnections, Item.m_pObject, (DWORD)Item.m_pEntity->GetClassName());
+				}
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the resource ID of the long description of an error type.
+//-----------------------------------------------------------------------------
+int CMapChecker::GetErrorDescriptionID(MapErrorType eType)
+{
+	int iErrorStr = clamp( (int)eType, 0, ARRAYSIZE( g_MapErrorStrings ) - 1 );
+	Assert( iErrorStr == (int)eType );
+	return g_MapErrorStrings[iErrorStr].m_DescriptionResourceID;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the one line summary of an error.
+//-----------------------------------------------------------------------------
+void CMapChecker::GetErrorText(const MapCheckError_t &Error, CString &str)
+{
+	// Figure out which error string we're using.
+	int iErrorStr = (int)Error.m_eType;
+	iErrorStr = clamp( iErrorStr, 0, ARRAYSIZE( g_MapErrorStrings ) - 1 );
+	Assert( iErrorStr == (int)Error.m_eType );
+
+	str.LoadString(g_MapErrorStrings[iErrorStr].m_StrResourceID);
+
+	if (str.Find('%') != -1)
+	{
+		if (Error.m_eType == ErrorUnusedKeyvalues)
+		{
+			// dwExtra has the name of the string in it
+			CString str2 = str;
+			CMapEntity *pEntity = (CMapEntity *)Error.m_pObject;
+			str.Format(str2, pEntity->GetClassName(), Error.m_dwExtra);
+		}
+		else
+		{
+			CString str2 = str;
+			str.Format(str2, Error.m_dwExtra);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads a map and writes its problems to <filename>_mapcheck.txt,
+//			one per line with the ID of the object in error.
+// Input  : pszFileName - Full path of the map to check.
+// Output : Returns the number of problems found, -1 if the map didn't load.
+//-----------------------------------------------------------------------------
+int CMapChecker::CheckMapFile(const char *pszFileName)
+{
+	CMapDoc *pDoc = dynamic_cast<CMapDoc *>(APP()->OpenDocumentFile(pszFileName));
+	if (pDoc == NULL)
+	{
+		Warning( "Map check: couldn't open %s\n", pszFileName );
+		return -1;
+	}
+
+	double flStartTime = Plat_FloatTime();
+
+	CMapChecker Checker;
+	int nErrors = Checker.Run(pDoc, false);
+
+	double flElapsed = Plat_FloatTime() - flStartTime;
+
+	FileHandle_t hFile = g_pFullFileSystem->Open( CFmtStr( "%s_mapcheck.txt", pszFileName ), "wt" );
+	for (int i = 0; i < nErrors; i++)
+	{
+		const MapCheckError_t &Error = Checker.GetError(i);
+
+		CString str;
+		GetErrorText(Error, str);
+
+		CFmtStr line( "%d: %s\n", Error.m_pObject ? Error.m_pObject->GetID() : 0, (const char *)str );
+		if ( hFile )
+		{
+			g_pFullFileSystem->Write( line.Access(), line.Length(), hFile );
+		}
+	}
+
+	if ( hFile )
+	{
+		g_pFullFileSystem->Close( hFile );
+	}
+
+	Msg( "Map check: %s, %d problems in %.1f ms\n", pszFileName, nErrors, flElapsed * 1000.0 );
+	return nErrors;
+}
@@ -0,0 +1,176 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Finds problems in a map for Check for Problems and for the
+//			-mapcheck command line switch. Has no user interface of its own.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef MAPCHECKER_H
+#define MAPCHECKER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier1/utlvector.h"
+#include "tier1/utlhashtable.h"
+
+class CMapClass;
+class CMapDoc;
+class CMapEntity;
+class CMapSolid;
+class CMapWorld;
+class CEntityConnection;
+
+
+// ********
+// NOTE: Make sure the order matches g_MapErrorStrings in mapchecker.cpp!
+// ********
+enum MapErrorType
+{
+	ErrorNoPlayerStart,
+	ErrorMixedFace,
+	ErrorDuplicatePlanes,
+	ErrorMissingTarget,
+	ErrorInvalidTexture,
+	ErrorSolidStructure,
+	ErrorUnusedKeyvalues,
+	ErrorEmptyEntity,
+	ErrorDuplicateKeys,
+	ErrorInvalidTextureAxes,
+	ErrorDuplicateFaceIDs,
+	ErrorDuplicateNodeIDs,
+	ErrorBadConnections,
+	ErrorHiddenGroupHiddenChildren,
+	ErrorHiddenGroupVisibleChildren,
+	ErrorHiddenGroupMixedChildren,
+	ErrorHiddenObjectNoVisGroup,
+	ErrorHiddenChildOfEntity,
+	ErrorIllegallyHiddenObject,
+	ErrorKillInputRaceCondition,
+	ErrorOverlayFaceList,
+};
+
+
+struct MapCheckError_t
+{
+	MapErrorType m_eType;
+	CMapClass *m_pObject;		// Object in error, NULL for ErrorNoPlayerStart.
+	DWORD m_dwExtra;			// Depends on the error type, see CMapCheckDlg.
+};
+
+
+class CMapChecker
+{
+	public:
+
+		CMapChecker(void);
+		~CMapChecker(void);
+
+		//
+		// Checks the document's world. Objects that haven't changed since the last
+		// run reuse the results of the checks that only look at the object itself.
+		// Returns the number of errors found.
+		//
+		int Run(CMapDoc *pDoc, bool bVisibleOnly);
+		void FlushCache(void);
+
+		inline int GetErrorCount(void) const { return(m_Errors.Count()); }
+		inline const MapCheckError_t &GetError(int nIndex) const { return(m_Errors[nIndex]); }
+
+		// Objects whose own checks were run, rather than reused, by the last Run.
+		inline int GetCheckedObjectCount(void) const { return(m_nCheckedObjects); }
+
+		static void GetErrorText(const MapCheckError_t &Error, CString &str);
+		static int GetErrorDescriptionID(MapErrorType eType);
+
+		// For -mapcheck: loads a map, writes its problems to <map>_mapcheck.txt.
+		static int CheckMapFile(const char *pszFileName);
+
+	protected:
+
+		//
+		// Results of the checks that only look at the object itself, kept from
+		// one run to the next.
+		//
+		struct ObjectResult_t
+		{
+			uint32 m_nSignature;		// Hash of everything these checks look at.
+			int m_nErrorFlags;			// One bit per MapErrorType found.
+			int m_nErrorIndex;			// Face for texture errors, keyvalue for ErrorUnusedKeyvalues.
+		};
+
+		//
+		// An object to check on the worker threads.
+		//
+		struct CheckItem_t
+		{
+			CMapClass *m_pObject;
+			CMapSolid *m_pSolid;		// Set if the object is a solid.
+			CMapEntity *m_pEntity;		// Set if the object is an entity.
+			ObjectResult_t m_Result;
+			bool m_bCached;				// Result came from the last run.
+			CUtlVector<const char *> m_MissingTargets;	// Target keys that match no entity.
+			bool m_bBadConnection;		// Has a connection with a bad output, target or input.
+		};
+
+		//
+		// Connections sorted by target and input, so each distinct target and input
+		// is only looked up once.
+		//
+		struct ConnectionRef_t
+		{
+			CEntityConnection *m_pConnection;
+			int m_nItem;				// Index of the source entity in m_Items.
+		};
+
+		struct ConnectionTarget_t
+		{
+			const char *m_pszTarget;
+			const char *m_pszInput;
+			bool m_bValid;
+		};
+
+		void GatherObjects(CMapWorld *pWorld);
+		void BuildConnectionIndex(void);
+		static int __cdecl CompareConnectionTargets(const ConnectionRef_t *pRef1, const ConnectionRef_t *pRef2);
+
+		void CheckItem(CheckItem_t &Item);
+		void CheckConnectionTarget(ConnectionTarget_t &Target);
+
+		uint32 GetSolidSignature(CMapSolid *pSolid);
+		uint32 GetEntitySignature(CMapEntity *pEntity);
+		void CheckSolid(CMapSolid *pSolid, ObjectResult_t &Result);
+		void CheckEntity(CMapEntity *pEntity, ObjectResult_t &Result);
+		void CheckEntityTargets(CheckItem_t &Item);
+		bool TargetExists(const char *pszTarget, bool bCheckClassNames);
+
+		void CheckPlayerStart(void);
+		void CheckDuplicateFaceIDs(void);
+		void CheckDuplicateNodeIDs(void);
+		void CheckVisGroups(CMapDoc *pDoc, CMapWorld *pWorld);
+		void AddErrors(void);
+
+		void AddError(MapErrorType eType, CMapClass *pObject, DWORD dwExtra = 0);
+		static BOOL CheckVisGroupsCallback(CMapClass *pObject, CMapChecker *pChecker);
+
+		inline bool IsCheckVisible(CMapClass *pObject);
+
+		CMapDoc *m_pDoc;
+		CMapWorld *m_pWorld;
+		bool m_bVisibleOnly;
+
+		CUtlVector<CheckItem_t> m_Items;
+		CUtlVector<ConnectionRef_t> m_Connections;
+		CUtlVector<ConnectionTarget_t> m_ConnectionTargets;
+		CUtlVector<int> m_ConnectionTargetIndex;	// Target of each entry in m_Connections.
+
+		CUtlHashtable<CMapClass *, ObjectResult_t, PointerHashFunctor> m_Cache;
+		bool m_bCacheVisibleOnly;					// The visible only setting the cache was made with.
+
+		CUtlVector<MapCheckError_t> m_Errors;
+		int m_nCheckedObjects;
+};
+
+
+#endif // MAPCHECKER_H
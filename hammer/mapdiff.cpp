@@ -0,0 +1,1107 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compares two map files object by object.
+//
+//			Each world solid and each entity becomes one object with two hashes:
+//			one of its contents, and one of its shape, which is the same but
+//			relative to the object's position. Faces, keys and the solids of an
+//			entity are hashed in sorted order so that the order they were
+//			written in doesn't matter. Objects are matched by ID first, then
+//			objects left over are matched by content hash and shape hash, so
+//			renumbered objects are still found.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "stdafx.h"
+#include "mapdiff.h"
+#include "filesystem.h"
+#include "tier1/fmtstr.h"
+#include "tier1/generichash.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utlhashtable.h"
+#include "vstdlib/jobthread.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+
+static const char *g_pszObjectTypeNames[] =
+{
+	"solid",
+	"entity",
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Rounds coordinates to 1/64 unit and directions to about 1/16000,
+//			so that values read back from different files compare reliably.
+//-----------------------------------------------------------------------------
+static inline int QuantizeCoord(float flValue)
+{
+	return (int)floor(flValue * 64.0f + 0.5f);
+}
+
+
+static inline int QuantizeUnit(float flValue)
+{
+	return (int)floor(flValue * 16384.0f + 0.5f);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the key used to match objects by ID.
+//-----------------------------------------------------------------------------
+static inline uint32 ObjectIDKey(const MapDiffObject_t &Object)
+{
+	return ((uint32)Object.m_nID << 1) | (uint32)Object.m_eType;
+}
+
+
+static int __cdecl CompareHashes(const uint32 *pHash1, const uint32 *pHash2)
+{
+	return (*pHash1 < *pHash2) ? -1 : (*pHash1 > *pHash2);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Hashes a list of hashes without regard to their order.
+//-----------------------------------------------------------------------------
+uint32 CMapDiff::HashSorted(CUtlVector<uint32> &Hashes, uint32 nSeed)
+{
+	int nCount = Hashes.Count();
+	nSeed = MurmurHash2(&nCount, sizeof(nCount), nSeed);
+	if (nCount == 0)
+	{
+		return(nSeed);
+	}
+
+	Hashes.Sort(CompareHashes);
+	return(MurmurHash2(Hashes.Base(), nCount * sizeof(uint32), nSeed));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads both files and compares them.
+// Input  : pszOldFileName - File to compare from.
+//			pszNewFileName - File to compare to.
+// Output : Returns false if either file couldn't be read.
+//-----------------------------------------------------------------------------
+bool CMapDiff::Run(const char *pszOldFileName, const char *pszNewFileName)
+{
+	const char *pszFileNames[2] = { pszOldFileName, pszNewFileName };
+	for (int i = 0; i < 2; i++)
+	{
+		m_Files[i].m_strFileName = pszFileNames[i];
+		m_Files[i].m_Objects.RemoveAll();
+		m_Files[i].m_strWorldKeys.Clear();
+		m_Files[i].m_strError.Clear();
+	}
+
+	//
+	// Read the old file on a worker thread while this thread reads the new one.
+	//
+	IThreadPool *pThreadPool = CreateThreadPool();
+
+	ThreadPoolStartParams_t startParams;
+	startParams.nThreads = 1;
+	pThreadPool->Start(startParams, "hammer_mapdiff");
+
+	CJobSetN<1> jobs;
+	jobs += pThreadPool->QueueCall(this, &CMapDiff::ReadFile, &m_Files[0]);
+	ReadFile(&m_Files[1]);
+	jobs.WaitForFinish(pThreadPool);
+
+	pThreadPool->Stop();
+	DestroyThreadPool(pThreadPool);
+
+	if (!m_Files[0].m_strError.IsEmpty() || !m_Files[1].m_strError.IsEmpty())
+	{
+		return(false);
+	}
+
+	Compare();
+	return(true);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns why Run failed.
+//-----------------------------------------------------------------------------
+const char *CMapDiff::GetError(void) const
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (!m_Files[i].m_strError.IsEmpty())
+		{
+			return(m_Files[i].m_strError.Get());
+		}
+	}
+
+	return("");
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the solids and entities of a file, keeping only their hashes
+//			and where they are in the file. Called on the worker thread.
+//-----------------------------------------------------------------------------
+void CMapDiff::ReadFile(MapDiffFile_t *pFile)
+{
+	CChunkFile File;
+	ChunkFileResult_t eResult = File.Open(pFile->m_strFileName, ChunkFile_Read);
+	if (eResult != ChunkFile_Ok)
+	{
+		pFile->m_strError.Format("%s: %s", pFile->m_strFileName.Get(), File.GetErrorText(eResult));
+		return;
+	}
+
+	ReadState_t State;
+	State.m_pFile = pFile;
+
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	for (;;)
+	{
+		int nStart = File.GetReadOffset();
+		eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType);
+		if (eResult != ChunkFile_Ok)
+		{
+			break;
+		}
+
+		if (eChunkType != ChunkType_Chunk)
+		{
+			continue;
+		}
+
+		if (!stricmp(szName, "world"))
+		{
+			eResult = ReadWorld(File, State, nStart);
+		}
+		else if (!stricmp(szName, "entity"))
+		{
+			eResult = ReadEntity(File, State, nStart);
+		}
+		else if (!stricmp(szName, "hidden"))
+		{
+			eResult = ReadHidden(File, State, false);
+		}
+		else
+		{
+			eResult = SkipChunk(File);
+		}
+
+		if (eResult != ChunkFile_Ok)
+		{
+			break;
+		}
+	}
+
+	if (eResult != ChunkFile_EOF)
+	{
+		pFile->m_strError.Format("%s: %s", pFile->m_strFileName.Get(), File.GetErrorText(eResult));
+	}
+
+	File.Close();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Skips the rest of the current chunk and everything in it.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::SkipChunk(CChunkFile &File)
+{
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	while ((eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+	{
+		if (eChunkType == ChunkType_Chunk)
+		{
+			eResult = SkipChunk(File);
+			if (eResult != ChunkFile_Ok)
+			{
+				return(eResult);
+			}
+		}
+	}
+
+	return((eResult == ChunkFile_EndOfChunk) ? ChunkFile_Ok : eResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds a key of the entity being read to its hashes.
+// Input  : bShape - Whether the key is part of the entity's shape as well as
+//				its contents.
+//-----------------------------------------------------------------------------
+void CMapDiff::AddKeyHash(ReadState_t &State, const char *pszKey, const char *pszValue, bool bShape)
+{
+	uint32 nHash = MurmurHash2LowerCase(pszKey, 0);
+	nHash = MurmurHash2(pszValue, V_strlen(pszValue), nHash);
+
+	State.m_KeyHashes.AddToTail(nHash);
+	if (bShape)
+	{
+		State.m_ShapeKeyHashes.AddToTail(nHash);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the world chunk. The world's solids each become an object, the
+//			world's own keys become an entity object.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::ReadWorld(CChunkFile &File, ReadState_t &State, int nStart)
+{
+	MapDiffFile_t *pFile = State.m_pFile;
+
+	MapDiffObject_t &World = pFile->m_Objects[pFile->m_Objects.AddToTail()];
+	int nWorld = pFile->m_Objects.Count() - 1;
+	World.m_eType = MapDiffObject_Entity;
+	World.m_nID = 0;
+	World.m_vecReference.Init();
+	World.m_nStart = -1;
+	World.m_nEnd = -1;
+	World.m_eResult = MapDiff_Unchanged;
+	World.m_nMatch = -1;
+
+	State.m_KeyHashes.RemoveAll();
+	State.m_ShapeKeyHashes.RemoveAll();
+
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	for (;;)
+	{
+		int nChildStart = File.GetReadOffset();
+		eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType);
+		if (eResult != ChunkFile_Ok)
+		{
+			break;
+		}
+
+		if (eChunkType == ChunkType_Key)
+		{
+			if (!stricmp(szName, "id"))
+			{
+				CChunkFile::ReadKeyValueInt(szValue, pFile->m_Objects[nWorld].m_nID);
+				continue;
+			}
+
+			// The map version changes with every save.
+			if (!stricmp(szName, "mapversion"))
+			{
+				continue;
+			}
+
+			if (!stricmp(szName, "classname"))
+			{
+				pFile->m_Objects[nWorld].m_strClassName = szValue;
+			}
+
+			pFile->m_strWorldKeys.Append(CFmtStr("\t\t\"%s\" \"%s\"\n", szName, szValue));
+			AddKeyHash(State, szName, szValue, true);
+		}
+		else if (!stricmp(szName, "solid"))
+		{
+			eResult = ReadSolid(File, State);
+			if (eResult == ChunkFile_Ok)
+			{
+				AddSolidObject(State, State.m_Solids.Tail(), nChildStart, File.GetReadOffset());
+			}
+		}
+		else if (!stricmp(szName, "hidden"))
+		{
+			eResult = ReadHidden(File, State, false);
+		}
+		else
+		{
+			eResult = SkipChunk(File);
+		}
+
+		if (eResult != ChunkFile_Ok)
+		{
+			return(eResult);
+		}
+	}
+
+	if (eResult != ChunkFile_EndOfChunk)
+	{
+		return(eResult);
+	}
+
+	// Objects may have been added since, so don't hold on to a reference.
+	MapDiffObject_t &WorldObject = pFile->m_Objects[nWorld];
+	WorldObject.m_nContentHash = HashSorted(State.m_KeyHashes, MapDiffObject_Entity);
+	WorldObject.m_nShapeHash = WorldObject.m_nContentHash;
+
+	return(ChunkFile_Ok);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a hidden chunk, which holds solids or entities that were
+//			hidden when the file was saved.
+// Input  : bEntitySolids - Whether solids belong to the entity being read
+//				rather than being objects of their own.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::ReadHidden(CChunkFile &File, ReadState_t &State, bool bEntitySolids)
+{
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	for (;;)
+	{
+		int nStart = File.GetReadOffset();
+		eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType);
+		if (eResult != ChunkFile_Ok)
+		{
+			break;
+		}
+
+		if (eChunkType != ChunkType_Chunk)
+		{
+			continue;
+		}
+
+		if (!stricmp(szName, "solid"))
+		{
+			eResult = ReadSolid(File, State);
+			if ((eResult == ChunkFile_Ok) && !bEntitySolids)
+			{
+				AddSolidObject(State, State.m_Solids.Tail(), nStart, File.GetReadOffset());
+			}
+		}
+		else if (!stricmp(szName, "entity") && !bEntitySolids)
+		{
+			eResult = ReadEntity(File, State, nStart);
+		}
+		else
+		{
+			eResult = SkipChunk(File);
+		}
+
+		if (eResult != ChunkFile_Ok)
+		{
+			return(eResult);
+		}
+	}
+
+	return((eResult == ChunkFile_EndOfChunk) ? ChunkFile_Ok : eResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads an entity with its connections and solids.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::ReadEntity(CChunkFile &File, ReadState_t &State, int nStart)
+{
+	State.m_KeyHashes.RemoveAll();
+	State.m_ShapeKeyHashes.RemoveAll();
+	State.m_Solids.RemoveAll();
+	State.m_Faces.RemoveAll();
+
+	int nID = 0;
+	bool bHasOrigin = false;
+	Vector vecOrigin(0, 0, 0);
+	const char *pszClassName = "";
+	char szClassName[MAX_KEYVALUE_LEN];
+
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	while ((eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+	{
+		if (eChunkType == ChunkType_Key)
+		{
+			if (!stricmp(szName, "id"))
+			{
+				CChunkFile::ReadKeyValueInt(szValue, nID);
+			}
+			else if (!stricmp(szName, "origin"))
+			{
+				//
+				// The origin is part of the contents, but not of the shape, so
+				// that an entity that was only moved is found as moved.
+				//
+				bHasOrigin = (CChunkFile::ScanValue(szValue, "%f %f %f", &vecOrigin.x, &vecOrigin.y, &vecOrigin.z) == 3);
+
+				int nOrigin[3] = { QuantizeCoord(vecOrigin.x), QuantizeCoord(vecOrigin.y), QuantizeCoord(vecOrigin.z) };
+				State.m_KeyHashes.AddToTail(MurmurHash2(nOrigin, sizeof(nOrigin), MurmurHash2LowerCase(szName, 0)));
+			}
+			else
+			{
+				if (!stricmp(szName, "classname"))
+				{
+					V_strncpy(szClassName, szValue, sizeof(szClassName));
+					pszClassName = szClassName;
+				}
+
+				AddKeyHash(State, szName, szValue, true);
+			}
+		}
+		else
+		{
+			if (!stricmp(szName, "solid"))
+			{
+				eResult = ReadSolid(File, State);
+			}
+			else if (!stricmp(szName, "connections"))
+			{
+				eResult = ReadConnections(File, State);
+			}
+			else if (!stricmp(szName, "hidden"))
+			{
+				eResult = ReadHidden(File, State, true);
+			}
+			else
+			{
+				eResult = SkipChunk(File);
+			}
+
+			if (eResult != ChunkFile_Ok)
+			{
+				return(eResult);
+			}
+		}
+	}
+
+	if (eResult != ChunkFile_EndOfChunk)
+	{
+		return(eResult);
+	}
+
+	//
+	// Entities without an origin are placed by their solids.
+	//
+	Vector vecReference = vecOrigin;
+	if (!bHasOrigin && (State.m_Solids.Count() != 0))
+	{
+		vecReference = State.m_Solids[0].m_vecMins;
+		for (int i = 1; i < State.m_Solids.Count(); i++)
+		{
+			VectorMin(vecReference, State.m_Solids[i].m_vecMins, vecReference);
+		}
+	}
+
+	MapDiffFile_t *pFile = State.m_pFile;
+	MapDiffObject_t &Entity = pFile->m_Objects[pFile->m_Objects.AddToTail()];
+	Entity.m_eType = MapDiffObject_Entity;
+	Entity.m_nID = nID;
+	Entity.m_strClassName = pszClassName;
+	Entity.m_vecReference = vecReference;
+	Entity.m_nStart = nStart;
+	Entity.m_nEnd = File.GetReadOffset();
+	Entity.m_eResult = MapDiff_Unchanged;
+	Entity.m_nMatch = -1;
+
+	Entity.m_nContentHash = HashSorted(State.m_KeyHashes, MapDiffObject_Entity);
+	State.m_SolidHashes.RemoveAll();
+	for (int i = 0; i < State.m_Solids.Count(); i++)
+	{
+		State.m_SolidHashes.AddToTail(HashSolid(State, State.m_Solids[i], false, vec3_origin));
+	}
+	Entity.m_nContentHash = HashSorted(State.m_SolidHashes, Entity.m_nContentHash);
+
+	Entity.m_nShapeHash = HashSorted(State.m_ShapeKeyHashes, MapDiffObject_Entity);
+	State.m_SolidHashes.RemoveAll();
+	for (int i = 0; i < State.m_Solids.Count(); i++)
+	{
+		State.m_SolidHashes.AddToTail(HashSolid(State, State.m_Solids[i], true, vecReference));
+	}
+	Entity.m_nShapeHash = HashSorted(State.m_SolidHashes, Entity.m_nShapeHash);
+
+	State.m_Solids.RemoveAll();
+	State.m_Faces.RemoveAll();
+
+	return(ChunkFile_Ok);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the connections of the entity being read into its key hashes.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::ReadConnections(CChunkFile &File, ReadState_t &State)
+{
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	while ((eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+	{
+		if (eChunkType == ChunkType_Key)
+		{
+			// Outputs can repeat, so mark these apart from the entity's keys.
+			uint32 nHash = MurmurHash2LowerCase(szName, 1);
+			nHash = MurmurHash2(szValue, V_strlen(szValue), nHash);
+			State.m_KeyHashes.AddToTail(nHash);
+			State.m_ShapeKeyHashes.AddToTail(nHash);
+		}
+		else
+		{
+			eResult = SkipChunk(File);
+			if (eResult != ChunkFile_Ok)
+			{
+				return(eResult);
+			}
+		}
+	}
+
+	return((eResult == ChunkFile_EndOfChunk) ? ChunkFile_Ok : eResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a solid's faces into the read state and adds the solid to it.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::ReadSolid(CChunkFile &File, ReadState_t &State)
+{
+	DiffSolid_t Solid;
+	Solid.m_nID = 0;
+	Solid.m_nFirstFace = State.m_Faces.Count();
+	Solid.m_nFaceCount = 0;
+	Solid.m_vecMins.Init();
+
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	while ((eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+	{
+		if (eChunkType == ChunkType_Key)
+		{
+			if (!stricmp(szName, "id"))
+			{
+				CChunkFile::ReadKeyValueInt(szValue, Solid.m_nID);
+			}
+		}
+		else
+		{
+			if (!stricmp(szName, "side"))
+			{
+				eResult = ReadSide(File, State);
+			}
+			else
+			{
+				eResult = SkipChunk(File);
+			}
+
+			if (eResult != ChunkFile_Ok)
+			{
+				return(eResult);
+			}
+		}
+	}
+
+	if (eResult != ChunkFile_EndOfChunk)
+	{
+		return(eResult);
+	}
+
+	Solid.m_nFaceCount = State.m_Faces.Count() - Solid.m_nFirstFace;
+	for (int i = 0; i < Solid.m_nFaceCount; i++)
+	{
+		const Vector &vecFaceMins = State.m_Faces[Solid.m_nFirstFace + i].m_vecMins;
+		if (i == 0)
+		{
+			Solid.m_vecMins = vecFaceMins;
+		}
+		else
+		{
+			VectorMin(Solid.m_vecMins, vecFaceMins, Solid.m_vecMins);
+		}
+	}
+
+	State.m_Solids.AddToTail(Solid);
+	return(ChunkFile_Ok);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a face of the solid being read.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::ReadSide(CChunkFile &File, ReadState_t &State)
+{
+	DiffFace_t &Face = State.m_Faces[State.m_Faces.AddToTail()];
+	Face.m_vecNormal.Init();
+	Face.m_flDist = 0;
+	Face.m_vecMins.Init();
+	Face.m_nTextureHash = 0;
+	Face.m_flShift[0] = Face.m_flShift[1] = 0;
+	Face.m_bDisplacement = false;
+	Face.m_nDispHash = 0;
+	Face.m_vecDispStart.Init();
+
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	while ((eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+	{
+		if (eChunkType == ChunkType_Chunk)
+		{
+			if (!stricmp(szName, "dispinfo"))
+			{
+				Face.m_bDisplacement = true;
+				eResult = ReadDispInfo(File, Face, Face.m_nDispHash);
+			}
+			else
+			{
+				eResult = SkipChunk(File);
+			}
+
+			if (eResult != ChunkFile_Ok)
+			{
+				return(eResult);
+			}
+
+			continue;
+		}
+
+		if (!stricmp(szName, "plane"))
+		{
+			//
+			// The plane is kept as a normal and distance rather than the three
+			// points, which can be any three points on the plane.
+			//
+			Vector vecPoints[3];
+			CChunkFile::ScanValue(szValue, "(%f %f %f) (%f %f %f) (%f %f %f)",
+				&vecPoints[0].x, &vecPoints[0].y, &vecPoints[0].z, &vecPoints[1].x, &vecPoints[1].y, &vecPoints[1].z,
+				&vecPoints[2].x, &vecPoints[2].y, &vecPoints[2].z);
+
+			CrossProduct(vecPoints[0] - vecPoints[1], vecPoints[2] - vecPoints[1], Face.m_vecNormal);
+			VectorNormalize(Face.m_vecNormal);
+			Face.m_flDist = DotProduct(vecPoints[0], Face.m_vecNormal);
+
+			Face.m_vecMins = vecPoints[0];
+			VectorMin(Face.m_vecMins, vecPoints[1], Face.m_vecMins);
+			VectorMin(Face.m_vecMins, vecPoints[2], Face.m_vecMins);
+		}
+		else if (!stricmp(szName, "uaxis") || !stricmp(szName, "vaxis"))
+		{
+			//
+			// The shift is left out of the texture hash so that objects moved with
+			// texture lock on are still found as moved.
+			//
+			Vector vecAxis(0, 0, 0);
+			float flShift = 0;
+			float flScale = 0;
+			CChunkFile::ScanValue(szValue, "[%f %f %f %f] %f", &vecAxis.x, &vecAxis.y, &vecAxis.z, &flShift, &flScale);
+
+			int nAxis[4] = { QuantizeUnit(vecAxis.x), QuantizeUnit(vecAxis.y), QuantizeUnit(vecAxis.z), QuantizeUnit(flScale) };
+			Face.m_nTextureHash = MurmurHash2(nAxis, sizeof(nAxis), MurmurHash2LowerCase(szName, Face.m_nTextureHash));
+			Face.m_flShift[(szName[0] == 'v') || (szName[0] == 'V')] = flShift;
+		}
+		else if (!stricmp(szName, "material"))
+		{
+			Face.m_nTextureHash = MurmurHash2LowerCase(szValue, MurmurHash2LowerCase(szName, Face.m_nTextureHash));
+		}
+		else if (stricmp(szName, "id") && stricmp(szName, "rotation"))
+		{
+			// The rotation is worked out from the axes.
+			Face.m_nTextureHash = MurmurHash2(szValue, V_strlen(szValue), MurmurHash2LowerCase(szName, Face.m_nTextureHash));
+		}
+	}
+
+	return((eResult == ChunkFile_EndOfChunk) ? ChunkFile_Ok : eResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Hashes a displacement's data, keeping its start position apart.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CMapDiff::ReadDispInfo(CChunkFile &File, DiffFace_t &Face, uint32 &nHash)
+{
+	char szName[MAX_KEYVALUE_LEN];
+	char szValue[MAX_KEYVALUE_LEN];
+	ChunkType_t eChunkType;
+
+	ChunkFileResult_t eResult;
+	while ((eResult = File.ReadNext(szName, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+	{
+		nHash = MurmurHash2LowerCase(szName, nHash);
+
+		if (eChunkType == ChunkType_Chunk)
+		{
+			eResult = ReadDispInfo(File, Face, nHash);
+			if (eResult != ChunkFile_Ok)
+			{
+				return(eResult);
+			}
+		}
+		else if (!stricmp(szName, "startposition"))
+		{
+			CChunkFile::ScanValue(szValue, "[%f %f %f]", &Face.m_vecDispStart.x, &Face.m_vecDispStart.y, &Face.m_vecDispStart.z);
+		}
+		else
+		{
+			nHash = MurmurHash2(szValue, V_strlen(szValue), nHash);
+		}
+	}
+
+	return((eResult == ChunkFile_EndOfChunk) ? ChunkFile_Ok : eResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Hashes a face.
+// Input  : bShape - Whether to hash the face's shape, relative to vecReference
+//				and without texture shifts, rather than its contents.
+//-----------------------------------------------------------------------------
+uint32 CMapDiff::HashFace(const DiffFace_t &Face, bool bShape, const Vector &vecReference)
+{
+	int nData[9];
+	int nCount = 0;
+
+	nData[nCount++] = QuantizeUnit(Face.m_vecNormal.x);
+	nData[nCount++] = QuantizeUnit(Face.m_vecNormal.y);
+	nData[nCount++] = QuantizeUnit(Face.m_vecNormal.z);
+	nData[nCount++] = QuantizeCoord(Face.m_flDist - DotProduct(Face.m_vecNormal, vecReference));
+
+	if (!bShape)
+	{
+		nData[nCount++] = QuantizeCoord(Face.m_flShift[0]);
+		nData[nCount++] = QuantizeCoord(Face.m_flShift[1]);
+	}
+
+	uint32 nHash = Face.m_nTextureHash;
+	if (Face.m_bDisplacement)
+	{
+		Vector vecStart = Face.m_vecDispStart - vecReference;
+		nData[nCount++] = QuantizeCoord(vecStart.x);
+		nData[nCount++] = QuantizeCoord(vecStart.y);
+		nData[nCount++] = QuantizeCoord(vecStart.z);
+		nHash = MurmurHash2(&Face.m_nDispHash, sizeof(Face.m_nDispHash), nHash);
+	}
+
+	return(MurmurHash2(nData, nCount * sizeof(int), nHash));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Hashes a solid's faces in sorted order.
+//-----------------------------------------------------------------------------
+uint32 CMapDiff::HashSolid(ReadState_t &State, const DiffSolid_t &Solid, bool bShape, const Vector &vecReference)
+{
+	State.m_FaceHashes.RemoveAll();
+	for (int i = 0; i < Solid.m_nFaceCount; i++)
+	{
+		State.m_FaceHashes.AddToTail(HashFace(State.m_Faces[Solid.m_nFirstFace + i], bShape, vecReference));
+	}
+
+	return(HashSorted(State.m_FaceHashes, MapDiffObject_Solid));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Makes an object of a world solid that was just read.
+//-----------------------------------------------------------------------------
+void CMapDiff::AddSolidObject(ReadState_t &State, const DiffSolid_t &Solid, int nStart, int nEnd)
+{
+	MapDiffFile_t *pFile = State.m_pFile;
+	MapDiffObject_t &Object = pFile->m_Objects[pFile->m_Objects.AddToTail()];
+	Object.m_eType = MapDiffObject_Solid;
+	Object.m_nID = Solid.m_nID;
+	Object.m_vecReference = Solid.m_vecMins;
+	Object.m_nContentHash = HashSolid(State, Solid, false, vec3_origin);
+	Object.m_nShapeHash = HashSolid(State, Solid, true, Solid.m_vecMins);
+	Object.m_nStart = nStart;
+	Object.m_nEnd = nEnd;
+	Object.m_eResult = MapDiff_Unchanged;
+	Object.m_nMatch = -1;
+
+	State.m_Solids.RemoveAll();
+	State.m_Faces.RemoveAll();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Links two objects found to be the same object and works out what
+//			happened to it.
+//-----------------------------------------------------------------------------
+void CMapDiff::Classify(MapDiffObject_t &OldObject, MapDiffObject_t &NewObject, int nOld, int nNew)
+{
+	OldObject.m_nMatch = nNew;
+	NewObject.m_nMatch = nOld;
+
+	MapDiffResult_t eResult = MapDiff_Modified;
+	if (OldObject.m_nContentHash == NewObject.m_nContentHash)
+	{
+		eResult = MapDiff_Unchanged;
+	}
+	else if ((OldObject.m_nShapeHash == NewObject.m_nShapeHash) && (OldObject.m_vecReference != NewObject.m_vecReference))
+	{
+		eResult = MapDiff_Moved;
+	}
+
+	OldObject.m_eResult = eResult;
+	NewObject.m_eResult = eResult;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Matches the objects of the two files and classifies them.
+//-----------------------------------------------------------------------------
+void CMapDiff::Compare(void)
+{
+	CUtlVector<MapDiffObject_t> &OldObjects = m_Files[0].m_Objects;
+	CUtlVector<MapDiffObject_t> &NewObjects = m_Files[1].m_Objects;
+
+	//
+	// Match objects that kept their IDs.
+	//
+	CUtlHashtable<uint32, int> NewByID;
+	for (int i = 0; i < NewObjects.Count(); i++)
+	{
+		uint32 nKey = ObjectIDKey(NewObjects[i]);
+		if (NewByID.Find(nKey) == NewByID.InvalidHandle())
+		{
+			NewByID.Insert(nKey, i);
+		}
+	}
+
+	for (int i = 0; i < OldObjects.Count(); i++)
+	{
+		UtlHashHandle_t h = NewByID.Find(ObjectIDKey(OldObjects[i]));
+		if ((h != NewByID.InvalidHandle()) && (NewObjects[NewByID[h]].m_nMatch == -1))
+		{
+			Classify(OldObjects[i], NewObjects[NewByID[h]], i, NewByID[h]);
+		}
+	}
+
+	//
+	// Match what's left by content, then by shape, so objects that were given
+	// new IDs, by being copied and the original deleted for instance, are
+	// still found. Objects with the same hash are chained together.
+	//
+	CUtlHashtable<uint32, int> NewByContent;
+	CUtlHashtable<uint32, int> NewByShape;
+	CUtlVector<int> NextSameContent;
+	CUtlVector<int> NextSameShape;
+	NextSameContent.SetCount(NewObjects.Count());
+	NextSameShape.SetCount(NewObjects.Count());
+
+	for (int i = NewObjects.Count() - 1; i >= 0; i--)
+	{
+		if (NewObjects[i].m_nMatch != -1)
+		{
+			continue;
+		}
+
+		UtlHashHandle_t h = NewByContent.Find(NewObjects[i].m_nContentHash);
+		NextSameContent[i] = (h != NewByContent.InvalidHandle()) ? NewByContent[h] : -1;
+		NewByContent[NewObjects[i].m_nContentHash] = i;
+
+		h = NewByShape.Find(NewObjects[i].m_nShapeHash);
+		NextSameShape[i] = (h != NewByShape.InvalidHandle()) ? NewByShape[h] : -1;
+		NewByShape[NewObjects[i].m_nShapeHash] = i;
+	}
+
+	for (int i = 0; i < OldObjects.Count(); i++)
+	{
+		MapDiffObject_t &OldObject = OldObjects[i];
+		if (OldObject.m_nMatch != -1)
+		{
+			continue;
+		}
+
+		int nMatch = -1;
+
+		UtlHashHandle_t h = NewByContent.Find(OldObject.m_nContentHash);
+		for (int j = (h != NewByContent.InvalidHandle()) ? NewByContent[h] : -1; j != -1; j = NextSameContent[j])
+		{
+			if ((NewObjects[j].m_nMatch == -1) && (NewObjects[j].m_eType == OldObject.m_eType))
+			{
+				nMatch = j;
+				break;
+			}
+		}
+
+		if (nMatch == -1)
+		{
+			h = NewByShape.Find(OldObject.m_nShapeHash);
+			for (int j = (h != NewByShape.InvalidHandle()) ? NewByShape[h] : -1; j != -1; j = NextSameShape[j])
+			{
+				if ((NewObjects[j].m_nMatch == -1) && (NewObjects[j].m_eType == OldObject.m_eType))
+				{
+					nMatch = j;
+					break;
+				}
+			}
+		}
+
+		if (nMatch != -1)
+		{
+			Classify(OldObject, NewObjects[nMatch], i, nMatch);
+		}
+		else
+		{
+			OldObject.m_eResult = MapDiff_Removed;
+		}
+	}
+
+	for (int i = 0; i < NewObjects.Count(); i++)
+	{
+		if (NewObjects[i].m_nMatch == -1)
+		{
+			NewObjects[i].m_eResult = MapDiff_Added;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the number of objects with the given result.
+//-----------------------------------------------------------------------------
+int CMapDiff::GetResultCount(MapDiffResult_t eResult) const
+{
+	const MapDiffFile_t &File = (eResult == MapDiff_Removed) ? m_Files[0] : m_Files[1];
+
+	int nCount = 0;
+	for (int i = 0; i < File.m_Objects.Count(); i++)
+	{
+		if (File.m_Objects[i].m_eResult == eResult)
+		{
+			nCount++;
+		}
+	}
+
+	return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Copies an object's chunk from its file into the patch.
+//-----------------------------------------------------------------------------
+static void WriteObjectText(FileHandle_t hPatch, FileHandle_t hSource, const MapDiffFile_t &File, const MapDiffObject_t &Object, CUtlBuffer &buf)
+{
+	if (Object.m_nStart < 0)
+	{
+		// The world's keys are kept rather than the whole world chunk.
+		g_pFullFileSystem->FPrintf(hPatch, "\tworld\n\t{\n%s\t}\n", File.m_strWorldKeys.Get());
+		return;
+	}
+
+	int nSize = Object.m_nEnd - Object.m_nStart;
+	buf.Clear();
+	buf.EnsureCapacity(nSize);
+
+	g_pFullFileSystem->Seek(hSource, Object.m_nStart, FILESYSTEM_SEEK_HEAD);
+	nSize = g_pFullFileSystem->Read(buf.Base(), nSize, hSource);
+
+	// Leave out the white space between the object and whatever came before it.
+	const char *pszText = (const char *)buf.Base();
+	while ((nSize > 0) && V_isspace(*pszText))
+	{
+		pszText++;
+		nSize--;
+	}
+
+	g_pFullFileSystem->Write(pszText, nSize, hPatch);
+	g_pFullFileSystem->FPrintf(hPatch, "\n");
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the changes that turn the old file into the new one, in the
+//			same chunk format as the map files:
+//
+//			remove { "solid" "<id>" "entity" "<id>" ... }
+//			add { <object> }
+//			modify { "id" "<old id>" <object> }
+//			move { "id" "<old id>" "offset" "<x y z>" <object> }
+//
+// Input  : pszFileName - Full path of the patch to write.
+// Output : Returns false if the patch or the new file couldn't be opened.
+//-----------------------------------------------------------------------------
+bool CMapDiff::ExportPatch(const char *pszFileName) const
+{
+	const MapDiffFile_t &OldFile = m_Files[0];
+	const MapDiffFile_t &NewFile = m_Files[1];
+
+	FileHandle_t hSource = g_pFullFileSystem->Open(NewFile.m_strFileName, "rb");
+	if (!hSource)
+	{
+		return(false);
+	}
+
+	FileHandle_t hPatch = g_pFullFileSystem->Open(pszFileName, "wb");
+	if (!hPatch)
+	{
+		g_pFullFileSystem->Close(hSource);
+		return(false);
+	}
+
+	g_pFullFileSystem->FPrintf(hPatch, "mapdiff\n{\n\t\"from\" \"%s\"\n\t\"to\" \"%s\"\n}\n", OldFile.m_strFileName.Get(), NewFile.m_strFileName.Get());
+
+	if (GetResultCount(MapDiff_Removed) != 0)
+	{
+		g_pFullFileSystem->FPrintf(hPatch, "remove\n{\n");
+		for (int i = 0; i < OldFile.m_Objects.Count(); i++)
+		{
+			const MapDiffObject_t &Object = OldFile.m_Objects[i];
+			if (Object.m_eResult == MapDiff_Removed)
+			{
+				g_pFullFileSystem->FPrintf(hPatch, "\t\"%s\" \"%d\"\n", g_pszObjectTypeNames[Object.m_eType], Object.m_nID);
+			}
+		}
+		g_pFullFileSystem->FPrintf(hPatch, "}\n");
+	}
+
+	CUtlBuffer buf;
+	for (int i = 0; i < NewFile.m_Objects.Count(); i++)
+	{
+		const MapDiffObject_t &Object = NewFile.m_Objects[i];
+		switch (Object.m_eResult)
+		{
+			case MapDiff_Added:
+			{
+				g_pFullFileSystem->FPrintf(hPatch, "add\n{\n\t");
+				break;
+			}
+
+			case MapDiff_Modified:
+			{
+				const MapDiffObject_t &OldObject = OldFile.m_Objects[Object.m_nMatch];
+				g_pFullFileSystem->FPrintf(hPatch, "modify\n{\n\t\"id\" \"%d\"\n\t", OldObject.m_nID);
+				break;
+			}
+
+			case MapDiff_Moved:
+			{
+				const MapDiffObject_t &OldObject = OldFile.m_Objects[Object.m_nMatch];
+				Vector vecOffset = Object.m_vecReference - OldObject.m_vecReference;
+				g_pFullFileSystem->FPrintf(hPatch, "move\n{\n\t\"id\" \"%d\"\n\t\"offset\" \"%g %g %g\"\n\t", OldObject.m_nID, vecOffset.x, vecOffset.y, vecOffset.z);
+				break;
+			}
+
+			default:
+			{
+				continue;
+			}
+		}
+
+		WriteObjectText(hPatch, hSource, NewFile, Object, buf);
+		g_pFullFileSystem->FPrintf(hPatch, "}\n");
+	}
+
+	g_pFullFileSystem->Close(hPatch);
+	g_pFullFileSystem->Close(hSource);
+
+	return(true);
+}
@@ -0,0 +1,155 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compares two map files object by object. The files are read
+//			without creating any map objects, each solid and entity is reduced
+//			to hashes of its contents, and the objects are matched up by ID and
+//			then by hash.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef MAPDIFF_H
+#define MAPDIFF_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+#include "tier1/utlvector.h"
+#include "tier1/utlstring.h"
+#include "chunkfile.h"
+
+
+enum MapDiffObjectType_t
+{
+	MapDiffObject_Solid = 0,		// A world solid.
+	MapDiffObject_Entity,			// An entity, including its solids, or the world's keys.
+};
+
+
+enum MapDiffResult_t
+{
+	MapDiff_Unchanged = 0,
+	MapDiff_Added,					// Only in the new file.
+	MapDiff_Removed,				// Only in the old file.
+	MapDiff_Modified,
+	MapDiff_Moved,					// Same contents at a different position.
+
+	MapDiff_ResultCount
+};
+
+
+struct MapDiffObject_t
+{
+	MapDiffObjectType_t m_eType;
+	int m_nID;
+	CUtlString m_strClassName;		// Entities only.
+
+	uint32 m_nContentHash;			// Everything but the ID and editor settings.
+	uint32 m_nShapeHash;			// The same, relative to m_vecReference and without texture shifts.
+	Vector m_vecReference;			// Entity origin, or the lowest corner of the plane points.
+
+	int m_nStart;					// Where the object's chunk is in its file.
+	int m_nEnd;
+
+	MapDiffResult_t m_eResult;
+	int m_nMatch;					// Index of the same object in the other file, -1 if none.
+};
+
+
+struct MapDiffFile_t
+{
+	CUtlString m_strFileName;
+	CUtlVector<MapDiffObject_t> m_Objects;
+	CUtlString m_strWorldKeys;		// The world's keys, as they are in the file.
+	CUtlString m_strError;			// Empty if the file was read.
+};
+
+
+class CMapDiff
+{
+	public:
+
+		//
+		// Reads both files, at the same time, and compares them. Returns false if
+		// either file couldn't be read, see GetError.
+		//
+		bool Run(const char *pszOldFileName, const char *pszNewFileName);
+		const char *GetError(void) const;
+
+		inline const MapDiffFile_t &GetOldFile(void) const { return(m_Files[0]); }
+		inline const MapDiffFile_t &GetNewFile(void) const { return(m_Files[1]); }
+
+		// Number of objects in either file with the given result, counting matched pairs once.
+		int GetResultCount(MapDiffResult_t eResult) const;
+
+		//
+		// Writes the changes needed to turn the old file into the new one: the IDs
+		// of removed objects and the new text of added, modified and moved objects.
+		//
+		bool ExportPatch(const char *pszFileName) const;
+
+	protected:
+
+		//
+		// A face as read from the file, kept until the hashes of its solid can be
+		// worked out, which for the solids of an entity needs the entity's origin.
+		//
+		struct DiffFace_t
+		{
+			Vector m_vecNormal;
+			float m_flDist;
+			Vector m_vecMins;				// Lowest corner of the plane points.
+			uint32 m_nTextureHash;			// Material, texture axes and scales, lightmap scale, smoothing.
+			float m_flShift[2];
+			bool m_bDisplacement;
+			uint32 m_nDispHash;				// Displacement data other than its start position.
+			Vector m_vecDispStart;
+		};
+
+		struct DiffSolid_t
+		{
+			int m_nID;
+			int m_nFirstFace;				// Into the faces being collected.
+			int m_nFaceCount;
+			Vector m_vecMins;
+		};
+
+		//
+		// What's collected while reading a single file.
+		//
+		struct ReadState_t
+		{
+			MapDiffFile_t *m_pFile;
+			CUtlVector<DiffFace_t> m_Faces;
+			CUtlVector<DiffSolid_t> m_Solids;
+			CUtlVector<uint32> m_KeyHashes;			// Keys and connections of the entity being read.
+			CUtlVector<uint32> m_ShapeKeyHashes;	// The same without the origin.
+			CUtlVector<uint32> m_FaceHashes;
+			CUtlVector<uint32> m_SolidHashes;
+		};
+
+		void ReadFile(MapDiffFile_t *pFile);
+		ChunkFileResult_t ReadWorld(CChunkFile &File, ReadState_t &State, int nStart);
+		ChunkFileResult_t ReadEntity(CChunkFile &File, ReadState_t &State, int nStart);
+		ChunkFileResult_t ReadHidden(CChunkFile &File, ReadState_t &State, bool bEntitySolids);
+		ChunkFileResult_t ReadSolid(CChunkFile &File, ReadState_t &State);
+		ChunkFileResult_t ReadSide(CChunkFile &File, ReadState_t &State);
+		ChunkFileResult_t ReadDispInfo(CChunkFile &File, DiffFace_t &Face, uint32 &nHash);
+		ChunkFileResult_t ReadConnections(CChunkFile &File, ReadState_t &State);
+		ChunkFileResult_t SkipChunk(CChunkFile &File);
+		void AddKeyHash(ReadState_t &State, const char *pszKey, const char *pszValue, bool bShape);
+
+		void AddSolidObject(ReadState_t &State, const DiffSolid_t &Solid, int nStart, int nEnd);
+		uint32 HashSolid(ReadState_t &State, const DiffSolid_t &Solid, bool bShape, const Vector &vecReference);
+		static uint32 HashFace(const DiffFace_t &Face, bool bShape, const Vector &vecReference);
+		static uint32 HashSorted(CUtlVector<uint32> &Hashes, uint32 nSeed);
+
+		void Compare(void);
+		void Classify(MapDiffObject_t &OldObject, MapDiffObject_t &NewObject, int nOld, int nNew);
+
+		MapDiffFile_t m_Files[2];
+};
+
+
+#endif // MAPDIFF_H
@@ -31,6 +31,7 @@
 #include "render2d.h"
 #include "faceeditsheet.h"
 #include "options.h"
+#include "tier1/utlbuffer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -39,6 +40,7 @@
 
 bool CMapDisp::m_bSelectMask = false;
 bool CMapDisp::m_bGridMask = false;
+bool CMapDisp::m_bDeferCreate = false;
 
 //-----------------------------------------------------------------------------
 // Purpose : CMapDisp constructor
@@ -203,7 +205,10 @@ void CMapDisp::InitData( int power )
 //-----------------------------------------------------------------------------
 bool CMapDisp::Create( void )
 {
-	if ( m_CoreDispInfo.CreateWithoutLOD() )
+	if ( m_bDeferCreate )
+		return true;
+
+	if ( CreateSurface() )
 	{
 		PostCreate();
 		return true;
@@ -214,14 +219,31 @@ bool CMapDisp::Create( void )
 
 
 //-----------------------------------------------------------------------------
+// Purpose: Builds the surface and the data that depends only on it. This
+//			touches nothing outside of this displacement, so it is safe to call
+//			on a worker thread as long as no displacements are being added or
+//			removed.
 //-----------------------------------------------------------------------------
-void CMapDisp::PostCreate( void )
+bool CMapDisp::CreateSurface( void )
 {
+	if ( !m_CoreDispInfo.CreateWithoutLOD() )
+		return false;
+
 	UpdateBoundingBox();
-	UpdateNeighborDependencies( false );
-	UpdateLightmapExtents();
 	UpdateWalkable();
 	UpdateBuildable();
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finishes creation once the surface is built, updating neighbors,
+//			the parent face and the render data. Main thread only.
+//-----------------------------------------------------------------------------
+void CMapDisp::PostCreate( void )
+{
+	UpdateNeighborDependencies( false );
+	UpdateLightmapExtents();
 	if ( m_pMesh )
 	{
 		CMatRenderContextPtr pRenderContext( MaterialSystemInterface() );
@@ -326,6 +348,7 @@ CMapDisp *CMapDisp::CopyFrom( CMapDisp *pMapDisp, bool bUpdateDependencies )
 		unsigned short triValue = pMapDisp->m_CoreDispInfo.GetTriTagValue( iTri );
 		m_CoreDispInfo.SetTriTagValue( iTri, triValue );
 	}
+	m_CollideTree.Invalidate();
 
 	//
 	// copy editor specific data
@@ -351,6 +374,178 @@ CMapDisp *CMapDisp::CopyFrom( CMapDisp *pMapDisp, bool bUpdateDependencies )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Writes the data that CopyFrom copies to a binary buffer. The order
+//			matches CopyFrom, and LoadUndoState reads it back the same way.
+//-----------------------------------------------------------------------------
+void CMapDisp::SaveUndoState( CUtlBuffer &buf )
+{
+	CCoreDispSurface *pSurf = m_CoreDispInfo.GetSurface();
+
+	int pointCount = pSurf->GetPointCount();
+	buf.PutInt( pointCount );
+
+	Vector2D v2;
+	Vector v3;
+	for( int i = 0; i < pointCount; i++ )
+	{
+		pSurf->GetPoint( i, v3 );
+		buf.Put( &v3, sizeof( v3 ) );
+
+		pSurf->GetPointNormal( i, v3 );
+		buf.Put( &v3, sizeof( v3 ) );
+
+		pSurf->GetTexCoord( i, v2 );
+		buf.Put( &v2, sizeof( v2 ) );
+
+		pSurf->GetLuxelCoord( 0, i, v2 );
+		buf.Put( &v2, sizeof( v2 ) );
+	}
+
+	buf.PutInt( pSurf->GetFlags() );
+	buf.PutInt( pSurf->GetContents() );
+	buf.PutInt( pSurf->GetPointStartIndex() );
+
+	buf.PutInt( GetPower() );
+	buf.PutFloat( GetElevation() );
+	buf.PutFloat( GetScale() );
+
+	int size = GetSize();
+	for( int i = 0; i < size; i++ )
+	{
+		GetFieldVector( i, v3 );
+		buf.Put( &v3, sizeof( v3 ) );
+
+		GetSubdivPosition( i, v3 );
+		buf.Put( &v3, sizeof( v3 ) );
+
+		GetSubdivNormal( i, v3 );
+		buf.Put( &v3, sizeof( v3 ) );
+
+		buf.PutFloat( GetFieldDistance( i ) );
+
+		GetVert( i, v3 );
+		buf.Put( &v3, sizeof( v3 ) );
+
+		GetFlatVert( i, v3 );
+		buf.Put( &v3, sizeof( v3 ) );
+
+		buf.PutFloat( GetAlpha( i ) );
+	}
+
+	int renderCount = m_CoreDispInfo.GetRenderIndexCount();
+	buf.PutInt( renderCount );
+	for( int i = 0; i < renderCount; i++ )
+	{
+		buf.PutUnsignedShort( ( unsigned short )m_CoreDispInfo.GetRenderIndex( i ) );
+	}
+
+	int nTriCount = GetTriCount();
+	for ( int iTri = 0; iTri < nTriCount; ++iTri )
+	{
+		unsigned short triIndices[3];
+		GetTriIndices( iTri, triIndices[0], triIndices[1], triIndices[2] );
+		buf.Put( triIndices, sizeof( triIndices ) );
+		buf.PutUnsignedShort( m_CoreDispInfo.GetTriTagValue( iTri ) );
+	}
+
+	buf.PutUnsignedChar( IsSubdivided() );
+	buf.PutUnsignedChar( NeedsReSubdivision() );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Turns this displacement into the one saved by SaveUndoState, the
+//			same way CopyFrom does.
+//-----------------------------------------------------------------------------
+void CMapDisp::LoadUndoState( CUtlBuffer &buf, bool bUpdateDependencies )
+{
+	CCoreDispSurface *pSurf = m_CoreDispInfo.GetSurface();
+
+	int pointCount = buf.GetInt();
+	pSurf->SetPointCount( pointCount );
+
+	Vector2D v2;
+	Vector v3;
+	for( int i = 0; i < pointCount; i++ )
+	{
+		buf.Get( &v3, sizeof( v3 ) );
+		pSurf->SetPoint( i, v3 );
+
+		buf.Get( &v3, sizeof( v3 ) );
+		pSurf->SetPointNormal( i, v3 );
+
+		buf.Get( &v2, sizeof( v2 ) );
+		pSurf->SetTexCoord( i, v2 );
+
+		buf.Get( &v2, sizeof( v2 ) );
+		pSurf->SetLuxelCoord( 0, i, v2 );
+	}
+
+	pSurf->SetFlags( buf.GetInt() );
+	pSurf->SetContents( buf.GetInt() );
+	pSurf->SetPointStartIndex( buf.GetInt() );
+
+	SetPower( buf.GetInt() );
+	SetElevation( buf.GetFloat() );
+	m_Scale = buf.GetFloat();
+
+	int size = GetSize();
+	for( int i = 0; i < size; i++ )
+	{
+		buf.Get( &v3, sizeof( v3 ) );
+		SetFieldVector( i, v3 );
+
+		buf.Get( &v3, sizeof( v3 ) );
+		SetSubdivPosition( i, v3 );
+
+		buf.Get( &v3, sizeof( v3 ) );
+		SetSubdivNormal( i, v3 );
+
+		SetFieldDistance( i, buf.GetFloat() );
+
+		buf.Get( &v3, sizeof( v3 ) );
+		SetVert( i, v3 );
+
+		buf.Get( &v3, sizeof( v3 ) );
+		SetFlatVert( i, v3 );
+
+		SetAlpha( i, buf.GetFloat() );
+	}
+
+	int renderCount = buf.GetInt();
+	m_CoreDispInfo.SetRenderIndexCount( renderCount );
+	for( int i = 0; i < renderCount; i++ )
+	{
+		m_CoreDispInfo.SetRenderIndex( i, buf.GetUnsignedShort() );
+	}
+
+	int nTriCount = GetTriCount();
+	for ( int iTri = 0; iTri < nTriCount; ++iTri )
+	{
+		unsigned short triIndices[3];
+		buf.Get( triIndices, sizeof( triIndices ) );
+		m_CoreDispInfo.SetTriIndices( iTri, triIndices[0], triIndices[1], triIndices[2] );
+		m_CoreDispInfo.SetTriTagValue( iTri, buf.GetUnsignedShort() );
+	}
+	m_CollideTree.Invalidate();
+
+	m_bSubdiv = ( buf.GetUnsignedChar() != 0 );
+	m_bReSubdiv = ( buf.GetUnsignedChar() != 0 );
+
+	ResetTexelHitIndex();
+	ResetDispMapHitIndex();
+	ResetTouched();
+	m_CoreDispInfo.AllowedVerts_Clear();
+
+	if( bUpdateDependencies )
+	{
+		UpdateData();
+		CheckAndUpdateOverlays( true );
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 void CMapDisp::UpdateSurfData( CMapFace *pFace )
@@ -993,214 +1188,10 @@ bool CMapDisp::ComparePoints( const Vector& pt1, const Vector& pt2, const float
 
 
 //-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-float CMapDisp::CollideWithTriangles( const Vector& RayStart, const Vector& RayEnd, Tri_t *pTris, int triCount,
-									  Vector& surfNormal )
-{
-	// create a ray
-	Ray_t ray;
-	ray.m_Start = RayStart;
-	ray.m_Delta = RayEnd - RayStart;
-	ray.m_IsRay = true;
-
-	Vector vNormal;
-	float minFraction = 1.0f;
-	for( int ndxTri = 0; ndxTri < triCount; ndxTri++ )
-	{
-		Tri_t &tri = pTris[ndxTri];
-		float fraction = IntersectRayWithTriangle( ray, tri.v[0], tri.v[2], tri.v[1], true );
-		if( fraction == -1 )
-			continue;
-
-		if( fraction < minFraction )
-		{
-			minFraction = fraction;
-
-			// calculate the triangle normal
-			Vector edge1, edge2;
-			VectorSubtract( tri.v[2], tri.v[0], edge1 );
-			VectorSubtract( tri.v[1], tri.v[0], edge2 );
-			CrossProduct( edge1, edge2, surfNormal );
-			VectorNormalize( surfNormal );
-		}
-	}
-
-	return minFraction;
-}
-
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-void CMapDisp::CreatePlanesFromBoundingBox( Plane_t *planes, const Vector& bbMin, const Vector& bbMax )
-{
-	for( int i = 0; i < 6; i++ )
-	{
-		VectorClear( planes[i].normal );
-	}
-
-	//
-	// use pads to store minor axes
-	//
-	planes[0].normal[0] = -1;	planes[0].dist = -bbMin[0];
-	planes[1].normal[0] = 1;	planes[1].dist = bbMax[0];
-
-	planes[2].normal[1] = -1;	planes[2].dist = -bbMin[1];
-	planes[3].normal[1] = 1;	planes[3].dist = bbMax[1];
-
-	planes[4].normal[2] = -1;	planes[4].dist = -bbMin[2];
-	planes[5].normal[2] = 1;	planes[5].dist = bbMax[2];
-}
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-void CMapDisp::CollideWithBoundingBoxes( const Vector& rayStart, const Vector& rayEnd,
-										 BBox_t *pBBox, int bboxCount, Tri_t *pTris, int *triCount )
-{
-	const float DIST_EPSILON = 0.01f;
-
-	//
-	// collide against all bounding boxes
-	//
-	for( int i = 0; i < bboxCount; i++ )
-	{
-		//
-		// make copy of vectors so they can be cut up
-		//
-		Vector start, end;
-		start = rayStart;
-		end = rayEnd;
-
-		//
-		// make planes for bbox
-		//
-		Plane_t planes[6];
-		CreatePlanesFromBoundingBox( planes, pBBox[i].min, pBBox[i].max );
-
-		//
-		// collide against bounding box planes
-		//
-		int j;
-		for( j = 0; j < 6; j++ )
-		{
-			float dist1 = DotProduct( planes[j].normal, start ) - planes[j].dist;
-			float dist2 = DotProduct( planes[j].normal, end ) - planes[j].dist;
-
-			//
-			// entry intersection point - move ray start up to intersection
-			//
-			if( ( dist1 > DIST_EPSILON ) && ( dist2 < -DIST_EPSILON ) )
-			{
-				float fraction = ( dist1 / ( dist1 - dist2 ) );
-				Vector segment, addOn;
-				VectorSubtract( end, start, segment );
-				VectorScale( segment, fraction, addOn );
-				VectorNormalize( segment );
-				VectorAdd( addOn, segment, addOn );
-				VectorAdd( start, addOn, start );
-			}
-			else if( ( dist1 > DIST_EPSILON ) && ( dist2 > DIST_EPSILON ) )
-			{
-				break;
-			}
-		}
-
-		//
-		// collision add triangles to list
-		//
-		if( j == 6 )
-		{
-			// gross! shouldn't know value (64) and handle error better
-			if( *triCount >= 256 )
-			{
-				// error!!!!!
-				return;
-			}
-
-			int postSpacing = m_CoreDispInfo.GetPostSpacing();
-			int index = i + ( i / ( postSpacing - 1 ) );
-
-			m_CoreDispInfo.GetVert( index, pTris[*triCount].v[0] );
-			m_CoreDispInfo.GetVert( index+postSpacing, pTris[*triCount].v[1] );
-			m_CoreDispInfo.GetVert( index+1, pTris[*triCount].v[2] );
-			*triCount += 1;
-
-			m_CoreDispInfo.GetVert( index+1, pTris[*triCount].v[0] );
-			m_CoreDispInfo.GetVert( index+postSpacing, pTris[*triCount].v[1] );
-			m_CoreDispInfo.GetVert( index+postSpacing+1, pTris[*triCount].v[2] );
-			*triCount += 1;
-		}
-	}
-}
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-void CMapDisp::CreateBoundingBoxes( BBox_t *pBBox, int count, float bloat )
-{
-	//
-	// initialize the bounding boxes
-	//
-	for( int i = 0; i < count; i++ )
-	{
-		VectorFill( pBBox[i].min, COORD_NOTINIT );
-		VectorFill( pBBox[i].max, -COORD_NOTINIT );
-	}
-
-	// get the width and height of the displacement surface
-	int postSpacing = m_CoreDispInfo.GetPostSpacing();
-
-	//
-	// find bounding box of every two consecutive triangles
-	//
-	int bboxIndex = 0;
-	int index = 0;
-	for( int i = 0; i < ( postSpacing - 1 ); i++ )
-	{
-		for( int j = 0; j < ( postSpacing - 1 ); j++ )
-		{
-			for( int k = 0; k < 4; k++ )
-			{
-				switch( k )
-				{
-					case 0: { index = ( postSpacing * i ) + j; break; }
-					case 1: { index = ( postSpacing * ( i + 1 ) ) + j; break; }
-					case 2: { index = ( postSpacing * i ) + ( j + 1 ); break; }
-					case 3: { index = ( postSpacing * ( i + 1 ) ) + ( j + 1 ); break; }
-				}
-
-				Vector v;
-				m_CoreDispInfo.GetVert( index, v );
-				if( v[0] < pBBox[bboxIndex].min[0] ) { pBBox[bboxIndex].min[0] = v[0]; }
-				if( v[1] < pBBox[bboxIndex].min[1] ) { pBBox[bboxIndex].min[1] = v[1]; }
-				if( v[2] < pBBox[bboxIndex].min[2] ) { pBBox[bboxIndex].min[2] = v[2]; }
-
-				if( v[0] > pBBox[bboxIndex].max[0] ) { pBBox[bboxIndex].max[0] = v[0]; }
-				if( v[1] > pBBox[bboxIndex].max[1] ) { pBBox[bboxIndex].max[1] = v[1]; }
-				if( v[2] > pBBox[bboxIndex].max[2] ) { pBBox[bboxIndex].max[2] = v[2]; }
-			}
-
-			// bloat all the boxes a little
-			for( int axis = 0; axis < 3; axis++ )
-			{
-				pBBox[bboxIndex].min[axis] -= bloat;
-				pBBox[bboxIndex].max[axis] += bloat;
-			}
-
-			bboxIndex++;
-		}
-	}
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose:
-// NOTE: Performance, look into it here.  This is doing way more work than
-//	   necessary.  We should probably update a collision representation, a
-//	   simple one at least whenever we update a displacement and use it as
-//	   a first level cull here.  But for now....it works...ship, ship, ship.
+// Purpose: Finds where a line segment first hits the displacement surface.
 //-----------------------------------------------------------------------------
 bool CMapDisp::TraceLine( Vector &vecHitPos, Vector &vecHitNormal, Vector const &vecRayStart, Vector const &vecRayEnd )
 {
-	// Just do the slow thing for now.
 	float flFraction;
 	int iTri = CollideWithDispTri( vecRayStart, vecRayEnd, flFraction );
 	if ( iTri == -1 )
@@ -2697,6 +2688,9 @@ void CMapDisp::UpdateBoundingBox( void )
 	VectorFill( m_BBox[0], COORD_NOTINIT );
 	VectorFill( m_BBox[1], -COORD_NOTINIT );
 
+	// The vertices have moved, so the collision tree needs refitting.
+	m_CollideTree.MarkMoved();
+
 	int size = GetSize();
 	for( int i = 0; i < size; i++ )
 	{
@@ -4255,38 +4249,37 @@ bool CMapDisp::HasGridMask( void )
 }
 
 //-----------------------------------------------------------------------------
-// Purpose: Do the slow thing first and optimize later??
 //-----------------------------------------------------------------------------
-int CMapDisp::CollideWithDispTri( const Vector &rayStart, const Vector &rayEnd, float &flFraction, bool OneSided )
+void CMapDisp::SetDeferCreate( bool bDeferCreate )
 {
-	int iTriangle = -1;
-	flFraction = 1.0f;
-
-	int nTriCount = GetTriCount();
-	for ( int iTri = 0; iTri < nTriCount; ++iTri )
-	{
-		unsigned short v1, v2, v3;
-		GetTriIndices( iTri, v1, v2, v3 );
-		Vector vec1, vec2, vec3;
-		GetVert( v1, vec1 );
-		GetVert( v2, vec2 );
-		GetVert( v3, vec3 );
+	m_bDeferCreate = bDeferCreate;
+}
 
-		Ray_t ray;
-		ray.Init( rayStart, rayEnd, Vector( 0.0f, 0.0f, 0.0f ), Vector ( 0.0f, 0.0f, 0.0f ) );
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+bool CMapDisp::IsCreateDeferred( void )
+{
+	return m_bDeferCreate;
+}
 
-		float flFrac = IntersectRayWithTriangle( ray, vec1, vec2, vec3, OneSided );
-		if ( flFrac == -1.0f )
-			continue;
+//-----------------------------------------------------------------------------
+// Purpose: Finds the first triangle along a line segment, through the collision
+//			tree, which is brought up to date first if the surface changed.
+// Output : Returns the triangle index, or -1 if nothing was hit.
+//-----------------------------------------------------------------------------
+int CMapDisp::CollideWithDispTri( const Vector &rayStart, const Vector &rayEnd, float &flFraction, bool OneSided )
+{
+	m_CollideTree.Update( &m_CoreDispInfo );
+	return m_CollideTree.TraceRay( rayStart, rayEnd, OneSided, flFraction );
+}
 
-		if ( flFrac < flFraction )
-		{
-			flFraction = flFrac;
-			iTriangle = iTri;
-		}
-	}
 
-	return iTriangle;
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+void CMapDisp::EnumerateVertsInSphere( const Vector &vecCenter, float flRadius, CUtlVector<int> &verts )
+{
+	m_CollideTree.Update( &m_CoreDispInfo );
+	m_CollideTree.EnumerateVertsInSphere( vecCenter, flRadius, verts );
 }
 
 bool CMapDisp::SaveDXF(ExportDXFInfo_s *pInfo)
@@ -24,8 +24,10 @@
 #include "dispmapimagefilter.h"
 #include "builddisp.h"
 #include "dispmanager.h"
+#include "dispcollidetree.h"
 
 class CChunkFile;
+class CUtlBuffer;
 class CMapClass;
 class CMapFace;
 class CSaveInfo;
@@ -55,18 +57,6 @@ class CMapDisp final : public CMapAtom
 {
 private:
 
-	struct BBox_t
-	{
-		Vector min;
-		Vector max;
-	};
-
-	struct Plane_t
-	{
-		Vector normal;
-		float  dist;
-	};
-
 	struct Tri_t
 	{
 		Vector v[3];
@@ -98,8 +88,14 @@ public:
 	// Creation, Copy
 	//
 	bool Create( void );
+	bool CreateSurface( void );
+	void PostCreate( void );
 	CMapDisp *CopyFrom( CMapDisp *pMapDisp, bool bUpdateDependencies );
 
+	// Compact binary form of the data CopyFrom copies, for the undo history.
+	void SaveUndoState( CUtlBuffer &buf );
+	void LoadUndoState( CUtlBuffer &buf, bool bUpdateDependencies );
+
 	//=========================================================================
 	//
 	// Update/Modification/Editing Functions
@@ -222,6 +218,9 @@ public:
 
 	int CollideWithDispTri( const Vector &rayStart, const Vector &rayEnd, float &flFraction, bool OneSided = false );
 
+	// Adds the indices of the vertices strictly inside the sphere to the list.
+	void EnumerateVertsInSphere( const Vector &vecCenter, float flRadius, CUtlVector<int> &verts );
+
 	//=========================================================================
 	//
 	// Neighbors
@@ -254,6 +253,11 @@ public:
 	static void SetGridMask( bool bGridMask );
 	static bool HasGridMask( void );
 
+	// While set, Create() does nothing. Used when solids are built in a batch, which
+	// creates the surfaces afterwards with CreateSurface() and PostCreate().
+	static void SetDeferCreate( bool bDeferCreate );
+	static bool IsCreateDeferred( void );
+
 	//=========================================================================
 	//
 	// Selection
@@ -333,11 +337,13 @@ private:
 	Vector			m_MapAxes[2];															// for older files (.map, .rmf)
 
 	Vector			m_BBox[2];																// axial-aligned bounding box
+	CDispCollideTree	m_CollideTree;														// for ray and sphere queries, refit on demand
 
 	float			m_Scale;
 
 	static bool		m_bSelectMask;															// masks for the Displacement Tool (FaceEditSheet)
 	static bool		m_bGridMask;
+	static bool		m_bDeferCreate;
 
 	bool			m_bSubdiv;
 	bool			m_bReSubdiv;
@@ -383,7 +389,6 @@ private:
 	void SamplePoints( int index, int width, int height, bool *pValidPoints, float *pValue, float *pAlpha,
 					   Vector& newDispVector, Vector& newSubdivPos, Vector &newSubdivNormal );
 
-	void PostCreate( void );
 	void UpdateBoundingBox( void );
 	void UpdateLightmapExtents( void );
 	bool ValidLightmapSize( void );
@@ -398,15 +403,6 @@ private:
 	int GetAxisTypeBasedOnView( int majorAxis, int vertAxis, int horzAxis );
 	int GetMajorAxis( Vector &v );
 
-	//=========================================================================
-	//
-	// Collision Testing
-	//
-	void CreateBoundingBoxes( BBox_t *pBBox, int count, float bloat );
-	void CreatePlanesFromBoundingBox( Plane_t *planes, const Vector& bbMin, const Vector& bbMax );
-	void CollideWithBoundingBoxes( const Vector& rayStart, const Vector& rayEnd, BBox_t *pBBox, int bboxCount, Tri_t *pTris, int *triCount );
-	float CollideWithTriangles( const Vector& RayStart, const Vector& RayEnd, Tri_t *pTris, int triCount, Vector& surfNormal );
-
 	//=========================================================================
 	//
 	// Rendering
@@ -469,6 +465,7 @@ private:
 inline void CMapDisp::SetPower( int power )
 {
 	m_CoreDispInfo.SetPower( power );
+	m_CollideTree.Invalidate();
 }
 
 
@@ -686,6 +683,7 @@ inline void CMapDisp::SetSurfTexCoord( int ndx, Vector2D const &texCoord )
 inline void CMapDisp::SetVert( int index, Vector const &v )
 {
 	m_CoreDispInfo.SetVert( index, v );
+	m_CollideTree.MarkMoved();
 }
 
 
@@ -547,6 +547,10 @@ class CMapDoc : public CDocument
 
 		void PreloadDocument();
 		bool LoadVMF( const char *pszFileName, int LoadFlags = VMF_LOAD_ACTIVATE );
+
+		// Time the VMF tokenizer and value parsing against the old stream tokenizer and sscanf.
+		// Results are appended to <filename>_benchmark.txt.
+		static bool BenchmarkVMFParse( const char *pszFileName );
 		void PostloadDocument(const char *pszFileName);
 		inline bool IsLoading(void);
 
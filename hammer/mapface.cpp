@@ -26,6 +26,7 @@
 #include "camera.h"
 #include "options.h"
 #include "hammer.h"
+#include "tier1/utlbuffer.h"
 
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -356,6 +357,151 @@ CMapFace *CMapFace::CopyFrom(const CMapFace *pObject, DWORD dwFlags, bool bUpdat
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Writes the data that CopyFrom copies to a binary buffer. The
+//			selection state changes too often to be worth keeping with the rest.
+//-----------------------------------------------------------------------------
+void CMapFace::SaveUndoState(CUtlBuffer &buf)
+{
+	buf.PutInt(m_nFaceID);
+
+	buf.PutString(texture.texture);
+	buf.Put(&texture.UAxis, sizeof(texture.UAxis));
+	buf.Put(&texture.VAxis, sizeof(texture.VAxis));
+	buf.PutFloat(texture.rotate);
+	buf.PutFloat(texture.scale[0]);
+	buf.PutFloat(texture.scale[1]);
+	buf.PutUnsignedChar(texture.smooth);
+	buf.PutUnsignedChar(texture.material);
+	buf.PutInt(texture.nLightmapScale);
+	buf.Put(&m_pTexture, sizeof(m_pTexture));
+
+	buf.PutUnsignedChar(m_bIsCordonFace);
+
+	bool bHasPoints = (Points != NULL) && (nPoints != 0);
+	buf.PutInt(nPoints);
+	buf.PutUnsignedChar(bHasPoints);
+	if (bHasPoints)
+	{
+		buf.Put(Points, sizeof(Vector) * nPoints);
+		buf.Put(m_pTextureCoords, sizeof(Vector2D) * nPoints);
+		buf.Put(m_pLightmapCoords, sizeof(Vector2D) * nPoints);
+		buf.Put(m_pTangentAxes, sizeof(TangentSpaceAxes_t) * nPoints);
+	}
+
+	buf.Put(&plane, sizeof(plane));
+
+	buf.PutUnsignedChar(HasDisp());
+	if (HasDisp())
+	{
+		EditDispMgr()->GetDisp(m_DispHandle)->SaveUndoState(buf);
+	}
+
+	buf.PutUnsignedChar(r);
+	buf.PutUnsignedChar(g);
+	buf.PutUnsignedChar(b);
+	buf.PutUnsignedChar(m_uchAlpha);
+	buf.PutUnsignedChar(m_bIgnoreLighting);
+	buf.PutUnsignedInt(m_fSmoothingGroups);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Turns this face into the one saved by SaveUndoState, the same way
+//			CopyFrom does with COPY_FACE_POINTS.
+//-----------------------------------------------------------------------------
+void CMapFace::LoadUndoState(CUtlBuffer &buf, bool bUpdateDependencies)
+{
+	SignalUpdate( EVTYPE_FACE_CHANGED );
+
+	//
+	// Free our points first.
+	//
+	if (Points != NULL)
+	{
+		delete [] Points;
+		Points = NULL;
+	}
+
+	if (m_pTextureCoords != NULL)
+	{
+		delete [] m_pTextureCoords;
+		m_pTextureCoords = NULL;
+	}
+
+	if (m_pLightmapCoords != NULL)
+	{
+		delete [] m_pLightmapCoords;
+		m_pLightmapCoords = NULL;
+	}
+
+	FreeTangentSpaceAxes();
+
+	m_nFaceID = buf.GetInt();
+
+	memset(&texture, 0, sizeof(texture));
+	buf.GetString(texture.texture);
+	buf.Get(&texture.UAxis, sizeof(texture.UAxis));
+	buf.Get(&texture.VAxis, sizeof(texture.VAxis));
+	texture.rotate = buf.GetFloat();
+	texture.scale[0] = buf.GetFloat();
+	texture.scale[1] = buf.GetFloat();
+	texture.smooth = buf.GetUnsignedChar();
+	texture.material = buf.GetUnsignedChar();
+	texture.nLightmapScale = buf.GetInt();
+	buf.Get(&m_pTexture, sizeof(m_pTexture));
+
+	m_bIsCordonFace = (buf.GetUnsignedChar() != 0);
+
+	nPoints = buf.GetInt();
+	if (buf.GetUnsignedChar() != 0)
+	{
+		int nCount = nPoints;
+		AllocatePoints(nCount);
+		AllocTangentSpaceAxes(nCount);
+		buf.Get(Points, sizeof(Vector) * nCount);
+		buf.Get(m_pTextureCoords, sizeof(Vector2D) * nCount);
+		buf.Get(m_pLightmapCoords, sizeof(Vector2D) * nCount);
+		buf.Get(m_pTangentAxes, sizeof(TangentSpaceAxes_t) * nCount);
+	}
+
+	buf.Get(&plane, sizeof(plane));
+
+	if (buf.GetUnsignedChar() != 0)
+	{
+		//
+		// Allocate a new displacement info if we don't already have one.
+		//
+		if (!HasDisp())
+		{
+			SetDisp(EditDispMgr()->Create());
+		}
+
+		CMapDisp *pDisp = EditDispMgr()->GetDisp(m_DispHandle);
+		pDisp->SetParent(this);
+		pDisp->LoadUndoState(buf, bUpdateDependencies);
+	}
+	else
+	{
+		SetDisp(EDITDISPHANDLE_INVALID);
+	}
+
+	r = buf.GetUnsignedChar();
+	g = buf.GetUnsignedChar();
+	b = buf.GetUnsignedChar();
+	m_uchAlpha = buf.GetUnsignedChar();
+	m_bIgnoreLighting = (buf.GetUnsignedChar() != 0);
+	m_fSmoothingGroups = buf.GetUnsignedInt();
+
+	// Delete any existing and build any new detail objects
+	delete m_pDetailObjects;
+	m_pDetailObjects = NULL;
+	DetailObjects::BuildAnyDetailObjects(this);
+
+	UpdateFaceFlags();
+}
+
+
 //-----------------------------------------------------------------------------
 // Called any time this object is modified due to an Undo or Redo.
 //-----------------------------------------------------------------------------
@@ -2615,7 +2761,7 @@ ChunkFileResult_t CMapFace::LoadPointDataKeyCallback(const char* szKey, const ch
 	{
 		Vector p;
 		int num = 0;
-		int nRead = sscanf(szValue, "%i %f %f %f", &num, &p.x, &p.y, &p.z);
+		int nRead = CChunkFile::ScanValue(szValue, "%i %f %f %f", &num, &p.x, &p.y, &p.z);
 
 		if (nRead != 4)
 			return ChunkFile_Fail;
@@ -2648,7 +2794,7 @@ ChunkFileResult_t CMapFace::LoadKeyCallback(const char *szKey, const char *szVal
 	}
 	else if (!stricmp(szKey, "plane"))
 	{
-		int nRead = sscanf(szValue, "(%f %f %f) (%f %f %f) (%f %f %f)",
+		int nRead = CChunkFile::ScanValue(szValue, "(%f %f %f) (%f %f %f) (%f %f %f)",
 			&pFace->plane.planepts[0][0], &pFace->plane.planepts[0][1], &pFace->plane.planepts[0][2],
 			&pFace->plane.planepts[1][0], &pFace->plane.planepts[1][1], &pFace->plane.planepts[1][2],
 			&pFace->plane.planepts[2][0], &pFace->plane.planepts[2][1], &pFace->plane.planepts[2][2]);
@@ -2665,7 +2811,7 @@ ChunkFileResult_t CMapFace::LoadKeyCallback(const char *szKey, const char *szVal
 	}
 	else if (!stricmp(szKey, "uaxis"))
 	{
-		int nRead = sscanf(szValue, "[%f %f %f %f] %f",
+		int nRead = CChunkFile::ScanValue(szValue, "[%f %f %f %f] %f",
 			&pFace->texture.UAxis[0], &pFace->texture.UAxis[1], &pFace->texture.UAxis[2], &pFace->texture.UAxis[3], &pFace->texture.scale[0]);
 
 		if (nRead != 5)
@@ -2676,7 +2822,7 @@ ChunkFileResult_t CMapFace::LoadKeyCallback(const char *szKey, const char *szVal
 	}
 	else if (!stricmp(szKey, "vaxis"))
 	{
-		int nRead = sscanf(szValue, "[%f %f %f %f] %f",
+		int nRead = CChunkFile::ScanValue(szValue, "[%f %f %f %f] %f",
 			&pFace->texture.VAxis[0], &pFace->texture.VAxis[1], &pFace->texture.VAxis[2], &pFace->texture.VAxis[3], &pFace->texture.scale[1]);
 
 		if (nRead != 5)
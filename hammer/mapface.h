@@ -22,6 +22,7 @@ class IEditorTexture;
 class CRender;
 class CRender3D;
 class CChunkFile;
+class CUtlBuffer;
 class CSaveInfo;
 class IMaterial;
 class CMapWorld;
@@ -229,6 +230,11 @@ public:
 	void CreateFace(Vector *pPoints, int nPoints, bool bIsCordonFace = false);
 	void CreateFace(winding_t *w, int nFlags = 0);
 	CMapFace *CopyFrom(const CMapFace *pFrom, DWORD dwFlags = COPY_FACE_POINTS, bool bUpdateDependencies = true );
+
+	// Compact binary form of the data CopyFrom copies with COPY_FACE_POINTS, for the
+	// undo history. The selection state is left out.
+	void SaveUndoState(CUtlBuffer &buf);
+	void LoadUndoState(CUtlBuffer &buf, bool bUpdateDependencies);
 	size_t AllocatePoints(int nPoints);
 
 	void OnUndoRedo();
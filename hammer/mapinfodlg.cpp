@@ -84,6 +84,8 @@ void CMapInfoDlg::CountEntity(CMapEntity *pEntity)
 	{
 		m_uSolidEntityCount++;
 	}
+
+	pEntity->GetKeyValueMemoryStats(m_KeyValueStats);
 }
 
 
@@ -183,6 +185,7 @@ void CMapInfoDlg::DoDataExchange(CDataExchange *pDX)
 	DDX_Control(pDX, IDC_POINTENTITIES, m_PointEntities);
 	DDX_Control(pDX, IDC_UNIQUETEXTURES, m_UniqueTextures);
 	DDX_Control(pDX, IDC_TEXTUREMEMORY, m_TextureMemory);
+	DDX_Control(pDX, IDC_KEYVALUEMEMORY, m_KeyValueMemory);
 	DDX_Control(pDX, IDC_WADSUSED, m_WadsUsed);
 	//}}AFX_DATA_MAP
 }
@@ -202,6 +205,7 @@ BOOL CMapInfoDlg::OnInitDialog(void)
 	m_uFaceCount = 0;
 	m_uUniqueTextures = 0;
 	m_uTextureMemory = 0;
+	m_KeyValueStats = KeyValueMemoryStats_t();
 
 	// count objects!
 	pWorld->EnumChildren(CountObject, this);
@@ -226,6 +230,15 @@ BOOL CMapInfoDlg::OnInitDialog(void)
 	sprintf(szBuf, "%u bytes (%.2f MB)", m_uTextureMemory, (float)m_uTextureMemory / 1024000.0f);
 	m_TextureMemory.SetWindowText(szBuf);
 
+	//
+	// Keyvalue memory per entity, counting the shared key names, next to what
+	// the same keyvalues took with fixed size key and value buffers.
+	//
+	UINT uEntityCount = max(m_uPointEntityCount + m_uSolidEntityCount, 1U);
+	int nKeyValueBytes = m_KeyValueStats.m_nBytes + KeyValue_GetKeyTableSize();
+	sprintf(szBuf, "%u bytes/entity (was %u)", nKeyValueBytes / uEntityCount, m_KeyValueStats.m_nFixedSizeBytes / uEntityCount);
+	m_KeyValueMemory.SetWindowText(szBuf);
+
 	return TRUE;
 }
 
@@ -36,6 +36,7 @@ class CMapInfoDlg : public CDialog
 		CStatic	m_PointEntities;
 		CStatic	m_TextureMemory;
 		CStatic	m_UniqueTextures;
+		CStatic	m_KeyValueMemory;
 		CListBox m_WadsUsed;
 		//}}AFX_DATA
 
@@ -55,6 +56,8 @@ class CMapInfoDlg : public CDialog
 		UINT m_uUniqueTextures;
 		UINT m_uTextureMemory;
 
+		KeyValueMemoryStats_t m_KeyValueStats;
+
 		IEditorTexture *m_pTextures[1024];
 
 	// Implementation
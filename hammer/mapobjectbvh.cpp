@@ -0,0 +1,626 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Dynamic bounding volume hierarchy over map objects. The tree is
+//			built top-down when a map is loaded and then maintained with
+//			surface area guided insertion, removal and bottom-up refits as
+//			objects are created, deleted and edited.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "stdafx.h"
+#include "mapclass.h"
+#include "mapobjectbvh.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns half the surface area of the given box, which is all the
+//			insertion cost heuristic needs.
+//-----------------------------------------------------------------------------
+static inline float BoxHalfArea(const Vector &vecMins, const Vector &vecMaxs)
+{
+	Vector vecSize = vecMaxs - vecMins;
+	return(vecSize.x * vecSize.y + vecSize.y * vecSize.z + vecSize.z * vecSize.x);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the half area of the union of two boxes.
+//-----------------------------------------------------------------------------
+static inline float UnionHalfArea(const Vector &vecMins1, const Vector &vecMaxs1, const Vector &vecMins2, const Vector &vecMaxs2)
+{
+	Vector vecMins = vecMins1.Min(vecMins2);
+	Vector vecMaxs = vecMaxs1.Max(vecMaxs2);
+	return(BoxHalfArea(vecMins, vecMaxs));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+CMapObjectBVH::CMapObjectBVH(void)
+{
+	m_nRoot = -1;
+	m_nFreeList = -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+CMapObjectBVH::~CMapObjectBVH(void)
+{
+	RemoveAll();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Empties the tree.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::RemoveAll(void)
+{
+	m_Nodes.Purge();
+	m_ObjectToNode.Purge();
+	m_nRoot = -1;
+	m_nFreeList = -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns a node from the free list, growing the node array if needed.
+//-----------------------------------------------------------------------------
+int CMapObjectBVH::AllocNode(void)
+{
+	int nNode = m_nFreeList;
+	if (nNode != -1)
+	{
+		m_nFreeList = m_Nodes[nNode].m_nParent;
+	}
+	else
+	{
+		nNode = m_Nodes.AddToTail();
+	}
+
+	BVHNode_t &Node = m_Nodes[nNode];
+	Node.m_nParent = -1;
+	Node.m_nChildren[0] = -1;
+	Node.m_nChildren[1] = -1;
+	Node.m_pObject = NULL;
+
+	return(nNode);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns a node to the free list.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::FreeNode(int nNode)
+{
+	BVHNode_t &Node = m_Nodes[nNode];
+	Node.m_pObject = NULL;
+	Node.m_nChildren[0] = -1;
+	Node.m_nChildren[1] = -1;
+	Node.m_nParent = m_nFreeList;
+	m_nFreeList = nNode;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the tree from scratch over the given objects. A top-down
+//			build gives a much better tree than inserting one at a time, so
+//			this is used whenever a whole world is (re)loaded.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::Build(CMapClass **ppObjects, int nObjects)
+{
+	RemoveAll();
+
+	if (nObjects == 0)
+	{
+		return;
+	}
+
+	m_Nodes.EnsureCapacity(nObjects * 2);
+	m_ObjectToNode.Reserve(nObjects);
+
+	CUtlVector<int> Leaves;
+	Leaves.EnsureCapacity(nObjects);
+
+	for (int i = 0; i < nObjects; i++)
+	{
+		CMapClass *pObject = ppObjects[i];
+		if (HasObject(pObject))
+		{
+			continue;
+		}
+
+		int nLeaf = AllocNode();
+		BVHNode_t &Leaf = m_Nodes[nLeaf];
+		Leaf.m_pObject = pObject;
+		pObject->GetCullBox(Leaf.m_vecMins, Leaf.m_vecMaxs);
+
+		m_ObjectToNode.Insert(pObject, nLeaf);
+		Leaves.AddToTail(nLeaf);
+	}
+
+	if (Leaves.Count() != 0)
+	{
+		m_nRoot = BuildRecurse(Leaves.Base(), Leaves.Count(), -1);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds a subtree over the given leaves by splitting them at the
+//			midpoint of their centroids along the widest axis.
+// Output : Returns the index of the subtree's root node.
+//-----------------------------------------------------------------------------
+int CMapObjectBVH::BuildRecurse(int *pLeaves, int nLeaves, int nParent)
+{
+	if (nLeaves == 1)
+	{
+		m_Nodes[pLeaves[0]].m_nParent = nParent;
+		return(pLeaves[0]);
+	}
+
+	Vector vecCenterMins(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vector vecCenterMaxs(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for (int i = 0; i < nLeaves; i++)
+	{
+		const BVHNode_t &Leaf = m_Nodes[pLeaves[i]];
+		Vector vecCenter = (Leaf.m_vecMins + Leaf.m_vecMaxs) * 0.5f;
+		vecCenterMins = vecCenterMins.Min(vecCenter);
+		vecCenterMaxs = vecCenterMaxs.Max(vecCenter);
+	}
+
+	Vector vecExtent = vecCenterMaxs - vecCenterMins;
+	int nAxis = 0;
+	if (vecExtent.y > vecExtent[nAxis])
+	{
+		nAxis = 1;
+	}
+	if (vecExtent.z > vecExtent[nAxis])
+	{
+		nAxis = 2;
+	}
+
+	//
+	// Partition the leaves about the midpoint. Centroids are compared doubled
+	// to avoid a multiply per leaf.
+	//
+	float flSplit = vecCenterMins[nAxis] + vecCenterMaxs[nAxis];
+	int nLeft = 0;
+	int nRight = nLeaves - 1;
+	while (nLeft <= nRight)
+	{
+		const BVHNode_t &Leaf = m_Nodes[pLeaves[nLeft]];
+		if (Leaf.m_vecMins[nAxis] + Leaf.m_vecMaxs[nAxis] < flSplit)
+		{
+			nLeft++;
+		}
+		else
+		{
+			int nTemp = pLeaves[nLeft];
+			pLeaves[nLeft] = pLeaves[nRight];
+			pLeaves[nRight] = nTemp;
+			nRight--;
+		}
+	}
+
+	//
+	// All the centroids coincide; split the list in half instead.
+	//
+	if ((nLeft == 0) || (nLeft == nLeaves))
+	{
+		nLeft = nLeaves / 2;
+	}
+
+	int nNode = AllocNode();
+	m_Nodes[nNode].m_nParent = nParent;
+
+	int nChild0 = BuildRecurse(pLeaves, nLeft, nNode);
+	int nChild1 = BuildRecurse(pLeaves + nLeft, nLeaves - nLeft, nNode);
+
+	BVHNode_t &Node = m_Nodes[nNode];
+	Node.m_nChildren[0] = nChild0;
+	Node.m_nChildren[1] = nChild1;
+	Node.m_vecMins = m_Nodes[nChild0].m_vecMins.Min(m_Nodes[nChild1].m_vecMins);
+	Node.m_vecMaxs = m_Nodes[nChild0].m_vecMaxs.Max(m_Nodes[nChild1].m_vecMaxs);
+
+	return(nNode);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Recomputes the bounds of the given node and all of its ancestors.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::RefitAncestors(int nNode)
+{
+	while (nNode != -1)
+	{
+		BVHNode_t &Node = m_Nodes[nNode];
+		const BVHNode_t &Child0 = m_Nodes[Node.m_nChildren[0]];
+		const BVHNode_t &Child1 = m_Nodes[Node.m_nChildren[1]];
+
+		Vector vecMins = Child0.m_vecMins.Min(Child1.m_vecMins);
+		Vector vecMaxs = Child0.m_vecMaxs.Max(Child1.m_vecMaxs);
+
+		//
+		// Once a node's bounds stop changing, none of its ancestors can change either.
+		//
+		if ((vecMins == Node.m_vecMins) && (vecMaxs == Node.m_vecMaxs))
+		{
+			break;
+		}
+
+		Node.m_vecMins = vecMins;
+		Node.m_vecMaxs = vecMaxs;
+		nNode = Node.m_nParent;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Links a leaf into the tree next to the sibling that grows the total
+//			surface area of the tree the least.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::InsertLeaf(int nLeaf)
+{
+	if (m_nRoot == -1)
+	{
+		m_nRoot = nLeaf;
+		m_Nodes[nLeaf].m_nParent = -1;
+		return;
+	}
+
+	Vector vecMins = m_Nodes[nLeaf].m_vecMins;
+	Vector vecMaxs = m_Nodes[nLeaf].m_vecMaxs;
+
+	int nSibling = m_nRoot;
+	while (!m_Nodes[nSibling].IsLeaf())
+	{
+		const BVHNode_t &Node = m_Nodes[nSibling];
+
+		float flArea = BoxHalfArea(Node.m_vecMins, Node.m_vecMaxs);
+		float flCombinedArea = UnionHalfArea(Node.m_vecMins, Node.m_vecMaxs, vecMins, vecMaxs);
+
+		// Cost of making a new parent for this node and the new leaf.
+		float flCost = 2.0f * flCombinedArea;
+
+		// Minimum cost of pushing the leaf further down the tree.
+		float flInheritanceCost = 2.0f * (flCombinedArea - flArea);
+
+		float flChildCost[2];
+		for (int i = 0; i < 2; i++)
+		{
+			const BVHNode_t &Child = m_Nodes[Node.m_nChildren[i]];
+			flChildCost[i] = UnionHalfArea(Child.m_vecMins, Child.m_vecMaxs, vecMins, vecMaxs) + flInheritanceCost;
+			if (!Child.IsLeaf())
+			{
+				flChildCost[i] -= BoxHalfArea(Child.m_vecMins, Child.m_vecMaxs);
+			}
+		}
+
+		if ((flCost <= flChildCost[0]) && (flCost <= flChildCost[1]))
+		{
+			break;
+		}
+
+		nSibling = (flChildCost[0] < flChildCost[1]) ? Node.m_nChildren[0] : Node.m_nChildren[1];
+	}
+
+	//
+	// Make a new parent for the sibling and the leaf.
+	//
+	int nOldParent = m_Nodes[nSibling].m_nParent;
+	int nNewParent = AllocNode();
+
+	BVHNode_t &NewParent = m_Nodes[nNewParent];
+	NewParent.m_nParent = nOldParent;
+	NewParent.m_nChildren[0] = nSibling;
+	NewParent.m_nChildren[1] = nLeaf;
+	NewParent.m_vecMins = m_Nodes[nSibling].m_vecMins.Min(vecMins);
+	NewParent.m_vecMaxs = m_Nodes[nSibling].m_vecMaxs.Max(vecMaxs);
+
+	m_Nodes[nSibling].m_nParent = nNewParent;
+	m_Nodes[nLeaf].m_nParent = nNewParent;
+
+	if (nOldParent == -1)
+	{
+		m_nRoot = nNewParent;
+	}
+	else
+	{
+		BVHNode_t &OldParent = m_Nodes[nOldParent];
+		OldParent.m_nChildren[(OldParent.m_nChildren[0] == nSibling) ? 0 : 1] = nNewParent;
+		RefitAncestors(nOldParent);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Unlinks a leaf from the tree, collapsing its parent into its sibling.
+//			The leaf node itself is left allocated.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::RemoveLeaf(int nLeaf)
+{
+	if (nLeaf == m_nRoot)
+	{
+		m_nRoot = -1;
+		return;
+	}
+
+	int nParent = m_Nodes[nLeaf].m_nParent;
+	int nGrandParent = m_Nodes[nParent].m_nParent;
+	int nSibling = (m_Nodes[nParent].m_nChildren[0] == nLeaf) ? m_Nodes[nParent].m_nChildren[1] : m_Nodes[nParent].m_nChildren[0];
+
+	m_Nodes[nSibling].m_nParent = nGrandParent;
+	m_Nodes[nLeaf].m_nParent = -1;
+
+	if (nGrandParent == -1)
+	{
+		m_nRoot = nSibling;
+	}
+	else
+	{
+		BVHNode_t &GrandParent = m_Nodes[nGrandParent];
+		GrandParent.m_nChildren[(GrandParent.m_nChildren[0] == nParent) ? 0 : 1] = nSibling;
+	}
+
+	FreeNode(nParent);
+
+	if (nGrandParent != -1)
+	{
+		RefitAncestors(nGrandParent);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds an object to the tree. Does nothing if it is already there.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::AddObject(CMapClass *pObject)
+{
+	if (HasObject(pObject))
+	{
+		return;
+	}
+
+	int nLeaf = AllocNode();
+	BVHNode_t &Leaf = m_Nodes[nLeaf];
+	Leaf.m_pObject = pObject;
+	pObject->GetCullBox(Leaf.m_vecMins, Leaf.m_vecMaxs);
+
+	m_ObjectToNode.Insert(pObject, nLeaf);
+	InsertLeaf(nLeaf);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Removes an object from the tree, if it is there.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::RemoveObject(CMapClass *pObject)
+{
+	UtlHashHandle_t h = m_ObjectToNode.Find(pObject);
+	if (h == m_ObjectToNode.InvalidHandle())
+	{
+		return;
+	}
+
+	int nLeaf = m_ObjectToNode.Element(h);
+	m_ObjectToNode.Remove(pObject);
+
+	RemoveLeaf(nLeaf);
+	FreeNode(nLeaf);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Brings an object's leaf up to date with its culling box. Objects
+//			that shrank or stayed put are refit in place; objects that grew
+//			out of their old box are reinserted so the tree stays tight.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::UpdateObject(CMapClass *pObject)
+{
+	UtlHashHandle_t h = m_ObjectToNode.Find(pObject);
+	if (h == m_ObjectToNode.InvalidHandle())
+	{
+		AddObject(pObject);
+		return;
+	}
+
+	int nLeaf = m_ObjectToNode.Element(h);
+
+	Vector vecMins, vecMaxs;
+	pObject->GetCullBox(vecMins, vecMaxs);
+
+	BVHNode_t &Leaf = m_Nodes[nLeaf];
+	if ((vecMins == Leaf.m_vecMins) && (vecMaxs == Leaf.m_vecMaxs))
+	{
+		return;
+	}
+
+	bool bContained = (vecMins.x >= Leaf.m_vecMins.x) && (vecMins.y >= Leaf.m_vecMins.y) && (vecMins.z >= Leaf.m_vecMins.z) &&
+					  (vecMaxs.x <= Leaf.m_vecMaxs.x) && (vecMaxs.y <= Leaf.m_vecMaxs.y) && (vecMaxs.z <= Leaf.m_vecMaxs.z);
+
+	Leaf.m_vecMins = vecMins;
+	Leaf.m_vecMaxs = vecMaxs;
+
+	if (bContained)
+	{
+		RefitAncestors(Leaf.m_nParent);
+	}
+	else
+	{
+		RemoveLeaf(nLeaf);
+		InsertLeaf(nLeaf);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds every object whose box is crossed by the segment from
+//			vecStart to vecEnd.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::EnumerateRay(const Vector &vecStart, const Vector &vecEnd, CUtlVector<MapObjectRayHit_t> &Hits) const
+{
+	if (m_nRoot == -1)
+	{
+		return;
+	}
+
+	Vector vecDelta = vecEnd - vecStart;
+	Vector vecInvDelta;
+	for (int nAxis = 0; nAxis < 3; nAxis++)
+	{
+		vecInvDelta[nAxis] = (vecDelta[nAxis] != 0.0f) ? 1.0f / vecDelta[nAxis] : FLT_MAX;
+	}
+
+	CUtlVectorFixedGrowable<int, 64> Stack;
+	Stack.AddToTail(m_nRoot);
+
+	while (Stack.Count() != 0)
+	{
+		int nNode = Stack.Tail();
+		Stack.RemoveMultipleFromTail(1);
+
+		const BVHNode_t &Node = m_Nodes[nNode];
+
+		float flEnter;
+		if (!ClipSegmentToBox(vecStart, vecInvDelta, Node.m_vecMins, Node.m_vecMaxs, flEnter))
+		{
+			continue;
+		}
+
+		if (Node.IsLeaf())
+		{
+			MapObjectRayHit_t &Hit = Hits[Hits.AddToTail()];
+			Hit.m_pObject = Node.m_pObject;
+			Hit.m_flEnterFraction = flEnter;
+		}
+		else
+		{
+			Stack.AddToTail(Node.m_nChildren[0]);
+			Stack.AddToTail(Node.m_nChildren[1]);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds every object whose box is not entirely outside one of the
+//			given planes (see BoxOutsidePlanes for the plane convention).
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::EnumerateFrustum(const Vector4D *pPlanes, int nPlanes, CUtlVector<CMapClass *> &Objects) const
+{
+	if (m_nRoot == -1)
+	{
+		return;
+	}
+
+	Assert(nPlanes <= 32);
+
+	//
+	// Each entry carries the planes its node may still cross. A node entirely
+	// inside a plane drops it for the whole subtree, so subtrees well inside
+	// the frustum are walked without any plane tests.
+	//
+	struct FrustumStackEntry_t
+	{
+		int m_nNode;
+		unsigned int m_nPlaneMask;
+	};
+
+	CUtlVectorFixedGrowable<FrustumStackEntry_t, 64> Stack;
+	FrustumStackEntry_t &Root = Stack[Stack.AddToTail()];
+	Root.m_nNode = m_nRoot;
+	Root.m_nPlaneMask = (nPlanes < 32) ? ((1u << nPlanes) - 1) : ~0u;
+
+	while (Stack.Count() != 0)
+	{
+		FrustumStackEntry_t Entry = Stack.Tail();
+		Stack.RemoveMultipleFromTail(1);
+
+		const BVHNode_t &Node = m_Nodes[Entry.m_nNode];
+
+		bool bOutside = false;
+		for (int i = 0; (i < nPlanes) && (Entry.m_nPlaneMask != 0); i++)
+		{
+			if (Entry.m_nPlaneMask & (1u << i))
+			{
+				int nSide = ClassifyBoxPlane(pPlanes[i], Node.m_vecMins, Node.m_vecMaxs);
+				if (nSide < 0)
+				{
+					bOutside = true;
+					break;
+				}
+
+				if (nSide > 0)
+				{
+					Entry.m_nPlaneMask &= ~(1u << i);
+				}
+			}
+		}
+
+		if (bOutside)
+		{
+			continue;
+		}
+
+		if (Node.IsLeaf())
+		{
+			Objects.AddToTail(Node.m_pObject);
+		}
+		else
+		{
+			for (int nChild = 0; nChild < 2; nChild++)
+			{
+				FrustumStackEntry_t &Child = Stack[Stack.AddToTail()];
+				Child.m_nNode = Node.m_nChildren[nChild];
+				Child.m_nPlaneMask = Entry.m_nPlaneMask;
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds every object whose box intersects the given box.
+//-----------------------------------------------------------------------------
+void CMapObjectBVH::EnumerateBox(const Vector &vecMins, const Vector &vecMaxs, CUtlVector<CMapClass *> &Objects) const
+{
+	if (m_nRoot == -1)
+	{
+		return;
+	}
+
+	CUtlVectorFixedGrowable<int, 64> Stack;
+	Stack.AddToTail(m_nRoot);
+
+	while (Stack.Count() != 0)
+	{
+		int nNode = Stack.Tail();
+		Stack.RemoveMultipleFromTail(1);
+
+		const BVHNode_t &Node = m_Nodes[nNode];
+		if ((Node.m_vecMaxs.x < vecMins.x) || (Node.m_vecMins.x > vecMaxs.x) ||
+			(Node.m_vecMaxs.y < vecMins.y) || (Node.m_vecMins.y > vecMaxs.y) ||
+			(Node.m_vecMaxs.z < vecMins.z) || (Node.m_vecMins.z > vecMaxs.z))
+		{
+			continue;
+		}
+
+		if (Node.IsLeaf())
+		{
+			Objects.AddToTail(Node.m_pObject);
+		}
+		else
+		{
+			Stack.AddToTail(Node.m_nChildren[0]);
+			Stack.AddToTail(Node.m_nChildren[1]);
+		}
+	}
+}
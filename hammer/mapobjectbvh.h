@@ -0,0 +1,189 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Dynamic bounding volume hierarchy over map objects, keyed by their
+//			culling boxes. Supports incremental insert, remove and refit so it
+//			can be kept current as objects are edited.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef MAPOBJECTBVH_H
+#define MAPOBJECTBVH_H
+#pragma once
+
+#include "mathlib/vector.h"
+#include "mathlib/vector4d.h"
+#include "utlvector.h"
+#include "utlhashtable.h"
+
+class CMapClass;
+
+
+//
+// An object whose box is crossed by a ray, with the parametric distance
+// along the ray at which the ray enters the box.
+//
+struct MapObjectRayHit_t
+{
+	CMapClass *m_pObject;
+	float m_flEnterFraction;
+};
+
+
+class CMapObjectBVH
+{
+	public:
+
+		CMapObjectBVH(void);
+		~CMapObjectBVH(void);
+
+		//
+		// Building and maintenance.
+		//
+		void Build(CMapClass **ppObjects, int nObjects);
+		void RemoveAll(void);
+
+		void AddObject(CMapClass *pObject);
+		void RemoveObject(CMapClass *pObject);
+		void UpdateObject(CMapClass *pObject);
+
+		inline bool HasObject(CMapClass *pObject) const { return(m_ObjectToNode.Find(pObject) != m_ObjectToNode.InvalidHandle()); }
+		inline int GetObjectCount(void) const { return(m_ObjectToNode.Count()); }
+
+		//
+		// Queries. Results are appended to the given list.
+		//
+		void EnumerateRay(const Vector &vecStart, const Vector &vecEnd, CUtlVector<MapObjectRayHit_t> &Hits) const;
+		void EnumerateFrustum(const Vector4D *pPlanes, int nPlanes, CUtlVector<CMapClass *> &Objects) const;
+		void EnumerateBox(const Vector &vecMins, const Vector &vecMaxs, CUtlVector<CMapClass *> &Objects) const;
+
+	protected:
+
+		struct BVHNode_t
+		{
+			Vector m_vecMins;
+			Vector m_vecMaxs;
+			int m_nParent;				// Parent node, or the next free node when on the free list.
+			int m_nChildren[2];			// Child nodes, -1 for leaves.
+			CMapClass *m_pObject;		// Object held by a leaf, NULL for interior nodes.
+
+			inline bool IsLeaf(void) const { return(m_nChildren[0] == -1); }
+		};
+
+		int AllocNode(void);
+		void FreeNode(int nNode);
+
+		int BuildRecurse(int *pLeaves, int nLeaves, int nParent);
+		void InsertLeaf(int nLeaf);
+		void RemoveLeaf(int nLeaf);
+		void RefitAncestors(int nNode);
+
+		CUtlVector<BVHNode_t> m_Nodes;
+		int m_nRoot;
+		int m_nFreeList;
+
+		CUtlHashtable<CMapClass *, int, PointerHashFunctor> m_ObjectToNode;
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Clips a line segment against a box.
+// Input  : vecStart - Start of the segment.
+//			vecInvDelta - Reciprocal of the segment's delta on each axis.
+// Output : Returns true if the segment touches the box, with the fraction along
+//			the segment at which it enters the box in flEnter.
+//-----------------------------------------------------------------------------
+inline bool ClipSegmentToBox(const Vector &vecStart, const Vector &vecInvDelta, const Vector &vecMins, const Vector &vecMaxs, float &flEnter)
+{
+	float flMin = 0.0f;
+	float flMax = 1.0f;
+
+	for (int nAxis = 0; nAxis < 3; nAxis++)
+	{
+		float t1 = (vecMins[nAxis] - vecStart[nAxis]) * vecInvDelta[nAxis];
+		float t2 = (vecMaxs[nAxis] - vecStart[nAxis]) * vecInvDelta[nAxis];
+
+		//
+		// Axes the segment doesn't move along use FLT_MAX as their reciprocal,
+		// so the slab either spans the whole segment or rejects it outright.
+		//
+		if (t1 > t2)
+		{
+			float flTemp = t1;
+			t1 = t2;
+			t2 = flTemp;
+		}
+
+		if (t1 > flMin)
+		{
+			flMin = t1;
+		}
+
+		if (t2 < flMax)
+		{
+			flMax = t2;
+		}
+
+		if (!(flMin <= flMax))
+		{
+			return(false);
+		}
+	}
+
+	flEnter = flMin;
+	return(true);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Classifies a box against a plane. Planes follow the CCamera
+//			convention: points with DotProduct(normal, p) < dist are on the inside.
+// Output : Returns -1 if the box is entirely outside the plane, 1 if it is
+//			entirely inside, 0 if it straddles the plane.
+//-----------------------------------------------------------------------------
+inline int ClassifyBoxPlane(const Vector4D &Plane, const Vector &vecMins, const Vector &vecMaxs)
+{
+	Vector vecNear;
+	Vector vecFar;
+
+	vecNear.x = (Plane.x > 0) ? vecMins.x : vecMaxs.x;
+	vecNear.y = (Plane.y > 0) ? vecMins.y : vecMaxs.y;
+	vecNear.z = (Plane.z > 0) ? vecMins.z : vecMaxs.z;
+
+	if (DotProduct(Plane.AsVector3D(), vecNear) >= Plane.w)
+	{
+		return(-1);
+	}
+
+	vecFar.x = (Plane.x > 0) ? vecMaxs.x : vecMins.x;
+	vecFar.y = (Plane.y > 0) ? vecMaxs.y : vecMins.y;
+	vecFar.z = (Plane.z > 0) ? vecMaxs.z : vecMins.z;
+
+	if (DotProduct(Plane.AsVector3D(), vecFar) < Plane.w)
+	{
+		return(1);
+	}
+
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the box lies entirely on the outside of any of the
+//			given planes, using the same convention as ClassifyBoxPlane.
+//-----------------------------------------------------------------------------
+inline bool BoxOutsidePlanes(const Vector4D *pPlanes, int nPlanes, const Vector &vecMins, const Vector &vecMaxs)
+{
+	for (int i = 0; i < nPlanes; i++)
+	{
+		if (ClassifyBoxPlane(pPlanes[i], vecMins, vecMaxs) < 0)
+		{
+			return(true);
+		}
+	}
+
+	return(false);
+}
+
+
+#endif // MAPOBJECTBVH_H
@@ -67,7 +67,7 @@ CMapPathNode &CMapPathNode::operator=(const CMapPathNode &src)
 	for ( int i=src.kv.GetFirst(); i != src.kv.GetInvalidIndex(); i=src.kv.GetNext( i ) )
 	{
 		MDkeyvalue KeyValue = src.kv.GetKeyValue(i);
-		kv.SetValue(KeyValue.szKey, KeyValue.szValue);
+		kv.SetValue(KeyValue.Key(), KeyValue.Value());
 	}
 	pos = src.pos;
 	dwID = src.dwID;
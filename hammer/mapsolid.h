@@ -50,6 +50,8 @@ public:
 	//
 	static void PreloadWorld( void );
 	static int GetBadSolidCount( void );
+	static int BeginDeferredBuild( void );
+	static void EndDeferredBuild( int nFirstSolid );
 	virtual void PostloadWorld(CMapWorld *pWorld);
 	ChunkFileResult_t LoadVMF( CChunkFile *pFile, bool &bValid );
 	ChunkFileResult_t SaveVMF( CChunkFile *pFile, CSaveInfo *pSaveInfo );
@@ -69,6 +71,10 @@ public:
 	void CalcBounds( BOOL bFullUpdate = FALSE );
 	virtual CMapClass *Copy(bool bUpdateDependencies);
 	virtual CMapClass *CopyFrom(CMapClass *pFrom, bool bUpdateDependencies);
+
+	// For the undo history, which keeps the faces separately.
+	CMapSolid *CopyWithoutFaces(void);
+	void CopyFromWithoutFaces(CMapSolid *pFrom, bool bUpdateDependencies);
 	int Split(PLANE *pPlane, CMapSolid **pFront = NULL, CMapSolid **pBack = NULL);
 	bool Subtract(CMapObjectList *pInside, CMapObjectList *pOutside, CMapClass *pSubtractWith);
 
@@ -161,6 +167,8 @@ protected:
 
 	bool m_bValid : 1;						// Is it a proper convex solid?
 	bool m_bIsCordonBrush : 1;				// Whether this brush was added by the cordon tool.
+
+	int m_nDeferredIndex;					// Index in the list of solids waiting for EndDeferredBuild, -1 if none.
 };
 
 
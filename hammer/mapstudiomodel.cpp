@@ -912,64 +912,62 @@ const vertexFileHeader_t* mstudiomodel_t::CacheVertexData( void *pModelData )
 	return g_pStudioDataCache->CacheVertexData( (studiohdr_t*)pModelData );
 }
 
-void CMapStudioModel::AddShadowingTriangles( CUtlVector<Vector>& tri_list )
+//-----------------------------------------------------------------------------
+// Purpose: Adds the triangles of the model's root LOD, in its rest pose, to a
+//			list of vertices, three per triangle.
+// Input  : transform - model to world transform.
+//			bAllBodygroups - whether to add every model of each bodypart rather
+//				than just the ones the bodygroups select.
+//-----------------------------------------------------------------------------
+void CMapStudioModel::AddMeshTriangles( CUtlVector<Vector> &tri_list, const VMatrix &transform, bool bAllBodygroups )
 {
-	if ( m_pStudioModel != NULL )
+	const studiohdr_t* pHdr = m_pStudioModel->GetStudioHdr()->GetRenderHdr();
+	studiomeshdata_t *pStudioMeshes = m_pStudioModel->GetHardwareData()->m_pLODs[0].m_pMeshData;
+	for ( int i = 0; i < pHdr->numbodyparts; ++i )
 	{
-		Vector origin;
-		QAngle angles;
-		GetOrigin( origin );
-		GetRenderAngles( angles );
-
-		VMatrix transform;
-		transform.SetupMatrixOrgAngles( origin, angles );
-		if ( m_bExtraRotation )
-			RotateAroundAxis( transform, 90, 2 );
-		const studiohdr_t* pHdr = m_pStudioModel->GetStudioHdr()->GetRenderHdr();
-		studiomeshdata_t *pStudioMeshes = m_pStudioModel->GetHardwareData()->m_pLODs[0].m_pMeshData;
-		for ( int i = 0; i < pHdr->numbodyparts; ++i )
+		mstudiobodyparts_t* pBodypart = pHdr->pBodypart( i );
+		for ( int j = 0; j < pBodypart->nummodels; ++j )
 		{
-			mstudiobodyparts_t* pBodypart = pHdr->pBodypart( i );
-			for ( int j = 0; j < pBodypart->nummodels; ++j )
+			if ( !bAllBodygroups && ( j != ( m_BodyGroup / pBodypart->base ) % pBodypart->nummodels ) )
+				continue;
+
+			const mstudiomodel_t* pModel = pBodypart->pModel( j );
+			for ( int k = 0; k < pModel->nummeshes; ++k )
 			{
-				const mstudiomodel_t* pModel = pBodypart->pModel( j );
-				for ( int k = 0; k < pModel->nummeshes; ++k )
-				{
-					mstudiomesh_t *pMesh = pModel->pMesh( k );
-					const mstudio_meshvertexdata_t* vertData = pMesh->GetVertexData( const_cast<studiohdr_t*>( pHdr ) );
-					studiomeshdata_t *pMeshData = &pStudioMeshes[pMesh->meshid];
-					if ( pMeshData->m_NumGroup == 0 )
-						continue;
+				mstudiomesh_t *pMesh = pModel->pMesh( k );
+				const mstudio_meshvertexdata_t* vertData = pMesh->GetVertexData( const_cast<studiohdr_t*>( pHdr ) );
+				studiomeshdata_t *pMeshData = &pStudioMeshes[pMesh->meshid];
+				if ( pMeshData->m_NumGroup == 0 )
+					continue;
 
-					for ( int stripGroupID = 0; stripGroupID < pMeshData->m_NumGroup; stripGroupID++ )
+				for ( int stripGroupID = 0; stripGroupID < pMeshData->m_NumGroup; stripGroupID++ )
+				{
+					studiomeshgroup_t *pMeshGroup = &pMeshData->m_pMeshGroup[stripGroupID];
+					for ( int stripID = 0; stripID < pMeshGroup->m_NumStrips; stripID++ )
 					{
-						studiomeshgroup_t *pMeshGroup = &pMeshData->m_pMeshGroup[stripGroupID];
-						for ( int stripID = 0; stripID < pMeshGroup->m_NumStrips; stripID++ )
-						{
-							OptimizedModel::StripHeader_t *pStripData = &pMeshGroup->m_pStripData[stripID];
+						OptimizedModel::StripHeader_t *pStripData = &pMeshGroup->m_pStripData[stripID];
 
-							if ( pStripData->flags & OptimizedModel::STRIP_IS_TRILIST )
+						if ( pStripData->flags & OptimizedModel::STRIP_IS_TRILIST )
+						{
+							for ( int i = 0; i < pStripData->numIndices; i += 3 )
 							{
-								for ( int i = 0; i < pStripData->numIndices; i += 3 )
-								{
-									int idx = pStripData->indexOffset + i;
-
-									tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx ) ) ) );
-									tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 1 ) ) ) );
-									tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 2 ) ) ) );
-								}
+								int idx = pStripData->indexOffset + i;
+
+								tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx ) ) ) );
+								tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 1 ) ) ) );
+								tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 2 ) ) ) );
 							}
-							else
+						}
+						else
+						{
+							Assert( pStripData->flags & OptimizedModel::STRIP_IS_TRISTRIP );
+							for (int i = 0; i < pStripData->numIndices - 2; ++i)
 							{
-								Assert( pStripData->flags & OptimizedModel::STRIP_IS_TRISTRIP );
-								for (int i = 0; i < pStripData->numIndices - 2; ++i)
-								{
-									int idx = pStripData->indexOffset + i;
-									bool ccw = (i & 0x1) == 0;
-									tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx ) ) ) );
-									tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 1 + ccw ) ) ) );
-									tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 2 - ccw ) ) ) );
-								}
+								int idx = pStripData->indexOffset + i;
+								bool ccw = (i & 0x1) == 0;
+								tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx ) ) ) );
+								tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 1 + ccw ) ) ) );
+								tri_list.AddToTail( transform.VMul4x3( *vertData->Position( pMeshGroup->MeshIndex( idx + 2 - ccw ) ) ) );
 							}
 						}
 					}
@@ -980,6 +978,75 @@ void CMapStudioModel::AddShadowingTriangles( CUtlVector<Vector>& tri_list )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Adds the triangles of the model to the lighting preview's shadow
+//			casting geometry.
+//-----------------------------------------------------------------------------
+void CMapStudioModel::AddShadowingTriangles( CUtlVector<Vector>& tri_list )
+{
+	if ( m_pStudioModel != NULL )
+	{
+		Vector origin;
+		QAngle angles;
+		GetOrigin( origin );
+		GetRenderAngles( angles );
+
+		VMatrix transform;
+		transform.SetupMatrixOrgAngles( origin, angles );
+		if ( m_bExtraRotation )
+			RotateAroundAxis( transform, 90, 2 );
+		AddMeshTriangles( tri_list, transform, true );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the model is drawn as its bounding box rather than
+//			as a mesh when seen from the given point.
+//-----------------------------------------------------------------------------
+bool CMapStudioModel::IsRenderedAsBox( const Vector &ViewPoint )
+{
+	if ( m_pStudioModel == NULL )
+		return true;
+
+	return ( ( fabs( ViewPoint[0] - m_Origin[0] ) >= m_fRenderDistance ) ||
+			 ( fabs( ViewPoint[1] - m_Origin[1] ) >= m_fRenderDistance ) ||
+			 ( fabs( ViewPoint[2] - m_Origin[2] ) >= m_fRenderDistance ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Gets the world space triangles the model draws as its hit target,
+//			for picking without rendering.
+// Output : Returns false if the model's pose depends on its animation, in which
+//			case only rendering it picks it exactly.
+//-----------------------------------------------------------------------------
+bool CMapStudioModel::GetPickTriangles( CUtlVector<Vector> &tri_list )
+{
+	if ( m_pStudioModel == NULL )
+		return false;
+
+	const studiohdr_t *pHdr = m_pStudioModel->GetStudioHdr()->GetRenderHdr();
+	if ( ( pHdr->flags & STUDIOHDR_FLAGS_STATIC_PROP ) == 0 )
+		return false;
+
+	QAngle angles;
+	GetRenderAngles( angles );
+
+	VMatrix transform;
+	transform.SetupMatrixOrgAngles( m_Origin, angles );
+	if ( m_flModelScale != 1.0f )
+	{
+		VMatrix scale;
+		MatrixBuildScale( scale, m_flModelScale, m_flModelScale, m_flModelScale );
+		transform = transform * scale;
+	}
+
+	AddMeshTriangles( tri_list, transform, false );
+	return true;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose:
 // Output : int
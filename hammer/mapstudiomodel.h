@@ -68,6 +68,9 @@ class CMapStudioModel : public CMapHelper
 
 		void AddShadowingTriangles(CUtlVector<Vector>& tri_list);
 
+		bool IsRenderedAsBox(const Vector &ViewPoint);
+		bool GetPickTriangles(CUtlVector<Vector> &tri_list);
+
 		int GetFrame(void);
 		int GetMaxFrame(void);
 		void SetFrame(int nFrame);
@@ -93,6 +96,8 @@ class CMapStudioModel : public CMapHelper
 
 		void GetRenderAngles(QAngle &Angles);
 
+		void AddMeshTriangles(CUtlVector<Vector> &tri_list, const VMatrix &transform, bool bAllBodygroups);
+
 		//
 		// Implements CMapAtom transformation functions.
 		//
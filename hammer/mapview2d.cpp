@@ -209,8 +209,34 @@ void CMapView2D::AddToRenderLists(CMapClass *pObject)
 		m_RenderList.AddToTail(pObject);
 	}
 
-	// Recurse into children and add them.
+	// Let the world's BVH pick out the children in view, unless it is out of
+	// date because the map is still being loaded.
 	const CMapObjectList *pChildren = pObject->GetChildren();
+	if ( pObject->IsWorld() )
+	{
+		const CMapObjectBVH *pBVH = static_cast<CMapWorld *>(pObject)->ObjectBVH_Get();
+		if ( pBVH->GetObjectCount() == pChildren->Count() )
+		{
+			CUtlVector<CMapClass *> Objects;
+			pBVH->EnumerateBox( m_ViewMin, m_ViewMax, Objects );
+
+			for ( int i = 0; i < Objects.Count(); i++ )
+			{
+				AddToRenderLists( Objects[i] );
+			}
+
+			// The BVH never returns objects without a valid box, which the walk
+			// below doesn't cull, so the world keeps those on a list of their own.
+			const CUtlVector<CMapClass *> *pUnbounded = static_cast<CMapWorld *>(pObject)->ObjectBVH_GetUnbounded();
+			for ( int i = 0; i < pUnbounded->Count(); i++ )
+			{
+				AddToRenderLists( pUnbounded->Element( i ) );
+			}
+			return;
+		}
+	}
+
+	// Recurse into children and add them.
 	FOR_EACH_OBJ( *pChildren, pos )
 	{
 		AddToRenderLists(pChildren->Element(pos));
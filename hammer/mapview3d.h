@@ -105,6 +105,7 @@ public:
 	void EndPick(void);
 
 	DrawType_t GetDrawType() { return m_eDrawType; }
+	CRender3D *GetRender() { return m_pRender; }
 	void SetDrawType(DrawType_t eDrawType);
 
 	int			ObjectsAt( const Vector2D &point, HitInfo_t *pObjects, int nMaxObjects, unsigned int nFlags = 0 );
@@ -6,7 +6,6 @@
 
 #include "stdafx.h"
 #include "generichash.h"
-#include "culltreenode.h"
 #include "globalfunctions.h"
 #include "mainfrm.h"
 #include "mapdefs.h"
@@ -32,9 +31,6 @@
 #pragma warning(disable:4244)
 
 
-class CCullTreeNode;
-
-
 IMPLEMENT_MAPCLASS(CMapWorld)
 
 
@@ -146,10 +142,13 @@ void CMapWorld::Init()
 	m_Render2DBox.UpdateBounds(pt);
 
 	SetClass("worldspawn");
-	m_pCullTree = NULL;
 
 	m_nNextFaceID = 1;			// Face IDs start at 1. An ID of 0 means no ID.
 
+	m_bNamePrefixIndexDirty = false;
+
+	m_bShadowListAllDirty = true;
+
 	// create the world displacement manager
 	m_pWorldDispMgr = CreateWorldEditDispMgr();
 }
@@ -173,7 +172,7 @@ CMapWorld::CMapWorld( CMapDoc *pOwningDocument )
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Destructor. Deletes all paths in the world and the culling tree.
+// Purpose: Destructor. Deletes all paths in the world and empties the object BVH.
 //-----------------------------------------------------------------------------
 CMapWorld::~CMapWorld(void)
 {
@@ -181,9 +180,14 @@ CMapWorld::~CMapWorld(void)
 	m_Paths.PurgeAndDeleteElements();
 
 	//
-	// Delete the culling tree.
+	// Empty the object BVH.
 	//
-	CullTree_Free();
+	m_ObjectBVH.RemoveAll();
+	m_UnboundedChildren.RemoveAll();
+
+	// Delete the entity index buckets.
+	m_EntitiesByName.PurgeAndDeleteElements();
+	m_EntitiesByClass.PurgeAndDeleteElements();
 
 	// destroy the world displacement manager
 	DestroyWorldEditDispMgr( &m_pWorldDispMgr );
@@ -197,15 +201,18 @@ void CMapWorld::OnUndoRedo()
 {
 	BaseClass::OnUndoRedo();
 
-	// The cull tree doesn't get kept by the undo system so we need to rebuild it.
-	CullTree_Build();
+	// The object BVH doesn't get kept by the undo system so we need to rebuild it.
+	ObjectBVH_Build();
+
+	// Nor does the lighting preview's copy of the geometry.
+	ShadowList_MarkAllDirty();
 }
 
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Overridden to maintain the culling tree. Root level children of the
-//			world are kept in the culling tree.
+// Purpose: Overridden to maintain the object BVH. Root level children of the
+//			world are kept in the BVH.
 // Input  : pChild - object to add as a child.
 //-----------------------------------------------------------------------------
 void CMapWorld::AddChild(CMapClass *pChild)
@@ -213,11 +220,13 @@ void CMapWorld::AddChild(CMapClass *pChild)
 	CMapClass::AddChild(pChild);
 
 	//
-	// Add the object to the culling tree.
+	// Objects added during a level load don't have valid bounds yet. The BVH
+	// is rebuilt in one go once loading is done.
 	//
-	if (m_pCullTree != NULL)
+	if (CMapDoc::GetInLevelLoad() == 0)
 	{
-		m_pCullTree->AddCullTreeObjectRecurse(pChild);
+		m_ObjectBVH.AddObject(pChild);
+		ObjectBVH_UpdateUnbounded(pChild);
 	}
 }
 
@@ -249,6 +258,8 @@ void CMapWorld::AddObjectToWorld(CMapClass *pObject, CMapClass *pParent)
 
 	pParent->AddChild(pObject);
 
+	ShadowList_MarkDirty(pObject);
+
 	//
 	// If this object or any of its children are entities, add the entities
 	// to our optimized list of entities.
@@ -345,57 +356,169 @@ CMapClass *CMapWorld::CopyFrom(CMapClass *pobj, bool bUpdateDependencies)
 
 
 //-----------------------------------------------------------------------------
-// Hash the string to the bucket index where it belongs.
+// Purpose: Finds the index bucket for a name. Buckets are keyed by the name's
+//			case insensitive hash, so different names can share one and entities
+//			found through a bucket still have to be compared by name.
+// Input  : bCreate - Whether to make a new bucket if the name doesn't have one.
+// Output : Returns the bucket, or -1 if there is no name or no bucket for it.
 //-----------------------------------------------------------------------------
-static inline int EntityBucketForName( const char *pszName )
+static int EntityBucketForName( const char *pszName, CUtlHashtable<unsigned int, int> &BucketIndex, CUtlVector<CMapEntityList *> &Buckets, bool bCreate )
 {
 	if ( !pszName )
-		return 0;
+		return -1;
 
 	unsigned int nHash = HashStringCaseless( pszName );
 
-	return nHash % NUM_HASHED_ENTITY_BUCKETS;
+	UtlHashHandle_t h = BucketIndex.Find( nHash );
+	if ( h != BucketIndex.InvalidHandle() )
+		return BucketIndex[ h ];
+
+	if ( !bCreate )
+		return -1;
+
+	int nBucket = Buckets.AddToTail( new CMapEntityList );
+	BucketIndex.Insert( nHash, nBucket );
+	return nBucket;
 }
 
 
 //-----------------------------------------------------------------------------
+// Purpose: Adds an entity to the flat list and the name and class indices,
+//			unless it is already in them.
 //-----------------------------------------------------------------------------
-int CMapWorld::FindEntityBucket( CMapEntity *pEntity, int *pnIndex )
+void CMapWorld::AddEntity( CMapEntity *pEntity )
 {
-	for ( int i = 0; i < NUM_HASHED_ENTITY_BUCKETS; i++ )
+	UtlHashHandle_t h = m_EntityIndex.Find( pEntity );
+	if ( h != m_EntityIndex.InvalidHandle() )
 	{
-		int nIndex = m_EntityListByName[ i ].Find( pEntity );
-		if ( nIndex != -1 )
-		{
-			if ( pnIndex )
-			{
-				*pnIndex = nIndex;
-			}
+		int nIndex = m_EntityIndex[ h ].m_nListIndex;
+		if ( m_EntityList.IsValidIndex( nIndex ) && ( m_EntityList[ nIndex ] == pEntity ) )
+			return;
+
+		// An entity was deleted without being removed from the world, and this
+		// one was allocated in its place. Its references in the lists are NULL.
+		m_EntityIndex.RemoveAndAdvance( h );
+	}
+
+	EntityIndex_t Index;
+
+	// Add it to the flat list.
+	Index.m_nListIndex = m_EntityList.Count();
+	m_EntityList.AddToTail( pEntity );
+
+	// Add it to the buckets for its name and class.
+	Index.m_nNameBucket = EntityBucketForName( pEntity->GetKeyValue( "targetname" ), m_NameBucketIndex, m_EntitiesByName, true );
+	if ( Index.m_nNameBucket != -1 )
+	{
+		m_EntitiesByName[ Index.m_nNameBucket ]->AddToTail( pEntity );
+		m_bNamePrefixIndexDirty = true;
+	}
+
+	Index.m_nClassBucket = EntityBucketForName( pEntity->GetClassName(), m_ClassBucketIndex, m_EntitiesByClass, true );
+	if ( Index.m_nClassBucket != -1 )
+	{
+		m_EntitiesByClass[ Index.m_nClassBucket ]->AddToTail( pEntity );
+	}
+
+	m_EntityIndex.Insert( pEntity, Index );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Removes an entity from the flat list and the name and class indices.
+//-----------------------------------------------------------------------------
+void CMapWorld::RemoveEntity( CMapEntity *pEntity )
+{
+	UtlHashHandle_t h = m_EntityIndex.Find( pEntity );
+	if ( h == m_EntityIndex.InvalidHandle() )
+		return;
+
+	EntityIndex_t Index = m_EntityIndex[ h ];
+	m_EntityIndex.RemoveAndAdvance( h );
+
+	if ( !m_EntityList.IsValidIndex( Index.m_nListIndex ) || ( m_EntityList[ Index.m_nListIndex ] != pEntity ) )
+	{
+		// Left over from an entity that was deleted without being removed.
+		return;
+	}
 
-			return i;
+	// Remove the entity from the flat list. The last entity moves into its place.
+	m_EntityList.FastRemove( Index.m_nListIndex );
+	if ( Index.m_nListIndex < m_EntityList.Count() )
+	{
+		CMapEntity *pMoved = m_EntityList[ Index.m_nListIndex ];
+		UtlHashHandle_t hMoved = ( pMoved != NULL ) ? m_EntityIndex.Find( pMoved ) : m_EntityIndex.InvalidHandle();
+		if ( hMoved != m_EntityIndex.InvalidHandle() )
+		{
+			m_EntityIndex[ hMoved ].m_nListIndex = Index.m_nListIndex;
 		}
 	}
 
-	return -1;
+	// Remove the entity from its name and class buckets.
+	if ( Index.m_nNameBucket != -1 )
+	{
+		m_EntitiesByName[ Index.m_nNameBucket ]->FindAndFastRemove( pEntity );
+		m_bNamePrefixIndexDirty = true;
+	}
+
+	if ( Index.m_nClassBucket != -1 )
+	{
+		m_EntitiesByClass[ Index.m_nClassBucket ]->FindAndFastRemove( pEntity );
+	}
+
+	Assert( m_EntityIndex.Find( pEntity ) == m_EntityIndex.InvalidHandle() );
 }
 
 
 //-----------------------------------------------------------------------------
+// Purpose: Moves an entity to the right name and class buckets after its
+//			targetname or class may have changed.
 //-----------------------------------------------------------------------------
-void CMapWorld::AddEntity( CMapEntity *pEntity )
+void CMapWorld::EntityList_Reindex( CMapEntity *pEntity )
 {
-	if ( m_EntityList.Find( pEntity ) != -1 )
+	UtlHashHandle_t h = m_EntityIndex.Find( pEntity );
+	if ( h == m_EntityIndex.InvalidHandle() )
 		return;
 
-	// Add it to the flat list.
-	m_EntityList.AddToTail( pEntity );
+	EntityIndex_t &Index = m_EntityIndex[ h ];
 
-	// If it has a name, add it to the list of entities hashed by name checksum.
-	const char *pszName = pEntity->GetKeyValue( "targetname" );
-	if ( pszName )
+	int nNameBucket = EntityBucketForName( pEntity->GetKeyValue( "targetname" ), m_NameBucketIndex, m_EntitiesByName, true );
+	if ( nNameBucket != Index.m_nNameBucket )
 	{
-		int nBucket = EntityBucketForName( pszName );
-		m_EntityListByName[ nBucket ].AddToTail( pEntity );
+		if ( Index.m_nNameBucket != -1 )
+		{
+			m_EntitiesByName[ Index.m_nNameBucket ]->FindAndFastRemove( pEntity );
+		}
+
+		if ( nNameBucket != -1 )
+		{
+			m_EntitiesByName[ nNameBucket ]->AddToTail( pEntity );
+		}
+
+		Index.m_nNameBucket = nNameBucket;
+	}
+
+	// The name may have changed within its bucket, which still moves it in the
+	// sorted name index.
+	if ( nNameBucket != -1 )
+	{
+		m_bNamePrefixIndexDirty = true;
+	}
+
+	int nClassBucket = EntityBucketForName( pEntity->GetClassName(), m_ClassBucketIndex, m_EntitiesByClass, true );
+	if ( nClassBucket != Index.m_nClassBucket )
+	{
+		if ( Index.m_nClassBucket != -1 )
+		{
+			m_EntitiesByClass[ Index.m_nClassBucket ]->FindAndFastRemove( pEntity );
+		}
+
+		if ( nClassBucket != -1 )
+		{
+			m_EntitiesByClass[ nClassBucket ]->AddToTail( pEntity );
+		}
+
+		Index.m_nClassBucket = nClassBucket;
 	}
 }
 
@@ -419,7 +542,7 @@ void CMapWorld::EntityList_Add(CMapClass *pObject)
 	while (pChild != NULL)
 	{
 		pEntity = dynamic_cast<CMapEntity *>(pChild);
-		if ((pEntity != NULL) && (m_EntityList.Find(pEntity) == -1))
+		if (pEntity != NULL)
 		{
 			AddEntity(pEntity);
 		}
@@ -442,21 +565,7 @@ void CMapWorld::EntityList_Remove(CMapClass *pObject, bool bRemoveChildren)
 	CMapEntity *pEntity = dynamic_cast<CMapEntity *>(pObject);
 	if (pEntity != NULL)
 	{
-		// Remove the entity from the flat list.
-		int nIndex = m_EntityList.Find( pEntity );
-		if ( nIndex != -1 )
-		{
-			m_EntityList.FastRemove( nIndex );
-		}
-
-		// Remove the entity from the hashed list.
-		int nOldBucket = FindEntityBucket( pEntity, &nIndex );
-		if ( nOldBucket != -1 )
-		{
-			m_EntityListByName[ nOldBucket ].FastRemove( nIndex );
-		}
-
-		Assert( m_EntityList.Find( pEntity ) == -1 );
+		RemoveEntity(pEntity);
 	}
 
 	//
@@ -471,7 +580,7 @@ void CMapWorld::EntityList_Remove(CMapClass *pObject, bool bRemoveChildren)
 			pEntity = dynamic_cast<CMapEntity *>(pChild);
 			if (pEntity != NULL)
 			{
-				m_EntityList.FindAndRemove(pEntity);
+				RemoveEntity(pEntity);
 			}
 			pChild = pObject->GetNextDescendent(pos);
 		}
@@ -480,8 +589,8 @@ void CMapWorld::EntityList_Remove(CMapClass *pObject, bool bRemoveChildren)
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Overridden to maintain the culling tree. Root level children of the
-//			world are kept in the culling tree.
+// Purpose: Overridden to maintain the object BVH. Root level children of the
+//			world are kept in the BVH.
 // Input  : pChild - child to remove.
 //-----------------------------------------------------------------------------
 void CMapWorld::RemoveChild(CMapClass *pChild, bool bUpdateBounds)
@@ -489,12 +598,10 @@ void CMapWorld::RemoveChild(CMapClass *pChild, bool bUpdateBounds)
 	CMapClass::RemoveChild(pChild, bUpdateBounds);
 
 	//
-	// Remove the object from the culling tree because it is no longer a root-level child.
+	// Remove the object from the BVH because it is no longer a root-level child.
 	//
-	if (m_pCullTree != NULL)
-	{
-		m_pCullTree->RemoveCullTreeObjectRecurse(pChild);
-	}
+	m_ObjectBVH.RemoveObject(pChild);
+	m_UnboundedChildren.FindAndFastRemove(pChild);
 }
 
 
@@ -531,6 +638,8 @@ void CMapWorld::RemoveObjectFromWorld(CMapClass *pObject, bool bRemoveChildren)
 		return;
 	}
 
+	ShadowList_MarkRemoved(pObject);
+
 	//
 	// Unlink the object from the tree.
 	//
@@ -574,13 +683,16 @@ void CMapWorld::UpdateChild(CMapClass *pChild)
 	CalcBounds( FALSE );
 
 	//
-	// Relink the child in the culling tree.
+	// Refit the child's leaf in the BVH.
 	//
-	if (m_pCullTree != NULL)
+	if ((CMapDoc::GetInLevelLoad() == 0) && (pChild->GetParent() == this))
 	{
-		m_pCullTree->UpdateCullTreeObjectRecurse(pChild);
+		m_ObjectBVH.UpdateObject(pChild);
+		ObjectBVH_UpdateUnbounded(pChild);
 	}
 
+	ShadowList_MarkDirty(pChild);
+
 	//
 	// Notify the document that an object in the world has changed.
 	//
@@ -614,233 +726,142 @@ void CMapWorld::GetUsedTextures(CUsedTextureList &List)
 
 
 //-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pNode -
+// Purpose: Rebuilds the object BVH from scratch over the world's root level
+//			children. Used after loads and undo, when incremental updates
+//			were skipped or can't be trusted.
 //-----------------------------------------------------------------------------
-void CMapWorld::CullTree_FreeNode(CCullTreeNode *pNode)
+void CMapWorld::ObjectBVH_Build(void)
 {
-	Assert(pNode != NULL);
-	if ( !pNode )
-		return;
+	CUtlVector<CMapClass *> Objects;
+	Objects.EnsureCapacity(m_Children.Count());
 
-	int nChildCount = pNode->GetChildCount();
-	if (nChildCount != 0)
+	FOR_EACH_OBJ( m_Children, pos )
 	{
-		for (int nChild = 0; nChild < nChildCount; nChild++)
-		{
-			CCullTreeNode *pChild = pNode->GetCullTreeChild(nChild);
-			CullTree_FreeNode(pChild);
-		}
+		Objects.AddToTail(m_Children.Element(pos));
 	}
 
-	delete pNode;
+	m_ObjectBVH.Build(Objects.Base(), Objects.Count());
+
+	m_UnboundedChildren.RemoveAll();
+	for (int i = 0; i < Objects.Count(); i++)
+	{
+		ObjectBVH_UpdateUnbounded(Objects[i]);
+	}
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Recursively deletes the entire culling tree if is it not NULL.
-//			This does not delete the map objects that the culling tree contains,
-//			only the leaves and nodes themselves.
+// Purpose: Keeps a root level child in the list of unbounded children if, and
+//			only if, its culling box is invalid.
 //-----------------------------------------------------------------------------
-void CMapWorld::CullTree_Free(void)
+void CMapWorld::ObjectBVH_UpdateUnbounded(CMapClass *pChild)
 {
-	if (m_pCullTree != NULL)
+	Vector vecMins, vecMaxs;
+	pChild->GetCullBox(vecMins, vecMaxs);
+
+	int nIndex = m_UnboundedChildren.Find(pChild);
+	if (IsValidBox(vecMins, vecMaxs))
 	{
-		CullTree_FreeNode(m_pCullTree);
-		m_pCullTree = NULL;
+		if (nIndex != -1)
+		{
+			m_UnboundedChildren.FastRemove(nIndex);
+		}
+	}
+	else if (nIndex == -1)
+	{
+		m_UnboundedChildren.AddToTail(pChild);
 	}
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Determines if this node is a node or a leaf. If it is a node, it will
-//			be split into eight children and each child will be populated with
-//			objects whose bounding boxes intersect them, then split recursively.
-//			If this node is a leaf, no action is taken and recursion terminates.
-// Input  : pNode -
+// Purpose: Queues an object and its children to be resent to the lighting
+//			preview.
+// Input  : pObject - object that was added or changed.
 //-----------------------------------------------------------------------------
-#define MIN_NODE_DIM			1024		// Minimum node size of 170 x 170 x 170 feet
-#define MIN_NODE_OBJECT_SPLIT	2			// Don't split nodes with fewer than two objects.
-
-void CMapWorld::CullTree_SplitNode(CCullTreeNode *pNode)
+void CMapWorld::ShadowList_MarkDirty(CMapClass *pObject)
 {
-	Vector Mins;
-	Vector Maxs;
-	Vector Size;
-
-	pNode->GetBounds(Mins, Maxs);
-	VectorSubtract(Maxs, Mins, Size);
-
-	if ((Size[0] > MIN_NODE_DIM) && (Size[1] > MIN_NODE_DIM) && (Size[2] > MIN_NODE_DIM))
+	if (m_bShadowListAllDirty)
 	{
-		Vector Mids;
-		int nChild;
-
-		Mids[0] = (Mins[0] + Maxs[0]) / 2.0;
-		Mids[1] = (Mins[1] + Maxs[1]) / 2.0;
-		Mids[2] = (Mins[2] + Maxs[2]) / 2.0;
-
-		for (nChild = 0; nChild < 8; nChild++)
-		{
-			Vector ChildMins;
-			Vector ChildMaxs;
-
-			//
-			// Create a child and set its bounding box.
-			//
-			CCullTreeNode *pChild = new CCullTreeNode;
-
-			if (nChild & 1)
-			{
-				ChildMins[0] = Mins[0];
-				ChildMaxs[0] = Mids[0];
-			}
-			else
-			{
-				ChildMins[0] = Mids[0];
-				ChildMaxs[0] = Maxs[0];
-			}
-
-			if (nChild & 2)
-			{
-				ChildMins[1] = Mins[1];
-				ChildMaxs[1] = Mids[1];
-			}
-			else
-			{
-				ChildMins[1] = Mids[1];
-				ChildMaxs[1] = Maxs[1];
-			}
-
-			if (nChild & 4)
-			{
-				ChildMins[2] = Mins[2];
-				ChildMaxs[2] = Mids[2];
-			}
-			else
-			{
-				ChildMins[2] = Mids[2];
-				ChildMaxs[2] = Maxs[2];
-			}
-
-			pChild->UpdateBounds(ChildMins, ChildMaxs);
-
-			pNode->AddCullTreeChild(pChild);
-
-			Vector mins1;
-			Vector maxs1;
-			pChild->GetBounds(mins1, maxs1);
-
-			//
-			// Check all objects in this node against the child's bounding box, adding the
-			// objects that intersect to the child's object list.
-			//
-			int nObjectCount = pNode->GetObjectCount();
-			for (int nObject = 0; nObject < nObjectCount; nObject++)
-			{
-				CMapClass *pObject = pNode->GetCullTreeObject(nObject);
-				Assert(pObject != NULL);
-
-				Vector mins2;
-				Vector maxs2;
-				pObject->GetCullBox(mins2, maxs2);
-				if (BoxesIntersect(mins1, maxs1, mins2, maxs2))
-				{
-					pChild->AddCullTreeObject(pObject);
-				}
-			}
-		}
-
-		//
-		// Remove all objects from this node's object list (since we are not a leaf).
-		//
-		pNode->RemoveAllCullTreeObjects();
+		return;
+	}
 
-		//
-		// Recurse into all children with at least two objects, splitting them.
-		//
-		int nChildCount = pNode->GetChildCount();
-		for (nChild = 0; nChild < nChildCount; nChild++)
-		{
-			CCullTreeNode *pChild = pNode->GetCullTreeChild(nChild);
-			if (pChild->GetObjectCount() >= MIN_NODE_OBJECT_SPLIT)
-			{
-				CullTree_SplitNode(pChild);
-			}
-		}
+	if (m_ShadowDirtyList.Find(pObject) == -1)
+	{
+		m_ShadowDirtyList.AddToTail(pObject);
 	}
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose:
-// Input  : pNode -
+// Purpose: Queues the whole world to be resent to the lighting preview.
 //-----------------------------------------------------------------------------
-void CMapWorld::CullTree_DumpNode(CCullTreeNode *pNode, int nDepth)
+void CMapWorld::ShadowList_MarkAllDirty(void)
 {
-	int nChildCount = pNode->GetChildCount();
-	char szText[100];
+	m_bShadowListAllDirty = true;
+	m_ShadowDirtyList.RemoveAll();
+	m_ShadowRemovedIDs.RemoveAll();
+}
 
-	if (nChildCount == 0)
+
+//-----------------------------------------------------------------------------
+// Purpose: Queues the ids of an object and its children for removal from the
+//			lighting preview. The object's parent is requeued because any
+//			children left behind may end up under it.
+// Input  : pObject - object leaving the world.
+//-----------------------------------------------------------------------------
+void CMapWorld::ShadowList_MarkRemoved(CMapClass *pObject)
+{
+	if (m_bShadowListAllDirty)
 	{
-		// Leaf
-		OutputDebugString("LEAF:\n");
-		int nObjectCount = pNode->GetObjectCount();
-		for (int nObject = 0; nObject < nObjectCount; nObject++)
-		{
-			CMapClass *pMapClass = pNode->GetCullTreeObject(nObject);
-			sprintf(szText, "%*c %p %s\n", nDepth, ' ', pMapClass, pMapClass->GetType());
-			OutputDebugString(szText);
-		}
+		return;
 	}
-	else
-	{
-		// Node
-		sprintf(szText, "%*s\n", nDepth, "+");
-		OutputDebugString(szText);
 
-		for (int nChild = 0; nChild < nChildCount; nChild++)
-		{
-			CCullTreeNode *pChild = pNode->GetCullTreeChild(nChild);
-			CullTree_DumpNode(pChild, nDepth + 1);
-		}
+	m_ShadowRemovedIDs.AddToTail(pObject->GetID());
 
-		OutputDebugString("\n");
+	EnumChildrenPos_t pos;
+	CMapClass *pChild = pObject->GetFirstDescendent(pos);
+	while (pChild != NULL)
+	{
+		m_ShadowRemovedIDs.AddToTail(pChild->GetID());
+		pChild = pObject->GetNextDescendent(pos);
+	}
+
+	CMapClass *pParent = pObject->GetParent();
+	if ((pParent != NULL) && (pParent != this))
+	{
+		ShadowList_MarkDirty(pParent);
 	}
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose:
+// Purpose: Hands over the changes queued since the last call and clears them.
+// Input  : Dirty - receives the objects to resend, with their children. Objects
+//				that have since been deleted are left out.
+//			RemovedIDs - receives the ids of the objects that left the world.
+// Output : Returns true if the whole world has to be resent, in which case
+//			Dirty and RemovedIDs are left empty.
 //-----------------------------------------------------------------------------
-void CMapWorld::CullTree_Build(void)
+bool CMapWorld::ShadowList_GetChanges(CMapObjectList &Dirty, CUtlVector<int> &RemovedIDs)
 {
-	CullTree_Free();
-	m_pCullTree = new CCullTreeNode;
-
-	//
-	// The top level node in the tree uses the largest possible bounding box.
-	//
-	Vector BoxMins( g_MIN_MAP_COORD, g_MIN_MAP_COORD, g_MIN_MAP_COORD );
-	Vector BoxMaxs( g_MAX_MAP_COORD, g_MAX_MAP_COORD, g_MAX_MAP_COORD );
-	m_pCullTree->UpdateBounds(BoxMins, BoxMaxs);
+	bool bAllDirty = m_bShadowListAllDirty;
 
-	//
-	// Populate the top level node with the contents of the world.
-	//
-	FOR_EACH_OBJ( m_Children, pos )
+	FOR_EACH_OBJ( m_ShadowDirtyList, pos )
 	{
-		CMapClass *pObject = m_Children.Element(pos);
-		m_pCullTree->AddCullTreeObject(pObject);
+		CMapClass *pObject = m_ShadowDirtyList.Element(pos);
+		if (pObject != NULL)
+		{
+			Dirty.AddToTail(pObject);
+		}
 	}
+	RemovedIDs.AddVectorToTail(m_ShadowRemovedIDs);
 
-	//
-	// Recursively split this node into children and populate them.
-	//
-	CullTree_SplitNode(m_pCullTree);
+	m_bShadowListAllDirty = false;
+	m_ShadowDirtyList.RemoveAll();
+	m_ShadowRemovedIDs.RemoveAll();
 
-	//DumpCullTreeNode(m_pCullTree, 1);
-	//OutputDebugString("\n");
+	return bAllDirty;
 }
 
 
@@ -868,8 +889,7 @@ int CMapWorld::GetGroupList(CUtlVector<CMapGroup *> &GroupList)
 
 //-----------------------------------------------------------------------------
 // Purpose: Called after all objects in the World have been loaded. Calls the
-//			PostLoadWorld function for every object in the world, then
-//			builds the culling tree.
+//			PostLoadWorld function for every object in the world.
 //-----------------------------------------------------------------------------
 void CMapWorld::PostloadWorld(void)
 {
@@ -905,14 +925,6 @@ void CMapWorld::PostloadWorld(void)
 	{
 		CMapClass *pChild = m_Children[pos];
 		pChild->CalcBounds( TRUE );
-		//
-		// Relink the child in the culling tree.
-		//
-		if (m_pCullTree != NULL)
-		{
-			m_pCullTree->UpdateCullTreeObjectRecurse(pChild);
-		}
-
 		pChild->PostUpdate(Notify_Changed);
 		pChild->SignalChanged();
 	}
@@ -1772,31 +1784,36 @@ CMapEntity *CMapWorld::FindEntityByName( const char *pszName, bool bVisiblesOnly
 	if ( !pszName )
 		return NULL;
 
-	CMapEntityList *pList = &m_EntityList;
-
-	if ( !strchr( pszName, '*' ) )
+	if ( strchr( pszName, '*' ) )
 	{
-		int nBucket = EntityBucketForName( pszName );
-		pList = &m_EntityListByName[nBucket];
+		CMapEntityList Found;
+		FindEntitiesByNamePrefix( Found, pszName, bVisiblesOnly );
+		if ( Found.Count() != 0 )
+		{
+			return Found.Element( 0 );
+		}
 	}
-
-	int nCount = pList->Count();
-	for ( int i = 0; i < nCount; i++ )
+	else
 	{
-		CMapEntity *pEntity = pList->Element( i );
+		int nBucket = EntityBucketForName( pszName, m_NameBucketIndex, m_EntitiesByName, false );
+		int nCount = ( nBucket != -1 ) ? m_EntitiesByName[nBucket]->Count() : 0;
+		for ( int i = 0; i < nCount; i++ )
+		{
+			CMapEntity *pEntity = m_EntitiesByName[nBucket]->Element( i );
 
-		// If you hit this assert it means that an entity was deleted
-		// but not removed from the world's entity list.
-		Assert( pEntity != NULL );
+			// If you hit this assert it means that an entity was deleted
+			// but not removed from the world's entity list.
+			Assert( pEntity != NULL );
 
-		if ( !pEntity )
-			continue;
+			if ( !pEntity )
+				continue;
 
-		if ( pEntity->IsVisible() || !bVisiblesOnly )
-		{
-			if ( pEntity->NameMatches( pszName ) )
+			if ( pEntity->IsVisible() || !bVisiblesOnly )
 			{
-				return pEntity;
+				if ( pEntity->NameMatches( pszName ) )
+				{
+					return pEntity;
+				}
 			}
 		}
 	}
@@ -1845,6 +1862,30 @@ bool CMapWorld::FindEntitiesByClassName(CMapEntityList &Found, const char *pszCl
 {
 	Found.RemoveAll();
 
+	//
+	// Without wildcards, only the entities in the class name's bucket can match.
+	//
+	if ( !strchr( pszClassName, '*' ) )
+	{
+		int nBucket = EntityBucketForName( pszClassName, m_ClassBucketIndex, m_EntitiesByClass, false );
+		int nCount = ( nBucket != -1 ) ? m_EntitiesByClass[nBucket]->Count() : 0;
+		for ( int i = 0; i < nCount; i++ )
+		{
+			CMapEntity *pEntity = m_EntitiesByClass[nBucket]->Element( i );
+
+			if ( pEntity && ( pEntity->IsVisible() || !bVisiblesOnly ) )
+			{
+				if ( pEntity->ClassNameMatches( pszClassName ) )
+				{
+					Found.AddToTail( pEntity );
+				}
+			}
+		}
+
+		SortByEntityListOrder( Found );
+		return( Found.Count() != 0 );
+	}
+
 	int nCount = EntityList_GetCount();
 	for ( int i = 0; i < nCount; i++ )
 	{
@@ -1911,18 +1952,17 @@ bool CMapWorld::FindEntitiesByName( CMapEntityList &Found, const char *pszName,
 	if ( !pszName )
 		return false;
 
-	CMapEntityList *pList = &m_EntityList;
-
-	if ( !strchr( pszName, '*' ) )
+	if ( strchr( pszName, '*' ) )
 	{
-		int nBucket = EntityBucketForName( pszName );
-		pList = &m_EntityListByName[nBucket];
+		FindEntitiesByNamePrefix( Found, pszName, bVisiblesOnly );
+		return( Found.Count() != 0 );
 	}
 
-	int nCount = pList->Count();
+	int nBucket = EntityBucketForName( pszName, m_NameBucketIndex, m_EntitiesByName, false );
+	int nCount = ( nBucket != -1 ) ? m_EntitiesByName[nBucket]->Count() : 0;
 	for ( int i = 0; i < nCount; i++ )
 	{
-		CMapEntity *pEntity = pList->Element( i );
+		CMapEntity *pEntity = m_EntitiesByName[nBucket]->Element( i );
 
 		if ( pEntity && ( pEntity->IsVisible() || !bVisiblesOnly ) )
 		{
@@ -1945,6 +1985,55 @@ bool CMapWorld::FindEntitiesByNameOrClassName(CMapEntityList &Found, const char
 {
 	Found.RemoveAll();
 
+	//
+	// Without wildcards in the search, an entity matches if it is in the name's
+	// targetname or class bucket, or if its own targetname has a wildcard.
+	//
+	if ( !strchr( pszName, '*' ) )
+	{
+		UpdateNamePrefixIndex();
+
+		CMapEntityList *pLists[3];
+		int nLists = 0;
+
+		int nBucket = EntityBucketForName( pszName, m_NameBucketIndex, m_EntitiesByName, false );
+		if ( nBucket != -1 )
+		{
+			pLists[nLists++] = m_EntitiesByName[nBucket];
+		}
+
+		nBucket = EntityBucketForName( pszName, m_ClassBucketIndex, m_EntitiesByClass, false );
+		if ( nBucket != -1 )
+		{
+			pLists[nLists++] = m_EntitiesByClass[nBucket];
+		}
+
+		pLists[nLists++] = &m_WildcardNamedEntities;
+
+		for ( int nList = 0; nList < nLists; nList++ )
+		{
+			for ( int i = 0; i < pLists[nList]->Count(); i++ )
+			{
+				CMapEntity *pEntity = pLists[nList]->Element( i );
+
+				if ( pEntity && ( pEntity->IsVisible() || !bVisiblesOnly ) )
+				{
+					if ( pEntity->NameMatches( pszName ) || pEntity->ClassNameMatches( pszName ) )
+					{
+						// Entities matching both ways are in more than one list.
+						if ( Found.Find( pEntity ) == -1 )
+						{
+							Found.AddToTail( pEntity );
+						}
+					}
+				}
+			}
+		}
+
+		SortByEntityListOrder( Found );
+		return( Found.Count() != 0 );
+	}
+
 	int nCount = EntityList_GetCount();
 	for ( int i = 0; i < nCount; i++ )
 	{
@@ -1964,41 +2053,320 @@ bool CMapWorld::FindEntitiesByNameOrClassName(CMapEntityList &Found, const char
 
 
 //-----------------------------------------------------------------------------
-// Tell all our children to update their dependencies because of the given object.
+// Purpose: Brings the entity indices up to date so that EnumEntitiesByName and
+//			EnumEntitiesByClassName only read from them.
 //-----------------------------------------------------------------------------
-void CMapWorld::UpdateAllDependencies( CMapClass *pObject )
+void CMapWorld::EntityIndex_Prepare( void )
 {
-	//
-	// Entities need to be put in their proper hash bucket if the name changed.
-	//
-	CMapEntity *pEntity = dynamic_cast<CMapEntity *>(pObject);
-	if ( pEntity )
+	UpdateNamePrefixIndex();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the entities whose targetnames match the given name.
+// Input  : Found - Receives the entities, in no particular order.
+//			bMatchWildcardNames - Whether entities whose own targetname has a
+//				wildcard can match a name without one. FindEntitiesByName doesn't
+//				do that, but CEntityConnection::ValidateTarget does.
+// Output : Returns the number of entities added to the list.
+//-----------------------------------------------------------------------------
+int CMapWorld::EnumEntitiesByName( CUtlVector<CMapEntity *> &Found, const char *pszName, bool bVisiblesOnly, bool bMatchWildcardNames )
+{
+	int nFirst = Found.Count();
+
+	if ( !pszName )
+		return 0;
+
+	if ( strchr( pszName, '*' ) )
 	{
-		int nNewBucket = -1;
-		const char *pszName = pEntity->GetKeyValue( "targetname" );
-		if ( pszName )
+		EnumEntitiesByNamePrefix( Found, pszName, bVisiblesOnly );
+		return Found.Count() - nFirst;
+	}
+
+	CMapEntityList *pLists[2];
+	int nLists = 0;
+
+	int nBucket = EntityBucketForName( pszName, m_NameBucketIndex, m_EntitiesByName, false );
+	if ( nBucket != -1 )
+	{
+		pLists[nLists++] = m_EntitiesByName[nBucket];
+	}
+
+	if ( bMatchWildcardNames )
+	{
+		Assert( !m_bNamePrefixIndexDirty );
+		pLists[nLists++] = &m_WildcardNamedEntities;
+	}
+
+	for ( int nList = 0; nList < nLists; nList++ )
+	{
+		for ( int i = 0; i < pLists[nList]->Count(); i++ )
 		{
-			nNewBucket = EntityBucketForName( pszName );
+			CMapEntity *pEntity = pLists[nList]->Element( i );
+
+			if ( pEntity && ( pEntity->IsVisible() || !bVisiblesOnly ) )
+			{
+				if ( pEntity->NameMatches( pszName ) )
+				{
+					Found.AddToTail( pEntity );
+				}
+			}
 		}
+	}
+
+	return Found.Count() - nFirst;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds the entities whose class names match the given name.
+// Input  : Found - Receives the entities, in no particular order.
+// Output : Returns the number of entities added to the list.
+//-----------------------------------------------------------------------------
+int CMapWorld::EnumEntitiesByClassName( CUtlVector<CMapEntity *> &Found, const char *pszClassName, bool bVisiblesOnly )
+{
+	int nFirst = Found.Count();
 
-		int nIndex;
-		int nOldBucket = FindEntityBucket( pEntity, &nIndex );
+	if ( !pszClassName )
+		return 0;
 
-		if ( nOldBucket != nNewBucket )
+	if ( !strchr( pszClassName, '*' ) )
+	{
+		int nBucket = EntityBucketForName( pszClassName, m_ClassBucketIndex, m_EntitiesByClass, false );
+		int nCount = ( nBucket != -1 ) ? m_EntitiesByClass[nBucket]->Count() : 0;
+		for ( int i = 0; i < nCount; i++ )
 		{
-			// Remove the entity from the hashed list.
-			if ( nOldBucket != -1 )
+			CMapEntity *pEntity = m_EntitiesByClass[nBucket]->Element( i );
+
+			if ( pEntity && ( pEntity->IsVisible() || !bVisiblesOnly ) )
 			{
-				m_EntityListByName[ nOldBucket ].FastRemove( nIndex );
+				if ( pEntity->ClassNameMatches( pszClassName ) )
+				{
+					Found.AddToTail( pEntity );
+				}
 			}
+		}
+
+		return Found.Count() - nFirst;
+	}
 
-			// Add the entity back to the hashed list in the proper bucket.
-			if ( nNewBucket != -1 )
+	int nCount = EntityList_GetCount();
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CMapEntity *pEntity = EntityList_GetEntity( i );
+
+		if ( pEntity->IsVisible() || !bVisiblesOnly )
+		{
+			if ( pEntity->ClassNameMatches( pszClassName ) )
 			{
-				m_EntityListByName[ nNewBucket ].AddToTail( pEntity );
+				Found.AddToTail( pEntity );
 			}
 		}
 	}
+
+	return Found.Count() - nFirst;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Compares entries in the sorted name index.
+//-----------------------------------------------------------------------------
+static int __cdecl CompareEntityNamePrefix( const EntityNamePrefix_t *pEntry1, const EntityNamePrefix_t *pEntry2 )
+{
+	return V_strcmp( pEntry1->m_pszName, pEntry2->m_pszName );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the sorted name index if entities have been added, removed
+//			or renamed since it was last built.
+//-----------------------------------------------------------------------------
+void CMapWorld::UpdateNamePrefixIndex( void )
+{
+	if ( !m_bNamePrefixIndexDirty )
+		return;
+
+	m_bNamePrefixIndexDirty = false;
+
+	m_NamePrefixIndex.RemoveAll();
+	m_NamePrefixText.RemoveAll();
+	m_WildcardNamedEntities.RemoveAll();
+
+	//
+	// Copy the names first and point at them once the text stops growing.
+	//
+	CUtlVector<int> NameOffsets;
+
+	int nCount = m_EntityList.Count();
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CMapEntity *pEntity = m_EntityList.Element( i );
+		const char *pszName = pEntity ? pEntity->GetKeyValue( "targetname" ) : NULL;
+		if ( !pszName )
+			continue;
+
+		// Entities named with wildcards can match names that don't share their
+		// prefix, so they are checked one by one.
+		if ( strchr( pszName, '*' ) )
+		{
+			m_WildcardNamedEntities.AddToTail( pEntity );
+			continue;
+		}
+
+		int nOffset = m_NamePrefixText.AddMultipleToTail( V_strlen( pszName ) + 1, pszName );
+		V_strlower( m_NamePrefixText.Base() + nOffset );
+		NameOffsets.AddToTail( nOffset );
+
+		EntityNamePrefix_t &Entry = m_NamePrefixIndex[ m_NamePrefixIndex.AddToTail() ];
+		Entry.m_pEntity = pEntity;
+	}
+
+	for ( int i = 0; i < m_NamePrefixIndex.Count(); i++ )
+	{
+		m_NamePrefixIndex[i].m_pszName = m_NamePrefixText.Base() + NameOffsets[i];
+	}
+
+	m_NamePrefixIndex.Sort( CompareEntityNamePrefix );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds all entities whose targetnames match a name with a wildcard.
+//			Everything before the wildcard is looked up in the sorted name index,
+//			so only the entities sharing that prefix are visited.
+//-----------------------------------------------------------------------------
+void CMapWorld::FindEntitiesByNamePrefix( CMapEntityList &Found, const char *pszName, bool bVisiblesOnly )
+{
+	UpdateNamePrefixIndex();
+
+	CUtlVector<CMapEntity *> Matches;
+	EnumEntitiesByNamePrefix( Matches, pszName, bVisiblesOnly );
+
+	for ( int i = 0; i < Matches.Count(); i++ )
+	{
+		Found.AddToTail( Matches[i] );
+	}
+
+	// Keep the order a search of the whole entity list would give.
+	SortByEntityListOrder( Found );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Does the work of FindEntitiesByNamePrefix without updating the name
+//			index or sorting, for EnumEntitiesByName.
+//-----------------------------------------------------------------------------
+void CMapWorld::EnumEntitiesByNamePrefix( CUtlVector<CMapEntity *> &Found, const char *pszName, bool bVisiblesOnly )
+{
+	Assert( !m_bNamePrefixIndexDirty );
+
+	CUtlString strPrefix;
+	strPrefix.SetDirect( pszName, strchr( pszName, '*' ) - pszName );
+	strPrefix.ToLower();
+
+	const char *pszPrefix = strPrefix.Get();
+	int nPrefixLen = strPrefix.Length();
+
+	//
+	// Find the first name that isn't less than the prefix.
+	//
+	int nLow = 0;
+	int nHigh = m_NamePrefixIndex.Count();
+	while ( nLow < nHigh )
+	{
+		int nMid = ( nLow + nHigh ) / 2;
+		if ( V_strcmp( m_NamePrefixIndex[nMid].m_pszName, pszPrefix ) < 0 )
+		{
+			nLow = nMid + 1;
+		}
+		else
+		{
+			nHigh = nMid;
+		}
+	}
+
+	for ( int i = nLow; i < m_NamePrefixIndex.Count(); i++ )
+	{
+		const EntityNamePrefix_t &Entry = m_NamePrefixIndex[i];
+		if ( V_strncmp( Entry.m_pszName, pszPrefix, nPrefixLen ) != 0 )
+			break;
+
+		if ( Entry.m_pEntity->IsVisible() || !bVisiblesOnly )
+		{
+			Found.AddToTail( Entry.m_pEntity );
+		}
+	}
+
+	int nCount = m_WildcardNamedEntities.Count();
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CMapEntity *pEntity = m_WildcardNamedEntities.Element( i );
+
+		if ( pEntity && ( pEntity->IsVisible() || !bVisiblesOnly ) )
+		{
+			if ( pEntity->NameMatches( pszName ) )
+			{
+				Found.AddToTail( pEntity );
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Compares entity list indices.
+//-----------------------------------------------------------------------------
+static int __cdecl CompareEntityListIndex( const int *pIndex1, const int *pIndex2 )
+{
+	return *pIndex1 - *pIndex2;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sorts entities found through the indices into the order they have in
+//			the flat entity list.
+//-----------------------------------------------------------------------------
+void CMapWorld::SortByEntityListOrder( CMapEntityList &Found )
+{
+	int nCount = Found.Count();
+	if ( nCount < 2 )
+		return;
+
+	CUtlVector<int> Indices;
+	Indices.EnsureCapacity( nCount );
+
+	for ( int i = 0; i < nCount; i++ )
+	{
+		UtlHashHandle_t h = m_EntityIndex.Find( Found.Element( i ) );
+		if ( h != m_EntityIndex.InvalidHandle() )
+		{
+			Indices.AddToTail( m_EntityIndex[h].m_nListIndex );
+		}
+	}
+
+	Indices.Sort( CompareEntityListIndex );
+
+	Found.RemoveAll();
+	for ( int i = 0; i < Indices.Count(); i++ )
+	{
+		Found.AddToTail( m_EntityList.Element( Indices[i] ) );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Tell all our children to update their dependencies because of the given object.
+//-----------------------------------------------------------------------------
+void CMapWorld::UpdateAllDependencies( CMapClass *pObject )
+{
+	//
+	// Entities need to be put in their proper name bucket if the name changed.
+	//
+	CMapEntity *pEntity = dynamic_cast<CMapEntity *>(pObject);
+	if ( pEntity )
+	{
+		EntityList_Reindex( pEntity );
+	}
 }
 
 
@@ -15,6 +15,8 @@
 #include "mapclass.h"
 #include "mapdoc.h"
 #include "mappath.h"
+#include "mapobjectbvh.h"
+#include "utlhashtable.h"
 
 // Flags for SaveVMF.
 #define SAVEFLAGS_AUTOSAVE		(1<<0)
@@ -23,13 +25,10 @@
 
 #define MAX_VISIBLE_OBJECTS		10000
 
-#define NUM_HASHED_ENTITY_BUCKETS	200
-
 
 class BoundBox;
 class CChunkFile;
 class CVisGroup;
-class CCullTreeNode;
 class IEditorTexture;
 class CMapGroup;
 class CMapInstance;
@@ -38,6 +37,27 @@ class CUsedTextureList;
 struct SaveLists_t;
 
 
+//
+// Where an entity is kept in the world's entity indices.
+//
+struct EntityIndex_t
+{
+	int m_nListIndex;		// Index in the flat entity list.
+	int m_nNameBucket;		// Targetname bucket, -1 if the entity has no targetname.
+	int m_nClassBucket;		// Class name bucket, -1 if the entity has no class name.
+};
+
+
+//
+// A named entity in the world's sorted name index.
+//
+struct EntityNamePrefix_t
+{
+	const char *m_pszName;	// Lowercase targetname.
+	CMapEntity *m_pEntity;
+};
+
+
 
 class CMapWorld : public CMapClass, public CEditGameClass
 {
@@ -53,10 +73,22 @@ class CMapWorld : public CMapClass, public CEditGameClass
 		CMapDoc *GetOwningDocument( void ) { return m_pOwningDocument; }
 
 		//
-		// Public interface to the culling tree.
+		// Public interface to the object BVH used for culling, picking and
+		// box queries.
+		//
+		void ObjectBVH_Build(void);
+		inline const CMapObjectBVH *ObjectBVH_Get(void) const { return(&m_ObjectBVH); }
+
+		// Root level children without a valid culling box, which no BVH query returns.
+		inline const CUtlVector<CMapClass *> *ObjectBVH_GetUnbounded(void) const { return(&m_UnboundedChildren); }
+
+		//
+		// Objects whose shadow casting triangles may have changed since the
+		// lighting preview was last sent this world's geometry.
 		//
-		void CullTree_Build(void);
-		inline CCullTreeNode *CullTree_GetCullTree(void) { return(m_pCullTree); }
+		void ShadowList_MarkDirty(CMapClass *pObject);
+		void ShadowList_MarkAllDirty(void);
+		bool ShadowList_GetChanges(CMapObjectList &Dirty, CUtlVector<int> &RemovedIDs);
 
 		//
 		// CMapClass virtual overrides.
@@ -122,6 +154,17 @@ class CMapWorld : public CMapClass, public CEditGameClass
 		bool FindEntitiesByClassName(CMapEntityList &Found, const char *szClassName, bool bVisiblesOnly);
 		bool FindEntitiesByNameOrClassName(CMapEntityList &Found, const char *pszName, bool bVisiblesOnly);
 
+		//
+		// Lookups that fill a plain list in no particular order and don't update any
+		// index on demand, so they can be called from several threads at once as long
+		// as nothing is edited and EntityIndex_Prepare was called first.
+		//
+		void EntityIndex_Prepare(void);
+		int EnumEntitiesByName(CUtlVector<CMapEntity *> &Found, const char *pszName, bool bVisiblesOnly, bool bMatchWildcardNames);
+		int EnumEntitiesByClassName(CUtlVector<CMapEntity *> &Found, const char *pszClassName, bool bVisiblesOnly);
+
+		void EntityList_Reindex(CMapEntity *pEntity);
+
 		bool GenerateNewTargetname( const char *startName, char *newName, int newNameBufferSize, bool bMakeUnique, const char *szPrefix, CMapClass *pRoot = NULL );
 
 		// displacement management
@@ -135,10 +178,14 @@ class CMapWorld : public CMapClass, public CEditGameClass
 		// Protected entity list functions.
 		//
 		void AddEntity( CMapEntity *pEntity );
+		void RemoveEntity( CMapEntity *pEntity );
 		void EntityList_Add(CMapClass *pObject);
 		void EntityList_Remove(CMapClass *pObject, bool bRemoveChildren);
 
-		int FindEntityBucket( CMapEntity *pEntity, int *pnIndex );
+		void FindEntitiesByNamePrefix( CMapEntityList &Found, const char *pszName, bool bVisiblesOnly );
+		void EnumEntitiesByNamePrefix( CUtlVector<CMapEntity *> &Found, const char *pszName, bool bVisiblesOnly );
+		void UpdateNamePrefixIndex( void );
+		void SortByEntityListOrder( CMapEntityList &Found );
 
 		//
 		// Serialization.
@@ -154,18 +201,32 @@ class CMapWorld : public CMapClass, public CEditGameClass
 		static BOOL BuildSaveListsCallback(CMapClass *pObject, SaveLists_t *pSaveLists);
 		static ChunkFileResult_t SaveObjectListVMF(CChunkFile *pFile, CSaveInfo *pSaveInfo, const CMapObjectList *pList, int saveFlags);
 
-		//
-		// Culling tree operations.
-		//
-		void CullTree_SplitNode(CCullTreeNode *pNode);
-		void CullTree_DumpNode(CCullTreeNode *pNode, int nDepth);
-		void CullTree_FreeNode(CCullTreeNode *pNode);
-		void CullTree_Free(void);
+		void ObjectBVH_UpdateUnbounded(CMapClass *pChild);
+		void ShadowList_MarkRemoved(CMapClass *pObject);
 
-		CCullTreeNode *m_pCullTree;		// This world's objects stored in a spatial hierarchy for culling.
+		CMapObjectBVH m_ObjectBVH;		// Root level children in a bounding volume hierarchy for culling and picking.
+		CUtlVector<CMapClass *> m_UnboundedChildren;	// Root level children whose culling box is invalid.
+
+		CMapObjectList m_ShadowDirtyList;	// Objects to resend to the lighting preview, with their children.
+		CUtlVector<int> m_ShadowRemovedIDs;	// Ids of objects that left the world since the last send.
+		bool m_bShadowListAllDirty;			// The whole world has to be resent.
 
 		CMapEntityList m_EntityList;									// A flat list of all the entities in this world.
-		CMapEntityList m_EntityListByName[NUM_HASHED_ENTITY_BUCKETS];	// A list of all the entities in the world, hashed by name checksum.
+		CUtlHashtable<CMapEntity *, EntityIndex_t, PointerHashFunctor> m_EntityIndex;	// Where each entity is in the lists.
+
+		CUtlHashtable<unsigned int, int> m_NameBucketIndex;				// Caseless targetname hash to bucket.
+		CUtlVector<CMapEntityList *> m_EntitiesByName;					// Entities in each targetname bucket.
+		CUtlHashtable<unsigned int, int> m_ClassBucketIndex;			// Caseless class name hash to bucket.
+		CUtlVector<CMapEntityList *> m_EntitiesByClass;					// Entities in each class name bucket.
+
+		//
+		// Named entities sorted by targetname, for wildcard name searches. Built
+		// on demand after entities are added, removed or renamed.
+		//
+		CUtlVector<EntityNamePrefix_t> m_NamePrefixIndex;
+		CUtlVector<char> m_NamePrefixText;								// Names pointed to by m_NamePrefixIndex.
+		CMapEntityList m_WildcardNamedEntities;							// Entities with wildcards in their own targetnames.
+		bool m_bNamePrefixIndexDirty;
 
 		int m_nNextFaceID;						// Used for assigning unique IDs to every solid face in this world.
 
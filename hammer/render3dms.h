@@ -31,7 +31,6 @@
 
 class BoundBox;
 class CCamera;
-class CCullTreeNode;
 class CMapClass;
 class CMapDoc;
 class CMapFace;
@@ -181,6 +180,10 @@ public:
 
 
 	int ObjectsAt( float x, float y, float fWidth, float fHeight, HitInfo_t *pObjects, int nMaxObjects, unsigned nFlags = 0 );
+	void BenchmarkPicking( int nPicksPerAxis = 16 );
+	void BenchmarkCulling( int nIterations = 100 );
+	void RecordLightingPreviewGBuffers( void );
+	bool IsRecordingLightingPreviewGBuffers( void ) const { return m_bRecordLPreviewGBuffers; }
 
 	void DebugHook1(void *pData = NULL);
 	void DebugHook2(void *pData = NULL);
@@ -215,7 +218,6 @@ protected:
 	// Rendering functions.
 	void RenderMapClass(CMapClass *pMapClass);
 	void RenderInstanceMapClass_r(CMapClass *pMapClass);
-	void RenderNode(CCullTreeNode *pNode, bool bForce);
 	void RenderOverlayElements(void);
 	void RenderTool(void);
 	void RenderTree( CMapWorld *pWorld );
@@ -223,6 +225,11 @@ protected:
 	void RenderWorldAxes();
 	void RenderTranslucentObjects( void );
 
+	// Picking functions.
+	int ObjectsAtRender( float x, float y, float fWidth, float fHeight, HitInfo_t *pObjects, int nMaxObjects, unsigned int nFlags );
+	int ObjectsAtBVH( float x, float y, float fWidth, float fHeight, HitInfo_t *pObjects, int nMaxObjects, unsigned int nFlags );
+	void SortPickHits(void);
+
 	// Utility functions.
 	void Preload(CMapClass *pParent);
 	Visibility_t IsBoxVisible(Vector const &BoxMins, Vector const &BoxMaxs);
@@ -247,6 +254,7 @@ protected:
 	float m_fLastLPreviewZoom;
 	int m_nLastLPreviewWidth;
 	int m_nLastLPreviewHeight;
+	bool m_bRecordLPreviewGBuffers;		// write the next g-buffers sent out for the benchmark
 
 	Vector4D m_FrustumPlanes[6];		// Plane normals and constants for the current view frustum.
 
@@ -742,6 +742,7 @@
 #define IDC_UNIQUETEXTURES              1419
 #define IDC_TEXTUREMEMORY               1420
 #define IDC_WADSUSED                    1421
+#define IDC_KEYVALUEMEMORY              1422
 #define IDC_FORWARD_SPEED               1424
 #define IDC_FORWARD_ACCELERATION        1425
 #define IDC_FORWARD_SPEED_TEXT          1426
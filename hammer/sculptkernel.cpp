@@ -0,0 +1,664 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Batch versions of the sculpt brushes. The vertices are gathered on
+//			the main thread, which is the only one that touches the map, and the
+//			jobs only read the gathered copies and write to their own outputs.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "stdafx.h"
+#include "sculptkernel.h"
+#include "collisionutils.h"
+#include "dispmanager.h"
+#include "hammer.h"
+#include "mapdisp.h"
+#include "mapdoc.h"
+#include "mapworld.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/jobthread.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include <tier0/memdbgon.h>
+
+
+//
+// Work below these sizes isn't worth handing to other threads.
+//
+static const int PUSH_BLOCK_GROUPS = 256;
+static const int SMOOTH_BLOCK_TARGETS = 16;
+
+// exp(-x) is worked out as 2^(-x * log2(e)).
+static const fltx4 Four_NegLog2E = ReplicateX4( -1.44269504f );
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads one of a group's positions.
+//-----------------------------------------------------------------------------
+static inline void LoadGroupPos( const float flPos[3][4], FourVectors &vecPos )
+{
+	vecPos.x = LoadUnalignedSIMD( flPos[0] );
+	vecPos.y = LoadUnalignedSIMD( flPos[1] );
+	vecPos.z = LoadUnalignedSIMD( flPos[2] );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds the four values together.
+//-----------------------------------------------------------------------------
+static inline float SumSIMD( const fltx4 &a )
+{
+	return ( SubFloat( a, 0 ) + SubFloat( a, 1 ) ) + ( SubFloat( a, 2 ) + SubFloat( a, 3 ) );
+}
+
+
+CSculptKernel::CSculptKernel(void)
+{
+	m_pThreadPool = NULL;
+	m_bUseThreads = true;
+}
+
+
+CSculptKernel::~CSculptKernel(void)
+{
+	EndStroke();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Stops the thread pool. It's started again by the next dab that has
+//			enough work for it.
+//-----------------------------------------------------------------------------
+void CSculptKernel::EndStroke(void)
+{
+	if (m_pThreadPool != NULL)
+	{
+		m_pThreadPool->Stop();
+		DestroyThreadPool(m_pThreadPool);
+		m_pThreadPool = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Starts a new dab, with no displacements.
+//-----------------------------------------------------------------------------
+void CSculptKernel::BeginDab(void)
+{
+	m_Disps.RemoveAll();
+	m_Results.RemoveAll();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds a displacement to the dab.
+// Input  : pOrigDisp - The displacement as it was when the stroke started, or NULL.
+//-----------------------------------------------------------------------------
+void CSculptKernel::AddDisp(CMapDisp *pDisp, CMapDisp *pOrigDisp)
+{
+	KernelDisp_t &Disp = m_Disps[m_Disps.AddToTail()];
+	Disp.m_pDisp = pDisp;
+	Disp.m_pOrigDisp = pOrigDisp;
+	pDisp->GetSurfNormal(Disp.m_vecNormal);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Gathers the vertices near a point, four at a time.
+// Input  : bUseOrig - Test the positions from before the stroke instead of the
+//				current ones, where there are any.
+//-----------------------------------------------------------------------------
+void CSculptKernel::Gather(const Vector &vecCenter, float flRadius, bool bUseOrig)
+{
+	m_Groups.RemoveAll();
+	m_Spans.RemoveAll();
+
+	// The sphere query is strict and the kernels aren't, so ask for a little more.
+	float flQueryRadius = flRadius * 1.001f + 0.01f;
+
+	for (int nDisp = 0; nDisp < m_Disps.Count(); nDisp++)
+	{
+		CMapDisp *pDisp = m_Disps[nDisp].m_pDisp;
+		CMapDisp *pOrigDisp = m_Disps[nDisp].m_pOrigDisp;
+		CMapDisp *pQueryDisp = (bUseOrig && (pOrigDisp != NULL)) ? pOrigDisp : pDisp;
+
+		Vector vecMins, vecMaxs;
+		pQueryDisp->GetBoundingBox(vecMins, vecMaxs);
+		if (!IsBoxIntersectingSphere(vecMins, vecMaxs, vecCenter, flQueryRadius))
+		{
+			continue;
+		}
+
+		m_SphereVerts.RemoveAll();
+		pQueryDisp->EnumerateVertsInSphere(vecCenter, flQueryRadius, m_SphereVerts);
+
+		// The sphere query goes leaf by leaf, so runs of groups stay close together.
+		for (int nFirst = 0; nFirst < m_SphereVerts.Count(); nFirst += 4)
+		{
+			int nGroup = m_Groups.AddToTail();
+			VertGroup_t &Group = m_Groups[nGroup];
+			Group.m_nDisp = nDisp;
+			Group.m_bHasOrig = (pOrigDisp != NULL);
+
+			if ((m_Spans.Count() == 0) || (m_Groups[m_Spans.Tail().m_nFirstGroup].m_nDisp != nDisp) || (m_Spans.Tail().m_nGroupCount == SPAN_GROUPS))
+			{
+				GroupSpan_t &Span = m_Spans[m_Spans.AddToTail()];
+				ClearBounds(Span.m_vecMins, Span.m_vecMaxs);
+				Span.m_nFirstGroup = nGroup;
+				Span.m_nGroupCount = 0;
+			}
+
+			GroupSpan_t &Span = m_Spans.Tail();
+			Span.m_nGroupCount++;
+
+			for (int nSlot = 0; nSlot < 4; nSlot++)
+			{
+				Vector vecPos(FLT_MAX, FLT_MAX, FLT_MAX);
+				Vector vecOrigPos(FLT_MAX, FLT_MAX, FLT_MAX);
+				int nVert = -1;
+
+				if (nFirst + nSlot < m_SphereVerts.Count())
+				{
+					nVert = m_SphereVerts[nFirst + nSlot];
+					pDisp->GetVert(nVert, vecPos);
+					if (pOrigDisp != NULL)
+					{
+						pOrigDisp->GetVert(nVert, vecOrigPos);
+					}
+					else
+					{
+						vecOrigPos = vecPos;
+					}
+
+					AddPointToBounds(vecPos, Span.m_vecMins, Span.m_vecMaxs);
+				}
+
+				for (int nAxis = 0; nAxis < 3; nAxis++)
+				{
+					Group.m_flPos[nAxis][nSlot] = vecPos[nAxis];
+					Group.m_flOrigPos[nAxis][nSlot] = vecOrigPos[nAxis];
+				}
+				Group.m_nVert[nSlot] = nVert;
+			}
+		}
+	}
+
+	int nSlots = m_Groups.Count() * 4;
+	m_Output.SetCount(nSlots);
+	m_OutputValid.SetCount(nSlots);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs a kernel over [0, nCount) in blocks, on the thread pool when
+//			there's more than one block.
+//-----------------------------------------------------------------------------
+void CSculptKernel::Dispatch(int nCount, int nBlockSize, void (CSculptKernel::*pfnBlock)(KernelBlock_t &))
+{
+	m_Blocks.RemoveAll();
+	for (int nStart = 0; nStart < nCount; nStart += nBlockSize)
+	{
+		KernelBlock_t &Block = m_Blocks[m_Blocks.AddToTail()];
+		Block.m_nStart = nStart;
+		Block.m_nEnd = MIN(nStart + nBlockSize, nCount);
+	}
+
+	if (!m_bUseThreads || (m_Blocks.Count() < 2))
+	{
+		for (int i = 0; i < m_Blocks.Count(); i++)
+		{
+			(this->*pfnBlock)(m_Blocks[i]);
+		}
+		return;
+	}
+
+	if (m_pThreadPool == NULL)
+	{
+		m_pThreadPool = CreateThreadPool();
+
+		const CPUInformation *pCPUInfo = GetCPUInformation();
+		ThreadPoolStartParams_t startParams;
+		startParams.nThreads = Clamp(pCPUInfo->m_nLogicalProcessors - 1, 1, TP_MAX_POOL_THREADS);
+		m_pThreadPool->Start(startParams, "hammer_sculpt");
+	}
+
+	ParallelProcess("SculptKernel", m_pThreadPool, m_Blocks.Base(), m_Blocks.Count(), this, pfnBlock);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Moves the outputs the kernel set into the results, in slot order.
+//-----------------------------------------------------------------------------
+void CSculptKernel::CollectResults(void)
+{
+	m_Results.RemoveAll();
+
+	for (int nSlot = 0; nSlot < m_OutputValid.Count(); nSlot++)
+	{
+		if (m_OutputValid[nSlot])
+		{
+			const VertGroup_t &Group = m_Groups[nSlot >> 2];
+
+			SculptResult_t &Result = m_Results[m_Results.AddToTail()];
+			Result.m_nDisp = Group.m_nDisp;
+			Result.m_nVert = Group.m_nVert[nSlot & 3];
+			Result.m_vecPaintPos = m_Output[nSlot];
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Pushes the vertices inside the brush along the brush direction,
+//			by less towards the edge of the brush.
+//-----------------------------------------------------------------------------
+void CSculptKernel::Push(const SculptPushParams_t &Params)
+{
+	m_PushParams = Params;
+
+	Gather(Params.m_vecCenter, Params.m_flRadius, true);
+	Dispatch(m_Groups.Count(), PUSH_BLOCK_GROUPS, &CSculptKernel::PushBlock);
+	CollectResults();
+}
+
+
+void CSculptKernel::PushBlock(KernelBlock_t &Block)
+{
+	const SculptPushParams_t &Params = m_PushParams;
+
+	FourVectors vecCenter;
+	vecCenter.DuplicateVector(Params.m_vecCenter);
+	FourVectors vecDirection;
+	vecDirection.DuplicateVector(Params.m_vecDirection);
+
+	fltx4 flRadius = ReplicateX4(Params.m_flRadius);
+	fltx4 flOORadius = ReplicateX4((Params.m_flRadius > 0.0f) ? (1.0f / Params.m_flRadius) : 0.0f);
+	fltx4 flFalloffSpot = ReplicateX4(Params.m_flFalloffSpot);
+	fltx4 flOOFalloffRange = ReplicateX4((Params.m_flFalloffSpot < 1.0f) ? (1.0f / (1.0f - Params.m_flFalloffSpot)) : 0.0f);
+	fltx4 flFalloffScale = ReplicateX4(1.0f - Params.m_flFalloffEndingValue);
+	fltx4 flFalloffBias = ReplicateX4(Params.m_flFalloffEndingValue * Params.m_flMaxDistance);
+	fltx4 flMaxDistance = ReplicateX4(Params.m_flMaxDistance);
+	fltx4 flOOMaxDistance = ReplicateX4((Params.m_flMaxDistance != 0.0f) ? (1.0f / Params.m_flMaxDistance) : 0.0f);
+
+	for (int nGroup = Block.m_nStart; nGroup < Block.m_nEnd; nGroup++)
+	{
+		const VertGroup_t &Group = m_Groups[nGroup];
+
+		FourVectors vecPos, vecOrigPos;
+		LoadGroupPos(Group.m_flPos, vecPos);
+		LoadGroupPos(Group.m_flOrigPos, vecOrigPos);
+
+		FourVectors vecOffset = vecCenter;
+		vecOffset -= vecOrigPos;
+		fltx4 flLength = SqrtSIMD(vecOffset * vecOffset);
+		fltx4 bInside = CmpLeSIMD(flLength, flRadius);
+
+		// Past the falloff spot the distance eases down to the ending value.
+		fltx4 flPercent = MulSIMD(flLength, flOORadius);
+		fltx4 flFalloff = SubSIMD(Four_Ones, MulSIMD(SubSIMD(flPercent, flFalloffSpot), flOOFalloffRange));
+		fltx4 flFalloffDistance = MaddSIMD(MulSIMD(flFalloffScale, flFalloff), flMaxDistance, flFalloffBias);
+		fltx4 flDistance = MaskedAssign(CmpGtSIMD(flPercent, flFalloffSpot), flFalloffDistance, flMaxDistance);
+
+		fltx4 bMoved = AndNotSIMD(CmpEqSIMD(flDistance, Four_Zeros), bInside);
+
+		FourVectors vecPaintPos = vecDirection;
+		vecPaintPos *= flDistance;
+		vecPaintPos += vecPos;
+
+		if (Params.m_bAttenuated && Group.m_bHasOrig)
+		{
+			// Go no further than the full distance from where the vertex started.
+			FourVectors vecDiff = vecPaintPos;
+			vecDiff -= vecOrigPos;
+			fltx4 flScale = MinSIMD(MulSIMD(SqrtSIMD(vecDiff * vecDiff), flOOMaxDistance), Four_Ones);
+
+			vecPaintPos = vecDirection;
+			vecPaintPos *= MulSIMD(flScale, flMaxDistance);
+			vecPaintPos += vecOrigPos;
+		}
+
+		int nMoved = TestSignSIMD(bMoved);
+		for (int nSlot = 0; nSlot < 4; nSlot++)
+		{
+			int nOutput = (nGroup << 2) + nSlot;
+			m_OutputValid[nOutput] = ((nMoved & (1 << nSlot)) != 0);
+			if (m_OutputValid[nOutput])
+			{
+				m_Output[nOutput] = vecPaintPos.Vec(nSlot);
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Moves each vertex inside the target radius to the weighted average
+//			of the vertices around it, measured along its displacement's normal.
+//			The neighbourhood shrinks towards the edge of the brush.
+//-----------------------------------------------------------------------------
+void CSculptKernel::Smooth(const SculptSmoothParams_t &Params)
+{
+	m_SmoothParams = Params;
+
+	// No neighbourhood is bigger than root two times the radius.
+	Gather(Params.m_vecCenter, Params.m_flTargetRadius + (Params.m_flRadius * 1.41421356f), false);
+
+	m_Targets.RemoveAll();
+
+	FourVectors vecCenter;
+	vecCenter.DuplicateVector(Params.m_vecCenter);
+	fltx4 flTargetRadius2 = ReplicateX4(Params.m_flTargetRadius * Params.m_flTargetRadius);
+
+	for (int nGroup = 0; nGroup < m_Groups.Count(); nGroup++)
+	{
+		FourVectors vecOffset;
+		LoadGroupPos(m_Groups[nGroup].m_flPos, vecOffset);
+		vecOffset -= vecCenter;
+
+		int nInside = TestSignSIMD(CmpLeSIMD(vecOffset * vecOffset, flTargetRadius2));
+		for (int nSlot = 0; nSlot < 4; nSlot++)
+		{
+			int nOutput = (nGroup << 2) + nSlot;
+			m_OutputValid[nOutput] = false;
+			if (nInside & (1 << nSlot))
+			{
+				m_Targets.AddToTail(nOutput);
+			}
+		}
+	}
+
+	Dispatch(m_Targets.Count(), SMOOTH_BLOCK_TARGETS, &CSculptKernel::SmoothBlock);
+	CollectResults();
+}
+
+
+void CSculptKernel::SmoothBlock(KernelBlock_t &Block)
+{
+	const SculptSmoothParams_t &Params = m_SmoothParams;
+
+	float flRadius2 = Params.m_flRadius * Params.m_flRadius;
+	fltx4 flSelfScale = ReplicateX4(1.0f / (Params.m_flScalar * 2.0f));
+
+	for (int nTarget = Block.m_nStart; nTarget < Block.m_nEnd; nTarget++)
+	{
+		int nOutput = m_Targets[nTarget];
+		const VertGroup_t &TargetGroup = m_Groups[nOutput >> 2];
+		const Vector &vecAxis = m_Disps[TargetGroup.m_nDisp].m_vecNormal;
+
+		Vector vecTarget;
+		for (int nAxis = 0; nAxis < 3; nAxis++)
+		{
+			vecTarget[nAxis] = TargetGroup.m_flPos[nAxis][nOutput & 3];
+		}
+
+		// The neighbourhood's radius squared, twice the square of the radius scaled down by the distance from the brush center.
+		float flRatio = 1.0f - (vecTarget.DistToSqr(Params.m_vecCenter) / flRadius2);
+		float flSmoothRadius = flRatio * Params.m_flRadius;
+		float flSmoothRadius2 = flSmoothRadius * flSmoothRadius * 2.0f;
+		if (flSmoothRadius2 <= 0.0f)
+		{
+			continue;
+		}
+		flSmoothRadius = sqrt(flSmoothRadius2);
+
+		FourVectors vecTarget4;
+		vecTarget4.DuplicateVector(vecTarget);
+		fltx4 flSmoothRadius2x4 = ReplicateX4(flSmoothRadius2);
+		fltx4 flOOSmoothRadius2 = ReplicateX4(1.0f / flSmoothRadius2);
+		fltx4 flPaintDist = ReplicateX4(DotProduct(vecTarget, vecAxis));
+
+		fltx4 flSmoothDist = Four_Zeros;
+		fltx4 flWeight = Four_Zeros;
+
+		for (int nSpan = 0; nSpan < m_Spans.Count(); nSpan++)
+		{
+			const GroupSpan_t &Span = m_Spans[nSpan];
+			if (!IsBoxIntersectingSphere(Span.m_vecMins, Span.m_vecMaxs, vecTarget, flSmoothRadius))
+			{
+				continue;
+			}
+
+			for (int nGroup = Span.m_nFirstGroup; nGroup < Span.m_nFirstGroup + Span.m_nGroupCount; nGroup++)
+			{
+				FourVectors vecVert;
+				LoadGroupPos(m_Groups[nGroup].m_flPos, vecVert);
+
+				FourVectors vecOffset = vecVert;
+				vecOffset -= vecTarget4;
+				fltx4 flDist2 = vecOffset * vecOffset;
+				fltx4 bInside = CmpLtSIMD(flDist2, flSmoothRadius2x4);
+				if (IsAllZeros(bInside))
+				{
+					continue;
+				}
+
+				// The vertex itself has a weight of one, the others 1 / e^(d^2/r^2) of the scalar.
+				fltx4 flFactor = ExpSIMD(MulSIMD(MulSIMD(flDist2, flOOSmoothRadius2), Four_NegLog2E));
+				flFactor = MaskedAssign(CmpEqSIMD(flDist2, Four_Zeros), Four_Ones, MulSIMD(flFactor, flSelfScale));
+
+				fltx4 flProjectDist = SubSIMD(vecVert * vecAxis, flPaintDist);
+				flSmoothDist = AddSIMD(flSmoothDist, AndSIMD(bInside, MulSIMD(flProjectDist, flFactor)));
+				flWeight = AddSIMD(flWeight, AndSIMD(bInside, flFactor));
+			}
+		}
+
+		float flTotalWeight = SumSIMD(flWeight);
+		if (flTotalWeight == 0.0f)
+		{
+			continue;
+		}
+
+		m_Output[nOutput] = vecTarget + (vecAxis * (SumSIMD(flSmoothDist) / flTotalWeight));
+		m_OutputValid[nOutput] = true;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads a map and drags the push brush, with every fourth dab
+//			smoothing, corner to corner across its displacements. Each dab
+//			is run without and with threads, and the results are checked
+//			against each other before they're written back.
+//-----------------------------------------------------------------------------
+void CSculptKernel::BenchmarkStroke(const char *pszFileName)
+{
+	CMapDoc *pDoc = dynamic_cast<CMapDoc *>(APP()->OpenDocumentFile(pszFileName));
+	if (pDoc == NULL)
+	{
+		Warning("Sculpt benchmark: couldn't open %s\n", pszFileName);
+		return;
+	}
+
+	IWorldEditDispMgr *pDispMgr = pDoc->GetMapWorld()->GetWorldEditDispManager();
+	int nDispCount = (pDispMgr != NULL) ? pDispMgr->WorldCount() : 0;
+	if (nDispCount == 0)
+	{
+		Warning("Sculpt benchmark: %s has no displacements\n", pszFileName);
+		return;
+	}
+
+	//
+	// Copy the displacements as they are, for the push brush to work from,
+	// and get ready to paint their positions.
+	//
+	Vector vecMins, vecMaxs;
+	ClearBounds(vecMins, vecMaxs);
+
+	CUtlVector<CMapDisp *> OrigDisps;
+	for (int i = 0; i < nDispCount; i++)
+	{
+		CMapDisp *pDisp = pDispMgr->GetFromWorld(i);
+
+		Vector vecDispMins, vecDispMaxs;
+		pDisp->GetBoundingBox(vecDispMins, vecDispMaxs);
+		AddPointToBounds(vecDispMins, vecMins, vecMaxs);
+		AddPointToBounds(vecDispMaxs, vecMins, vecMaxs);
+
+		CMapDisp *pCopy = new CMapDisp();
+		pCopy->CopyFrom(pDisp, false);
+		OrigDisps.AddToTail(pCopy);
+
+		pDisp->Paint_Init(DISPPAINT_CHANNEL_POSITION);
+	}
+
+	Vector vecSize = vecMaxs - vecMins;
+	float flBrushRadius = MAX(vecSize.x, vecSize.y) / 16.0f;
+
+	SculptPushParams_t PushParams;
+	PushParams.m_flRadius = flBrushRadius;
+	PushParams.m_vecDirection.Init(0.0f, 0.0f, 1.0f);
+	PushParams.m_flMaxDistance = flBrushRadius * 0.05f;
+	PushParams.m_flFalloffSpot = 0.5f;
+	PushParams.m_flFalloffEndingValue = 0.0f;
+	PushParams.m_bAttenuated = false;
+
+	SculptSmoothParams_t SmoothParams;
+	SmoothParams.m_flTargetRadius = flBrushRadius;
+	SmoothParams.m_flRadius = flBrushRadius * 2.0f;
+	SmoothParams.m_flScalar = 10.0f / 0.2f;
+
+	CSculptKernel SerialKernel;
+	SerialKernel.SetUseThreads(false);
+	CSculptKernel Kernel;
+
+	const int nDabs = 256;
+	int nDabsDone = 0;
+	int nVertsMoved = 0;
+	int nMismatches = 0;
+	double flSerialTime = 0.0;
+	double flKernelTime = 0.0;
+	double flDabTime = 0.0;
+
+	for (int nDab = 0; nDab < nDabs; nDab++)
+	{
+		//
+		// Find the surface under this point of the stroke.
+		//
+		float flFraction = (float)nDab / (float)(nDabs - 1);
+		Vector vecStart(vecMins.x + vecSize.x * flFraction, vecMins.y + vecSize.y * flFraction, vecMaxs.z + 1.0f);
+		Vector vecEnd(vecStart.x, vecStart.y, vecMins.z - 1.0f);
+
+		bool bHit = false;
+		Vector vecCenter;
+		for (int i = 0; i < nDispCount; i++)
+		{
+			Vector vecHit, vecNormal;
+			if (pDispMgr->GetFromWorld(i)->TraceLine(vecHit, vecNormal, vecStart, vecEnd) && (!bHit || (vecHit.z > vecCenter.z)))
+			{
+				vecCenter = vecHit;
+				bHit = true;
+			}
+		}
+
+		if (!bHit)
+		{
+			continue;
+		}
+
+		bool bSmooth = ((nDab & 3) == 3);
+		PushParams.m_vecCenter = vecCenter;
+		SmoothParams.m_vecCenter = vecCenter;
+
+		double flStartTime = Plat_FloatTime();
+
+		SerialKernel.BeginDab();
+		for (int i = 0; i < nDispCount; i++)
+		{
+			SerialKernel.AddDisp(pDispMgr->GetFromWorld(i), OrigDisps[i]);
+		}
+
+		if (bSmooth)
+		{
+			SerialKernel.Smooth(SmoothParams);
+		}
+		else
+		{
+			SerialKernel.Push(PushParams);
+		}
+
+		double flSerialEndTime = Plat_FloatTime();
+
+		Kernel.BeginDab();
+		for (int i = 0; i < nDispCount; i++)
+		{
+			Kernel.AddDisp(pDispMgr->GetFromWorld(i), OrigDisps[i]);
+		}
+
+		if (bSmooth)
+		{
+			Kernel.Smooth(SmoothParams);
+		}
+		else
+		{
+			Kernel.Push(PushParams);
+		}
+
+		double flKernelEndTime = Plat_FloatTime();
+
+		const CUtlVector<SculptResult_t> &Results = Kernel.GetResults();
+		const CUtlVector<SculptResult_t> &SerialResults = SerialKernel.GetResults();
+		if (Results.Count() != SerialResults.Count())
+		{
+			nMismatches++;
+		}
+		else
+		{
+			for (int i = 0; i < Results.Count(); i++)
+			{
+				if ((Results[i].m_nDisp != SerialResults[i].m_nDisp) || (Results[i].m_nVert != SerialResults[i].m_nVert) || (Results[i].m_vecPaintPos != SerialResults[i].m_vecPaintPos))
+				{
+					nMismatches++;
+					break;
+				}
+			}
+		}
+
+		//
+		// Write the results back and rebuild the displacements they touched.
+		//
+		int nLastDisp = -1;
+		for (int i = 0; i < Results.Count(); i++)
+		{
+			Kernel.GetDisp(Results[i].m_nDisp)->Paint_SetValue(Results[i].m_nVert, Results[i].m_vecPaintPos);
+			if (Results[i].m_nDisp != nLastDisp)
+			{
+				if (nLastDisp != -1)
+				{
+					Kernel.GetDisp(nLastDisp)->Paint_Update(false);
+				}
+				nLastDisp = Results[i].m_nDisp;
+			}
+		}
+
+		if (nLastDisp != -1)
+		{
+			Kernel.GetDisp(nLastDisp)->Paint_Update(false);
+		}
+
+		double flEndTime = Plat_FloatTime();
+
+		flSerialTime += flSerialEndTime - flStartTime;
+		flKernelTime += flKernelEndTime - flSerialEndTime;
+		flDabTime += flEndTime - flSerialEndTime;
+		nVertsMoved += Results.Count();
+		nDabsDone++;
+	}
+
+	Kernel.EndStroke();
+	OrigDisps.PurgeAndDeleteElements();
+
+	if (nDabsDone == 0)
+	{
+		Warning("Sculpt benchmark: the stroke across %s didn't hit any displacements\n", pszFileName);
+		return;
+	}
+
+	if (nMismatches != 0)
+	{
+		Warning("Sculpt benchmark: %d dabs differed between the serial and threaded kernels\n", nMismatches);
+	}
+
+	Msg("Sculpt benchmark: %s, %d displacements, %d dabs, %.1f verts per dab, %.3f ms per dab (%.3f ms in the kernels, %.3f ms without threads)\n",
+		pszFileName, nDispCount, nDabsDone, (float)nVertsMoved / nDabsDone,
+		flDabTime * 1000.0 / nDabsDone, flKernelTime * 1000.0 / nDabsDone, flSerialTime * 1000.0 / nDabsDone);
+}
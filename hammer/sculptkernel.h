@@ -0,0 +1,164 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Batch versions of the sculpt brushes. For each dab the vertices
+//			the brush can reach are gathered out of all the displacements into
+//			four wide arrays, the brush is evaluated over them with SIMD, spread
+//			across a thread pool, and the new positions are handed back in one
+//			list to be written to the displacements' paint canvases.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef SCULPTKERNEL_H
+#define SCULPTKERNEL_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+#include "utlvector.h"
+
+class CMapDisp;
+class IThreadPool;
+
+
+//
+// The push brush. Vertices are tested at their positions from before the
+// stroke and moved from their current positions.
+//
+struct SculptPushParams_t
+{
+	Vector m_vecCenter;					// Original collision point.
+	float m_flRadius;					// Original projected radius.
+	Vector m_vecDirection;				// Paint axis times the brush direction.
+	float m_flMaxDistance;
+	float m_flFalloffSpot;				// Fraction of the radius where the falloff starts.
+	float m_flFalloffEndingValue;		// Fraction of the distance left at the edge.
+	bool m_bAttenuated;					// Limit how far a vertex gets from where it started.
+};
+
+
+//
+// The smoothing brush. Each vertex within the target radius is moved along its
+// displacement's normal to the weighted average of its neighbours.
+//
+struct SculptSmoothParams_t
+{
+	Vector m_vecCenter;					// Current collision point.
+	float m_flTargetRadius;				// Current projected radius.
+	float m_flRadius;					// Radius the smoothing falls off over.
+	float m_flScalar;					// Weight of the neighbours against the vertex itself.
+};
+
+
+struct SculptResult_t
+{
+	int m_nDisp;						// Index of the displacement in the dab.
+	int m_nVert;
+	Vector m_vecPaintPos;
+};
+
+
+class CSculptKernel
+{
+	public:
+
+		CSculptKernel(void);
+		~CSculptKernel(void);
+
+		//
+		// The displacements a dab may touch, with their copies from before the
+		// stroke, which can be NULL. Displacements the brush can't reach are
+		// skipped when the vertices are gathered.
+		//
+		void BeginDab(void);
+		void AddDisp(CMapDisp *pDisp, CMapDisp *pOrigDisp);
+		inline int GetDispCount(void) const { return(m_Disps.Count()); }
+		inline CMapDisp *GetDisp(int nDisp) const { return(m_Disps[nDisp].m_pDisp); }
+
+		//
+		// Evaluate a brush over the dab's displacements. The results are in
+		// displacement order and are the same whether or not threads are used.
+		//
+		void Push(const SculptPushParams_t &Params);
+		void Smooth(const SculptSmoothParams_t &Params);
+		inline const CUtlVector<SculptResult_t> &GetResults(void) const { return(m_Results); }
+
+		// The thread pool is kept between dabs, call this when the stroke is over.
+		void EndStroke(void);
+		inline void SetUseThreads(bool bUseThreads) { m_bUseThreads = bUseThreads; }
+
+		// Replays a stroke across the displacements in a map file and reports the time per dab.
+		static void BenchmarkStroke(const char *pszFileName);
+
+	protected:
+
+		struct KernelDisp_t
+		{
+			CMapDisp *m_pDisp;
+			CMapDisp *m_pOrigDisp;
+			Vector m_vecNormal;					// Smoothing axis.
+		};
+
+		//
+		// Four vertices of one displacement. Unused slots are at FLT_MAX, which
+		// no brush reaches.
+		//
+		struct VertGroup_t
+		{
+			float m_flPos[3][4];				// Current position.
+			float m_flOrigPos[3][4];			// Position before the stroke.
+			int m_nVert[4];						// -1 for unused slots.
+			int m_nDisp;
+			bool m_bHasOrig;					// Whether the displacement has a copy from before the stroke.
+		};
+
+		//
+		// A run of groups and their bounds, so the smoothing kernel can skip
+		// neighbours that are far away without looking at each group.
+		//
+		struct GroupSpan_t
+		{
+			Vector m_vecMins;
+			Vector m_vecMaxs;
+			int m_nFirstGroup;
+			int m_nGroupCount;
+		};
+
+		// A range of work for one job.
+		struct KernelBlock_t
+		{
+			int m_nStart;
+			int m_nEnd;
+		};
+
+		enum { SPAN_GROUPS = 8 };
+
+		void Gather(const Vector &vecCenter, float flRadius, bool bUseOrig);
+		void Dispatch(int nCount, int nBlockSize, void (CSculptKernel::*pfnBlock)(KernelBlock_t &));
+		void CollectResults(void);
+
+		void PushBlock(KernelBlock_t &Block);
+		void SmoothBlock(KernelBlock_t &Block);
+
+		CUtlVector<KernelDisp_t> m_Disps;
+		CUtlVector<VertGroup_t> m_Groups;
+		CUtlVector<GroupSpan_t> m_Spans;
+		CUtlVector<int> m_SphereVerts;
+		CUtlVector<KernelBlock_t> m_Blocks;
+
+		// One output per gathered slot, so the jobs never write to the same place.
+		CUtlVector<Vector> m_Output;
+		CUtlVector<bool> m_OutputValid;
+		CUtlVector<int> m_Targets;				// Slots the smoothing brush moves.
+		CUtlVector<SculptResult_t> m_Results;
+
+		SculptPushParams_t m_PushParams;
+		SculptSmoothParams_t m_SmoothParams;
+
+		IThreadPool *m_pThreadPool;
+		bool m_bUseThreads;
+};
+
+
+#endif // SCULPTKERNEL_H
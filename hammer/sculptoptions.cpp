@@ -148,6 +148,9 @@ bool CSculptTool::OnLMouseUp3D( CMapView3D *pView, UINT nFlags, const Vector2D &
 	m_bLMBDown = false;
 	m_MousePoint = vPoint;
 
+	// The stroke is over, let the brush kernel's threads go.
+	m_Kernel.EndStroke();
+
 	return true;
 }
 
@@ -460,40 +463,81 @@ void CSculptTool::DoPaintEqual( SpatialPaintData_t &spatialData, CMapDisp *pDisp
 
 
 //-----------------------------------------------------------------------------
-// Purpose: this routine does the smoothing operation
+// Purpose: this routine does the smoothing operation across the displacements in the kernel's dab
 // Input  : pView - the 3d view
 //			vPoint - the mouse point
-//			pDisp - the displacement to smooth
-//			pOrigDisp - the displacement prior to the paint operation
 // Output :
 //-----------------------------------------------------------------------------
-void CSculptTool::DoPaintSmooth( CMapView3D *pView, const Vector2D &vPoint, CMapDisp *pDisp, CMapDisp *pOrigDisp )
+void CSculptTool::DoPaintSmooth( CMapView3D *pView, const Vector2D &vPoint )
 {
-	Vector	vPaintPos, vVert;
+	if ( !m_CurrentCollisionValid )
+	{
+		return;
+	}
 
-	pDisp->GetSurfNormal( m_SpatialData.m_vPaintAxis );
+	SculptSmoothParams_t Params;
+	Params.m_vecCenter = m_SpatialData.m_vCenter;
+	Params.m_flTargetRadius = m_CurrentProjectedRadius;
+	Params.m_flRadius = m_SpatialData.m_flRadius;
+	Params.m_flScalar = m_SpatialData.m_flScalar;
 
-	int nVertCount = pDisp->GetSize();
-	for ( int iVert = 0; iVert < nVertCount; iVert++ )
+	m_Kernel.Smooth( Params );
+	ApplyKernelResults();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: adds all selected displacements, with their original copies, to the brush kernel's dab
+//-----------------------------------------------------------------------------
+void CSculptTool::AddSelectedDispsToKernel( )
+{
+	IWorldEditDispMgr *pDispMgr = GetActiveWorldEditDispManager();
+	if( !pDispMgr )
+		return;
+
+	int nDispCount = pDispMgr->SelectCount();
+	for ( int iDisp = 0; iDisp < nDispCount; iDisp++ )
 	{
-		if ( IsPointInScreenCircle( pView, pDisp, pOrigDisp, iVert, false, true ) )
+		CMapDisp *pDisp = pDispMgr->GetFromSelect( iDisp );
+		if ( pDisp )
 		{
-//			Msg( "Checking Vert %d\n", iVert );
-			// Get the current vert.
-			pDisp->GetVert( iVert, vVert );
+			CMapDisp	*OrigDisp = NULL;
+			int			index = m_OrigMapDisp.Find( pDisp->GetEditHandle() );
 
-			// Build the new smoothed position and set it.
-			if ( DoPaintSmoothOneOverExp( vVert, vPaintPos ) )
+			if ( index != m_OrigMapDisp.InvalidIndex() )
 			{
-				AddToUndo( &pDisp );
-				pDisp->Paint_SetValue( iVert, vPaintPos );
-//				Msg( "Vert %d Updated: from %g %g %g to %g %g %g\n", iVert, vVert.x, vVert.y, vVert.z, vPaintPos.x, vPaintPos.y, vPaintPos.z );
+				OrigDisp = m_OrigMapDisp[ index ];
 			}
+			m_Kernel.AddDisp( pDisp, OrigDisp );
 		}
 	}
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: writes the brush kernel's results to the displacements' paint canvases
+//-----------------------------------------------------------------------------
+void CSculptTool::ApplyKernelResults( )
+{
+	const CUtlVector<SculptResult_t> &Results = m_Kernel.GetResults();
+
+	// The results are grouped by displacement, so each one only goes to the undo manager once.
+	CMapDisp	*pDisp = NULL;
+	int			nLastDisp = -1;
+	for ( int i = 0; i < Results.Count(); i++ )
+	{
+		if ( Results[ i ].m_nDisp != nLastDisp )
+		{
+			nLastDisp = Results[ i ].m_nDisp;
+			pDisp = m_Kernel.GetDisp( nLastDisp );
+			AddToUndo( &pDisp );
+		}
+
+		pDisp->Paint_SetValue( Results[ i ].m_nVert, Results[ i ].m_vecPaintPos );
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: checks to see if the paint sphere is within the bounding box
 // Input  : vCenter - center of the sphere
@@ -525,103 +569,6 @@ bool CSculptTool::IsInSphereRadius( const Vector &vCenter, float flRadius2, cons
 }
 
 
-//-----------------------------------------------------------------------------
-// Purpose: calculates the smoothing radius squared
-// Input  : vPoint - the point to be smoothed
-// Output : returns the smoothing radius squared
-//-----------------------------------------------------------------------------
-float CSculptTool::CalcSmoothRadius2( const Vector &vPoint )
-{
-	Vector vTmp;
-	VectorSubtract( m_SpatialData.m_vCenter, vPoint, vTmp );
-	float flDistance2 = ( vTmp.x * vTmp.x ) + ( vTmp.y * vTmp.y ) + ( vTmp.z * vTmp.z );
-
-	float flRatio = flDistance2 / m_SpatialData.m_flRadius2;
-	flRatio = 1.0f - flRatio;
-
-	float flRadius = flRatio * m_SpatialData.m_flRadius;
-	return ( flRadius * flRadius );
-}
-
-
-//-----------------------------------------------------------------------------
-// Purpose: smooths all displacements
-// Input  : vNewCenter - calculate the smoothing center
-// Output : returns true if successful
-//			vPaintPos - the new smoothing position
-//-----------------------------------------------------------------------------
-bool CSculptTool::DoPaintSmoothOneOverExp( const Vector &vNewCenter, Vector &vPaintPos )
-{
-	// Get the displacement manager from the active map document.
-	IWorldEditDispMgr *pDispMgr = GetActiveWorldEditDispManager();
-	if( !pDispMgr )
-		return false;
-
-	// Calculate the smoothing radius.
-	float flNewRadius2 = CalcSmoothRadius2( vNewCenter );
-	flNewRadius2 *= 2.0f;
-	float flNewRadius = ( float )sqrt( flNewRadius2 );
-
-
-	// Test all selected surfaces for smoothing.
-	float flWeight = 0.0f;
-	float flSmoothDist = 0.0f;
-
-	// Calculate the plane dist.
-	float flPaintDist = m_SpatialData.m_vPaintAxis.Dot( vNewCenter );
-
-	int nDispCount = pDispMgr->SelectCount();
-	for ( int iDisp = 0; iDisp < nDispCount; iDisp++ )
-	{
-		CMapDisp *pDisp = pDispMgr->GetFromSelect( iDisp );
-		if ( pDisp )
-		{
-			// Test paint sphere displacement bbox for overlap.
-			Vector vBBoxMin, vBBoxMax;
-			pDisp->GetBoundingBox( vBBoxMin, vBBoxMax );
-			if ( PaintSphereDispBBoxOverlap( vNewCenter, flNewRadius, vBBoxMin, vBBoxMax ) )
-			{
-				Vector vVert;
-				int nVertCount = pDisp->GetSize();
-				for ( int iVert = 0; iVert < nVertCount; iVert++ )
-				{
-					// Get the current vert.
-					pDisp->GetVert( iVert, vVert );
-
-					float flDistance2 = 0.0f;
-					if ( IsInSphereRadius( vNewCenter, flNewRadius2, vVert, flDistance2 ) )
-					{
-						float flRatio = flDistance2 / flNewRadius2;
-						float flFactor = 1.0f / exp( flRatio );
-						if ( flFactor != 1.0f )
-						{
-							flFactor *= 1.0f / ( m_SpatialData.m_flScalar * 2.0f );
-						}
-
-						Vector vProjectVert;
-						float flProjectDist = DotProduct( vVert, m_SpatialData.m_vPaintAxis ) - flPaintDist;
-						flSmoothDist += ( flProjectDist * flFactor );
-						flWeight += flFactor;
-//						Msg( "Factoring %d: %g %g %g at %g\n", iVert, vVert.x, vVert.y, vVert.z, flNewRadius2 );
-					}
-				}
-			}
-		}
-	}
-
-	if ( flWeight == 0.0f )
-	{
-		return false;
-	}
-
-	// Re-normalize the smoothing position.
-	flSmoothDist /= flWeight;
-	vPaintPos = vNewCenter + ( m_SpatialData.m_vPaintAxis * flSmoothDist );
-
-	return true;
-}
-
-
 //-----------------------------------------------------------------------------
 // Purpose: gets the starting position when the paint operation begins
 // Input  : pView - the 3d view
@@ -1480,6 +1427,22 @@ void CSculptPushOptions::GetPaintAxis( CCamera *pCamera, const Vector2D &vPoint,
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: applies the push operation across all selected displacements at once
+// Input  : pView - the 3d view
+//			vPoint - the mouse point
+// Output : returns true if successful
+//-----------------------------------------------------------------------------
+bool CSculptPushOptions::DoPaint( CMapView3D *pView, const Vector2D &vPoint )
+{
+	m_Kernel.BeginDab();
+	AddSelectedDispsToKernel();
+	DoPaintKernel( pView, vPoint );
+
+	return true;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: applies the specific push operation onto the displacement
 // Input  : pView - the 3d view
@@ -1489,12 +1452,19 @@ void CSculptPushOptions::GetPaintAxis( CCamera *pCamera, const Vector2D &vPoint,
 //-----------------------------------------------------------------------------
 void CSculptPushOptions::DoPaintOperation( CMapView3D *pView, const Vector2D &vPoint, CMapDisp *pDisp, CMapDisp *pOrigDisp )
 {
-	Vector	vPaintPos, vVert, vDirection;
-	float	flMaxDistance = 0.0f;
-	float	flDistance;
-	float	flLengthPercent;
-	Vector	vPaintAxis;
+	m_Kernel.BeginDab();
+	m_Kernel.AddDisp( pDisp, pOrigDisp );
+	DoPaintKernel( pView, vPoint );
+}
+
 
+//-----------------------------------------------------------------------------
+// Purpose: runs the push, or with shift the smoothing, brush over the displacements in the kernel's dab
+// Input  : pView - the 3d view
+//			vPoint - the mouse point
+//-----------------------------------------------------------------------------
+void CSculptPushOptions::DoPaintKernel( CMapView3D *pView, const Vector2D &vPoint )
+{
 	if ( m_bShiftDown )
 	{
 //		DoSmoothOperation( pView, vPoint, pDisp, pOrigDisp );
@@ -1508,80 +1478,39 @@ void CSculptPushOptions::DoPaintOperation( CMapView3D *pView, const Vector2D &vP
 		m_SpatialData.m_flScalar = 10.0f / m_SmoothAmount;
 		m_SpatialData.m_vCenter = m_CurrentCollisionPoint;
 
-		DoPaintSmooth( pView, vPoint, pDisp, pOrigDisp );
+		DoPaintSmooth( pView, vPoint );
 		return;
 	}
 
+	if ( !m_OriginalCollisionValid )
+	{
+		return;
+	}
+
+	Vector	vPaintAxis;
 	GetPaintAxis( pView->GetCamera(), vPoint, vPaintAxis );
 
-	vDirection = vPaintAxis * m_Direction;
+	SculptPushParams_t Params;
+	Params.m_vecCenter = m_OriginalCollisionPoint;
+	Params.m_flRadius = m_OriginalProjectedRadius;
+	Params.m_vecDirection = vPaintAxis * m_Direction;
+	Params.m_flMaxDistance = 0.0f;
+	Params.m_flFalloffSpot = m_flFalloffSpot;
+	Params.m_flFalloffEndingValue = m_flFalloffEndingValue;
+	Params.m_bAttenuated = ( m_DensityMode == DENSITY_MODE_ATTENUATED );
 
 	switch( m_OffsetMode )
 	{
 		case OFFSET_MODE_ADAPTIVE:
-			flMaxDistance = m_StartingProjectedRadius * m_OffsetAmount;
+			Params.m_flMaxDistance = m_StartingProjectedRadius * m_OffsetAmount;
 			break;
 		case OFFSET_MODE_ABSOLUTE:
-			flMaxDistance = m_OffsetDistance;
+			Params.m_flMaxDistance = m_OffsetDistance;
 			break;
 	}
 
-	int nVertCount = pDisp->GetSize();
-	for ( int iVert = 0; iVert < nVertCount; iVert++ )
-	{
-		if ( IsPointInScreenCircle( pView, pDisp, pOrigDisp, iVert, true, false, &flLengthPercent ) )
-		{
-			pDisp->GetVert( iVert, vVert );
-
-			if ( flLengthPercent > m_flFalloffSpot )
-			{
-				flLengthPercent = ( flLengthPercent - m_flFalloffSpot ) / ( 1.0f - m_flFalloffSpot );
-				flLengthPercent = 1.0 - flLengthPercent;
-				flDistance = ( ( 1.0f - m_flFalloffEndingValue ) * flLengthPercent * flMaxDistance ) + ( m_flFalloffEndingValue * flMaxDistance );
-			}
-			else
-			{
-				flDistance = flMaxDistance;
-			}
-
-			if ( flDistance == 0.0f )
-			{
-				continue;
-			}
-
-			switch( m_DensityMode )
-			{
-				case DENSITY_MODE_ADDITIVE:
-					VectorScale( vDirection, flDistance, vPaintPos );
-					VectorAdd( vPaintPos, vVert, vPaintPos );
-					break;
-
-				case DENSITY_MODE_ATTENUATED:
-					VectorScale( vDirection, flDistance, vPaintPos );
-					VectorAdd( vPaintPos, vVert, vPaintPos );
-
-					if ( pOrigDisp )
-					{
-						Vector	vOrigVert, vDiff;
-						float	Length;
-
-						pOrigDisp->GetVert( iVert, vOrigVert );
-						vDiff = ( vPaintPos - vOrigVert );
-						Length = vDiff.Length() / flMaxDistance;
-						if ( Length > 1.0f )
-						{
-							Length = 1.0f;
-						}
-
-						vPaintPos = vOrigVert + ( Length * vDirection * flMaxDistance );
-					}
-					break;
-			}
-
-			AddToUndo( &pDisp );
-			pDisp->Paint_SetValue( iVert, vPaintPos );
-		}
-	}
+	m_Kernel.Push( Params );
+	ApplyKernelResults();
 }
 
 
@@ -3079,6 +3008,40 @@ bool CSculptCarveOptions::IsPointAffected( CMapView3D *pView, CMapDisp *pDisp, C
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: smooths across all selected displacements at once while shift is down,
+//			otherwise carves each displacement in turn
+// Input  : pView - the 3d view
+//			vPoint - the mouse point
+// Output : returns true if successful
+//-----------------------------------------------------------------------------
+bool CSculptCarveOptions::DoPaint( CMapView3D *pView, const Vector2D &vPoint )
+{
+	if ( !m_bShiftDown )
+	{
+		return CSculptTool::DoPaint( pView, vPoint );
+	}
+
+	if ( m_DrawPoints.Count() - 1 < 2 )
+	{
+		return true;
+	}
+
+//	m_SpatialData.m_flRadius = m_StartingProjectedRadius * 1.5f;
+	m_SpatialData.m_flRadius = m_CurrentProjectedRadius * 2.0f;
+	m_SpatialData.m_flRadius2 = ( m_SpatialData.m_flRadius * m_SpatialData.m_flRadius );
+	m_SpatialData.m_flOORadius2 = 1.0f / m_SpatialData.m_flRadius2;
+	m_SpatialData.m_flScalar = 10.0f / m_SmoothAmount;
+	m_SpatialData.m_vCenter = m_CurrentCollisionPoint;
+
+	m_Kernel.BeginDab();
+	AddSelectedDispsToKernel();
+	DoPaintSmooth( pView, vPoint );
+
+	return true;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: applies the specific push operation onto the displacement
 // Input  : pView - the 3d view
@@ -3099,23 +3062,6 @@ void CSculptCarveOptions::DoPaintOperation( CMapView3D *pView, const Vector2D &v
 		return;
 	}
 
-	if ( m_bShiftDown )
-	{
-//		DoSmoothOperation( pView, vPoint, pDisp, pOrigDisp );
-//		m_SpatialData.m_flRadius = 256.0f;
-//		m_SpatialData.m_flScalar = 5.0f / m_SmoothAmount;
-
-//		m_SpatialData.m_flRadius = m_StartingProjectedRadius * 1.5f;
-		m_SpatialData.m_flRadius = m_CurrentProjectedRadius * 2.0f;
-		m_SpatialData.m_flRadius2 = ( m_SpatialData.m_flRadius * m_SpatialData.m_flRadius );
-		m_SpatialData.m_flOORadius2 = 1.0f / m_SpatialData.m_flRadius2;
-		m_SpatialData.m_flScalar = 10.0f / m_SmoothAmount;
-		m_SpatialData.m_vCenter = m_CurrentCollisionPoint;
-
-		DoPaintSmooth( pView, vPoint, pDisp, pOrigDisp );
-		return;
-	}
-
 	GetPaintAxis( pView->GetCamera(), vPoint, vPaintAxis );
 
 	vDirection = vPaintAxis * m_Direction;
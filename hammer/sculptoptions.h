@@ -11,6 +11,7 @@
 #endif
 
 #include "disppaint.h"
+#include "sculptkernel.h"
 #include "afxwin.h"
 
 class CMapView3D;
@@ -48,11 +49,12 @@ protected:
 
 	bool	IsPointInScreenCircle( CMapView3D *pView, CMapDisp *pDisp, CMapDisp *pOrigDisp, int nVertIndex, bool bUseOrigDisplacement = true, bool bUseCurrentPosition = false, float *pflLengthPercent = NULL );
 
-	void	DoPaintSmooth( CMapView3D *pView, const Vector2D &vPoint, CMapDisp *pDisp, CMapDisp *pOrigDisp );
+	void	DoPaintSmooth( CMapView3D *pView, const Vector2D &vPoint );
 	bool	PaintSphereDispBBoxOverlap( const Vector &vCenter, float flRadius, const Vector &vBBoxMin, const Vector &vBBoxMax );
 	bool	IsInSphereRadius( const Vector &vCenter, float flRadius2, const Vector &vPos, float &flDistance2 );
-	float	CalcSmoothRadius2( const Vector &vPoint );
-	bool	DoPaintSmoothOneOverExp( const Vector &vNewCenter, Vector &vPaintPos );
+
+	void	AddSelectedDispsToKernel( );
+	void	ApplyKernelResults( );
 
 	void	AddToUndo( CMapDisp **pDisp );
 
@@ -89,6 +91,8 @@ protected:
 	CPaintSculptDlg				*m_PaintOwner;
 
 	SpatialPaintData_t			m_SpatialData;
+
+	CSculptKernel				m_Kernel;				// batch brush evaluation across all selected displacements
 };
 
 class CSculptPainter : public CSculptTool
@@ -188,7 +192,9 @@ public:
 	virtual bool OnRMouseDown3D( CMapView3D *pView, UINT nFlags, const Vector2D &vPoint );
 
 protected:
+	virtual bool DoPaint( CMapView3D *pView, const Vector2D &vPoint );
 	virtual void DoPaintOperation( CMapView3D *pView, const Vector2D &vPoint, CMapDisp *pDisp, CMapDisp *pOrigDisp );
+			void DoPaintKernel( CMapView3D *pView, const Vector2D &vPoint );
 			void DoSmoothOperation( CMapView3D *pView, const Vector2D &vPoint, CMapDisp *pDisp, CMapDisp *pOrigDisp );
 
 public:
@@ -291,6 +297,7 @@ public:
 
 protected:
 	bool	IsPointAffected( CMapView3D *pView, CMapDisp *pDisp, CMapDisp *pOrigDisp, int nVertIndex, int nBrushPoint, Vector2D &vViewVert, bool bUseOrigDisplacement = true, bool bUseCurrentPosition = false );
+	virtual bool DoPaint( CMapView3D *pView, const Vector2D &vPoint );
 	virtual void DoPaintOperation( CMapView3D *pView, const Vector2D &vPoint, CMapDisp *pDisp, CMapDisp *pOrigDisp );
 
 public:
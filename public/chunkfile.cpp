@@ -38,6 +38,7 @@
 #endif
 #include <math.h>
 #include <sys/stat.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -50,6 +51,213 @@
 #include "tier0/memdbgon.h"
 
 
+//
+// Powers of ten up to the largest that a float holds exactly.
+//
+static const float s_flPowersOf10[] =
+{
+	1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+#define MAX_EXACT_FRACTION_DIGITS	10
+#define MAX_EXACT_FLOAT_MANTISSA	(1 << 24)
+
+
+//
+// Character classes used by the tokenizer.
+//
+#define CHAR_DIGIT			0x01
+#define CHAR_IDENT			0x02	// Alphanumerics and underscores.
+#define CHAR_STRING_END		0x04	// Characters that end a run of plain text in a quoted string.
+
+static unsigned char s_CharClass[256];
+
+static class CChunkFileCharClassInit
+{
+	public:
+
+		CChunkFileCharClassInit(void)
+		{
+			for (int ch = '0'; ch <= '9'; ch++)
+			{
+				s_CharClass[ch] |= CHAR_DIGIT | CHAR_IDENT;
+			}
+
+			for (int ch = 'a'; ch <= 'z'; ch++)
+			{
+				s_CharClass[ch] |= CHAR_IDENT;
+				s_CharClass[ch - 'a' + 'A'] |= CHAR_IDENT;
+			}
+
+			s_CharClass['_'] |= CHAR_IDENT;
+
+			s_CharClass['\"'] |= CHAR_STRING_END;
+			s_CharClass['\\'] |= CHAR_STRING_END;
+			s_CharClass['\r'] |= CHAR_STRING_END;
+			s_CharClass['\n'] |= CHAR_STRING_END;
+			s_CharClass['\0'] |= CHAR_STRING_END;
+		}
+} s_CharClassInit;
+
+
+static inline bool IsTokenDigit(char ch)
+{
+	return((s_CharClass[(unsigned char)ch] & CHAR_DIGIT) != 0);
+}
+
+
+static inline bool IsIdentChar(char ch)
+{
+	return((s_CharClass[(unsigned char)ch] & CHAR_IDENT) != 0);
+}
+
+
+static inline bool IsStringEndChar(char ch)
+{
+	return((s_CharClass[(unsigned char)ch] & CHAR_STRING_END) != 0);
+}
+
+
+static inline bool IsSpaceChar(char ch)
+{
+	return((ch == ' ') || ((ch >= '\t') && (ch <= '\r')));
+}
+
+
+static inline const char *SkipSpaceChars(const char *psz)
+{
+	while (IsSpaceChar(*psz))
+	{
+		psz++;
+	}
+
+	return(psz);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Parses a decimal integer the way atoi does.
+// Input  : pszValue - Text to parse. Leading whitespace is skipped.
+//			ppszEnd - Receives the end of the number, or pszValue if there was none.
+//-----------------------------------------------------------------------------
+static int ParseInt(const char *pszValue, const char **ppszEnd)
+{
+	const char *psz = SkipSpaceChars(pszValue);
+
+	bool bNegative = false;
+	if ((*psz == '-') || (*psz == '+'))
+	{
+		bNegative = (*psz == '-');
+		psz++;
+	}
+
+	if (!IsTokenDigit(*psz))
+	{
+		*ppszEnd = pszValue;
+		return(0);
+	}
+
+	unsigned int nValue = 0;
+	while (IsTokenDigit(*psz))
+	{
+		nValue = nValue * 10 + (*psz - '0');
+		psz++;
+	}
+
+	*ppszEnd = psz;
+	return((int)(bNegative ? 0u - nValue : nValue));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Parses a float the way strtof does. Numbers with a mantissa that fits
+//			in a float and no more than ten decimal places, which covers nearly
+//			every number in a map file, are converted exactly with a single
+//			division. Anything else is handed to strtof.
+// Input  : pszValue - Text to parse. Leading whitespace is skipped.
+//			ppszEnd - Receives the end of the number, or pszValue if there was none.
+//-----------------------------------------------------------------------------
+static float ParseFloat(const char *pszValue, const char **ppszEnd)
+{
+	const char *pszStart = SkipSpaceChars(pszValue);
+	const char *psz = pszStart;
+
+	bool bNegative = false;
+	if ((*psz == '-') || (*psz == '+'))
+	{
+		bNegative = (*psz == '-');
+		psz++;
+	}
+
+	unsigned int nMantissa = 0;
+	int nFractionDigits = 0;
+	bool bDigits = false;
+	bool bExact = true;
+
+	while (IsTokenDigit(*psz))
+	{
+		nMantissa = nMantissa * 10 + (*psz - '0');
+		bExact = bExact && (nMantissa < MAX_EXACT_FLOAT_MANTISSA);
+		bDigits = true;
+		psz++;
+	}
+
+	if (*psz == '.')
+	{
+		psz++;
+
+		//
+		// Trailing zeros don't change the value, so they are only counted once
+		// another digit follows them.
+		//
+		int nPendingZeros = 0;
+		while (IsTokenDigit(*psz))
+		{
+			if (*psz == '0')
+			{
+				nPendingZeros++;
+			}
+			else
+			{
+				for (int i = 0; i < nPendingZeros; i++)
+				{
+					nMantissa *= 10;
+					bExact = bExact && (nMantissa < MAX_EXACT_FLOAT_MANTISSA);
+				}
+
+				nMantissa = nMantissa * 10 + (*psz - '0');
+				bExact = bExact && (nMantissa < MAX_EXACT_FLOAT_MANTISSA);
+				nFractionDigits += nPendingZeros + 1;
+				nPendingZeros = 0;
+			}
+
+			bDigits = true;
+			psz++;
+		}
+	}
+
+	//
+	// Exponents, hex, infinities and long mantissas take the slow path.
+	//
+	if (!bDigits || !bExact || (nFractionDigits > MAX_EXACT_FRACTION_DIGITS) || IsIdentChar(*psz) || (*psz == '.'))
+	{
+		char *pszEnd;
+		float flValue = strtof(pszStart, &pszEnd);
+		*ppszEnd = (pszEnd != pszStart) ? pszEnd : pszValue;
+		return(flValue);
+	}
+
+	float flValue = (float)nMantissa;
+	if (nFractionDigits > 0)
+	{
+		flValue /= s_flPowersOf10[nFractionDigits];
+	}
+
+	*ppszEnd = psz;
+	return(bNegative ? -flValue : flValue);
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Constructor.
 //-----------------------------------------------------------------------------
@@ -90,6 +298,14 @@ void CChunkHandlerMap::AddHandler(const char *pszChunkName, ChunkHandler_t pfnHa
 	pNew->Handler.pData = pData;
 	pNew->pNext = NULL;
 
+	//
+	// The first handler added for a chunk name is the one that gets used.
+	//
+	if (m_HandlerIndex.Find(pNew->Handler.szChunkName) == m_HandlerIndex.InvalidHandle())
+	{
+		m_HandlerIndex.Insert(pNew->Handler.szChunkName, pNew);
+	}
+
 	if (m_pHandlers == NULL)
 	{
 		m_pHandlers = pNew;
@@ -139,16 +355,12 @@ ChunkErrorHandler_t CChunkHandlerMap::GetErrorHandler(void **ppData)
 //-----------------------------------------------------------------------------
 ChunkHandler_t CChunkHandlerMap::GetHandler(const char *pszChunkName, void **ppData)
 {
-	ChunkHandlerInfoNode_t *pNode = m_pHandlers;
-	while (pNode != NULL)
+	UtlHashHandle_t hNode = m_HandlerIndex.Find(pszChunkName);
+	if (hNode != m_HandlerIndex.InvalidHandle())
 	{
-		if (!stricmp(pNode->Handler.szChunkName, pszChunkName))
-		{
-			*ppData = pNode->Handler.pData;
-			return(pNode->Handler.pfnHandler);
-		}
-
-		pNode = pNode->pNext;
+		ChunkHandlerInfoNode_t *pNode = m_HandlerIndex[hNode];
+		*ppData = pNode->Handler.pData;
+		return(pNode->Handler.pfnHandler);
 	}
 
 	return NULL;
@@ -160,6 +372,11 @@ ChunkHandler_t CChunkHandlerMap::GetHandler(const char *pszChunkName, void **ppD
 //-----------------------------------------------------------------------------
 CChunkFile::CChunkFile(void)
 {
+	m_pBuffer = NULL;
+	m_pCursor = NULL;
+	m_pBufferEnd = NULL;
+	m_nLine = 1;
+	m_szFileName[0] = '\0';
 	m_hFile = NULL;
 	m_nCurrentDepth = 0;
 	m_szIndent[0] = '\0';
@@ -177,6 +394,8 @@ CChunkFile::~CChunkFile(void)
 	{
 		fclose(m_hFile);
 	}
+
+	delete [] m_pBuffer;
 }
 
 
@@ -236,6 +455,11 @@ ChunkFileResult_t CChunkFile::Close(void)
 		m_hFile = NULL;
 	}
 
+	delete [] m_pBuffer;
+	m_pBuffer = NULL;
+	m_pCursor = NULL;
+	m_pBufferEnd = NULL;
+
 	return(ChunkFile_Ok);
 }
 
@@ -297,7 +521,9 @@ const char *CChunkFile::GetErrorText(ChunkFileResult_t eResult)
 		}
 	}
 
-	return(m_TokenReader.Error(szError));
+	static char szErrorWithLine[MAX_KEYVALUE_LEN + MAX_PATH];
+	Q_snprintf(szErrorWithLine, sizeof( szErrorWithLine ), "File %s, line %d: %s", m_szFileName, m_nLine, szError);
+	return(szErrorWithLine);
 }
 
 
@@ -362,10 +588,12 @@ ChunkFileResult_t CChunkFile::HandleChunk(const char *szChunkName)
 			do
 			{
 				ChunkType_t eChunkType;
-				char szKey[MAX_KEYVALUE_LEN];
-				char szValue[MAX_KEYVALUE_LEN];
+				const char *pszKey;
+				const char *pszValue;
+				char szKeyScratch[MAX_KEYVALUE_LEN];
+				char szValueScratch[MAX_KEYVALUE_LEN];
 
-				while ((eResult = ReadNext(szKey, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+				while ((eResult = ReadNextInPlace(pszKey, pszValue, eChunkType, szKeyScratch, szValueScratch)) == ChunkFile_Ok)
 				{
 					if (eChunkType == ChunkType_Chunk)
 					{
@@ -402,16 +630,39 @@ ChunkFileResult_t CChunkFile::Open(const char *pszFileName, ChunkFileOpenMode_t
 {
 	if (eMode == ChunkFile_Read)
 	{
-		// UNDONE: TokenReader encapsulates file - unify reading and writing to use the same file I/O.
-		// UNDONE: Support in-memory parsing.
-		if (m_TokenReader.Open(pszFileName))
+		//
+		// Read the whole file into memory with one read so that it can be
+		// tokenized in place.
+		//
+		FILE *hFile = fopen(pszFileName, "rb");
+		if (hFile == NULL)
 		{
-			m_nCurrentDepth = 0;
+			return(ChunkFile_OpenFail);
 		}
-		else
+
+		fseek(hFile, 0, SEEK_END);
+		long nFileSize = ftell(hFile);
+		fseek(hFile, 0, SEEK_SET);
+
+		if (nFileSize < 0)
 		{
+			fclose(hFile);
 			return(ChunkFile_OpenFail);
 		}
+
+		delete [] m_pBuffer;
+		m_pBuffer = new char[nFileSize + 1];
+
+		size_t nRead = fread(m_pBuffer, 1, nFileSize, hFile);
+		fclose(hFile);
+
+		m_pBuffer[nRead] = '\0';
+		m_pCursor = m_pBuffer;
+		m_pBufferEnd = m_pBuffer + nRead;
+		m_nLine = 1;
+		Q_strncpy(m_szFileName, pszFileName, sizeof( m_szFileName ));
+
+		m_nCurrentDepth = 0;
 	}
 	else if (eMode == ChunkFile_Write)
 	{
@@ -462,107 +713,397 @@ void CChunkFile::PushHandlers(CChunkHandlerMap *pHandlerMap)
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Reads the next term from the chunk file. The type of term read is
-//			returned in the eChunkType parameter.
-// Input  : szName - Name of key or chunk.
-//			szValue - If eChunkType is ChunkType_Key, contains the value of the key.
-//			nValueSize - Size of the buffer pointed to by szValue.
-//			eChunkType - ChunkType_Key or ChunkType_Chunk.
-// Output : Returns ChunkFile_Ok on success, an error code if a parsing error occurs.
+// Purpose: Skips whitespace and comments in the read buffer.
+// Output : Returns true if the whitespace contained the combine strings
+//			character '+', which is used to merge consecutive quoted strings.
 //-----------------------------------------------------------------------------
-ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSize, ChunkType_t &eChunkType)
+bool CChunkFile::SkipWhiteSpace(void)
 {
-	// HACK: pass in buffer sizes?
-	trtoken_t eTokenType = m_TokenReader.NextToken(szName, MAX_KEYVALUE_LEN);
+	bool bCombineStrings = false;
 
-	if (eTokenType != TOKENEOF)
+	while (true)
 	{
-		switch (eTokenType)
+		char ch = *m_pCursor;
+
+		if ((ch == ' ') || (ch == '\t') || (ch == '\r'))
+		{
+			m_pCursor++;
+		}
+		else if (ch == '\n')
+		{
+			m_nLine++;
+			m_pCursor++;
+		}
+		else if (ch == '+')
+		{
+			bCombineStrings = true;
+			m_pCursor++;
+		}
+		else if (ch == '/')
 		{
-			case IDENT:
-			case STRING:
+			//
+			// Comments run to the end of the line. A lone slash is ignored.
+			//
+			m_pCursor++;
+			if (*m_pCursor == '/')
 			{
-				char szNext[MAX_KEYVALUE_LEN];
-				trtoken_t eNextTokenType;
+				while ((m_pCursor < m_pBufferEnd) && (*m_pCursor != '\n'))
+				{
+					m_pCursor++;
+				}
+			}
+		}
+		else if ((ch == '\0') && (m_pCursor < m_pBufferEnd))
+		{
+			m_pCursor++;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	return(bCombineStrings);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the next token from the read buffer. Tokenizes the same way
+//			as TokenReader.
+// Input  : pszToken - Receives the token text.
+//			pszScratch - MAX_KEYVALUE_LEN buffer for tokens that can't be
+//				terminated in place.
+// Output : Returns the type of token that was read.
+//-----------------------------------------------------------------------------
+trtoken_t CChunkFile::ReadToken(const char *&pszToken, char *pszScratch)
+{
+	if (m_pBuffer == NULL)
+	{
+		return(TOKENEOF);
+	}
+
+	SkipWhiteSpace();
+
+	if (m_pCursor >= m_pBufferEnd)
+	{
+		return(TOKENEOF);
+	}
+
+	char ch = *m_pCursor++;
+
+	switch (ch)
+	{
+		case '@':
+		case ',':
+		case '!':
+		case '+':
+		case '&':
+		case '*':
+		case '$':
+		case '.':
+		case '=':
+		case ':':
+		case '[':
+		case ']':
+		case '(':
+		case ')':
+		case '{':
+		case '}':
+		case '\\':
+		{
+			pszScratch[0] = ch;
+			pszScratch[1] = '\0';
+			pszToken = pszScratch;
+			return(OPERATOR);
+		}
 
+		case '\"':
+		{
+			//
+			// Quoted strings are unescaped and terminated in place. The result is
+			// never longer than the source text, so it can't run into the next token.
+			//
+			char *pszDest = m_pCursor;
+			pszToken = pszDest;
+
+			while (true)
+			{
 				//
-				// Read the next token to determine what we have.
+				// Take the run of plain text up to the next quote, backslash or newline.
+				// Nothing needs moving until an escape or a combined string is seen.
 				//
-				eNextTokenType = m_TokenReader.NextToken(szNext, sizeof(szNext));
+				char *pszRun = m_pCursor;
+				while (!IsStringEndChar(*m_pCursor))
+				{
+					m_pCursor++;
+				}
 
-				switch (eNextTokenType)
+				int nRunLength = m_pCursor - pszRun;
+				if (pszDest != pszRun)
 				{
-					case OPERATOR:
-					{
-						if (!stricmp(szNext, "{"))
-						{
-							// Beginning of new chunk.
-							m_nCurrentDepth++;
-							eChunkType = ChunkType_Chunk;
-							szValue[0] = '\0';
-							return(ChunkFile_Ok);
-						}
-						else
-						{
-							// Unexpected symbol.
-							Q_strncpy(m_szErrorToken, szNext, sizeof( m_szErrorToken ) );
-							return(ChunkFile_UnexpectedSymbol);
-						}
-					}
+					memmove(pszDest, pszRun, nRunLength);
+				}
+
+				pszDest += nRunLength;
 
-					case STRING:
-					case IDENT:
+				ch = *m_pCursor;
+
+				if ((ch == '\r') || (pszDest - pszToken > MAX_KEYVALUE_LEN - 1))
+				{
+					//
+					// Newline encountered before closing quote, or the string won't fit
+					// in the callers' buffers. Skip to the close-quote and exit.
+					//
+					while ((m_pCursor < m_pBufferEnd) && (*m_pCursor++ != '\"'))
 					{
-						// Key value pair.
-						Q_strncpy(szValue, szNext, nValueSize );
-						eChunkType = ChunkType_Key;
-						return(ChunkFile_Ok);
 					}
 
-					case TOKENEOF:
+					*pszDest = '\0';
+					return(TOKENSTRINGTOOLONG);
+				}
+
+				if (ch == '\"')
+				{
+					m_pCursor++;
+
+					//
+					// Combine consecutive quoted strings if the combine strings character
+					// was encountered between the two strings.
+					//
+					if (SkipWhiteSpace() && (*m_pCursor == '\"'))
 					{
-						// Unexpected end of file.
-						return(ChunkFile_UnexpectedEOF);
+						m_pCursor++;
+						continue;
 					}
 
-					case TOKENSTRINGTOOLONG:
+					*pszDest = '\0';
+					return(STRING);
+				}
+
+				if (m_pCursor >= m_pBufferEnd)
+				{
+					*pszDest = '\0';
+					return(TOKENEOF);
+				}
+
+				m_pCursor++;
+
+				if (ch == '\n')
+				{
+					m_nLine++;
+				}
+				else if ((ch == '\\') && (*m_pCursor != '\"') && (m_pCursor < m_pBufferEnd))
+				{
+					//
+					// Backslash sequence - replace with the appropriate character.
+					//
+					ch = *m_pCursor++;
+					if (ch == 'n')
 					{
-						// String too long or unterminated string.
-						return ChunkFile_StringTooLong;
+						ch = '\n';
 					}
 				}
+
+				*pszDest++ = ch;
 			}
+		}
+	}
+
+	char *pszStore = pszScratch;
+	char *pszStoreEnd = pszScratch + MAX_KEYVALUE_LEN - 1;
+	pszToken = pszScratch;
 
-			case OPERATOR:
+	//
+	// Integers consist of numbers with an optional leading minus sign.
+	//
+	if (IsTokenDigit(ch) || (ch == '-'))
+	{
+		*pszStore++ = ch;
+
+		while (IsTokenDigit(*m_pCursor))
+		{
+			if (pszStore < pszStoreEnd)
 			{
-				if (!stricmp(szName, "}"))
+				*pszStore++ = *m_pCursor;
+			}
+
+			m_pCursor++;
+		}
+
+		*pszStore = '\0';
+
+		//
+		// No identifier characters are allowed contiguous with numbers.
+		//
+		if ((*m_pCursor == '-') || IsIdentChar(*m_pCursor))
+		{
+			m_pCursor++;
+			return(TOKENERROR);
+		}
+
+		return(INTEGER);
+	}
+
+	//
+	// Identifiers consist of a consecutive string of alphanumeric
+	// characters and underscores.
+	//
+	if (IsIdentChar(ch))
+	{
+		*pszStore++ = ch;
+
+		while (IsIdentChar(*m_pCursor))
+		{
+			if (pszStore < pszStoreEnd)
+			{
+				*pszStore++ = *m_pCursor;
+			}
+
+			m_pCursor++;
+		}
+
+		*pszStore = '\0';
+		return(IDENT);
+	}
+
+	//
+	// Anything else isn't a token. It has been consumed so that parsing can't stall on it.
+	//
+	pszScratch[0] = ch;
+	pszScratch[1] = '\0';
+	return(TOKENERROR);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the next term from the chunk file without copying it. The
+//			name and value point into the read buffer or into the given scratch
+//			buffers, and are valid until the next read.
+// Input  : pszName - Receives the name of the key or chunk.
+//			pszValue - If eChunkType is ChunkType_Key, receives the value of the key.
+//			eChunkType - ChunkType_Key or ChunkType_Chunk.
+//			pszNameScratch, pszValueScratch - MAX_KEYVALUE_LEN scratch buffers.
+// Output : Returns ChunkFile_Ok on success, an error code if a parsing error occurs.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CChunkFile::ReadNextInPlace(const char *&pszName, const char *&pszValue, ChunkType_t &eChunkType, char *pszNameScratch, char *pszValueScratch)
+{
+	trtoken_t eTokenType = ReadToken(pszName, pszNameScratch);
+
+	switch (eTokenType)
+	{
+		case IDENT:
+		case STRING:
+		{
+			//
+			// Read the next token to determine what we have.
+			//
+			trtoken_t eNextTokenType = ReadToken(pszValue, pszValueScratch);
+
+			switch (eNextTokenType)
+			{
+				case OPERATOR:
+				{
+					if (pszValue[0] == '{')
+					{
+						// Beginning of new chunk.
+						m_nCurrentDepth++;
+						eChunkType = ChunkType_Chunk;
+						pszValue = "";
+						return(ChunkFile_Ok);
+					}
+
+					break;
+				}
+
+				case STRING:
+				case IDENT:
+				{
+					// Key value pair.
+					eChunkType = ChunkType_Key;
+					return(ChunkFile_Ok);
+				}
+
+				case TOKENEOF:
 				{
-					// End of current chunk.
-					m_nCurrentDepth--;
-					return(ChunkFile_EndOfChunk);
+					// Unexpected end of file.
+					return(ChunkFile_UnexpectedEOF);
 				}
-				else
+
+				case TOKENSTRINGTOOLONG:
 				{
-					// Unexpected symbol.
-					Q_strncpy(m_szErrorToken, szName, sizeof( m_szErrorToken ) );
-					return(ChunkFile_UnexpectedSymbol);
+					// String too long or unterminated string.
+					return(ChunkFile_StringTooLong);
 				}
 			}
 
-			case TOKENSTRINGTOOLONG:
+			// Unexpected symbol.
+			Q_strncpy(m_szErrorToken, pszValue, sizeof( m_szErrorToken ) );
+			return(ChunkFile_UnexpectedSymbol);
+		}
+
+		case OPERATOR:
+		{
+			if (pszName[0] == '}')
+			{
+				// End of current chunk.
+				m_nCurrentDepth--;
+				return(ChunkFile_EndOfChunk);
+			}
+
+			break;
+		}
+
+		case TOKENSTRINGTOOLONG:
+		{
+			return(ChunkFile_StringTooLong);
+		}
+
+		case TOKENEOF:
+		{
+			if (m_nCurrentDepth != 0)
 			{
-				return ChunkFile_StringTooLong;
+				// End of file while within the scope of a chunk.
+				return(ChunkFile_UnexpectedEOF);
 			}
+
+			return(ChunkFile_EOF);
 		}
 	}
 
-	if (m_nCurrentDepth != 0)
+	// Unexpected symbol.
+	Q_strncpy(m_szErrorToken, pszName, sizeof( m_szErrorToken ) );
+	return(ChunkFile_UnexpectedSymbol);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the next term from the chunk file. The type of term read is
+//			returned in the eChunkType parameter.
+// Input  : szName - Name of key or chunk.
+//			szValue - If eChunkType is ChunkType_Key, contains the value of the key.
+//			nValueSize - Size of the buffer pointed to by szValue.
+//			eChunkType - ChunkType_Key or ChunkType_Chunk.
+// Output : Returns ChunkFile_Ok on success, an error code if a parsing error occurs.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSize, ChunkType_t &eChunkType)
+{
+	const char *pszName = szName;
+	const char *pszValue = "";
+	char szValueScratch[MAX_KEYVALUE_LEN];
+
+	// HACK: pass in buffer sizes?
+	ChunkFileResult_t eResult = ReadNextInPlace(pszName, pszValue, eChunkType, szName, szValueScratch);
+	if (eResult == ChunkFile_Ok)
 	{
-		// End of file while within the scope of a chunk.
-		return(ChunkFile_UnexpectedEOF);
+		if (pszName != szName)
+		{
+			Q_strncpy(szName, pszName, MAX_KEYVALUE_LEN);
+		}
+
+		Q_strncpy(szValue, pszValue, nValueSize);
 	}
 
-	return(ChunkFile_EOF);
+	return(eResult);
 }
 
 
@@ -580,13 +1121,18 @@ ChunkFileResult_t CChunkFile::ReadChunk(KeyHandler_t pfnKeyHandler, void *pData)
 	// Read the keys and sub-chunks.
 	//
 	ChunkFileResult_t eResult;
+	char szNameScratch[MAX_KEYVALUE_LEN];
+	char szValueScratch[MAX_KEYVALUE_LEN];
 	do
 	{
-		char szName[MAX_KEYVALUE_LEN];
-		char szValue[MAX_KEYVALUE_LEN];
+		const char *pszName;
+		const char *pszValue;
 		ChunkType_t eChunkType;
 
-		eResult = ReadNext(szName, szValue, sizeof(szValue), eChunkType);
+		//
+		// Keys and values are handed to the handlers straight from the read buffer.
+		//
+		eResult = ReadNextInPlace(pszName, pszValue, eChunkType, szNameScratch, szValueScratch);
 
 		if (eResult == ChunkFile_Ok)
 		{
@@ -595,14 +1141,14 @@ ChunkFileResult_t CChunkFile::ReadChunk(KeyHandler_t pfnKeyHandler, void *pData)
 				//
 				// Dispatch sub-chunks to the appropriate handler.
 				//
-				eResult = HandleChunk(szName);
+				eResult = HandleChunk(pszName);
 			}
 			else if ((eChunkType == ChunkType_Key) && (pfnKeyHandler != NULL))
 			{
 				//
 				// Dispatch keys to the key value handler.
 				//
-				eResult = pfnKeyHandler(szName, szValue, pData);
+				eResult = pfnKeyHandler(pszName, pszValue, pData);
 			}
 		}
 	} while (eResult == ChunkFile_Ok);
@@ -635,7 +1181,8 @@ ChunkFileResult_t CChunkFile::ReadChunk(KeyHandler_t pfnKeyHandler, void *pData)
 //-----------------------------------------------------------------------------
 bool CChunkFile::ReadKeyValueBool(const char *pszValue, bool &bBool)
 {
-	int nValue = atoi(pszValue);
+	const char *pszEnd;
+	int nValue = ParseInt(pszValue, &pszEnd);
 
 	if (nValue > 0)
 	{
@@ -658,7 +1205,8 @@ bool CChunkFile::ReadKeyValueBool(const char *pszValue, bool &bBool)
 //-----------------------------------------------------------------------------
 bool CChunkFile::ReadKeyValueFloat(const char *pszValue, float &flFloat)
 {
-	flFloat = (float)atof(pszValue);
+	const char *pszEnd;
+	flFloat = ParseFloat(pszValue, &pszEnd);
 	return(true);
 }
 
@@ -671,7 +1219,8 @@ bool CChunkFile::ReadKeyValueFloat(const char *pszValue, float &flFloat)
 //-----------------------------------------------------------------------------
 bool CChunkFile::ReadKeyValueInt(const char *pszValue, int &nInt)
 {
-	nInt = atoi(pszValue);
+	const char *pszEnd;
+	nInt = ParseInt(pszValue, &pszEnd);
 	return(true);
 }
 
@@ -692,7 +1241,7 @@ bool CChunkFile::ReadKeyValueColor(const char *pszValue, unsigned char &chRed, u
 		int g = 0;
 		int b = 0;
 
-		if (sscanf(pszValue, "%d %d %d", &r, &g, &b) == 3)
+		if (ScanValue(pszValue, "%d %d %d", &r, &g, &b) == 3)
 		{
 			chRed = r;
 			chGreen = g;
@@ -716,7 +1265,7 @@ bool CChunkFile::ReadKeyValuePoint(const char *pszValue, Vector &Point)
 {
 	if (pszValue != NULL)
 	{
-		return(sscanf(pszValue, "(%f %f %f)", &Point.x, &Point.y, &Point.z) == 3);
+		return(ScanValue(pszValue, "(%f %f %f)", &Point.x, &Point.y, &Point.z) == 3);
 	}
 
 	return(false);
@@ -733,7 +1282,7 @@ bool CChunkFile::ReadKeyValueVector2(const char *pszValue, Vector2D &vec)
 {
 	if (pszValue != NULL)
 	{
-		return ( sscanf( pszValue, "[%f %f]", &vec.x, &vec.y) == 2 );
+		return ( ScanValue( pszValue, "[%f %f]", &vec.x, &vec.y) == 2 );
 	}
 
 	return(false);
@@ -750,7 +1299,7 @@ bool CChunkFile::ReadKeyValueVector3(const char *pszValue, Vector &vec)
 {
 	if (pszValue != NULL)
 	{
-		return(sscanf(pszValue, "[%f %f %f]", &vec.x, &vec.y, &vec.z) == 3);
+		return(ScanValue(pszValue, "[%f %f %f]", &vec.x, &vec.y, &vec.z) == 3);
 	}
 
 	return(false);
@@ -767,13 +1316,106 @@ bool CChunkFile::ReadKeyValueVector4(const char *pszValue, Vector4D &vec)
 {
 	if( pszValue != NULL )
 	{
-		return(sscanf(pszValue, "[%f %f %f %f]", &vec[0], &vec[1], &vec[2], &vec[3]) == 4);
+		return(ScanValue(pszValue, "[%f %f %f %f]", &vec[0], &vec[1], &vec[2], &vec[3]) == 4);
 	}
 
 	return false;
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Parses a key value like sscanf, for the conversions that map files
+//			use. Whitespace in the format matches any amount of whitespace, %f,
+//			%d and %i convert as they do for sscanf, and other characters must
+//			match exactly.
+// Input  : pszValue - Text to parse.
+//			pszFormat - Format string.
+// Output : Returns the number of values converted, or EOF if the input ran out
+//			before anything was converted.
+//-----------------------------------------------------------------------------
+int CChunkFile::ScanValue(const char *pszValue, const char *pszFormat, ...)
+{
+	va_list args;
+	va_start(args, pszFormat);
+
+	int nConverted = 0;
+	const char *pszIn = pszValue;
+	const char *pszFmt = pszFormat;
+
+	while (*pszFmt != '\0')
+	{
+		if (IsSpaceChar(*pszFmt))
+		{
+			pszIn = SkipSpaceChars(pszIn);
+			pszFmt++;
+		}
+		else if (*pszFmt == '%')
+		{
+			const char *pszEnd = pszIn;
+			pszFmt++;
+
+			if (*pszFmt == 'f')
+			{
+				float flValue = ParseFloat(pszIn, &pszEnd);
+				if (pszEnd != pszIn)
+				{
+					*va_arg(args, float *) = flValue;
+				}
+			}
+			else if (*pszFmt == 'd')
+			{
+				int nValue = ParseInt(pszIn, &pszEnd);
+				if (pszEnd != pszIn)
+				{
+					*va_arg(args, int *) = nValue;
+				}
+			}
+			else if (*pszFmt == 'i')
+			{
+				char *pszIntEnd;
+				long nValue = strtol(pszIn, &pszIntEnd, 0);
+				pszEnd = pszIntEnd;
+				if (pszEnd != pszIn)
+				{
+					*va_arg(args, int *) = (int)nValue;
+				}
+			}
+			else
+			{
+				AssertMsg(false, "CChunkFile::ScanValue: unsupported conversion");
+			}
+
+			if (pszEnd == pszIn)
+			{
+				break;
+			}
+
+			pszIn = pszEnd;
+			pszFmt++;
+			nConverted++;
+		}
+		else if (*pszIn == *pszFmt)
+		{
+			pszIn++;
+			pszFmt++;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	va_end(args);
+
+	if ((nConverted == 0) && (*pszFmt != '\0') && (*SkipSpaceChars(pszIn) == '\0'))
+	{
+		return(EOF);
+	}
+
+	return(nConverted);
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose:
 // Input  : pszLine -
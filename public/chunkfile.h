@@ -14,6 +14,7 @@
 
 #include <stdio.h>
 #include "tokenreader.h"
+#include "tier1/utlhashtable.h"
 
 #define MAX_INDENT_DEPTH		80
 #define MAX_KEYVALUE_LEN		1024
@@ -121,6 +122,7 @@ class CChunkHandlerMap
 	protected:
 
 		ChunkHandlerInfoNode_t *m_pHandlers;
+		CUtlHashtable<const char *, ChunkHandlerInfoNode_t *, CaselessStringHashFunctor, CaselessStringEqualFunctor> m_HandlerIndex;
 		ChunkErrorHandler_t m_pfnErrorHandler;
 		void *m_pErrorData;
 };
@@ -179,6 +181,10 @@ class CChunkFile
 		static bool ReadKeyValueVector3(const char *pszValue, Vector &vec);
 	    static bool ReadKeyValueVector4( const char *pszValue, Vector4D &vec);
 
+		// A subset of sscanf for parsing key values: %f, %d, %i, whitespace and
+		// literal characters. Returns the number of values converted.
+		static int ScanValue(const char *pszValue, const char *pszFormat, ...);
+
 		// The default chunk handler gets called before any other chunk handlers.
 		//
 		// If the handler returns ChunkFile_Ok, then it goes into the chunk.
@@ -197,11 +203,27 @@ class CChunkFile
 		void PushHandlers(CChunkHandlerMap *pHandlerMap);
 		void PopHandlers(void);
 
+		// Offset of the next character to be read from the start of the file.
+		inline int GetReadOffset(void) const { return (int)(m_pCursor - m_pBuffer); }
+
 	protected:
 
 		void BuildIndentString(char *pszDest, int nDepth);
 
-		TokenReader m_TokenReader;
+		//
+		// The file being read is held in memory and tokenized in place. Quoted
+		// strings are terminated within the buffer, other tokens are copied to
+		// the given scratch buffer, which must be MAX_KEYVALUE_LEN in size.
+		//
+		bool SkipWhiteSpace(void);
+		trtoken_t ReadToken(const char *&pszToken, char *pszScratch);
+		ChunkFileResult_t ReadNextInPlace(const char *&pszName, const char *&pszValue, ChunkType_t &eChunkType, char *pszNameScratch, char *pszValueScratch);
+
+		char *m_pBuffer;
+		char *m_pCursor;
+		char *m_pBufferEnd;
+		int m_nLine;
+		char m_szFileName[MAX_PATH];
 
 		FILE *m_hFile;
 		char m_szErrorToken[80];
@@ -13,6 +13,7 @@
 #include "tokenreader.h"
 #include "gdclass.h"
 #include "utlvector.h"
+#include "utlhashtable.h"
 
 
 class MDkeyvalue;
@@ -69,6 +70,14 @@ class GameData
 
 		void ClearData();
 
+		// Changes whenever classes are deleted or overridden, so anything that
+		// caches GDclass or GDinputvariable pointers knows to drop them.
+		static inline int GetGeneration(void) { return s_nGeneration; }
+
+		// Brings every class's variable index up to date. Until the classes next
+		// change, VarForName doesn't modify them and is safe to call from threads.
+		void PrepareVariableIndexes(void);
+
 		inline int GetMaxMapCoord(void);
 		inline int GetMinMapCoord(void);
 
@@ -89,8 +98,12 @@ class GameData
 	private:
 
 		bool ParseMapSize(TokenReader &tr);
+		void BuildVariableIndexes(void);
 
 		CUtlVector<GDclass *> m_Classes;
+		CUtlHashtable<const char *, int> m_ClassIndex;	// Class name to index in m_Classes.
+
+		static int s_nGeneration;
 
 		int m_nMinMapCoord;		// Min & max map bounds as defined by the FGD.
 		int m_nMaxMapCoord;
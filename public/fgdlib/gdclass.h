@@ -22,6 +22,7 @@
 #include "gdvar.h"
 #include "inputoutput.h"
 #include "mathlib/vector.h"
+#include "utlhashtable.h"
 
 class CHelperInfo;
 class GameData;
@@ -55,6 +56,8 @@ class GDclass
 		GDinputvariable *GetVariableAt(int iIndex);
 		void GetHelperForGDVar( GDinputvariable *pVar, CUtlVector<const char *> *helperName );
 		GDinputvariable *VarForName(const char *pszName, int *piIndex = NULL);
+		void BuildVariableIndex(void);
+		void PrepareVariableIndex(void);
 		BOOL AddVariable(GDinputvariable *pVar, GDclass *pBase, int iBaseIndex, int iVarIndex);
 		void AddBase(GDclass *pBase);
 
@@ -167,6 +170,14 @@ class GDclass
 		//
 		signed short m_VariableMap[GD_MAX_VARIABLES][2];
 
+		//
+		// Variable name (ignoring case) to index in m_VariableMap. Inherited entries
+		// resolve through the base classes, so this is rebuilt when the GameData
+		// generation says a class has been overridden.
+		//
+		CUtlHashtable<const char *, int, CaselessStringHashFunctor, CaselessStringEqualFunctor> m_VariableIndex;
+		int m_nVariableIndexGeneration;
+
 		Vector m_bmins;		// 3D minima of object (pointclass).
 		Vector m_bmaxs;		// 3D maxima of object (pointclass).
 };
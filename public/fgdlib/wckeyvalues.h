@@ -12,12 +12,20 @@
 #include <tier0/dbg.h>
 #include <utlvector.h>
 #include <utldict.h>
+#include <utllinkedlist.h>
+#include <utlsymbol.h>
 
 
 #define KEYVALUE_MAX_KEY_LENGTH			80
 #define KEYVALUE_MAX_VALUE_LENGTH		512
 
 
+//-----------------------------------------------------------------------------
+// Key names are interned in a global table, so all the keyvalues with the same
+// key share one copy of its name and find each other by symbol instead of by
+// string compare. Values short enough to fit are kept in the keyvalue itself,
+// longer ones are allocated.
+//-----------------------------------------------------------------------------
 class MDkeyvalue
 {
 	public:
@@ -26,71 +34,102 @@ class MDkeyvalue
 		// Constructors/Destructor.
 		//
 		inline MDkeyvalue(void);
-		inline MDkeyvalue(const char *pszKey, const char *pszValue);
+		MDkeyvalue(const char *pszKey, const char *pszValue);
+		MDkeyvalue(const MDkeyvalue &other);
 		~MDkeyvalue(void);
 
 		MDkeyvalue &operator =(const MDkeyvalue &other);
 
-		inline void Set(const char *pszKey, const char *pszValue);
-		inline const char *Key(void) const;
+		void Set(const char *pszKey, const char *pszValue);
+		void SetKey(const char *pszKey);
+		void SetValue(const char *pszValue);
+
+		const char *Key(void) const;
 		inline const char *Value(void) const;
 
-		char szKey[KEYVALUE_MAX_KEY_LENGTH];			// The name of this key.
-		char szValue[KEYVALUE_MAX_VALUE_LENGTH];		// The value of this key, stored as a string.
+		// Case-insensitive symbol for the key, see KeyValue_FindKeySymbol.
+		inline CUtlSymbol KeySymbol(void) const;
+
+		// Bytes allocated for the value outside of the keyvalue itself.
+		inline int GetValueAllocSize(void) const;
+
+	private:
+
+		enum { INLINE_VALUE_LENGTH = 24 };
+
+		void FreeValue(void);
+
+		union
+		{
+			char m_szInlineValue[INLINE_VALUE_LENGTH];	// Values shorter than INLINE_VALUE_LENGTH.
+			char *m_pszValue;							// Anything longer.
+		};
+
+		CUtlSymbol m_Key;				// The name of this key, as it was spelled.
+		CUtlSymbol m_LookupKey;			// The name of this key, ignoring case.
+		unsigned short m_nValueAlloc;	// Size of m_pszValue, or zero if the value is inline.
 };
 
 
+// Returns the symbol keys named pszKey (in any case) have, or UTL_INVAL_SYMBOL
+// if no keyvalue has ever had that key. A valid symbol never changes, so callers
+// that look up the same key over and over can keep it and use FindByKeySymbol.
+// Safe to call from any thread.
+CUtlSymbol KeyValue_FindKeySymbol(const char *pszKey);
+
+// Bytes used by the interned key names.
+int KeyValue_GetKeyTableSize(void);
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Constructor.
 //-----------------------------------------------------------------------------
 MDkeyvalue::MDkeyvalue(void)
 {
-	szKey[0] = '\0';
-	szValue[0] = '\0';
+	m_szInlineValue[0] = '\0';
+	m_nValueAlloc = 0;
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Constructor with assignment.
+// Purpose: Returns the string value of this keyvalue.
 //-----------------------------------------------------------------------------
-MDkeyvalue::MDkeyvalue(const char *pszKey, const char *pszValue)
+const char *MDkeyvalue::Value(void) const
 {
-	szKey[0] = '\0';
-	szValue[0] = '\0';
-
-	Set(pszKey, pszValue);
+	return m_nValueAlloc ? m_pszValue : m_szInlineValue;
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Assigns a key and value.
+// Purpose: Returns the case-insensitive symbol for this key.
 //-----------------------------------------------------------------------------
-void MDkeyvalue::Set(const char *pszKey, const char *pszValue)
+CUtlSymbol MDkeyvalue::KeySymbol(void) const
 {
-	Assert(pszKey);
-	Assert(pszValue);
-
-	strcpy(szKey, pszKey);
-	strcpy(szValue, pszValue);
+	return m_LookupKey;
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Returns the string keyname.
+// Purpose: Returns the size of the value's allocation, if it has one.
 //-----------------------------------------------------------------------------
-const char *MDkeyvalue::Key(void) const
+int MDkeyvalue::GetValueAllocSize(void) const
 {
-	return szKey;
+	return m_nValueAlloc;
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Returns the string value of this keyvalue.
+// Memory used by one or more keyvalue lists, along with what the same pairs
+// took when every keyvalue held fixed size key and value buffers.
 //-----------------------------------------------------------------------------
-const char *MDkeyvalue::Value(void) const
+struct KeyValueMemoryStats_t
 {
-	return szValue;
-}
+	KeyValueMemoryStats_t() : m_nKeyValues(0), m_nBytes(0), m_nFixedSizeBytes(0) {}
+
+	int m_nKeyValues;
+	int m_nBytes;
+	int m_nFixedSizeBytes;
+};
 
 
 typedef CUtlVector<MDkeyvalue> KeyValueArray;
@@ -108,7 +147,9 @@ public:
 	static inline int GetInvalidIndex()	{ return -1; }
 
 	void RemoveKeyAt(int nIndex);
+	void GetMemoryStats( KeyValueMemoryStats_t &stats ) const;
 	int FindByKeyName( const char *pKeyName ) const; // Returns the same value as GetInvalidIndex if not found.
+	int FindByKeySymbol( CUtlSymbol LookupKey ) const; // Same, for a symbol from KeyValue_FindKeySymbol.
 
 	// Special function used for non-unique keyvalue lists.
 	void AddKeyValue(const char *pszKey, const char *pszValue);
@@ -122,24 +163,27 @@ protected:
 };
 
 // Used for most key/value sets because it's fast. Does not allow duplicate key names.
+// Iterates in alphabetical key order (ignoring case), which is the order they are saved in.
 class WCKVBase_Dict
 {
 public:
 
 	// Iteration helpers. Note that there is no GetCount() because you can't iterate
 	// these by incrementing a counter.
-	inline int GetFirst() const			{ return m_KeyValues.First(); }
+	inline int GetFirst() const			{ return m_KeyValues.Head(); }
 	inline int GetNext( int i ) const	{ return m_KeyValues.Next( i ); }
-	static inline int GetInvalidIndex()	{ return CUtlDict<MDkeyvalue,unsigned short>::InvalidIndex(); }
+	static inline int GetInvalidIndex()	{ return CUtlLinkedList<MDkeyvalue,unsigned short>::InvalidIndex(); }
 
 	int FindByKeyName( const char *pKeyName ) const; // Returns the same value as GetInvalidIndex if not found.
+	int FindByKeySymbol( CUtlSymbol LookupKey ) const; // Same, for a symbol from KeyValue_FindKeySymbol.
 	void RemoveKeyAt(int nIndex);
+	void GetMemoryStats( KeyValueMemoryStats_t &stats ) const;
 
 protected:
 	void InsertKeyValue( const MDkeyvalue &kv );
 
 protected:
-	CUtlDict<MDkeyvalue,unsigned short> m_KeyValues;
+	CUtlLinkedList<MDkeyvalue,unsigned short> m_KeyValues;
 };
 
 
@@ -178,7 +222,7 @@ typedef WCKeyValuesT<WCKVBase_Vector> WCKeyValuesVector;
 template<class Base>
 inline const char *WCKeyValuesT<Base>::GetKey(int nIndex) const
 {
-	return(this->m_KeyValues.Element(nIndex).szKey);
+	return(this->m_KeyValues.Element(nIndex).Key());
 }
 
 
@@ -213,7 +257,7 @@ inline const MDkeyvalue& WCKeyValuesT<Base>::GetKeyValue(int nIndex) const
 template<class Base>
 inline const char *WCKeyValuesT<Base>::GetValue(int nIndex) const
 {
-	return(this->m_KeyValues.Element(nIndex).szValue);
+	return(this->m_KeyValues.Element(nIndex).Value());
 }
 
 
@@ -41,6 +41,25 @@ public:
 
 };
 
+/// a bundle of up to RAYPACKET_MAX_GROUPS*4 rays traced together by TraceRayPacket. Each group has
+/// its own t extents. All of the groups should have the same direction signs (see FourRays::Check)
+/// for the packet to be traced as a unit.
+#define RAYPACKET_MAX_GROUPS 16
+
+class RayPacket
+{
+public:
+	FourRays m_Rays[RAYPACKET_MAX_GROUPS];
+	fltx4 m_TMin[RAYPACKET_MAX_GROUPS];
+	fltx4 m_TMax[RAYPACKET_MAX_GROUPS];
+	int m_nGroups;
+
+	RayPacket(void) : m_nGroups( 0 ) {}
+
+	// returns the direction sign mask shared by all of the groups, or -1 if they differ
+	int CalculateDirectionSignMask(void) const;
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -221,6 +240,43 @@ public:
 };
 
 
+/// summary of a built kd-tree. SetupAccelerationStructure fills in the timing/threading fields,
+/// CalculateKDTreeStats fills in the rest by walking the packed tree.
+struct KDTreeBuildStats_t
+{
+	float m_flBuildTime;									// seconds spent in the builder
+	int m_nThreads;											// threads used by the builder
+	int m_nSubtreeTasks;									// subtrees built as independent tasks
+
+	int m_nTriangles;
+	int m_nNodes;
+	int m_nLeaves;
+	int m_nEmptyLeaves;
+	int m_nTriangleReferences;								// sum of triangle counts in all leaves
+	int m_nMaxLeafTriangles;
+	int m_nMaxDepth;
+	float m_flSAHCost;										// expected cost of a ray, using the same
+															// traversal/intersection costs as the builder
+};
+
+/// work done by the counted trace routines (Trace4RaysCounted, TraceRayPacketCounted). Used by
+/// the ray tracing benchmarks to compare traversal strategies independently of timing noise.
+struct RayTraceCounters_t
+{
+	int64 m_nRays;
+	int64 m_nNodesVisited;									// inner nodes + leaves entered
+	int64 m_nTriangleTests;									// triangle tests against a group of 4 rays
+
+	RayTraceCounters_t( void ) : m_nRays( 0 ), m_nNodesVisited( 0 ), m_nTriangleTests( 0 ) {}
+
+	void operator+=( RayTraceCounters_t const &other )
+	{
+		m_nRays += other.m_nRays;
+		m_nNodesVisited += other.m_nNodesVisited;
+		m_nTriangleTests += other.m_nTriangleTests;
+	}
+};
+
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
@@ -310,6 +366,15 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure(void);
 
+	// parallel version of SetupAccelerationStructure. The upper levels of the tree are split
+	// using binned SAH, and the subtrees below them are built as independent tasks on nThreads
+	// threads. The resulting node and triangle index arrays have the same layout as the serial
+	// builder's, so all of the trace routines work unchanged.
+	void SetupAccelerationStructure( int nThreads, KDTreeBuildStats_t *pStatsOut = NULL );
+
+	// walk the kd-tree and fill in the tree quality part of stats
+	void CalculateKDTreeStats( KDTreeBuildStats_t &stats ) const;
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -324,6 +389,25 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL );
 
+	// trace a packet of 16-64 coherent rays (shadow rays towards the sun or sky, for instance).
+	// The kd-tree is walked once for the whole packet: nodes are first culled with interval
+	// arithmetic on the packet's bounds, and only if that's inconclusive are the groups looked
+	// at one by one. Groups whose rays have all missed the node or found their hit drop out of
+	// the traversal. Packets with mixed direction signs are traced a group at a time.
+	// pResults needs one entry per group, ppCallbacks (if not NULL) one callback per group.
+	void TraceRayPacket( const RayPacket &packet, RayTracingResult *pResults,
+						 int32 skip_id=-1, ITransparentTriangleCallback * const *ppCallbacks = NULL );
+
+	// same as Trace4Rays and TraceRayPacket, but add the work done to counters. These are
+	// separate instantiations of the same traversal code, so the versions above don't pay for
+	// the counting.
+	void Trace4RaysCounted( const FourRays &rays, fltx4 TMin, fltx4 TMax,
+							RayTracingResult *rslt_out, RayTraceCounters_t &counters,
+							int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL );
+	void TraceRayPacketCounted( const RayPacket &packet, RayTracingResult *pResults,
+								RayTraceCounters_t &counters,
+								int32 skip_id=-1, ITransparentTriangleCallback * const *ppCallbacks = NULL );
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -357,6 +441,18 @@ public:
 
 	int MakeLeafNode(int first_tri, int last_tri);
 
+	template< bool bCountWork >
+	void Trace4RaysInternal( const FourRays &rays, fltx4 TMin, fltx4 TMax,
+							 RayTracingResult *rslt_out, int32 skip_id,
+							 ITransparentTriangleCallback *pCallback, RayTraceCounters_t *pCounters );
+	template< bool bCountWork >
+	void Trace4RaysInternal( const FourRays &rays, fltx4 TMin, fltx4 TMax, int DirectionSignMask,
+							 RayTracingResult *rslt_out, int32 skip_id,
+							 ITransparentTriangleCallback *pCallback, RayTraceCounters_t *pCounters );
+	template< bool bCountWork >
+	void TraceRayPacketInternal( const RayPacket &packet, RayTracingResult *pResults, int32 skip_id,
+								 ITransparentTriangleCallback * const *ppCallbacks, RayTraceCounters_t *pCounters );
+
 
 	float CalculateCostsOfSplit(
 		int split_plane,int32 const *tri_list,int ntris,
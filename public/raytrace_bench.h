@@ -0,0 +1,62 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Ray tracing throughput benchmark, shared by vrad -benchtrace and rtbench.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef RAYTRACE_BENCH_H
+#define RAYTRACE_BENCH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "raytrace.h"
+
+
+/// settings for RunRayTraceBenchmark. The ray sets only depend on these and on the scene, so two
+/// runs with the same settings on the same scene trace exactly the same rays.
+struct RayTraceBenchmarkParams_t
+{
+	uint32 m_nSeed;
+	int m_nMaxThreads;										// timed at 1, 2, 4 ... m_nMaxThreads threads
+	int m_nRepeats;											// best of this many timed passes is reported
+
+	int m_nCameras;											// primary rays: m_nCameras images of
+	int m_nImageSize;										// m_nImageSize x m_nImageSize pixels
+	int m_nMaxSurfaceQuads;									// hit points used for the secondary rays
+
+	Vector m_vSunDirection;									// towards the sun
+	float m_flSunAngularExtent;
+	int m_nSunSamples;										// per hit point, up to RAYPACKET_MAX_GROUPS
+
+	int m_nAOSamples;										// per hit point, like CalculateAmbientOcclusion4
+	float m_flAORadius;
+
+	RayTraceBenchmarkParams_t( void )
+	{
+		m_nSeed = 0x5eed1234;
+		m_nMaxThreads = 1;
+		m_nRepeats = 3;
+		m_nCameras = 4;
+		m_nImageSize = 256;
+		m_nMaxSurfaceQuads = 8192;
+		m_vSunDirection.Init( 0.35f, 0.25f, 0.9f );
+		m_flSunAngularExtent = 0.02f;
+		m_nSunSamples = 16;
+		m_nAOSamples = 32;
+		m_flAORadius = 36.0f;
+	}
+};
+
+// Traces the primary, sun shadow and ambient occlusion ray sets through env (which must have
+// its acceleration structure set up) with Trace4Rays and TraceRayPacket, and prints Mrays/s per
+// thread count and nodes visited/triangles tested per ray.
+void RunRayTraceBenchmark( RayTracingEnvironment &env, RayTraceBenchmarkParams_t const &params );
+
+// Reads a scene written by vrad -dumptrace (WriteRTEnv) into env. Polygons with more than 3
+// verts are fanned. Doesn't set up the acceleration structure.
+bool LoadRayTraceEnvironmentDump( RayTracingEnvironment &env, char const *pFilename );
+
+
+#endif // RAYTRACE_BENCH_H
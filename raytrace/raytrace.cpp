@@ -3,6 +3,7 @@
 
 #include "raytrace.h"
 #include <filesystem_tools.h>
+#include <tier0/threadtools.h>
 
 static bool SameSign(float a, float b)
 {
@@ -273,13 +274,150 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+// test one triangle against 4 rays, updating the closest hits in rslt_out
+static FORCEINLINE void IntersectTriangleWithFourRays( TriIntersectData_t const *tri, int tnum, const FourRays &rays,
+													   RayTracingResult *rslt_out, ITransparentTriangleCallback *pCallback )
+{
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	DDotN = MaskedAssign( did_hit, DDotN, Four_Ones );
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	Trace4RaysInternal<false>( rays, TMin, TMax, rslt_out, skip_id, pCallback, NULL );
+}
+
+void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+									   int DirectionSignMask, RayTracingResult *rslt_out,
+									   int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	Trace4RaysInternal<false>( rays, TMin, TMax, DirectionSignMask, rslt_out, skip_id, pCallback, NULL );
+}
+
+void RayTracingEnvironment::TraceRayPacket( const RayPacket &packet, RayTracingResult *pResults,
+											int32 skip_id, ITransparentTriangleCallback * const *ppCallbacks )
+{
+	TraceRayPacketInternal<false>( packet, pResults, skip_id, ppCallbacks, NULL );
+}
+
+void RayTracingEnvironment::Trace4RaysCounted( const FourRays &rays, fltx4 TMin, fltx4 TMax,
+											   RayTracingResult *rslt_out, RayTraceCounters_t &counters,
+											   int32 skip_id, ITransparentTriangleCallback *pCallback )
+{
+	counters.m_nRays += 4;
+	Trace4RaysInternal<true>( rays, TMin, TMax, rslt_out, skip_id, pCallback, &counters );
+}
+
+void RayTracingEnvironment::TraceRayPacketCounted( const RayPacket &packet, RayTracingResult *pResults,
+												   RayTraceCounters_t &counters,
+												   int32 skip_id, ITransparentTriangleCallback * const *ppCallbacks )
+{
+	counters.m_nRays += 4 * packet.m_nGroups;
+	TraceRayPacketInternal<true>( packet, pResults, skip_id, ppCallbacks, &counters );
+}
+
+// The trace routines are templated on whether they count the work done, so that the normal
+// entry points pay nothing for the benchmark counters.
+template< bool bCountWork >
+void RayTracingEnvironment::Trace4RaysInternal( const FourRays &rays, fltx4 TMin, fltx4 TMax,
+												RayTracingResult *rslt_out, int32 skip_id,
+												ITransparentTriangleCallback *pCallback, RayTraceCounters_t *pCounters )
 {
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
-		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
+		Trace4RaysInternal<bCountWork>(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback, pCounters);
 	else
 	{
 		// sucky case - can't trace 4 rays at once. in the worst case, need to trace all 4
@@ -322,7 +460,7 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				RayTracingResult tmpresults;
 				msk=tmprays.CalculateDirectionSignMask();
 				Assert(msk!=-1);
-				Trace4Rays(tmprays,TMin,TMax,msk,&tmpresults,skip_id, pCallback);
+				Trace4RaysInternal<bCountWork>(tmprays,TMin,TMax,msk,&tmpresults,skip_id, pCallback, pCounters);
 				// now, move results to proper place
 				for(int i=0;i<4;i++)
 					if (need_trace[i]==2)
@@ -340,10 +478,11 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 	}
 }
 
-// wrapper for the low level trace4 rays routine
-void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
-									   int DirectionSignMask, RayTracingResult *rslt_out,
-									   int32 skip_id, ITransparentTriangleCallback *pCallback)
+// the low level trace4 rays routine
+template< bool bCountWork >
+void RayTracingEnvironment::Trace4RaysInternal( const FourRays &rays, fltx4 TMin, fltx4 TMax,
+												int DirectionSignMask, RayTracingResult *rslt_out, int32 skip_id,
+												ITransparentTriangleCallback *pCallback, RayTraceCounters_t *pCounters )
 {
 	rays.Check();
 
@@ -413,6 +552,8 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 	{
 		while (CurNode->NodeType() != KDNODE_STATE_LEAF)		// traverse until next leaf
 		{
+			if ( bCountWork )
+				pCounters->m_nNodesVisited++;
 			int split_plane_number=CurNode->NodeType();
 			CacheOptimizedKDNode const *FrontChild=&(OptimizedKDTree[CurNode->LeftChild()]);
 
@@ -460,6 +601,8 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 			}
 		}
 		// hit a leaf! must do intersection check
+		if ( bCountWork )
+			pCounters->m_nNodesVisited++;
 		int ntris=CurNode->NumberOfTrianglesInLeaf();
 		if (ntris)
 		{
@@ -474,120 +617,345 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
 				{
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
+					if ( bCountWork )
+						pCounters->m_nTriangleTests++;
+					IntersectTriangleWithFourRays( tri, tnum, rays, rslt_out, pCallback );
+				}
+			} while (--ntris);
+			// now, check if all rays have terminated
+			fltx4 raydone=CmpLeSIMD(TMax,rslt_out->HitDistance);
+			if (! IsAnyNegative(raydone))
+			{
+				return;
+			}
+		}
+
+ 		if (stack_ptr==&NodeQueue[MAX_NODE_STACK_LEN])
+		{
+			return;
+		}
+		// pop stack!
+		CurNode=stack_ptr->node;
+		TMin=stack_ptr->TMin;
+		TMax=stack_ptr->TMax;
+		stack_ptr++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Packet tracing
+//-----------------------------------------------------------------------------
+
+// one entry per tree level is enough, since the far child is only pushed from the current path
+#define MAX_PACKET_STACK_LEN (MAX_TREE_DEPTH+8)
+
+struct PacketNodeToVisit_t
+{
+	CacheOptimizedKDNode const *m_pNode;
+	uint32 m_nGroups;										// groups with rays in this node
+	float m_flTMin, m_flTMax;								// bounds on all of the intervals below
+	fltx4 m_TMin[RAYPACKET_MAX_GROUPS];
+	fltx4 m_TMax[RAYPACKET_MAX_GROUPS];
+};
+
+int RayPacket::CalculateDirectionSignMask(void) const
+{
+	Assert( m_nGroups > 0 );
+	int msk = m_Rays[0].CalculateDirectionSignMask();
+	for( int g = 1; ( msk != -1 ) && ( g < m_nGroups ); g++ )
+	{
+		if ( m_Rays[g].CalculateDirectionSignMask() != msk )
+			msk = -1;
+	}
+	return msk;
+}
+
+static FORCEINLINE int FirstBitSet( uint32 n )
+{
+	Assert( n );
+#ifdef _WIN32
+	unsigned long nBit;
+	_BitScanForward( &nBit, n );
+	return (int)nBit;
+#else
+	return __builtin_ctz( n );
+#endif
+}
+
+static FORCEINLINE float MinOfLanes( fltx4 const &v )
+{
+	return min( min( SubFloat( v, 0 ), SubFloat( v, 1 ) ), min( SubFloat( v, 2 ), SubFloat( v, 3 ) ) );
+}
+
+static FORCEINLINE float MaxOfLanes( fltx4 const &v )
+{
+	return max( max( SubFloat( v, 0 ), SubFloat( v, 1 ) ), max( SubFloat( v, 2 ), SubFloat( v, 3 ) ) );
+}
 
+template< bool bCountWork >
+void RayTracingEnvironment::TraceRayPacketInternal( const RayPacket &packet, RayTracingResult *pResults, int32 skip_id,
+													ITransparentTriangleCallback * const *ppCallbacks,
+													RayTraceCounters_t *pCounters )
+{
+	int nGroups = packet.m_nGroups;
+	Assert( ( nGroups > 0 ) && ( nGroups <= RAYPACKET_MAX_GROUPS ) );
 
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
+	int DirectionSignMask = packet.CalculateDirectionSignMask();
+	if ( ( DirectionSignMask == -1 ) || ( nGroups == 1 ) )
+	{
+		// the groups don't agree on a traversal order, or there's nothing to share
+		for( int g = 0; g < nGroups; g++ )
+		{
+			Trace4RaysInternal<bCountWork>( packet.m_Rays[g], packet.m_TMin[g], packet.m_TMax[g], &pResults[g],
+											skip_id, ppCallbacks ? ppCallbacks[g] : NULL, pCounters );
+		}
+		return;
+	}
 
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+	FourVectors OneOverRayDir[RAYPACKET_MAX_GROUPS];
+	fltx4 TMin[RAYPACKET_MAX_GROUPS];
+	fltx4 TMax[RAYPACKET_MAX_GROUPS];
+	fltx4 Done[RAYPACKET_MAX_GROUPS];						// rays which found their closest hit
+	fltx4 DistToSepPlane[RAYPACKET_MAX_GROUPS];
+
+	// bounds of the whole packet, for deciding which way to go at a node without looking at
+	// the individual groups
+	Vector OriginMin( 1.0e23, 1.0e23, 1.0e23 ), OriginMax( -1.0e23, -1.0e23, -1.0e23 );
+	Vector RcpDirMin( 1.0e23, 1.0e23, 1.0e23 ), RcpDirMax( -1.0e23, -1.0e23, -1.0e23 );
+	float flTMin = 1.0e23;
+	float flTMax = -1.0e23;
+
+	uint32 nActiveGroups = 0;
+	for( int g = 0; g < nGroups; g++ )
+	{
+		FourRays const &rays = packet.m_Rays[g];
+		rays.Check();
 
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+		RayTracingResult *rslt_out = &pResults[g];
+		memset( rslt_out->HitIds, 0xff, sizeof( rslt_out->HitIds ) );
+		rslt_out->HitDistance = ReplicateX4( 1.0e23 );
+		rslt_out->surface_normal.DuplicateVector( Vector( 0., 0., 0. ) );
 
-					DDotN = MaskedAssign( did_hit, DDotN, Four_Ones );
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+		OneOverRayDir[g] = rays.direction;
+		OneOverRayDir[g].MakeReciprocalSaturate();
 
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
+		// clip rays against bounding box
+		TMin[g] = packet.m_TMin[g];
+		TMax[g] = packet.m_TMax[g];
+		for( int c = 0; c < 3; c++ )
+		{
+			fltx4 isect_min_t =
+				MulSIMD( SubSIMD( ReplicateX4( m_MinBound[c] ), rays.origin[c] ), OneOverRayDir[g][c] );
+			fltx4 isect_max_t =
+				MulSIMD( SubSIMD( ReplicateX4( m_MaxBound[c] ), rays.origin[c] ), OneOverRayDir[g][c] );
+			TMin[g] = MaxSIMD( TMin[g], MinSIMD( isect_min_t, isect_max_t ) );
+			TMax[g] = MinSIMD( TMax[g], MaxSIMD( isect_min_t, isect_max_t ) );
+		}
+		Done[g] = Four_Zeros;
 
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+		fltx4 active = CmpLeSIMD( TMin[g], TMax[g] );
+		if ( ! IsAnyNegative( active ) )
+			continue;											// missed bounding box
+		nActiveGroups |= 1 << g;
 
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+		for( int c = 0; c < 3; c++ )
+		{
+			OriginMin[c] = min( OriginMin[c], MinOfLanes( rays.origin[c] ) );
+			OriginMax[c] = max( OriginMax[c], MaxOfLanes( rays.origin[c] ) );
+			RcpDirMin[c] = min( RcpDirMin[c], MinOfLanes( OneOverRayDir[g][c] ) );
+			RcpDirMax[c] = max( RcpDirMax[c], MaxOfLanes( OneOverRayDir[g][c] ) );
+		}
+		flTMin = min( flTMin, MinOfLanes( MaskedAssign( active, TMin[g], ReplicateX4( 1.0e23 ) ) ) );
+		flTMax = max( flTMax, MaxOfLanes( MaskedAssign( active, TMax[g], ReplicateX4( -1.0e23 ) ) ) );
+	}
+	if ( !nActiveGroups )
+		return;
+	uint32 nLiveGroups = nActiveGroups;						// groups with rays still looking for a hit
 
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+	// used to avoid redundant triangle tests. groups can reach a triangle at different leaves,
+	// so the mailbox also remembers which groups have been tested against it
+	int32 mailboxids[MAILBOX_HASH_SIZE];
+	uint32 mailboxgroups[MAILBOX_HASH_SIZE];
+	memset( mailboxids, 0xff, sizeof( mailboxids ) );
 
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+	int front_idx[3], back_idx[3];							// based on ray direction, whether to
+															// visit left or right node first
+	for( int c = 0; c < 3; c++ )
+	{
+		back_idx[c] = ( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+		front_idx[c] = 1 - back_idx[c];
+	}
 
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+	PacketNodeToVisit_t NodeStack[MAX_PACKET_STACK_LEN];
+	PacketNodeToVisit_t *stack_ptr = &NodeStack[MAX_PACKET_STACK_LEN];
+	CacheOptimizedKDNode const *CurNode = &( OptimizedKDTree[0] );
+	while( true )
+	{
+		while ( CurNode->NodeType() != KDNODE_STATE_LEAF )		// traverse until next leaf
+		{
+			if ( bCountWork )
+				pCounters->m_nNodesVisited++;
+			int split_plane_number = CurNode->NodeType();
+			CacheOptimizedKDNode const *FrontChild = &( OptimizedKDTree[CurNode->LeftChild()] );
+			float flSplit = CurNode->SplittingPlaneValue;
+
+			// interval test: the distance to the plane of every ray in the packet lies within
+			// (split-origin)*(1/dir) over the packet's origin and direction bounds
+			float a0 = flSplit - OriginMax[split_plane_number];
+			float a1 = flSplit - OriginMin[split_plane_number];
+			float r0 = RcpDirMin[split_plane_number];
+			float r1 = RcpDirMax[split_plane_number];
+			float flDistMin = min( min( a0 * r0, a0 * r1 ), min( a1 * r0, a1 * r1 ) );
+			float flDistMax = max( max( a0 * r0, a0 * r1 ), max( a1 * r0, a1 * r1 ) );
+			if ( flDistMax < flTMin )
+			{
+				// every ray crosses the plane before entering the node. only visit back, and none
+				// of the intervals change
+				CurNode = FrontChild + back_idx[split_plane_number];
+				continue;
+			}
+			if ( flDistMin > flTMax )
+			{
+				// every ray leaves the node before reaching the plane
+				CurNode = FrontChild + front_idx[split_plane_number];
+				continue;
+			}
 
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+			// the packet straddles the plane. classify the groups one at a time
+			uint32 nFrontGroups = 0;
+			uint32 nBackGroups = 0;
+			for( uint32 nGroupBits = nActiveGroups & nLiveGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
+			{
+				int g = FirstBitSet( nGroupBits );
+				DistToSepPlane[g] =						// dist=(split-org)/dir
+					MulSIMD( SubSIMD( ReplicateX4( flSplit ), packet.m_Rays[g].origin[split_plane_number] ),
+							 OneOverRayDir[g][split_plane_number] );
+				fltx4 active = AndNotSIMD( Done[g], CmpLeSIMD( TMin[g], TMax[g] ) );
+				if ( IsAnyNegative( AndSIMD( active, CmpGeSIMD( DistToSepPlane[g], TMin[g] ) ) ) )
+					nFrontGroups |= 1 << g;
+				if ( IsAnyNegative( AndSIMD( active, CmpLeSIMD( DistToSepPlane[g], TMax[g] ) ) ) )
+					nBackGroups |= 1 << g;
+			}
 
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+			if ( !nFrontGroups && !nBackGroups )
+			{
+				nActiveGroups = 0;								// nothing left in this subtree
+				break;
+			}
 
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+			if ( !nFrontGroups )
+			{
+				// missed the front. only traverse back
+				for( uint32 nGroupBits = nBackGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
+				{
+					int g = FirstBitSet( nGroupBits );
+					TMin[g] = MaxSIMD( TMin[g], DistToSepPlane[g] );
+				}
+				nActiveGroups = nBackGroups;
+				flTMin = max( flTMin, flDistMin );
+				CurNode = FrontChild + back_idx[split_plane_number];
+			}
+			else if ( !nBackGroups )
+			{
+				// missed the back - only need to traverse front node
+				for( uint32 nGroupBits = nFrontGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
+				{
+					int g = FirstBitSet( nGroupBits );
+					TMax[g] = MinSIMD( TMax[g], DistToSepPlane[g] );
+				}
+				nActiveGroups = nFrontGroups;
+				flTMax = min( flTMax, flDistMax );
+				CurNode = FrontChild + front_idx[split_plane_number];
+			}
+			else
+			{
+				// must push far, traverse near
+				Assert( stack_ptr > NodeStack );
+				--stack_ptr;
+				stack_ptr->m_pNode = FrontChild + back_idx[split_plane_number];
+				stack_ptr->m_nGroups = nBackGroups;
+				stack_ptr->m_flTMin = max( flTMin, flDistMin );
+				stack_ptr->m_flTMax = flTMax;
+				for( uint32 nGroupBits = nBackGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
+				{
+					int g = FirstBitSet( nGroupBits );
+					stack_ptr->m_TMin[g] = MaxSIMD( TMin[g], DistToSepPlane[g] );
+					stack_ptr->m_TMax[g] = TMax[g];
+				}
 
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
+				for( uint32 nGroupBits = nFrontGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
+				{
+					int g = FirstBitSet( nGroupBits );
+					TMax[g] = MinSIMD( TMax[g], DistToSepPlane[g] );
+				}
+				nActiveGroups = nFrontGroups;
+				flTMax = min( flTMax, flDistMax );
+				CurNode = FrontChild + front_idx[split_plane_number];
+			}
+		}
 
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+		// hit a leaf! must do intersection check
+		if ( bCountWork )
+			pCounters->m_nNodesVisited++;
+		int ntris = ( nActiveGroups & nLiveGroups ) ? CurNode->NumberOfTrianglesInLeaf() : 0;
+		if ( ntris )
+		{
+			uint32 nLeafGroups = nActiveGroups & nLiveGroups;
+			int32 const *tlist = &( TriangleIndexList[CurNode->TriangleIndexStart()] );
+			do
+			{
+				int tnum = *( tlist++ );
+				// check mailbox
+				int mbox_slot = tnum & ( MAILBOX_HASH_SIZE - 1 );
+				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				uint32 nTestedGroups = ( mailboxids[mbox_slot] == tnum ) ? mailboxgroups[mbox_slot] : 0;
+				uint32 nTestGroups = nLeafGroups & ~nTestedGroups;
+				if ( nTestGroups && ( tri->m_nTriangleID != skip_id ) )
+				{
+					mailboxids[mbox_slot] = tnum;
+					mailboxgroups[mbox_slot] = nTestedGroups | nTestGroups;
+					for( uint32 nGroupBits = nTestGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
 					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
+						int g = FirstBitSet( nGroupBits );
+						if ( bCountWork )
+							pCounters->m_nTriangleTests++;
+						IntersectTriangleWithFourRays( tri, tnum, packet.m_Rays[g], &pResults[g],
+													   ppCallbacks ? ppCallbacks[g] : NULL );
 					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-
 				}
-			} while (--ntris);
-			// now, check if all rays have terminated
-			fltx4 raydone=CmpLeSIMD(TMax,rslt_out->HitDistance);
-			if (! IsAnyNegative(raydone))
+			} while ( --ntris );
+
+			// rays with a hit inside this node are finished, everything after is farther away
+			for( uint32 nGroupBits = nLeafGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
 			{
-				return;
+				int g = FirstBitSet( nGroupBits );
+				fltx4 active = CmpLeSIMD( TMin[g], TMax[g] );
+				Done[g] = OrSIMD( Done[g], AndSIMD( active, CmpLtSIMD( pResults[g].HitDistance, TMax[g] ) ) );
+				if ( TestSignSIMD( Done[g] ) == 0xf )
+					nLiveGroups &= ~( 1 << g );
 			}
+			if ( !nLiveGroups )
+				return;
 		}
 
- 		if (stack_ptr==&NodeQueue[MAX_NODE_STACK_LEN])
+		// pop the next node that still has live rays
+		do
 		{
-			return;
-		}
-		// pop stack!
-		CurNode=stack_ptr->node;
-		TMin=stack_ptr->TMin;
-		TMax=stack_ptr->TMax;
-		stack_ptr++;
+			if ( stack_ptr == &NodeStack[MAX_PACKET_STACK_LEN] )
+				return;
+			CurNode = stack_ptr->m_pNode;
+			nActiveGroups = stack_ptr->m_nGroups & nLiveGroups;
+			flTMin = stack_ptr->m_flTMin;
+			flTMax = stack_ptr->m_flTMax;
+			for( uint32 nGroupBits = nActiveGroups; nGroupBits; nGroupBits &= nGroupBits - 1 )
+			{
+				int g = FirstBitSet( nGroupBits );
+				TMin[g] = stack_ptr->m_TMin[g];
+				TMax[g] = stack_ptr->m_TMax[g];
+			}
+			stack_ptr++;
+		} while ( !nActiveGroups );
 	}
 }
 
@@ -888,4 +1256,546 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 void RayTracingEnvironment::AddInfinitePointLight( Vector position, Vector intensity)
 {
 	LightList.AddToTail( LightDesc_t( position, intensity ) );
-}
\ No newline at end of file
+}
+
+//-----------------------------------------------------------------------------
+// Parallel kd-tree builder.
+//
+// The serial builder above evaluates a sample of the triangle vertices on all three axes for
+// every node, re-classifying the whole triangle list for each candidate, and stores its
+// classification in the triangles themselves, which makes it impossible to run on more than one
+// thread. This builder works from a precomputed table of triangle bounds instead:
+//
+// - nodes with more than KDBUILD_EXACT_SAH_MAX_TRIS triangles are split by binned SAH: the
+//   triangle bounds are histogrammed into KDBUILD_NUM_BINS bins per axis and only the bin
+//   boundaries are considered as split planes.
+// - smaller nodes sort the triangle bounds once per axis and evaluate every triangle min/max as
+//   a candidate with binary searches.
+// - once the top levels have produced nodes with fewer than m_nTaskTris triangles, those
+//   subtrees are handed out as tasks to the worker threads. each task builds into its own node
+//   and triangle index lists, using a per-thread scratch list, and the results are spliced into
+//   OptimizedKDTree/TriangleIndexList serially at the end.
+//
+// Both builders use the same cost function and termination rules, so the trees are of
+// comparable quality.
+//-----------------------------------------------------------------------------
+
+#define KDBUILD_NUM_BINS 32
+#define KDBUILD_EXACT_SAH_MAX_TRIS 1024
+#define KDBUILD_MIN_TASK_TRIS 2048							// don't make tasks out of tiny subtrees
+#define KDBUILD_TASKS_PER_THREAD 8
+
+struct KDTriBounds_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+};
+
+struct KDSplit_t
+{
+	int m_nAxis;
+	float m_flValue;
+	float m_flCost;
+};
+
+struct KDBuildTask_t
+{
+	int m_nDestNode;										// slot in OptimizedKDTree for the root
+	int m_nDepth;
+	Vector m_Mins;
+	Vector m_Maxs;
+	CUtlVector<int32> m_Tris;
+
+	// output. Indices are local to the task until merged.
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriIndices;
+};
+
+static int __cdecl CompareBuildTasks( KDBuildTask_t * const *pA, KDBuildTask_t * const *pB )
+{
+	// largest subtrees first so that the tail of the build is made up of small tasks
+	return (*pB)->m_Tris.Count() - (*pA)->m_Tris.Count();
+}
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( RayTracingEnvironment *pEnv, int nThreads );
+	~CKDTreeBuilder();
+
+	void Build( KDTreeBuildStats_t *pStatsOut );
+
+private:
+	int Classify( int32 tri, int axis, float value ) const;
+	float CostOfSplit( int axis, float value, Vector const &mins, Vector const &maxs,
+					   int nleft, int nright, int nboth ) const;
+	bool FindSplitBinned( int32 const *tris, int ntris, Vector const &mins, Vector const &maxs,
+						  KDSplit_t &split ) const;
+	bool FindSplitExact( int32 const *tris, int ntris, Vector const &mins, Vector const &maxs,
+						 KDSplit_t &split ) const;
+
+	void MakeLeaf( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &triIndices,
+				   int node, int32 const *tris, int ntris, Vector const &mins, Vector const &maxs );
+	void RefineNode( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &triIndices,
+					 CUtlVector<int32> &scratch, int node, int nListStart, int ntris,
+					 Vector const &mins, Vector const &maxs, int depth, bool bMakeTasks );
+
+	void RunTasks();
+	static unsigned WorkerThreadFn( void *pParam );
+	void MergeTask( KDBuildTask_t const *pTask );
+
+	RayTracingEnvironment *m_pEnv;
+	int m_nThreads;
+	int m_nTaskTris;
+	CUtlVector<KDTriBounds_t> m_TriBounds;
+	CUtlVector<KDBuildTask_t *> m_Tasks;
+	CInterlockedInt m_nNextTask;
+};
+
+CKDTreeBuilder::CKDTreeBuilder( RayTracingEnvironment *pEnv, int nThreads )
+{
+	m_pEnv = pEnv;
+	m_nThreads = max( nThreads, 1 );
+	int ntris = pEnv->OptimizedTriangleList.Count();
+	m_nTaskTris = max( KDBUILD_MIN_TASK_TRIS, ntris / ( m_nThreads * KDBUILD_TASKS_PER_THREAD ) );
+	m_nNextTask = 0;
+
+	m_TriBounds.SetCount( ntris );
+	for( int t = 0; t < ntris; t++ )
+	{
+		CacheOptimizedTriangle const &tri = pEnv->OptimizedTriangleList[t];
+		KDTriBounds_t &b = m_TriBounds[t];
+		b.m_Mins = tri.Vertex( 0 );
+		b.m_Maxs = tri.Vertex( 0 );
+		for( int v = 1; v < 3; v++ )
+		{
+			VectorMin( b.m_Mins, tri.Vertex( v ), b.m_Mins );
+			VectorMax( b.m_Maxs, tri.Vertex( v ), b.m_Maxs );
+		}
+	}
+}
+
+CKDTreeBuilder::~CKDTreeBuilder()
+{
+	m_Tasks.PurgeAndDeleteElements();
+}
+
+// same results as CacheOptimizedTriangle::ClassifyAgainstAxisSplit, but from the bounds table
+inline int CKDTreeBuilder::Classify( int32 tri, int axis, float value ) const
+{
+	KDTriBounds_t const &b = m_TriBounds[tri];
+	float minc = b.m_Mins[axis];
+	float maxc = b.m_Maxs[axis];
+	if ( minc >= value )
+		return PLANECHECK_POSITIVE;
+	if ( maxc <= value )
+		return PLANECHECK_NEGATIVE;
+	if ( minc == maxc )
+		return PLANECHECK_POSITIVE;
+	return PLANECHECK_STRADDLING;
+}
+
+inline float CKDTreeBuilder::CostOfSplit( int axis, float value, Vector const &mins, Vector const &maxs,
+										  int nleft, int nright, int nboth ) const
+{
+	Vector LeftMaxes = maxs;
+	Vector RightMins = mins;
+	LeftMaxes[axis] = value;
+	RightMins[axis] = value;
+	float ISA = 1.0 / BoxSurfaceArea( mins, maxs );
+	return COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ( nboth +
+		( BoxSurfaceArea( mins, LeftMaxes ) * ISA * nleft ) +
+		( BoxSurfaceArea( RightMins, maxs ) * ISA * nright ) );
+}
+
+bool CKDTreeBuilder::FindSplitBinned( int32 const *tris, int ntris, Vector const &mins, Vector const &maxs,
+									  KDSplit_t &split ) const
+{
+	split.m_flCost = 1.0e23;
+	for( int axis = 0; axis < 3; axis++ )
+	{
+		float flExtent = maxs[axis] - mins[axis];
+		if ( flExtent <= 0 )
+			continue;
+		float flBinScale = KDBUILD_NUM_BINS / flExtent;
+
+		// nMinBins[b] = # of tris whose min falls in bin b, nMaxBins the same for max
+		int nMinBins[KDBUILD_NUM_BINS];
+		int nMaxBins[KDBUILD_NUM_BINS];
+		memset( nMinBins, 0, sizeof( nMinBins ) );
+		memset( nMaxBins, 0, sizeof( nMaxBins ) );
+		for( int t = 0; t < ntris; t++ )
+		{
+			KDTriBounds_t const &b = m_TriBounds[tris[t]];
+			int nMinBin = (int) ( ( b.m_Mins[axis] - mins[axis] ) * flBinScale );
+			int nMaxBin = (int) ( ( b.m_Maxs[axis] - mins[axis] ) * flBinScale );
+			nMinBins[clamp( nMinBin, 0, KDBUILD_NUM_BINS - 1 )]++;
+			nMaxBins[clamp( nMaxBin, 0, KDBUILD_NUM_BINS - 1 )]++;
+		}
+
+		// sweep the bin boundaries. tris whose max is in a bin below the boundary are on the left,
+		// tris whose min is in a bin at or above it are on the right, the rest straddle.
+		int nleft = 0;
+		int nright = ntris;
+		for( int b = 1; b < KDBUILD_NUM_BINS; b++ )
+		{
+			nleft += nMaxBins[b - 1];
+			nright -= nMinBins[b - 1];
+			int nboth = ntris - nleft - nright;
+			float flValue = mins[axis] + b * ( flExtent / KDBUILD_NUM_BINS );
+			float flCost = CostOfSplit( axis, flValue, mins, maxs, nleft, nright, nboth );
+			if ( flCost < split.m_flCost )
+			{
+				split.m_nAxis = axis;
+				split.m_flValue = flValue;
+				split.m_flCost = flCost;
+			}
+		}
+	}
+	return split.m_flCost < 1.0e23;
+}
+
+bool CKDTreeBuilder::FindSplitExact( int32 const *tris, int ntris, Vector const &mins, Vector const &maxs,
+									 KDSplit_t &split ) const
+{
+	split.m_flCost = 1.0e23;
+
+	CUtlVector<float> sortedMins, sortedMaxs, sortedPlanar;
+	sortedMins.SetCount( ntris );
+	sortedMaxs.SetCount( ntris );
+	sortedPlanar.EnsureCapacity( ntris );
+	for( int axis = 0; axis < 3; axis++ )
+	{
+		sortedPlanar.RemoveAll();
+		for( int t = 0; t < ntris; t++ )
+		{
+			KDTriBounds_t const &b = m_TriBounds[tris[t]];
+			sortedMins[t] = b.m_Mins[axis];
+			sortedMaxs[t] = b.m_Maxs[axis];
+			if ( b.m_Mins[axis] == b.m_Maxs[axis] )
+				sortedPlanar.AddToTail( b.m_Mins[axis] );
+		}
+		std::sort( sortedMins.begin(), sortedMins.end() );
+		std::sort( sortedMaxs.begin(), sortedMaxs.end() );
+		std::sort( sortedPlanar.begin(), sortedPlanar.end() );
+
+		// candidates are the middle of the node plus every triangle extent inside of it
+		for( int c = -1; c < 2 * ntris; c++ )
+		{
+			float flValue;
+			if ( c == -1 )
+				flValue = 0.5 * ( mins[axis] + maxs[axis] );
+			else
+			{
+				flValue = ( c & 1 ) ? sortedMaxs[c >> 1] : sortedMins[c >> 1];
+				if ( ( flValue > maxs[axis] ) || ( flValue < mins[axis] ) )
+					continue;
+			}
+
+			// right = min >= value, left = max <= value, except for tris lying in the plane,
+			// which Classify() puts on the right
+			int nright = sortedMins.end() - std::lower_bound( sortedMins.begin(), sortedMins.end(), flValue );
+			int nleft = std::upper_bound( sortedMaxs.begin(), sortedMaxs.end(), flValue ) - sortedMaxs.begin();
+			if ( sortedPlanar.Count() )
+			{
+				nleft -= std::upper_bound( sortedPlanar.begin(), sortedPlanar.end(), flValue ) -
+					std::lower_bound( sortedPlanar.begin(), sortedPlanar.end(), flValue );
+			}
+			int nboth = ntris - nleft - nright;
+
+			// if the split resulted in one half being empty, "grow" the empty half
+			if ( nleft && ( nboth == 0 ) && ( nright == 0 ) )
+				flValue = sortedMaxs.Tail();
+			if ( nright && ( nboth == 0 ) && ( nleft == 0 ) )
+				flValue = sortedMins.Head();
+
+			float flCost = CostOfSplit( axis, flValue, mins, maxs, nleft, nright, nboth );
+			if ( flCost < split.m_flCost )
+			{
+				split.m_nAxis = axis;
+				split.m_flValue = flValue;
+				split.m_flCost = flCost;
+			}
+		}
+	}
+	return split.m_flCost < 1.0e23;
+}
+
+void CKDTreeBuilder::MakeLeaf( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &triIndices,
+							   int node, int32 const *tris, int ntris, Vector const &mins, Vector const &maxs )
+{
+	nodes[node].Children = KDNODE_STATE_LEAF + ( triIndices.Count() << 2 );
+	nodes[node].SetNumberOfTrianglesInLeafNode( ntris );
+#ifdef DEBUG_RAYTRACE
+	nodes[node].vecMins = mins;
+	nodes[node].vecMaxs = maxs;
+#endif
+	triIndices.AddMultipleToTail( ntris, tris );
+}
+
+// the triangle list for the node lives in scratch[nListStart..nListStart+ntris). Child lists are
+// appended to scratch and popped off again when the children are done, so the scratch list acts
+// as a per-thread stack and nothing is allocated once it has grown to its working size.
+void CKDTreeBuilder::RefineNode( CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &triIndices,
+								 CUtlVector<int32> &scratch, int node, int nListStart, int ntris,
+								 Vector const &mins, Vector const &maxs, int depth, bool bMakeTasks )
+{
+	if ( ntris < 3 )
+	{
+		MakeLeaf( nodes, triIndices, node, scratch.Base() + nListStart, ntris, mins, maxs );
+		return;
+	}
+
+	if ( bMakeTasks && ( ntris <= m_nTaskTris ) )
+	{
+		// defer this subtree to the worker threads
+		KDBuildTask_t *pTask = new KDBuildTask_t;
+		pTask->m_nDestNode = node;
+		pTask->m_nDepth = depth;
+		pTask->m_Mins = mins;
+		pTask->m_Maxs = maxs;
+		pTask->m_Tris.CopyArray( scratch.Base() + nListStart, ntris );
+		m_Tasks.AddToTail( pTask );
+		return;
+	}
+
+	KDSplit_t split;
+	bool bFound;
+	if ( ntris > KDBUILD_EXACT_SAH_MAX_TRIS )
+		bFound = FindSplitBinned( scratch.Base() + nListStart, ntris, mins, maxs, split );
+	else
+		bFound = FindSplitExact( scratch.Base() + nListStart, ntris, mins, maxs, split );
+
+	// count the real classification for the chosen plane. the binned counts are conservative
+	// estimates.
+	int nleft = 0, nright = 0, nboth = 0;
+	if ( bFound )
+	{
+		int32 const *pTris = scratch.Base() + nListStart;
+		for( int t = 0; t < ntris; t++ )
+		{
+			switch( Classify( pTris[t], split.m_nAxis, split.m_flValue ) )
+			{
+				case PLANECHECK_NEGATIVE:
+					nleft++;
+					break;
+				case PLANECHECK_POSITIVE:
+					nright++;
+					break;
+				case PLANECHECK_STRADDLING:
+					nboth++;
+					break;
+			}
+		}
+		split.m_flCost = CostOfSplit( split.m_nAxis, split.m_flValue, mins, maxs, nleft, nright, nboth );
+	}
+
+	float cost_of_no_split = COST_OF_INTERSECTION * ntris;
+	if ( !bFound || ( cost_of_no_split <= split.m_flCost ) || NEVER_SPLIT || ( depth > MAX_TREE_DEPTH ) )
+	{
+		MakeLeaf( nodes, triIndices, node, scratch.Base() + nListStart, ntris, mins, maxs );
+		return;
+	}
+
+	// partition into left, both, right order, same as RefineNode
+	int nChildListStart = scratch.Count();
+	scratch.AddMultipleToTail( ntris );
+	int32 const *pSrc = scratch.Base() + nListStart;
+	int32 *pDest = scratch.Base() + nChildListStart;
+	int n_left_output = 0;
+	int n_both_output = 0;
+	int n_right_output = 0;
+	for( int t = 0; t < ntris; t++ )
+	{
+		switch( Classify( pSrc[t], split.m_nAxis, split.m_flValue ) )
+		{
+			case PLANECHECK_NEGATIVE:
+				pDest[n_left_output++] = pSrc[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				pDest[ntris - n_right_output] = pSrc[t];
+				break;
+			case PLANECHECK_STRADDLING:
+				pDest[nleft + n_both_output] = pSrc[t];
+				n_both_output++;
+				break;
+		}
+	}
+
+	Vector LeftMaxes = maxs;
+	Vector RightMins = mins;
+	LeftMaxes[split.m_nAxis] = split.m_flValue;
+	RightMins[split.m_nAxis] = split.m_flValue;
+
+	int left_child = nodes.Count();
+	nodes[node].Children = split.m_nAxis + ( left_child << 2 );
+	nodes[node].SplittingPlaneValue = split.m_flValue;
+#ifdef DEBUG_RAYTRACE
+	nodes[node].vecMins = mins;
+	nodes[node].vecMaxs = maxs;
+#endif
+	CacheOptimizedKDNode newnode{};
+	nodes.AddToTail( newnode );
+	nodes.AddToTail( newnode );
+
+	if ( ( ntris < 20 ) && ( ( nleft == 0 ) || ( nright == 0 ) ) )
+		depth += 100;
+	RefineNode( nodes, triIndices, scratch, left_child, nChildListStart, nleft + nboth,
+				mins, LeftMaxes, depth + 1, bMakeTasks );
+	RefineNode( nodes, triIndices, scratch, left_child + 1, nChildListStart + nleft, nright + nboth,
+				RightMins, maxs, depth + 1, bMakeTasks );
+	scratch.SetCountNonDestructively( nChildListStart );
+}
+
+void CKDTreeBuilder::RunTasks()
+{
+	CUtlVector<int32> scratch;
+	for(;;)
+	{
+		int nTask = ( ++m_nNextTask ) - 1;
+		if ( nTask >= m_Tasks.Count() )
+			break;
+		KDBuildTask_t *pTask = m_Tasks[nTask];
+		CacheOptimizedKDNode root{};
+		pTask->m_Nodes.AddToTail( root );
+		scratch.CopyArray( pTask->m_Tris.Base(), pTask->m_Tris.Count() );
+		RefineNode( pTask->m_Nodes, pTask->m_TriIndices, scratch, 0, 0, pTask->m_Tris.Count(),
+					pTask->m_Mins, pTask->m_Maxs, pTask->m_nDepth, false );
+		pTask->m_Tris.Purge();
+	}
+}
+
+unsigned CKDTreeBuilder::WorkerThreadFn( void *pParam )
+{
+	reinterpret_cast<CKDTreeBuilder *>( pParam )->RunTasks();
+	return 0;
+}
+
+// splice a finished subtree into the environment. The subtree root goes into the slot reserved
+// for it, the remaining nodes are appended, and all child/triangle indices are relocated.
+void CKDTreeBuilder::MergeTask( KDBuildTask_t const *pTask )
+{
+	int nNodeBase = m_pEnv->OptimizedKDTree.Count() - 1;	// local node 1 goes at Count()
+	int nTriBase = m_pEnv->TriangleIndexList.Count();
+	m_pEnv->TriangleIndexList.AddMultipleToTail( pTask->m_TriIndices.Count(), pTask->m_TriIndices.Base() );
+	m_pEnv->OptimizedKDTree.EnsureCapacity( nNodeBase + pTask->m_Nodes.Count() );
+	for( int i = 0; i < pTask->m_Nodes.Count(); i++ )
+	{
+		CacheOptimizedKDNode node = pTask->m_Nodes[i];
+		if ( node.NodeType() == KDNODE_STATE_LEAF )
+			node.Children = KDNODE_STATE_LEAF + ( ( node.TriangleIndexStart() + nTriBase ) << 2 );
+		else
+			node.Children = node.NodeType() + ( ( node.LeftChild() + nNodeBase ) << 2 );
+		if ( i == 0 )
+			m_pEnv->OptimizedKDTree[pTask->m_nDestNode] = node;
+		else
+			m_pEnv->OptimizedKDTree.AddToTail( node );
+	}
+}
+
+void CKDTreeBuilder::Build( KDTreeBuildStats_t *pStatsOut )
+{
+	float flStartTime = Plat_FloatTime();
+	int ntris = m_TriBounds.Count();
+
+	m_pEnv->m_MinBound = Vector( 1.0e23, 1.0e23, 1.0e23 );
+	m_pEnv->m_MaxBound = Vector( -1.0e23, -1.0e23, -1.0e23 );
+	for( int t = 0; t < ntris; t++ )
+	{
+		VectorMin( m_pEnv->m_MinBound, m_TriBounds[t].m_Mins, m_pEnv->m_MinBound );
+		VectorMax( m_pEnv->m_MaxBound, m_TriBounds[t].m_Maxs, m_pEnv->m_MaxBound );
+	}
+
+	// top levels, on this thread
+	CUtlVector<int32> scratch;
+	scratch.SetCount( ntris );
+	for( int t = 0; t < ntris; t++ )
+		scratch[t] = t;
+	CacheOptimizedKDNode root{};
+	m_pEnv->OptimizedKDTree.AddToTail( root );
+	RefineNode( m_pEnv->OptimizedKDTree, m_pEnv->TriangleIndexList, scratch, 0, 0, ntris,
+				m_pEnv->m_MinBound, m_pEnv->m_MaxBound, 0, m_nThreads > 1 );
+	scratch.Purge();
+
+	// subtrees, on all threads
+	if ( m_Tasks.Count() )
+	{
+		// merge in creation order afterwards so that the output doesn't depend on scheduling
+		CUtlVector<KDBuildTask_t *> mergeOrder;
+		mergeOrder.CopyArray( m_Tasks.Base(), m_Tasks.Count() );
+		m_Tasks.Sort( CompareBuildTasks );
+
+		CUtlVector<ThreadHandle_t> threads;
+		int nWorkers = min( m_nThreads, m_Tasks.Count() ) - 1;
+		for( int i = 0; i < nWorkers; i++ )
+			threads.AddToTail( CreateSimpleThread( WorkerThreadFn, this ) );
+		RunTasks();
+		for( int i = 0; i < threads.Count(); i++ )
+		{
+			ThreadJoin( threads[i] );
+			ReleaseThreadHandle( threads[i] );
+		}
+
+		for( int i = 0; i < mergeOrder.Count(); i++ )
+			MergeTask( mergeOrder[i] );
+	}
+
+	// now, convert all triangles to "intersection format"
+	for( int i = 0; i < ntris; i++ )
+		m_pEnv->OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+
+	if ( pStatsOut )
+	{
+		m_pEnv->CalculateKDTreeStats( *pStatsOut );
+		pStatsOut->m_flBuildTime = Plat_FloatTime() - flStartTime;
+		pStatsOut->m_nThreads = m_nThreads;
+		pStatsOut->m_nSubtreeTasks = m_Tasks.Count();
+	}
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure( int nThreads, KDTreeBuildStats_t *pStatsOut )
+{
+	CKDTreeBuilder builder( this, nThreads );
+	builder.Build( pStatsOut );
+}
+
+
+static void AccumulateKDTreeStats( RayTracingEnvironment const *pEnv, int nNode, Vector mins, Vector maxs,
+								   int depth, float flISA, KDTreeBuildStats_t &stats )
+{
+	CacheOptimizedKDNode const &node = pEnv->OptimizedKDTree[nNode];
+	float flProb = BoxSurfaceArea( mins, maxs ) * flISA;
+	stats.m_nNodes++;
+	stats.m_nMaxDepth = max( stats.m_nMaxDepth, depth );
+	if ( node.NodeType() == KDNODE_STATE_LEAF )
+	{
+		int ntris = node.NumberOfTrianglesInLeaf();
+		stats.m_nLeaves++;
+		if ( !ntris )
+			stats.m_nEmptyLeaves++;
+		stats.m_nTriangleReferences += ntris;
+		stats.m_nMaxLeafTriangles = max( stats.m_nMaxLeafTriangles, ntris );
+		stats.m_flSAHCost += flProb * COST_OF_INTERSECTION * ntris;
+		return;
+	}
+	stats.m_flSAHCost += flProb * COST_OF_TRAVERSAL;
+	int axis = node.NodeType();
+	Vector LeftMaxes = maxs;
+	Vector RightMins = mins;
+	LeftMaxes[axis] = node.SplittingPlaneValue;
+	RightMins[axis] = node.SplittingPlaneValue;
+	AccumulateKDTreeStats( pEnv, node.LeftChild(), mins, LeftMaxes, depth + 1, flISA, stats );
+	AccumulateKDTreeStats( pEnv, node.RightChild(), RightMins, maxs, depth + 1, flISA, stats );
+}
+
+void RayTracingEnvironment::CalculateKDTreeStats( KDTreeBuildStats_t &stats ) const
+{
+	memset( &stats, 0, sizeof( stats ) );
+	stats.m_nTriangles = OptimizedTriangleList.Count();
+	if ( !OptimizedKDTree.Count() )
+		return;
+	float flRootArea = BoxSurfaceArea( m_MinBound, m_MaxBound );
+	AccumulateKDTreeStats( this, 0, m_MinBound, m_MaxBound, 0, ( flRootArea > 0 ) ? 1.0 / flRootArea : 0, stats );
+}
@@ -0,0 +1,471 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Ray tracing throughput benchmark. Builds reproducible sets of the rays vrad traces
+//			most (camera style primary rays, shadow rays towards the sun and short hemisphere
+//			rays for ambient occlusion) and times them through Trace4Rays and TraceRayPacket.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "raytrace_bench.h"
+#include <stdio.h>
+#include <tier0/threadtools.h>
+
+// how many packets a thread claims at a time
+#define BENCH_PACKETS_PER_FETCH 8
+
+typedef CUtlVector< RayPacket, CUtlMemoryAligned< RayPacket, 16 > > RayPacketVector_t;
+
+
+//-----------------------------------------------------------------------------
+// xorshift, so the ray sets don't depend on the crt's rand()
+//-----------------------------------------------------------------------------
+class CBenchRandom
+{
+public:
+	CBenchRandom( uint32 nSeed ) : m_nState( nSeed ? nSeed : 1 ) {}
+
+	uint32 RandomInt( void )
+	{
+		m_nState ^= m_nState << 13;
+		m_nState ^= m_nState >> 17;
+		m_nState ^= m_nState << 5;
+		return m_nState;
+	}
+
+	float RandomFloat( float flMin, float flMax )
+	{
+		return flMin + ( flMax - flMin ) * ( RandomInt() >> 8 ) * ( 1.0f / 16777216.0f );
+	}
+
+	// uniform on the sphere
+	Vector RandomUnitVector( void )
+	{
+		float z = RandomFloat( -1.0f, 1.0f );
+		float flPhi = RandomFloat( 0.0f, 2.0f * M_PI );
+		float r = sqrt( max( 0.0f, 1.0f - z * z ) );
+		return Vector( r * cos( flPhi ), r * sin( flPhi ), z );
+	}
+
+private:
+	uint32 m_nState;
+};
+
+
+struct BenchRaySet_t
+{
+	char const *m_pName;
+	RayPacketVector_t m_Packets;
+	int64 m_nRays;
+
+	BenchRaySet_t( char const *pName ) : m_pName( pName ), m_nRays( 0 ) {}
+};
+
+// 4 surface points found by the primary rays
+struct BenchSurfaceQuad_t
+{
+	FourVectors m_Position;
+	FourVectors m_Normal;									// facing the camera
+};
+
+typedef CUtlVector< BenchSurfaceQuad_t, CUtlMemoryAligned< BenchSurfaceQuad_t, 16 > > SurfaceQuadVector_t;
+
+
+static void AddGroup( BenchRaySet_t &set, RayPacket &packet, FourVectors const &origin,
+					  FourVectors const &direction, float flTMax )
+{
+	Assert( packet.m_nGroups < RAYPACKET_MAX_GROUPS );
+	int g = packet.m_nGroups++;
+	packet.m_Rays[g].origin = origin;
+	packet.m_Rays[g].direction = direction;
+	packet.m_TMin[g] = Four_Zeros;
+	packet.m_TMax[g] = ReplicateX4( flTMax );
+	set.m_nRays += 4;
+}
+
+static float MaxTraceDistance( RayTracingEnvironment const &env )
+{
+	return ( env.m_MaxBound - env.m_MinBound ).Length() + 1.0f;
+}
+
+
+//-----------------------------------------------------------------------------
+// Primary rays: square 90 degree images from random spots in the middle of the scene. Each
+// 8x8 pixel tile is one packet of 2x2 pixel groups.
+//-----------------------------------------------------------------------------
+static void BuildPrimaryRays( RayTracingEnvironment const &env, RayTraceBenchmarkParams_t const &params,
+							  CBenchRandom &rnd, BenchRaySet_t &set )
+{
+	float flMaxDist = MaxTraceDistance( env );
+	int nTiles = max( params.m_nImageSize / 8, 1 );
+	float flPixelSize = 2.0f / ( nTiles * 8 );
+
+	for( int c = 0; c < params.m_nCameras; c++ )
+	{
+		Vector vOrigin;
+		for( int i = 0; i < 3; i++ )
+			vOrigin[i] = env.m_MinBound[i] + ( env.m_MaxBound[i] - env.m_MinBound[i] ) * rnd.RandomFloat( 0.25f, 0.75f );
+
+		float flYaw = rnd.RandomFloat( 0.0f, 2.0f * M_PI );
+		float flPitch = rnd.RandomFloat( -0.35f, 0.35f );
+		Vector vForward( cos( flPitch ) * cos( flYaw ), cos( flPitch ) * sin( flYaw ), sin( flPitch ) );
+		Vector vRight = CrossProduct( vForward, Vector( 0, 0, 1 ) );
+		VectorNormalize( vRight );
+		Vector vUp = CrossProduct( vRight, vForward );
+
+		FourVectors origin;
+		origin.DuplicateVector( vOrigin );
+		for( int ty = 0; ty < nTiles; ty++ )
+		{
+			for( int tx = 0; tx < nTiles; tx++ )
+			{
+				RayPacket &packet = set.m_Packets[set.m_Packets.AddToTail()];
+				for( int q = 0; q < 16; q++ )
+				{
+					FourVectors direction;
+					for( int i = 0; i < 4; i++ )
+					{
+						int px = tx * 8 + ( q & 3 ) * 2 + ( i & 1 );
+						int py = ty * 8 + ( q >> 2 ) * 2 + ( i >> 1 );
+						float u = ( px + 0.5f ) * flPixelSize - 1.0f;
+						float v = 1.0f - ( py + 0.5f ) * flPixelSize;
+						Vector vDir = vForward + u * vRight + v * vUp;
+						VectorNormalize( vDir );
+						direction.X( i ) = vDir.x;
+						direction.Y( i ) = vDir.y;
+						direction.Z( i ) = vDir.z;
+					}
+					AddGroup( set, packet, origin, direction, flMaxDist );
+				}
+			}
+		}
+	}
+}
+
+// traces the primary rays once and keeps up to nMaxQuads groups where all 4 rays hit something,
+// spread evenly over all of the images
+static void FindSurfaceQuads( RayTracingEnvironment &env, BenchRaySet_t const &primary, int nMaxQuads,
+							  SurfaceQuadVector_t &quads )
+{
+	SurfaceQuadVector_t hits;
+	RayTracingResult results[RAYPACKET_MAX_GROUPS];
+	for( int p = 0; p < primary.m_Packets.Count(); p++ )
+	{
+		RayPacket const &packet = primary.m_Packets[p];
+		env.TraceRayPacket( packet, results );
+		for( int g = 0; g < packet.m_nGroups; g++ )
+		{
+			RayTracingResult const &rslt = results[g];
+			if ( ( rslt.HitIds[0] == -1 ) || ( rslt.HitIds[1] == -1 ) ||
+				 ( rslt.HitIds[2] == -1 ) || ( rslt.HitIds[3] == -1 ) )
+				continue;
+
+			FourRays const &rays = packet.m_Rays[g];
+			BenchSurfaceQuad_t &quad = hits[hits.AddToTail()];
+			quad.m_Position = rays.direction;
+			quad.m_Position *= rslt.HitDistance;
+			quad.m_Position += rays.origin;
+
+			fltx4 backfacing = CmpGtSIMD( rslt.surface_normal * rays.direction, Four_Zeros );
+			for( int c = 0; c < 3; c++ )
+				quad.m_Normal[c] = MaskedAssign( backfacing, NegSIMD( rslt.surface_normal[c] ), rslt.surface_normal[c] );
+		}
+	}
+
+	int nKeep = min( nMaxQuads, hits.Count() );
+	for( int i = 0; i < nKeep; i++ )
+		quads.AddToTail( hits[(int)( (int64)i * hits.Count() / nKeep )] );
+}
+
+// Shadow rays towards the sun: one packet per surface quad, one group per jittered sun sample,
+// started one unit off the surface like the vrad sample positions
+static void BuildSunRays( RayTracingEnvironment const &env, RayTraceBenchmarkParams_t const &params,
+						  CBenchRandom &rnd, SurfaceQuadVector_t const &quads, BenchRaySet_t &set )
+{
+	float flMaxDist = MaxTraceDistance( env );
+	Vector vSun = params.m_vSunDirection;
+	VectorNormalize( vSun );
+	int nSamples = clamp( params.m_nSunSamples, 1, RAYPACKET_MAX_GROUPS );
+
+	for( int q = 0; q < quads.Count(); q++ )
+	{
+		FourVectors origin = quads[q].m_Normal;
+		origin += quads[q].m_Position;
+
+		RayPacket &packet = set.m_Packets[set.m_Packets.AddToTail()];
+		for( int s = 0; s < nSamples; s++ )
+		{
+			Vector vDir = vSun + params.m_flSunAngularExtent * rnd.RandomUnitVector();
+			VectorNormalize( vDir );
+			FourVectors direction;
+			direction.DuplicateVector( vDir );
+			AddGroup( set, packet, origin, direction, flMaxDist );
+		}
+	}
+}
+
+// Ambient occlusion rays, set up the same way as CalculateAmbientOcclusion4: a fixed sequence of
+// sphere directions mirrored into each sample's hemisphere, starting one unit off the surface
+static void BuildAORays( RayTraceBenchmarkParams_t const &params, CBenchRandom &rnd,
+						 SurfaceQuadVector_t const &quads, BenchRaySet_t &set )
+{
+	CUtlVector<Vector> directions;
+	for( int s = 0; s < params.m_nAOSamples; s++ )
+		directions.AddToTail( rnd.RandomUnitVector() );
+
+	for( int q = 0; q < quads.Count(); q++ )
+	{
+		FourVectors const &normal = quads[q].m_Normal;
+		FourVectors origin = normal;
+		origin += quads[q].m_Position;
+
+		for( int s = 0; s < directions.Count(); s++ )
+		{
+			if ( ( s % RAYPACKET_MAX_GROUPS ) == 0 )
+				set.m_Packets.AddToTail();
+			RayPacket &packet = set.m_Packets.Tail();
+
+			FourVectors direction;
+			direction.DuplicateVector( directions[s] );
+			fltx4 rayDotN = direction * normal;
+			fltx4 flip = MulSIMD( Four_Twos, MaxSIMD( NegSIMD( rayDotN ), Four_Zeros ) );	// |d.n| - d.n
+			for( int c = 0; c < 3; c++ )
+				direction[c] = AddSIMD( direction[c], MulSIMD( normal[c], flip ) );
+			AddGroup( set, packet, origin, direction, params.m_flAORadius );
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Timing
+//-----------------------------------------------------------------------------
+struct BenchPass_t
+{
+	RayTracingEnvironment *m_pEnv;
+	BenchRaySet_t const *m_pSet;
+	bool m_bPackets;
+	CInterlockedInt m_nNextPacket;
+	CInterlockedInt m_nHits;
+};
+
+static int CountHits( RayTracingResult const *pResults, int nGroups )
+{
+	int nHits = 0;
+	for( int g = 0; g < nGroups; g++ )
+	{
+		for( int i = 0; i < 4; i++ )
+			nHits += ( pResults[g].HitIds[i] != -1 );
+	}
+	return nHits;
+}
+
+static void TraceBenchPackets( BenchPass_t *pPass )
+{
+	RayPacketVector_t const &packets = pPass->m_pSet->m_Packets;
+	RayTracingResult results[RAYPACKET_MAX_GROUPS];
+	int nHits = 0;
+	while( true )
+	{
+		int nFirst = pPass->m_nNextPacket.AtomicAdd( BENCH_PACKETS_PER_FETCH );
+		if ( nFirst >= packets.Count() )
+			break;
+		int nLast = min( nFirst + BENCH_PACKETS_PER_FETCH, packets.Count() );
+		for( int p = nFirst; p < nLast; p++ )
+		{
+			RayPacket const &packet = packets[p];
+			if ( pPass->m_bPackets )
+			{
+				pPass->m_pEnv->TraceRayPacket( packet, results );
+			}
+			else
+			{
+				for( int g = 0; g < packet.m_nGroups; g++ )
+					pPass->m_pEnv->Trace4Rays( packet.m_Rays[g], packet.m_TMin[g], packet.m_TMax[g], &results[g] );
+			}
+			nHits += CountHits( results, packet.m_nGroups );
+		}
+	}
+	pPass->m_nHits += nHits;
+}
+
+static unsigned BenchWorkerThreadFn( void *pParam )
+{
+	TraceBenchPackets( reinterpret_cast<BenchPass_t *>( pParam ) );
+	return 0;
+}
+
+// returns the wall clock time of one pass over the set on nThreads threads
+static float TimeBenchPass( RayTracingEnvironment &env, BenchRaySet_t const &set, bool bPackets, int nThreads, int *pHitsOut )
+{
+	BenchPass_t pass;
+	pass.m_pEnv = &env;
+	pass.m_pSet = &set;
+	pass.m_bPackets = bPackets;
+	pass.m_nNextPacket = 0;
+	pass.m_nHits = 0;
+
+	float flStartTime = Plat_FloatTime();
+	CUtlVector<ThreadHandle_t> threads;
+	for( int i = 1; i < nThreads; i++ )
+		threads.AddToTail( CreateSimpleThread( BenchWorkerThreadFn, &pass ) );
+	TraceBenchPackets( &pass );
+	for( int i = 0; i < threads.Count(); i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+	float flTime = Plat_FloatTime() - flStartTime;
+
+	*pHitsOut = pass.m_nHits;
+	return flTime;
+}
+
+// single threaded pass with the counted trace routines
+static void CountBenchPass( RayTracingEnvironment &env, BenchRaySet_t const &set, bool bPackets,
+							RayTraceCounters_t &counters )
+{
+	RayTracingResult results[RAYPACKET_MAX_GROUPS];
+	for( int p = 0; p < set.m_Packets.Count(); p++ )
+	{
+		RayPacket const &packet = set.m_Packets[p];
+		if ( bPackets )
+		{
+			env.TraceRayPacketCounted( packet, results, counters );
+		}
+		else
+		{
+			for( int g = 0; g < packet.m_nGroups; g++ )
+				env.Trace4RaysCounted( packet.m_Rays[g], packet.m_TMin[g], packet.m_TMax[g], &results[g], counters );
+		}
+	}
+}
+
+static void BenchmarkRaySet( RayTracingEnvironment &env, RayTraceBenchmarkParams_t const &params, BenchRaySet_t const &set )
+{
+	if ( !set.m_nRays )
+	{
+		Msg( "  %s: no rays\n", set.m_pName );
+		return;
+	}
+
+	int nCoherent = 0;
+	for( int p = 0; p < set.m_Packets.Count(); p++ )
+		nCoherent += ( set.m_Packets[p].CalculateDirectionSignMask() != -1 );
+	Msg( "  %s: %lld rays in %d packets (%d with matching direction signs)\n",
+		 set.m_pName, set.m_nRays, set.m_Packets.Count(), nCoherent );
+
+	// work counts. A node visit or triangle test covers a group of 4 rays in Trace4Rays, and node
+	// visits cover the whole packet in TraceRayPacket, so these are per ray amortized SIMD steps.
+	char const *pModeNames[2] = { "4-ray ", "packet" };
+	for( int m = 0; m < 2; m++ )
+	{
+		RayTraceCounters_t counters;
+		CountBenchPass( env, set, m != 0, counters );
+		Msg( "    %s: %.2f node visits/ray, %.2f triangle tests/ray\n", pModeNames[m],
+			 (float)counters.m_nNodesVisited / counters.m_nRays, (float)counters.m_nTriangleTests / counters.m_nRays );
+	}
+
+	Msg( "    threads   4-ray Mrays/s   packet Mrays/s\n" );
+	int nMaxThreads = max( params.m_nMaxThreads, 1 );
+	int nHits[2] = { -1, -1 };
+	for( int nThreads = 1; ; nThreads = min( nThreads * 2, nMaxThreads ) )
+	{
+		float flRate[2];
+		for( int m = 0; m < 2; m++ )
+		{
+			float flBestTime = 1.0e23;
+			for( int r = 0; r < max( params.m_nRepeats, 1 ); r++ )
+			{
+				int nPassHits;
+				flBestTime = min( flBestTime, TimeBenchPass( env, set, m != 0, nThreads, &nPassHits ) );
+				nHits[m] = nPassHits;
+			}
+			flRate[m] = set.m_nRays / ( 1.0e6 * max( flBestTime, 1.0e-6f ) );
+		}
+		Msg( "    %7d   %13.2f   %14.2f\n", nThreads, flRate[0], flRate[1] );
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+
+	if ( nHits[0] != nHits[1] )
+		Warning( "    hit counts differ: 4-ray %d, packet %d\n", nHits[0], nHits[1] );
+	else
+		Msg( "    %d hits (%.1f%%)\n", nHits[0], 100.0f * nHits[0] / set.m_nRays );
+}
+
+void RunRayTraceBenchmark( RayTracingEnvironment &env, RayTraceBenchmarkParams_t const &params )
+{
+	Msg( "Ray tracing benchmark: %d triangles, seed 0x%08x, up to %d threads\n",
+		 env.OptimizedTriangleList.Count(), params.m_nSeed, params.m_nMaxThreads );
+
+	CBenchRandom rnd( params.m_nSeed );
+
+	BenchRaySet_t primary( "primary" );
+	BuildPrimaryRays( env, params, rnd, primary );
+
+	SurfaceQuadVector_t quads;
+	FindSurfaceQuads( env, primary, params.m_nMaxSurfaceQuads, quads );
+
+	BenchRaySet_t sun( "sun shadow" );
+	BuildSunRays( env, params, rnd, quads, sun );
+
+	BenchRaySet_t ao( "ambient occlusion" );
+	BuildAORays( params, rnd, quads, ao );
+
+	BenchmarkRaySet( env, params, primary );
+	BenchmarkRaySet( env, params, sun );
+	BenchmarkRaySet( env, params, ao );
+}
+
+
+//-----------------------------------------------------------------------------
+// Reads the text format written by vrad's WriteRTEnv: a vertex count, then one
+// "x y z r g b" line per vertex, for each polygon
+//-----------------------------------------------------------------------------
+bool LoadRayTraceEnvironmentDump( RayTracingEnvironment &env, char const *pFilename )
+{
+	FILE *fp = fopen( pFilename, "r" );
+	if ( !fp )
+	{
+		Warning( "Couldn't open %s\n", pFilename );
+		return false;
+	}
+
+	CUtlVector<Vector> verts;
+	int nTriangles = 0;
+	int nPoints;
+	while( fscanf( fp, "%d", &nPoints ) == 1 )
+	{
+		if ( nPoints < 3 )
+		{
+			Warning( "%s: bad polygon with %d verts\n", pFilename, nPoints );
+			fclose( fp );
+			return false;
+		}
+
+		verts.SetCount( nPoints );
+		Vector vColor;
+		for( int i = 0; i < nPoints; i++ )
+		{
+			if ( fscanf( fp, "%f %f %f %f %f %f", &verts[i].x, &verts[i].y, &verts[i].z,
+						 &vColor.x, &vColor.y, &vColor.z ) != 6 )
+			{
+				Warning( "%s: unexpected end of file\n", pFilename );
+				fclose( fp );
+				return false;
+			}
+		}
+
+		for( int i = 2; i < nPoints; i++ )
+			env.AddTriangle( nTriangles++, verts[0], verts[i - 1], verts[i], vColor );
+	}
+	fclose( fp );
+
+	if ( !nTriangles )
+	{
+		Warning( "%s: no triangles\n", pFilename );
+		return false;
+	}
+	return true;
+}
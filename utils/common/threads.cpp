@@ -20,6 +20,8 @@
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
+#include "utlvector.h"
 
 #define	MAX_THREADS	MAX_TOOL_THREADS
 
@@ -74,6 +76,195 @@ int	GetThreadWork (void)
 }
 
 
+/*
+===================================================================
+
+Work-stealing dispatch
+
+RunThreadsOn splits the work items into one contiguous range per
+thread. GetThreadWork( iThread ) hands out items from the calling
+thread's current chunk without any synchronization, takes its next
+chunk off the front of its own range with a single compare-and-swap,
+and when its own range is empty it steals the back half of another
+thread's range. With a cost hint, the items are sorted by decreasing
+cost and dealt out round-robin, so every thread starts on expensive
+items and the thieves pick up the cheap tail.
+
+===================================================================
+*/
+
+#define THREADWORK_MAX_CHUNK	32
+
+struct ALIGN128 ThreadWorkRange_t
+{
+	// begin in the low 32 bits, end in the high 32 bits, so both can be swapped at once
+	volatile int64	m_nRange;
+
+	// only touched by the owning thread
+	int				m_nChunkNext;
+	int				m_nChunkEnd;
+} ALIGN128_POST;
+
+static ThreadWorkRange_t g_ThreadWork[MAX_THREADS+1];
+static CUtlVector<int> g_ThreadWorkOrder;	// item for each position. empty if not sorted.
+static volatile long g_nThreadWorkDispatched;
+static volatile long g_nThreadWorkPacifierBusy;
+
+
+static inline int64 MakeWorkRange( int nBegin, int nEnd )
+{
+	return (int64)(uint32)nBegin | ( (int64)(uint32)nEnd << 32 );
+}
+
+static inline int WorkRangeBegin( int64 nRange )
+{
+	return (int)(uint32)nRange;
+}
+
+static inline int WorkRangeEnd( int64 nRange )
+{
+	return (int)(uint32)( nRange >> 32 );
+}
+
+
+struct ThreadWorkCost_t
+{
+	float	m_flCost;
+	int		m_iWorkItem;
+};
+
+static int __cdecl CompareThreadWorkCost( const ThreadWorkCost_t *pA, const ThreadWorkCost_t *pB )
+{
+	if ( pA->m_flCost != pB->m_flCost )
+		return ( pA->m_flCost > pB->m_flCost ) ? -1 : 1;
+	return pA->m_iWorkItem - pB->m_iWorkItem;
+}
+
+
+static void SetupThreadWork( int workcnt, ThreadWorkCostFn costFn )
+{
+	int nThreads = clamp( numthreads, 1, MAX_THREADS );
+
+	int nBegin = 0;
+	for ( int i=0; i < nThreads; i++ )
+	{
+		int nCount = workcnt / nThreads + ( ( i < workcnt % nThreads ) ? 1 : 0 );
+		g_ThreadWork[i].m_nRange = MakeWorkRange( nBegin, nBegin + nCount );
+		g_ThreadWork[i].m_nChunkNext = g_ThreadWork[i].m_nChunkEnd = 0;
+		nBegin += nCount;
+	}
+	for ( int i=nThreads; i <= MAX_THREADS; i++ )
+	{
+		g_ThreadWork[i].m_nRange = MakeWorkRange( 0, 0 );
+		g_ThreadWork[i].m_nChunkNext = g_ThreadWork[i].m_nChunkEnd = 0;
+	}
+
+	g_nThreadWorkDispatched = 0;
+	g_nThreadWorkPacifierBusy = 0;
+	g_ThreadWorkOrder.RemoveAll();
+	if ( !costFn || workcnt <= 1 )
+		return;
+
+	CUtlVector<ThreadWorkCost_t> costs;
+	costs.SetCount( workcnt );
+	for ( int i=0; i < workcnt; i++ )
+	{
+		costs[i].m_flCost = costFn( i );
+		costs[i].m_iWorkItem = i;
+	}
+	costs.Sort( CompareThreadWorkCost );
+
+	// deal the sorted items out round-robin so that every thread's range is sorted too
+	g_ThreadWorkOrder.SetCount( workcnt );
+	for ( int i=0; i < workcnt; i++ )
+	{
+		int iThread = i % nThreads;
+		g_ThreadWorkOrder[ WorkRangeBegin( g_ThreadWork[iThread].m_nRange ) + i / nThreads ] = costs[i].m_iWorkItem;
+	}
+}
+
+
+// Takes a chunk off the front of the thread's own range.
+static bool TakeOwnThreadWork( ThreadWorkRange_t &work )
+{
+	while ( 1 )
+	{
+		int64 nRange = work.m_nRange;
+		int nBegin = WorkRangeBegin( nRange );
+		int nEnd = WorkRangeEnd( nRange );
+		if ( nBegin >= nEnd )
+			return false;
+
+		int nCount = clamp( ( nEnd - nBegin ) / 8, 1, THREADWORK_MAX_CHUNK );
+		if ( ThreadInterlockedAssignIf64( &work.m_nRange, MakeWorkRange( nBegin + nCount, nEnd ), nRange ) )
+		{
+			work.m_nChunkNext = nBegin;
+			work.m_nChunkEnd = nBegin + nCount;
+			return true;
+		}
+	}
+}
+
+// Moves the back half of another thread's range into this thread's range.
+static bool StealThreadWork( ThreadWorkRange_t &work, ThreadWorkRange_t &victim )
+{
+	while ( 1 )
+	{
+		int64 nRange = victim.m_nRange;
+		int nBegin = WorkRangeBegin( nRange );
+		int nEnd = WorkRangeEnd( nRange );
+		if ( nBegin >= nEnd )
+			return false;
+
+		int nSteal = ( nEnd - nBegin + 1 ) / 2;
+		if ( ThreadInterlockedAssignIf64( &victim.m_nRange, MakeWorkRange( nBegin, nEnd - nSteal ), nRange ) )
+		{
+			ThreadInterlockedExchange64( &work.m_nRange, MakeWorkRange( nEnd - nSteal, nEnd ) );
+			return true;
+		}
+	}
+}
+
+static void UpdateThreadWorkPacifier( int nDispatched )
+{
+	// whoever gets here first draws it, everybody else carries on working
+	if ( !ThreadInterlockedAssignIf( &g_nThreadWorkPacifierBusy, 1, 0 ) )
+		return;
+	UpdatePacifier( (float)nDispatched / workcount );
+	g_nThreadWorkPacifierBusy = 0;
+}
+
+int GetThreadWork( int iThread )
+{
+	Assert( iThread >= 0 && iThread <= MAX_THREADS );
+	ThreadWorkRange_t &work = g_ThreadWork[iThread];
+
+	if ( work.m_nChunkNext >= work.m_nChunkEnd )
+	{
+		if ( !TakeOwnThreadWork( work ) )
+		{
+			int nThreads = clamp( numthreads, 1, MAX_THREADS );
+			bool bStole = false;
+			for ( int i=1; i <= nThreads && !bStole; i++ )
+			{
+				int iVictim = ( iThread + i ) % nThreads;
+				if ( iVictim != iThread )
+					bStole = StealThreadWork( work, g_ThreadWork[iVictim] );
+			}
+			// someone else may have stolen it back in the meantime
+			if ( !bStole || !TakeOwnThreadWork( work ) )
+				return -1;
+		}
+
+		int nCount = work.m_nChunkEnd - work.m_nChunkNext;
+		UpdateThreadWorkPacifier( ThreadInterlockedExchangeAdd( &g_nThreadWorkDispatched, nCount ) + nCount );
+	}
+
+	int r = work.m_nChunkNext++;
+	return g_ThreadWorkOrder.Count() ? g_ThreadWorkOrder[r] : r;
+}
+
+
 ThreadWorkerFn workfunction;
 
 void ThreadWorkerFunction( int iThread, void *pUserData )
@@ -82,7 +273,7 @@ void ThreadWorkerFunction( int iThread, void *pUserData )
 
 	while (1)
 	{
-		work = GetThreadWork ();
+		work = GetThreadWork ( iThread );
 		if (work == -1)
 			break;
 		 
@@ -99,6 +290,15 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 	RunThreadsOn (workcnt, showpacifier, ThreadWorkerFunction);
 }
 
+void RunThreadsOnIndividualSorted (int workcnt, qboolean showpacifier, ThreadWorkerFn func, ThreadWorkCostFn costFn)
+{
+	if (numthreads == -1)
+		ThreadSetDefault ();
+	
+	workfunction = func;
+	RunThreadsOnSorted (workcnt, showpacifier, ThreadWorkerFunction, costFn);
+}
+
 
 /*
 ===================================================================
@@ -225,12 +425,18 @@ RunThreadsOn
 =============
 */
 void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData )
+{
+	RunThreadsOnSorted( workcnt, showpacifier, fn, NULL, pUserData );
+}
+
+void RunThreadsOnSorted( int workcnt, qboolean showpacifier, RunThreadsFn fn, ThreadWorkCostFn costFn, void *pUserData )
 {
 	int		start, end;
 
 	start = Plat_FloatTime();
 	dispatch = 0;
 	workcount = workcnt;
+	SetupThreadWork( workcnt, costFn );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -254,3 +460,71 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 }
 
 
+/*
+=============
+RunThreadWorkBenchmark
+=============
+*/
+static float g_flThreadWorkBenchmarkSink[MAX_THREADS+1];
+
+static float ThreadWorkBenchmarkCost( int iWorkItem )
+{
+	// mostly tiny items, with a heavy one every so often, roughly like faces in a map
+	return ( iWorkItem % 61 ) ? 8 : 4096;
+}
+
+static void ThreadWorkBenchmarkItem( int iThread, int iWorkItem )
+{
+	float f = (float)iWorkItem;
+	for ( int i = (int)ThreadWorkBenchmarkCost( iWorkItem ); i > 0; i-- )
+		f = sqrtf( f + 1.0f );
+	g_flThreadWorkBenchmarkSink[iThread] += f;
+}
+
+static void ThreadWorkBenchmarkLocked( int iThread, void *pUserData )
+{
+	int work;
+	while ( ( work = GetThreadWork() ) != -1 )
+		ThreadWorkBenchmarkItem( iThread, work );
+}
+
+static void ThreadWorkBenchmarkStealing( int iThread, void *pUserData )
+{
+	int work;
+	while ( ( work = GetThreadWork( iThread ) ) != -1 )
+		ThreadWorkBenchmarkItem( iThread, work );
+}
+
+void RunThreadWorkBenchmark()
+{
+	if ( numthreads == -1 )
+		ThreadSetDefault();
+
+	static const int s_nItemCounts[] = { 10000, 100000, 1000000 };
+
+	SuppressPacifier( true );
+	Msg( "Dispatcher benchmark, %d threads:\n", numthreads );
+	for ( int i=0; i < ARRAYSIZE( s_nItemCounts ); i++ )
+	{
+		int nItems = s_nItemCounts[i];
+
+		double flStart = Plat_FloatTime();
+		RunThreadsOn( nItems, false, ThreadWorkBenchmarkLocked );
+		double flLocked = Plat_FloatTime() - flStart;
+
+		flStart = Plat_FloatTime();
+		RunThreadsOn( nItems, false, ThreadWorkBenchmarkStealing );
+		double flStealing = Plat_FloatTime() - flStart;
+
+		flStart = Plat_FloatTime();
+		RunThreadsOnSorted( nItems, false, ThreadWorkBenchmarkStealing, ThreadWorkBenchmarkCost );
+		double flSorted = Plat_FloatTime() - flStart;
+
+		Msg( "  %8d items: locked %.3fs (%.2f Mitems/s), stealing %.3fs (%.2f Mitems/s), stealing+cost %.3fs (%.2f Mitems/s)\n",
+			nItems,
+			flLocked, nItems / ( flLocked * 1.0e6 ),
+			flStealing, nItems / ( flStealing * 1.0e6 ),
+			flSorted, nItems / ( flSorted * 1.0e6 ) );
+	}
+	SuppressPacifier( false );
+}
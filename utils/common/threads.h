@@ -30,6 +30,10 @@ extern bool	g_bLowPriorityThreads;
 typedef void (*ThreadWorkerFn)( int iThread, int iWorkItem );
 typedef void (*RunThreadsFn)( int iThread, void *pUserData );
 
+// Returns an estimate of how long a work item will take, in any units. Items with the highest
+// cost are handed out first.
+typedef float (*ThreadWorkCostFn)( int iWorkItem );
+
 
 enum ERunThreadsPriority
 {
@@ -43,12 +47,27 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Old style dispatcher: every call takes the global lock. Prefer GetThreadWork( iThread ).
 int	GetThreadWork (void);
 
+// Work-stealing dispatcher. Each thread works through its own share of the items and steals
+// from the other threads when it runs out, without taking any locks. Returns -1 when all of
+// the work has been handed out.
+int GetThreadWork( int iThread );
+
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
 
 void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData=NULL );
 
+// Same as above, but the work items are handed out in order of decreasing cost.
+void RunThreadsOnIndividualSorted ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn, ThreadWorkCostFn costFn );
+
+void RunThreadsOnSorted ( int workcnt, qboolean showpacifier, RunThreadsFn fn, ThreadWorkCostFn costFn, void *pUserData=NULL );
+
+// Times the old and work-stealing dispatchers against each other on synthetic work.
+void RunThreadWorkBenchmark();
+
 // This version doesn't track work items - it just runs your function and waits for it to finish.
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority=k_eRunThreadsPriority_UseGlobalState );
 void RunThreads_End();
@@ -60,6 +79,8 @@ void ThreadUnlock (void);
 #ifndef NO_THREAD_NAMES
 #define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
 #define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define RunThreadsOnSorted(n,p,f,...) { if (p) printf("%-20s ", #f ":"); RunThreadsOnSorted(n,p,f,__VA_ARGS__); }
+#define RunThreadsOnIndividualSorted(n,p,f,c) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividualSorted(n,p,f,c); }
 #endif
 
 #endif // THREADS_H
@@ -0,0 +1,109 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Headless ray tracing benchmark. Loads a scene dumped with vrad -dumptrace,
+//			builds the kd-tree and times the benchmark ray sets on it. To benchmark
+//			the scene vrad builds straight from a bsp, use vrad -benchtrace instead.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "mathlib/mathlib.h"
+#include "tier1/strtools.h"
+#include "raytrace_bench.h"
+
+
+static SpewRetval_t RTBenchSpewFunc( SpewType_t type, char const *pMsg )
+{
+	printf( "%s", pMsg );
+	fflush( stdout );
+
+	if ( type == SPEW_ASSERT )
+		return SPEW_DEBUGGER;
+	if ( type == SPEW_ERROR )
+		return SPEW_ABORT;
+	return SPEW_CONTINUE;
+}
+
+static void PrintUsage( void )
+{
+	Msg( "usage: rtbench [options] <trace.txt>\n"
+		 "\n"
+		 "  <trace.txt> is a scene written by vrad -dumptrace.\n"
+		 "\n"
+		 "  -threads #    : Time with 1, 2, 4 ... # threads (default: all logical processors).\n"
+		 "  -seed #       : Seed for the ray sets.\n"
+		 "  -cameras #    : Number of primary ray images (default 4).\n"
+		 "  -size #       : Width and height of the primary ray images (default 256).\n"
+		 "  -quads #      : Surface points (in groups of 4) for the sun and AO rays (default 8192).\n"
+		 "  -repeats #    : Report the best of # passes (default 3).\n" );
+}
+
+int main( int argc, char **argv )
+{
+	SpewOutputFunc( RTBenchSpewFunc );
+	MathLib_Init( 2.2f, 2.2f, 0.0f, 2.0f, false, false, false, false );
+
+	RayTraceBenchmarkParams_t params;
+	params.m_nMaxThreads = GetCPUInformation()->m_nLogicalProcessors;
+
+	int i;
+	for( i = 1; i < argc; i++ )
+	{
+		if ( argv[i][0] != '-' )
+			break;
+
+		if ( i + 1 >= argc )
+		{
+			Warning( "Error: expected a value after '%s'\n", argv[i] );
+			PrintUsage();
+			return 1;
+		}
+
+		if ( !Q_stricmp( argv[i], "-threads" ) )
+			params.m_nMaxThreads = max( atoi( argv[++i] ), 1 );
+		else if ( !Q_stricmp( argv[i], "-seed" ) )
+			params.m_nSeed = strtoul( argv[++i], NULL, 0 );
+		else if ( !Q_stricmp( argv[i], "-cameras" ) )
+			params.m_nCameras = max( atoi( argv[++i] ), 1 );
+		else if ( !Q_stricmp( argv[i], "-size" ) )
+			params.m_nImageSize = max( atoi( argv[++i] ), 8 );
+		else if ( !Q_stricmp( argv[i], "-quads" ) )
+			params.m_nMaxSurfaceQuads = max( atoi( argv[++i] ), 1 );
+		else if ( !Q_stricmp( argv[i], "-repeats" ) )
+			params.m_nRepeats = max( atoi( argv[++i] ), 1 );
+		else
+		{
+			Warning( "Error: unknown option '%s'\n", argv[i] );
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if ( i != argc - 1 )
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	RayTracingEnvironment *pEnv = new RayTracingEnvironment;
+	if ( !LoadRayTraceEnvironmentDump( *pEnv, argv[i] ) )
+	{
+		delete pEnv;
+		return 1;
+	}
+
+	Msg( "Setting up ray-trace acceleration structure... " );
+	KDTreeBuildStats_t kdStats;
+	pEnv->SetupAccelerationStructure( params.m_nMaxThreads, &kdStats );
+	Msg( "Done (%.2f seconds)\n", kdStats.m_flBuildTime );
+	Msg( "  kd-tree: %d triangles, %d nodes, %d leaves, max depth %d, SAH cost %.1f\n",
+		 kdStats.m_nTriangles, kdStats.m_nNodes, kdStats.m_nLeaves, kdStats.m_nMaxDepth, kdStats.m_flSAHCost );
+
+	RunRayTraceBenchmark( *pEnv, params );
+
+	delete pEnv;
+	return 0;
+}
@@ -942,25 +942,19 @@ void CVRadDispMgr::RadialLuxelAddSamples( int ndxFace, Vector const &luxelPt, Ve
 		voxelMax[axis] = ( int )( ( luxelPt[axis] + radius ) * ooVoxelSize ) + 1;
 	}
 
-	SampleData_t sampleData;
 	for( int ndxZ = voxelMin[2]; ndxZ < voxelMax[2] + 1; ndxZ++ )
 	{
 		for( int ndxY = voxelMin[1]; ndxY < voxelMax[1] + 1; ndxY++ )
 		{
 			for( int ndxX = voxelMin[0]; ndxX < voxelMax[0] + 1; ndxX++ )
 			{
-				sampleData.x = ndxX * 100;
-				sampleData.y = ndxY * 10;
-				sampleData.z = ndxZ;
-
-				UtlHashHandle_t handle = g_SampleHashTable.Find( sampleData );
-				if( handle != g_SampleHashTable.InvalidHandle() )
+				int count;
+				uint32 const *pSamples = g_SampleHash.FindVoxel( ndxX, ndxY, ndxZ, count );
+				if( pSamples )
 				{
-					SampleData_t *pSampleData = &g_SampleHashTable.Element( handle );
-					int count = pSampleData->m_Samples.Count();
 					for( int ndx = 0; ndx < count; ndx++ )
 					{
-						SampleHandle_t sampleHandle = pSampleData->m_Samples.Element( ndx );
+						SampleHandle_t sampleHandle = pSamples[ndx];
 						int ndxSample = ( sampleHandle & 0x0000ffff );
 						int ndxFaceLight = ( ( sampleHandle >> 16 ) & 0x0000ffff );
 
@@ -1204,46 +1198,39 @@ void CVRadDispMgr::RadialLuxelAddPatch( int ndxFace, Vector const &luxelPt,
 		voxelMax[axis] = ( int )( ( luxelPt[axis] + radius ) * ooVoxelSize ) + 1;
 	}
 
-	unsigned short curIterationKey = IncrementPatchIterationKey();
-	PatchSampleData_t patchData;
+	// gather the neighbouring patches, each once
+	CUtlVector<int> ndxPatches;
 	for ( int ndxZ = voxelMin[2]; ndxZ < voxelMax[2] + 1; ndxZ++ )
 	{
 		for ( int ndxY = voxelMin[1]; ndxY < voxelMax[1] + 1; ndxY++ )
 		{
 			for ( int ndxX = voxelMin[0]; ndxX < voxelMax[0] + 1; ndxX++ )
 			{
-				patchData.x = ndxX * 100;
-				patchData.y = ndxY * 10;
-				patchData.z = ndxZ;
-
-				UtlHashHandle_t handle = g_PatchSampleHashTable.Find( patchData );
-				if ( handle != g_PatchSampleHashTable.InvalidHandle() )
+				int count;
+				uint32 const *pPatches = g_PatchSampleHash.FindVoxel( ndxX, ndxY, ndxZ, count );
+				for ( int ndx = 0; ndx < count; ndx++ )
 				{
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
-					int count = pPatchData->m_ndxPatches.Count();
-					for ( int ndx = 0; ndx < count; ndx++ )
+					int ndxPatch = pPatches[ndx];
+					if ( IsNeighbor( ndxFace, g_Patches[ndxPatch].faceNumber ) )
 					{
-						int ndxPatch = pPatchData->m_ndxPatches.Element( ndx );
-						CPatch *pPatch = &g_Patches.Element( ndxPatch );
-						if ( pPatch && pPatch->m_IterationKey != curIterationKey )
-						{
-							pPatch->m_IterationKey = curIterationKey;
-
-							if ( IsNeighbor( ndxFace, pPatch->faceNumber ) )
-							{
-								bool bNeighborBump = texinfo[g_pFaces[pPatch->faceNumber].texinfo].flags & SURF_BUMPLIGHT ? true : false;
-
-								Vector patchLight[NUM_BUMP_VECTS+1];
-								GetPatchLight( pPatch, bBump, patchLight );
-								AddPatchLightToRadial( pPatch->origin, pPatch->normal, patchLight, radius*radius,
-									                   luxelPt, luxelNormal, pRadial, ndxRadial, bBump, bNeighborBump );
-							}
-						}
+						ndxPatches.AddToTail( ndxPatch );
 					}
 				}
 			}
 		}
 	}
+	RemoveDuplicatePatches( ndxPatches );
+
+	for ( int i = 0; i < ndxPatches.Count(); i++ )
+	{
+		CPatch *pPatch = &g_Patches.Element( ndxPatches[i] );
+		bool bNeighborBump = texinfo[g_pFaces[pPatch->faceNumber].texinfo].flags & SURF_BUMPLIGHT ? true : false;
+
+		Vector patchLight[NUM_BUMP_VECTS+1];
+		GetPatchLight( pPatch, bBump, patchLight );
+		AddPatchLightToRadial( pPatch->origin, pPatch->normal, patchLight, radius*radius,
+							   luxelPt, luxelNormal, pRadial, ndxRadial, bBump, bNeighborBump );
+	}
 #endif
 }
 
@@ -1303,9 +1290,8 @@ void CVRadDispMgr::GetInterestingPatchesForLuxels(
 	}
 
 
-	// Now get the list of patches that touch those voxels.
-	unsigned short curIterationKey = IncrementPatchIterationKey();
-
+	// Now get the list of neighbouring patches that touch those voxels, each once.
+	CUtlVector<int> ndxPatches;
 	for ( int x=0; x < allVoxelSize[0]; x++ )
 	{
 		for ( int y=0; y < allVoxelSize[1]; y++ )
@@ -1318,37 +1304,27 @@ void CVRadDispMgr::GetInterestingPatchesForLuxels(
 				if ( !val )
 					continue;
 
-				PatchSampleData_t patchData;
-				patchData.x = (x + allVoxelMin[0]) * 100;
-				patchData.y = (y + allVoxelMin[1]) * 10;
-				patchData.z = (z + allVoxelMin[2]);
+				int count;
+				uint32 const *pPatches = g_PatchSampleHash.FindVoxel( x + allVoxelMin[0], y + allVoxelMin[1], z + allVoxelMin[2], count );
 
-				UtlHashHandle_t handle = g_PatchSampleHashTable.Find( patchData );
-				if ( handle != g_PatchSampleHashTable.InvalidHandle() )
+				// For all patches that touch this voxel..
+				for ( int ndx = 0; ndx < count; ndx++ )
 				{
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
-
-					// For all patches that touch this hash table element..
-					for ( int ndx = 0; ndx < pPatchData->m_ndxPatches.Count(); ndx++ )
+					int ndxPatch = pPatches[ndx];
+					if ( IsNeighbor( ndxFace, g_Patches[ndxPatch].faceNumber ) )
 					{
-						int ndxPatch = pPatchData->m_ndxPatches.Element( ndx );
-						CPatch *pPatch = &g_Patches.Element( ndxPatch );
-
-						// If we haven't touched the patch already and it's a valid neighbor, then we want to use it.
-						if ( pPatch && pPatch->m_IterationKey != curIterationKey )
-						{
-							pPatch->m_IterationKey = curIterationKey;
-
-							if ( IsNeighbor( ndxFace, pPatch->faceNumber ) )
-							{
-								interestingPatches.AddToTail( pPatch );
-							}
-						}
+						ndxPatches.AddToTail( ndxPatch );
 					}
 				}
 			}
 		}
 	}
+	RemoveDuplicatePatches( ndxPatches );
+
+	for ( int i = 0; i < ndxPatches.Count(); i++ )
+	{
+		interestingPatches.AddToTail( &g_Patches.Element( ndxPatches[i] ) );
+	}
 }
 
 
@@ -1425,63 +1401,7 @@ bool SampleInSolid( sample_t *pSample )
 //-----------------------------------------------------------------------------
 void CVRadDispMgr::InsertSamplesDataIntoHashTable( void )
 {
-	int totalSamples = 0;
-#if 0
-	int totalSamplesInSolid = 0;
-#endif
-
-	for( int ndxFace = 0; ndxFace < numfaces; ndxFace++ )
-	{
-		dface_t *pFace = &g_pFaces[ndxFace];
-		facelight_t *pFaceLight = &facelight[ndxFace];
-		if( !pFace || !pFaceLight )
-			continue;
-
-		if( texinfo[pFace->texinfo].flags & TEX_SPECIAL )
-			continue;
-
-#if 0
-		bool bDisp = ( pFace->dispinfo != -1 );
-#endif
-		//
-		// for each sample
-		//
-		for( int ndxSample = 0; ndxSample < pFaceLight->numsamples; ndxSample++ )
-		{
-			sample_t *pSample = &pFaceLight->sample[ndxSample];
-			if( pSample )
-			{
-#if 0
-				if( bDisp )
-				{
-					// test sample to see if the displacement samples resides in solid
-					if( SampleInSolid( pSample ) )
-					{
-						totalSamplesInSolid++;
-						continue;
-					}
-				}
-#endif
-
-				// create the sample handle
-				SampleHandle_t sampleHandle = ndxSample;
-				sampleHandle |= ( ndxFace << 16 );
-
-				SampleData_AddSample( pSample, sampleHandle );
-			}
-
-		}
-
-		totalSamples += pFaceLight->numsamples;
-	}
-
-#if 0
-	// not implemented yet!!!
-	Msg( "%d samples in solid\n", totalSamplesInSolid );
-#endif
-
-	// log the distribution
-	SampleData_Log();
+	BuildSampleHash();
 }
 
 
@@ -1490,47 +1410,13 @@ void CVRadDispMgr::InsertSamplesDataIntoHashTable( void )
 void CVRadDispMgr::InsertPatchSampleDataIntoHashTable( void )
 {
 	// don't insert patch samples if we are not bouncing light
-	if( numbounce <= 0 )
-		return;
-
-	int totalPatchSamples = 0;
-
-	for( int ndxFace = 0; ndxFace < numfaces; ndxFace++ )
+	if( numbounce > 0 )
 	{
-		dface_t *pFace = &g_pFaces[ndxFace];
-		facelight_t *pFaceLight = &facelight[ndxFace];
-		if( !pFace || !pFaceLight )
-			continue;
-
-		if( texinfo[pFace->texinfo].flags & TEX_SPECIAL )
-			continue;
-
-		//
-		// for each patch
-		//
-		CPatch *pNextPatch = NULL;
-		if( g_FacePatches.Element( ndxFace ) != g_FacePatches.InvalidIndex() )
-		{
-			for( CPatch *pPatch = &g_Patches.Element( g_FacePatches.Element( ndxFace ) ); pPatch; pPatch = pNextPatch )
-			{
-				// next patch
-				pNextPatch = NULL;
-				if( pPatch->ndxNext != g_Patches.InvalidIndex() )
-				{
-					pNextPatch = &g_Patches.Element( pPatch->ndxNext );
-				}
-
-				// skip patches with children
-				if( pPatch->child1 != g_Patches.InvalidIndex() )
-					continue;
-
-				int ndxPatch = pPatch - g_Patches.Base();
-				PatchSampleData_AddSample( pPatch, ndxPatch );
-
-				totalPatchSamples++;
-			}
-		}
+		BuildPatchSampleHash();
 	}
+
+	// log the distribution
+	SampleHash_Log();
 }
 
 
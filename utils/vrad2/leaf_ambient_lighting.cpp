@@ -570,7 +570,7 @@ static void ThreadComputeLeafAmbient( int iThread, void *pUserData )
 	CUtlVector<ambientsample_t> list;
 	while (1)
 	{
-		int leafID = GetThreadWork ();
+		int leafID = GetThreadWork ( iThread );
 		if (leafID == -1)
 			break;
 		list.RemoveAll();
@@ -8,6 +8,7 @@
 
 #include "vrad.h"
 #include "lightmap.h"
+#include "pvscache.h"
 #include "radial.h"
 #include "mathlib/bumpvects.h"
 #include "tier1/utlvector.h"
@@ -1076,7 +1077,6 @@ entity_t *FindTargetEntity (const char *target)
   =============
 */
 
-int GetVisCache( int lastoffset, int cluster, byte *pvs );
 void SetDLightVis( directlight_t *dl, int cluster );
 void MergeDLightVis( directlight_t *dl, int cluster );
 
@@ -1128,10 +1128,14 @@ void SetDLightVis( directlight_t *dl, int cluster )
 {
 	if (dl->pvs == NULL)
 	{
-		dl->pvs = (byte *)calloc( 1, (dvis->numclusters / 8) + 1 );
+		dl->pvs = (byte *)calloc( 1, PVSRowBytes() );
 	}
 
-	GetVisCache( -1, cluster, dl->pvs );
+	byte const *pvs = GetClusterPVS( cluster, dl->pvs );
+	if ( pvs != dl->pvs )
+	{
+		memcpy( dl->pvs, pvs, PVSRowBytes() );
+	}
 }
 
 void MergeDLightVis( directlight_t *dl, int cluster )
@@ -1142,14 +1146,9 @@ void MergeDLightVis( directlight_t *dl, int cluster )
 	}
 	else
 	{
-		byte		pvs[MAX_MAP_CLUSTERS/8];
-		GetVisCache( -1, cluster, pvs );
-
 		// merge both vis graphs
-		for (int i = 0; i < (dvis->numclusters / 8) + 1; i++)
-		{
-			dl->pvs[i] |= pvs[i];
-		}
+		byte		pvs[MAX_MAP_CLUSTERS/8];
+		PVSMerge( dl->pvs, GetClusterPVS( cluster, pvs ) );
 	}
 }
 
@@ -1484,7 +1483,7 @@ void BuildVisForLightEnvironment( void )
 
 	// Second pass to set flags on leaves that don't contain sky, but touch leaves that
 	// contain sky.
-	byte pvs[MAX_MAP_CLUSTERS / 8];
+	byte pvsScratch[MAX_MAP_CLUSTERS / 8];
 
 	int nLeafBytes = (numleafs >> 3) + 1;
 	unsigned char *pLeafBits = (unsigned char *)stackalloc( nLeafBytes * sizeof(unsigned char) );
@@ -1503,7 +1502,7 @@ void BuildVisForLightEnvironment( void )
 			continue;
 
 		// See what other leaves are visible from this leaf
-		GetVisCache( -1, dleafs[iLeaf].cluster, pvs );
+		byte const *pvs = GetClusterPVS( dleafs[iLeaf].cluster, pvsScratch );
 
 		// Now check out all other leaves
 		int nByte = iLeaf >> 3;
@@ -1810,30 +1809,40 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 	}
 
 	fltx4 totalFractionVisible = Four_Zeros;
-	fltx4 fractionVisible = Four_Zeros;
+	fltx4 fractionVisible[RAYPACKET_MAX_GROUPS];
+	FourVectors starts[RAYPACKET_MAX_GROUPS];
+	FourVectors stops[RAYPACKET_MAX_GROUPS];
 
 	DirectionalSampler_t sampler;
 
-	for ( int d = 0; d < nsamples; d++ )
+	// the samples all head the same way, so they're traced as packets
+	for ( int d = 0; d < nsamples; )
 	{
-		// determine visibility of skylight
-		// serach back to see if we can hit a sky brush
-		Vector delta;
-		VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
-		if ( d )
+		int nGroups = min( nsamples - d, RAYPACKET_MAX_GROUPS );
+		for ( int g = 0; g < nGroups; g++, d++ )
 		{
-			// jitter light source location
-			Vector ofs = sampler.NextValue();
-			ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
-			delta += ofs;
+			// determine visibility of skylight
+			// serach back to see if we can hit a sky brush
+			Vector delta;
+			VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
+			if ( d )
+			{
+				// jitter light source location
+				Vector ofs = sampler.NextValue();
+				ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
+				delta += ofs;
+			}
+			starts[g] = pos;
+			stops[g].DuplicateVector ( delta );
+			stops[g] += pos;
 		}
-		FourVectors delta4;
-		delta4.DuplicateVector ( delta );
-		delta4 += pos;
 
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
+		TestLinePacket_DoesHitSky ( starts, stops, nGroups, fractionVisible, true, static_prop_index_to_ignore );
 
-		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+		for ( int g = 0; g < nGroups; g++ )
+		{
+			totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible[g] );
+		}
 	}
 
 	fltx4 seeAmount = MulSIMD ( totalFractionVisible, ReplicateX4 ( 1.0f / nsamples ) );
@@ -1855,6 +1864,23 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 	out.m_flSunAmount = MulSIMD( out.m_flDot[0], out.m_flFalloff );
 }
 
+// traces a batch of ambient sky samples and adds the light that makes it through
+static void TraceAmbientSkyPacket( FourVectors const *pStarts, FourVectors const *pStops,
+								   fltx4 const (*pDots)[NUM_BUMP_VECTS+1], int nSamples, int normalCount,
+								   int static_prop_index_to_ignore, fltx4 *pAmbientIntensity )
+{
+	fltx4 fractionVisible[RAYPACKET_MAX_GROUPS];
+	TestLinePacket_DoesHitSky( pStarts, pStops, nSamples, fractionVisible, true, static_prop_index_to_ignore );
+	for ( int g = 0; g < nSamples; g++ )
+	{
+		for ( int i = 0; i < normalCount; i++ )
+		{
+			fltx4 addedAmount = MulSIMD( fractionVisible[g], pDots[g][i] );
+			pAmbientIntensity[i] = AddSIMD( pAmbientIntensity[i], addedAmount );
+		}
+	}
+}
+
 // Helper function - gathers light from ambient sky light
 void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum,
 							   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
@@ -1868,7 +1894,13 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 	fltx4 sumdot = Four_Zeros;
 	fltx4 ambient_intensity[NUM_BUMP_VECTS+1];
 	fltx4 possibleHitCount[NUM_BUMP_VECTS+1];
-	fltx4 dots[NUM_BUMP_VECTS+1];
+
+	// samples waiting to be traced as a packet. a packet only shares its traversal when all
+	// of its rays point into the same octant, so the samples are binned by octant first
+	int nPending[8] = { 0 };
+	fltx4 pendingDots[8][RAYPACKET_MAX_GROUPS][NUM_BUMP_VECTS+1];
+	FourVectors starts[8][RAYPACKET_MAX_GROUPS];
+	FourVectors stops[8][RAYPACKET_MAX_GROUPS];
 
 	for ( int i = 0; i < normalCount; i++ )
 	{
@@ -1885,8 +1917,13 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 
 	for (int j = 0; j < nsky_samples; j++)
 	{
+		Vector vecSkyDir = sampler.NextValue();
 		FourVectors anorm;
-		anorm.DuplicateVector( sampler.NextValue() );
+		anorm.DuplicateVector( vecSkyDir );
+
+		// the rays go along -anorm
+		int nOctant = ( ( vecSkyDir.x > 0.0f ) ? 1 : 0 ) | ( ( vecSkyDir.y > 0.0f ) ? 2 : 0 ) | ( ( vecSkyDir.z > 0.0f ) ? 4 : 0 );
+		fltx4 *dots = pendingDots[nOctant][nPending[nOctant]];
 
 		if ( bIgnoreNormals )
 			dots[0] = ReplicateX4( CONSTANT_DOT );
@@ -1926,14 +1963,23 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		offset *= -flEpsilon;
 		surfacePos -= offset;
 
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
-		for ( int i = 0; i < normalCount; i++ )
+		starts[nOctant][nPending[nOctant]] = surfacePos;
+		stops[nOctant][nPending[nOctant]] = delta;
+		nPending[nOctant]++;
+
+		if ( nPending[nOctant] == RAYPACKET_MAX_GROUPS )
 		{
-			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
-			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			TraceAmbientSkyPacket( starts[nOctant], stops[nOctant], pendingDots[nOctant], nPending[nOctant], normalCount, static_prop_index_to_ignore, ambient_intensity );
+			nPending[nOctant] = 0;
 		}
+	}
 
+	for ( int nOctant = 0; nOctant < 8; nOctant++ )
+	{
+		if ( nPending[nOctant] )
+		{
+			TraceAmbientSkyPacket( starts[nOctant], stops[nOctant], pendingDots[nOctant], nPending[nOctant], normalCount, static_prop_index_to_ignore, ambient_intensity );
+		}
 	}
 
 	out.m_flFalloff = Four_Ones;
@@ -2424,42 +2470,6 @@ void GetPhongNormal( int facenum, FourVectors const& spot, FourVectors& phongnor
 
 
 
-int GetVisCache( int lastoffset, int cluster, byte *pvs )
-{
-	// get the PVS for the pos to limit the number of checks
-    if ( !visdatasize )
-    {
-        memset (pvs, 255, (dvis->numclusters+7)/8 );
-        lastoffset = -1;
-    }
-    else
-    {
-		if (cluster < 0)
-		{
-			// Error, point embedded in wall
-			// sampled[0][1] = 255;
-			memset (pvs, 255, (dvis->numclusters+7)/8 );
-			lastoffset = -1;
-		}
-		else
-		{
-			int thisoffset = dvis->bitofs[ cluster ][DVIS_PVS];
-			if ( thisoffset != lastoffset )
-			{
-				if ( thisoffset == -1 )
-				{
-					Error ("visofs == -1");
-				}
-
-				DecompressVis (&dvisdata[thisoffset], pvs);
-			}
-			lastoffset = thisoffset;
-		}
-    }
-	return lastoffset;
-}
-
-
 void BuildPatchLights( int facenum );
 
 void DumpSamples( int ndxFace, facelight_t *pFaceLight )
@@ -2793,6 +2803,9 @@ bool PointsInWinding ( FourVectors const & point, winding_t *w, int &invalidBits
 	return true;
 }
 
+// luxels with a larger intensity difference to a neighbor than this get supersampled
+#define SUPERSAMPLE_GRADIENT_THRESHOLD		0.0625f
+
 //-----------------------------------------------------------------------------
 // Perform supersampling at a particular point
 //-----------------------------------------------------------------------------
@@ -3033,7 +3046,7 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 				continue;
 
 			// Don't supersample if the lighting is pretty uniform near the sample
-			if (pGradient[i] < 0.0625)
+			if (pGradient[i] < SUPERSAMPLE_GRADIENT_THRESHOLD)
 				continue;
 
 			// Joy! We're supersampling now, and we therefore must do another pass
@@ -3172,6 +3185,431 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Adaptive supersampling
+//
+// Instead of a fixed 4x4 grid, the direct light of each luxel flagged by the
+// gradient check is sampled in rounds of 4 points until the standard error of
+// the luxel's intensity drops below -supersampleerror. Luxels in flat lighting
+// stop after the minimum number of rounds, penumbrae keep going.
+//
+// BuildFacelights only measures how much error each face has. Once every face
+// is known, SupersampleAllFacelights refines them and splits the optional
+// -supersamplebudget ray budget between faces in proportion to their error.
+//-----------------------------------------------------------------------------
+#define ADAPTIVE_SUPERSAMPLE_MIN_ROUNDS		2
+#define ADAPTIVE_SUPERSAMPLE_MAX_ROUNDS		8
+
+struct AdaptiveSupersampleStats_t
+{
+	int64	m_nLuxels;
+	int64	m_nDirectSamples;
+	int64	m_nDirectRays;
+	int64	m_nAmbientRays;
+};
+
+struct SupersampleCandidate_t
+{
+	float	m_flGradient;
+	int		m_nSample;
+};
+
+// the expected error of each face, or < 0 if the face isn't waiting to be supersampled
+static float g_flFaceSupersampleError[MAX_MAP_FACES];
+static double g_flTotalSupersampleError;
+static AdaptiveSupersampleStats_t g_AdaptiveSupersampleStats;
+
+// what the fixed supersampler really cast and spent with -noadaptive, summed over all threads
+static int64 g_nFixedSupersampleRays;
+static double g_flFixedSupersampleThreadTime;
+
+static bool UseAdaptiveSupersampling()
+{
+	// MPI workers build their faces independently, so there's no global view of the error
+	return g_bAdaptiveSupersample && !g_bUseMPI;
+}
+
+static int CompareSupersampleCandidates( const void *pA, const void *pB )
+{
+	float flA = ( (SupersampleCandidate_t const *)pA )->m_flGradient;
+	float flB = ( (SupersampleCandidate_t const *)pB )->m_flGradient;
+	return ( flA > flB ) ? -1 : ( flA < flB ) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Sums the gradients of all luxels that would be supersampled, over all lightstyles
+//-----------------------------------------------------------------------------
+static float EstimateSupersampleError( SSE_SampleInfo_t& info )
+{
+	facelight_t *fl = info.m_pFaceLight;
+
+	bool* pHasProcessedSample = (bool*)stackalloc( fl->numsamples * sizeof(bool) );
+	memset( pHasProcessedSample, 0, fl->numsamples * sizeof(bool) );
+	float* pGradient = (float*)stackalloc( fl->numsamples * sizeof(float) );
+	float* pSampleIntensity = (float*)stackalloc( info.m_NormalCount * info.m_LightmapSize * sizeof(float) );
+
+	float flError = 0.0f;
+	for ( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		if (info.m_pFace->styles[i] == 255)
+			break;
+
+		ComputeSampleIntensities( info, fl->light[i], pSampleIntensity );
+		ComputeLightmapGradients( info, pHasProcessedSample, pSampleIntensity, pGradient );
+		for ( int j = 0; j < fl->numsamples; ++j )
+		{
+			if ( pGradient[j] >= SUPERSAMPLE_GRADIENT_THRESHOLD )
+				flError += pGradient[j];
+		}
+	}
+	return flError;
+}
+
+//-----------------------------------------------------------------------------
+// Element n of the Halton sequence in the given base. HaltonSequenceGenerator_t
+// can only be stepped through in order, GetElement() ignores its argument.
+//-----------------------------------------------------------------------------
+static float HaltonElement( int nElement, int nBase )
+{
+	float flResult = 0.0f;
+	float flDigitScale = 1.0f / nBase;
+	while ( nElement )
+	{
+		flResult += ( nElement % nBase ) * flDigitScale;
+		flDigitScale /= nBase;
+		nElement /= nBase;
+	}
+	return flResult;
+}
+
+//-----------------------------------------------------------------------------
+// Samples the direct light at 4 points of a luxel, one column of the 4x4 grid the
+// fixed supersampler uses. Columns are visited in 0,2,1,3 order so any number of
+// rounds is spread over the luxel; later rounds shift the grid by a Halton offset.
+// Adds the light of the points inside the sample's winding to pLight, writes their
+// intensities to pIntensity and returns how many there were.
+//-----------------------------------------------------------------------------
+static int SupersampleDirectLightRound( lightinfo_t& l, SSE_SampleInfo_t& info, int sampleIndex,
+										int lightStyleIndex, int nRound, LightingValue_t *pLight, float *pIntensity )
+{
+	static const int s_nRoundColumns[4] = { 0, 2, 1, 3 };
+
+	sample_t& sample = info.m_pFaceLight->sample[sampleIndex];
+
+	Vector2D temp;
+	WorldToLuxelSpace( &l, sample.pos, temp );
+
+	float cscale = 1.0f / 4;
+	float csshift = -( 3 * cscale ) / 2.0f;
+	float flOffsetX = 0.0f;
+	float flOffsetY = 0.0f;
+	int nGridPass = nRound >> 2;
+	if ( nGridPass )
+	{
+		flOffsetX = ( HaltonElement( nGridPass, 2 ) - 0.5f ) * cscale;
+		flOffsetY = ( HaltonElement( nGridPass, 3 ) - 0.5f ) * cscale;
+
+		// every pass has to shift the grid somewhere new or it just resamples the same points
+		Assert( HaltonElement( nGridPass, 2 ) != HaltonElement( nGridPass - 1, 2 ) ||
+				HaltonElement( nGridPass, 3 ) != HaltonElement( nGridPass - 1, 3 ) );
+	}
+
+	float aRow[4];
+	for ( int coord = 0; coord < 4; ++coord )
+		aRow[coord] = csshift + coord * cscale + flOffsetY;
+
+	FourVectors superSampleLightCoord;
+	superSampleLightCoord.DuplicateVector( Vector( temp[0] + csshift + s_nRoundColumns[nRound & 3] * cscale + flOffsetX, temp[1], 0.0f ) );
+	superSampleLightCoord.y = AddSIMD( superSampleLightCoord.y, LoadUnalignedSIMD( aRow ) );
+
+	FourVectors superSamplePosition;
+	LuxelSpaceToWorld( &l, superSampleLightCoord[0], superSampleLightCoord[1], superSamplePosition );
+
+	int invalidBits = 0;
+	if ( sample.w && !PointsInWinding( superSamplePosition, sample.w, invalidBits ) )
+		return 0;
+
+	FourVectors superSampleNormal;
+	superSampleNormal.DuplicateVector( sample.normal );
+	ComputeIlluminationPointAndNormalsSSE( l, superSamplePosition, superSampleNormal, &info, 4 );
+
+	LightingValue_t result[4][NUM_BUMP_VECTS+1];
+	ResampleLightAt4Points( info, lightStyleIndex, NON_AMBIENT_ONLY, result );
+
+	int subsampleCount = 0;
+	for ( int i = 0; i < 4; i++ )
+	{
+		if ( ( invalidBits >> i ) & 0x1 )
+			continue;
+
+		for ( int n = 0; n < info.m_NormalCount; ++n )
+		{
+			pLight[n].AddLight( result[i][n] );
+		}
+
+		// same perceptual space as the gradients
+		pIntensity[subsampleCount++] = pow( result[i][0].Intensity() / 256.0, 1.0 / 2.2 );
+	}
+	return subsampleCount;
+}
+
+//-----------------------------------------------------------------------------
+// Supersamples one luxel until its error is small enough, it runs out of rounds or
+// the face runs out of rays. Returns the number of direct light samples taken, 0
+// if the luxel was left alone.
+//-----------------------------------------------------------------------------
+static int AdaptiveSupersampleLuxel( lightinfo_t& l, SSE_SampleInfo_t& info, int sampleIndex, int lightStyleIndex,
+									 int64 &nRaysLeft, AdaptiveSupersampleStats_t &stats )
+{
+	LightingValue_t pAmbientLight[NUM_BUMP_VECTS+1];
+	LightingValue_t pDirectLight[NUM_BUMP_VECTS+1];
+
+	// The ambient light varies slowly, it gets the same 2x2 samples as in the fixed supersampler
+	uint32 nStartRays = ThreadRaysTraced();
+	int ambientSupersampleCount = SupersampleLightAtPoint( l, info, sampleIndex, lightStyleIndex, pAmbientLight, AMBIENT_ONLY );
+	uint32 nRays = ThreadRaysTraced() - nStartRays;
+	stats.m_nAmbientRays += nRays;
+	nRaysLeft -= nRays;
+
+	// Because of sampling problems, small area triangles may have no samples.
+	// In this case, just use what we already have
+	if ( ambientSupersampleCount == 0 )
+		return 0;
+
+	for ( int n = 0; n < info.m_NormalCount; ++n )
+		pDirectLight[n].Zero();
+
+	// running mean and variance (Welford) of the direct sample intensities
+	int directSupersampleCount = 0;
+	float flMean = 0.0f;
+	float flM2 = 0.0f;
+	float flMaxVariance = g_flSupersampleError * g_flSupersampleError;
+	for ( int nRound = 0; nRound < ADAPTIVE_SUPERSAMPLE_MAX_ROUNDS; ++nRound )
+	{
+		if ( nRound >= ADAPTIVE_SUPERSAMPLE_MIN_ROUNDS )
+		{
+			if ( nRaysLeft <= 0 )
+				break;
+
+			// variance of the mean = sample variance / n
+			if ( ( directSupersampleCount > 1 ) &&
+				 ( flM2 / ( directSupersampleCount - 1 ) < flMaxVariance * directSupersampleCount ) )
+				break;
+		}
+
+		float flIntensity[4];
+		nStartRays = ThreadRaysTraced();
+		int nNewSamples = SupersampleDirectLightRound( l, info, sampleIndex, lightStyleIndex, nRound, pDirectLight, flIntensity );
+		nRays = ThreadRaysTraced() - nStartRays;
+		stats.m_nDirectRays += nRays;
+		nRaysLeft -= nRays;
+
+		for ( int i = 0; i < nNewSamples; ++i )
+		{
+			++directSupersampleCount;
+			float flDelta = flIntensity[i] - flMean;
+			flMean += flDelta / directSupersampleCount;
+			flM2 += flDelta * ( flIntensity[i] - flMean );
+		}
+	}
+
+	stats.m_nDirectSamples += directSupersampleCount;
+	if ( directSupersampleCount == 0 )
+		return 0;
+	stats.m_nLuxels++;
+
+	// Add the ambient + directional terms together, stick it back into the lightmap
+	LightingValue_t **ppLightSamples = info.m_pFaceLight->light[lightStyleIndex];
+	for (int n = 0; n < info.m_NormalCount; ++n)
+	{
+		ppLightSamples[n][sampleIndex].Zero();
+		ppLightSamples[n][sampleIndex].AddWeighted( pDirectLight[n], 1.0f / directSupersampleCount );
+		ppLightSamples[n][sampleIndex].AddWeighted( pAmbientLight[n], 1.0f / ambientSupersampleCount );
+	}
+	return directSupersampleCount;
+}
+
+//-----------------------------------------------------------------------------
+// Adaptive version of BuildSupersampleFaceLights. The gradient check is repeated
+// after each pass like in the fixed version, and the worst luxels of each pass go
+// first so that a tight budget is spent where it matters.
+//-----------------------------------------------------------------------------
+static void BuildAdaptiveSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info, int lightstyleIndex,
+												int64 &nRaysLeft, AdaptiveSupersampleStats_t &stats )
+{
+	int numsamples = info.m_pFaceLight->numsamples;
+
+	bool* pHasProcessedSample = (bool*)stackalloc( numsamples * sizeof(bool) );
+	memset( pHasProcessedSample, 0, numsamples * sizeof(bool) );
+	float* pGradient = (float*)stackalloc( numsamples * sizeof(float) );
+	float* pSampleIntensity = (float*)stackalloc( info.m_NormalCount * info.m_LightmapSize * sizeof(float) );
+	SupersampleCandidate_t *pCandidates = (SupersampleCandidate_t*)stackalloc( numsamples * sizeof(SupersampleCandidate_t) );
+
+	LightingValue_t **ppLightSamples = info.m_pFaceLight->light[lightstyleIndex];
+	ComputeSampleIntensities( info, ppLightSamples, pSampleIntensity );
+
+	Vector *pVisualizePass = NULL;
+	if (debug_extra)
+	{
+		pVisualizePass = (Vector*)stackalloc( numsamples * sizeof(Vector) );
+		memset( pVisualizePass, 0, numsamples * sizeof(Vector) );
+	}
+
+	for ( int pass = 1; pass <= extrapasses; ++pass )
+	{
+		ComputeLightmapGradients( info, pHasProcessedSample, pSampleIntensity, pGradient );
+
+		int nCandidates = 0;
+		for ( int i = 0; i < numsamples; ++i )
+		{
+			if ( !pHasProcessedSample[i] && ( pGradient[i] >= SUPERSAMPLE_GRADIENT_THRESHOLD ) )
+			{
+				pCandidates[nCandidates].m_flGradient = pGradient[i];
+				pCandidates[nCandidates].m_nSample = i;
+				++nCandidates;
+			}
+		}
+		if ( !nCandidates )
+			break;
+
+		qsort( pCandidates, nCandidates, sizeof(SupersampleCandidate_t), CompareSupersampleCandidates );
+
+		for ( int c = 0; c < nCandidates; ++c )
+		{
+			int i = pCandidates[c].m_nSample;
+			pHasProcessedSample[i] = true;
+
+			int directSupersampleCount = AdaptiveSupersampleLuxel( l, info, i, lightstyleIndex, nRaysLeft, stats );
+			if ( directSupersampleCount )
+			{
+				// Recompute the luxel intensity based on the supersampling
+				ComputeLuxelIntensity( info, i, ppLightSamples, pSampleIntensity );
+			}
+
+			if (debug_extra)
+			{
+				// red: how many rounds the luxel took, green/blue: which pass it was updated on
+				int nRounds = ( directSupersampleCount + 3 ) / 4;
+				pVisualizePass[i][0] = 255.0f * nRounds / ADAPTIVE_SUPERSAMPLE_MAX_ROUNDS;
+				pVisualizePass[i][1] = (pass & 1) * 255;
+				pVisualizePass[i][2] = (pass & 2) * 128;
+			}
+		}
+	}
+
+	if (debug_extra)
+	{
+		for (int i = 0; i < numsamples; ++i)
+		{
+			for (int j = 0; j < info.m_NormalCount; ++j)
+			{
+				VectorCopy( pVisualizePass[i], ppLightSamples[j][i].m_vecLighting );
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Second half of BuildFacelights for faces that are supersampled adaptively
+//-----------------------------------------------------------------------------
+static void SupersampleFacelights( int iThread, int facenum )
+{
+	if ( g_flFaceSupersampleError[facenum] < 0.0f )
+		return;
+
+	facelight_t *fl = &facelight[facenum];
+
+	if ( g_flFaceSupersampleError[facenum] > 0.0f )
+	{
+		lightinfo_t l;
+		SSE_SampleInfo_t sampleInfo;
+		InitLightinfo( &l, facenum );
+		InitSampleInfo( l, iThread, sampleInfo );
+
+		int64 nRaysLeft = 0x7fffffffffffffffLL;
+		if ( ( g_flSupersampleBudget > 0.0f ) && ( g_flTotalSupersampleError > 0.0 ) )
+		{
+			nRaysLeft = (int64)( g_flSupersampleBudget * 1.0e6 * g_flFaceSupersampleError[facenum] / g_flTotalSupersampleError );
+		}
+
+		AdaptiveSupersampleStats_t stats;
+		memset( &stats, 0, sizeof( stats ) );
+		for ( int i = 0; i < MAXLIGHTMAPS; ++i )
+		{
+			// Stop when we run out of lightstyles
+			if (sampleInfo.m_pFace->styles[i] == 255)
+				break;
+
+			BuildAdaptiveSupersampleFaceLights( l, sampleInfo, i, nRaysLeft, stats );
+		}
+
+		ThreadLock();
+		g_AdaptiveSupersampleStats.m_nLuxels += stats.m_nLuxels;
+		g_AdaptiveSupersampleStats.m_nDirectSamples += stats.m_nDirectSamples;
+		g_AdaptiveSupersampleStats.m_nDirectRays += stats.m_nDirectRays;
+		g_AdaptiveSupersampleStats.m_nAmbientRays += stats.m_nAmbientRays;
+		ThreadUnlock();
+	}
+
+	// the rest of BuildFacelights. Adaptive supersampling is never used with MPI, so the patch
+	// lights are always built here.
+	BuildPatchLights( facenum );
+
+	if( g_bDumpPatches )
+	{
+		DumpSamples( facenum, fl );
+	}
+	else
+	{
+		FreeSampleWindings( fl );
+	}
+}
+
+static float FaceSupersampleCost( int iFace )
+{
+	return g_flFaceSupersampleError[iFace];
+}
+
+void SupersampleAllFacelights()
+{
+	if ( !do_extra )
+		return;
+
+	if ( !UseAdaptiveSupersampling() )
+	{
+		// the fixed passes already ran in BuildFacelights. Report what they measured, so a
+		// -noadaptive run can be compared with the adaptive estimate below
+		Msg( "Fixed supersampling: %.2f Mrays in %.1f thread seconds (measured)\n",
+			 g_nFixedSupersampleRays / 1.0e6, g_flFixedSupersampleThreadTime );
+		return;
+	}
+
+	g_flTotalSupersampleError = 0.0;
+	for ( int i = 0; i < numfaces; ++i )
+	{
+		if ( g_flFaceSupersampleError[i] > 0.0f )
+			g_flTotalSupersampleError += g_flFaceSupersampleError[i];
+	}
+	memset( &g_AdaptiveSupersampleStats, 0, sizeof( g_AdaptiveSupersampleStats ) );
+
+	double flStartTime = Plat_FloatTime();
+	RunThreadsOnIndividualSorted( numfaces, true, SupersampleFacelights, FaceSupersampleCost );
+	double flTime = Plat_FloatTime() - flStartTime;
+
+	// The fixed supersampler takes 16 direct samples per luxel. This only extrapolates what it
+	// would have cost from the rays our direct samples took, assuming the same luxels and the
+	// same rays per sample; it isn't measured. Run with -noadaptive for the real figures.
+	AdaptiveSupersampleStats_t const &stats = g_AdaptiveSupersampleStats;
+	int64 nRays = stats.m_nAmbientRays + stats.m_nDirectRays;
+	double flRaysPerDirectSample = stats.m_nDirectSamples ? (double)stats.m_nDirectRays / stats.m_nDirectSamples : 0.0;
+	double flFixedRays = stats.m_nAmbientRays + flRaysPerDirectSample * 16 * stats.m_nLuxels;
+	Msg( "Adaptive supersampling: %lld luxels, %.1f direct samples/luxel (fixed: 16)\n",
+		 stats.m_nLuxels, stats.m_nLuxels ? (float)stats.m_nDirectSamples / stats.m_nLuxels : 0.0f );
+	Msg( "  %.2f Mrays in %.1f seconds (measured)\n", nRays / 1.0e6, flTime );
+	Msg( "  fixed 16 sample supersampling, estimated: %.2f Mrays in %.1f seconds (not measured, compare with -noadaptive)\n",
+		 flFixedRays / 1.0e6, nRays ? flTime * flFixedRays / nRays : flTime );
+}
+
 void BuildFacelights (int iThread, int facenum)
 {
 	lightinfo_t	l;
@@ -3181,6 +3619,8 @@ void BuildFacelights (int iThread, int facenum)
 	directlight_t *dl;
 	Vector v[4], n[4];
 
+	g_flFaceSupersampleError[facenum] = -1.0f;
+
 	if( g_bInterrupt )
 		return;
 
@@ -3274,8 +3714,19 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
+	if (do_extra && !sampleInfo.m_IsDispFace && UseAdaptiveSupersampling())
+	{
+		// Supersampled by SupersampleAllFacelights once all faces know their error, which also
+		// finishes up the face
+		g_flFaceSupersampleError[facenum] = EstimateSupersampleError( sampleInfo );
+		return;
+	}
+
 	if (do_extra && !sampleInfo.m_IsDispFace)
 	{
+		uint32 nStartRays = ThreadRaysTraced();
+		double flStartTime = Plat_FloatTime();
+
 		// For each lightstyle, perform a supersampling pass
 		for ( int i = 0; i < MAXLIGHTMAPS; ++i )
 		{
@@ -3285,6 +3736,13 @@ void BuildFacelights (int iThread, int facenum)
 
 			BuildSupersampleFaceLights( l, sampleInfo, i );
 		}
+
+		uint32 nRays = ThreadRaysTraced() - nStartRays;
+		double flTime = Plat_FloatTime() - flStartTime;
+		ThreadLock();
+		g_nFixedSupersampleRays += nRays;
+		g_flFixedSupersampleThreadTime += flTime;
+		ThreadUnlock();
 	}
 
 	if (!g_bUseMPI)
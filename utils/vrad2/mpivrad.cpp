@@ -294,7 +294,8 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		patch->numtransfers = numtransfers;
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
+			// Allocated the same way as in MakeScales, CTransferMatrix::PackRow free()s these.
+			patch->transfers = ( transfer_t* )malloc( numtransfers * sizeof(transfer_t) );
 			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
 		}
 		
@@ -0,0 +1,144 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Decompressed PVS rows, shared by all threads.
+//
+// The direct lighting and vis matrix passes ask for the same few cluster rows
+// over and over from every thread. Rows are decompressed once, on first use,
+// and published into a table indexed by cluster with a compare and swap, so
+// lookups never take a lock. If two threads race for a row the loser just
+// throws its copy away.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "pvscache.h"
+#include "tier0/threadtools.h"
+
+
+// Rows take numclusters^2 / 8 bytes in total, which is tiny for normal maps
+// but can get big near MAX_MAP_CLUSTERS. Past this, rows are no longer kept.
+int g_nPVSCacheBudgetMB = 256;
+
+static byte * volatile	*s_pPVSRows = NULL;
+static byte				*s_pAllVisibleRow = NULL;
+static int				s_nPVSRowBytes = 0;
+static int				s_nPVSClusters = 0;
+
+static CInterlockedInt	s_nPVSLookups;
+static CInterlockedInt	s_nPVSDecompressed;
+static CInterlockedInt	s_nPVSRowsCached;
+
+
+int PVSRowBytes()
+{
+	Assert( s_nPVSRowBytes );
+	return s_nPVSRowBytes;
+}
+
+void InitPVSCache()
+{
+	FreePVSCache();
+
+	s_nPVSClusters = dvis->numclusters;
+	s_nPVSRowBytes = max( ( ( s_nPVSClusters + 127 ) >> 7 ) << 4, 16 );
+
+	s_pPVSRows = (byte * volatile *)calloc( max( s_nPVSClusters, 1 ), sizeof( byte * ) );
+
+	// only the bits of real clusters are set, so it can be scanned like any other row
+	s_pAllVisibleRow = (byte *)calloc( 1, s_nPVSRowBytes );
+	memset( s_pAllVisibleRow, 255, s_nPVSClusters >> 3 );
+	for ( int i = s_nPVSClusters & ~7; i < s_nPVSClusters; i++ )
+	{
+		s_pAllVisibleRow[i >> 3] |= 1 << ( i & 7 );
+	}
+
+	s_nPVSLookups = 0;
+	s_nPVSDecompressed = 0;
+	s_nPVSRowsCached = 0;
+}
+
+void FreePVSCache()
+{
+	if ( s_pPVSRows )
+	{
+		for ( int i = 0; i < s_nPVSClusters; i++ )
+		{
+			free( s_pPVSRows[i] );
+		}
+		free( (void *)s_pPVSRows );
+		s_pPVSRows = NULL;
+	}
+	free( s_pAllVisibleRow );
+	s_pAllVisibleRow = NULL;
+	s_nPVSClusters = 0;
+}
+
+void PrintPVSCacheStats()
+{
+	int nLookups = s_nPVSLookups;
+	int nDecompressed = s_nPVSDecompressed;
+	Msg( "PVS cache: %d lookups, %.1f%% hits, %d rows cached (%.1f KB), %.1f KB decompressed\n",
+		 nLookups,
+		 nLookups ? 100.0f * ( nLookups - nDecompressed ) / nLookups : 0.0f,
+		 (int)s_nPVSRowsCached,
+		 s_nPVSRowsCached * s_nPVSRowBytes / 1024.0f,
+		 nDecompressed * (float)s_nPVSRowBytes / 1024.0f );
+}
+
+static void DecompressClusterPVS( int cluster, byte *pRow )
+{
+	int nOffset = dvis->bitofs[cluster][DVIS_PVS];
+	if ( nOffset == -1 )
+	{
+		Error( "visofs == -1" );
+	}
+
+	DecompressVis( &dvisdata[nOffset], pRow );
+	++s_nPVSDecompressed;
+}
+
+byte const *GetClusterPVS( int cluster, byte *pScratch )
+{
+	Assert( s_pPVSRows );
+
+	// point embedded in a wall, or no vis at all
+	if ( cluster < 0 || !visdatasize )
+		return s_pAllVisibleRow;
+
+	++s_nPVSLookups;
+
+	byte *pRow = s_pPVSRows[cluster];
+	if ( pRow )
+		return pRow;
+
+	if ( (int64)( s_nPVSRowsCached + 1 ) * s_nPVSRowBytes > (int64)g_nPVSCacheBudgetMB * 1024 * 1024 )
+	{
+		// DecompressVis only writes the real clusters' bytes, clear the padding
+		// so the row scans and merges read the same thing as for cached rows
+		int nVisBytes = ( s_nPVSClusters + 7 ) >> 3;
+		memset( pScratch + nVisBytes, 0, s_nPVSRowBytes - nVisBytes );
+		DecompressClusterPVS( cluster, pScratch );
+		return pScratch;
+	}
+
+	pRow = (byte *)calloc( 1, s_nPVSRowBytes );
+	DecompressClusterPVS( cluster, pRow );
+	if ( !ThreadInterlockedAssignPointerIf( (void * volatile *)&s_pPVSRows[cluster], pRow, NULL ) )
+	{
+		free( pRow );
+		return s_pPVSRows[cluster];
+	}
+
+	++s_nPVSRowsCached;
+	return pRow;
+}
+
+void PVSMerge( byte *pDest, byte const *pSrc )
+{
+	for ( int i = 0; i < s_nPVSRowBytes; i += 16 )
+	{
+		fltx4 dest = LoadUnalignedSIMD( pDest + i );
+		StoreUnalignedSIMD( (float *)( pDest + i ), OrSIMD( dest, LoadUnalignedSIMD( pSrc + i ) ) );
+	}
+}
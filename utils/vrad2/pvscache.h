@@ -0,0 +1,85 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Decompressed PVS rows, shared by all threads.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef PVSCACHE_H
+#define PVSCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/ssemath.h"
+#include <intrin.h>
+
+
+extern int g_nPVSCacheBudgetMB;
+
+// Call once the bsp is loaded and dvis->numclusters is known.
+void InitPVSCache();
+void FreePVSCache();
+void PrintPVSCacheStats();
+
+// Bytes in a decompressed row, padded to a multiple of 16. Any buffer handed
+// to the functions below must be at least this big.
+int PVSRowBytes();
+
+// Returns the PVS of a cluster (everything for cluster -1 or maps without
+// vis). Rows are decompressed the first time they're asked for and kept for
+// everyone; once the cache is over budget the row is decompressed into
+// pScratch instead, which is what's returned.
+byte const *GetClusterPVS( int cluster, byte *pScratch );
+
+// pDest |= pSrc
+void PVSMerge( byte *pDest, byte const *pSrc );
+
+
+//-----------------------------------------------------------------------------
+// Returns the first cluster >= iCluster in the pvs, or dvis->numclusters if
+// there are no more. Skips empty 16 byte blocks at a time:
+//
+//	for ( int i = NextVisibleCluster( pvs, 0 ); i < dvis->numclusters; i = NextVisibleCluster( pvs, i + 1 ) )
+//-----------------------------------------------------------------------------
+FORCEINLINE bool PVSBlockIsEmpty( byte const *pBlock )
+{
+	__m128i block = _mm_loadu_si128( (__m128i const *)pBlock );
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( block, _mm_setzero_si128() ) ) == 0xffff;
+}
+
+inline int NextVisibleCluster( byte const *pvs, int iCluster )
+{
+	int nClusters = dvis->numclusters;
+	int nWords = ( nClusters + 31 ) >> 5;
+	int iWord = iCluster >> 5;
+	if ( iWord >= nWords )
+		return nClusters;
+
+	uint32 const *pWords = (uint32 const *)pvs;
+	uint32 nBits = pWords[iWord] & ( 0xffffffffu << ( iCluster & 31 ) );
+	for (;;)
+	{
+		if ( nBits )
+		{
+			unsigned long iBit;
+			_BitScanForward( &iBit, nBits );
+			return min( ( iWord << 5 ) + (int)iBit, nClusters );
+		}
+
+		if ( ++iWord >= nWords )
+			return nClusters;
+
+		// rows are padded to 16 bytes, so whole blocks can always be read
+		while ( !( iWord & 3 ) && PVSBlockIsEmpty( pvs + iWord * 4 ) )
+		{
+			iWord += 4;
+			if ( iWord >= nWords )
+				return nClusters;
+		}
+		nBits = pWords[iWord];
+	}
+}
+
+
+#endif // PVSCACHE_H
@@ -10,9 +10,11 @@
 #include "lightmap.h"
 #include "radial.h"
 #include "mathlib/bumpvects.h"
-#include "utlrbtree.h"
+#include "tier1/utlbuffer.h"
 #include "mathlib/VMatrix.h"
 #include "macro_texture.h"
+#include "tier0/threadtools.h"
+#include <algorithm>
 
 
 void WorldToLuxelSpace( lightinfo_t const *l, Vector const &world, Vector2D &coord )
@@ -256,11 +258,113 @@ void PatchLightmapCoordRange( radial_t *rad, int ndxPatch, Vector2D &mins, Vecto
 	}
 }
 
+//-----------------------------------------------------------------------------
+// FinalLightFace scratch memory. A radial_t is over a megabyte, so rather than
+// calloc'ing one per face and style, every thread keeps the radials and median
+// buffers it has used so far and hands them out again for the next face. Only
+// the part of a pooled radial that the face covers gets cleared.
+//-----------------------------------------------------------------------------
+struct FinalLightStats_t
+{
+	int64	m_nFaces;
+	int64	m_nRadials;				// radials built
+	int64	m_nRadialAllocs;		// of those, the ones that needed new memory
+	int64	m_nBufferAllocs;		// median buffer growths
+	double	m_flRadialTime;
+	double	m_flSampleTime;
+	double	m_flMedianTime;
+
+	FinalLightStats_t()
+	{
+		memset( this, 0, sizeof( *this ) );
+	}
+
+	void operator+=( FinalLightStats_t const &src )
+	{
+		m_nFaces += src.m_nFaces;
+		m_nRadials += src.m_nRadials;
+		m_nRadialAllocs += src.m_nRadialAllocs;
+		m_nBufferAllocs += src.m_nBufferAllocs;
+		m_flRadialTime += src.m_flRadialTime;
+		m_flSampleTime += src.m_flSampleTime;
+		m_flMedianTime += src.m_flMedianTime;
+	}
+};
+
+struct FinalLightArena_t
+{
+	CUtlVector<radial_t *>	m_Radials;
+	int						m_nRadialsUsed;
+	CUtlVector<float>		m_Median[3];
+	CUtlBuffer				m_DispLuxels[NUM_BUMP_VECTS + 1];	// -dump output for displacements
+	FinalLightStats_t		m_Stats;
+
+	FinalLightArena_t() : m_nRadialsUsed( 0 )
+	{
+		for ( int i = 0; i < NUM_BUMP_VECTS + 1; i++ )
+		{
+			m_DispLuxels[i].SetBufferType( true, false );
+		}
+	}
+
+	~FinalLightArena_t()
+	{
+		for ( int i = 0; i < m_Radials.Count(); i++ )
+		{
+			free( m_Radials[i] );
+		}
+	}
+
+	// everything handed out so far is free again
+	void Reset()
+	{
+		m_nRadialsUsed = 0;
+	}
+
+	radial_t *AllocRadial()
+	{
+		if ( m_nRadialsUsed == m_Radials.Count() )
+		{
+			radial_t *rad = ( radial_t * )malloc( sizeof( radial_t ) );
+			rad->pooled = true;
+			m_Radials.AddToTail( rad );
+			m_Stats.m_nRadialAllocs++;
+		}
+		m_Stats.m_nRadials++;
+		return m_Radials[m_nRadialsUsed++];
+	}
+
+	void EnsureMedianCapacity( int nCount )
+	{
+		if ( m_Median[0].NumAllocated() >= nCount )
+			return;
+		for ( int i = 0; i < 3; i++ )
+		{
+			m_Median[i].EnsureCapacity( nCount );
+		}
+		m_Stats.m_nBufferAllocs++;
+	}
+};
+
+static FinalLightArena_t *s_pFinalLightArenas[MAX_TOOL_THREADS + 1];
+
+// the calling thread's arena while it is inside FinalLightFace, NULL everywhere else
+static CTHREADLOCALPTR( FinalLightArena_t ) s_pThreadFinalLightArena;
+
+
 radial_t *AllocateRadial( int facenum )
 {
 	radial_t *rad;
 
-	rad = ( radial_t* )calloc( 1, sizeof( *rad ) );
+	FinalLightArena_t *pArena = s_pThreadFinalLightArena;
+	if ( pArena )
+	{
+		rad = pArena->AllocRadial();
+	}
+	else
+	{
+		rad = ( radial_t* )calloc( 1, sizeof( *rad ) );
+	}
 
 	rad->facenum = facenum;
 	InitLightinfo( &rad->l, facenum );
@@ -268,12 +372,24 @@ radial_t *AllocateRadial( int facenum )
 	rad->w = rad->l.face->m_LightmapTextureSizeInLuxels[0]+1;
 	rad->h = rad->l.face->m_LightmapTextureSizeInLuxels[1]+1;
 
+	if ( rad->pooled )
+	{
+		// SampleRadial's bounds check lets u == w and v == h through, so clear one
+		// luxel past the end of each row and one row past the last
+		int nClear = min( ( rad->w + 1 ) * ( rad->h + 1 ), SINGLEMAP );
+		memset( rad->weight, 0, nClear * sizeof( rad->weight[0] ) );
+		for ( int bumpSample = 0; bumpSample < NUM_BUMP_VECTS + 1; bumpSample++ )
+		{
+			memset( rad->light[bumpSample], 0, nClear * sizeof( rad->light[bumpSample][0] ) );
+		}
+	}
+
 	return rad;
 }
 
 void FreeRadial( radial_t *rad )
 {
-	if (rad)
+	if (rad && !rad->pooled)
 		free( rad );
 }
 
@@ -594,39 +710,50 @@ void DumpLuxels( facelight_t *pFaceLight, Vector *luxelColors, int ndxFace )
 #endif
 
 
-static FileHandle_t pFileLuxels[4] = { NULL, NULL, NULL, NULL };
-
-void DumpDispLuxels( int iFace, Vector &color, int iLuxel, int nBump )
+// Each thread collects its luxel windings in its arena, CloseDispLuxels writes them out once
+// all the faces are done.
+static void DumpDispLuxels( FinalLightArena_t &arena, int iFace, Vector &color, int iLuxel, int nBump )
 {
-	// Lock the thread and dump the luxel data.
-	ThreadLock();
-
 	// Get the face and facelight data.
 	facelight_t *pFaceLight = &facelight[iFace];
+	winding_t *w = pFaceLight->sample[iLuxel].w;
 
-	// Open the luxel files.
-	char szFileName[512];
-	for ( int iBump = 0; iBump < ( NUM_BUMP_VECTS+1 ); ++iBump )
+	// Same format as WriteWinding
+	CUtlBuffer &buf = arena.m_DispLuxels[nBump];
+	buf.Printf( "%i\n", w->numpoints );
+	for ( int i = 0; i < w->numpoints; i++ )
 	{
-		if ( pFileLuxels[iBump] == NULL )
-		{
-			sprintf( szFileName, "luxels_bump%d.txt", iBump );
-			pFileLuxels[iBump] = g_pFileSystem->Open( szFileName, "w" );
-		}
+		buf.Printf( "%5.2f %5.2f %5.2f %5.3f %5.3f %5.3f\n",
+			w->p[i][0], w->p[i][1], w->p[i][2],
+			color[0] / 256, color[1] / 256, color[2] / 256 );
 	}
-
-	WriteWinding( pFileLuxels[nBump], pFaceLight->sample[iLuxel].w, color );
-
-	ThreadUnlock();
 }
 
-void CloseDispLuxels()
+static void CloseDispLuxels()
 {
+	char szFileName[512];
 	for ( int iBump = 0; iBump < ( NUM_BUMP_VECTS+1 ); ++iBump )
 	{
-		if ( pFileLuxels[iBump] )
+		FileHandle_t fp = NULL;
+		for ( int iThread = 0; iThread < MAX_TOOL_THREADS + 1; iThread++ )
+		{
+			FinalLightArena_t *pArena = s_pFinalLightArenas[iThread];
+			if ( !pArena || !pArena->m_DispLuxels[iBump].TellPut() )
+				continue;
+
+			if ( !fp )
+			{
+				sprintf( szFileName, "luxels_bump%d.txt", iBump );
+				fp = g_pFileSystem->Open( szFileName, "w" );
+				if ( !fp )
+					break;
+			}
+			g_pFileSystem->Write( pArena->m_DispLuxels[iBump].Base(), pArena->m_DispLuxels[iBump].TellPut(), fp );
+		}
+
+		if ( fp )
 		{
-			g_pFileSystem->Close( pFileLuxels[iBump] );
+			g_pFileSystem->Close( fp );
 		}
 	}
 }
@@ -639,7 +766,7 @@ Add the indirect lighting on top of the direct
 lighting and save into final map format
 =============
 */
-void FinalLightFace( int iThread, int facenum )
+static void FinalLightFace( FinalLightArena_t &arena, int facenum )
 {
 	dface_t	        *f;
 	int		        i, j, k;
@@ -669,6 +796,7 @@ void FinalLightFace( int iThread, int facenum )
 	if ( !lightstyles )
 		return;
 
+	arena.m_Stats.m_nFaces++;
 
 	//
 	// sample the triangulation
@@ -688,14 +816,15 @@ void FinalLightFace( int iThread, int facenum )
 #endif
 
 
-	// NOTE: I'm using these RB trees to sort all the illumination values
-	// to compute median colors. Turns out that this is a somewhat better
-	// method that using the average; usually if there are surfaces
-	// with a large light intensity variation, the extremely bright regions
-	// have a very small area and tend to influence the average too much.
-	CUtlRBTree< float, int >	m_Red( 0, 256, FloatLess );
-	CUtlRBTree< float, int >	m_Green( 0, 256, FloatLess );
-	CUtlRBTree< float, int >	m_Blue( 0, 256, FloatLess );
+	// NOTE: I'm collecting all the illumination values to compute median
+	// colors. Turns out that this is a somewhat better method that using
+	// the average; usually if there are surfaces with a large light
+	// intensity variation, the extremely bright regions have a very small
+	// area and tend to influence the average too much.
+	arena.EnsureMedianCapacity( fl->numluxels );
+	CUtlVector<float> &m_Red = arena.m_Median[0];
+	CUtlVector<float> &m_Green = arena.m_Median[1];
+	CUtlVector<float> &m_Blue = arena.m_Median[2];
 
 	for (k=0 ; k < lightstyles; k++ )
 	{
@@ -703,6 +832,8 @@ void FinalLightFace( int iThread, int facenum )
 		m_Green.RemoveAll();
 		m_Blue.RemoveAll();
 
+		double flStartTime = Plat_FloatTime();
+
 		if (!do_fast)
 		{
 			if( !bDisp )
@@ -728,12 +859,17 @@ void FinalLightFace( int iThread, int facenum )
 			}
 		}
 
+		double flRadialTime = Plat_FloatTime();
+		arena.m_Stats.m_flRadialTime += flRadialTime - flStartTime;
+
 		// pack the nonbump texture and the three bump texture for the given
 		// lightstyle right next to each other.
 		// NOTE: Even though it's building positions for all bump-mapped data,
 		// it isn't going to use those positions (see loop over bumpSample below)
 		// The file offset is correctly computed to only store space for 1 set
 		// of light data if we don't have bumped lighting.
+		// PrecompLightmapOffsets gave every face its own range of pdlightdata,
+		// so the threads write their luxels straight out without any locking.
 		for( bumpSample = 0; bumpSample < bumpSampleCount; ++bumpSample )
 		{
 			pdata[bumpSample] = &(*pdlightdata)[f->lightofs + (k * bumpSampleCount + bumpSample) * fl->numluxels*4];
@@ -790,7 +926,7 @@ void FinalLightFace( int iThread, int facenum )
 			{
 				for( bumpSample = 0; bumpSample < bumpSampleCount; ++bumpSample )
 				{
-					DumpDispLuxels( facenum, lb[bumpSample].m_vecLighting, j, bumpSample );
+					DumpDispLuxels( arena, facenum, lb[bumpSample].m_vecLighting, j, bumpSample );
 				}
 			}
 
@@ -826,9 +962,9 @@ void FinalLightFace( int iThread, int facenum )
 					ApplyMacroTextures( facenum, fl->luxel[j], lb[0].m_vecLighting );
 
 					// For median computation
-					m_Red.Insert( lb[bumpSample].m_vecLighting[0] );
-					m_Green.Insert( lb[bumpSample].m_vecLighting[1] );
-					m_Blue.Insert( lb[bumpSample].m_vecLighting[2] );
+					m_Red.AddToTail( lb[bumpSample].m_vecLighting[0] );
+					m_Green.AddToTail( lb[bumpSample].m_vecLighting[1] );
+					m_Blue.AddToTail( lb[bumpSample].m_vecLighting[2] );
 				}
 
 #ifdef RANDOM_COLOR
@@ -852,6 +988,9 @@ void FinalLightFace( int iThread, int facenum )
 			prad = NULL;
 		}
 
+		double flSampleTime = Plat_FloatTime();
+		arena.m_Stats.m_flSampleTime += flSampleTime - flRadialTime;
+
 		// Compute the median color for this lightstyle
 		// Remember, the data goes *before* the specified light_ofs, in *reverse order*
 		ColorRGBExp32 *pAvgColor = dface_AvgLightColor( f, k );
@@ -862,21 +1001,113 @@ void FinalLightFace( int iThread, int facenum )
 		}
 		else
 		{
-			unsigned int r, g, b;
-			r = m_Red.FirstInorder();
-			g = m_Green.FirstInorder();
-			b = m_Blue.FirstInorder();
-			avgCount >>= 1;
-			while (avgCount > 0)
-			{
-				r = m_Red.NextInorder(r);
-				g = m_Green.NextInorder(g);
-				b = m_Blue.NextInorder(b);
-				--avgCount;
-			}
-
-			Vector median( m_Red[r], m_Green[g], m_Blue[b] );
+			// each channel's median on its own, like walking a sorted list
+			// of each to the middle
+			int nMiddle = avgCount >> 1;
+			std::nth_element( m_Red.Base(), m_Red.Base() + nMiddle, m_Red.Base() + avgCount );
+			std::nth_element( m_Green.Base(), m_Green.Base() + nMiddle, m_Green.Base() + avgCount );
+			std::nth_element( m_Blue.Base(), m_Blue.Base() + nMiddle, m_Blue.Base() + avgCount );
+
+			Vector median( m_Red[nMiddle], m_Green[nMiddle], m_Blue[nMiddle] );
 			VectorToColorRGBExp32( median, *pAvgColor );
 		}
+
+		arena.m_Stats.m_flMedianTime += Plat_FloatTime() - flSampleTime;
+	}
+}
+
+void FinalLightFace( int iThread, int facenum )
+{
+	FinalLightArena_t *&pArena = s_pFinalLightArenas[iThread];
+	if ( !pArena )
+	{
+		pArena = new FinalLightArena_t;
+	}
+
+	pArena->Reset();
+	s_pThreadFinalLightArena = pArena;
+	FinalLightFace( *pArena, facenum );
+	s_pThreadFinalLightArena = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Small faces are lit several to a work item: the cost of handing out an item
+// and the per-face setup would otherwise dominate, and neighbouring faces share
+// their neighbours' facelights, which stay in cache.
+//-----------------------------------------------------------------------------
+#define FINALLIGHT_BATCH_LUXELS		1024
+
+static CUtlVector<int> s_FinalLightBatches;		// first face of each batch, numfaces at the end
+static CUtlVector<float> s_FinalLightBatchCost;
+
+static float FinalLightBatchCost( int iBatch )
+{
+	return s_FinalLightBatchCost[iBatch];
+}
+
+static void FinalLightFaceBatch( int iThread, int iBatch )
+{
+	for ( int facenum = s_FinalLightBatches[iBatch]; facenum < s_FinalLightBatches[iBatch + 1]; facenum++ )
+	{
+		FinalLightFace( iThread, facenum );
+	}
+}
+
+void FinalLightAllFaces()
+{
+	double flStartTime = Plat_FloatTime();
+
+	// Split the faces into runs of about FINALLIGHT_BATCH_LUXELS luxels, bigger faces get
+	// a work item each. Without batching every face is its own item.
+	int nBatchLuxels = g_bFinalLightBatch ? FINALLIGHT_BATCH_LUXELS : 0;
+	s_FinalLightBatches.RemoveAll();
+	s_FinalLightBatchCost.RemoveAll();
+	float flBatchCost = 0;
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		float flCost = ( f->m_LightmapTextureSizeInLuxels[0] + 1 ) * ( f->m_LightmapTextureSizeInLuxels[1] + 1 );
+		if ( !s_FinalLightBatches.Count() || flBatchCost + flCost > nBatchLuxels )
+		{
+			s_FinalLightBatches.AddToTail( i );
+			s_FinalLightBatchCost.AddToTail( 0 );
+			flBatchCost = 0;
+		}
+		flBatchCost += flCost;
+		s_FinalLightBatchCost.Tail() = flBatchCost;
+	}
+	int nBatches = s_FinalLightBatchCost.Count();
+	s_FinalLightBatches.AddToTail( numfaces );
+
+	RunThreadsOnIndividualSorted( nBatches, true, FinalLightFaceBatch, FinalLightBatchCost );
+
+	if ( g_bDumpPatches )
+	{
+		CloseDispLuxels();
+	}
+
+	FinalLightStats_t stats;
+	int nPooledRadials = 0;
+	for ( int i = 0; i < MAX_TOOL_THREADS + 1; i++ )
+	{
+		if ( !s_pFinalLightArenas[i] )
+			continue;
+
+		stats += s_pFinalLightArenas[i]->m_Stats;
+		nPooledRadials += s_pFinalLightArenas[i]->m_Radials.Count();
+		delete s_pFinalLightArenas[i];
+		s_pFinalLightArenas[i] = NULL;
+	}
+
+	if ( verbose )
+	{
+		Msg( "FinalLightFace: %d faces in %d work items, %.2f seconds\n",
+			(int)stats.m_nFaces, nBatches, Plat_FloatTime() - flStartTime );
+		Msg( "  radials: %d built, %d allocated (%.1f MB)\n",
+			(int)stats.m_nRadials, (int)stats.m_nRadialAllocs, nPooledRadials * ( sizeof( radial_t ) / ( 1024.0f * 1024.0f ) ) );
+		Msg( "  median buffer allocations: %d\n", (int)stats.m_nBufferAllocs );
+		Msg( "  thread time: %.2fs building radials, %.2fs sampling luxels, %.2fs medians\n",
+			stats.m_flRadialTime, stats.m_flSampleTime, stats.m_flMedianTime );
 	}
 }
@@ -39,6 +39,7 @@ typedef struct radial_s
 	int	facenum;
 	lightinfo_t l;
 	int w, h;
+	bool pooled;		// belongs to a FinalLightFace thread arena, FreeRadial leaves it alone
 	float weight[SINGLEMAP];
 	LightingValue_t light[NUM_BUMP_VECTS + 1][SINGLEMAP];
 } radial_t;
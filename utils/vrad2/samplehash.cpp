@@ -1,176 +1,293 @@
 //========= Copyright Valve Corporation, All rights reserved. ============//
 //
-// Purpose: 
+// Purpose: Voxel hashes of the lighting samples and patches that displacement
+//			radials gather their light from.
 //
-// $NoKeywords: $
+// Each face's entries are counted and then written straight into place by
+// all the threads, sorted by voxel key in runs that are merged pairwise, and
+// then laid out as one payload array with a table of runs on top. Payloads
+// in a voxel come back in face order, which is the order the old CUtlHash
+// buckets had them in, so the radials add their light up the same way.
 //
+// $NoKeywords: $
 //=============================================================================//
 
 #include "vrad.h"
 #include "lightmap.h"
+#include "samplehash.h"
+#include <algorithm>
+
+#define VOXELHASH_MIN_SORT_RUN		4096
 
-#define SAMPLEHASH_NUM_BUCKETS			65536
-#define SAMPLEHASH_GROW_SIZE			0
-#define SAMPLEHASH_INIT_SIZE			0
+CVoxelHash g_SampleHash;
+CVoxelHash g_PatchSampleHash;
 
-int samplesAdded = 0;
-int patchSamplesAdded = 0;
-static unsigned short g_PatchIterationKey = 0;
 
 //-----------------------------------------------------------------------------
+// Sorting
 //-----------------------------------------------------------------------------
-bool SampleData_CompareFunc( SampleData_t const &src1, SampleData_t const &src2 )
+static inline bool VoxelHashEntryLess( VoxelHashEntry_t const &a, VoxelHashEntry_t const &b )
 {
-	return ( ( src1.x == src2.x ) &&
-		     ( src1.y == src2.y ) &&
-			 ( src1.z == src2.z ) );
+	if ( a.m_nKey != b.m_nKey )
+		return a.m_nKey < b.m_nKey;
+	return a.m_nOrder < b.m_nOrder;
 }
 
+static VoxelHashEntry_t	*s_pSortSrc;
+static VoxelHashEntry_t	*s_pSortDst;
+static int				s_nSortCount;
+static int				s_nSortRun;
 
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-unsigned int SampleData_KeyFunc( SampleData_t const &src )
+static void SortVoxelHashRun( int iThread, int iRun )
 {
-	return ( src.x + src.y + src.z );
+	int nBegin = iRun * s_nSortRun;
+	int nEnd = min( nBegin + s_nSortRun, s_nSortCount );
+	std::sort( s_pSortSrc + nBegin, s_pSortSrc + nEnd, VoxelHashEntryLess );
 }
 
+static void MergeVoxelHashRuns( int iThread, int iPair )
+{
+	int nBegin = iPair * 2 * s_nSortRun;
+	int nMid = min( nBegin + s_nSortRun, s_nSortCount );
+	int nEnd = min( nMid + s_nSortRun, s_nSortCount );
+	std::merge( s_pSortSrc + nBegin, s_pSortSrc + nMid, s_pSortSrc + nMid, s_pSortSrc + nEnd,
+				s_pSortDst + nBegin, VoxelHashEntryLess );
+}
 
-CUtlHash<SampleData_t> g_SampleHashTable( SAMPLEHASH_NUM_BUCKETS, 
-										  SAMPLEHASH_GROW_SIZE, 
-										  SAMPLEHASH_INIT_SIZE, 
-										  SampleData_CompareFunc, SampleData_KeyFunc );
+// Returns whichever of the two buffers ends up holding the sorted entries.
+static VoxelHashEntry_t *SortVoxelHashEntries( VoxelHashEntry_t *pEntries, VoxelHashEntry_t *pScratch, int nCount )
+{
+	int nThreads = max( numthreads, 1 );
 
+	s_pSortSrc = pEntries;
+	s_pSortDst = pScratch;
+	s_nSortCount = nCount;
+	s_nSortRun = max( ( nCount + nThreads - 1 ) / nThreads, VOXELHASH_MIN_SORT_RUN );
 
+	RunThreadsOnIndividual( ( nCount + s_nSortRun - 1 ) / s_nSortRun, false, SortVoxelHashRun );
 
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-UtlHashHandle_t SampleData_Find( sample_t *pSample )
-{
-	SampleData_t sampleData;	
-	sampleData.x = ( int )( pSample->pos.x / SAMPLEHASH_VOXEL_SIZE ) * 100;
-	sampleData.y = ( int )( pSample->pos.y / SAMPLEHASH_VOXEL_SIZE ) * 10;
-	sampleData.z = ( int )( pSample->pos.z / SAMPLEHASH_VOXEL_SIZE );
+	while ( s_nSortRun < nCount )
+	{
+		int nPairs = ( nCount + 2 * s_nSortRun - 1 ) / ( 2 * s_nSortRun );
+		RunThreadsOnIndividual( nPairs, false, MergeVoxelHashRuns );
+		V_swap( s_pSortSrc, s_pSortDst );
+		s_nSortRun *= 2;
+	}
 
-	return g_SampleHashTable.Find( sampleData );
+	return s_pSortSrc;
 }
 
 
 //-----------------------------------------------------------------------------
+// CVoxelHash
 //-----------------------------------------------------------------------------
-UtlHashHandle_t SampleData_InsertIntoHashTable( sample_t *pSample, SampleHandle_t sampleHandle )
+CVoxelHash::CVoxelHash()
 {
-	SampleData_t sampleData;
-	sampleData.x = ( int )( pSample->pos.x / SAMPLEHASH_VOXEL_SIZE ) * 100;
-	sampleData.y = ( int )( pSample->pos.y / SAMPLEHASH_VOXEL_SIZE ) * 10;
-	sampleData.z = ( int )( pSample->pos.z / SAMPLEHASH_VOXEL_SIZE );
+	m_nSlotMask = 0;
+	m_nSlotShift = 64;
+	m_nVoxels = 0;
+	m_flBuildTime = 0;
+}
 
-	UtlHashHandle_t handle = g_SampleHashTable.AllocEntryFromKey( sampleData );
+void CVoxelHash::Purge()
+{
+	m_Slots.Purge();
+	m_Payloads.Purge();
+	m_nSlotMask = 0;
+	m_nSlotShift = 64;
+	m_nVoxels = 0;
+}
 
-	SampleData_t *pSampleData = &g_SampleHashTable.Element( handle );
-	pSampleData->x = sampleData.x;
-	pSampleData->y = sampleData.y;
-	pSampleData->z = sampleData.z;
-	pSampleData->m_Samples.AddToTail( sampleHandle );
+void CVoxelHash::Build( CUtlVector<VoxelHashEntry_t> &entries )
+{
+	double flStartTime = Plat_FloatTime();
 
-	samplesAdded++;
+	Purge();
 
-	return handle;
-}
+	int nCount = entries.Count();
+	CUtlVector<VoxelHashEntry_t> scratch;
+	scratch.SetCount( nCount );
+	VoxelHashEntry_t *pSorted = nCount ? SortVoxelHashEntries( entries.Base(), scratch.Base(), nCount ) : NULL;
 
+	int nVoxels = 0;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		if ( i == 0 || pSorted[i].m_nKey != pSorted[i-1].m_nKey )
+			nVoxels++;
+	}
 
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-UtlHashHandle_t SampleData_AddSample( sample_t *pSample, SampleHandle_t sampleHandle )
-{
+	// at most half full
+	int nBits = 4;
+	while ( ( 1 << nBits ) < nVoxels * 2 )
+		nBits++;
 
-	// find the key -- if it doesn't exist add new sample data to the
-	// hash table
-	UtlHashHandle_t handle = SampleData_Find( pSample );
-	if( handle == g_SampleHashTable.InvalidHandle() )
+	m_Slots.SetCount( 1 << nBits );
+	for ( int i = 0; i < m_Slots.Count(); i++ )
 	{
-		handle = SampleData_InsertIntoHashTable( pSample, sampleHandle );
+		m_Slots[i].m_nKey = VOXELHASH_EMPTY_KEY;
+		m_Slots[i].m_nFirst = 0;
+		m_Slots[i].m_nCount = 0;
 	}
-	else
+	m_nSlotMask = m_Slots.Count() - 1;
+	m_nSlotShift = 64 - nBits;
+
+	m_Payloads.SetCount( nCount );
+	for ( int nFirst = 0; nFirst < nCount; )
 	{
-		SampleData_t *pSampleData = &g_SampleHashTable.Element( handle );
-		pSampleData->m_Samples.AddToTail( sampleHandle );
+		uint64 nKey = pSorted[nFirst].m_nKey;
+		int nEnd = nFirst;
+		while ( nEnd < nCount && pSorted[nEnd].m_nKey == nKey )
+		{
+			m_Payloads[nEnd] = pSorted[nEnd].m_nPayload;
+			nEnd++;
+		}
 
-		samplesAdded++;
+		uint32 iSlot = SlotForKey( nKey );
+		while ( m_Slots[iSlot].m_nKey != VOXELHASH_EMPTY_KEY )
+		{
+			iSlot = ( iSlot + 1 ) & m_nSlotMask;
+		}
+		m_Slots[iSlot].m_nKey = nKey;
+		m_Slots[iSlot].m_nFirst = nFirst;
+		m_Slots[iSlot].m_nCount = nEnd - nFirst;
+
+		nFirst = nEnd;
 	}
+	m_nVoxels = nVoxels;
+
+	m_flBuildTime = Plat_FloatTime() - flStartTime;
+}
 
-	return handle;
+void CVoxelHash::GetProbeStats( float &flMean, int &nMax ) const
+{
+	int64 nTotal = 0;
+	nMax = 0;
+	for ( int i = 0; i < m_Slots.Count(); i++ )
+	{
+		if ( m_Slots[i].m_nKey == VOXELHASH_EMPTY_KEY )
+			continue;
+
+		int nProbes = ( ( i - (int)SlotForKey( m_Slots[i].m_nKey ) ) & m_nSlotMask ) + 1;
+		nTotal += nProbes;
+		nMax = max( nMax, nProbes );
+	}
+	flMean = m_nVoxels ? (float)nTotal / m_nVoxels : 0.0f;
 }
 
 
 //-----------------------------------------------------------------------------
+// Gathering the entries. Every face's entries are counted first, so that each
+// thread can write its faces' entries straight to their place in face order.
 //-----------------------------------------------------------------------------
-void SampleData_Log( void )
+
+// Writes the face's entries to pOut (if it isn't NULL) and returns how many there are.
+typedef int (*VoxelHashFaceFn)( int ndxFace, VoxelHashEntry_t *pOut );
+
+static VoxelHashFaceFn		s_pfnFaceEntries;
+static CUtlVector<int>		s_FaceEntryStart;
+static VoxelHashEntry_t		*s_pFaceEntries;
+
+static void CountFaceEntries( int iThread, int ndxFace )
+{
+	s_FaceEntryStart[ndxFace] = s_pfnFaceEntries( ndxFace, NULL );
+}
+
+static void WriteFaceEntries( int iThread, int ndxFace )
+{
+	int nFirst = s_FaceEntryStart[ndxFace];
+	VoxelHashEntry_t *pOut = s_pFaceEntries + nFirst;
+	int nCount = s_pfnFaceEntries( ndxFace, pOut );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		pOut[i].m_nOrder = nFirst + i;
+	}
+}
+
+static void BuildVoxelHashFromFaces( CVoxelHash &hash, VoxelHashFaceFn pfnFaceEntries )
 {
-	if( g_bLogHashData )
+	s_pfnFaceEntries = pfnFaceEntries;
+	s_FaceEntryStart.SetCount( numfaces + 1 );
+	s_FaceEntryStart[numfaces] = 0;
+	RunThreadsOnIndividual( numfaces, false, CountFaceEntries );
+
+	int nTotal = 0;
+	for ( int i = 0; i <= numfaces; i++ )
 	{
-		g_SampleHashTable.Log( "samplehash.txt" );
+		int nCount = s_FaceEntryStart[i];
+		s_FaceEntryStart[i] = nTotal;
+		nTotal += nCount;
 	}
+
+	CUtlVector<VoxelHashEntry_t> entries;
+	entries.SetCount( nTotal );
+	s_pFaceEntries = entries.Base();
+	RunThreadsOnIndividual( numfaces, false, WriteFaceEntries );
+
+	hash.Build( entries );
+
+	s_FaceEntryStart.Purge();
+	s_pFaceEntries = NULL;
 }
 
 
 //=============================================================================
 //=============================================================================
 //
-// PatchSample Functions
+// Sample Functions
 //
 //=============================================================================
 //=============================================================================
 
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-bool PatchSampleData_CompareFunc( PatchSampleData_t const &src1, PatchSampleData_t const &src2 )
+static int GetFaceSampleEntries( int ndxFace, VoxelHashEntry_t *pOut )
 {
-	return ( ( src1.x == src2.x ) &&
-		     ( src1.y == src2.y ) &&
-			 ( src1.z == src2.z ) );
-}
+	dface_t *pFace = &g_pFaces[ndxFace];
+	facelight_t *pFaceLight = &facelight[ndxFace];
 
+	if( texinfo[pFace->texinfo].flags & TEX_SPECIAL )
+		return 0;
 
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-unsigned int PatchSampleData_KeyFunc( PatchSampleData_t const &src )
+	if ( pOut )
+	{
+		for( int ndxSample = 0; ndxSample < pFaceLight->numsamples; ndxSample++ )
+		{
+			sample_t *pSample = &pFaceLight->sample[ndxSample];
+
+			// create the sample handle
+			SampleHandle_t sampleHandle = ndxSample;
+			sampleHandle |= ( ndxFace << 16 );
+
+			pOut[ndxSample].m_nKey = VoxelHashKey( ( int )( pSample->pos.x / SAMPLEHASH_VOXEL_SIZE ),
+												   ( int )( pSample->pos.y / SAMPLEHASH_VOXEL_SIZE ),
+												   ( int )( pSample->pos.z / SAMPLEHASH_VOXEL_SIZE ) );
+			pOut[ndxSample].m_nPayload = sampleHandle;
+		}
+	}
+
+	return pFaceLight->numsamples;
+}
+
+void BuildSampleHash()
 {
-	return ( src.x + src.y + src.z );
+	BuildVoxelHashFromFaces( g_SampleHash, GetFaceSampleEntries );
 }
 
 
-CUtlHash<PatchSampleData_t>	g_PatchSampleHashTable( SAMPLEHASH_NUM_BUCKETS,
-												    SAMPLEHASH_GROW_SIZE,
-													SAMPLEHASH_INIT_SIZE,
-													PatchSampleData_CompareFunc, PatchSampleData_KeyFunc );
+//=============================================================================
+//=============================================================================
+//
+// PatchSample Functions
+//
+//=============================================================================
+//=============================================================================
 
-void GetPatchSampleHashXYZ( const Vector &vOrigin, int &x, int &y, int &z )
+static void GetPatchSampleHashXYZ( const Vector &vOrigin, int &x, int &y, int &z )
 {
 	x = ( int )( vOrigin.x / SAMPLEHASH_VOXEL_SIZE );
 	y = ( int )( vOrigin.y / SAMPLEHASH_VOXEL_SIZE );
 	z = ( int )( vOrigin.z / SAMPLEHASH_VOXEL_SIZE );
 }
 
-
-unsigned short IncrementPatchIterationKey()
-{
-	if ( g_PatchIterationKey == 0xFFFF )
-	{
-		g_PatchIterationKey = 1;
-		for ( int i=0; i < g_Patches.Count(); i++ )
-			g_Patches[i].m_IterationKey = 0;
-	}
-	else
-	{
-		g_PatchIterationKey++;
-	}
-	return g_PatchIterationKey;
-}
-
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-void PatchSampleData_AddSample( CPatch *pPatch, int ndxPatch )
+static int GetPatchEntries( CPatch *pPatch, int ndxPatch, VoxelHashEntry_t *pOut )
 {
 	int patchSampleMins[3], patchSampleMaxs[3];
 
@@ -182,49 +299,245 @@ void PatchSampleData_AddSample( CPatch *pPatch, int ndxPatch )
 	GetPatchSampleHashXYZ( pPatch->origin, patchSampleMins[0], patchSampleMins[1], patchSampleMins[2] );
 	memcpy( patchSampleMaxs, patchSampleMins, sizeof( patchSampleMaxs ) );
 #endif
-	
+
 	// Make sure mins are smaller than maxs so we don't iterate for 4 bil.
 	Assert( patchSampleMins[0] <= patchSampleMaxs[0] && patchSampleMins[1] <= patchSampleMaxs[1] && patchSampleMins[2] <= patchSampleMaxs[2] );
 	patchSampleMins[0] = min( patchSampleMins[0], patchSampleMaxs[0] );
 	patchSampleMins[1] = min( patchSampleMins[1], patchSampleMaxs[1] );
 	patchSampleMins[2] = min( patchSampleMins[2], patchSampleMaxs[2] );
-	
-	int iterateCoords[3];
-	for ( iterateCoords[0]=patchSampleMins[0]; iterateCoords[0] <= patchSampleMaxs[0]; iterateCoords[0]++ )
+
+	int nCount = 0;
+	for ( int x = patchSampleMins[0]; x <= patchSampleMaxs[0]; x++ )
 	{
-		for ( iterateCoords[1]=patchSampleMins[1]; iterateCoords[1] <= patchSampleMaxs[1]; iterateCoords[1]++ )
+		for ( int y = patchSampleMins[1]; y <= patchSampleMaxs[1]; y++ )
 		{
-			for ( iterateCoords[2]=patchSampleMins[2]; iterateCoords[2] <= patchSampleMaxs[2]; iterateCoords[2]++ )
+			for ( int z = patchSampleMins[2]; z <= patchSampleMaxs[2]; z++ )
 			{
-				// find the key -- if it doesn't exist add new sample data to the
-				// hash table
-				PatchSampleData_t iteratePatch;
-				iteratePatch.x = iterateCoords[0] * 100;
-				iteratePatch.y = iterateCoords[1] * 10;
-				iteratePatch.z = iterateCoords[2];
-
-				UtlHashHandle_t handle = g_PatchSampleHashTable.Find( iteratePatch );
-				if( handle == g_PatchSampleHashTable.InvalidHandle() )
+				if ( pOut )
 				{
-					UtlHashHandle_t handle = g_PatchSampleHashTable.AllocEntryFromKey( iteratePatch );
+					pOut[nCount].m_nKey = VoxelHashKey( x, y, z );
+					pOut[nCount].m_nPayload = ndxPatch;
+				}
+				nCount++;
+			}
+		}
+	}
+	return nCount;
+}
 
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
-					pPatchData->x = iteratePatch.x;
-					pPatchData->y = iteratePatch.y;
-					pPatchData->z = iteratePatch.z;
-					pPatchData->m_ndxPatches.AddToTail( ndxPatch );
+static int GetFacePatchEntries( int ndxFace, VoxelHashEntry_t *pOut )
+{
+	dface_t *pFace = &g_pFaces[ndxFace];
+	if( texinfo[pFace->texinfo].flags & TEX_SPECIAL )
+		return 0;
 
-					patchSamplesAdded++;
-				}
-				else
-				{
-					PatchSampleData_t *pPatchData = &g_PatchSampleHashTable.Element( handle );
-					pPatchData->m_ndxPatches.AddToTail( ndxPatch );
+	if( g_FacePatches.Element( ndxFace ) == g_FacePatches.InvalidIndex() )
+		return 0;
+
+	int nCount = 0;
+	CPatch *pNextPatch = NULL;
+	for( CPatch *pPatch = &g_Patches.Element( g_FacePatches.Element( ndxFace ) ); pPatch; pPatch = pNextPatch )
+	{
+		// next patch
+		pNextPatch = NULL;
+		if( pPatch->ndxNext != g_Patches.InvalidIndex() )
+		{
+			pNextPatch = &g_Patches.Element( pPatch->ndxNext );
+		}
+
+		// skip patches with children
+		if( pPatch->child1 != g_Patches.InvalidIndex() )
+			continue;
+
+		int ndxPatch = pPatch - g_Patches.Base();
+		nCount += GetPatchEntries( pPatch, ndxPatch, pOut ? pOut + nCount : NULL );
+	}
+	return nCount;
+}
+
+void BuildPatchSampleHash()
+{
+	BuildVoxelHashFromFaces( g_PatchSampleHash, GetFacePatchEntries );
+}
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+void RemoveDuplicatePatches( CUtlVector<int> &patches )
+{
+	int nCount = patches.Count();
+	if ( nCount < 2 )
+		return;
+
+	// sort (patch, position) pairs, the first of each patch is the one to keep
+	CUtlVectorFixedGrowable<uint64, 256> sorted;
+	sorted.SetCount( nCount );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		sorted[i] = ( (uint64)(uint32)patches[i] << 32 ) | (uint32)i;
+	}
+	std::sort( sorted.Base(), sorted.Base() + nCount );
+
+	CUtlVectorFixedGrowable<bool, 256> keep;
+	keep.SetCount( nCount );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		keep[(int)(uint32)sorted[i]] = ( i == 0 ) || ( ( sorted[i] >> 32 ) != ( sorted[i-1] >> 32 ) );
+	}
+
+	int nKept = 0;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		if ( keep[i] )
+		{
+			patches[nKept++] = patches[i];
+		}
+	}
+	patches.SetCountNonDestructively( nKept );
+}
 
-					patchSamplesAdded++;
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+static void GetVoxelHashStats( char *pBuf, int nBufSize, char const *pName, CVoxelHash const &hash )
+{
+	float flMeanProbes;
+	int nMaxProbes;
+	hash.GetProbeStats( flMeanProbes, nMaxProbes );
+
+	Q_snprintf( pBuf, nBufSize, "%s: %d entries in %d voxels (%.2f per voxel), %d slots, %.2f probes per lookup (max %d), built in %.3f seconds\n",
+		pName, hash.PayloadCount(), hash.VoxelCount(),
+		hash.VoxelCount() ? (float)hash.PayloadCount() / hash.VoxelCount() : 0.0f,
+		hash.SlotCount(), flMeanProbes, nMaxProbes, hash.BuildTime() );
+}
+
+void SampleHash_Log( void )
+{
+	if( !g_bLogHashData )
+		return;
+
+	FileHandle_t fp = g_pFileSystem->Open( "samplehash.txt", "w" );
+	if ( !fp )
+		return;
+
+	char szStats[512];
+	GetVoxelHashStats( szStats, sizeof( szStats ), "samples", g_SampleHash );
+	CmdLib_FPrintf( fp, "%s", szStats );
+	GetVoxelHashStats( szStats, sizeof( szStats ), "patches", g_PatchSampleHash );
+	CmdLib_FPrintf( fp, "%s", szStats );
+	g_pFileSystem->Close( fp );
+}
+
+
+//-----------------------------------------------------------------------------
+// Benchmark: a box query around every luxel, with the radii the displacement
+// radials use, against the sample hash and the patch hash.
+//-----------------------------------------------------------------------------
+struct SampleHashBenchCounts_t
+{
+	int64	m_nQueries;
+	int64	m_nVoxels;
+	int64	m_nPayloads;
+	int64	m_nSink;			// keeps the payload reads from being optimized away
+	char	m_Pad[32];
+};
+
+static SampleHashBenchCounts_t s_SampleHashBenchCounts[MAX_TOOL_THREADS + 1];
+
+static void QueryVoxelBox( CVoxelHash const &hash, Vector const &vPos, float flRadius, SampleHashBenchCounts_t &counts )
+{
+	float ooVoxelSize = 1.0f / SAMPLEHASH_VOXEL_SIZE;
+
+	int voxelMin[3], voxelMax[3];
+	for( int axis = 0; axis < 3; axis++ )
+	{
+		voxelMin[axis] = ( int )( ( vPos[axis] - flRadius ) * ooVoxelSize );
+		voxelMax[axis] = ( int )( ( vPos[axis] + flRadius ) * ooVoxelSize ) + 1;
+	}
+
+	for( int z = voxelMin[2]; z <= voxelMax[2]; z++ )
+	{
+		for( int y = voxelMin[1]; y <= voxelMax[1]; y++ )
+		{
+			for( int x = voxelMin[0]; x <= voxelMax[0]; x++ )
+			{
+				int nCount;
+				uint32 const *pPayloads = hash.FindVoxel( x, y, z, nCount );
+				for ( int i = 0; i < nCount; i++ )
+				{
+					counts.m_nSink += pPayloads[i];
 				}
+				counts.m_nPayloads += nCount;
+				counts.m_nVoxels++;
 			}
 		}
 	}
+	counts.m_nQueries++;
 }
 
+static void SampleHashBenchFace( int iThread, int ndxFace )
+{
+	dface_t *pFace = &g_pFaces[ndxFace];
+	if ( texinfo[pFace->texinfo].flags & TEX_SPECIAL )
+		return;
+
+	// same as CVRADDispColl::CalcSampleRadius2AndBox
+	texinfo_t *pTexInfo = &texinfo[pFace->texinfo];
+	Vector vecTmp( pTexInfo->lightmapVecsLuxelsPerWorldUnits[0][0],
+				   pTexInfo->lightmapVecsLuxelsPerWorldUnits[0][1],
+				   pTexInfo->lightmapVecsLuxelsPerWorldUnits[0][2] );
+	float flLuxelSize = 1.0f / max( VectorLength( vecTmp ), 1e-6f );
+	float flSampleRadius = min( flLuxelSize * 1.41421356f * 2.2f, g_flMaxDispSampleSize );
+	float flPatchRadius = min( flLuxelSize * dispchop * 2.2f, g_MaxDispPatchRadius );
+
+	SampleHashBenchCounts_t &counts = s_SampleHashBenchCounts[iThread];
+	facelight_t *pFaceLight = &facelight[ndxFace];
+	for ( int i = 0; i < pFaceLight->numluxels; i++ )
+	{
+		QueryVoxelBox( g_SampleHash, pFaceLight->luxel[i], flSampleRadius, counts );
+		if ( g_PatchSampleHash.VoxelCount() )
+		{
+			QueryVoxelBox( g_PatchSampleHash, pFaceLight->luxel[i], flPatchRadius, counts );
+		}
+	}
+}
+
+void RunSampleHashBenchmark()
+{
+	Msg( "Sample hash benchmark:\n" );
+	char szStats[512];
+	GetVoxelHashStats( szStats, sizeof( szStats ), "  samples", g_SampleHash );
+	Msg( "%s", szStats );
+	GetVoxelHashStats( szStats, sizeof( szStats ), "  patches", g_PatchSampleHash );
+	Msg( "%s", szStats );
+
+	int nMaxThreads = max( numthreads, 1 );
+	for ( int nThreads = 1; ; nThreads = min( nThreads * 2, nMaxThreads ) )
+	{
+		memset( s_SampleHashBenchCounts, 0, sizeof( s_SampleHashBenchCounts ) );
+
+		int nSavedThreads = numthreads;
+		numthreads = nThreads;
+		double flStartTime = Plat_FloatTime();
+		RunThreadsOnIndividual( numfaces, false, SampleHashBenchFace );
+		double flTime = Plat_FloatTime() - flStartTime;
+		numthreads = nSavedThreads;
+
+		SampleHashBenchCounts_t total;
+		memset( &total, 0, sizeof( total ) );
+		for ( int i = 0; i < nThreads; i++ )
+		{
+			total.m_nQueries += s_SampleHashBenchCounts[i].m_nQueries;
+			total.m_nVoxels += s_SampleHashBenchCounts[i].m_nVoxels;
+			total.m_nPayloads += s_SampleHashBenchCounts[i].m_nPayloads;
+		}
+
+		double flQueries = max( (double)total.m_nQueries, 1.0 );
+		Msg( "  %2d threads: %.2f Mqueries/s (%.3f seconds), %.1f voxels and %.1f payloads per query\n",
+			nThreads, total.m_nQueries / max( flTime, 1e-6 ) * 1e-6, flTime,
+			total.m_nVoxels / flQueries, total.m_nPayloads / flQueries );
+
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+}
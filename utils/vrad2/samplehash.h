@@ -0,0 +1,134 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Voxel hashes of the lighting samples and patches that displacement
+//			radials gather their light from.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef SAMPLEHASH_H
+#define SAMPLEHASH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier1/utlvector.h"
+
+
+#define SAMPLEHASH_VOXEL_SIZE			64.0f
+
+typedef unsigned int SampleHandle_t;				// the upper 16 bits = facelight index (works because max face are 65536)
+													// the lower 16 bits = sample index inside of facelight
+
+#define VOXELHASH_EMPTY_KEY				0xffffffffffffffffull
+
+// Interleaves the low 21 bits of x, y and z, so voxels that are close together
+// get keys that are close together.
+inline uint64 VoxelHashSpreadBits( int n )
+{
+	uint64 x = (uint32)( n + ( 1 << 20 ) ) & 0x1fffff;
+	x = ( x | ( x << 32 ) ) & 0x001f00000000ffffull;
+	x = ( x | ( x << 16 ) ) & 0x001f0000ff0000ffull;
+	x = ( x | ( x << 8 ) ) & 0x100f00f00f00f00full;
+	x = ( x | ( x << 4 ) ) & 0x10c30c30c30c30c3ull;
+	x = ( x | ( x << 2 ) ) & 0x1249249249249249ull;
+	return x;
+}
+
+inline uint64 VoxelHashKey( int x, int y, int z )
+{
+	return VoxelHashSpreadBits( x ) | ( VoxelHashSpreadBits( y ) << 1 ) | ( VoxelHashSpreadBits( z ) << 2 );
+}
+
+struct VoxelHashEntry_t
+{
+	uint64	m_nKey;				// VoxelHashKey of the voxel
+	uint32	m_nOrder;			// position in the voxel, payloads come back out in this order
+	uint32	m_nPayload;
+};
+
+
+//-----------------------------------------------------------------------------
+// Maps voxels to the payloads in them. The payloads are kept in one array
+// sorted by voxel key, so neighbouring voxels' payloads are mostly next to
+// each other in memory, and an open addressed table maps a voxel to its run.
+// Nothing changes once it's built, so any number of threads can query it.
+//-----------------------------------------------------------------------------
+class CVoxelHash
+{
+public:
+	CVoxelHash();
+
+	// Sorts entries into place (using all the threads) and builds the table from them.
+	void Build( CUtlVector<VoxelHashEntry_t> &entries );
+	void Purge();
+
+	// Returns the payloads in voxel x, y, z, or NULL if there aren't any.
+	uint32 const *FindVoxel( int x, int y, int z, int &nCount ) const;
+
+	int VoxelCount() const			{ return m_nVoxels; }
+	int PayloadCount() const		{ return m_Payloads.Count(); }
+	int SlotCount() const			{ return m_Slots.Count(); }
+	double BuildTime() const		{ return m_flBuildTime; }
+
+	// Mean and longest number of slots looked at to find a voxel that's there.
+	void GetProbeStats( float &flMean, int &nMax ) const;
+
+private:
+	struct Slot_t
+	{
+		uint64	m_nKey;
+		int		m_nFirst;
+		int		m_nCount;
+	};
+
+	uint32 SlotForKey( uint64 nKey ) const
+	{
+		return (uint32)( ( nKey * 0x9e3779b97f4a7c15ull ) >> m_nSlotShift );
+	}
+
+	CUtlVector<Slot_t>	m_Slots;
+	uint32				m_nSlotMask;
+	int					m_nSlotShift;
+	CUtlVector<uint32>	m_Payloads;
+	int					m_nVoxels;
+	double				m_flBuildTime;
+};
+
+inline uint32 const *CVoxelHash::FindVoxel( int x, int y, int z, int &nCount ) const
+{
+	nCount = 0;
+	if ( !m_nVoxels )
+		return NULL;
+
+	uint64 nKey = VoxelHashKey( x, y, z );
+	for ( uint32 i = SlotForKey( nKey ); ; i = ( i + 1 ) & m_nSlotMask )
+	{
+		Slot_t const &slot = m_Slots[i];
+		if ( slot.m_nKey == nKey )
+		{
+			nCount = slot.m_nCount;
+			return &m_Payloads[slot.m_nFirst];
+		}
+		if ( slot.m_nKey == VOXELHASH_EMPTY_KEY )
+			return NULL;
+	}
+}
+
+
+extern CVoxelHash g_SampleHash;			// SampleHandle_t of every sample, by position
+extern CVoxelHash g_PatchSampleHash;	// index of every leaf patch, by origin (or bounds, see SAMPLEHASH_USE_AREA_PATCHES)
+
+void BuildSampleHash();
+void BuildPatchSampleHash();
+void SampleHash_Log();
+
+// Times box queries around every luxel against both hashes.
+void RunSampleHashBenchmark();
+
+// Drops repeats from a list of patches gathered from several voxels, keeping
+// the first of each where it was.
+void RemoveDuplicatePatches( CUtlVector<int> &patches );
+
+
+#endif // SAMPLEHASH_H
@@ -13,6 +13,7 @@
 #include "trace.h"
 #include "Cmodel.h"
 #include "mathlib/vmatrix.h"
+#include "tier0/threadtools.h"
 
 
 //=============================================================================
@@ -148,9 +149,23 @@ public:
 	}
 };
 
+// rays traced by each thread through the TestLine functions
+static CTHREADLOCALINTEGER( intp ) s_nThreadRaysTraced;
+
+uint32 ThreadRaysTraced()
+{
+	return (uint32)(int)s_nThreadRaysTraced;
+}
+
+static inline void CountRaysTraced( int nRays )
+{
+	s_nThreadRaysTraced = (int)s_nThreadRaysTraced + nRays;
+}
+
 void TestLine( const FourVectors& start, const FourVectors& stop,
                fltx4 *pFractionVisible, int static_prop_index_to_ignore )
 {
+	CountRaysTraced( 4 );
 	FourRays myrays;
 	myrays.origin = start;
 	myrays.direction = stop;
@@ -182,6 +197,7 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 void TestLine_IgnoreSky( const FourVectors& start, const FourVectors& stop,
 						 fltx4 *pFractionVisible, int static_prop_index_to_ignore )
 {
+	CountRaysTraced( 4 );
 	FourRays myrays;
 	myrays.origin = start;
 	myrays.direction = stop;
@@ -388,20 +404,12 @@ void DM_ClipBoxToBrush( CToolTrace *trace, const Vector& mins, const Vector& max
 	}
 }
 
-void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+// turns the result of a trace towards the sky into visibility, clipping into the 3D sky boxes
+// if the sky was hit
+static void SkyVisibilityFromTrace( FourVectors const& start, FourVectors const& stop, FourRays const& myrays,
+	fltx4 len, RayTracingResult const& rt_result, CCoverageCountTexture &coverageCallback,
 	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
-
 	if ( bDoDebug )
 	{
 		WriteTrace( "trace.txt", myrays, rt_result );
@@ -467,6 +475,63 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 	*pFractionVisible = SubSIMD( Four_Ones, occlusion );
 }
 
+void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
+	CountRaysTraced( 4 );
+	FourRays myrays;
+	myrays.origin = start;
+	myrays.direction = stop;
+	myrays.direction -= myrays.origin;
+	fltx4 len = myrays.direction.length();
+	myrays.direction *= ReciprocalSIMD( len );
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
+
+	SkyVisibilityFromTrace( start, stop, myrays, len, rt_result, coverageCallback, pFractionVisible,
+							canRecurse, static_prop_to_skip, bDoDebug );
+}
+
+void TestLinePacket_DoesHitSky( FourVectors const *pStarts, FourVectors const *pStops, int nGroups,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip )
+{
+	CountRaysTraced( 4 * nGroups );
+	RayPacket packet;
+	fltx4 len[RAYPACKET_MAX_GROUPS];
+	RayTracingResult rt_results[RAYPACKET_MAX_GROUPS];
+	CCoverageCountTexture coverageCallbacks[RAYPACKET_MAX_GROUPS];
+	ITransparentTriangleCallback *pCallbacks[RAYPACKET_MAX_GROUPS];
+
+	for ( int nFirst = 0; nFirst < nGroups; nFirst += RAYPACKET_MAX_GROUPS )
+	{
+		packet.m_nGroups = min( nGroups - nFirst, RAYPACKET_MAX_GROUPS );
+		for ( int g = 0; g < packet.m_nGroups; g++ )
+		{
+			FourRays &myrays = packet.m_Rays[g];
+			myrays.origin = pStarts[nFirst + g];
+			myrays.direction = pStops[nFirst + g];
+			myrays.direction -= myrays.origin;
+			len[g] = myrays.direction.length();
+			myrays.direction *= ReciprocalSIMD( len[g] );
+			packet.m_TMin[g] = Four_Zeros;
+			packet.m_TMax[g] = len[g];
+
+			coverageCallbacks[g].m_coverage = Four_Zeros;
+			pCallbacks[g] = &coverageCallbacks[g];
+		}
+
+		g_RtEnv.TraceRayPacket( packet, rt_results, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows ? pCallbacks : NULL );
+
+		for ( int g = 0; g < packet.m_nGroups; g++ )
+		{
+			SkyVisibilityFromTrace( pStarts[nFirst + g], pStops[nFirst + g], packet.m_Rays[g], len[g], rt_results[g],
+									coverageCallbacks[g], &pFractionVisible[nFirst + g], canRecurse, static_prop_to_skip, false );
+		}
+	}
+}
+
 
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,247 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Keeps the packed transfer matrix on disk between vrad runs.
+//
+// The transfers only depend on the geometry, the PVS and the patches, so when
+// just the lights change they can be reused as is. The cache is keyed by an MD5
+// of everything the transfers are built from, which means a stale cache is
+// simply ignored and rebuilt; there is nothing to invalidate by hand. Unlike
+// CIncremental this works on full offline compiles.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfercache.h"
+#include "transfermatrix.h"
+#include "gamebspfile.h"
+#include "tier1/strtools.h"
+
+
+extern int total_transfer;
+extern int max_transfer;
+
+static MD5Value_t	s_TransferCacheKey;
+static bool			s_bTransferCacheKeyValid = false;
+
+
+template< class T >
+static inline void HashData( MD5Context_t &ctx, T const *pData, int nCount )
+{
+	MD5Update( &ctx, (unsigned char const *)&nCount, sizeof( nCount ) );
+	if ( nCount > 0 )
+	{
+		MD5Update( &ctx, (unsigned char const *)pData, nCount * sizeof( T ) );
+	}
+}
+
+static inline void HashString( MD5Context_t &ctx, char const *pString )
+{
+	HashData( ctx, pString, Q_strlen( pString ) );
+}
+
+// hash a single scalar, so struct padding never ends up in the key
+template< class T >
+static inline void HashValue( MD5Context_t &ctx, T const &value )
+{
+	MD5Update( &ctx, (unsigned char const *)&value, sizeof( T ) );
+}
+
+static inline void HashVector( MD5Context_t &ctx, Vector const &v )
+{
+	HashValue( ctx, v.x );
+	HashValue( ctx, v.y );
+	HashValue( ctx, v.z );
+}
+
+static void HashFaces( MD5Context_t &ctx )
+{
+	// lightofs and styles are filled in by vrad itself, and the primitives don't affect lighting
+	HashValue( ctx, numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t const &face = g_pFaces[i];
+		HashValue( ctx, face.planenum );
+		HashValue( ctx, face.side );
+		HashValue( ctx, face.onNode );
+		HashValue( ctx, face.firstedge );
+		HashValue( ctx, face.numedges );
+		HashValue( ctx, face.texinfo );
+		HashValue( ctx, face.dispinfo );
+		HashValue( ctx, face.surfaceFogVolumeID );
+		HashValue( ctx, face.area );
+		HashValue( ctx, face.m_LightmapTextureMinsInLuxels[0] );
+		HashValue( ctx, face.m_LightmapTextureMinsInLuxels[1] );
+		HashValue( ctx, face.m_LightmapTextureSizeInLuxels[0] );
+		HashValue( ctx, face.m_LightmapTextureSizeInLuxels[1] );
+		HashValue( ctx, face.origFace );
+		HashValue( ctx, face.smoothingGroups );
+	}
+}
+
+static void HashEntities( MD5Context_t &ctx )
+{
+	// brush entities can cast shadows, but editing a light mustn't throw the cache away
+	for ( int i = 0; i < num_entities; i++ )
+	{
+		if ( !Q_strnicmp( ValueForKey( &entities[i], "classname" ), "light", 5 ) )
+			continue;
+
+		for ( epair_t *ep = entities[i].epairs; ep; ep = ep->next )
+		{
+			HashString( ctx, ep->key );
+			HashString( ctx, ep->value );
+		}
+	}
+}
+
+static void HashStaticProps( MD5Context_t &ctx )
+{
+	GameLumpHandle_t handle = g_GameLumps.GetGameLumpHandle( GAMELUMP_STATIC_PROPS );
+	if ( handle == g_GameLumps.InvalidGameLump() )
+		return;
+
+	HashData( ctx, (unsigned char const *)g_GameLumps.GetGameLump( handle ), g_GameLumps.GameLumpSize( handle ) );
+}
+
+static void HashPatches( MD5Context_t &ctx )
+{
+	int nPatches = g_Patches.Count();
+	HashValue( ctx, nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		CPatch const &patch = g_Patches[i];
+		HashVector( ctx, patch.origin );
+		HashVector( ctx, patch.normal );
+		HashValue( ctx, patch.area );
+		HashValue( ctx, patch.faceNumber );
+		HashValue( ctx, patch.clusterNumber );
+		HashValue( ctx, patch.parent );
+		HashValue( ctx, patch.child1 );
+		HashValue( ctx, patch.child2 );
+
+		int nPoints = patch.winding ? patch.winding->numpoints : 0;
+		HashValue( ctx, nPoints );
+		for ( int j = 0; j < nPoints; j++ )
+		{
+			HashVector( ctx, patch.winding->p[j] );
+		}
+	}
+}
+
+static void HashOccluders( MD5Context_t &ctx )
+{
+	// everything the visibility rays can hit, including static props and
+	// displacements, exactly as the ray tracer sees it
+	int nTriangles = g_RtEnv.OptimizedTriangleList.Count();
+	HashData( ctx, &nTriangles, 1 );
+	for ( int i = 0; i < nTriangles; i++ )
+	{
+		HashData( ctx, &g_RtEnv.OptimizedTriangleList[i], 1 );
+	}
+	HashData( ctx, g_RtEnv.TriangleColors.Base(), g_RtEnv.TriangleColors.Count() );
+	HashData( ctx, g_RtEnv.TriangleMaterials.Base(), g_RtEnv.TriangleMaterials.Count() );
+}
+
+static void ComputeTransferCacheKey( MD5Value_t &key )
+{
+	MD5Context_t ctx;
+	memset( &ctx, 0, sizeof( ctx ) );
+	MD5Init( &ctx );
+
+	// bsp lumps
+	HashData( ctx, dplanes, numplanes );
+	HashData( ctx, dvertexes, numvertexes );
+	HashData( ctx, dedges, numedges );
+	HashData( ctx, dsurfedges, numsurfedges );
+	HashData( ctx, texinfo.Base(), texinfo.Count() );
+	HashData( ctx, dtexdata, numtexdata );
+	HashData( ctx, g_dispinfo.Base(), g_dispinfo.Count() );
+	HashData( ctx, g_DispVerts.Base(), g_DispVerts.Count() );
+	HashData( ctx, g_DispTris.Base(), g_DispTris.Count() );
+	HashData( ctx, dvisdata, visdatasize );
+	HashData( ctx, dleafs, numleafs );
+	HashData( ctx, dleaffaces, numleaffaces );
+	HashData( ctx, dnodes, numnodes );
+	HashData( ctx, dmodels, nummodels );
+	HashFaces( ctx );
+	HashEntities( ctx );
+	HashStaticProps( ctx );
+
+	// what vrad built from them
+	HashPatches( ctx );
+	HashOccluders( ctx );
+
+	// options that change the transfers without showing up in the above
+	HashData( ctx, &g_bTextureShadows, 1 );
+	HashData( ctx, &g_bStaticPropPolys, 1 );
+
+	MD5Final( key.bits, &ctx );
+}
+
+static void GetTransferCacheFilename( char *pFilename, int nMaxLen )
+{
+	Q_snprintf( pFilename, nMaxLen, "%s.vtc", source );
+}
+
+
+bool LoadTransferCache()
+{
+	ComputeTransferCacheKey( s_TransferCacheKey );
+	s_bTransferCacheKeyValid = true;
+
+	char szFilename[MAX_PATH];
+	GetTransferCacheFilename( szFilename, sizeof( szFilename ) );
+
+	float flStart = Plat_FloatTime();
+	if ( !g_TransferMatrix.MapFile( szFilename, s_TransferCacheKey ) )
+	{
+		if ( verbose )
+		{
+			Msg( "No usable transfer cache (%s), building transfers\n", szFilename );
+		}
+		return false;
+	}
+
+	// the rest of vrad only looks at the transfer counts
+	total_transfer = 0;
+	max_transfer = 0;
+	int nPatches = g_Patches.Count();
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		CPatch *pPatch = &g_Patches[i];
+		pPatch->numtransfers = g_TransferMatrix.RowTransfers( i );
+		pPatch->transfers = NULL;
+		total_transfer += pPatch->numtransfers;
+		max_transfer = max( max_transfer, pPatch->numtransfers );
+	}
+
+	Msg( "Using cached transfers from %s (%d transfers, %.2f seconds)\n",
+		 szFilename, total_transfer, Plat_FloatTime() - flStart );
+	return true;
+}
+
+void SaveTransferCache()
+{
+	if ( !g_TransferMatrix.IsBuilt() || g_TransferMatrix.IsMapped() )
+		return;
+
+	if ( !s_bTransferCacheKeyValid )
+	{
+		ComputeTransferCacheKey( s_TransferCacheKey );
+		s_bTransferCacheKeyValid = true;
+	}
+
+	char szFilename[MAX_PATH];
+	GetTransferCacheFilename( szFilename, sizeof( szFilename ) );
+	if ( !g_TransferMatrix.WriteFile( szFilename, s_TransferCacheKey ) )
+	{
+		Warning( "Couldn't write transfer cache %s\n", szFilename );
+		return;
+	}
+
+	if ( verbose )
+	{
+		Msg( "Wrote transfer cache %s (%.1f MB)\n", szFilename, g_TransferMatrix.PackedSize() / ( 1024.0f * 1024.0f ) );
+	}
+}
@@ -0,0 +1,24 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Keeps the packed transfer matrix on disk between vrad runs.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef TRANSFERCACHE_H
+#define TRANSFERCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+// Must be called after the patches have been made and before MakeAllScales.
+// If a cache written for the same geometry exists it's mapped into
+// g_TransferMatrix and true is returned; MakeAllScales can then be skipped.
+bool LoadTransferCache();
+
+// Writes g_TransferMatrix out for the next run.
+void SaveTransferCache();
+
+
+#endif // TRANSFERCACHE_H
@@ -0,0 +1,547 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packed patch-to-patch transfer matrix used by the radiosity bounces.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfermatrix.h"
+
+
+CTransferMatrix g_TransferMatrix;
+
+
+//-----------------------------------------------------------------------------
+// Variable length encoding of the patch index deltas: 7 bits per byte, high
+// bit set on all but the last byte. Sorted rows mostly need 1 or 2 bytes.
+//-----------------------------------------------------------------------------
+static inline int VarIntSize( uint32 n )
+{
+	int nBytes = 1;
+	while ( n >= 0x80 )
+	{
+		n >>= 7;
+		nBytes++;
+	}
+	return nBytes;
+}
+
+static inline uint8 *WriteVarInt( uint8 *pOut, uint32 n )
+{
+	while ( n >= 0x80 )
+	{
+		*(pOut++) = (uint8)( n | 0x80 );
+		n >>= 7;
+	}
+	*(pOut++) = (uint8)n;
+	return pOut;
+}
+
+static inline uint8 const *ReadVarInt( uint8 const *pIn, uint32 &n )
+{
+	n = 0;
+	int nShift = 0;
+	uint8 b;
+	do
+	{
+		b = *(pIn++);
+		n |= (uint32)( b & 0x7f ) << nShift;
+		nShift += 7;
+	} while ( b & 0x80 );
+	return pIn;
+}
+
+static int __cdecl CompareTransferPatch( const void *pA, const void *pB )
+{
+	return ( (transfer_t const *)pA )->patch - ( (transfer_t const *)pB )->patch;
+}
+
+static FORCEINLINE fltx4 GatherSIMD( float const *pBase, int const *pIndices )
+{
+	ALIGN16 float flValues[4] ALIGN16_POST;
+	flValues[0] = pBase[pIndices[0]];
+	flValues[1] = pBase[pIndices[1]];
+	flValues[2] = pBase[pIndices[2]];
+	flValues[3] = pBase[pIndices[3]];
+	return LoadAlignedSIMD( flValues );
+}
+
+static FORCEINLINE float SumOfLanes( fltx4 const &v )
+{
+	return SubFloat( v, 0 ) + SubFloat( v, 1 ) + SubFloat( v, 2 ) + SubFloat( v, 3 );
+}
+
+
+//-----------------------------------------------------------------------------
+// On disk layout. Every array starts on a 16 byte boundary so the file can be
+// used in place once mapped.
+//-----------------------------------------------------------------------------
+#define TRANSFERMATRIX_FILE_ID			( ( 'C' << 24 ) + ( 'T' << 16 ) + ( 'R' << 8 ) + 'V' )
+#define TRANSFERMATRIX_FILE_VERSION		1
+
+struct TransferMatrixFileHeader_t
+{
+	int			m_nID;
+	int			m_nVersion;
+	MD5Value_t	m_Key;
+	int			m_nPatches;
+	int			m_nTransfers;
+	int			m_nMaxRowTransfers;
+	int			m_nUnused;
+	uint64		m_nUnpackedSize;
+	uint64		m_nFileSize;
+
+	// offsets from the start of the file
+	uint64		m_nRowTransfersOfs;
+	uint64		m_nRowIndexBytesOfs;
+	uint64		m_nRowScaleOfs;
+	uint64		m_nCoefficientsOfs;
+	uint64		m_nPatchDeltasOfs;
+};
+
+static inline uint64 AlignFileOffset( uint64 nOffset )
+{
+	return ( nOffset + 15 ) & ~(uint64)15;
+}
+
+
+CTransferMatrix::CTransferMatrix()
+{
+	m_pRowTransfers = NULL;
+	m_pRowIndexBytes = NULL;
+	m_pRowScale = NULL;
+	m_pCoefficients = NULL;
+	m_pPatchDeltas = NULL;
+	m_nPatches = 0;
+	m_nTransfers = 0;
+	m_hMapping = NULL;
+	m_pMappedView = NULL;
+	m_nMaxRowTransfers = 0;
+	m_nUnpackedSize = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Build
+//-----------------------------------------------------------------------------
+
+// pass 1: sort the row and work out how many bytes its deltas need
+void CTransferMatrix::MeasureRow( int iThread, int iPatch )
+{
+	CPatch *pPatch = &g_Patches[iPatch];
+	qsort( pPatch->transfers, pPatch->numtransfers, sizeof( transfer_t ), CompareTransferPatch );
+
+	uint32 nBytes = 0;
+	int nPrev = 0;
+	for ( int i = 0; i < pPatch->numtransfers; i++ )
+	{
+		nBytes += VarIntSize( pPatch->transfers[i].patch - nPrev );
+		nPrev = pPatch->transfers[i].patch;
+	}
+	g_TransferMatrix.m_RowIndexBytes[iPatch+1] = nBytes;
+}
+
+// pass 2: write the row out and free the original
+void CTransferMatrix::PackRow( int iThread, int iPatch )
+{
+	CTransferMatrix &m = g_TransferMatrix;
+	CPatch *pPatch = &g_Patches[iPatch];
+	int nTransfers = pPatch->numtransfers;
+	if ( !nTransfers )
+	{
+		m.m_RowScale[iPatch] = 0;
+		return;
+	}
+
+	float flMax = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+		flMax = max( flMax, pPatch->transfers[i].transfer );
+	float flScale = flMax / 65535.0f;
+	float flInvScale = 65535.0f / flMax;
+	m.m_RowScale[iPatch] = flScale;
+
+	uint16 *pCoefficients = m.m_Coefficients.Base() + m.m_RowTransfers[iPatch];
+	uint8 *pDeltas = m.m_PatchDeltas.Base() + m.m_RowIndexBytes[iPatch];
+	int nPrev = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		transfer_t const &t = pPatch->transfers[i];
+		pCoefficients[i] = (uint16)clamp( (int)( t.transfer * flInvScale + 0.5f ), 0, 65535 );
+		pDeltas = WriteVarInt( pDeltas, t.patch - nPrev );
+		nPrev = t.patch;
+	}
+	Assert( pDeltas == m.m_PatchDeltas.Base() + m.m_RowIndexBytes[iPatch+1] );
+
+	free( pPatch->transfers );
+	pPatch->transfers = NULL;
+}
+
+void CTransferMatrix::Build()
+{
+	Purge();
+
+	int nPatches = g_Patches.Count();
+	m_RowTransfers.SetCount( nPatches + 1 );
+	m_RowIndexBytes.SetCount( nPatches + 1 );
+	m_RowScale.SetCount( nPatches );
+
+	m_RowTransfers[0] = 0;
+	m_nMaxRowTransfers = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		int nTransfers = g_Patches[i].numtransfers;
+		m_RowTransfers[i+1] = m_RowTransfers[i] + nTransfers;
+		m_nMaxRowTransfers = max( m_nMaxRowTransfers, nTransfers );
+		m_nUnpackedSize += nTransfers * sizeof( transfer_t );
+	}
+
+	m_RowIndexBytes[0] = 0;
+	RunThreadsOnIndividual( nPatches, false, MeasureRow );
+	for ( int i = 0; i < nPatches; i++ )
+		m_RowIndexBytes[i+1] += m_RowIndexBytes[i];
+
+	m_Coefficients.SetCount( m_RowTransfers[nPatches] );
+	m_PatchDeltas.SetCount( m_RowIndexBytes[nPatches] );
+	RunThreadsOnIndividual( nPatches, false, PackRow );
+
+	m_pRowTransfers = m_RowTransfers.Base();
+	m_pRowIndexBytes = m_RowIndexBytes.Base();
+	m_pRowScale = m_RowScale.Base();
+	m_pCoefficients = m_Coefficients.Base();
+	m_pPatchDeltas = m_PatchDeltas.Base();
+	m_nPatches = nPatches;
+	m_nTransfers = m_RowTransfers[nPatches];
+
+	SetupPatchData();
+}
+
+void CTransferMatrix::SetupPatchData()
+{
+	int nPatches = m_nPatches;
+	m_OriginX.SetCount( nPatches );
+	m_OriginY.SetCount( nPatches );
+	m_OriginZ.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		m_OriginX[i] = g_Patches[i].origin.x;
+		m_OriginY[i] = g_Patches[i].origin.y;
+		m_OriginZ[i] = g_Patches[i].origin.z;
+	}
+
+	// decode buffers are padded out to a multiple of 4
+	for ( int i = 0; i <= MAX_TOOL_THREADS; i++ )
+	{
+		m_DecodedPatches[i].SetCount( m_nMaxRowTransfers + 4 );
+		m_DecodedTransfers[i].SetCount( m_nMaxRowTransfers + 4 );
+	}
+}
+
+void CTransferMatrix::Purge()
+{
+	m_RowTransfers.Purge();
+	m_RowIndexBytes.Purge();
+	m_RowScale.Purge();
+	m_Coefficients.Purge();
+	m_PatchDeltas.Purge();
+	m_EmitR.Purge();
+	m_EmitG.Purge();
+	m_EmitB.Purge();
+	m_OriginX.Purge();
+	m_OriginY.Purge();
+	m_OriginZ.Purge();
+	for ( int i = 0; i <= MAX_TOOL_THREADS; i++ )
+	{
+		m_DecodedPatches[i].Purge();
+		m_DecodedTransfers[i].Purge();
+	}
+	UnmapFile();
+	m_pRowTransfers = NULL;
+	m_pRowIndexBytes = NULL;
+	m_pRowScale = NULL;
+	m_pCoefficients = NULL;
+	m_pPatchDeltas = NULL;
+	m_nPatches = 0;
+	m_nTransfers = 0;
+	m_nMaxRowTransfers = 0;
+	m_nUnpackedSize = 0;
+}
+
+size_t CTransferMatrix::PackedSize() const
+{
+	if ( !IsBuilt() )
+		return 0;
+
+	return ( m_nPatches + 1 ) * sizeof( int ) +
+		( m_nPatches + 1 ) * sizeof( uint32 ) +
+		m_nPatches * sizeof( float ) +
+		m_nTransfers * sizeof( uint16 ) +
+		m_pRowIndexBytes[m_nPatches] * sizeof( uint8 );
+}
+
+
+//-----------------------------------------------------------------------------
+// Cache files
+//-----------------------------------------------------------------------------
+bool CTransferMatrix::WriteFile( char const *pFilename, MD5Value_t const &key ) const
+{
+	if ( !IsBuilt() )
+		return false;
+
+	TransferMatrixFileHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nID = TRANSFERMATRIX_FILE_ID;
+	header.m_nVersion = TRANSFERMATRIX_FILE_VERSION;
+	header.m_Key = key;
+	header.m_nPatches = m_nPatches;
+	header.m_nTransfers = m_nTransfers;
+	header.m_nMaxRowTransfers = m_nMaxRowTransfers;
+	header.m_nUnpackedSize = m_nUnpackedSize;
+
+	uint64 nDeltaBytes = m_pRowIndexBytes[m_nPatches];
+	header.m_nRowTransfersOfs = AlignFileOffset( sizeof( header ) );
+	header.m_nRowIndexBytesOfs = AlignFileOffset( header.m_nRowTransfersOfs + ( m_nPatches + 1 ) * sizeof( int ) );
+	header.m_nRowScaleOfs = AlignFileOffset( header.m_nRowIndexBytesOfs + ( m_nPatches + 1 ) * sizeof( uint32 ) );
+	header.m_nCoefficientsOfs = AlignFileOffset( header.m_nRowScaleOfs + m_nPatches * sizeof( float ) );
+	header.m_nPatchDeltasOfs = AlignFileOffset( header.m_nCoefficientsOfs + (uint64)m_nTransfers * sizeof( uint16 ) );
+	header.m_nFileSize = header.m_nPatchDeltasOfs + nDeltaBytes;
+
+	FILE *fp = fopen( pFilename, "wb" );
+	if ( !fp )
+		return false;
+
+	struct Chunk_t
+	{
+		uint64 m_nOffset;
+		void const *m_pData;
+		uint64 m_nSize;
+	};
+	Chunk_t chunks[] =
+	{
+		{ 0, &header, sizeof( header ) },
+		{ header.m_nRowTransfersOfs, m_pRowTransfers, ( m_nPatches + 1 ) * sizeof( int ) },
+		{ header.m_nRowIndexBytesOfs, m_pRowIndexBytes, ( m_nPatches + 1 ) * sizeof( uint32 ) },
+		{ header.m_nRowScaleOfs, m_pRowScale, m_nPatches * sizeof( float ) },
+		{ header.m_nCoefficientsOfs, m_pCoefficients, (uint64)m_nTransfers * sizeof( uint16 ) },
+		{ header.m_nPatchDeltasOfs, m_pPatchDeltas, nDeltaBytes },
+	};
+
+	static const uint8 s_Padding[16] = { 0 };
+	uint64 nWritten = 0;
+	bool bOk = true;
+	for ( int i = 0; bOk && i < ARRAYSIZE( chunks ); i++ )
+	{
+		Assert( chunks[i].m_nOffset >= nWritten && chunks[i].m_nOffset - nWritten < 16 );
+		size_t nPad = (size_t)( chunks[i].m_nOffset - nWritten );
+		bOk = ( fwrite( s_Padding, 1, nPad, fp ) == nPad ) &&
+			( fwrite( chunks[i].m_pData, 1, (size_t)chunks[i].m_nSize, fp ) == chunks[i].m_nSize );
+		nWritten = chunks[i].m_nOffset + chunks[i].m_nSize;
+	}
+
+	fclose( fp );
+	if ( !bOk )
+	{
+		// don't leave a truncated file behind for the next run to trip over
+		remove( pFilename );
+	}
+	return bOk;
+}
+
+bool CTransferMatrix::MapFile( char const *pFilename, MD5Value_t const &key )
+{
+	Purge();
+
+	HANDLE hFile = CreateFile( pFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx( hFile, &fileSize ) || (uint64)fileSize.QuadPart < sizeof( TransferMatrixFileHeader_t ) )
+	{
+		CloseHandle( hFile );
+		return false;
+	}
+
+	HANDLE hMapping = CreateFileMapping( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	CloseHandle( hFile );
+	if ( !hMapping )
+		return false;
+
+	void *pView = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( !pView )
+	{
+		CloseHandle( hMapping );
+		return false;
+	}
+	m_hMapping = hMapping;
+	m_pMappedView = pView;
+
+	TransferMatrixFileHeader_t const *pHeader = (TransferMatrixFileHeader_t const *)pView;
+	if ( pHeader->m_nID != TRANSFERMATRIX_FILE_ID ||
+		 pHeader->m_nVersion != TRANSFERMATRIX_FILE_VERSION ||
+		 pHeader->m_Key != key ||
+		 pHeader->m_nPatches != g_Patches.Count() ||
+		 pHeader->m_nFileSize != (uint64)fileSize.QuadPart )
+	{
+		UnmapFile();
+		return false;
+	}
+
+	uint8 const *pBase = (uint8 const *)pView;
+	m_pRowTransfers = (int const *)( pBase + pHeader->m_nRowTransfersOfs );
+	m_pRowIndexBytes = (uint32 const *)( pBase + pHeader->m_nRowIndexBytesOfs );
+	m_pRowScale = (float const *)( pBase + pHeader->m_nRowScaleOfs );
+	m_pCoefficients = (uint16 const *)( pBase + pHeader->m_nCoefficientsOfs );
+	m_pPatchDeltas = pBase + pHeader->m_nPatchDeltasOfs;
+	m_nPatches = pHeader->m_nPatches;
+	m_nTransfers = pHeader->m_nTransfers;
+	m_nMaxRowTransfers = pHeader->m_nMaxRowTransfers;
+	m_nUnpackedSize = (size_t)pHeader->m_nUnpackedSize;
+
+	if ( m_pRowTransfers[m_nPatches] != m_nTransfers ||
+		 pHeader->m_nPatchDeltasOfs + m_pRowIndexBytes[m_nPatches] != pHeader->m_nFileSize )
+	{
+		Purge();
+		return false;
+	}
+
+	SetupPatchData();
+	return true;
+}
+
+void CTransferMatrix::UnmapFile()
+{
+	if ( m_pMappedView )
+	{
+		UnmapViewOfFile( m_pMappedView );
+		m_pMappedView = NULL;
+	}
+	if ( m_hMapping )
+	{
+		CloseHandle( (HANDLE)m_hMapping );
+		m_hMapping = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Bounces
+//-----------------------------------------------------------------------------
+void CTransferMatrix::SetEmitLight( CUtlVector<Vector> const &emitlight )
+{
+	int nPatches = g_Patches.Count();
+	m_EmitR.SetCount( nPatches );
+	m_EmitG.SetCount( nPatches );
+	m_EmitB.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		Vector const &reflectivity = g_Patches[i].reflectivity;
+		m_EmitR[i] = emitlight[i].x * reflectivity.x;
+		m_EmitG[i] = emitlight[i].y * reflectivity.y;
+		m_EmitB[i] = emitlight[i].z * reflectivity.z;
+	}
+}
+
+int CTransferMatrix::DecodeRow( int iPatch, int *pPatches, float *pTransfers ) const
+{
+	int nFirst = m_pRowTransfers[iPatch];
+	int nTransfers = m_pRowTransfers[iPatch+1] - nFirst;
+	uint16 const *pCoefficients = m_pCoefficients + nFirst;
+	uint8 const *pDeltas = m_pPatchDeltas + m_pRowIndexBytes[iPatch];
+	float flScale = m_pRowScale[iPatch];
+
+	uint32 nPatch = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		uint32 nDelta;
+		pDeltas = ReadVarInt( pDeltas, nDelta );
+		nPatch += nDelta;
+		pPatches[i] = nPatch;
+		pTransfers[i] = pCoefficients[i] * flScale;
+	}
+	return nTransfers;
+}
+
+// decodes into the thread's buffers and pads them out to a multiple of 4 with
+// zero transfers from the first patch, so the SIMD loops don't need a tail.
+int CTransferMatrix::DecodeRowForThread( int iThread, int iPatch )
+{
+	int *pPatches = m_DecodedPatches[iThread].Base();
+	float *pTransfers = m_DecodedTransfers[iThread].Base();
+	int nTransfers = DecodeRow( iPatch, pPatches, pTransfers );
+	if ( !nTransfers )
+		return 0;
+	int nPadded = ( nTransfers + 3 ) & ~3;
+	for ( int i = nTransfers; i < nPadded; i++ )
+	{
+		pPatches[i] = pPatches[0];
+		pTransfers[i] = 0;
+	}
+	return nPadded;
+}
+
+void CTransferMatrix::GatherLight( int iThread, int iPatch, Vector &sum )
+{
+	int nTransfers = DecodeRowForThread( iThread, iPatch );
+	int const *pPatches = m_DecodedPatches[iThread].Base();
+	float const *pTransfers = m_DecodedTransfers[iThread].Base();
+
+	fltx4 sumR = Four_Zeros;
+	fltx4 sumG = Four_Zeros;
+	fltx4 sumB = Four_Zeros;
+	for ( int k = 0; k < nTransfers; k += 4 )
+	{
+		fltx4 transfer = LoadUnalignedSIMD( pTransfers + k );
+		sumR = MaddSIMD( transfer, GatherSIMD( m_EmitR.Base(), pPatches + k ), sumR );
+		sumG = MaddSIMD( transfer, GatherSIMD( m_EmitG.Base(), pPatches + k ), sumG );
+		sumB = MaddSIMD( transfer, GatherSIMD( m_EmitB.Base(), pPatches + k ), sumB );
+	}
+	sum.Init( SumOfLanes( sumR ), SumOfLanes( sumG ), SumOfLanes( sumB ) );
+}
+
+void CTransferMatrix::GatherBumpedLight( int iThread, int iPatch, Vector const *pNormals, Vector *pBumpSums )
+{
+	CPatch const &patch = g_Patches[iPatch];
+	int nTransfers = DecodeRowForThread( iThread, iPatch );
+	int const *pPatches = m_DecodedPatches[iThread].Base();
+	float const *pTransfers = m_DecodedTransfers[iThread].Base();
+
+	FourVectors origin;
+	origin.DuplicateVector( patch.origin );
+
+	FourVectors bumpSums[NUM_BUMP_VECTS+1];
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		bumpSums[i].DuplicateVector( vec3_origin );
+
+	for ( int k = 0; k < nTransfers; k += 4 )
+	{
+		// get vector to other patch
+		FourVectors delta;
+		delta.x = SubSIMD( GatherSIMD( m_OriginX.Base(), pPatches + k ), origin.x );
+		delta.y = SubSIMD( GatherSIMD( m_OriginY.Base(), pPatches + k ), origin.y );
+		delta.z = SubSIMD( GatherSIMD( m_OriginZ.Base(), pPatches + k ), origin.z );
+		delta.VectorNormalize();
+
+		// remove normal already factored into transfer steradian
+		fltx4 scale = DivSIMD( LoadUnalignedSIMD( pTransfers + k ), delta * patch.normal );
+
+		FourVectors v;
+		v.x = MulSIMD( GatherSIMD( m_EmitR.Base(), pPatches + k ), scale );
+		v.y = MulSIMD( GatherSIMD( m_EmitG.Base(), pPatches + k ), scale );
+		v.z = MulSIMD( GatherSIMD( m_EmitB.Base(), pPatches + k ), scale );
+
+		// transfers facing away from a bump normal don't contribute to it
+		for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		{
+			fltx4 dot = MaxSIMD( delta * pNormals[i], Four_Zeros );
+			bumpSums[i].x = MaddSIMD( v.x, dot, bumpSums[i].x );
+			bumpSums[i].y = MaddSIMD( v.y, dot, bumpSums[i].y );
+			bumpSums[i].z = MaddSIMD( v.z, dot, bumpSums[i].z );
+		}
+	}
+
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		pBumpSums[i].Init( SumOfLanes( bumpSums[i].x ), SumOfLanes( bumpSums[i].y ), SumOfLanes( bumpSums[i].z ) );
+	}
+}
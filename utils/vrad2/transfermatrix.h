@@ -0,0 +1,109 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packed patch-to-patch transfer matrix used by the radiosity bounces.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef TRANSFERMATRIX_H
+#define TRANSFERMATRIX_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "mathlib/vector.h"
+#include "threads.h"
+#include "tier1/checksum_md5.h"
+
+
+//-----------------------------------------------------------------------------
+// The transfers of all patches in compressed sparse row form. Each row is the
+// list of patches a receiving patch gathers from:
+//
+//   - patch indices are sorted and stored as variable length deltas
+//   - coefficients are 16 bit fractions of the row's largest transfer
+//
+// Everything a bounce needs to know about an emitting patch (emitlight times
+// reflectivity, origin) is kept in dense arrays indexed by patch, so the
+// gather loop never touches CPatch for the emitters.
+//
+// The packed rows can be written to disk and mapped straight back in by a
+// later run, see transfercache.cpp.
+//-----------------------------------------------------------------------------
+class CTransferMatrix
+{
+public:
+	CTransferMatrix();
+
+	// Packs g_Patches[].transfers and frees them.
+	void Build();
+	void Purge();
+	bool IsBuilt() const { return m_pRowTransfers != NULL; }
+
+	// Writes the packed rows out, or maps them back in from a file written for
+	// the same key. MapFile fails if the file is missing, stale or doesn't match
+	// the current patch count.
+	bool WriteFile( char const *pFilename, MD5Value_t const &key ) const;
+	bool MapFile( char const *pFilename, MD5Value_t const &key );
+	bool IsMapped() const { return m_pMappedView != NULL; }
+
+	// Call before each bounce. Caches emitlight * reflectivity for every patch.
+	void SetEmitLight( CUtlVector<Vector> const &emitlight );
+
+	// Gather the light arriving at a patch through its transfers.
+	void GatherLight( int iThread, int iPatch, Vector &sum );
+	void GatherBumpedLight( int iThread, int iPatch, Vector const *pNormals, Vector *pBumpSums );
+
+	// Unpacks a row. Returns the number of transfers.
+	int DecodeRow( int iPatch, int *pPatches, float *pTransfers ) const;
+
+	int NumTransfers() const { return m_nTransfers; }
+	int MaxRowTransfers() const { return m_nMaxRowTransfers; }
+	int RowTransfers( int iPatch ) const { return m_pRowTransfers[iPatch+1] - m_pRowTransfers[iPatch]; }
+	size_t PackedSize() const;								// bytes used by the packed rows
+	size_t UnpackedSize() const { return m_nUnpackedSize; }	// bytes the transfer_t lists used
+
+private:
+	int DecodeRowForThread( int iThread, int iPatch );
+
+	static void MeasureRow( int iThread, int iPatch );
+	static void PackRow( int iThread, int iPatch );
+
+	void SetupPatchData();
+	void UnmapFile();
+
+	CUtlVector<int>			m_RowTransfers;				// first transfer of each row, numpatches+1 entries
+	CUtlVector<uint32>		m_RowIndexBytes;			// first byte of each row in m_PatchDeltas
+	CUtlVector<float>		m_RowScale;					// transfer = coefficient * scale
+	CUtlVector<uint16>		m_Coefficients;
+	CUtlVector<uint8>		m_PatchDeltas;
+
+	// the rows in use, pointing either at the vectors above or into a mapped file
+	int const				*m_pRowTransfers;
+	uint32 const			*m_pRowIndexBytes;
+	float const				*m_pRowScale;
+	uint16 const			*m_pCoefficients;
+	uint8 const				*m_pPatchDeltas;
+	int						m_nPatches;
+	int						m_nTransfers;
+
+	void					*m_hMapping;
+	void					*m_pMappedView;
+
+	// per patch, SoA
+	CUtlVector<float>		m_EmitR, m_EmitG, m_EmitB;
+	CUtlVector<float>		m_OriginX, m_OriginY, m_OriginZ;
+
+	// per thread decode buffers
+	CUtlVector<int>			m_DecodedPatches[MAX_TOOL_THREADS+1];
+	CUtlVector<float>		m_DecodedTransfers[MAX_TOOL_THREADS+1];
+	int						m_nMaxRowTransfers;
+
+	size_t					m_nUnpackedSize;
+};
+
+extern CTransferMatrix g_TransferMatrix;
+
+
+#endif // TRANSFERMATRIX_H
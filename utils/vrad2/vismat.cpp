@@ -8,6 +8,7 @@
 
 #include "vrad.h"
 #include "vmpi.h"
+#include "pvscache.h"
 #ifdef MPI
 #include "messbuf.h"
 static MessageBuffer mb;
@@ -129,29 +130,21 @@ int ClusterFromPoint( Vector const& point )
 
 void PvsForOrigin (Vector& org, byte *pvs)
 {
-	int visofs;
-	int cluster;
-
 	if (!visdatasize)
 	{
 		memset (pvs, 255, (dvis->numclusters+7)/8 );
 		return;
 	}
 
-	cluster = ClusterFromPoint( org );
+	int cluster = ClusterFromPoint( org );
 	if ( cluster < 0 )
-	{
-		visofs = -1;
-	}
-	else
-	{
-		visofs = dvis->bitofs[ cluster ][DVIS_PVS];
-	}
-
-	if (visofs == -1)
 		Error ("visofs == -1");
 
-	DecompressVis (&dvisdata[visofs], pvs);
+	byte const *pCached = GetClusterPVS( cluster, pvs );
+	if ( pCached != pvs )
+	{
+		memcpy( pvs, pCached, (dvis->numclusters+7)/8 );
+	}
 }
 
 
@@ -303,7 +296,7 @@ BuildVisRow
 Calc vis bits from a single patch
 ==============
 */
-void BuildVisRow (int patchnum, byte *pvs, int head, transfer_t *transfers, CTransferMaker &transferMaker, int iThread )
+void BuildVisRow (int patchnum, byte const *pvs, int head, transfer_t *transfers, CTransferMaker &transferMaker, int iThread )
 {
 	int		j, k, l, leafIndex;
 	CPatch	*patch;
@@ -316,13 +309,9 @@ void BuildVisRow (int patchnum, byte *pvs, int head, transfer_t *transfers, CTra
 	memset( face_tested, 0, numfaces ) ;
 	memset( disp_tested, 0, numfaces );
 
-	for (j=0; j<dvis->numclusters; j++)
+	// only visit the clusters in the pvs
+	for (j=NextVisibleCluster( pvs, 0 ); j<dvis->numclusters; j=NextVisibleCluster( pvs, j+1 ))
 	{
-		if ( ! ( pvs[(j)>>3] & (1<<((j)&7)) ) )
-		{
-			continue;		// not in pvs
-		}
-
 		for ( leafIndex = 0; leafIndex < g_ClusterLeaves[j].leafCount; leafIndex++ )
 		{
 			leaf = dleafs + g_ClusterLeaves[j].leafs[leafIndex];
@@ -390,12 +379,12 @@ void BuildVisLeafs_Cluster(
 	void (*PatchCB)(int iThread, int patchnum, CPatch *patch)
 	)
 {
-	byte	pvs[(MAX_MAP_CLUSTERS+7)/8];
+	byte	pvsScratch[(MAX_MAP_CLUSTERS+7)/8];
 	CPatch	*patch;
 	int		head;
 	unsigned	patchnum;
 	
-	DecompressVis( &dvisdata[ dvis->bitofs[ iCluster ][DVIS_PVS] ], pvs);
+	byte const *pvs = GetClusterPVS( iCluster, pvsScratch );
 	head = 0;
 
 	CTransferMaker transferMaker( transfers );
@@ -449,7 +438,7 @@ void BuildVisLeafs( int threadnum, void *pUserData )
 		// covers areas relevent to the PVS
 		//
 		// JAY: Now this returns a cluster index
-		int iCluster = GetThreadWork();
+		int iCluster = GetThreadWork( threadnum );
 		if ( iCluster == -1 )
 			break;
 
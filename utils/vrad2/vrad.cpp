@@ -16,6 +16,10 @@
 #include "macro_texture.h"
 #include "vmpi_tools_shared.h"
 #include "leaf_ambient_lighting.h"
+#include "transfermatrix.h"
+#include "transfercache.h"
+#include "pvscache.h"
+#include "raytrace_bench.h"
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
@@ -57,6 +61,15 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bBenchmarkThreads = false;
+bool		g_bBenchmarkTrace = false;
+bool		g_bBenchmarkSampleHash = false;
+bool		g_bUnpackedTransfers = false;
+bool		g_bNoTransferCache = false;
+
+// bounce statistics, reported at the end of the run
+float		g_flGatherLightTime = 0;
+int			g_nGatherLightBounces = 0;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -99,6 +112,10 @@ float		indirect_sun = 1.0;
 float		reflectivityScale = 1.0;
 qboolean	do_extra = true;
 bool		debug_extra = false;
+bool		g_bAdaptiveSupersample = true;
+float		g_flSupersampleError = 0.01f;		// "-supersampleerror" target standard error of a luxel, in the gradient's units
+float		g_flSupersampleBudget = 0.0f;		// "-supersamplebudget" millions of rays, 0 for no limit
+bool		g_bFinalLightBatch = true;			// light small faces several to a work item in FinalLightFace
 qboolean	do_fast = false;
 qboolean	do_centersamples = false;
 int			extrapasses = 4;
@@ -782,7 +799,6 @@ int CreateChildPatch( int nParentIndex, winding_t *pWinding, float flArea, const
 	child->child1 = g_Patches.InvalidIndex();
 	child->child2 = g_Patches.InvalidIndex();
 	child->parent = nParentIndex;
-	child->m_IterationKey = 0;
 
 	child->winding = pWinding;
 	child->area = flArea;
@@ -1516,7 +1532,7 @@ void GatherLight (int threadnum, void *pUserData)
 
 	while (1)
 	{
-		j = GetThreadWork ();
+		j = GetThreadWork (threadnum);
 		if (j == -1)
 			break;
 
@@ -1557,6 +1573,12 @@ void GatherLight (int threadnum, void *pUserData)
 			// FIXME: why does the patch not use the phong normal?
 			normals[0] = patch->normal;
 
+			if ( g_TransferMatrix.IsBuilt() )
+			{
+				g_TransferMatrix.GatherBumpedLight( threadnum, j, normals, addlight[j].light );
+				continue;
+			}
+
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 			{
 				VectorFill( bumpSum[i], 0 );
@@ -1597,6 +1619,10 @@ void GatherLight (int threadnum, void *pUserData)
 				VectorCopy( bumpSum[i], addlight[j].light[i] );
 			}
 		}
+		else if ( g_TransferMatrix.IsBuilt() )
+		{
+			g_TransferMatrix.GatherLight( threadnum, j, addlight[j].light[0] );
+		}
 		else
 		{
 			VectorFill( sum, 0 );
@@ -1618,6 +1644,18 @@ void GatherLight (int threadnum, void *pUserData)
 #pragma warning (pop)
 #endif
 
+static float GatherLightCost( int iPatch )
+{
+	return g_Patches[iPatch].numtransfers;
+}
+
+// cost hint for the per-face passes - larger lightmaps take longer
+static float FaceLightingCost( int iFace )
+{
+	dface_t *f = &g_pFaces[iFace];
+	return ( f->m_LightmapTextureSizeInLuxels[0] + 1 ) * ( f->m_LightmapTextureSizeInLuxels[1] + 1 );
+}
+
 
 /*
 =============
@@ -1643,9 +1681,17 @@ void BounceLight (void)
 	unsigned i = 0U;
 	while ( bouncing )
 	{
+		float flBounceStart = Plat_FloatTime();
+		if ( g_TransferMatrix.IsBuilt() )
+		{
+			g_TransferMatrix.SetEmitLight( emitlight );
+		}
+
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
-		RunThreadsOn (uiPatchCount, true, GatherLight);
+		RunThreadsOnSorted (uiPatchCount, true, GatherLight, GatherLightCost);
+		g_flGatherLightTime += Plat_FloatTime() - flBounceStart;
+		g_nGatherLightBounces++;
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
@@ -1773,29 +1819,12 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 	// First merge all the light PVSes.
 	CUtlVector<byte> aggregate;
-	aggregate.SetSize( (dvis->numclusters/8) + 1 );
+	aggregate.SetSize( PVSRowBytes() );
 	memset( aggregate.Base(), 0, aggregate.Count() );
 
-	int nDWords = aggregate.Count() / 4;
-	int nBytes = aggregate.Count() - nDWords*4;
-
 	for( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
 	{
-		byte *pIn  = dl->pvs;
-		byte *pOut = aggregate.Base();
-		for( int iDWord=0; iDWord < nDWords; iDWord++ )
-		{
-			*((unsigned long*)pOut) |= *((unsigned long*)pIn);
-			pIn  += 4;
-			pOut += 4;
-		}
-
-		for( int iByte=0; iByte < nBytes; iByte++ )
-		{
-			*pOut |= *pIn;
-			++pOut;
-			++pIn;
-		}
+		PVSMerge( aggregate.Base(), dl->pvs );
 	}
 
 
@@ -1951,7 +1980,8 @@ bool RadWorld_Go()
 	}
 	else
 	{
-		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
+		RunThreadsOnIndividualSorted (numfaces, true, BuildFacelights, FaceLightingCost);
+		SupersampleAllFacelights();
 	}
 
 	// Was the process interrupted?
@@ -1989,7 +2019,21 @@ bool RadWorld_Go()
 			addlight.SetSize( g_Patches.Size() );
 			memset( addlight.Base(), 0, g_Patches.Size() * sizeof( bumplights_t ) );
 
-			MakeAllScales ();
+			// reuse the transfers from the last run if the geometry hasn't changed
+			bool bUseTransferCache = !g_bUnpackedTransfers && !g_bNoTransferCache && !g_bUseMPI;
+			if ( !bUseTransferCache || !LoadTransferCache() )
+			{
+				MakeAllScales ();
+
+				if ( !g_bUnpackedTransfers )
+				{
+					g_TransferMatrix.Build();
+					if ( bUseTransferCache )
+					{
+						SaveTransferCache();
+					}
+				}
+			}
 
 			// spread light around
 			BounceLight ();
@@ -2003,10 +2047,15 @@ bool RadWorld_Go()
 		StaticDispMgr()->InsertPatchSampleDataIntoHashTable();
 		StaticDispMgr()->EndTimer();
 
+		if ( g_bBenchmarkSampleHash )
+		{
+			RunSampleHashBenchmark();
+		}
+
 		// blend bounced light into direct light and save
 		VMPI_SetCurrentStage( "FinalLightFace" );
 		if ( !g_bUseMPI || g_bMPIMaster )
-			RunThreadsOnIndividual (numfaces, true, FinalLightFace);
+			FinalLightAllFaces();
 
 		// Distribute the lighting data to workers.
 		VMPI_DistributeLightData();
@@ -2162,6 +2211,8 @@ void VRAD_LoadBSP( char const *pFilename )
 		dvis->numclusters = CountClusters();
 	}
 
+	InitPVSCache();
+
 	//
 	// patches and referencing data (ensure capacity)
 	//
@@ -2196,10 +2247,29 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	// Build acceleration structure
 	Msg( "Setting up ray-trace acceleration structure... " );
-	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
-	float end = Plat_FloatTime();
-	Msg( "Done (%.2f seconds)\n", end - start );
+	KDTreeBuildStats_t kdStats;
+	g_RtEnv.SetupAccelerationStructure( numthreads, &kdStats );
+	Msg( "Done (%.2f seconds)\n", kdStats.m_flBuildTime );
+	if ( verbose )
+	{
+		Msg( "  kd-tree: %d triangles, %d threads, %d subtree tasks\n",
+			 kdStats.m_nTriangles, kdStats.m_nThreads, kdStats.m_nSubtreeTasks );
+		Msg( "  kd-tree: %d nodes, %d leaves (%d empty), max depth %d\n",
+			 kdStats.m_nNodes, kdStats.m_nLeaves, kdStats.m_nEmptyLeaves, kdStats.m_nMaxDepth );
+		Msg( "  kd-tree: %.2f tris/leaf (max %d), %.2f refs/tri, SAH cost %.1f\n",
+			 kdStats.m_nLeaves ? (float)kdStats.m_nTriangleReferences / kdStats.m_nLeaves : 0.0f,
+			 kdStats.m_nMaxLeafTriangles,
+			 kdStats.m_nTriangles ? (float)kdStats.m_nTriangleReferences / kdStats.m_nTriangles : 0.0f,
+			 kdStats.m_flSAHCost );
+	}
+
+	if ( g_bBenchmarkTrace )
+	{
+		RayTraceBenchmarkParams_t benchParams;
+		benchParams.m_nMaxThreads = numthreads;
+		RunRayTraceBenchmark( g_RtEnv, benchParams );
+		return;
+	}
 
 #if 0  // To test only k-d build
 	exit(0);
@@ -2235,8 +2305,6 @@ void VRAD_ComputeOtherLighting()
 	}
 }
 
-extern void CloseDispLuxels();
-
 void VRAD_Finish()
 {
 	Msg( "Ready to Finish\n" );
@@ -2245,6 +2313,26 @@ void VRAD_Finish()
 	if ( verbose )
 	{
 		PrintBSPFileSizes();
+		PrintPVSCacheStats();
+	}
+
+	if ( g_nGatherLightBounces )
+	{
+		if ( g_TransferMatrix.IsBuilt() )
+		{
+			Msg( "Transfers: %d, %.1f MB unpacked, %.1f MB packed (%.1f%%)\n",
+				 g_TransferMatrix.NumTransfers(),
+				 g_TransferMatrix.UnpackedSize() / ( 1024.0f * 1024.0f ),
+				 g_TransferMatrix.PackedSize() / ( 1024.0f * 1024.0f ),
+				 g_TransferMatrix.UnpackedSize() ? 100.0f * g_TransferMatrix.PackedSize() / g_TransferMatrix.UnpackedSize() : 0.0f );
+		}
+		else
+		{
+			Msg( "Transfers: %d, %.1f MB unpacked\n", total_transfer, total_transfer * sizeof( transfer_t ) / ( 1024.0f * 1024.0f ) );
+		}
+		Msg( "Bounce time: %.2f seconds for %d bounces (%.3f per bounce, %s transfers)\n",
+			 g_flGatherLightTime, g_nGatherLightBounces, g_flGatherLightTime / g_nGatherLightBounces,
+			 g_TransferMatrix.IsBuilt() ? "packed" : "unpacked" );
 	}
 
 	Msg( "Writing %s\n", source );
@@ -2262,8 +2350,6 @@ void VRAD_Finish()
 		}
 	}
 
-	CloseDispLuxels();
-
 	StaticPropMgr()->Shutdown();
 
 	double end = Plat_FloatTime();
@@ -2349,6 +2435,38 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			bDumpNormals = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-unpackedtransfers" ) )
+		{
+			g_bUnpackedTransfers = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-notransfercache" ) )
+		{
+			g_bNoTransferCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-pvscachemb" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nPVSCacheBudgetMB = max( Q_atoi( argv[i] ), 0 );
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-pvscachemb'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-benchthreads" ) )
+		{
+			g_bBenchmarkThreads = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-benchtrace" ) )
+		{
+			g_bBenchmarkTrace = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-benchsamplehash" ) )
+		{
+			g_bBenchmarkSampleHash = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-dumptrace" ) )
 		{
 			g_bDumpRtEnv = true;
@@ -2420,6 +2538,38 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			debug_extra = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-noadaptive" ) )
+		{
+			g_bAdaptiveSupersample = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-nofinalbatch" ) )
+		{
+			g_bFinalLightBatch = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-supersampleerror" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_flSupersampleError = max( Q_atof( argv[i] ), 0.0f );
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-supersampleerror'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-supersamplebudget" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_flSupersampleBudget = max( Q_atof( argv[i] ), 0.0f );
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-supersamplebudget'\n" );
+				return -1;
+			}
+		}
 		else if ( !Q_stricmp(argv[i], "-fastambient") )
 		{
 			g_bFastAmbient = true;
@@ -2753,6 +2903,13 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -benchthreads   : Benchmark the thread work dispatchers and exit.\n"
+		"  -benchtrace     : Benchmark the ray tracer on the map's geometry and exit.\n"
+		"  -benchsamplehash : Time neighbourhood queries on the sample and patch hashes\n"
+		"                    before FinalLightFace.\n"
+		"  -unpackedtransfers : Bounce light with the unpacked transfer lists (for comparison).\n"
+		"  -notransfercache : Don't read or write the <mapname>.vtc transfer cache.\n"
+		"  -pvscachemb #   : Memory budget for decompressed PVS rows (default 256).\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
@@ -2760,6 +2917,14 @@ void PrintUsage( int argc, char **argv )
 		"  -noextra        : Disable supersampling.\n"
 		"  -debugextra     : Places debugging data in lightmaps to visualize\n"
 		"                    supersampling.\n"
+		"  -noadaptive     : Supersample with a fixed 4x4 grid instead of sampling each\n"
+		"                    luxel until its error is small enough.\n"
+		"  -supersampleerror # : Target error of an adaptively supersampled luxel\n"
+		"                    (default 0.01).\n"
+		"  -supersamplebudget # : Millions of rays adaptive supersampling may spend,\n"
+		"                    split between faces by their error (default: no limit).\n"
+		"  -nofinalbatch   : Hand out every face as its own work item in FinalLightFace\n"
+		"                    instead of batching small faces together.\n"
 		"  -smooth #       : Set the threshold for smoothing groups, in degrees\n"
 		"                    (default 45).\n"
 		"  -dlightmap      : Force direct lighting into different lightmap than\n"
@@ -2841,6 +3006,14 @@ int RunVRAD( int argc, char **argv )
 
 	bool onlydetail;
 	int i = ParseCommandLine( argc, argv, &onlydetail );
+	if ( g_bBenchmarkThreads )
+	{
+		RunThreadWorkBenchmark();
+		DeleteCmdLine( argc, argv );
+		CmdLib_Cleanup();
+		return 0;
+	}
+
 	if (i == -1)
 	{
 		PrintUsage( argc, argv );
@@ -2852,6 +3025,12 @@ int RunVRAD( int argc, char **argv )
 	CmdLib_InitFileSystem( argv[ i ] );
 
 	VRAD_LoadBSP( argv[i] );
+	if ( g_bBenchmarkTrace )
+	{
+		DeleteCmdLine( argc, argv );
+		CmdLib_Cleanup();
+		return 0;
+	}
 
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
 	{
@@ -30,6 +30,7 @@
 #include "utlvector.h"
 #include "iincremental.h"
 #include "raytrace.h"
+#include "samplehash.h"
 
 
 #ifdef _WIN32
@@ -197,9 +198,6 @@ struct CPatch
 
 	dplane_t	*plane;				// plane (corrected for facing)
 	
-	unsigned short		m_IterationKey;	// Used to prevent touching the same patch multiple times in the same query.
-										// See IncrementPatchIterationKey().
-	
 	// these are packed into one dword
 	unsigned int normalMajorAxis : 2;	// the major axis of base face normal
 	unsigned int sky : 1;
@@ -334,6 +332,10 @@ extern  float maxlight;
 extern	unsigned numbounce;
 extern  qboolean g_bLogHashData;
 extern  bool	debug_extra;
+extern  bool	g_bAdaptiveSupersample;
+extern  float	g_flSupersampleError;
+extern  float	g_flSupersampleBudget;
+extern  bool	g_bFinalLightBatch;
 extern	directlight_t	*activelights;
 extern	directlight_t	*freelights;
 
@@ -369,8 +371,10 @@ qboolean IsIncremental(char *filename);
 int SaveIncremental(char *filename);
 int PartialHead (void);
 void BuildFacelights (int facenum, int threadnum);
+void SupersampleAllFacelights();
 void PrecompLightmapOffsets();
 void FinalLightFace (int threadnum, int facenum);
+void FinalLightAllFaces();
 void PvsForOrigin (Vector& org, byte *pvs);
 void ConvertRGBExp32ToRGBA8888( const ColorRGBExp32 *pSrc, unsigned char *pDst, Vector* _optOutLinear = NULL );
 void ConvertRGBExp32ToLinear(const ColorRGBExp32 *pSrc, Vector* pDst);
@@ -400,6 +404,15 @@ void TestLine_IgnoreSky( FourVectors const& start, FourVectors const& stop, fltx
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+// same as TestLine_DoesHitSky for nGroups groups of 4 rays, traced as packets. Much faster when
+// the rays are coherent, like the samples of an area sun.
+void TestLinePacket_DoesHitSky( FourVectors const *pStarts, FourVectors const *pStops, int nGroups,
+                                fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1 );
+
+// number of rays the calling thread has traced through the TestLine functions. Wraps around, so
+// only the difference between two calls is meaningful.
+uint32 ThreadRaysTraced();
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
@@ -558,32 +571,6 @@ inline bool ValidDispFace( dface_t *pFace )
 	return true;
 }
 
-#define SAMPLEHASH_VOXEL_SIZE			64.0f
-typedef unsigned int SampleHandle_t;				// the upper 16 bits = facelight index (works because max face are 65536)
-													// the lower 16 bits = sample index inside of facelight
-struct sample_t;
-struct SampleData_t
-{
-	unsigned short				x, y, z;
-	CUtlVector<SampleHandle_t>	m_Samples;
-};
-
-struct PatchSampleData_t
-{
-	unsigned short				x, y, z;
-	CUtlVector<int>				m_ndxPatches;
-};
-
-UtlHashHandle_t SampleData_AddSample( sample_t *pSample, SampleHandle_t sampleHandle );
-void PatchSampleData_AddSample( CPatch *pPatch, int ndxPatch );
-unsigned short IncrementPatchIterationKey();
-void SampleData_Log( void );
-
-extern CUtlHash<SampleData_t>		g_SampleHashTable;
-extern CUtlHash<PatchSampleData_t>	g_PatchSampleHashTable;
-
-extern int samplesAdded;
-extern int patchSamplesAdded;
 
 //-----------------------------------------------------------------------------
 // Computes lighting for the detail props
@@ -883,9 +883,6 @@ bool CVRADDispColl::InitParentPatch( int iPatch, Vector *pPoints, float &flArea
 	texinfo_t *pTexInfo = &texinfo[pFace->texinfo];
 	pPatch->needsBumpmap = pTexInfo->flags & SURF_BUMPLIGHT ? true : false;
 
-	// Misc...
-	pPatch->m_IterationKey = 0;
-
 	// Calculate the base light, area, and reflectivity.
 	BaseLightForFace( &g_pFaces[pPatch->faceNumber], pPatch->baselight, &pPatch->basearea, pPatch->reflectivity );
 
@@ -1041,9 +1038,6 @@ bool CVRADDispColl::InitPatch( int iPatch, int iParentPatch, int iChild, Vector
 	texinfo_t *pTexInfo = &texinfo[pFace->texinfo];
 	pPatch->needsBumpmap = pTexInfo->flags & SURF_BUMPLIGHT ? true : false;
 
-	// Misc...
-	pPatch->m_IterationKey = 0;
-
 	// Get the base light for the face.
 	if ( !pParentPatch )
 	{
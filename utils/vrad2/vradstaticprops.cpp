@@ -1790,7 +1790,7 @@ void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUs
 {
 	while (1)
 	{
-		int j = GetThreadWork ();
+		int j = GetThreadWork ( iThread );
 		if (j == -1)
 			break;
 		CComputeStaticPropLightingResults results;